@@ -2,6 +2,11 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <alloca.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#endif
 
 #ifdef APPLE
 #include <OpenCL/cl.h>
@@ -9,6 +14,8 @@
 #include <CL/cl.h>
 #endif
 
+#include "program_cache.h"
+
 void loadProgramSource(const char** files,
                        size_t length,
                        char** buffer,
@@ -30,18 +37,80 @@ void loadProgramSource(const char** files,
 	   }
 }
 
+/*
+ Offline compiler: builds the given .cl files (simple.cl and simple_2.cl by
+ default) as one program for every OpenCL device found and stores the
+ binaries in the program cache (see program_cache.h), so that the samples
+ and VexCL start without compiling from source.
+
+ Usage: BuildOpenCLProgram [--cache dir] [--options "build options"] [file.cl ...]
+
+ The cache directory defaults to $VEXCL_CACHE_DIR and is created if needed;
+ without one the programs are only built. A single argument that does not
+ end in .cl is taken as build options, as in earlier versions of the tool.
+ */
+int isSourceFile(const char* name) {
+    size_t len = strlen(name);
+    return len > 3 && strcmp(name + len - 3, ".cl") == 0;
+}
+
 int main(int argc, char** argv) {
 
    /* OpenCL 1.1 data structures */
    cl_platform_id* platforms;
    cl_program program;
-   cl_device_id device;
+   cl_device_id* devices;
    cl_context context;
 
    /* OpenCL 1.1 scalar data types */
    cl_uint numOfPlatforms;
+   cl_uint numOfDevices;
    cl_int  error;
 
+   const char* cacheDir = NULL;
+   const char* options = "";
+   const char** file_names = (const char**) alloca(sizeof(const char*) * (argc + 2));
+   int numOfFiles = 0;
+
+   for(int i = 1; i < argc; i++) {
+       if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+           cacheDir = argv[++i];
+       } else if (strcmp(argv[i], "--options") == 0 && i + 1 < argc) {
+           options = argv[++i];
+       } else if (isSourceFile(argv[i])) {
+           file_names[numOfFiles++] = argv[i];
+       } else {
+           options = argv[i];
+       }
+   }
+
+   if (numOfFiles == 0) {
+       file_names[numOfFiles++] = "simple.cl";
+       file_names[numOfFiles++] = "simple_2.cl";
+   }
+
+   cacheDir = cacheDirectory(cacheDir);
+   if (cacheDir) {
+#ifdef _WIN32
+       _mkdir(cacheDir);
+#else
+       mkdir(cacheDir, 0755);
+#endif
+       printf("Program cache: %s\n", cacheDir);
+   } else {
+       printf("No cache directory (--cache or VEXCL_CACHE_DIR), building only\n");
+   }
+   printf("build-options:%s\n", options);
+
+   /* Load the source files and join them into a single program source */
+   char** buffer = (char**) alloca(sizeof(char*) * numOfFiles);
+   size_t* sizes = (size_t*) alloca(sizeof(size_t) * numOfFiles);
+   loadProgramSource(file_names, numOfFiles, buffer, sizes);
+
+   size_t length;
+   char* source = joinSources((const char**)buffer, sizes, numOfFiles, &length);
+   for(int i = 0; i < numOfFiles; i++) { free(buffer[i]); }
+
    /* 
       Get the number of platforms 
       Remember that for each vendor's SDK installed on the computer,
@@ -61,62 +130,61 @@ int main(int argc, char** argv) {
       perror("Unable to find any OpenCL platforms");
       exit(1);
    }
-   // Search for a CPU/GPU device through the installed platforms
-   // Build a OpenCL program and do not run it.
+
+   int failed = 0;
+
+   // Build the OpenCL program for every device of every platform and do not run it.
    for(cl_uint i = 0; i < numOfPlatforms; i++ ) {
-       // Get the GPU device
-       error = clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_GPU, 1, &device, NULL);
-       if(error != CL_SUCCESS) {
-          // Otherwise, get the CPU
-          error = clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_CPU, 1, &device, NULL);
+       error = clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_ALL, 0, NULL, &numOfDevices);
+       if(error != CL_SUCCESS || numOfDevices == 0) continue;
+
+       devices = (cl_device_id*) malloc(sizeof(cl_device_id) * numOfDevices);
+       clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_ALL, numOfDevices, devices, NULL);
+
+       for(cl_uint j = 0; j < numOfDevices; j++) {
+            char name[256];
+            clGetDeviceInfo(devices[j], CL_DEVICE_NAME, sizeof(name), name, NULL);
+
+            /* Create a context */
+            context = clCreateContext(NULL, 1, &devices[j], NULL, NULL, &error);
+            if(error != CL_SUCCESS) {
+                printf("%s: can't create a valid OpenCL context\n", name);
+                failed = 1;
+                continue;
+            }
+
+            /* Always compile from source: this refreshes the cache entry */
+            program = buildCachedProgram(context, devices[j], NULL, source, length, options);
+            if(program == NULL) {
+                printf("%s: build failed\n", name);
+                failed = 1;
+                clReleaseContext(context);
+                continue;
+            }
+
+            if (cacheDir) {
+                char path[PROGRAM_CACHE_PATH_MAX];
+                cachePath(path, sizeof(path), cacheDir, devices[j], source, length, options);
+
+                size_t stored = storeProgramBinary(program, devices[j], cacheDir, source, length, options);
+                if (stored) {
+                    printf("%s: %lu bytes -> %s\n", name, (unsigned long)stored, path);
+                } else {
+                    printf("%s: couldn't store the binary in %s\n", name, cacheDir);
+                    failed = 1;
+                }
+            } else {
+                printf("%s: built\n", name);
+            }
+
+            /* Clean up */
+            clReleaseProgram(program);
+            clReleaseContext(context);
        }
-        if(error != CL_SUCCESS) {
-            perror("Can't locate any OpenCL compliant device");
-            exit(1);
-        }
-        /* Create a context */
-        context = clCreateContext(NULL, 1, &device, NULL, NULL, &error);
-        if(error != CL_SUCCESS) {
-            perror("Can't create a valid OpenCL context");
-            exit(1);
-        }
-
-        /* Load the two source files into temporary datastores */
-        const char *file_names[] = {"simple.cl", "simple_2.cl"};
-        const int NUMBER_OF_FILES = 2;
-        char* buffer[NUMBER_OF_FILES];
-        size_t sizes[NUMBER_OF_FILES];
-        loadProgramSource(file_names, NUMBER_OF_FILES, buffer, sizes);
-
-        /* Create the OpenCL program object */
-        program = clCreateProgramWithSource(context, NUMBER_OF_FILES, (const char**)buffer, sizes, &error);				
-	    if(error != CL_SUCCESS) {
-	      perror("Can't create the OpenCL program object");
-	      exit(1);   
-	    }
-        /* Build OpenCL program object and dump the error message, if any */
-        char *program_log;
-        const char options[] = "-cl-finite-math-only -cl-no-signed-zeros";  
-        size_t log_size;
-        printf("build-options:%s\n", argv[1]);
-        error = clBuildProgram(program, 1, &device, argv[1], NULL, NULL);		
-        // Uncomment the line below, comment the line above; re-build the program to use build options statically
-        // error = clBuildProgram(program, 1, &device, options, NULL, NULL);		
-	    if(error != CL_SUCCESS) {
-	      // If there's an error whilst building the program, dump the log
-	      clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
-	      program_log = (char*) malloc(log_size+1);
-	      program_log[log_size] = '\0';
-	      clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 
-	            log_size+1, program_log, NULL);
-	      printf("\n=== ERROR ===\n\n%s\n=============\n", program_log);
-	      free(program_log);
-	      exit(1);
-	    }
-   
-        /* Clean up */
-        for(i=0; i< NUMBER_OF_FILES; i++) { free(buffer[i]); }
-        clReleaseProgram(program);
-        clReleaseContext(context);
+
+       free(devices);
    }
+
+   free(source);
+   return failed;
 }
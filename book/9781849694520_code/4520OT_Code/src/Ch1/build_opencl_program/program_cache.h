@@ -0,0 +1,277 @@
+#ifndef PROGRAM_CACHE_H
+#define PROGRAM_CACHE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <process.h>
+#define CACHE_GETPID _getpid
+#else
+#include <unistd.h>
+#define CACHE_GETPID getpid
+#endif
+
+#ifdef APPLE
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+/**
+ * On-disk cache of OpenCL program binaries.
+ *
+ * Entries follow the layout of the VexCL cache (vexcl/util.hpp): the file
+ * <dir>/vexcl_<hash>.bin holds the CL_PROGRAM_BINARIES of one device, and
+ * <hash> is the 64-bit FNV-1a of the program source, the build options and
+ * the device name, vendor and driver version. A driver update thus moves
+ * every program to a new entry instead of loading a stale binary, and a
+ * program compiled offline by BuildOpenCLProgram is picked up both by
+ * buildCachedProgram() here and by vex::build_sources() with
+ * VEXCL_CACHE_DIR pointing to the same directory.
+ *
+ * Several source strings are hashed as their concatenation, which is what
+ * clCreateProgramWithSource compiles.
+ */
+
+#define PROGRAM_CACHE_ENV "VEXCL_CACHE_DIR"
+#define PROGRAM_CACHE_PATH_MAX 4096
+
+/* Cache directory: the requested one, or VEXCL_CACHE_DIR, or NULL if neither is set. */
+const char* cacheDirectory(const char* requested) {
+    return requested ? requested : getenv(PROGRAM_CACHE_ENV);
+}
+
+void cacheHash(unsigned long long* h, const char* data, size_t length) {
+    for(size_t i = 0; i < length; ++i) {
+        *h ^= (unsigned char)data[i];
+        *h *= 1099511628211ULL;
+    }
+    *h ^= 0xff;
+    *h *= 1099511628211ULL;
+}
+
+void cacheHashDeviceInfo(unsigned long long* h, cl_device_id device, cl_device_info param) {
+    size_t size = 0;
+    clGetDeviceInfo(device, param, 0, NULL, &size);
+
+    char* value = (char*) malloc(size + 1);
+    value[0] = '\0';
+    clGetDeviceInfo(device, param, size, value, NULL);
+    value[size] = '\0';
+
+    cacheHash(h, value, strlen(value));
+    free(value);
+}
+
+/* Name of the cache entry with the given extension (".bin" for program binaries). */
+void cacheEntryPath(char* path, size_t size, const char* dir, cl_device_id device,
+                    const char* source, size_t length, const char* options, const char* ext) {
+    unsigned long long h = 14695981039346656037ULL;
+
+    if (!options) options = "";
+
+    cacheHash(&h, source, length);
+    cacheHash(&h, options, strlen(options));
+    cacheHashDeviceInfo(&h, device, CL_DEVICE_NAME);
+    cacheHashDeviceInfo(&h, device, CL_DEVICE_VENDOR);
+    cacheHashDeviceInfo(&h, device, CL_DRIVER_VERSION);
+
+#ifdef _WIN32
+    snprintf(path, size, "%s\\vexcl_%llx%s", dir, h, ext);
+#else
+    snprintf(path, size, "%s/vexcl_%llx%s", dir, h, ext);
+#endif
+}
+
+/* Name of the cache entry for the given program source, options and device. */
+void cachePath(char* path, size_t size, const char* dir, cl_device_id device,
+               const char* source, size_t length, const char* options) {
+    cacheEntryPath(path, size, dir, device, source, length, options, ".bin");
+}
+
+/*
+ Stores a measured device property next to the binaries, where VexCL looks
+ up device properties (vex::device_properties in vexcl/util.hpp). Returns 0
+ on failure.
+ */
+int storeDeviceProperty(const char* dir, cl_device_id device, const char* key, double value) {
+    char path[PROGRAM_CACHE_PATH_MAX], tmp[PROGRAM_CACHE_PATH_MAX + 32];
+    cacheEntryPath(path, sizeof(path), dir, device, key, strlen(key), "", ".prop");
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)CACHE_GETPID());
+
+    FILE* file = fopen(tmp, "w");
+    if (file == NULL) return 0;
+
+    int ok = fprintf(file, "%.17g\n", value) > 0;
+    ok = (fclose(file) == 0) && ok;
+
+#ifdef _WIN32
+    remove(path);
+#endif
+
+    if (ok && rename(tmp, path) == 0) return 1;
+
+    remove(tmp);
+    return 0;
+}
+
+/* Concatenates the source strings into one malloc'ed buffer. */
+char* joinSources(const char** sources, const size_t* sizes, size_t count, size_t* length) {
+    *length = 0;
+    for(size_t i = 0; i < count; ++i) *length += sizes[i];
+
+    char* source = (char*) malloc(*length + 1);
+    char* p = source;
+    for(size_t i = 0; i < count; ++i) {
+        memcpy(p, sources[i], sizes[i]);
+        p += sizes[i];
+    }
+    *p = '\0';
+
+    return source;
+}
+
+void printBuildLog(cl_program program, cl_device_id device) {
+    size_t log_size;
+    clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
+    char* program_log = (char*) malloc(log_size+1);
+    program_log[log_size] = '\0';
+    clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG,
+          log_size+1, program_log, NULL);
+    printf("\n=== ERROR ===\n\n%s\n=============\n", program_log);
+    free(program_log);
+}
+
+/*
+ Creates and builds the program from the cached binary. Returns NULL on a
+ cache miss or when the driver rejects the binary.
+ */
+cl_program loadCachedProgram(cl_context context, cl_device_id device, const char* dir,
+                             const char* source, size_t length, const char* options) {
+    char path[PROGRAM_CACHE_PATH_MAX];
+    cachePath(path, sizeof(path), dir, device, source, length, options);
+
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+
+    if (size <= 0) {
+        fclose(file);
+        return NULL;
+    }
+
+    unsigned char* binary = (unsigned char*) malloc(size);
+    size_t binarySize = fread(binary, 1, size, file);
+    fclose(file);
+
+    cl_int status, error;
+    cl_program program = clCreateProgramWithBinary(context, 1, &device, &binarySize,
+                                                   (const unsigned char**)&binary, &status, &error);
+    free(binary);
+
+    if (error != CL_SUCCESS) return NULL;
+
+    if (status != CL_SUCCESS || clBuildProgram(program, 1, &device, options, NULL, NULL) != CL_SUCCESS) {
+        clReleaseProgram(program);
+        return NULL;
+    }
+
+    return program;
+}
+
+/*
+ Stores the binary of a built program for the given device. The binary goes
+ to a temporary file first, so that concurrent processes never read a
+ partially written entry. Returns the size of the binary, or 0 on failure.
+ */
+size_t storeProgramBinary(cl_program program, cl_device_id device, const char* dir,
+                          const char* source, size_t length, const char* options) {
+    cl_uint numOfDevices;
+    if (clGetProgramInfo(program, CL_PROGRAM_NUM_DEVICES, sizeof(numOfDevices), &numOfDevices, NULL) != CL_SUCCESS)
+        return 0;
+
+    cl_device_id* devices = (cl_device_id*) malloc(sizeof(cl_device_id) * numOfDevices);
+    size_t* sizes = (size_t*) malloc(sizeof(size_t) * numOfDevices);
+    unsigned char** binaries = (unsigned char**) malloc(sizeof(unsigned char*) * numOfDevices);
+
+    clGetProgramInfo(program, CL_PROGRAM_DEVICES, sizeof(cl_device_id) * numOfDevices, devices, NULL);
+    clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t) * numOfDevices, sizes, NULL);
+
+    for(cl_uint i = 0; i < numOfDevices; ++i)
+        binaries[i] = (unsigned char*) malloc(sizes[i] ? sizes[i] : 1);
+
+    size_t stored = 0;
+
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(unsigned char*) * numOfDevices,
+                         binaries, NULL) == CL_SUCCESS) {
+        for(cl_uint i = 0; i < numOfDevices; ++i) {
+            if (devices[i] != device || sizes[i] == 0) continue;
+
+            char path[PROGRAM_CACHE_PATH_MAX], tmp[PROGRAM_CACHE_PATH_MAX + 32];
+            cachePath(path, sizeof(path), dir, device, source, length, options);
+            snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)CACHE_GETPID());
+
+            FILE* file = fopen(tmp, "wb");
+            if (file == NULL) break;
+
+            int ok = fwrite(binaries[i], 1, sizes[i], file) == sizes[i];
+            ok = (fclose(file) == 0) && ok;
+
+#ifdef _WIN32
+            /* rename() does not replace existing files on Windows */
+            remove(path);
+#endif
+
+            if (ok && rename(tmp, path) == 0)
+                stored = sizes[i];
+            else
+                remove(tmp);
+            break;
+        }
+    }
+
+    for(cl_uint i = 0; i < numOfDevices; ++i) free(binaries[i]);
+    free(binaries);
+    free(sizes);
+    free(devices);
+
+    return stored;
+}
+
+/*
+ Builds the program for the device, loading it from the cache directory when
+ possible and storing the binary there after a build from source. With a
+ NULL directory this is clCreateProgramWithSource + clBuildProgram. Prints
+ the build log and returns NULL if the program does not compile.
+ */
+cl_program buildCachedProgram(cl_context context, cl_device_id device, const char* dir,
+                              const char* source, size_t length, const char* options) {
+    cl_program program;
+    cl_int error;
+
+    if (dir && (program = loadCachedProgram(context, device, dir, source, length, options)))
+        return program;
+
+    program = clCreateProgramWithSource(context, 1, &source, &length, &error);
+    if (error != CL_SUCCESS) {
+        perror("Can't create the OpenCL program object");
+        return NULL;
+    }
+
+    if (clBuildProgram(program, 1, &device, options, NULL, NULL) != CL_SUCCESS) {
+        printBuildLog(program, device);
+        clReleaseProgram(program);
+        return NULL;
+    }
+
+    if (dir) storeProgramBinary(program, device, dir, source, length, options);
+
+    return program;
+}
+
+#endif
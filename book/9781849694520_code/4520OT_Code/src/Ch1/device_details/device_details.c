@@ -8,6 +8,8 @@
 #include <CL/cl.h>
 #endif
 
+#include "roofline.h"
+
 void displayDeviceDetails(cl_device_id id, cl_device_info param_name, const char* paramNameAsStr) ; 
 
 void displayPlatformInfo(cl_platform_id id,
@@ -170,7 +172,36 @@ void displayDeviceDetails(cl_device_id id,
          
 }
 
-int main() {
+/*
+ Runs the roofline suite (see roofline.h) on every device of the platform
+ and appends the results to the profile.
+ */
+void benchmarkDevices(cl_platform_id id, FILE* profile, const char* cacheDir) {
+    cl_uint numOfDevices = 0;
+    RooflineProfile results;
+
+    if (clGetDeviceIDs(id, CL_DEVICE_TYPE_ALL, 0, NULL, &numOfDevices) != CL_SUCCESS) return;
+    cl_device_id* devices = (cl_device_id*) alloca(sizeof(cl_device_id) * numOfDevices);
+    clGetDeviceIDs(id, CL_DEVICE_TYPE_ALL, numOfDevices, devices, NULL);
+
+    for(cl_uint i = 0; i < numOfDevices; ++i) {
+        char name[256];
+        clGetDeviceInfo(devices[i], CL_DEVICE_NAME, sizeof(name), name, NULL);
+        printf("Benchmarking %s\n", name);
+
+        runRoofline(devices[i], &results);
+        writeProfile(profile, cacheDir, devices[i], &results);
+    }
+}
+
+/*
+ Usage: DeviceDetails [--bench [profile.tsv]]
+
+ With --bench every device is also measured with the roofline suite; the
+ results go to profile.tsv (device_profile.tsv by default) and, when
+ VEXCL_CACHE_DIR is set, to the VexCL cache as device properties.
+ */
+int main(int argc, char** argv) {
 
    /* OpenCL 1.1 data structures */
    cl_platform_id* platforms;
@@ -200,6 +231,18 @@ int main() {
       perror("Unable to find any OpenCL platforms");
       exit(1);
    }
+   int bench = argc > 1 && strcmp(argv[1], "--bench") == 0;
+   FILE* profile = NULL;
+   if (bench) {
+       const char* profileName = argc > 2 ? argv[2] : "device_profile.tsv";
+       profile = fopen(profileName, "w");
+       if (profile == NULL) {
+           perror("Unable to create the device profile");
+           exit(1);
+       }
+       fprintf(profile, "device\tmetric\tvalue\tunit\n");
+   }
+
    // We invoke the API 'clPlatformInfo' twice for each parameter we're trying to extract
    // and we use the return value to create temporary data structures (on the stack) to store
    // the returned information on the second invocation.
@@ -211,7 +254,11 @@ int main() {
         displayPlatformInfo( platforms[i], CL_PLATFORM_EXTENSIONS, "CL_PLATFORM_EXTENSIONS" );
         // Assume that we don't know how many devices are OpenCL compliant, we locate everything !
         displayDeviceInfo( platforms[i], CL_DEVICE_TYPE_ALL );
+
+        if (bench) benchmarkDevices( platforms[i], profile, cacheDirectory(NULL) );
    }
 
+   if (profile) fclose(profile);
+
    return 0;
 }
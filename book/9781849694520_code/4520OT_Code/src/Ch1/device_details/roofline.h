@@ -0,0 +1,430 @@
+#ifndef ROOFLINE_H
+#define ROOFLINE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
+
+#include "program_cache.h"
+
+/**
+ * Device roofline characterisation.
+ *
+ * Measures what a device sustains rather than what clGetDeviceInfo claims:
+ * global memory bandwidth for reads, writes and copies at several vector
+ * widths, local memory bandwidth, host/device transfer bandwidth from
+ * pageable and pinned (CL_MEM_ALLOC_HOST_PTR) memory, kernel launch latency,
+ * and peak single and double precision FLOP rates. Kernel times are taken
+ * from profiling events, as the best of several runs.
+ *
+ * Every result is a named metric. The metrics are written to a tab
+ * separated profile for the tuners, and into the VexCL cache directory as
+ * device properties, where vex::device_vector_perf() picks up the copy
+ * bandwidth as the partitioning weight.
+ */
+
+#define ROOFLINE_MAX_METRICS 64
+#define ROOFLINE_REPEATS 5
+#define ROOFLINE_BYTES (64 << 20)
+#define ROOFLINE_LOCAL_SIZE 256
+#define ROOFLINE_FLOP_ITERS 256
+#define ROOFLINE_LOCAL_ITERS 1024
+#define ROOFLINE_LAUNCHES 1000
+
+#define ROOFLINE_CHECK(error, message) \
+    if ((error) != CL_SUCCESS) { perror(message); exit(1); }
+
+typedef struct {
+    char        key[64];
+    double      value;
+    const char* unit;
+} RooflineMetric;
+
+typedef struct {
+    RooflineMetric metrics[ROOFLINE_MAX_METRICS];
+    int count;
+} RooflineProfile;
+
+static const char rooflineSource[] =
+    "#ifdef USE_DOUBLE\n"
+    "#pragma OPENCL EXTENSION cl_khr_fp64 : enable\n"
+    "#endif\n"
+    "kernel void bw_read(global const TYPE* in, global TYPE* out, uint n) {\n"
+    "    TYPE s = 0;\n"
+    "    for(uint i = get_global_id(0); i < n; i += get_global_size(0)) s += in[i];\n"
+    "    out[get_global_id(0)] = s;\n"
+    "}\n"
+    "kernel void bw_write(global TYPE* out, uint n) {\n"
+    "    for(uint i = get_global_id(0); i < n; i += get_global_size(0)) out[i] = (TYPE)(1);\n"
+    "}\n"
+    "kernel void bw_copy(global const TYPE* in, global TYPE* out, uint n) {\n"
+    "    for(uint i = get_global_id(0); i < n; i += get_global_size(0)) out[i] = in[i];\n"
+    "}\n"
+    "kernel void bw_local(global float* out, uint iters) {\n"
+    "    local float buf[LOCAL_SIZE];\n"
+    "    uint lid = get_local_id(0);\n"
+    "    buf[lid] = lid;\n"
+    "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+    "    float s = 0;\n"
+    "    for(uint k = 0; k < iters; k++) {\n"
+    "        uint j = lid + k;\n"
+    "        s += buf[j & (LOCAL_SIZE - 1)] + buf[(j + 32) & (LOCAL_SIZE - 1)] +\n"
+    "             buf[(j + 64) & (LOCAL_SIZE - 1)] + buf[(j + 96) & (LOCAL_SIZE - 1)];\n"
+    "    }\n"
+    "    out[get_global_id(0)] = s;\n"
+    "}\n"
+    "#define MAD4 x0 = mad(x0, a, b); x1 = mad(x1, a, b); x2 = mad(x2, a, b); x3 = mad(x3, a, b);\n"
+    "#define MAD16 MAD4 MAD4 MAD4 MAD4\n"
+    "kernel void peak_flops(global REAL4* out, REAL a, REAL b, uint iters) {\n"
+    "    REAL4 x0 = (REAL4)((REAL)get_global_id(0)), x1 = x0 + 1, x2 = x0 + 2, x3 = x0 + 3;\n"
+    "    for(uint k = 0; k < iters; k++) { MAD16 MAD16 }\n"
+    "    out[get_global_id(0)] = x0 + x1 + x2 + x3;\n"
+    "}\n"
+    "kernel void noop() {}\n";
+
+double wallTime() {
+#ifdef _WIN32
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (double)now.QuadPart / freq.QuadPart;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + 1e-6 * tv.tv_usec;
+#endif
+}
+
+void addMetric(RooflineProfile* profile, const char* key, double value, const char* unit) {
+    if (profile->count == ROOFLINE_MAX_METRICS) return;
+
+    RooflineMetric* m = &profile->metrics[profile->count++];
+    snprintf(m->key, sizeof(m->key), "%s", key);
+    m->value = value;
+    m->unit  = unit;
+
+    printf("\t%-32s %12.2f %s\n", key, value, unit);
+}
+
+double metricValue(const RooflineProfile* profile, const char* key) {
+    for(int i = 0; i < profile->count; i++)
+        if (strcmp(profile->metrics[i].key, key) == 0) return profile->metrics[i].value;
+    return 0;
+}
+
+double eventSeconds(cl_event event) {
+    cl_ulong start, end;
+    clWaitForEvents(1, &event);
+    clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
+    clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
+    clReleaseEvent(event);
+    return (end - start) * 1e-9;
+}
+
+/* Best time of ROOFLINE_REPEATS runs of the kernel, after a warm-up run. */
+double kernelSeconds(cl_command_queue queue, cl_kernel kernel, size_t global, size_t local) {
+    double best = 1e30;
+
+    for(int r = 0; r <= ROOFLINE_REPEATS; r++) {
+        cl_event event;
+        cl_int error = clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &global, &local, 0, NULL, &event);
+        ROOFLINE_CHECK(error, "Unable to enqueue the benchmark kernel");
+
+        double t = eventSeconds(event);
+        if (r && t < best) best = t;
+    }
+
+    return best;
+}
+
+/* Best time of ROOFLINE_REPEATS blocking transfers between host and buffer. */
+double transferSeconds(cl_command_queue queue, cl_mem buffer, void* host, size_t bytes, int toDevice) {
+    double best = 1e30;
+
+    for(int r = 0; r <= ROOFLINE_REPEATS; r++) {
+        cl_event event;
+        cl_int error = toDevice
+            ? clEnqueueWriteBuffer(queue, buffer, CL_TRUE, 0, bytes, host, 0, NULL, &event)
+            : clEnqueueReadBuffer(queue, buffer, CL_TRUE, 0, bytes, host, 0, NULL, &event);
+        ROOFLINE_CHECK(error, "Unable to transfer the benchmark buffer");
+
+        double t = eventSeconds(event);
+        if (r && t < best) best = t;
+    }
+
+    return best;
+}
+
+cl_program rooflineProgram(cl_context context, cl_device_id device, const char* type,
+                           const char* real, int useDouble, size_t localSize) {
+    char options[256];
+    snprintf(options, sizeof(options), "-DTYPE=%s -DREAL=%s -DREAL4=%s4 -DLOCAL_SIZE=%lu%s",
+             type, real, real, (unsigned long)localSize, useDouble ? " -DUSE_DOUBLE" : "");
+
+    cl_program program = buildCachedProgram(context, device, cacheDirectory(NULL),
+                                            rooflineSource, strlen(rooflineSource), options);
+    if (program == NULL) exit(1);
+    return program;
+}
+
+void benchGlobal(cl_context context, cl_command_queue queue, cl_device_id device,
+                 size_t bytes, size_t global, size_t local, RooflineProfile* profile) {
+    static const int widths[] = {1, 2, 4, 8, 16};
+    cl_int error;
+
+    cl_mem in  = clCreateBuffer(context, CL_MEM_READ_WRITE, bytes, NULL, &error);
+    ROOFLINE_CHECK(error, "Unable to create the benchmark buffer");
+    cl_mem out = clCreateBuffer(context, CL_MEM_READ_WRITE, bytes, NULL, &error);
+    ROOFLINE_CHECK(error, "Unable to create the benchmark buffer");
+
+    /* fill the input so that reads see real data */
+    void* host = calloc(bytes, 1);
+    clEnqueueWriteBuffer(queue, in, CL_TRUE, 0, bytes, host, 0, NULL, NULL);
+    free(host);
+
+    double bestRead = 0, bestWrite = 0, bestCopy = 0;
+
+    for(int w = 0; w < (int)(sizeof(widths) / sizeof(widths[0])); w++) {
+        char type[16], key[64];
+        if (widths[w] == 1) snprintf(type, sizeof(type), "float");
+        else snprintf(type, sizeof(type), "float%d", widths[w]);
+
+        cl_program program = rooflineProgram(context, device, type, "float", 0, local);
+        cl_uint n = bytes / (sizeof(cl_float) * widths[w]);
+
+        /* bw_read writes one element per work-item, which has to fit */
+        size_t readGlobal = global < n ? global : n;
+
+        cl_kernel read = clCreateKernel(program, "bw_read", &error);
+        ROOFLINE_CHECK(error, "Unable to create the bw_read kernel");
+        clSetKernelArg(read, 0, sizeof(cl_mem), &in);
+        clSetKernelArg(read, 1, sizeof(cl_mem), &out);
+        clSetKernelArg(read, 2, sizeof(cl_uint), &n);
+        double gbRead = bytes / kernelSeconds(queue, read, readGlobal, local) * 1e-9;
+
+        cl_kernel write = clCreateKernel(program, "bw_write", &error);
+        ROOFLINE_CHECK(error, "Unable to create the bw_write kernel");
+        clSetKernelArg(write, 0, sizeof(cl_mem), &out);
+        clSetKernelArg(write, 1, sizeof(cl_uint), &n);
+        double gbWrite = bytes / kernelSeconds(queue, write, global, local) * 1e-9;
+
+        cl_kernel copy = clCreateKernel(program, "bw_copy", &error);
+        ROOFLINE_CHECK(error, "Unable to create the bw_copy kernel");
+        clSetKernelArg(copy, 0, sizeof(cl_mem), &in);
+        clSetKernelArg(copy, 1, sizeof(cl_mem), &out);
+        clSetKernelArg(copy, 2, sizeof(cl_uint), &n);
+        double gbCopy = 2.0 * bytes / kernelSeconds(queue, copy, global, local) * 1e-9;
+
+        snprintf(key, sizeof(key), "global read %s", type);
+        addMetric(profile, key, gbRead, "GB/s");
+        snprintf(key, sizeof(key), "global write %s", type);
+        addMetric(profile, key, gbWrite, "GB/s");
+        snprintf(key, sizeof(key), "global copy %s", type);
+        addMetric(profile, key, gbCopy, "GB/s");
+
+        if (gbRead  > bestRead)  bestRead  = gbRead;
+        if (gbWrite > bestWrite) bestWrite = gbWrite;
+        if (gbCopy  > bestCopy)  bestCopy  = gbCopy;
+
+        clReleaseKernel(read);
+        clReleaseKernel(write);
+        clReleaseKernel(copy);
+        clReleaseProgram(program);
+    }
+
+    addMetric(profile, "global read bandwidth",  bestRead,  "GB/s");
+    addMetric(profile, "global write bandwidth", bestWrite, "GB/s");
+    addMetric(profile, "global copy bandwidth",  bestCopy,  "GB/s");
+
+    clReleaseMemObject(in);
+    clReleaseMemObject(out);
+}
+
+void benchLocal(cl_context context, cl_command_queue queue, cl_device_id device,
+                size_t global, size_t local, RooflineProfile* profile) {
+    cl_int error;
+    cl_uint iters = ROOFLINE_LOCAL_ITERS;
+
+    cl_program program = rooflineProgram(context, device, "float", "float", 0, local);
+    cl_mem out = clCreateBuffer(context, CL_MEM_WRITE_ONLY, global * sizeof(cl_float), NULL, &error);
+    ROOFLINE_CHECK(error, "Unable to create the benchmark buffer");
+
+    cl_kernel kernel = clCreateKernel(program, "bw_local", &error);
+    ROOFLINE_CHECK(error, "Unable to create the bw_local kernel");
+    clSetKernelArg(kernel, 0, sizeof(cl_mem), &out);
+    clSetKernelArg(kernel, 1, sizeof(cl_uint), &iters);
+
+    double bytes = (double)global * iters * 4 * sizeof(cl_float);
+    addMetric(profile, "local read bandwidth", bytes / kernelSeconds(queue, kernel, global, local) * 1e-9, "GB/s");
+
+    clReleaseKernel(kernel);
+    clReleaseMemObject(out);
+    clReleaseProgram(program);
+}
+
+void benchFlops(cl_context context, cl_command_queue queue, cl_device_id device,
+                size_t global, size_t local, int useDouble, RooflineProfile* profile) {
+    cl_int error;
+    cl_uint iters = ROOFLINE_FLOP_ITERS;
+    const char* real = useDouble ? "double" : "float";
+    size_t size = useDouble ? sizeof(cl_double) : sizeof(cl_float);
+
+    cl_program program = rooflineProgram(context, device, real, real, useDouble, local);
+    cl_mem out = clCreateBuffer(context, CL_MEM_WRITE_ONLY, global * 4 * size, NULL, &error);
+    ROOFLINE_CHECK(error, "Unable to create the benchmark buffer");
+
+    cl_kernel kernel = clCreateKernel(program, "peak_flops", &error);
+    ROOFLINE_CHECK(error, "Unable to create the peak_flops kernel");
+    clSetKernelArg(kernel, 0, sizeof(cl_mem), &out);
+
+    /* x = a x + b converges to b / (1 - a): no overflow, no denormals */
+    if (useDouble) {
+        cl_double a = 0.999, b = 0.001;
+        clSetKernelArg(kernel, 1, sizeof(a), &a);
+        clSetKernelArg(kernel, 2, sizeof(b), &b);
+    } else {
+        cl_float a = 0.999f, b = 0.001f;
+        clSetKernelArg(kernel, 1, sizeof(a), &a);
+        clSetKernelArg(kernel, 2, sizeof(b), &b);
+    }
+    clSetKernelArg(kernel, 3, sizeof(cl_uint), &iters);
+
+    /* 32 mads on 4-wide vectors per iteration */
+    double flops = (double)global * iters * 32 * 4 * 2;
+    addMetric(profile, useDouble ? "peak double" : "peak float",
+              flops / kernelSeconds(queue, kernel, global, local) * 1e-9, "GFLOP/s");
+
+    clReleaseKernel(kernel);
+    clReleaseMemObject(out);
+    clReleaseProgram(program);
+}
+
+void benchTransfers(cl_context context, cl_command_queue queue, size_t bytes, RooflineProfile* profile) {
+    cl_int error;
+
+    cl_mem device = clCreateBuffer(context, CL_MEM_READ_WRITE, bytes, NULL, &error);
+    ROOFLINE_CHECK(error, "Unable to create the benchmark buffer");
+
+    void* pageable = calloc(bytes, 1);
+    addMetric(profile, "h2d pageable", bytes / transferSeconds(queue, device, pageable, bytes, 1) * 1e-9, "GB/s");
+    addMetric(profile, "d2h pageable", bytes / transferSeconds(queue, device, pageable, bytes, 0) * 1e-9, "GB/s");
+    free(pageable);
+
+    cl_mem staging = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, bytes, NULL, &error);
+    ROOFLINE_CHECK(error, "Unable to create the pinned staging buffer");
+    void* pinned = clEnqueueMapBuffer(queue, staging, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, bytes,
+                                      0, NULL, NULL, &error);
+    ROOFLINE_CHECK(error, "Unable to map the pinned staging buffer");
+
+    addMetric(profile, "h2d pinned", bytes / transferSeconds(queue, device, pinned, bytes, 1) * 1e-9, "GB/s");
+    addMetric(profile, "d2h pinned", bytes / transferSeconds(queue, device, pinned, bytes, 0) * 1e-9, "GB/s");
+
+    clEnqueueUnmapMemObject(queue, staging, pinned, 0, NULL, NULL);
+    clFinish(queue);
+    clReleaseMemObject(staging);
+    clReleaseMemObject(device);
+}
+
+void benchLaunch(cl_context context, cl_command_queue queue, cl_device_id device, RooflineProfile* profile) {
+    cl_int error;
+    size_t one = 1;
+
+    cl_program program = rooflineProgram(context, device, "float", "float", 0, ROOFLINE_LOCAL_SIZE);
+    cl_kernel kernel = clCreateKernel(program, "noop", &error);
+    ROOFLINE_CHECK(error, "Unable to create the noop kernel");
+
+    clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &one, NULL, 0, NULL, NULL);
+    clFinish(queue);
+
+    /* round trip: enqueue and wait for every launch */
+    double start = wallTime();
+    for(int i = 0; i < ROOFLINE_LAUNCHES / 10; i++) {
+        clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &one, NULL, 0, NULL, NULL);
+        clFinish(queue);
+    }
+    addMetric(profile, "launch latency", (wallTime() - start) / (ROOFLINE_LAUNCHES / 10) * 1e6, "us");
+
+    /* throughput: back to back launches, one wait at the end */
+    start = wallTime();
+    for(int i = 0; i < ROOFLINE_LAUNCHES; i++)
+        clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &one, NULL, 0, NULL, NULL);
+    clFinish(queue);
+    addMetric(profile, "launch interval", (wallTime() - start) / ROOFLINE_LAUNCHES * 1e6, "us");
+
+    clReleaseKernel(kernel);
+    clReleaseProgram(program);
+}
+
+/* Runs the whole suite on the device. */
+void runRoofline(cl_device_id device, RooflineProfile* profile) {
+    cl_int error;
+    cl_uint computeUnits;
+    size_t maxWorkGroup;
+    cl_ulong maxAlloc;
+    size_t extSize;
+
+    profile->count = 0;
+
+    clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(computeUnits), &computeUnits, NULL);
+    clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(maxWorkGroup), &maxWorkGroup, NULL);
+    clGetDeviceInfo(device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(maxAlloc), &maxAlloc, NULL);
+    clGetDeviceInfo(device, CL_DEVICE_EXTENSIONS, 0, NULL, &extSize);
+    char* extensions = (char*) malloc(extSize + 1);
+    clGetDeviceInfo(device, CL_DEVICE_EXTENSIONS, extSize, extensions, NULL);
+    extensions[extSize] = '\0';
+
+    /* power of two local size: bw_local wraps indices with a mask */
+    size_t local = ROOFLINE_LOCAL_SIZE;
+    while(local > maxWorkGroup) local /= 2;
+
+    size_t global = computeUnits * local * 16;
+    size_t bytes = ROOFLINE_BYTES;
+    while(bytes > maxAlloc / 2) bytes /= 2;
+
+    cl_context context = clCreateContext(NULL, 1, &device, NULL, NULL, &error);
+    ROOFLINE_CHECK(error, "Can't create a valid OpenCL context");
+    cl_command_queue queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &error);
+    ROOFLINE_CHECK(error, "Can't create a command queue");
+
+    benchGlobal(context, queue, device, bytes, global, local, profile);
+    benchLocal(context, queue, device, global, local, profile);
+    benchTransfers(context, queue, bytes, profile);
+    benchLaunch(context, queue, device, profile);
+    benchFlops(context, queue, device, global, local, 0, profile);
+    if (strstr(extensions, "cl_khr_fp64"))
+        benchFlops(context, queue, device, global, local, 1, profile);
+
+    free(extensions);
+    clReleaseCommandQueue(queue);
+    clReleaseContext(context);
+}
+
+/*
+ Appends the profile to a tab separated file, one "device, metric, value,
+ unit" line per metric, and stores the metrics as VexCL device properties
+ (prefixed with "roofline ") if a cache directory is given.
+ */
+void writeProfile(FILE* file, const char* cacheDir, cl_device_id device, const RooflineProfile* profile) {
+    char name[256];
+    clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(name), name, NULL);
+
+    for(int i = 0; i < profile->count; i++) {
+        const RooflineMetric* m = &profile->metrics[i];
+
+        if (file) fprintf(file, "%s\t%s\t%.6g\t%s\n", name, m->key, m->value, m->unit);
+
+        if (cacheDir) {
+            char key[80];
+            snprintf(key, sizeof(key), "roofline %s", m->key);
+            storeDeviceProperty(cacheDir, device, key, m->value);
+        }
+    }
+}
+
+#endif
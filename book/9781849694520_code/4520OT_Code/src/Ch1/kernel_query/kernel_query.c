@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <alloca.h>
+#include <string.h>
 
 #ifdef APPLE
 #include <OpenCL/cl.h>
@@ -9,6 +10,22 @@
 #include <CL/cl.h>
 #endif
 
+#include "program_cache.h"
+
+/* Device attribute queries of cl_nv_device_attribute_query and cl_amd_device_attribute_query */
+#ifndef CL_DEVICE_COMPUTE_CAPABILITY_MAJOR_NV
+#define CL_DEVICE_COMPUTE_CAPABILITY_MAJOR_NV 0x4000
+#define CL_DEVICE_COMPUTE_CAPABILITY_MINOR_NV 0x4001
+#define CL_DEVICE_REGISTERS_PER_BLOCK_NV      0x4002
+#define CL_DEVICE_WARP_SIZE_NV                0x4003
+#endif
+#ifndef CL_DEVICE_WAVEFRONT_WIDTH_AMD
+#define CL_DEVICE_SIMD_PER_COMPUTE_UNIT_AMD   0x4040
+#define CL_DEVICE_WAVEFRONT_WIDTH_AMD         0x4043
+#endif
+
+#define MAX_CANDIDATES 16
+
 void loadProgramSource(const char** files,
                        size_t length,
                        char** buffer,
@@ -30,18 +47,252 @@ void loadProgramSource(const char** files,
 	   }
 }
 
+/*
+ Per compute unit limits of a device that bound how many work-groups can be
+ resident at once. OpenCL does not expose them, so they come from the vendor
+ attribute extensions where available and from typical values otherwise;
+ all of them can be overridden on the command line.
+ */
+typedef struct {
+    char     name[256];
+    cl_uint  computeUnits;
+    cl_ulong localMem;        // local memory per compute unit
+    size_t   maxWorkGroupSize;
+    cl_uint  simdWidth;       // scheduling granularity: warp or wavefront
+    cl_uint  itemsPerCU;      // resident work-items per compute unit
+    cl_uint  groupsPerCU;     // resident work-groups per compute unit
+    cl_uint  registersPerCU;  // 0 if unknown
+    int      isGPU;
+} DeviceLimits;
+
+int hasExtension(cl_device_id device, const char* extension) {
+    size_t size;
+    clGetDeviceInfo(device, CL_DEVICE_EXTENSIONS, 0, NULL, &size);
+    char* extensions = (char*) malloc(size + 1);
+    clGetDeviceInfo(device, CL_DEVICE_EXTENSIONS, size, extensions, NULL);
+    extensions[size] = '\0';
+    int found = strstr(extensions, extension) != NULL;
+    free(extensions);
+    return found;
+}
+
+void deviceLimits(cl_device_id device, DeviceLimits* limits) {
+    cl_device_type type;
+    clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(limits->name), limits->name, NULL);
+    clGetDeviceInfo(device, CL_DEVICE_TYPE, sizeof(type), &type, NULL);
+    clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &limits->computeUnits, NULL);
+    clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong), &limits->localMem, NULL);
+    clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t), &limits->maxWorkGroupSize, NULL);
+
+    limits->isGPU = (type & CL_DEVICE_TYPE_GPU) != 0;
+    limits->registersPerCU = 0;
+
+    if (hasExtension(device, "cl_nv_device_attribute_query")) {
+        cl_uint major = 0;
+        clGetDeviceInfo(device, CL_DEVICE_COMPUTE_CAPABILITY_MAJOR_NV, sizeof(cl_uint), &major, NULL);
+        clGetDeviceInfo(device, CL_DEVICE_WARP_SIZE_NV, sizeof(cl_uint), &limits->simdWidth, NULL);
+        clGetDeviceInfo(device, CL_DEVICE_REGISTERS_PER_BLOCK_NV, sizeof(cl_uint), &limits->registersPerCU, NULL);
+        // resident threads and blocks per multiprocessor by compute capability
+        limits->itemsPerCU  = major < 2 ? 1024 : major < 3 ? 1536 : 2048;
+        limits->groupsPerCU = major < 3 ? 8 : major < 5 ? 16 : 32;
+    } else if (hasExtension(device, "cl_amd_device_attribute_query") && limits->isGPU) {
+        cl_uint simds = 4;
+        clGetDeviceInfo(device, CL_DEVICE_WAVEFRONT_WIDTH_AMD, sizeof(cl_uint), &limits->simdWidth, NULL);
+        clGetDeviceInfo(device, CL_DEVICE_SIMD_PER_COMPUTE_UNIT_AMD, sizeof(cl_uint), &simds, NULL);
+        // ten wavefronts per SIMD
+        limits->itemsPerCU  = simds * 10 * limits->simdWidth;
+        limits->groupsPerCU = 16;
+    } else if (limits->isGPU) {
+        limits->simdWidth   = 32;
+        limits->itemsPerCU  = 2048;
+        limits->groupsPerCU = 16;
+    } else {
+        // a CPU core runs one work-group at a time
+        limits->simdWidth   = 1;
+        limits->itemsPerCU  = limits->maxWorkGroupSize;
+        limits->groupsPerCU = 1;
+    }
+
+    if (limits->simdWidth == 0) limits->simdWidth = 1;
+}
+
+typedef struct {
+    size_t   workGroupSize;
+    size_t   compileWorkGroupSize[3];
+    size_t   preferredMultiple;
+    cl_ulong localMem;
+    cl_ulong privateMem;
+} KernelInfo;
+
+void kernelInfo(cl_kernel kernel, cl_device_id device, KernelInfo* info) {
+    clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_WORK_GROUP_SIZE,
+                             sizeof(size_t), &info->workGroupSize, NULL);
+    clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_COMPILE_WORK_GROUP_SIZE,
+                             sizeof(info->compileWorkGroupSize), info->compileWorkGroupSize, NULL);
+    clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE,
+                             sizeof(size_t), &info->preferredMultiple, NULL);
+    clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_LOCAL_MEM_SIZE,
+                             sizeof(cl_ulong), &info->localMem, NULL);
+    clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_PRIVATE_MEM_SIZE,
+                             sizeof(cl_ulong), &info->privateMem, NULL);
+    if (info->preferredMultiple == 0) info->preferredMultiple = 1;
+}
+
+/*
+ Work-groups of the given size resident on one compute unit, and the
+ resource that limits them. localPerItem is local memory per work-item
+ allocated through kernel arguments, which the kernel query can't see.
+ */
+size_t groupsPerCU(const DeviceLimits* dev, const KernelInfo* krn, size_t localSize,
+                   cl_ulong localPerItem, const char** limiter) {
+    size_t items = (localSize + dev->simdWidth - 1) / dev->simdWidth * dev->simdWidth;
+    size_t groups = dev->groupsPerCU;
+    *limiter = "work-groups";
+
+    size_t byItems = dev->itemsPerCU / items;
+    if (byItems < groups) { groups = byItems; *limiter = "work-items"; }
+
+    cl_ulong local = krn->localMem + localPerItem * localSize;
+    if (local) {
+        size_t byLocal = dev->localMem / local;
+        if (byLocal < groups) { groups = byLocal; *limiter = "local memory"; }
+    }
+
+    /*
+     Runtimes shrink CL_KERNEL_WORK_GROUP_SIZE below the device maximum when
+     a work-group would not fit into the register file; that bounds the
+     registers per work-item from above.
+     */
+    if (dev->registersPerCU && krn->workGroupSize < dev->maxWorkGroupSize) {
+        size_t regsPerItem = dev->registersPerCU / krn->workGroupSize;
+        size_t byRegs = dev->registersPerCU / (regsPerItem * items);
+        if (byRegs < groups) { groups = byRegs; *limiter = "registers"; }
+    }
+
+    return groups;
+}
+
+/* Multiples of the preferred size up to the kernel limit, doubling, plus the limit itself. */
+int candidateSizes(const KernelInfo* krn, size_t* sizes) {
+    int count = 0;
+
+    if (krn->compileWorkGroupSize[0]) {
+        sizes[count++] = krn->compileWorkGroupSize[0] *
+            (krn->compileWorkGroupSize[1] ? krn->compileWorkGroupSize[1] : 1) *
+            (krn->compileWorkGroupSize[2] ? krn->compileWorkGroupSize[2] : 1);
+        return count;
+    }
+
+    for(size_t s = krn->preferredMultiple; s <= krn->workGroupSize && count < MAX_CANDIDATES - 1; s *= 2)
+        sizes[count++] = s;
+
+    if (count == 0 || sizes[count - 1] != krn->workGroupSize)
+        sizes[count++] = krn->workGroupSize;
+
+    return count;
+}
+
+void reportKernel(cl_kernel kernel, const DeviceLimits* dev, cl_device_id device, cl_ulong localPerItem) {
+    char kernelName[256];
+    cl_uint argCnt;
+    KernelInfo krn;
+
+    clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, sizeof(kernelName), kernelName, NULL);
+    clGetKernelInfo(kernel, CL_KERNEL_NUM_ARGS, sizeof(argCnt), &argCnt, NULL);
+    kernelInfo(kernel, device, &krn);
+
+    printf("Kernel name: %s with arity: %d\n", kernelName, argCnt);
+    printf("  work-group size limit: %lu (device: %lu), preferred multiple: %lu\n",
+           (unsigned long)krn.workGroupSize, (unsigned long)dev->maxWorkGroupSize,
+           (unsigned long)krn.preferredMultiple);
+    printf("  local memory: %lu bytes + %lu per work-item, private memory: %lu bytes per work-item\n",
+           (unsigned long)krn.localMem, (unsigned long)localPerItem, (unsigned long)krn.privateMem);
+
+    if (dev->isGPU && krn.privateMem)
+        printf("  warning: private memory lives in off-chip memory (register spills or private arrays)\n");
+    if (krn.workGroupSize < dev->maxWorkGroupSize)
+        printf("  warning: work-group size is limited by per work-item resources (likely registers)\n");
+
+    size_t sizes[MAX_CANDIDATES];
+    int count = candidateSizes(&krn, sizes);
+    int best = -1;
+    size_t bestGroups = 0;
+    double bestOccupancy = 0;
+
+    printf("  %10s %12s %10s %10s  %s\n", "local size", "groups/CU", "items/CU", "occupancy", "limited by");
+    for(int i = 0; i < count; i++) {
+        const char* limiter;
+        size_t groups = groupsPerCU(dev, &krn, sizes[i], localPerItem, &limiter);
+        double occupancy = (double)(groups * sizes[i]) / dev->itemsPerCU;
+
+        printf("  %10lu %12lu %10lu %9.0f%%  %s\n", (unsigned long)sizes[i], (unsigned long)groups,
+               (unsigned long)(groups * sizes[i]), occupancy * 100, groups ? limiter : "does not fit");
+
+        // ties go to the smaller size: more groups per CU hide barriers better
+        if (occupancy > bestOccupancy) { bestOccupancy = occupancy; bestGroups = groups; best = i; }
+    }
+
+    if (best >= 0)
+        printf("  suggested local size: %lu (%lu work-groups in flight on %u compute units)\n",
+               (unsigned long)sizes[best],
+               (unsigned long)(bestGroups * dev->computeUnits),
+               dev->computeUnits);
+}
+
+/*
+ Occupancy analyser: reports the kernel resource usage of a program on every
+ device, and the work-groups per compute unit achievable with candidate
+ local sizes.
+
+ Usage: KernelQuery [--options "build options"] [--local-per-item bytes]
+                    [--items-per-cu n] [--groups-per-cu n] [file.cl ...]
+ */
 int main(int argc, char** argv) {
 
    /* OpenCL 1.1 data structures */
    cl_platform_id* platforms;
    cl_program program;
-   cl_device_id device;
+   cl_device_id* devices;
    cl_context context;
 
    /* OpenCL 1.1 scalar data types */
    cl_uint numOfPlatforms;
+   cl_uint numOfDevices;
    cl_int  error;
 
+   const char* options = "-cl-finite-math-only -cl-no-signed-zeros";  
+   cl_ulong localPerItem = 0;
+   cl_uint itemsPerCU = 0, groupsPerCUOverride = 0;
+   const char** file_names = (const char**) alloca(sizeof(const char*) * (argc + 2));
+   int numOfFiles = 0;
+
+   for(int i = 1; i < argc; i++) {
+       if (strcmp(argv[i], "--options") == 0 && i + 1 < argc)
+           options = argv[++i];
+       else if (strcmp(argv[i], "--local-per-item") == 0 && i + 1 < argc)
+           localPerItem = strtoul(argv[++i], NULL, 10);
+       else if (strcmp(argv[i], "--items-per-cu") == 0 && i + 1 < argc)
+           itemsPerCU = strtoul(argv[++i], NULL, 10);
+       else if (strcmp(argv[i], "--groups-per-cu") == 0 && i + 1 < argc)
+           groupsPerCUOverride = strtoul(argv[++i], NULL, 10);
+       else
+           file_names[numOfFiles++] = argv[i];
+   }
+
+   if (numOfFiles == 0) {
+       file_names[numOfFiles++] = "simple.cl";
+       file_names[numOfFiles++] = "simple_2.cl";
+   }
+
+   /* Load the source files into temporary datastores */
+   char** buffer = (char**) alloca(sizeof(char*) * numOfFiles);
+   size_t* sizes = (size_t*) alloca(sizeof(size_t) * numOfFiles);
+   loadProgramSource(file_names, numOfFiles, buffer, sizes);
+
+   size_t length;
+   char* source = joinSources((const char**)buffer, sizes, numOfFiles, &length);
+   for(int i = 0; i < numOfFiles; i++) { free(buffer[i]); }
+
    /* 
       Get the number of platforms 
       Remember that for each vendor's SDK installed on the computer,
@@ -61,79 +312,67 @@ int main(int argc, char** argv) {
       perror("Unable to find any OpenCL platforms");
       exit(1);
    }
-   // Search for a CPU/GPU device through the installed platforms
-   // Build a OpenCL program and do not run it.
+
+   // Build the OpenCL program for every device and query its kernels; do not run them.
    for(cl_uint i = 0; i < numOfPlatforms; i++ ) {
-       // Get the GPU device
-       error = clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_GPU, 1, &device, NULL);
-       if(error != CL_SUCCESS) {
-          // Otherwise, get the CPU
-          error = clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_CPU, 1, &device, NULL);
-       }
-        if(error != CL_SUCCESS) {
-            perror("Can't locate any OpenCL compliant device");
-            exit(1);
-        }
-        /* Create a context */
-        context = clCreateContext(NULL, 1, &device, NULL, NULL, &error);
-        if(error != CL_SUCCESS) {
-            perror("Can't create a valid OpenCL context");
-            exit(1);
-        }
-
-        /* Load the two source files into temporary datastores */
-        const char *file_names[] = {"simple.cl", "simple_2.cl"};
-        const int NUMBER_OF_FILES = 2;
-        char* buffer[NUMBER_OF_FILES];
-        size_t sizes[NUMBER_OF_FILES];
-        loadProgramSource(file_names, NUMBER_OF_FILES, buffer, sizes);
-
-        /* Create the OpenCL program object */
-        program = clCreateProgramWithSource(context, NUMBER_OF_FILES, (const char**)buffer, sizes, &error);				
-	    if(error != CL_SUCCESS) {
-	      perror("Can't create the OpenCL program object");
-	      exit(1);   
-	    }
-        /* Build OpenCL program object and dump the error message, if any */
-        char *program_log;
-        const char options[] = "-cl-finite-math-only -cl-no-signed-zeros";  
-        size_t log_size;
-        //error = clBuildProgram(program, 1, &device, argv[1], NULL, NULL);		
-        // Uncomment the line below, comment the line above; re-build the program to use build options statically
-        error = clBuildProgram(program, 1, &device, options, NULL, NULL);		
-	    if(error != CL_SUCCESS) {
-	      // If there's an error whilst building the program, dump the log
-	      clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
-	      program_log = (char*) malloc(log_size+1);
-	      program_log[log_size] = '\0';
-	      clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 
-	            log_size+1, program_log, NULL);
-	      printf("\n=== ERROR ===\n\n%s\n=============\n", program_log);
-	      free(program_log);
-	      exit(1);
-	    }
+       error = clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_ALL, 0, NULL, &numOfDevices);
+       if(error != CL_SUCCESS || numOfDevices == 0) continue;
+
+       devices = (cl_device_id*) malloc(sizeof(cl_device_id) * numOfDevices);
+       clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_ALL, numOfDevices, devices, NULL);
+
+       for(cl_uint d = 0; d < numOfDevices; d++) {
+            DeviceLimits dev;
+            deviceLimits(devices[d], &dev);
+            if (itemsPerCU) dev.itemsPerCU = itemsPerCU;
+            if (groupsPerCUOverride) dev.groupsPerCU = groupsPerCUOverride;
+
+            printf("\n=== %s ===\n", dev.name);
+            printf("%u compute units, %lu bytes of local memory, SIMD width %u, "
+                   "up to %u work-items and %u work-groups per compute unit\n",
+                   dev.computeUnits, (unsigned long)dev.localMem, dev.simdWidth,
+                   dev.itemsPerCU, dev.groupsPerCU);
+
+            /* Create a context */
+            context = clCreateContext(NULL, 1, &devices[d], NULL, NULL, &error);
+            if(error != CL_SUCCESS) {
+                perror("Can't create a valid OpenCL context");
+                continue;
+            }
+
+            /*
+             Create and build the OpenCL program object. With VEXCL_CACHE_DIR set
+             (e.g. filled by BuildOpenCLProgram) the binary is loaded from the
+             cache instead of being compiled from source; the build log is
+             dumped if compilation fails.
+             */
+            program = buildCachedProgram(context, devices[d], cacheDirectory(NULL), source, length, options);
+            if(program == NULL) {
+                clReleaseContext(context);
+                continue;
+            }
   
-        /* Query the program as to how many kernels were detected */
-        cl_uint numOfKernels;
-        error = clCreateKernelsInProgram(program, 0, NULL, &numOfKernels);
-        if (error != CL_SUCCESS) {
-            perror("Unable to retrieve kernel count from program");
-            exit(1);
-        }
-        cl_kernel* kernels = (cl_kernel*) alloca(sizeof(cl_kernel) * numOfKernels);
-        error = clCreateKernelsInProgram(program, numOfKernels, kernels, NULL);
-        for(cl_uint i = 0; i < numOfKernels; i++) {
-            char kernelName[32];
-            cl_uint argCnt;
-            clGetKernelInfo(kernels[i], CL_KERNEL_FUNCTION_NAME, sizeof(kernelName), kernelName, NULL);
-            clGetKernelInfo(kernels[i], CL_KERNEL_NUM_ARGS, sizeof(argCnt), &argCnt, NULL);
-            printf("Kernel name: %s with arity: %d\n", kernelName, argCnt);
-        }
-
-        /* Clean up */
-        for(cl_uint i = 0; i < numOfKernels; i++) { clReleaseKernel(kernels[i]); }
-        for(i=0; i< NUMBER_OF_FILES; i++) { free(buffer[i]); }
-        clReleaseProgram(program);
-        clReleaseContext(context);
+            /* Query the program as to how many kernels were detected */
+            cl_uint numOfKernels;
+            error = clCreateKernelsInProgram(program, 0, NULL, &numOfKernels);
+            if (error != CL_SUCCESS) {
+                perror("Unable to retrieve kernel count from program");
+                exit(1);
+            }
+            cl_kernel* kernels = (cl_kernel*) malloc(sizeof(cl_kernel) * numOfKernels);
+            error = clCreateKernelsInProgram(program, numOfKernels, kernels, NULL);
+            for(cl_uint k = 0; k < numOfKernels; k++)
+                reportKernel(kernels[k], &dev, devices[d], localPerItem);
+
+            /* Clean up */
+            for(cl_uint k = 0; k < numOfKernels; k++) { clReleaseKernel(kernels[k]); }
+            free(kernels);
+            clReleaseProgram(program);
+            clReleaseContext(context);
+       }
+
+       free(devices);
    }
+
+   free(source);
 }
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <alloca.h>
+#include <string.h>
 
 #ifdef APPLE
 #include <OpenCL/cl.h>
@@ -9,6 +10,8 @@
 #include <CL/cl.h>
 #endif
 
+#include "op_batch.h"
+
 void loadProgramSource(const char** files,
                        size_t length,
                        char** buffer,
@@ -30,6 +33,94 @@ void loadProgramSource(const char** files,
 	   }
 }
 
+/*
+ Runs 'numOps' independent ops of 'n' elements each, first with one kernel
+ launch per op and then as one batch on the persistent kernel, checks that
+ both give the same results and prints the time per op.
+ */
+void benchmarkTinyOps(cl_context context, cl_device_id device, cl_uint numOps, cl_uint n) {
+    cl_int error;
+    cl_command_queue queue = clCreateCommandQueue(context, device, 0, &error);
+    if (error != CL_SUCCESS) {
+        perror("Unable to create command-queue");
+        exit(1);
+    }
+
+    /* the pool holds the two inputs followed by one output per op */
+    size_t poolSize = (size_t)(2 + numOps) * n;
+    float* host = (float*) calloc(poolSize, sizeof(float));
+    float* reference = (float*) malloc(sizeof(float) * numOps * n);
+    for(size_t i = 0; i < 2 * (size_t)n; i++) host[i] = (float)(i % 97) / 8;
+
+    cl_mem data = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                                 sizeof(float) * poolSize, host, &error);
+    if (error != CL_SUCCESS) {
+        perror("Unable to create buffer object");
+        exit(1);
+    }
+
+    OpBatch batch;
+    if (!opBatchInit(&batch, context, device, queue, data, numOps)) {
+        perror("Unable to set up the op batch");
+        exit(1);
+    }
+
+    /* warm up both kernels */
+    opSingle(&batch, OP_COPY, 2 * n, 0, 0, 0, n);
+    opBatchAdd(&batch, OP_COPY, 2 * n, 0, 0, 0, n);
+    opBatchFlush(&batch, NULL);
+    clFinish(queue);
+
+    double start = opBatchTime();
+    for(cl_uint k = 0; k < numOps; k++) {
+        error = opSingle(&batch, (OpCode)(k % 5), (2 + k) * n, 0, n, 0.5f + k, n);
+        if (error != CL_SUCCESS) {
+            perror("Unable to enqueue the op");
+            exit(1);
+        }
+    }
+    clFinish(queue);
+    double single = opBatchTime() - start;
+
+    clEnqueueReadBuffer(queue, data, CL_TRUE, sizeof(float) * 2 * n, sizeof(float) * numOps * n,
+                        reference, 0, NULL, NULL);
+    clEnqueueWriteBuffer(queue, data, CL_TRUE, sizeof(float) * 2 * n, sizeof(float) * numOps * n,
+                         host + 2 * n, 0, NULL, NULL);
+
+    start = opBatchTime();
+    for(cl_uint k = 0; k < numOps; k++)
+        opBatchAdd(&batch, (OpCode)(k % 5), (2 + k) * n, 0, n, 0.5f + k, n);
+    error = opBatchFlush(&batch, NULL);
+    if (error != CL_SUCCESS) {
+        perror("Unable to enqueue the op batch");
+        exit(1);
+    }
+    clFinish(queue);
+    double batched = opBatchTime() - start;
+
+    clEnqueueReadBuffer(queue, data, CL_TRUE, sizeof(float) * 2 * n, sizeof(float) * numOps * n,
+                        host + 2 * n, 0, NULL, NULL);
+    size_t mismatches = 0;
+    for(size_t i = 0; i < (size_t)numOps * n; i++)
+        if (host[2 * n + i] != reference[i]) mismatches++;
+
+    printf("%u ops of %u elements: %.2f us per op with one launch each, %.2f us per op batched (%.1fx)\n",
+           numOps, n, single / numOps * 1e6, batched / numOps * 1e6, single / batched);
+    if (mismatches) printf("Batched results differ in %lu elements!\n", (unsigned long)mismatches);
+
+    opBatchRelease(&batch);
+    clReleaseMemObject(data);
+    clReleaseCommandQueue(queue);
+    free(reference);
+    free(host);
+}
+
+/*
+ Usage: KernelQueue [--tiny [ops [elements]]]
+
+ With --tiny the launch overhead of many small vector ops is compared with
+ running them as one batch (op_batch.h), 1000 ops of 4096 elements by default.
+ */
 int main(int argc, char** argv) {
 
    /* OpenCL 1.1 data structures */
@@ -42,6 +133,10 @@ int main(int argc, char** argv) {
    cl_uint numOfPlatforms;
    cl_int  error;
 
+   int tiny = argc > 1 && strcmp(argv[1], "--tiny") == 0;
+   cl_uint tinyOps = argc > 2 ? (cl_uint)atoi(argv[2]) : 1000;
+   cl_uint tinySize = argc > 3 ? (cl_uint)atoi(argv[3]) : 4096;
+
    /* 
       Get the number of platforms 
       Remember that for each vendor's SDK installed on the computer,
@@ -155,10 +250,12 @@ int main(int argc, char** argv) {
             clReleaseCommandQueue(cQ);
         }
 
+        if (tiny) benchmarkTinyOps(context, device, tinyOps, tinySize);
+
         /* Clean up */
         
-        for(cl_uint i = 0; i < numOfKernels; i++) { clReleaseKernel(kernels[i]); }
-        for(i=0; i< NUMBER_OF_FILES; i++) { free(buffer[i]); }
+        for(cl_uint k = 0; k < numOfKernels; k++) { clReleaseKernel(kernels[k]); }
+        for(int f = 0; f < NUMBER_OF_FILES; f++) { free(buffer[f]); }
         clReleaseProgram(program);
         clReleaseContext(context);
    }
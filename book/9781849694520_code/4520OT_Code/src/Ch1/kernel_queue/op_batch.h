@@ -0,0 +1,233 @@
+#ifndef OP_BATCH_H
+#define OP_BATCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
+
+#include "program_cache.h"
+
+/**
+ * Batched execution of tiny vector operations.
+ *
+ * A vector op on a few thousand elements finishes long before the
+ * clEnqueueNDRangeKernel that started it has paid for itself, so a stream of
+ * such ops is bound by launch overhead. Here the ops are recorded on the
+ * host as descriptors (opcode, length, scalar and the offsets of the
+ * operands in one pool buffer) and executed by a single launch of a
+ * persistent kernel: a pool of work-groups, a few per compute unit, where
+ * each group takes the next descriptor from the table through an atomic
+ * counter and runs it, until the table is empty. Long and short ops thus
+ * balance across the groups without any host involvement.
+ *
+ * The ops of one batch run concurrently, in no particular order, so they
+ * must be independent: an op may not read what another op of the same batch
+ * writes. Dependent ops go to the next batch (opBatchFlush() in between).
+ */
+
+#define OP_BATCH_LOCAL_SIZE 256
+#define OP_BATCH_GROUPS_PER_CU 4
+
+typedef enum {
+    OP_COPY,   // dst = x
+    OP_SCALE,  // dst = alpha * x
+    OP_ADD,    // dst = x + y
+    OP_AXPY,   // dst = alpha * x + y
+    OP_MUL     // dst = x * y
+} OpCode;
+
+/* Layout shared with the OpDescriptor of the kernel source below. */
+typedef struct {
+    cl_uint  op;
+    cl_uint  n;
+    cl_uint  dst;   // offsets into the pool, in floats
+    cl_uint  x;
+    cl_uint  y;
+    cl_float alpha;
+    cl_uint  pad[2];
+} OpDescriptor;
+
+typedef struct {
+    cl_context       context;
+    cl_command_queue queue;
+    cl_program       program;
+    cl_kernel        pool;     // persistent kernel
+    cl_kernel        single;   // one launch per op, for comparison
+    cl_mem           data;     // the pool buffer every op refers to
+    cl_mem           table;
+    cl_mem           counter;
+    OpDescriptor*    ops;
+    cl_uint          count;
+    cl_uint          capacity;
+    size_t           localSize;
+    size_t           groups;
+} OpBatch;
+
+static const char opBatchSource[] =
+    "typedef struct { uint op, n, dst, x, y; float alpha; uint pad0, pad1; } OpDescriptor;\n"
+    "float apply(global const float* data, OpDescriptor d, uint j) {\n"
+    "    float x = data[d.x + j];\n"
+    "    switch(d.op) {\n"
+    "        case 0: return x;\n"
+    "        case 1: return d.alpha * x;\n"
+    "        case 2: return x + data[d.y + j];\n"
+    "        case 3: return d.alpha * x + data[d.y + j];\n"
+    "        default: return x * data[d.y + j];\n"
+    "    }\n"
+    "}\n"
+    "kernel void op_pool(global float* data, global const OpDescriptor* ops, uint count,\n"
+    "                    global volatile uint* next) {\n"
+    "    local uint current;\n"
+    "    for(;;) {\n"
+    "        if (get_local_id(0) == 0) current = atomic_inc(next);\n"
+    "        barrier(CLK_LOCAL_MEM_FENCE);\n"
+    "        uint i = current;\n"
+    "        barrier(CLK_LOCAL_MEM_FENCE);\n"
+    "        if (i >= count) return;\n"
+    "        OpDescriptor d = ops[i];\n"
+    "        for(uint j = get_local_id(0); j < d.n; j += get_local_size(0))\n"
+    "            data[d.dst + j] = apply(data, d, j);\n"
+    "    }\n"
+    "}\n"
+    "kernel void op_single(global float* data, uint op, uint n, uint dst, uint x, uint y, float alpha) {\n"
+    "    OpDescriptor d = {op, n, dst, x, y, alpha, 0, 0};\n"
+    "    uint j = get_global_id(0);\n"
+    "    if (j < n) data[dst + j] = apply(data, d, j);\n"
+    "}\n";
+
+double opBatchTime() {
+#ifdef _WIN32
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (double)now.QuadPart / freq.QuadPart;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + 1e-6 * tv.tv_usec;
+#endif
+}
+
+/*
+ Sets up a batch of up to 'capacity' ops on the pool buffer 'data'. The
+ number of work-groups in the persistent pool is OP_BATCH_GROUPS_PER_CU
+ per compute unit. Returns 0 on failure.
+ */
+int opBatchInit(OpBatch* batch, cl_context context, cl_device_id device, cl_command_queue queue,
+                cl_mem data, cl_uint capacity) {
+    cl_int error;
+    cl_uint computeUnits = 1;
+    size_t maxLocal = OP_BATCH_LOCAL_SIZE;
+
+    memset(batch, 0, sizeof(*batch));
+    batch->context  = context;
+    batch->queue    = queue;
+    batch->data     = data;
+    batch->capacity = capacity;
+
+    batch->program = buildCachedProgram(context, device, cacheDirectory(NULL),
+                                        opBatchSource, strlen(opBatchSource), NULL);
+    if (batch->program == NULL) return 0;
+
+    batch->pool = clCreateKernel(batch->program, "op_pool", &error);
+    if (error != CL_SUCCESS) return 0;
+    batch->single = clCreateKernel(batch->program, "op_single", &error);
+    if (error != CL_SUCCESS) return 0;
+
+    clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(computeUnits), &computeUnits, NULL);
+    clGetKernelWorkGroupInfo(batch->pool, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(maxLocal), &maxLocal, NULL);
+    batch->localSize = maxLocal < OP_BATCH_LOCAL_SIZE ? maxLocal : OP_BATCH_LOCAL_SIZE;
+    batch->groups    = computeUnits * OP_BATCH_GROUPS_PER_CU;
+
+    batch->ops     = (OpDescriptor*) malloc(sizeof(OpDescriptor) * capacity);
+    batch->table   = clCreateBuffer(context, CL_MEM_READ_ONLY, sizeof(OpDescriptor) * capacity, NULL, &error);
+    if (error != CL_SUCCESS) return 0;
+    batch->counter = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint), NULL, &error);
+    if (error != CL_SUCCESS) return 0;
+
+    return 1;
+}
+
+/* Records an op. Returns 0 when the batch is full and has to be flushed first. */
+int opBatchAdd(OpBatch* batch, OpCode op, cl_uint dst, cl_uint x, cl_uint y, float alpha, cl_uint n) {
+    if (batch->count == batch->capacity) return 0;
+
+    OpDescriptor* d = &batch->ops[batch->count++];
+    d->op     = op;
+    d->n      = n;
+    d->dst    = dst;
+    d->x      = x;
+    d->y      = y;
+    d->alpha  = alpha;
+    d->pad[0] = d->pad[1] = 0;
+    return 1;
+}
+
+/*
+ Uploads the recorded ops and enqueues the persistent kernel that runs them.
+ The batch is empty again afterwards; the descriptor upload is blocking, so
+ the host table may be refilled right away.
+ */
+cl_int opBatchFlush(OpBatch* batch, cl_event* event) {
+    static const cl_uint zero = 0;
+    cl_int error;
+
+    if (batch->count == 0) return CL_SUCCESS;
+
+    error  = clEnqueueWriteBuffer(batch->queue, batch->table, CL_TRUE, 0,
+                                  sizeof(OpDescriptor) * batch->count, batch->ops, 0, NULL, NULL);
+    error |= clEnqueueWriteBuffer(batch->queue, batch->counter, CL_TRUE, 0,
+                                  sizeof(cl_uint), &zero, 0, NULL, NULL);
+
+    error |= clSetKernelArg(batch->pool, 0, sizeof(cl_mem), &batch->data);
+    error |= clSetKernelArg(batch->pool, 1, sizeof(cl_mem), &batch->table);
+    error |= clSetKernelArg(batch->pool, 2, sizeof(cl_uint), &batch->count);
+    error |= clSetKernelArg(batch->pool, 3, sizeof(cl_mem), &batch->counter);
+    if (error != CL_SUCCESS) return error;
+
+    /* no more groups than ops: the extra ones would only bump the counter */
+    size_t groups = batch->groups < batch->count ? batch->groups : batch->count;
+    size_t global = groups * batch->localSize;
+
+    error = clEnqueueNDRangeKernel(batch->queue, batch->pool, 1, NULL, &global, &batch->localSize,
+                                   0, NULL, event);
+    batch->count = 0;
+    return error;
+}
+
+/* Enqueues one op on its own, the way it runs without batching. */
+cl_int opSingle(OpBatch* batch, OpCode op, cl_uint dst, cl_uint x, cl_uint y, float alpha, cl_uint n) {
+    cl_uint code = op;
+    cl_int error;
+
+    error  = clSetKernelArg(batch->single, 0, sizeof(cl_mem), &batch->data);
+    error |= clSetKernelArg(batch->single, 1, sizeof(cl_uint), &code);
+    error |= clSetKernelArg(batch->single, 2, sizeof(cl_uint), &n);
+    error |= clSetKernelArg(batch->single, 3, sizeof(cl_uint), &dst);
+    error |= clSetKernelArg(batch->single, 4, sizeof(cl_uint), &x);
+    error |= clSetKernelArg(batch->single, 5, sizeof(cl_uint), &y);
+    error |= clSetKernelArg(batch->single, 6, sizeof(cl_float), &alpha);
+    if (error != CL_SUCCESS) return error;
+
+    size_t global = (n + batch->localSize - 1) / batch->localSize * batch->localSize;
+    return clEnqueueNDRangeKernel(batch->queue, batch->single, 1, NULL, &global, &batch->localSize,
+                                  0, NULL, NULL);
+}
+
+void opBatchRelease(OpBatch* batch) {
+    if (batch->counter) clReleaseMemObject(batch->counter);
+    if (batch->table)   clReleaseMemObject(batch->table);
+    if (batch->single)  clReleaseKernel(batch->single);
+    if (batch->pool)    clReleaseKernel(batch->pool);
+    if (batch->program) clReleaseProgram(batch->program);
+    free(batch->ops);
+    memset(batch, 0, sizeof(*batch));
+}
+
+#endif
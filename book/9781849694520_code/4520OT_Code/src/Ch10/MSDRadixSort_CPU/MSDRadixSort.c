@@ -0,0 +1,10 @@
+/*
+ MSD radix sort of 2^argv[1] keys of each test distribution, on argv[2]
+ threads (all of them by default).
+*/
+#include "msdradixsort.h"
+#include "sort_driver.h"
+
+int main(int argc, char** argv) {
+    return sortDriver(&msdRadixSortCPU, argc, argv);
+}
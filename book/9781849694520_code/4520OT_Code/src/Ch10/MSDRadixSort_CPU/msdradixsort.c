@@ -0,0 +1,164 @@
+/*
+ In-place MSD radix sort of unsigned integers (American flag sort,
+ McIlroy, Bostic and McIlroy, 1993).
+
+ 1. The keys are counted per value of the current byte and the bucket
+    boundaries are the prefix sums of the counts.
+ 2. Every key is moved to the head of its bucket, and the key it displaces
+    is carried on to its own bucket, until a key lands in the bucket being
+    filled: a permutation by cycles, with no scratch array.
+ 3. Each bucket is sorted on the next byte. Small buckets, where counting
+    256 values costs more than the keys themselves, use insertion sort, and
+    a byte shared by all the keys of a bucket costs only the counting pass.
+*/
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "msdradixsort.h"
+
+#define MSD_INSERTION_CUTOFF 32
+/* Below this, the first byte is not worth splitting between threads */
+#define MIN_PARALLEL (1 << 16)
+
+#define DIGIT(key, shift) (((key) >> (shift)) & R_MASK)
+
+static void insertionSort(unsigned int* a, size_t n) {
+    for(size_t i = 1; i < n; ++i) {
+        unsigned int v = a[i];
+        size_t j = i;
+        for(; j > 0 && a[j - 1] > v; --j) a[j] = a[j - 1];
+        a[j] = v;
+    }
+}
+
+/* Permutes a into its buckets of the byte at shift; bounds[b] is where bucket b starts */
+static void partition(unsigned int* a, size_t n, int shift, size_t* bounds) {
+    size_t head[R];
+    size_t count[R] = {0};
+
+    for(size_t i = 0; i < n; ++i) count[DIGIT(a[i], shift)]++;
+
+    bounds[0] = 0;
+    for(int b = 0; b < R; ++b) {
+        bounds[b + 1] = bounds[b] + count[b];
+        head[b] = bounds[b];
+    }
+
+    for(int b = 0; b < R; ++b) {
+        while(head[b] < bounds[b + 1]) {
+            unsigned int v = a[head[b]];
+            unsigned int d;
+            while((d = DIGIT(v, shift)) != (unsigned int)b) {
+                unsigned int t = a[head[d]];
+                a[head[d]++] = v;
+                v = t;
+            }
+            a[head[b]++] = v;
+        }
+    }
+}
+
+static void flagSort(unsigned int* a, size_t n, int shift) {
+    size_t bounds[R + 1];
+
+    for(;;) {
+        if(n <= MSD_INSERTION_CUTOFF) {
+            insertionSort(a, n);
+            return;
+        }
+        partition(a, n, shift, bounds);
+        if(shift == 0) return;
+        shift -= bitsbyte;
+
+        /* a single bucket is sorted on the next byte without recursion */
+        int b = DIGIT(a[0], shift + bitsbyte);
+        if(bounds[b + 1] - bounds[b] == n) continue;
+
+        for(b = 0; b < R; ++b)
+            if(bounds[b + 1] - bounds[b] > 1)
+                flagSort(a + bounds[b], bounds[b + 1] - bounds[b], shift);
+        return;
+    }
+}
+
+typedef struct {
+    unsigned int*   keys;
+    const size_t*   bounds;
+    const int*      order;    /* buckets of the first byte, largest first */
+    int             next;     /* next bucket of order to sort */
+    int             shift;
+    pthread_mutex_t lock;
+} shared_t;
+
+static void* bucketWorker(void* arg) {
+    shared_t* s = (shared_t*)arg;
+    for(;;) {
+        pthread_mutex_lock(&s->lock);
+        int i = s->next < R ? s->next++ : R;
+        pthread_mutex_unlock(&s->lock);
+        if(i == R) return NULL;
+
+        int b = s->order[i];
+        size_t n = s->bounds[b + 1] - s->bounds[b];
+        if(n > 1) flagSort(s->keys + s->bounds[b], n, s->shift);
+    }
+}
+
+int msdRadixSort(unsigned int* keys, size_t length, unsigned int threads) {
+    int top = (int)(sizeof(unsigned int) * bitsbyte) - bitsbyte;
+
+    if(!threads) {
+        long p = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = p > 0 ? (unsigned int)p : 1;
+    }
+    if(threads == 1 || length < MIN_PARALLEL) {
+        flagSort(keys, length, top);
+        return 0;
+    }
+
+    size_t bounds[R + 1];
+    int order[R];
+    partition(keys, length, top, bounds);
+
+    /* largest buckets first so that no thread is left with a big one at the end */
+    for(int b = 0; b < R; ++b) {
+        int i = b;
+        for(; i > 0 && bounds[order[i - 1] + 1] - bounds[order[i - 1]] < bounds[b + 1] - bounds[b]; --i)
+            order[i] = order[i - 1];
+        order[i] = b;
+    }
+
+    shared_t s = {keys, bounds, order, 0, top - bitsbyte};
+    pthread_mutex_init(&s.lock, NULL);
+
+    pthread_t* ids = (pthread_t*)malloc((threads - 1) * sizeof(pthread_t));
+    unsigned int spawned = 0;
+    while(ids && spawned + 1 < threads &&
+          pthread_create(&ids[spawned], NULL, bucketWorker, &s) == 0)
+        ++spawned;
+
+    bucketWorker(&s);
+
+    for(unsigned int t = 0; t < spawned; ++t) pthread_join(ids[t], NULL);
+    free(ids);
+    pthread_mutex_destroy(&s.lock);
+    return 0;
+}
+
+static void* msdCreate(unsigned int threads) {
+    unsigned int* state = (unsigned int*)malloc(sizeof(unsigned int));
+    if(state) *state = threads;
+    return state;
+}
+
+static int msdSort(void* state, unsigned int* keys, size_t length) {
+    return msdRadixSort(keys, length, *(unsigned int*)state);
+}
+
+const SortAlgorithm msdRadixSortCPU = {
+    "msd_radix_cpu", "CPU", msdCreate, msdSort, free
+};
@@ -0,0 +1,28 @@
+#ifndef MSDRADIXSORT_H
+#define MSDRADIXSORT_H
+
+#include <stddef.h>
+#include "sort_interface.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ Sorts length keys in ascending order in place, most significant byte
+ first. Each bucket is permuted in place (American flag sort) and sorted
+ recursively on the next byte; buckets of at most MSD_INSERTION_CUTOFF keys
+ are finished by insertion sort. The buckets of the first byte are shared
+ between the threads; threads = 0 uses all online processors.
+ Returns 0.
+*/
+int msdRadixSort(unsigned int* keys, size_t length, unsigned int threads);
+
+/* msdRadixSort behind the common sort interface */
+extern const SortAlgorithm msdRadixSortCPU;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,10 @@
+/*
+ GPU quicksort of 2^argv[1] keys of each test distribution, on the first
+ GPU of the first platform.
+*/
+#include "quicksort.h"
+#include "sort_driver.h"
+
+int main(int argc, char** argv) {
+    return sortDriver(&quickSortGPU, argc, argv);
+}
@@ -0,0 +1,135 @@
+/*
+ GPU quicksort (after Cederman and Tsigas, "GPU-Quicksort", 2009).
+
+ Segments longer than TILE keys are partitioned around a pivot by all the
+ work-groups at once, each group taking BLOCK_KEYS keys of a segment; the
+ host lays out the blocks and turns the counts of each block into its
+ output offsets. Segments of at most TILE keys are sorted by a single
+ work-group with a bitonic network in local memory.
+
+ GROUP_SIZE and TILE (a power of two) are set by the host at build time.
+*/
+#ifndef GROUP_SIZE
+#define GROUP_SIZE 256
+#endif
+#ifndef TILE
+#define TILE 2048
+#endif
+
+// Median of the first, middle and last key of each segment [x, y)
+__kernel void choosePivots(__global const uint* data,
+                           __global const uint2* segments,
+                           __global uint* pivots,
+                           uint count) {
+    uint i = get_global_id(0);
+    if (i >= count) return;
+
+    uint2 s = segments[i];
+    uint a = data[s.x];
+    uint b = data[s.x + (s.y - s.x) / 2];
+    uint c = data[s.y - 1];
+    pivots[i] = max(min(a, b), min(max(a, b), c));
+}
+
+// Keys of block [y, z) of segment x less than and greater than its pivot
+__kernel __attribute__((reqd_work_group_size(GROUP_SIZE, 1, 1)))
+void countPartitions(__global const uint* data,
+                     __global const uint4* blocks,
+                     __global const uint* pivots,
+                     __global uint2* counts) {
+    __local uint2 sums[GROUP_SIZE];
+
+    uint  lid   = get_local_id(0);
+    uint4 block = blocks[get_group_id(0)];
+    uint  pivot = pivots[block.x];
+
+    uint2 c = (uint2)(0, 0);
+    for(uint i = block.y + lid; i < block.z; i += GROUP_SIZE) {
+        uint v = data[i];
+        c.x += v < pivot;
+        c.y += v > pivot;
+    }
+    sums[lid] = c;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for(uint s = GROUP_SIZE / 2; s > 0; s >>= 1) {
+        if (lid < s) sums[lid] += sums[lid + s];
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    if (lid == 0) counts[get_group_id(0)] = sums[0];
+}
+
+// Writes the keys of each block to its less, equal and greater offsets
+__kernel __attribute__((reqd_work_group_size(GROUP_SIZE, 1, 1)))
+void scatterPartitions(__global const uint* data,
+                       __global uint* out,
+                       __global const uint4* blocks,
+                       __global const uint* pivots,
+                       __global const uint4* offsets) {
+    __local uint next[3];
+
+    uint  lid   = get_local_id(0);
+    uint4 block = blocks[get_group_id(0)];
+    uint  pivot = pivots[block.x];
+
+    if (lid == 0) {
+        uint4 o = offsets[get_group_id(0)];
+        next[0] = o.x;
+        next[1] = o.y;
+        next[2] = o.z;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for(uint i = block.y + lid; i < block.z; i += GROUP_SIZE) {
+        uint v = data[i];
+        uint side = v < pivot ? 0 : (v == pivot ? 1 : 2);
+        out[atomic_inc(&next[side])] = v;
+    }
+}
+
+// Copies the partitioned blocks back in place
+__kernel void copyBlocks(__global const uint* src,
+                         __global uint* dst,
+                         __global const uint4* blocks) {
+    uint4 block = blocks[get_group_id(0)];
+    for(uint i = block.y + get_local_id(0); i < block.z; i += get_local_size(0))
+        dst[i] = src[i];
+}
+
+// Sorts each segment [x, y) of at most TILE keys in local memory
+__kernel __attribute__((reqd_work_group_size(GROUP_SIZE, 1, 1)))
+void sortSegments(__global uint* data,
+                  __global const uint2* segments) {
+    __local uint tile[TILE];
+
+    uint  lid = get_local_id(0);
+    uint2 s   = segments[get_group_id(0)];
+    uint  n   = s.y - s.x;
+
+    // the network spans the next power of two, padded with the largest key
+    uint size = 2;
+    while(size < n) size <<= 1;
+
+    for(uint i = lid; i < size; i += GROUP_SIZE)
+        tile[i] = i < n ? data[s.x + i] : UINT_MAX;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for(uint k = 2; k <= size; k <<= 1) {
+        for(uint j = k >> 1; j > 0; j >>= 1) {
+            for(uint i = lid; i < size; i += GROUP_SIZE) {
+                uint p = i ^ j;
+                if (p > i) {
+                    uint a = tile[i], b = tile[p];
+                    if ((a > b) == ((i & k) == 0)) {
+                        tile[i] = b;
+                        tile[p] = a;
+                    }
+                }
+            }
+            barrier(CLK_LOCAL_MEM_FENCE);
+        }
+    }
+
+    for(uint i = lid; i < n; i += GROUP_SIZE)
+        data[s.x + i] = tile[i];
+}
@@ -0,0 +1,353 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "quicksort.h"
+
+#ifndef QUICKSORT_KERNEL_FILE
+#define QUICKSORT_KERNEL_FILE "QuickSort.cl"
+#endif
+
+/* Growable list of segments [x, y) */
+typedef struct {
+    cl_uint2* items;
+    size_t    count;
+    size_t    capacity;
+} segments_t;
+
+static int pushSegment(segments_t* list, cl_uint start, cl_uint end) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? 2 * list->capacity : 64;
+        cl_uint2* items = (cl_uint2*)realloc(list->items, capacity * sizeof(cl_uint2));
+        if (items == NULL) return -1;
+        list->items    = items;
+        list->capacity = capacity;
+    }
+    list->items[list->count].s[0] = start;
+    list->items[list->count].s[1] = end;
+    list->count++;
+    return 0;
+}
+
+/* A segment of more than one key goes to the partitions or to the local sort */
+static int addSegment(segments_t* large, segments_t* small, cl_uint start, cl_uint end) {
+    if (end - start > QUICKSORT_TILE) return pushSegment(large, start, end);
+    if (end - start > 1)              return pushSegment(small, start, end);
+    return 0;
+}
+
+static char* readSource(const char* path, size_t* size) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) return NULL;
+
+    fseek(file, 0, SEEK_END);
+    *size = ftell(file);
+    rewind(file);
+
+    char* buffer = (char*)malloc(*size + 1);
+    buffer[*size] = '\0';
+    *size = fread(buffer, sizeof(char), *size, file);
+    fclose(file);
+    return buffer;
+}
+
+cl_int quickSortInit(QuickSortGPU* qs, cl_context context, cl_device_id device,
+                     cl_command_queue queue, const char* source) {
+    cl_int error;
+    size_t size;
+    char options[64];
+
+    memset(qs, 0, sizeof(*qs));
+    qs->context = context;
+    qs->queue   = queue;
+
+    char* text = readSource(source, &size);
+    if (text == NULL) {
+        perror("Couldn't read the program file");
+        return CL_INVALID_VALUE;
+    }
+
+    qs->program = clCreateProgramWithSource(context, 1, (const char**)&text, &size, &error);
+    free(text);
+    if (error != CL_SUCCESS) return error;
+
+    sprintf(options, "-DGROUP_SIZE=%d -DTILE=%d", QUICKSORT_GROUP_SIZE, QUICKSORT_TILE);
+    error = clBuildProgram(qs->program, 1, &device, options, NULL, NULL);
+    if (error != CL_SUCCESS) {
+        size_t length;
+        clGetProgramBuildInfo(qs->program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &length);
+        char* log = (char*)malloc(length + 1);
+        clGetProgramBuildInfo(qs->program, device, CL_PROGRAM_BUILD_LOG, length, log, NULL);
+        log[length] = '\0';
+        printf("%s\n", log);
+        free(log);
+        return error;
+    }
+
+    qs->choosePivots      = clCreateKernel(qs->program, "choosePivots", &error);
+    if (error != CL_SUCCESS) return error;
+    qs->countPartitions   = clCreateKernel(qs->program, "countPartitions", &error);
+    if (error != CL_SUCCESS) return error;
+    qs->scatterPartitions = clCreateKernel(qs->program, "scatterPartitions", &error);
+    if (error != CL_SUCCESS) return error;
+    qs->copyBlocks        = clCreateKernel(qs->program, "copyBlocks", &error);
+    if (error != CL_SUCCESS) return error;
+    qs->sortSegments      = clCreateKernel(qs->program, "sortSegments", &error);
+    return error;
+}
+
+void quickSortRelease(QuickSortGPU* qs) {
+    if (qs->scratch)           clReleaseMemObject(qs->scratch);
+    if (qs->choosePivots)      clReleaseKernel(qs->choosePivots);
+    if (qs->countPartitions)   clReleaseKernel(qs->countPartitions);
+    if (qs->scatterPartitions) clReleaseKernel(qs->scatterPartitions);
+    if (qs->copyBlocks)        clReleaseKernel(qs->copyBlocks);
+    if (qs->sortSegments)      clReleaseKernel(qs->sortSegments);
+    if (qs->program)           clReleaseProgram(qs->program);
+    memset(qs, 0, sizeof(*qs));
+}
+
+/*
+ One partitioning pass over the large segments: pivots and per block counts
+ on the device, offsets on the host, then the scatter into the scratch
+ buffer and the copy back. The two sides of every segment are added to
+ large (emptied first) or small.
+*/
+static cl_int partitionPass(QuickSortGPU* qs, cl_mem keys, segments_t* large, segments_t* small) {
+    cl_int error = CL_SUCCESS;
+    size_t nseg = large->count;
+    size_t nblocks = 0;
+
+    for(size_t s = 0; s < nseg; ++s)
+        nblocks += (large->items[s].s[1] - large->items[s].s[0] + QUICKSORT_BLOCK_KEYS - 1) /
+                   QUICKSORT_BLOCK_KEYS;
+
+    cl_uint4* blocks  = (cl_uint4*)malloc(nblocks * sizeof(cl_uint4));
+    cl_uint4* offsets = (cl_uint4*)malloc(nblocks * sizeof(cl_uint4));
+    cl_uint2* counts  = (cl_uint2*)malloc(nblocks * sizeof(cl_uint2));
+    cl_uint2* segs    = (cl_uint2*)malloc(nseg * sizeof(cl_uint2));
+    cl_mem segments_d = NULL, blocks_d = NULL, pivots_d = NULL, counts_d = NULL, offsets_d = NULL;
+
+    if (!blocks || !offsets || !counts || !segs) {
+        error = CL_OUT_OF_HOST_MEMORY;
+        goto done;
+    }
+    memcpy(segs, large->items, nseg * sizeof(cl_uint2));
+
+    size_t b = 0;
+    for(size_t s = 0; s < nseg; ++s) {
+        for(cl_uint i = segs[s].s[0]; i < segs[s].s[1]; i += QUICKSORT_BLOCK_KEYS, ++b) {
+            blocks[b].s[0] = (cl_uint)s;
+            blocks[b].s[1] = i;
+            blocks[b].s[2] = segs[s].s[1] - i > QUICKSORT_BLOCK_KEYS ? i + QUICKSORT_BLOCK_KEYS
+                                                                     : segs[s].s[1];
+            blocks[b].s[3] = 0;
+        }
+    }
+
+    segments_d = clCreateBuffer(qs->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                nseg * sizeof(cl_uint2), segs, &error);
+    if (error != CL_SUCCESS) goto done;
+    blocks_d   = clCreateBuffer(qs->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                nblocks * sizeof(cl_uint4), blocks, &error);
+    if (error != CL_SUCCESS) goto done;
+    pivots_d   = clCreateBuffer(qs->context, CL_MEM_READ_WRITE, nseg * sizeof(cl_uint), NULL, &error);
+    if (error != CL_SUCCESS) goto done;
+    counts_d   = clCreateBuffer(qs->context, CL_MEM_WRITE_ONLY, nblocks * sizeof(cl_uint2), NULL, &error);
+    if (error != CL_SUCCESS) goto done;
+    offsets_d  = clCreateBuffer(qs->context, CL_MEM_READ_ONLY, nblocks * sizeof(cl_uint4), NULL, &error);
+    if (error != CL_SUCCESS) goto done;
+
+    cl_uint count    = (cl_uint)nseg;
+    size_t  group    = QUICKSORT_GROUP_SIZE;
+    size_t  global   = (nseg + group - 1) / group * group;
+    size_t  blockGlobal = nblocks * group;
+
+    clSetKernelArg(qs->choosePivots, 0, sizeof(cl_mem), &keys);
+    clSetKernelArg(qs->choosePivots, 1, sizeof(cl_mem), &segments_d);
+    clSetKernelArg(qs->choosePivots, 2, sizeof(cl_mem), &pivots_d);
+    clSetKernelArg(qs->choosePivots, 3, sizeof(cl_uint), &count);
+    error = clEnqueueNDRangeKernel(qs->queue, qs->choosePivots, 1, NULL, &global, &group, 0, NULL, NULL);
+    if (error != CL_SUCCESS) goto done;
+
+    clSetKernelArg(qs->countPartitions, 0, sizeof(cl_mem), &keys);
+    clSetKernelArg(qs->countPartitions, 1, sizeof(cl_mem), &blocks_d);
+    clSetKernelArg(qs->countPartitions, 2, sizeof(cl_mem), &pivots_d);
+    clSetKernelArg(qs->countPartitions, 3, sizeof(cl_mem), &counts_d);
+    error = clEnqueueNDRangeKernel(qs->queue, qs->countPartitions, 1, NULL, &blockGlobal, &group,
+                                   0, NULL, NULL);
+    if (error != CL_SUCCESS) goto done;
+
+    error = clEnqueueReadBuffer(qs->queue, counts_d, CL_TRUE, 0, nblocks * sizeof(cl_uint2), counts,
+                                0, NULL, NULL);
+    if (error != CL_SUCCESS) goto done;
+
+    // less keys fill each segment from its start, greater keys end at its end, blocks in order
+    large->count = 0;
+    b = 0;
+    for(size_t s = 0; s < nseg; ++s) {
+        size_t first = b;
+        cl_uint less = 0, greater = 0;
+        for(; b < nblocks && blocks[b].s[0] == s; ++b) {
+            less    += counts[b].s[0];
+            greater += counts[b].s[1];
+        }
+
+        cl_uint nextLess = segs[s].s[0];
+        cl_uint nextEqual = segs[s].s[0] + less;
+        cl_uint nextGreater = segs[s].s[1] - greater;
+        for(size_t k = first; k < b; ++k) {
+            cl_uint keysInBlock = blocks[k].s[2] - blocks[k].s[1];
+            offsets[k].s[0] = nextLess;
+            offsets[k].s[1] = nextEqual;
+            offsets[k].s[2] = nextGreater;
+            offsets[k].s[3] = 0;
+            nextLess    += counts[k].s[0];
+            nextGreater += counts[k].s[1];
+            nextEqual   += keysInBlock - counts[k].s[0] - counts[k].s[1];
+        }
+
+        if (addSegment(large, small, segs[s].s[0], segs[s].s[0] + less) ||
+            addSegment(large, small, segs[s].s[1] - greater, segs[s].s[1])) {
+            error = CL_OUT_OF_HOST_MEMORY;
+            goto done;
+        }
+    }
+
+    error = clEnqueueWriteBuffer(qs->queue, offsets_d, CL_TRUE, 0, nblocks * sizeof(cl_uint4), offsets,
+                                 0, NULL, NULL);
+    if (error != CL_SUCCESS) goto done;
+
+    clSetKernelArg(qs->scatterPartitions, 0, sizeof(cl_mem), &keys);
+    clSetKernelArg(qs->scatterPartitions, 1, sizeof(cl_mem), &qs->scratch);
+    clSetKernelArg(qs->scatterPartitions, 2, sizeof(cl_mem), &blocks_d);
+    clSetKernelArg(qs->scatterPartitions, 3, sizeof(cl_mem), &pivots_d);
+    clSetKernelArg(qs->scatterPartitions, 4, sizeof(cl_mem), &offsets_d);
+    error = clEnqueueNDRangeKernel(qs->queue, qs->scatterPartitions, 1, NULL, &blockGlobal, &group,
+                                   0, NULL, NULL);
+    if (error != CL_SUCCESS) goto done;
+
+    clSetKernelArg(qs->copyBlocks, 0, sizeof(cl_mem), &qs->scratch);
+    clSetKernelArg(qs->copyBlocks, 1, sizeof(cl_mem), &keys);
+    clSetKernelArg(qs->copyBlocks, 2, sizeof(cl_mem), &blocks_d);
+    error = clEnqueueNDRangeKernel(qs->queue, qs->copyBlocks, 1, NULL, &blockGlobal, &group,
+                                   0, NULL, NULL);
+
+done:
+    // the buffers are released once the queued kernels are done with them
+    if (segments_d) clReleaseMemObject(segments_d);
+    if (blocks_d)   clReleaseMemObject(blocks_d);
+    if (pivots_d)   clReleaseMemObject(pivots_d);
+    if (counts_d)   clReleaseMemObject(counts_d);
+    if (offsets_d)  clReleaseMemObject(offsets_d);
+    free(blocks);
+    free(offsets);
+    free(counts);
+    free(segs);
+    return error;
+}
+
+cl_int quickSortBuffer(QuickSortGPU* qs, cl_mem keys, cl_uint length) {
+    cl_int error = CL_SUCCESS;
+    segments_t large = {NULL, 0, 0}, small = {NULL, 0, 0};
+
+    if (length > QUICKSORT_TILE && qs->capacity < length) {
+        if (qs->scratch) clReleaseMemObject(qs->scratch);
+        qs->capacity = 0;
+        qs->scratch = clCreateBuffer(qs->context, CL_MEM_READ_WRITE, length * sizeof(cl_uint), NULL, &error);
+        if (error != CL_SUCCESS) {
+            qs->scratch = NULL;
+            return error;
+        }
+        qs->capacity = length;
+    }
+
+    if (addSegment(&large, &small, 0, length)) return CL_OUT_OF_HOST_MEMORY;
+
+    while(error == CL_SUCCESS && large.count > 0)
+        error = partitionPass(qs, keys, &large, &small);
+
+    if (error == CL_SUCCESS && small.count > 0) {
+        cl_mem segments_d = clCreateBuffer(qs->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                           small.count * sizeof(cl_uint2), small.items, &error);
+        if (error == CL_SUCCESS) {
+            size_t group  = QUICKSORT_GROUP_SIZE;
+            size_t global = small.count * group;
+            clSetKernelArg(qs->sortSegments, 0, sizeof(cl_mem), &keys);
+            clSetKernelArg(qs->sortSegments, 1, sizeof(cl_mem), &segments_d);
+            error = clEnqueueNDRangeKernel(qs->queue, qs->sortSegments, 1, NULL, &global, &group,
+                                           0, NULL, NULL);
+            clReleaseMemObject(segments_d);
+        }
+    }
+
+    if (error == CL_SUCCESS) error = clFinish(qs->queue);
+
+    free(large.items);
+    free(small.items);
+    return error;
+}
+
+/* State of quickSortGPU: the context and queue it owns around the sorter */
+typedef struct {
+    cl_context       context;
+    cl_command_queue queue;
+    QuickSortGPU     qs;
+} gpu_state_t;
+
+static void gpuDestroy(void* state) {
+    gpu_state_t* g = (gpu_state_t*)state;
+    if (g == NULL) return;
+    quickSortRelease(&g->qs);
+    if (g->queue)   clReleaseCommandQueue(g->queue);
+    if (g->context) clReleaseContext(g->context);
+    free(g);
+}
+
+static void* gpuCreate(unsigned int threads) {
+    cl_platform_id platform;
+    cl_device_id   device;
+    cl_int         error;
+
+    (void)threads;
+    if (clGetPlatformIDs(1, &platform, NULL) != CL_SUCCESS) return NULL;
+    if (clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &device, NULL) != CL_SUCCESS &&
+        clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 1, &device, NULL) != CL_SUCCESS)
+        return NULL;
+
+    gpu_state_t* g = (gpu_state_t*)calloc(1, sizeof(gpu_state_t));
+    if (g == NULL) return NULL;
+
+    g->context = clCreateContext(NULL, 1, &device, NULL, NULL, &error);
+    if (error != CL_SUCCESS) { g->context = NULL; gpuDestroy(g); return NULL; }
+    g->queue = clCreateCommandQueue(g->context, device, 0, &error);
+    if (error != CL_SUCCESS) { g->queue = NULL; gpuDestroy(g); return NULL; }
+
+    if (quickSortInit(&g->qs, g->context, device, g->queue, QUICKSORT_KERNEL_FILE) != CL_SUCCESS) {
+        gpuDestroy(g);
+        return NULL;
+    }
+    return g;
+}
+
+static int gpuSort(void* state, unsigned int* keys, size_t length) {
+    gpu_state_t* g = (gpu_state_t*)state;
+    cl_int error;
+
+    if (length < 2) return 0;
+    if (length > 0xFFFFFFFFu) return -1;
+
+    cl_mem buffer = clCreateBuffer(g->context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                                   length * sizeof(cl_uint), keys, &error);
+    if (error != CL_SUCCESS) return -1;
+
+    error = quickSortBuffer(&g->qs, buffer, (cl_uint)length);
+    if (error == CL_SUCCESS)
+        error = clEnqueueReadBuffer(g->queue, buffer, CL_TRUE, 0, length * sizeof(cl_uint), keys,
+                                    0, NULL, NULL);
+    clReleaseMemObject(buffer);
+    return error == CL_SUCCESS ? 0 : -1;
+}
+
+const SortAlgorithm quickSortGPU = {
+    "quicksort_gpu", "GPU", gpuCreate, gpuSort, gpuDestroy
+};
@@ -0,0 +1,59 @@
+#ifndef QUICKSORT_H
+#define QUICKSORT_H
+
+#ifdef APPLE
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+#include "sort_interface.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define QUICKSORT_GROUP_SIZE 256
+#define QUICKSORT_BLOCK_KEYS (QUICKSORT_GROUP_SIZE * 8)   /* keys per partitioning group */
+#define QUICKSORT_TILE       2048                         /* segments sorted in local memory */
+
+/* Kernels of QuickSort.cl and the scratch buffer of the partitions */
+typedef struct QuickSortGPU {
+    cl_context       context;
+    cl_command_queue queue;
+    cl_program       program;
+    cl_kernel        choosePivots, countPartitions, scatterPartitions, copyBlocks, sortSegments;
+    cl_mem           scratch;
+    size_t           capacity;                 /* keys in scratch */
+} QuickSortGPU;
+
+/*
+ Builds QuickSort.cl, read from source, for device and creates its kernels
+ on queue. Returns CL_SUCCESS or the first OpenCL error.
+*/
+cl_int quickSortInit(QuickSortGPU* qs, cl_context context, cl_device_id device,
+                     cl_command_queue queue, const char* source);
+
+void quickSortRelease(QuickSortGPU* qs);
+
+/*
+ Sorts the first length unsigned keys of keys in place on the device.
+ Each pass partitions every segment longer than QUICKSORT_TILE keys at
+ once and reads back one pair of counts per block to split them; the
+ remaining segments are then sorted by one work-group each. Returns when
+ keys is sorted.
+*/
+cl_int quickSortBuffer(QuickSortGPU* qs, cl_mem keys, cl_uint length);
+
+/*
+ quickSortBuffer behind the common sort interface, on the first GPU (or
+ else the first device) of the first platform, with the kernels read from
+ QUICKSORT_KERNEL_FILE.
+*/
+extern const SortAlgorithm quickSortGPU;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,146 @@
+/*
+ Parallel LSD radix sort of unsigned integers, the counting sort of
+ "Radix Sort for Vector Multiprocessors" (Zagha and Blelloch) that
+ RadixSort_GPU runs on the device, with threads in place of work-groups.
+
+ 1. Each thread builds the histogram of the current byte over its chunk.
+ 2. The histograms are scanned digit by digit and, within a digit, thread
+    by thread, which gives every thread the place of its first key of each
+    digit in the output.
+ 3. Each thread writes its keys to those places in order, which keeps the
+    sort stable, and the next pass reads the output.
+*/
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "lsdradixsort.h"
+
+/* Fewer keys per thread than this don't pay for its start-up */
+#define MIN_CHUNK (1 << 15)
+
+#define DIGIT(key, shift) (((key) >> (shift)) & R_MASK)
+
+typedef struct {
+    const unsigned int* src;
+    unsigned int*       dst;
+    size_t              begin;  /* chunk of the thread */
+    size_t              end;
+    int                 shift;
+    size_t              count[R];
+} task_t;
+
+static void* countWorker(void* arg) {
+    task_t* t = (task_t*)arg;
+    memset(t->count, 0, sizeof(t->count));
+    for(size_t i = t->begin; i < t->end; ++i) t->count[DIGIT(t->src[i], t->shift)]++;
+    return NULL;
+}
+
+/* count holds the output offsets of the thread by then */
+static void* scatterWorker(void* arg) {
+    task_t* t = (task_t*)arg;
+    for(size_t i = t->begin; i < t->end; ++i) {
+        unsigned int v = t->src[i];
+        t->dst[t->count[DIGIT(v, t->shift)]++] = v;
+    }
+    return NULL;
+}
+
+/* Runs the tasks on their own threads, the last one on the calling thread */
+static void runTasks(void* (*worker)(void*), task_t* tasks, unsigned int count) {
+    pthread_t* ids = (pthread_t*)malloc(count * sizeof(pthread_t));
+    int* spawned = (int*)calloc(count, sizeof(int));
+
+    for(unsigned int t = 0; t + 1 < count; ++t)
+        spawned[t] = ids && spawned && pthread_create(&ids[t], NULL, worker, &tasks[t]) == 0;
+
+    for(unsigned int t = 0; t + 1 < count; ++t)
+        if(!spawned || !spawned[t]) worker(&tasks[t]);
+
+    worker(&tasks[count - 1]);
+
+    for(unsigned int t = 0; t + 1 < count; ++t)
+        if(spawned && spawned[t]) pthread_join(ids[t], NULL);
+
+    free(ids);
+    free(spawned);
+}
+
+int lsdRadixSort(unsigned int* keys, size_t length, unsigned int threads) {
+    size_t n = length;
+    if(n < 2) return 0;
+
+    if(!threads) {
+        long p = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = p > 0 ? (unsigned int)p : 1;
+    }
+    if(threads > (n + MIN_CHUNK - 1) / MIN_CHUNK)
+        threads = (unsigned int)((n + MIN_CHUNK - 1) / MIN_CHUNK);
+
+    unsigned int* aux = (unsigned int*)malloc(n * sizeof(unsigned int));
+    task_t* tasks = (task_t*)malloc(threads * sizeof(task_t));
+    if(!aux || !tasks) {
+        free(aux);
+        free(tasks);
+        return -1;
+    }
+
+    for(unsigned int t = 0; t < threads; ++t) {
+        tasks[t].begin = n * t / threads;
+        tasks[t].end   = n * (t + 1) / threads;
+    }
+
+    unsigned int* src = keys;
+    unsigned int* dst = aux;
+    for(int shift = 0; shift < (int)(sizeof(unsigned int) * bitsbyte); shift += bitsbyte) {
+        for(unsigned int t = 0; t < threads; ++t) {
+            tasks[t].src   = src;
+            tasks[t].dst   = dst;
+            tasks[t].shift = shift;
+        }
+        runTasks(countWorker, tasks, threads);
+
+        /* digit-major scan; a digit holding every key leaves the order as it is */
+        size_t offset = 0;
+        int skip = 0;
+        for(int d = 0; d < R && !skip; ++d) {
+            size_t start = offset;
+            for(unsigned int t = 0; t < threads; ++t) {
+                size_t c = tasks[t].count[d];
+                tasks[t].count[d] = offset;
+                offset += c;
+            }
+            skip = offset - start == n;
+        }
+        if(skip) continue;
+
+        runTasks(scatterWorker, tasks, threads);
+
+        unsigned int* tmp = src; src = dst; dst = tmp;
+    }
+
+    if(src != keys) memcpy(keys, src, n * sizeof(unsigned int));
+
+    free(aux);
+    free(tasks);
+    return 0;
+}
+
+static void* lsdCreate(unsigned int threads) {
+    unsigned int* state = (unsigned int*)malloc(sizeof(unsigned int));
+    if(state) *state = threads;
+    return state;
+}
+
+static int lsdSort(void* state, unsigned int* keys, size_t length) {
+    return lsdRadixSort(keys, length, *(unsigned int*)state);
+}
+
+const SortAlgorithm lsdRadixSortCPU = {
+    "lsd_radix_cpu", "CPU", lsdCreate, lsdSort, free
+};
@@ -0,0 +1,29 @@
+#ifndef LSDRADIXSORT_H
+#define LSDRADIXSORT_H
+
+#include <stddef.h>
+#include "sort_interface.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ Sorts length keys in ascending order, least significant byte first, with
+ one counting sort pass per byte. Every thread counts the digits of its own
+ chunk, the counts of all threads are scanned digit-major into the output
+ offsets of each thread, and each thread then scatters its chunk stably.
+ Passes on a byte that is the same for all keys are skipped.
+ threads = 0 uses all online processors.
+ Returns 0, or -1 if the scratch buffer could not be allocated.
+*/
+int lsdRadixSort(unsigned int* keys, size_t length, unsigned int threads);
+
+/* lsdRadixSort behind the common sort interface */
+extern const SortAlgorithm lsdRadixSortCPU;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
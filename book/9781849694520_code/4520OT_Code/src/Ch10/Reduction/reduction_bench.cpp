@@ -0,0 +1,132 @@
+#include <vexcl/vexcl.hpp>
+#include <boost/chrono.hpp>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <cstdlib>
+
+/*
+ Serial reduction from reduction_serial.cpp, used as the baseline.
+ */
+template<typename T, class F>
+T reduce(F f, size_t n, const T a[], T identity) {
+  T accum = identity;
+  for(size_t i = 0; i < n ; ++i)
+        accum = f(accum, a[i]);
+  return accum;
+}
+
+/*
+ User-defined reduction kind: bitwise or of integers.
+ */
+struct BITOR {
+    template <typename T>
+    static T initial() { return T(); }
+
+    template <typename T>
+    struct function : vex::UserFunction<function<T>, T(T, T)> {
+        static std::string body() { return "return prm1 | prm2;"; }
+    };
+
+    template <class Iterator>
+    static typename std::iterator_traits<Iterator>::value_type
+    reduce(Iterator begin, Iterator end) {
+        typename std::iterator_traits<Iterator>::value_type s = 0;
+        for(; begin != end; ++begin) s |= *begin;
+        return s;
+    }
+};
+
+typedef boost::chrono::high_resolution_clock clock_type;
+
+const int runs = 20;
+
+/*
+ Prints effective bandwidth of a reduction that reads n elements of type T
+ and took the given time per run.
+ */
+template <typename T>
+void report(const std::string &name, size_t n, double seconds) {
+    std::cout << "  " << std::setw(24) << std::left << name
+              << std::setw(10) << std::right << std::fixed << std::setprecision(2)
+              << n * sizeof(T) / seconds * 1e-9 << " GB/s" << std::endl;
+}
+
+template <class F>
+double timeit(F f) {
+    f(); // Warm up (and compile the kernels).
+
+    clock_type::time_point start = clock_type::now();
+    for(int i = 0; i < runs; i++) f();
+    boost::chrono::duration<double> time = clock_type::now() - start;
+
+    return time.count() / runs;
+}
+
+template <typename T, class RDC, class F>
+void compare(const vex::Context &ctx, const std::string &name,
+             const vex::vector<T> &x, const std::vector<T> &h,
+             F serial_op, T identity) {
+    vex::Reductor<T, RDC> rdc(ctx);
+
+    volatile T sink;
+    report<T>(name + " (device)", h.size(), timeit([&]{ sink = rdc(x); }));
+    report<T>(name + " (serial)", h.size(), timeit([&]{
+                sink = reduce(serial_op, h.size(), h.data(), identity); }));
+}
+
+template <typename T>
+void bench(const vex::Context &ctx, size_t n, const std::string &type) {
+    std::vector<T> h(n);
+    for(size_t i = 0; i < n; i++) h[i] = static_cast<T>(rand() % 1000);
+
+    vex::vector<T> x(ctx, h);
+
+    std::cout << type << ", n = " << n << std::endl;
+
+    compare<T, vex::SUM>(ctx, "sum", x, h,
+            [](T a, T b) { return a + b; }, T());
+    compare<T, vex::MIN>(ctx, "min", x, h,
+            [](T a, T b) { return a < b ? a : b; }, std::numeric_limits<T>::max());
+    compare<T, vex::MAX>(ctx, "max", x, h,
+            [](T a, T b) { return a > b ? a : b; }, -std::numeric_limits<T>::max());
+
+    vex::ArgReductor<T, vex::MIN> argmin(ctx);
+
+    volatile size_t sink;
+    report<T>("argmin (device)", n, timeit([&]{ sink = argmin(x); }));
+    report<T>("argmin (serial)", n, timeit([&]{
+                sink = std::min_element(h.begin(), h.end()) - h.begin(); }));
+}
+
+int main(int argc, char** argv) {
+    size_t n = argc > 1 ? atoi(argv[1]) : 1 << 24;
+
+    vex::Context ctx(vex::Filter::Env && vex::Filter::Count(1));
+
+    if (!ctx) {
+        std::cerr << "No OpenCL devices found" << std::endl;
+        return 1;
+    }
+
+    std::cout << ctx << std::endl;
+
+    bench<cl_int>(ctx, n, "int");
+    bench<cl_float>(ctx, n, "float");
+
+    if (vex::Filter::DoublePrecision(ctx.device(0)))
+        bench<cl_double>(ctx, n, "double");
+
+    // Custom reduction kind.
+    {
+        std::vector<cl_uint> h(n);
+        for(size_t i = 0; i < n; i++) h[i] = 1u << (rand() % 32);
+
+        vex::vector<cl_uint> x(ctx, h);
+
+        std::cout << "uint, n = " << n << std::endl;
+        compare<cl_uint, BITOR>(ctx, "bitwise or", x, h,
+                [](cl_uint a, cl_uint b) { return a | b; }, 0u);
+    }
+}
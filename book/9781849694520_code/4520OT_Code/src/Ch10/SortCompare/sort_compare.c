@@ -0,0 +1,131 @@
+/*
+ Runs every sort library of Ch9 and Ch10 on each key distribution of
+ sort_driver.h and reports the rate of each, best of several runs, and the
+ fastest algorithm per distribution.
+
+ Usage: SortCompare [log2 of the number of keys, 22 by default]
+                    [threads, 0 for all by default] [runs, 3 by default]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sort_driver.h"
+#include "cpusort.h"
+#include "msdradixsort.h"
+#include "lsdradixsort.h"
+#ifdef HAVE_OPENCL
+#include "quicksort.h"
+#endif
+
+static int compareKeys(const void* a, const void* b) {
+    unsigned int x = *(const unsigned int*)a, y = *(const unsigned int*)b;
+    return (x > y) - (x < y);
+}
+
+static void* threadsCreate(unsigned int threads) {
+    unsigned int* state = (unsigned int*)malloc(sizeof(unsigned int));
+    if (state) *state = threads;
+    return state;
+}
+
+static int qsortSort(void* state, unsigned int* keys, size_t length) {
+    (void)state;
+    qsort(keys, length, sizeof(unsigned int), compareKeys);
+    return 0;
+}
+
+/* cpuSort orders signed keys: flipping the sign bit maps unsigned order onto it */
+static int bitonicSort(void* state, unsigned int* keys, size_t length) {
+    if (length > 0xFFFFFFFFu) return -1;
+    for(size_t i = 0; i < length; ++i) keys[i] ^= 0x80000000u;
+    int status = cpuSort((int*)keys, (unsigned int)length, *(unsigned int*)state);
+    for(size_t i = 0; i < length; ++i) keys[i] ^= 0x80000000u;
+    return status;
+}
+
+static const SortAlgorithm qsortCPU = {
+    "qsort", "CPU", threadsCreate, qsortSort, free
+};
+
+static const SortAlgorithm bitonicSortCPU = {
+    "bitonic_merge_cpu", "CPU", threadsCreate, bitonicSort, free
+};
+
+static const SortAlgorithm* const algorithms[] = {
+    &qsortCPU, &bitonicSortCPU, &msdRadixSortCPU, &lsdRadixSortCPU,
+#ifdef HAVE_OPENCL
+    &quickSortGPU,
+#endif
+};
+
+#define ALGORITHMS (sizeof(algorithms) / sizeof(algorithms[0]))
+
+int main(int argc, char** argv) {
+    unsigned int log2keys = argc > 1 ? atoi(argv[1]) : 22;
+    unsigned int threads  = argc > 2 ? atoi(argv[2]) : 0;
+    unsigned int runs     = argc > 3 ? atoi(argv[3]) : 3;
+    size_t       length   = (size_t)1 << log2keys;
+    int          failed   = 0;
+
+    void* states[ALGORITHMS];
+    for(size_t a = 0; a < ALGORITHMS; ++a) {
+        states[a] = algorithms[a]->create(threads);
+        if (states[a] == NULL)
+            printf("%s is not available on this machine\n", algorithms[a]->name);
+    }
+
+    unsigned int* input     = (unsigned int*)malloc(length * sizeof(unsigned int));
+    unsigned int* reference = (unsigned int*)malloc(length * sizeof(unsigned int));
+    unsigned int* keys      = (unsigned int*)malloc(length * sizeof(unsigned int));
+    if (!input || !reference || !keys) {
+        printf("Couldn't allocate %lu keys\n", (unsigned long)length);
+        return 1;
+    }
+
+    printf("%lu keys, Mkeys/s, best of %u runs\n%-15s", (unsigned long)length, runs, "distribution");
+    for(size_t a = 0; a < ALGORITHMS; ++a)
+        if (states[a]) printf(" %18s", algorithms[a]->name);
+    printf("  fastest\n");
+
+    for(int d = 0; d < DIST_COUNT; ++d) {
+        sortFill(input, length, (SortDistribution)d, 2013 + d);
+        memcpy(reference, input, length * sizeof(unsigned int));
+        qsort(reference, length, sizeof(unsigned int), compareKeys);
+
+        const char* fastest = "-";
+        double bestRate = 0;
+
+        printf("%-15s", sortDistributionName((SortDistribution)d));
+        for(size_t a = 0; a < ALGORITHMS; ++a) {
+            if (states[a] == NULL) continue;
+
+            double best = -1;
+            int ok = 1;
+            for(unsigned int r = 0; r < runs && ok; ++r) {
+                double seconds = sortTime(algorithms[a], states[a], keys, input, reference, length, &ok);
+                if (ok && (best < 0 || seconds < best)) best = seconds;
+            }
+
+            if (!ok) {
+                printf(" %18s", "wrong result");
+                failed = 1;
+                continue;
+            }
+            double rate = length / best * 1e-6;
+            printf(" %18.1f", rate);
+            if (rate > bestRate) {
+                bestRate = rate;
+                fastest  = algorithms[a]->name;
+            }
+        }
+        printf("  %s\n", fastest);
+    }
+
+    for(size_t a = 0; a < ALGORITHMS; ++a)
+        if (states[a]) algorithms[a]->destroy(states[a]);
+    free(input);
+    free(reference);
+    free(keys);
+    return failed;
+}
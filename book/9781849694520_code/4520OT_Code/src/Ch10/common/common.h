@@ -0,0 +1,25 @@
+#ifndef CH10_COMMON_H
+#define CH10_COMMON_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/* Radix of the radix sorts: one byte of the key per pass */
+#ifndef bitsbyte
+#define bitsbyte 8
+#endif
+#ifndef R
+#define R (1 << bitsbyte)
+#endif
+#define R_MASK (R - 1)
+
+/* Aborts the sample with msg when an OpenCL call doesn't return the expected status */
+#define CHECK_ERROR(actual, expected, msg) \
+    do { \
+        if ((actual) != (expected)) { \
+            fprintf(stderr, "Error: %s (status %d) at %s:%d\n", msg, (int)(actual), __FILE__, __LINE__); \
+            exit(1); \
+        } \
+    } while(0)
+
+#endif
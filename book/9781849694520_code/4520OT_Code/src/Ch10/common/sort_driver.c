@@ -0,0 +1,132 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "sort_driver.h"
+
+static const char* names[DIST_COUNT] = {
+    "uniform", "narrow", "few_unique", "sorted", "reverse_sorted", "nearly_sorted", "equal"
+};
+
+const char* sortDistributionName(SortDistribution distribution) {
+    return distribution < DIST_COUNT ? names[distribution] : "unknown";
+}
+
+static unsigned int next(unsigned int* state) {
+    unsigned int x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static int compareKeys(const void* a, const void* b) {
+    unsigned int x = *(const unsigned int*)a, y = *(const unsigned int*)b;
+    return (x > y) - (x < y);
+}
+
+void sortFill(unsigned int* keys, size_t length, SortDistribution distribution, unsigned int seed) {
+    unsigned int state = seed ? seed : 1;
+    unsigned int values[16];
+
+    switch(distribution) {
+    case DIST_UNIFORM:
+        for(size_t i = 0; i < length; ++i) keys[i] = next(&state);
+        break;
+    case DIST_NARROW:
+        for(size_t i = 0; i < length; ++i) keys[i] = next(&state) & 0xFFFF;
+        break;
+    case DIST_FEW_UNIQUE:
+        for(int v = 0; v < 16; ++v) values[v] = next(&state);
+        for(size_t i = 0; i < length; ++i) keys[i] = values[next(&state) & 15];
+        break;
+    case DIST_SORTED:
+    case DIST_REVERSE_SORTED:
+    case DIST_NEARLY_SORTED:
+        for(size_t i = 0; i < length; ++i) keys[i] = next(&state);
+        qsort(keys, length, sizeof(unsigned int), compareKeys);
+        if (distribution == DIST_REVERSE_SORTED) {
+            for(size_t i = 0; i < length / 2; ++i) {
+                unsigned int t = keys[i];
+                keys[i] = keys[length - 1 - i];
+                keys[length - 1 - i] = t;
+            }
+        }
+        if (distribution == DIST_NEARLY_SORTED && length > 1) {
+            for(size_t s = 0; s < length / 200; ++s) {
+                size_t a = next(&state) % length, b = next(&state) % length;
+                unsigned int t = keys[a];
+                keys[a] = keys[b];
+                keys[b] = t;
+            }
+        }
+        break;
+    default:
+        for(size_t i = 0; i < length; ++i) keys[i] = 42;
+        break;
+    }
+}
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+double sortTime(const SortAlgorithm* algorithm, void* state, unsigned int* keys,
+                const unsigned int* input, const unsigned int* reference, size_t length, int* ok) {
+    memcpy(keys, input, length * sizeof(unsigned int));
+
+    double start = now();
+    int status = algorithm->sort(state, keys, length);
+    double elapsed = now() - start;
+
+    *ok = status == 0 && !memcmp(keys, reference, length * sizeof(unsigned int));
+    return status == 0 ? elapsed : -1;
+}
+
+int sortDriver(const SortAlgorithm* algorithm, int argc, char** argv) {
+    unsigned int log2keys = argc > 1 ? atoi(argv[1]) : 20;
+    unsigned int threads  = argc > 2 ? atoi(argv[2]) : 0;
+    size_t       length   = (size_t)1 << log2keys;
+    int          failed   = 0;
+
+    void* state = algorithm->create(threads);
+    if (state == NULL) {
+        printf("%s is not available on this machine\n", algorithm->name);
+        return 1;
+    }
+
+    unsigned int* input     = (unsigned int*)malloc(length * sizeof(unsigned int));
+    unsigned int* reference = (unsigned int*)malloc(length * sizeof(unsigned int));
+    unsigned int* keys      = (unsigned int*)malloc(length * sizeof(unsigned int));
+    if (!input || !reference || !keys) {
+        printf("Couldn't allocate %lu keys\n", (unsigned long)length);
+        algorithm->destroy(state);
+        return 1;
+    }
+
+    printf("%s (%s), %lu keys:\n", algorithm->name, algorithm->device, (unsigned long)length);
+    for(int d = 0; d < DIST_COUNT; ++d) {
+        int ok;
+        sortFill(input, length, (SortDistribution)d, 2013 + d);
+        memcpy(reference, input, length * sizeof(unsigned int));
+        qsort(reference, length, sizeof(unsigned int), compareKeys);
+
+        double seconds = sortTime(algorithm, state, keys, input, reference, length, &ok);
+        if (seconds < 0)
+            printf("  %-15s failed\n", sortDistributionName((SortDistribution)d));
+        else
+            printf("  %-15s %9.4f s %9.1f Mkeys/s%s\n", sortDistributionName((SortDistribution)d),
+                   seconds, length / seconds * 1e-6, ok ? "" : "  (wrong result)");
+        failed |= !ok;
+    }
+
+    algorithm->destroy(state);
+    free(input);
+    free(reference);
+    free(keys);
+    return failed;
+}
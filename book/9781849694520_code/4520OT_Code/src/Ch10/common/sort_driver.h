@@ -0,0 +1,48 @@
+#ifndef SORT_DRIVER_H
+#define SORT_DRIVER_H
+
+#include <stddef.h>
+#include "sort_interface.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Key distributions the sorts are compared on */
+typedef enum SortDistribution {
+    DIST_UNIFORM,          /* all 32 bits random */
+    DIST_NARROW,           /* random in [0, 2^16) */
+    DIST_FEW_UNIQUE,       /* 16 distinct random values */
+    DIST_SORTED,
+    DIST_REVERSE_SORTED,
+    DIST_NEARLY_SORTED,    /* sorted, then 1% of the keys swapped at random */
+    DIST_EQUAL,
+    DIST_COUNT
+} SortDistribution;
+
+const char* sortDistributionName(SortDistribution distribution);
+
+/* Fills keys with length keys of distribution, from seed */
+void sortFill(unsigned int* keys, size_t length, SortDistribution distribution, unsigned int seed);
+
+/*
+ Sorts a copy of input with algorithm and returns the wall time of the
+ sort() call in seconds, or < 0 if it failed. *ok is set when the copy is
+ equal to reference, the input sorted ahead by the caller.
+*/
+double sortTime(const SortAlgorithm* algorithm, void* state, unsigned int* keys,
+                const unsigned int* input, const unsigned int* reference, size_t length, int* ok);
+
+/*
+ main() of the sample of one algorithm: sorts 2^argv[1] keys (2^20 by
+ default) of every distribution with argv[2] threads (0, all of them, by
+ default), and prints the times and whether the result is right.
+ Returns the exit status.
+*/
+int sortDriver(const SortAlgorithm* algorithm, int argc, char** argv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
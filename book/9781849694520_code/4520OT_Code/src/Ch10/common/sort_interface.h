@@ -0,0 +1,31 @@
+#ifndef SORT_INTERFACE_H
+#define SORT_INTERFACE_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ Common interface of the Ch9/Ch10 sort libraries, so that the algorithms
+ can be swapped and compared on the same data. create() allocates whatever
+ the algorithm keeps between calls (an OpenCL context and its programs,
+ thread pools, scratch space) and returns NULL when it is not available
+ here, e.g. without a GPU. sort() orders length unsigned keys ascending in
+ place and returns 0, or a negative value on failure. threads = 0 uses all
+ online processors; device sorts ignore it.
+*/
+typedef struct SortAlgorithm {
+    const char* name;
+    const char* device;                    /* "CPU" or "GPU" */
+    void* (*create)(unsigned int threads);
+    int   (*sort)(void* state, unsigned int* keys, size_t length);
+    void  (*destroy)(void* state);
+} SortAlgorithm;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -48,6 +48,7 @@ int main()
     cl_int ret;
  
     cl_event event1;
+    cl_event writeEvents[2], kernelEvent, readEvent;
  
     int i, j;
     float *A;
@@ -90,14 +91,19 @@ int main()
     event1 = clCreateUserEvent(context, &ret);
     clSetEventCallback(event1, CL_COMPLETE, &postProcess, "Looks like its done.");
 
-    /* Copy input data to the memory buffer */
- 
-    ret = clEnqueueWriteBuffer(command_queue, objA, CL_TRUE, 0, 4*4*sizeof(float), A, 0, NULL, NULL );
-    printf("A has been written\n");
- 
-    /* The next command will wait for event1 according to its status*/
-    ret = clEnqueueWriteBuffer(command_queue, objB, CL_TRUE, 0, 4*4*sizeof(float), B, 1, &event1, NULL);
-    printf("B has been written\n");
+    /*
+     * Copy input data to the memory buffer. Nothing below blocks the host:
+     * every command gets the events of the commands it depends on, and the
+     * host only waits for the final read.
+     */
+ 
+    ret = clEnqueueWriteBuffer(command_queue, objA, CL_FALSE, 0, 4*4*sizeof(float), A, 0, NULL, &writeEvents[0]);
+    printf("A write has been enqueued\n");
+ 
+    /* The next command will wait for event1 according to its status; a blocking
+       write would wait forever, since event1 is only completed below */
+    ret = clEnqueueWriteBuffer(command_queue, objB, CL_FALSE, 0, 4*4*sizeof(float), B, 1, &event1, &writeEvents[1]);
+    printf("B write has been enqueued\n");
 
     /* Tell event1 to complete */
     clSetUserEventStatus(event1, CL_COMPLETE);
@@ -124,10 +130,11 @@ int main()
  
     /* Execute OpenCL kernel as data parallel */
     ret = clEnqueueNDRangeKernel(command_queue, kernel, 1, NULL, 
-                                 &global_item_size, &local_item_size, 0, NULL, NULL);
+                                 &global_item_size, &local_item_size, 2, writeEvents, &kernelEvent);
  
     /* Transfer result to host */
-    ret = clEnqueueReadBuffer(command_queue, objC, CL_TRUE, 0, 4*4*sizeof(float), C, 0, NULL, NULL);
+    ret = clEnqueueReadBuffer(command_queue, objC, CL_FALSE, 0, 4*4*sizeof(float), C, 1, &kernelEvent, &readEvent);
+    ret = clWaitForEvents(1, &readEvent);
  
     /* Display Results */
     for (i=0; i<4; i++) {
@@ -141,6 +148,11 @@ int main()
     /* Finalization */
     ret = clFlush(command_queue);
     ret = clFinish(command_queue);
+    ret = clReleaseEvent(writeEvents[0]);
+    ret = clReleaseEvent(writeEvents[1]);
+    ret = clReleaseEvent(kernelEvent);
+    ret = clReleaseEvent(readEvent);
+    ret = clReleaseEvent(event1);
     ret = clReleaseKernel(kernel);
     ret = clReleaseProgram(program);
     ret = clReleaseMemObject(objA);
@@ -3,6 +3,7 @@
 #include <sys/types.h>
 #include <alloca.h>
 #include <math.h>
+#include <string.h>
 
 #ifdef APPLE
 #include <OpenCL/cl.h>
@@ -10,9 +11,13 @@
 #include <CL/cl.h>
 #endif
 
+#include "work_scheduler.h"
+
 //#define DATA_SIZE 64      // for test runs,
 #define DATA_SIZE 1048576 // for standard runs,
 //#define DATA_SIZE 8388608   // for large runs,
+#define WIDTH 1024        // rows and columns of float4, as in work_partition.cl
+#define CHUNK_ROWS 64     // default rows per chunk of the range
 
 /*
     This program requires all the devices to be supported by the
@@ -22,6 +27,11 @@
     The program will partition the data against all detected devices
     and execute on them 'clEnqueueNDRange'. In the setup i've got, 
     i have a ATI 6870x2 GPU card and a Intel Core i7 CPU.
+
+    The range is cut into chunks of rows that the devices take as they
+    finish their previous ones, stealing from each other once their own
+    share runs out; a slow device thus never holds up the fast ones.
+    Usage: WorkPartition [rows per chunk], 64 by default.
 */
 
 // test for valid values
@@ -105,9 +115,10 @@ int main(int argc, char** argv) {
    */
    cl_float* h_in = (float*) malloc( sizeof(cl_float4) * DATA_SIZE); // input to device
    cl_float* h_out = (float*) malloc( sizeof(cl_float4) * DATA_SIZE); // output from device
-   for( int i = 0; i < DATA_SIZE; ++i) {
+   for( int i = 0; i < 4 * DATA_SIZE; ++i) {
         h_in[i] = (float)i;
    }
+   size_t chunkRows = argc > 1 ? (size_t)atol(argv[1]) : CHUNK_ROWS;
 
    /* 
       Get the number of platforms 
@@ -158,145 +169,116 @@ int main(int argc, char** argv) {
 	        exit(1);
 	    }
 
-	    /* For each device, create a buffer and partition that data among the devices for compute! */
-	    cl_mem memInObj = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, 
+	    /* One input and one output buffer, shared by all the devices of the context */
+	    cl_mem memInObj = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, 
 	                                     sizeof(cl_float4) * (DATA_SIZE), h_in, &error);
 	    if(error != CL_SUCCESS) {
 	        perror("Can't create an input buffer object");
 	        exit(1);
 	    }
+	    cl_mem memOutObj = clCreateBuffer(context, CL_MEM_WRITE_ONLY,
+	                                      sizeof(cl_float4) * (DATA_SIZE), NULL, &error);
+	    if(error != CL_SUCCESS) {
+	        perror("Can't create an output buffer object");
+	        exit(1);
+	    }
+
+	    /* Load the source file into a temporary datastore */
+	    const char *file_names[] = {"work_partition.cl"}; 
+	    const int NUMBER_OF_FILES = 1;
+	    char* buffer[NUMBER_OF_FILES];
+	    size_t sizes[NUMBER_OF_FILES];
+	    loadProgramSource(file_names, NUMBER_OF_FILES, buffer, sizes);
 
-        int offset = 0; 
-        for(int i = 0; i < numOfDevices; ++i, ++offset ) {
-
-            displayDeviceType(devices[i], CL_DEVICE_TYPE);
-
-	        /* Load the two source files into temporary datastores */
-	        const char *file_names[] = {"work_partition.cl"}; 
-	        const int NUMBER_OF_FILES = 1;
-	        char* buffer[NUMBER_OF_FILES];
-	        size_t sizes[NUMBER_OF_FILES];
-	        loadProgramSource(file_names, NUMBER_OF_FILES, buffer, sizes);
-	
-	        /* Create the OpenCL program object */
-	        program = clCreateProgramWithSource(context, NUMBER_OF_FILES, (const char**)buffer, sizes, &error);				
-		    if(error != CL_SUCCESS) {
-		      perror("Can't create the OpenCL program object");
-		      exit(1);   
-		    }
-
-	        /* Build OpenCL program object and dump the error message, if any */
+	    /* Create the OpenCL program object and build it for every device at once */
+	    program = clCreateProgramWithSource(context, NUMBER_OF_FILES, (const char**)buffer, sizes, &error);				
+	    if(error != CL_SUCCESS) {
+	      perror("Can't create the OpenCL program object");
+	      exit(1);   
+	    }
+	    error = clBuildProgram(program, numOfDevices, devices, NULL, NULL, NULL);		
+	    if(error != CL_SUCCESS) {
+	      // If there's an error whilst building the program, dump the log of each device
+	      for(cl_uint j = 0; j < numOfDevices; ++j) {
 	        char *program_log;
 	        size_t log_size;
-	        error = clBuildProgram(program, 1, &devices[i], NULL, NULL, NULL);		
-		    if(error != CL_SUCCESS) {
-		      // If there's an error whilst building the program, dump the log
-		      clGetProgramBuildInfo(program, devices[i], CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
-		      program_log = (char*) malloc(log_size+1);
-		      program_log[log_size] = '\0';
-		      clGetProgramBuildInfo(program, devices[i], CL_PROGRAM_BUILD_LOG, 
-		            log_size+1, program_log, NULL);
-		      printf("\n=== ERROR ===\n\n%s\n=============\n", program_log);
-		      free(program_log);
-		      exit(1);
-		    }
-	  
-	        /* Query the program as to how many kernels were detected */
-	        cl_uint numOfKernels;
-	        error = clCreateKernelsInProgram(program, 0, NULL, &numOfKernels);
+	        clGetProgramBuildInfo(program, devices[j], CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
+	        program_log = (char*) malloc(log_size+1);
+	        program_log[log_size] = '\0';
+	        clGetProgramBuildInfo(program, devices[j], CL_PROGRAM_BUILD_LOG, 
+	              log_size+1, program_log, NULL);
+	        printf("\n=== ERROR ===\n\n%s\n=============\n", program_log);
+	        free(program_log);
+	      }
+	      exit(1);
+	    }
+
+	    /*
+	     Split the 1024x1024 range into chunks of rows, to be handed out to the
+	     devices as they finish their previous ones (see work_scheduler.h)
+	    */
+	    size_t localThreads[2] = { 64, 2 };
+	    Scheduler sched;
+	    if (!schedInit(&sched, WIDTH, WIDTH, chunkRows, localThreads,
+	                   memOutObj, h_out, WIDTH * sizeof(cl_float4))) {
+	        printf("Chunks of %lu rows do not tile the range in work-groups of 64x2\n", (unsigned long)chunkRows);
+	        exit(1);
+	    }
+
+	    cl_command_queue* queues = (cl_command_queue*) alloca(sizeof(cl_command_queue) * numOfDevices);
+	    cl_kernel* kernels = (cl_kernel*) alloca(sizeof(cl_kernel) * numOfDevices);
+	    cl_uint numOfScheduled = numOfDevices < SCHED_MAX_DEVICES ? numOfDevices : SCHED_MAX_DEVICES;
+
+	    for(cl_uint j = 0; j < numOfScheduled; ++j) {
+	        displayDeviceType(devices[j], CL_DEVICE_TYPE);
+
+	        /* Each device gets its own command queue, and its own kernel object */
+	        queues[j] = clCreateCommandQueue(context, devices[j], 0, &error);
+	        if (error != CL_SUCCESS) { 
+	            perror("Unable to create command-queue");
+	            exit(1);
+	        }
+	        kernels[j] = clCreateKernel(program, "copy2Dfloat4", &error);
 	        if (error != CL_SUCCESS) {
-	            perror("Unable to retrieve kernel count from program");
+	            perror("Unable to create the kernel");
 	            exit(1);
 	        }
-	        cl_kernel* kernels = (cl_kernel*) alloca(sizeof(cl_kernel) * numOfKernels);
-	        error = clCreateKernelsInProgram(program, numOfKernels, kernels, NULL);
-
-            /* Loop thru each kernel and execute on device */
-	        for(cl_uint j = 0; j < numOfKernels; j++) {
-	            char kernelName[32];
-	            cl_uint argCnt;
-	            clGetKernelInfo(kernels[j], CL_KERNEL_FUNCTION_NAME, sizeof(kernelName), kernelName, NULL);
-	            clGetKernelInfo(kernels[j], CL_KERNEL_NUM_ARGS, sizeof(argCnt), &argCnt, NULL);
-	            printf("\t=> Kernel name: %s with arity: %d\n", kernelName, argCnt);
-	            printf("\t=> About to create command queue and enqueue this kernel...\n");
-	
-	            /* Create a command queue */
-	            cl_command_queue cQ = clCreateCommandQueue(context, devices[i], 0, &error);
-	            if (error != CL_SUCCESS) { 
-	                perror("Unable to create command-queue");
-	                exit(1);
-	            }
-	
-	            cl_mem memOutObj = clCreateBuffer(context, CL_MEM_WRITE_ONLY ,
-	                                              sizeof(cl_float4) * (DATA_SIZE), NULL, &error);
-	            if(error != CL_SUCCESS) {
-	                perror("Can't create an output buffer object");
-	                exit(1);
-	            }
-
-	            /* Let OpenCL know that the kernel is suppose to receive two arguments */
-	            error = clSetKernelArg(kernels[j], 0, sizeof(cl_mem), &memInObj);
-	            if (error != CL_SUCCESS) { 
-	                perror("Unable to set buffer object in kernel");
-	                exit(1);
-	            }
-	            error = clSetKernelArg(kernels[j], 1, sizeof(cl_mem), &memOutObj);
-	            if (error != CL_SUCCESS) { 
-	                perror("Unable to set buffer object in kernel");
-	                exit(1);
-	            }
-	
-	            /* Enqueue the kernel to the command queue */
-                size_t globalThreads[2];
-                globalThreads[0]=1024;
-                globalThreads[1]=1024;
-                size_t localThreads[2];
-                localThreads[0] = 64;
-                localThreads[1] = 2;
-	
-                cl_event evt;
-	            error = clEnqueueNDRangeKernel(cQ, 
-                                               kernels[j],
-                                               2,
-                                               0,
-                                               globalThreads,
-                                               localThreads,
-                                               0, 
-                                               NULL, &evt);
-                clWaitForEvents(1, &evt);
-	            if (error != CL_SUCCESS) { 
-	                perror("Unable to enqueue task to command-queue");
-	                exit(1);
-	            }
-                clReleaseEvent(evt);
-	            printf("\t=> Task has been enqueued successfully!\n");
-	
-	            /* Enqueue the read-back from device to host */
-	            error = clEnqueueReadBuffer(cQ, memOutObj,
-	                                        CL_TRUE,               // blocking read
-	                                        0,         // write from the last offset
-	                                        (DATA_SIZE)*sizeof(cl_float4),           // how much to copy
-	                                        h_out, 0, NULL, NULL);
-
-                /* Check the returned data */
-	            if ( valuesOK(h_in, h_out, DATA_SIZE) ) {
-	                printf("Check passed!\n");
-	            } else printf("Check failed!\n");
-	
-	            /* Release the resources */
-	            clReleaseCommandQueue(cQ);
-	            clReleaseMemObject(memOutObj);
-	        } 
-
-        /* Clean up */
-        
-        for(cl_uint i = 0; i < numOfKernels; i++) { clReleaseKernel(kernels[i]); }
-        for(int i=0; i< NUMBER_OF_FILES; i++) { free(buffer[i]); }
-        clReleaseProgram(program);
-    }// end of device loop and execution
-    
+	        error  = clSetKernelArg(kernels[j], 0, sizeof(cl_mem), &memInObj);
+	        error |= clSetKernelArg(kernels[j], 1, sizeof(cl_mem), &memOutObj);
+	        if (error != CL_SUCCESS) { 
+	            perror("Unable to set buffer object in kernel");
+	            exit(1);
+	        }
+	        schedAddDevice(&sched, devices[j], queues[j], kernels[j]);
+	    }
+
+	    /* Static even split first, then the same chunks with work stealing */
+	    for(int steal = 0; steal < 2; ++steal) {
+	        memset(h_out, 0, sizeof(cl_float4) * DATA_SIZE);
+
+	        error = schedRun(&sched, steal);
+	        if (error != CL_SUCCESS) { 
+	            perror("Unable to run the chunks on the devices");
+	            exit(1);
+	        }
+	        schedReport(&sched, steal ? "Work stealing" : "Static split");
+
+	        /* Check the returned data */
+	        if ( valuesOK(h_in, h_out, 4 * DATA_SIZE) ) {
+	            printf("Check passed!\n");
+	        } else printf("Check failed!\n");
+	    }
+
+	    /* Clean up */
+	    for(cl_uint j = 0; j < numOfScheduled; ++j) {
+	        clReleaseKernel(kernels[j]);
+	        clReleaseCommandQueue(queues[j]);
+	    }
+	    for(int j = 0; j < NUMBER_OF_FILES; j++) { free(buffer[j]); }
+	    clReleaseProgram(program);
+	    clReleaseMemObject(memOutObj);
 	    clReleaseMemObject(memInObj);
-        clReleaseContext(context);
+	    clReleaseContext(context);
    }// end of platform loop
 
    free(h_in);
@@ -0,0 +1,236 @@
+#ifndef WORK_SCHEDULER_H
+#define WORK_SCHEDULER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#define schedPause() Sleep(0)
+#else
+#include <sys/time.h>
+#include <sched.h>
+#define schedPause() sched_yield()
+#endif
+
+#ifdef APPLE
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+/**
+ * Dynamic self-scheduling of a 2D NDRange over the devices of one context.
+ *
+ * The range is cut into chunks of whole rows (dimension 0), launched through
+ * the global work offset, and every device gets a contiguous run of chunks
+ * of its own to start with. A device takes its next chunk from the head of
+ * its run as soon as one of its chunks is done, so it never waits on the
+ * others; once its run is exhausted it steals the back half of the longest
+ * run left, so a slow device only ever holds up the chunks it is running.
+ * Each device keeps SCHED_IN_FLIGHT chunks enqueued, which hides the host
+ * round-trip between two chunks.
+ *
+ * Each chunk of the output is read back on the queue that computed it,
+ * right behind its kernel. Devices thus write disjoint rows of one shared
+ * output buffer without ever needing a consistent copy of the whole of it.
+ *
+ * Stealing can be switched off, which leaves the initial even split: the
+ * static partitioning the sample used to do, for comparison.
+ */
+
+#define SCHED_MAX_DEVICES 16
+#define SCHED_IN_FLIGHT 2
+
+typedef struct {
+    cl_device_id     device;
+    cl_command_queue queue;
+    cl_kernel        kernel;      // arguments are set by the caller
+    size_t           head, tail;  // own chunks [head, tail), taken from the head
+    cl_event         done[SCHED_IN_FLIGHT]; // read-back of each chunk in flight
+    int              pending;
+    size_t           chunks;      // chunks this device ran
+    size_t           stolen;      // of which were taken from other devices
+} SchedDevice;
+
+typedef struct {
+    SchedDevice devices[SCHED_MAX_DEVICES];
+    int         count;
+    size_t      rows, cols;       // the 2D range
+    size_t      chunkRows;
+    size_t      numChunks;
+    size_t      local[2];
+    cl_mem      output;
+    void*       host;             // where the output goes, rowBytes per row
+    size_t      rowBytes;
+    double      elapsed;          // seconds taken by the last schedRun()
+} Scheduler;
+
+double schedTime() {
+#ifdef _WIN32
+    LARGE_INTEGER freq, now;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (double)now.QuadPart / freq.QuadPart;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + 1e-6 * tv.tv_usec;
+#endif
+}
+
+/*
+ Sets up the scheduling of a rows x cols range with the given work-group
+ size, in chunks of chunkRows rows. Chunks have to tile the range in whole
+ work-groups. Returns 0 otherwise.
+ */
+int schedInit(Scheduler* s, size_t rows, size_t cols, size_t chunkRows, const size_t local[2],
+              cl_mem output, void* host, size_t rowBytes) {
+    memset(s, 0, sizeof(*s));
+
+    if (chunkRows == 0 || rows % chunkRows || chunkRows % local[0] || cols % local[1]) return 0;
+
+    s->rows      = rows;
+    s->cols      = cols;
+    s->chunkRows = chunkRows;
+    s->numChunks = rows / chunkRows;
+    s->local[0]  = local[0];
+    s->local[1]  = local[1];
+    s->output    = output;
+    s->host      = host;
+    s->rowBytes  = rowBytes;
+    return 1;
+}
+
+/* Adds a device with its own queue and kernel. Returns 0 if there is no room left. */
+int schedAddDevice(Scheduler* s, cl_device_id device, cl_command_queue queue, cl_kernel kernel) {
+    if (s->count == SCHED_MAX_DEVICES) return 0;
+
+    SchedDevice* d = &s->devices[s->count++];
+    memset(d, 0, sizeof(*d));
+    d->device = device;
+    d->queue  = queue;
+    d->kernel = kernel;
+    return 1;
+}
+
+/* Hands the next chunk to the device; steals one half of the longest run left when its own is done. */
+int schedTake(Scheduler* s, SchedDevice* d, int steal, size_t* chunk) {
+    if (d->head == d->tail) {
+        SchedDevice* victim = NULL;
+
+        if (!steal) return 0;
+
+        for(int i = 0; i < s->count; ++i) {
+            SchedDevice* v = &s->devices[i];
+            if (v != d && v->tail - v->head > (victim ? victim->tail - victim->head : 0))
+                victim = v;
+        }
+        if (victim == NULL) return 0;
+
+        size_t half = (victim->tail - victim->head + 1) / 2;
+        victim->tail -= half;
+        d->head = victim->tail;
+        d->tail = victim->tail + half;
+        d->stolen += half;
+    }
+
+    *chunk = d->head++;
+    return 1;
+}
+
+/* Enqueues the kernel over one chunk and the read-back of its rows. */
+cl_int schedEnqueue(Scheduler* s, SchedDevice* d, size_t chunk) {
+    size_t offset[2] = { chunk * s->chunkRows, 0 };
+    size_t global[2] = { s->chunkRows, s->cols };
+    size_t bytes = s->chunkRows * s->rowBytes;
+    cl_event kernelDone;
+    cl_int error;
+
+    error = clEnqueueNDRangeKernel(d->queue, d->kernel, 2, offset, global, s->local,
+                                   0, NULL, &kernelDone);
+    if (error != CL_SUCCESS) return error;
+
+    error = clEnqueueReadBuffer(d->queue, s->output, CL_FALSE, offset[0] * s->rowBytes, bytes,
+                                (char*)s->host + offset[0] * s->rowBytes,
+                                1, &kernelDone, &d->done[d->pending]);
+    clReleaseEvent(kernelDone);
+    if (error != CL_SUCCESS) return error;
+
+    d->pending++;
+    return clFlush(d->queue);
+}
+
+/*
+ Runs the whole range, with or without stealing. Returns once all of the
+ output is on the host; the time taken goes to s->elapsed and the chunks
+ each device ran to its 'chunks' and 'stolen'.
+ */
+cl_int schedRun(Scheduler* s, int steal) {
+    size_t completed = 0;
+    cl_int error;
+
+    if (s->count == 0) return CL_INVALID_DEVICE;
+
+    for(int i = 0; i < s->count; ++i) {
+        SchedDevice* d = &s->devices[i];
+        d->head    = s->numChunks * i / s->count;
+        d->tail    = s->numChunks * (i + 1) / s->count;
+        d->pending = 0;
+        d->chunks  = 0;
+        d->stolen  = 0;
+    }
+
+    double start = schedTime();
+
+    while (completed < s->numChunks) {
+        int progress = 0;
+
+        for(int i = 0; i < s->count; ++i) {
+            SchedDevice* d = &s->devices[i];
+            size_t chunk;
+
+            while (d->pending < SCHED_IN_FLIGHT && schedTake(s, d, steal, &chunk))
+                if ((error = schedEnqueue(s, d, chunk)) != CL_SUCCESS) return error;
+        }
+
+        /* an in-order queue completes its chunks in order: only the oldest one needs polling */
+        for(int i = 0; i < s->count; ++i) {
+            SchedDevice* d = &s->devices[i];
+            cl_int status;
+
+            if (d->pending == 0) continue;
+
+            error = clGetEventInfo(d->done[0], CL_EVENT_COMMAND_EXECUTION_STATUS,
+                                   sizeof(status), &status, NULL);
+            if (error != CL_SUCCESS) return error;
+            if (status < 0) return status;
+            if (status != CL_COMPLETE) continue;
+
+            clReleaseEvent(d->done[0]);
+            memmove(d->done, d->done + 1, sizeof(cl_event) * (d->pending - 1));
+            d->pending--;
+            d->chunks++;
+            completed++;
+            progress = 1;
+        }
+
+        /* a CPU device runs on the cores this loop polls from */
+        if (!progress) schedPause();
+    }
+
+    s->elapsed = schedTime() - start;
+    return CL_SUCCESS;
+}
+
+void schedReport(const Scheduler* s, const char* title) {
+    printf("%s: %zu chunks of %zu rows in %.3f ms\n", title, s->numChunks, s->chunkRows, 1e3 * s->elapsed);
+    for(int i = 0; i < s->count; ++i) {
+        char name[256] = "";
+        clGetDeviceInfo(s->devices[i].device, CL_DEVICE_NAME, sizeof(name), name, NULL);
+        printf("\t%-40s %4zu chunks (%zu stolen)\n", name, s->devices[i].chunks, s->devices[i].stolen);
+    }
+}
+
+#endif
@@ -0,0 +1,110 @@
+#include <string.h>
+#include "byte_swap.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
+static unsigned int gcd(unsigned int a, unsigned int b) {
+    while(b) { unsigned int t = a % b; a = b; b = t; }
+    return a;
+}
+
+/*
+ Spreads the record permutation over lcm(size, 16) bytes, doubled when
+ needed so that AVX2 can take the masks two at a time. Every output byte
+ must come from the same 16-byte block, because pshufb does not cross them.
+*/
+static void buildMasks(SwapLayout* layout) {
+    unsigned int blocks = layout->size / gcd(layout->size, 16);
+    unsigned int masks  = blocks % 2 ? 2 * blocks : blocks;
+
+    for(unsigned int j = 0; j < masks * 16; ++j) {
+        unsigned int source = j / layout->size * layout->size + layout->perm[j % layout->size];
+        if (source / 16 != j / 16) {
+            layout->masks = 0;
+            return;
+        }
+        layout->mask[j / 16][j % 16] = (unsigned char)(source % 16);
+    }
+    layout->masks = masks;
+}
+
+int swapLayout(SwapLayout* layout, const unsigned int* widths, unsigned int count) {
+    unsigned int offset = 0;
+
+    for(unsigned int f = 0; f < count; ++f) {
+        unsigned int w = widths[f];
+        if ((w != 1 && w != 2 && w != 4 && w != 8) || offset + w > SWAP_MAX_RECORD)
+            return -1;
+        for(unsigned int b = 0; b < w; ++b)
+            layout->perm[offset + b] = (unsigned char)(offset + w - 1 - b);
+        offset += w;
+    }
+    if (offset == 0) return -1;
+
+    layout->size = offset;
+    buildMasks(layout);
+    return 0;
+}
+
+int swapLayoutScalar(SwapLayout* layout, unsigned int width) {
+    return width == 1 ? -1 : swapLayout(layout, &width, 1);
+}
+
+void swapBytesScalar(void* dst, const void* src, size_t records, const SwapLayout* layout) {
+    unsigned char*       out = (unsigned char*)dst;
+    const unsigned char* in  = (const unsigned char*)src;
+    unsigned char        record[SWAP_MAX_RECORD];
+    unsigned int         size = layout->size;
+
+    for(size_t r = 0; r < records; ++r, in += size, out += size) {
+        memcpy(record, in, size);              // dst may alias src
+        for(unsigned int b = 0; b < size; ++b)
+            out[b] = record[layout->perm[b]];
+    }
+}
+
+void swapBytes(void* dst, const void* src, size_t records, const SwapLayout* layout) {
+#if defined(__AVX2__) || defined(__SSSE3__)
+    if (layout->masks) {
+        unsigned char*       out = (unsigned char*)dst;
+        const unsigned char* in  = (const unsigned char*)src;
+        size_t period  = layout->masks * 16;
+        size_t periods = records * layout->size / period;
+
+        for(size_t p = 0; p < periods; ++p, in += period, out += period) {
+#if defined(__AVX2__)
+            for(unsigned int k = 0; k < layout->masks; k += 2) {
+                __m256i m = _mm256_loadu_si256((const __m256i*)layout->mask[k]);
+                __m256i v = _mm256_loadu_si256((const __m256i*)(in + 16 * k));
+                _mm256_storeu_si256((__m256i*)(out + 16 * k), _mm256_shuffle_epi8(v, m));
+            }
+#else
+            for(unsigned int k = 0; k < layout->masks; ++k) {
+                __m128i m = _mm_loadu_si128((const __m128i*)layout->mask[k]);
+                __m128i v = _mm_loadu_si128((const __m128i*)(in + 16 * k));
+                _mm_storeu_si128((__m128i*)(out + 16 * k), _mm_shuffle_epi8(v, m));
+            }
+#endif
+        }
+
+        // a period is a whole number of records, the rest is done one by one
+        size_t done = periods * period / layout->size;
+        swapBytesScalar(out, in, records - done, layout);
+        return;
+    }
+#endif
+    swapBytesScalar(dst, src, records, layout);
+}
+
+const char* swapBytesPath(const SwapLayout* layout) {
+#if defined(__AVX2__)
+    if (layout->masks) return "AVX2";
+#elif defined(__SSSE3__)
+    if (layout->masks) return "SSSE3";
+#endif
+    return "scalar";
+}
@@ -0,0 +1,47 @@
+/*
+ In-place byte order conversion of an uploaded chunk. offset and count are
+ in elements (records for swapRecords); every work-item converts one
+ element so that consecutive work-items touch consecutive addresses.
+*/
+
+__kernel void swap16(__global ushort* data, uint offset, uint count) {
+    uint i = get_global_id(0);
+    if (i >= count) return;
+
+    ushort v = data[offset + i];
+    data[offset + i] = rotate(v, (ushort)8);
+}
+
+__kernel void swap32(__global uint* data, uint offset, uint count) {
+    uint i = get_global_id(0);
+    if (i >= count) return;
+
+    uint v = data[offset + i];
+    data[offset + i] = (rotate(v, 8u) & 0x00ff00ffu) | (rotate(v, 24u) & 0xff00ff00u);
+}
+
+__kernel void swap64(__global ulong* data, uint offset, uint count) {
+    uint i = get_global_id(0);
+    if (i >= count) return;
+
+    ulong v = data[offset + i];
+    v = ((v & 0x00ff00ff00ff00ffUL) << 8)  | ((v >> 8)  & 0x00ff00ff00ff00ffUL);
+    v = ((v & 0x0000ffff0000ffffUL) << 16) | ((v >> 16) & 0x0000ffff0000ffffUL);
+    data[offset + i] = rotate(v, (ulong)32);
+}
+
+/*
+ Packed records of size bytes: byte b of a record is replaced by byte
+ perm[b], the permutation of swapLayout() on the host
+*/
+__kernel void swapRecords(__global uchar* data, __constant uchar* perm,
+                          uint size, uint offset, uint count) {
+    uint i = get_global_id(0);
+    if (i >= count) return;
+
+    uchar record[64];                                  // SWAP_MAX_RECORD
+    __global uchar* p = data + (size_t)(offset + i) * size;
+
+    for(uint b = 0; b < size; ++b) record[b] = p[b];
+    for(uint b = 0; b < size; ++b) p[b] = record[perm[b]];
+}
@@ -0,0 +1,55 @@
+#ifndef BYTE_SWAP_H
+#define BYTE_SWAP_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Largest record, in bytes, a SwapLayout can describe */
+#define SWAP_MAX_RECORD 64
+/* Shuffle masks kept for the SIMD path: a whole number of 32-byte blocks */
+#define SWAP_MAX_MASKS  (2 * SWAP_MAX_RECORD)
+
+/*
+ Byte order conversion of a packed record. Every field of 1, 2, 4 or 8
+ bytes is reversed in place; perm[i] is the byte of the record that ends up
+ at byte i. When no field straddles a 16-byte boundary of the repeating
+ pattern the same permutation is kept as pshufb masks, one per 16 bytes.
+*/
+typedef struct SwapLayout {
+    unsigned int  size;                       /* bytes per record */
+    unsigned char perm[SWAP_MAX_RECORD];
+    unsigned int  masks;                      /* 0 when only the scalar path applies */
+    unsigned char mask[SWAP_MAX_MASKS][16];
+} SwapLayout;
+
+/*
+ Builds the layout of a record made of count fields of widths[] bytes,
+ packed in this order. Returns 0, or -1 if a width is not 1, 2, 4 or 8 or
+ the record is larger than SWAP_MAX_RECORD.
+*/
+int swapLayout(SwapLayout* layout, const unsigned int* widths, unsigned int count);
+
+/* A record of one 16, 32 or 64-bit value */
+int swapLayoutScalar(SwapLayout* layout, unsigned int width);
+
+/*
+ Converts records from src into dst, which may be the same buffer. Uses
+ AVX2 or SSSE3 shuffles when the layout allows it and the compiler targets
+ them, and the scalar permutation otherwise.
+*/
+void swapBytes(void* dst, const void* src, size_t records, const SwapLayout* layout);
+
+/* Reference conversion: the scalar permutation only */
+void swapBytesScalar(void* dst, const void* src, size_t records, const SwapLayout* layout);
+
+/* "AVX2", "SSSE3" or "scalar": the path swapBytes takes for layout */
+const char* swapBytesPath(const SwapLayout* layout);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
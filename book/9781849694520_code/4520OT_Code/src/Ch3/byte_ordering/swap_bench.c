@@ -0,0 +1,136 @@
+/*
+ Uploads big-endian data of 16, 32 and 64-bit values and of two packed
+ records three ways: a scalar host loop followed by one write, the
+ pipelined SIMD host conversion and the pipelined conversion on the device.
+ The uploaded buffer is read back and compared with the host-order data.
+
+ Usage: SwapBench [log2 of the number of bytes, 26 by default]
+*/
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "swap_upload.h"
+
+#define CHUNK (1 << 20)
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/* The loop this facility replaces: every field reversed byte by byte */
+static void naiveSwap(unsigned char* data, size_t records, const unsigned int* widths,
+                      unsigned int count) {
+    for(size_t r = 0; r < records; ++r) {
+        for(unsigned int f = 0; f < count; ++f) {
+            unsigned int w = widths[f];
+            for(unsigned int b = 0; b < w / 2; ++b) {
+                unsigned char t = data[b];
+                data[b] = data[w - 1 - b];
+                data[w - 1 - b] = t;
+            }
+            data += w;
+        }
+    }
+}
+
+static void report(const char* name, size_t bytes, double seconds, int ok) {
+    printf("  %-26s %8.4f s %8.1f MB/s%s\n", name, seconds, bytes / seconds * 1e-6,
+           ok ? "" : "  (wrong result)");
+}
+
+int main(int argc, char** argv) {
+    unsigned int log2bytes = argc > 1 ? atoi(argv[1]) : 26;
+    size_t       total     = (size_t)1 << log2bytes;
+
+    cl_platform_id platform;
+    cl_device_id   device;
+    cl_int         error;
+
+    if (clGetPlatformIDs(1, &platform, NULL) != CL_SUCCESS) {
+        printf("No OpenCL platform found\n");
+        return 1;
+    }
+    if (clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &device, NULL) != CL_SUCCESS &&
+        clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 1, &device, NULL) != CL_SUCCESS) {
+        printf("No OpenCL device found\n");
+        return 1;
+    }
+
+    cl_context context = clCreateContext(NULL, 1, &device, NULL, NULL, &error);
+
+    SwapUploader up;
+    if ((error = swapUploaderInit(&up, context, device, "byte_swap.cl", CHUNK)) != CL_SUCCESS) {
+        printf("Couldn't set up the upload pipeline: %d\n", error);
+        return 1;
+    }
+
+    static const unsigned int w16[] = {2}, w32[] = {4}, w64[] = {8};
+    static const unsigned int sensor[] = {2, 4, 8, 2};   // id, time, value, status
+    static const unsigned int packed[] = {1, 2, 4, 8};   // 15 bytes, no pshufb
+    const struct { const char* name; const unsigned int* widths; unsigned int count; } tests[] = {
+        {"16-bit values",           w16,    1},
+        {"32-bit values",           w32,    1},
+        {"64-bit values",           w64,    1},
+        {"16-byte sensor records",  sensor, 4},
+        {"15-byte packed records",  packed, 4},
+    };
+
+    for(size_t t = 0; t < sizeof(tests) / sizeof(tests[0]); ++t) {
+        SwapLayout layout;
+        swapLayout(&layout, tests[t].widths, tests[t].count);
+
+        size_t records = total / layout.size;
+        size_t bytes   = records * layout.size;
+
+        unsigned char* native = (unsigned char*)malloc(bytes);
+        unsigned char* big    = (unsigned char*)malloc(bytes);
+        unsigned char* work   = (unsigned char*)malloc(bytes);
+        unsigned char* back   = (unsigned char*)malloc(bytes);
+
+        for(size_t i = 0; i < bytes; ++i) native[i] = (unsigned char)rand();
+        swapBytesScalar(big, native, records, &layout);
+
+        cl_mem buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, bytes, NULL, &error);
+
+        printf("%s, %lu bytes, host path %s:\n", tests[t].name, (unsigned long)bytes,
+               swapBytesPath(&layout));
+
+        // scalar loop on the host, then a single blocking write
+        memcpy(work, big, bytes);
+        double start = now();
+        naiveSwap(work, records, tests[t].widths, tests[t].count);
+        clEnqueueWriteBuffer(up.transfer, buffer, CL_TRUE, 0, bytes, work, 0, NULL, NULL);
+        double elapsed = now() - start;
+        clEnqueueReadBuffer(up.transfer, buffer, CL_TRUE, 0, bytes, back, 0, NULL, NULL);
+        report("scalar loop, then write", bytes, elapsed, !memcmp(back, native, bytes));
+
+        const struct { const char* name; SwapMode mode; } modes[] = {
+            {"SIMD host, pipelined", SWAP_ON_HOST},
+            {"device kernel, pipelined", SWAP_ON_DEVICE},
+        };
+        for(int m = 0; m < 2; ++m) {
+            memset(back, 0, bytes);
+            start = now();
+            error = swapUpload(&up, buffer, big, records, &layout, modes[m].mode);
+            elapsed = now() - start;
+            clEnqueueReadBuffer(up.transfer, buffer, CL_TRUE, 0, bytes, back, 0, NULL, NULL);
+            report(modes[m].name, bytes, elapsed,
+                   error == CL_SUCCESS && !memcmp(back, native, bytes));
+        }
+
+        clReleaseMemObject(buffer);
+        free(native);
+        free(big);
+        free(work);
+        free(back);
+    }
+
+    swapUploaderRelease(&up);
+    clReleaseContext(context);
+    return 0;
+}
@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "swap_upload.h"
+
+static char* readSource(const char* path, size_t* size) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) return NULL;
+
+    fseek(file, 0, SEEK_END);
+    *size = ftell(file);
+    rewind(file);
+
+    char* buffer = (char*)malloc(*size + 1);
+    buffer[*size] = '\0';
+    *size = fread(buffer, sizeof(char), *size, file);
+    fclose(file);
+    return buffer;
+}
+
+cl_int swapUploaderInit(SwapUploader* up, cl_context context, cl_device_id device,
+                        const char* source, size_t chunk) {
+    cl_int error;
+    size_t size;
+
+    memset(up, 0, sizeof(*up));
+    up->context = context;
+    up->chunk   = chunk;
+
+    char* text = readSource(source, &size);
+    if (text == NULL) {
+        perror("Couldn't read the program file");
+        return CL_INVALID_VALUE;
+    }
+
+    up->transfer = clCreateCommandQueue(context, device, 0, &error);
+    if (error != CL_SUCCESS) { free(text); return error; }
+    up->compute  = clCreateCommandQueue(context, device, 0, &error);
+    if (error != CL_SUCCESS) { free(text); return error; }
+
+    up->program = clCreateProgramWithSource(context, 1, (const char**)&text, &size, &error);
+    free(text);
+    if (error != CL_SUCCESS) return error;
+
+    error = clBuildProgram(up->program, 1, &device, NULL, NULL, NULL);
+    if (error != CL_SUCCESS) {
+        size_t length;
+        clGetProgramBuildInfo(up->program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &length);
+        char* log = (char*)malloc(length + 1);
+        clGetProgramBuildInfo(up->program, device, CL_PROGRAM_BUILD_LOG, length, log, NULL);
+        log[length] = '\0';
+        printf("%s\n", log);
+        free(log);
+        return error;
+    }
+
+    up->swap16      = clCreateKernel(up->program, "swap16", &error);
+    if (error != CL_SUCCESS) return error;
+    up->swap32      = clCreateKernel(up->program, "swap32", &error);
+    if (error != CL_SUCCESS) return error;
+    up->swap64      = clCreateKernel(up->program, "swap64", &error);
+    if (error != CL_SUCCESS) return error;
+    up->swapRecords = clCreateKernel(up->program, "swapRecords", &error);
+    if (error != CL_SUCCESS) return error;
+
+    // Pinned host memory, so that the writes of SWAP_ON_HOST are DMA transfers
+    for(int s = 0; s < 2; ++s) {
+        up->staging[s] = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR,
+                                        chunk, NULL, &error);
+        if (error != CL_SUCCESS) return error;
+        up->stage[s] = clEnqueueMapBuffer(up->transfer, up->staging[s], CL_TRUE, CL_MAP_WRITE,
+                                          0, chunk, 0, NULL, NULL, &error);
+        if (error != CL_SUCCESS) return error;
+    }
+    return CL_SUCCESS;
+}
+
+void swapUploaderRelease(SwapUploader* up) {
+    for(int s = 0; s < 2; ++s) {
+        if (up->stage[s])   clEnqueueUnmapMemObject(up->transfer, up->staging[s], up->stage[s], 0, NULL, NULL);
+        if (up->staging[s]) clReleaseMemObject(up->staging[s]);
+    }
+    if (up->transfer)    clFinish(up->transfer);
+
+    if (up->swap16)      clReleaseKernel(up->swap16);
+    if (up->swap32)      clReleaseKernel(up->swap32);
+    if (up->swap64)      clReleaseKernel(up->swap64);
+    if (up->swapRecords) clReleaseKernel(up->swapRecords);
+    if (up->program)     clReleaseProgram(up->program);
+    if (up->transfer)    clReleaseCommandQueue(up->transfer);
+    if (up->compute)     clReleaseCommandQueue(up->compute);
+    memset(up, 0, sizeof(*up));
+}
+
+/* The kernel of a single 16, 32 or 64-bit field, otherwise NULL */
+static cl_kernel scalarKernel(const SwapUploader* up, const SwapLayout* layout) {
+    for(unsigned int b = 0; b < layout->size; ++b)
+        if (layout->perm[b] != layout->size - 1 - b) return NULL;
+
+    switch(layout->size) {
+        case 2: return up->swap16;
+        case 4: return up->swap32;
+        case 8: return up->swap64;
+    }
+    return NULL;
+}
+
+static cl_int uploadOnDevice(SwapUploader* up, cl_mem buffer, const unsigned char* src,
+                             size_t records, const SwapLayout* layout, size_t step) {
+    cl_kernel kernel = scalarKernel(up, layout);
+    cl_mem    perm   = NULL;
+    cl_int    error  = CL_SUCCESS;
+    cl_uint   arg    = 1;
+
+    if (kernel == NULL) {
+        kernel = up->swapRecords;
+        perm = clCreateBuffer(up->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                              layout->size, (void*)layout->perm, &error);
+        if (error != CL_SUCCESS) return error;
+
+        cl_uint size = layout->size;
+        clSetKernelArg(kernel, 1, sizeof(cl_mem), &perm);
+        clSetKernelArg(kernel, 2, sizeof(cl_uint), &size);
+        arg = 3;
+    }
+    clSetKernelArg(kernel, 0, sizeof(cl_mem), &buffer);
+
+    for(size_t first = 0; first < records && error == CL_SUCCESS; first += step) {
+        size_t   count = records - first < step ? records - first : step;
+        cl_event written;
+
+        error = clEnqueueWriteBuffer(up->transfer, buffer, CL_FALSE, first * layout->size,
+                                     count * layout->size, src + first * layout->size,
+                                     0, NULL, &written);
+        if (error != CL_SUCCESS) break;
+        clFlush(up->transfer);
+
+        cl_uint offset = (cl_uint)first, n = (cl_uint)count;
+        size_t  global = (count + 63) / 64 * 64;
+        clSetKernelArg(kernel, arg,     sizeof(cl_uint), &offset);
+        clSetKernelArg(kernel, arg + 1, sizeof(cl_uint), &n);
+
+        error = clEnqueueNDRangeKernel(up->compute, kernel, 1, NULL, &global, NULL,
+                                       1, &written, NULL);
+        clFlush(up->compute);
+        clReleaseEvent(written);
+    }
+
+    clFinish(up->transfer);
+    clFinish(up->compute);
+    if (perm) clReleaseMemObject(perm);
+    return error;
+}
+
+static cl_int uploadOnHost(SwapUploader* up, cl_mem buffer, const unsigned char* src,
+                           size_t records, const SwapLayout* layout, size_t step) {
+    cl_event written[2] = {NULL, NULL};
+    cl_int   error = CL_SUCCESS;
+
+    for(size_t first = 0, k = 0; first < records && error == CL_SUCCESS; first += step, ++k) {
+        size_t count = records - first < step ? records - first : step;
+        int    s = k % 2;
+
+        // the write of chunk k - 2 still reads this staging buffer
+        if (written[s]) {
+            clWaitForEvents(1, &written[s]);
+            clReleaseEvent(written[s]);
+            written[s] = NULL;
+        }
+
+        swapBytes(up->stage[s], src + first * layout->size, count, layout);
+
+        error = clEnqueueWriteBuffer(up->transfer, buffer, CL_FALSE, first * layout->size,
+                                     count * layout->size, up->stage[s], 0, NULL, &written[s]);
+        clFlush(up->transfer);
+    }
+
+    clFinish(up->transfer);
+    for(int s = 0; s < 2; ++s)
+        if (written[s]) clReleaseEvent(written[s]);
+    return error;
+}
+
+cl_int swapUpload(SwapUploader* up, cl_mem buffer, const void* src, size_t records,
+                  const SwapLayout* layout, SwapMode mode) {
+    size_t step = up->chunk / layout->size;
+    if (step == 0) return CL_INVALID_VALUE;
+
+    if (mode == SWAP_ON_DEVICE)
+        return uploadOnDevice(up, buffer, (const unsigned char*)src, records, layout, step);
+    return uploadOnHost(up, buffer, (const unsigned char*)src, records, layout, step);
+}
@@ -0,0 +1,61 @@
+#ifndef SWAP_UPLOAD_H
+#define SWAP_UPLOAD_H
+
+#ifdef APPLE
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+#include "byte_swap.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Where the byte order of an upload is converted */
+typedef enum SwapMode {
+    SWAP_ON_HOST,   /* swapBytes() into a pinned staging chunk, then written */
+    SWAP_ON_DEVICE  /* written as is, then converted by byte_swap.cl */
+} SwapMode;
+
+/*
+ Chunked upload of foreign-endian data. Writes go to the transfer queue
+ and the conversion kernels to the compute queue, so that on the device
+ chunk k is converted while chunk k+1 is in flight; on the host chunk k+1
+ is converted while chunk k is written from the other staging buffer.
+*/
+typedef struct SwapUploader {
+    cl_context       context;
+    cl_command_queue transfer;
+    cl_command_queue compute;
+    cl_program       program;
+    cl_kernel        swap16, swap32, swap64, swapRecords;
+    size_t           chunk;                    /* bytes per chunk */
+    cl_mem           staging[2];
+    void*            stage[2];
+} SwapUploader;
+
+/*
+ Creates the queues and kernels of byte_swap.cl (read from source) on
+ device, and two pinned staging buffers of chunk bytes.
+ Returns CL_SUCCESS or the first OpenCL error.
+*/
+cl_int swapUploaderInit(SwapUploader* up, cl_context context, cl_device_id device,
+                        const char* source, size_t chunk);
+
+void swapUploaderRelease(SwapUploader* up);
+
+/*
+ Uploads records of layout from src, stored in the opposite byte order,
+ into buffer converted to host byte order. Returns when the data in buffer
+ is ready; the kernels of later work may be enqueued on up->compute.
+*/
+cl_int swapUpload(SwapUploader* up, cl_mem buffer, const void* src, size_t records,
+                  const SwapLayout* layout, SwapMode mode);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,38 +1,99 @@
+/*
+ Two-pass argmin/argmax. Each work-item keeps a (value, index) pair over a
+ grid-stride loop, the pairs are reduced in local memory, and every group
+ writes its pair out; a single work-group then reduces the group results.
+ No global atomics are needed, so there is no contention between groups.
 
-#pragma OPENCL EXTENSION cl_khr_local_int32_extended_atomics : enable 
-#pragma OPENCL EXTENSION cl_khr_global_int32_extended_atomics : enable 
-
-__kernel void par_min(__global uint4* src,
-                      __global uint * globalMin,
-                      __local  uint * localMin,
-                      int             numOfItems,
-                      uint            device) {
-
-    uint count = ( numOfItems / 4) / get_global_size(0);
-    uint index = (dev == 0) ? get_global_id(0) * count: get_global_id(0);
-    
-    uint stride = (dev == 0) ? 1 : get_global_size(0);
-    uint partialMin = (uint) -1;
-
-    for(int i = 0; i < count; ++i, index += stride) {
-        partialMin = min(partialMin, src[index].x);
-        partialMin = min(partialMin, src[index].y);
-        partialMin = min(partialMin, src[index].z);
-        partialMin = min(partialMin, src[index].w);
-    }
+ Ties go to the smallest index, so the result is the same for any split of
+ the data between work-groups and devices.
+*/
 
-    if(get_local_id(0) == 0) localMin[0] = (uint) -1;
+// Whether (v, i) should replace (best, bestIdx).
+int better(uint v, uint i, uint best, uint bestIdx, uint findMax) {
+    if (v == best) return i < bestIdx;
+    return findMax ? v > best : v < best;
+}
 
-    barrier(CLK_LOCAL_MEM_FENCE);
+__kernel void par_minmax(__global const uint4* src,
+                         uint            first,
+                         uint            count,
+                         uint            findMax,
+                         __global uint * groupVal,
+                         __global uint * groupIdx,
+                         __local  uint * localVal,
+                         __local  uint * localIdx) {
 
-    atomic_min(localMin, globalMin);
+    uint lid = get_local_id(0);
+    uint best = findMax ? 0 : (uint) -1;
+    uint bestIdx = (uint) -1;
 
+    // src holds this device's partition, which starts at the uint4 'first'
+    // of the whole array.
+    for(uint i = get_global_id(0); i < count; i += get_global_size(0)) {
+        uint4 v = src[i];
+        uint base = (first + i) * 4;
+
+        if (better(v.x, base,     best, bestIdx, findMax)) { best = v.x; bestIdx = base;     }
+        if (better(v.y, base + 1, best, bestIdx, findMax)) { best = v.y; bestIdx = base + 1; }
+        if (better(v.z, base + 2, best, bestIdx, findMax)) { best = v.z; bestIdx = base + 2; }
+        if (better(v.w, base + 3, best, bestIdx, findMax)) { best = v.w; bestIdx = base + 3; }
+    }
+
+    localVal[lid] = best;
+    localIdx[lid] = bestIdx;
     barrier(CLK_LOCAL_MEM_FENCE);
 
-    if (get_local_id(0) == 0) globalMin[ get_group_id[0] ] = localMin[0];
+    // Local size is a power of two.
+    for(uint s = get_local_size(0) / 2; s > 0; s >>= 1) {
+        if (lid < s && better(localVal[lid + s], localIdx[lid + s], localVal[lid], localIdx[lid], findMax)) {
+            localVal[lid] = localVal[lid + s];
+            localIdx[lid] = localIdx[lid + s];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (lid == 0) {
+        groupVal[get_group_id(0)] = localVal[0];
+        groupIdx[get_group_id(0)] = localIdx[0];
+    }
 }
 
-__kernel void reduce(__global uint4* src,
-                     __global uint * globalMin) {
-    atom_min(globalMin, globalMin[get_global_id(0)]);
+/*
+ Second pass, run by a single work-group: reduces numOfGroups pairs and
+ stores the result into the first one.
+*/
+__kernel void reduce_minmax(__global uint * groupVal,
+                            __global uint * groupIdx,
+                            uint            numOfGroups,
+                            uint            findMax,
+                            __local  uint * localVal,
+                            __local  uint * localIdx) {
+
+    uint lid = get_local_id(0);
+    uint best = findMax ? 0 : (uint) -1;
+    uint bestIdx = (uint) -1;
+
+    for(uint i = lid; i < numOfGroups; i += get_local_size(0)) {
+        if (better(groupVal[i], groupIdx[i], best, bestIdx, findMax)) {
+            best = groupVal[i];
+            bestIdx = groupIdx[i];
+        }
+    }
+
+    localVal[lid] = best;
+    localIdx[lid] = bestIdx;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for(uint s = get_local_size(0) / 2; s > 0; s >>= 1) {
+        if (lid < s && better(localVal[lid + s], localIdx[lid + s], localVal[lid], localIdx[lid], findMax)) {
+            localVal[lid] = localVal[lid + s];
+            localIdx[lid] = localIdx[lid + s];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (lid == 0) {
+        groupVal[0] = localVal[0];
+        groupIdx[0] = localIdx[0];
+    }
 }
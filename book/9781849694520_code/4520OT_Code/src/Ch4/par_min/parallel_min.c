@@ -17,6 +17,10 @@
     Note: In the event that it runs on the CPU, then we cannot assign
           a local_work_size > 1 since the CPU forbids it. In the GPU, 
           that's an entirely different story :) whew
+
+    The data is split between the NDEVS devices; each device finds the
+    (value, index) pair of its partition with two kernel passes, and the
+    host combines the per-device pairs. Ties go to the smallest index.
 */
 void loadProgramSource(const char** files,
                        size_t length,
@@ -40,123 +44,186 @@ void loadProgramSource(const char** files,
 }
 
 
+/* Per-device state of the split reduction */
+typedef struct {
+    cl_device_id     device;
+    cl_context       context;
+    cl_command_queue cQ;
+    cl_program       program;
+    cl_kernel        parMinMax;
+    cl_kernel        reduce;
+    cl_mem           src_buffer;
+    cl_mem           val_buffer;
+    cl_mem           idx_buffer;
+    size_t           global_work_size;
+    size_t           local_work_size;
+    cl_uint          num_groups;
+    cl_uint          first;      // first uint4 of the partition
+    cl_uint          count;      // number of uint4 in the partition
+    cl_uint          value;
+    cl_uint          index;
+    cl_event         done[2];
+} DeviceState;
+
+int better(cl_uint v, cl_uint i, cl_uint best, cl_uint bestIdx, cl_uint findMax) {
+    if (v == best) return i < bestIdx;
+    return findMax ? v > best : v < best;
+}
+
+/* Enqueues both passes of the reduction and the read of the result */
+void enqueueMinMax(DeviceState* s, cl_uint findMax) {
+    size_t one_group = s->local_work_size;
+
+    clSetKernelArg(s->parMinMax, 3, sizeof(cl_uint), &findMax);
+    clSetKernelArg(s->reduce,    3, sizeof(cl_uint), &findMax);
+
+    clEnqueueNDRangeKernel(s->cQ, s->parMinMax, 1, NULL, &s->global_work_size, &s->local_work_size, 0, NULL, NULL);
+    clEnqueueNDRangeKernel(s->cQ, s->reduce,    1, NULL, &one_group, &s->local_work_size, 0, NULL, NULL);
+
+    clEnqueueReadBuffer(s->cQ, s->val_buffer, CL_FALSE, 0, sizeof(cl_uint), &s->value, 0, NULL, &s->done[0]);
+    clEnqueueReadBuffer(s->cQ, s->idx_buffer, CL_FALSE, 0, sizeof(cl_uint), &s->index, 0, NULL, &s->done[1]);
+    clFlush(s->cQ);
+}
+
 int main(int argc, char** argv) {
   cl_platform_id platform;
   int dev;
   cl_device_type devs[NDEVS] = { CL_DEVICE_TYPE_CPU, CL_DEVICE_TYPE_GPU };
+  DeviceState state[NDEVS];
 
   cl_uint *src_ptr;
   unsigned int numOfItems = DATA_SIZE;
 
   src_ptr = (cl_uint*) malloc( numOfItems * sizeof(cl_uint));
-  cl_uint min = (cl_uint) -1;
+  cl_uint min = (cl_uint) -1, max = 0;
+  cl_uint minIdx = 0, maxIdx = 0;
 
+  srand(42);
   for( int i = 0; i < numOfItems; ++i) {
-    src_ptr[i] = (cl_uint) i;
-    min = src_ptr[i] < min? src_ptr[i] : min;
+    src_ptr[i] = ((cl_uint) rand() << 16) ^ (cl_uint) rand();
+    if (src_ptr[i] < min) { min = src_ptr[i]; minIdx = i; }
+    if (src_ptr[i] > max) { max = src_ptr[i]; maxIdx = i; }
   }
 
+  const char* files[1] = {"par_min.cl"};
+  const int NUMBER_OF_FILES = 1;
+  char* programSource[NUMBER_OF_FILES];
+  size_t sizes[NUMBER_OF_FILES];
+  loadProgramSource(files, NUMBER_OF_FILES, programSource, sizes);
+
+  // Split the uint4 elements evenly; the last device takes the remainder.
+  // numOfItems is a multiple of 4.
+  cl_uint numOfVectors = numOfItems / 4;
+
   // Get the supported platforms
   clGetPlatformIDs(1, &platform, NULL);
   for( dev = 0; dev < NDEVS; dev++ ) { 
-    cl_device_id     device;
-    cl_context       context;
-    cl_command_queue cQ;
-    cl_program       program;
-    cl_kernel        paraMin;
-    cl_kernel        reduce;
+    DeviceState* s = &state[dev];
 
-    cl_mem           src_buffer;
-    cl_mem           dst_buffer;
-    
-    cl_uint          *dst_ptr;
-    
-    clGetDeviceIDs(platform, devs[dev], 1, &device, NULL);
+    if (clGetDeviceIDs(platform, devs[dev], 1, &s->device, NULL) != CL_SUCCESS)
+      clGetDeviceIDs(platform, CL_DEVICE_TYPE_DEFAULT, 1, &s->device, NULL);
 
     cl_uint compute_units;
-    size_t  global_work_size;
-    size_t  local_work_size;
-    size_t  num_groups;
+    clGetDeviceInfo( s->device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(compute_units), &compute_units, NULL);
 
-    size_t  paramSize = 0;
-    clGetDeviceInfo( device, CL_DEVICE_MAX_COMPUTE_UNITS, 0, NULL, &paramSize );
-    cl_uint* ret = (cl_uint*) alloca(sizeof(cl_uint) * paramSize);
-    clGetDeviceInfo( device, CL_DEVICE_MAX_COMPUTE_UNITS, paramSize, ret, NULL);
-    compute_units = *ret;
+    cl_device_type type;
+    clGetDeviceInfo( s->device, CL_DEVICE_TYPE, sizeof(type), &type, NULL);
 
     // Since the CPU doesn't permit parallel executing threads per core
     // hence we assign 1 thread to per core
-    if (devs[dev] == CL_DEVICE_TYPE_CPU ) {
-      global_work_size = compute_units * 1; // 1 thread per core
-      local_work_size = 1;
+    if (type == CL_DEVICE_TYPE_CPU ) {
+      s->local_work_size = 1;
+      s->num_groups = compute_units;
     } else {
-      cl_uint ws = 64; // represents the warp (NVIDIA) or wavefront (ATI)
-      global_work_size = compute_units * ws;
-      while( (numOfItems / 4) % global_work_size != 0 ) global_work_size += ws;
-
-      local_work_size = ws;
+      s->local_work_size = 64; // represents the warp (NVIDIA) or wavefront (ATI)
+      s->num_groups = compute_units * 4;
     }
-    num_groups = global_work_size / local_work_size;
+    s->global_work_size = s->num_groups * s->local_work_size;
 
-    context  = clCreateContext(NULL, 1, &device, NULL, NULL, NULL);
-    cQ       = clCreateCommandQueue(context, device, 0, NULL);
-    if (cQ == NULL ) { 
+    s->first = dev * (numOfVectors / NDEVS);
+    s->count = dev == NDEVS - 1 ? numOfVectors - s->first : numOfVectors / NDEVS;
+
+    s->context  = clCreateContext(NULL, 1, &s->device, NULL, NULL, NULL);
+    s->cQ       = clCreateCommandQueue(s->context, s->device, 0, NULL);
+    if (s->cQ == NULL ) { 
       printf("Cannot create device, darn...exiting...\n");
       exit(-1);
     }
-    const char* files[1] = {"par_min.cl"};
-    const int NUMBER_OF_FILES = 1;
-    char* programSource[NUMBER_OF_FILES];
-    size_t sizes[NUMBER_OF_FILES];
-    loadProgramSource(files, NUMBER_OF_FILES, programSource, sizes);
-    program  = clCreateProgramWithSource(context, 1, (const char**)programSource, NULL, NULL);
-    clBuildProgram(program, 0, NULL, NULL, NULL, NULL);
-
-    paraMin  = clCreateKernel(program, "par_min", NULL);
-    reduce   = clCreateKernel(program, "reduce" , NULL);
-
-    printf("Kernels created!");
-
-    // Prepare memory data structures
-    src_buffer = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, 
-                                numOfItems * sizeof(cl_uint),
-                                src_ptr, NULL);
-    dst_buffer = clCreateBuffer(context, CL_MEM_WRITE_ONLY, global_work_size * sizeof(cl_uint),
-                                NULL, NULL);
-    dst_ptr = (cl_uint*) malloc(numOfItems * sizeof(cl_uint));
+    s->program  = clCreateProgramWithSource(s->context, 1, (const char**)programSource, NULL, NULL);
+    clBuildProgram(s->program, 0, NULL, NULL, NULL, NULL);
+
+    s->parMinMax = clCreateKernel(s->program, "par_minmax", NULL);
+    s->reduce    = clCreateKernel(s->program, "reduce_minmax", NULL);
+
+    // Each device only gets its own partition of the data
+    s->src_buffer = clCreateBuffer(s->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                   s->count * 4 * sizeof(cl_uint),
+                                   src_ptr + s->first * 4, NULL);
+    s->val_buffer = clCreateBuffer(s->context, CL_MEM_READ_WRITE, s->num_groups * sizeof(cl_uint), NULL, NULL);
+    s->idx_buffer = clCreateBuffer(s->context, CL_MEM_READ_WRITE, s->num_groups * sizeof(cl_uint), NULL, NULL);
 
     // Set the necessary arguments to kernel's parameters
-    clSetKernelArg(paraMin, 0, sizeof(cl_mem),     &src_buffer);
-    clSetKernelArg(paraMin, 1, sizeof(cl_mem),     &dst_buffer);
-    clSetKernelArg(paraMin, 2, sizeof(cl_mem),     NULL);
-    clSetKernelArg(paraMin, 3, sizeof(numOfItems), &numOfItems);
-    clSetKernelArg(paraMin, 4, sizeof(dev),        &dev);
-    
-    clSetKernelArg(reduce, 0, sizeof(cl_mem),      &src_buffer);
-    clSetKernelArg(reduce, 0, sizeof(cl_mem),      &dst_buffer);
-
-    // Using events to manage execution dependency
-    // so the kernel 'reduce' runs after 'paraMin'
-    cl_event waitForParaMinToComplete;
-    clEnqueueNDRangeKernel(cQ, paraMin, 1, NULL, &global_work_size, &local_work_size, 0, NULL, &waitForParaMinToComplete);
-    clEnqueueNDRangeKernel(cQ, reduce , 1, NULL, &num_groups, NULL, 1, &waitForParaMinToComplete, NULL);
-
-    clFinish(cQ);
-
-    clEnqueueReadBuffer(cQ, dst_buffer, CL_TRUE, 0, num_groups *sizeof(cl_uint),dst_ptr , 0, NULL, NULL);
-
-    printf("computed min=%d, local min=%d\n", dst_ptr[0], min);
-    if(dst_ptr[0] == min)
+    clSetKernelArg(s->parMinMax, 0, sizeof(cl_mem),  &s->src_buffer);
+    clSetKernelArg(s->parMinMax, 1, sizeof(cl_uint), &s->first);
+    clSetKernelArg(s->parMinMax, 2, sizeof(cl_uint), &s->count);
+    clSetKernelArg(s->parMinMax, 4, sizeof(cl_mem),  &s->val_buffer);
+    clSetKernelArg(s->parMinMax, 5, sizeof(cl_mem),  &s->idx_buffer);
+    clSetKernelArg(s->parMinMax, 6, s->local_work_size * sizeof(cl_uint), NULL);
+    clSetKernelArg(s->parMinMax, 7, s->local_work_size * sizeof(cl_uint), NULL);
+
+    clSetKernelArg(s->reduce, 0, sizeof(cl_mem),  &s->val_buffer);
+    clSetKernelArg(s->reduce, 1, sizeof(cl_mem),  &s->idx_buffer);
+    clSetKernelArg(s->reduce, 2, sizeof(cl_uint), &s->num_groups);
+    clSetKernelArg(s->reduce, 4, s->local_work_size * sizeof(cl_uint), NULL);
+    clSetKernelArg(s->reduce, 5, s->local_work_size * sizeof(cl_uint), NULL);
+  }
+
+  printf("Kernels created!\n");
+
+  for(cl_uint findMax = 0; findMax < 2; ++findMax) {
+    // All devices work on their partitions at the same time...
+    for( dev = 0; dev < NDEVS; dev++ )
+      enqueueMinMax(&state[dev], findMax);
+
+    // ...and the host combines the per-device results
+    cl_uint best = findMax ? 0 : (cl_uint) -1;
+    cl_uint bestIdx = (cl_uint) -1;
+    for( dev = 0; dev < NDEVS; dev++ ) {
+      DeviceState* s = &state[dev];
+      clWaitForEvents(2, s->done);
+      clReleaseEvent(s->done[0]);
+      clReleaseEvent(s->done[1]);
+
+      if (better(s->value, s->index, best, bestIdx, findMax)) {
+        best = s->value;
+        bestIdx = s->index;
+      }
+    }
+
+    cl_uint ref = findMax ? max : min;
+    cl_uint refIdx = findMax ? maxIdx : minIdx;
+
+    printf("computed arg%s=%u (%u), host arg%s=%u (%u)\n",
+           findMax ? "max" : "min", bestIdx, best,
+           findMax ? "max" : "min", refIdx, ref);
+    if(bestIdx == refIdx && best == ref)
       printf("Check has passed!\n");
     else
       printf("Check has failed!\n");
+  }
 
-    clReleaseMemObject(dst_buffer);
-    clReleaseProgram(program);
-    clReleaseCommandQueue(cQ);
-    free(dst_ptr);
+  for( dev = 0; dev < NDEVS; dev++ ) {
+    DeviceState* s = &state[dev];
+    clReleaseMemObject(s->src_buffer);
+    clReleaseMemObject(s->val_buffer);
+    clReleaseMemObject(s->idx_buffer);
+    clReleaseKernel(s->parMinMax);
+    clReleaseKernel(s->reduce);
+    clReleaseProgram(s->program);
+    clReleaseCommandQueue(s->cQ);
+    clReleaseContext(s->context);
   }
 
+  free(programSource[0]);
   free(src_ptr);
 }
-
@@ -0,0 +1,102 @@
+// y = alpha A x + beta y and y = alpha A^T x + beta y for a dense row-major
+// rows x cols matrix A. The shape of the work-groups is chosen at run time
+// (see gemv.h): local size 0 runs along the rows of A, so that neighbouring
+// work-items read neighbouring columns, local size 1 across them. Both have
+// to be powers of two.
+
+// Floats of x staged in local memory at a time
+#ifndef GEMV_TILE
+#define GEMV_TILE 1024
+#endif
+
+// Every work-group computes get_local_size(1) rows, each row shared by the
+// get_local_size(0) work-items along it. The slices of x are read from
+// global memory once per work-group instead of once per row, and the partial
+// dot products of a row are summed with a tree in local memory.
+__kernel void gemv(__global const float* A,
+                   __global const float* x,
+                   __global float* y,
+                   uint rows,
+                   uint cols,
+                   float alpha,
+                   float beta,
+                   __local float* partial) {
+    __local float xtile[GEMV_TILE];
+
+    uint lanes = get_local_size(0);
+    uint lane = get_local_id(0);
+    uint lid = get_local_id(1) * lanes + lane;
+    uint groupSize = lanes * get_local_size(1);
+    uint row = get_global_id(1);
+
+    // rows past the end compute the last one again, and don't store it
+    __global const float* a = A + (size_t)min(row, rows - 1) * cols;
+    float sum = 0;
+
+    for(uint base = 0; base < cols; base += GEMV_TILE) {
+        uint n = min((uint)GEMV_TILE, cols - base);
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+        for(uint i = lid; i < n; i += groupSize) xtile[i] = x[base + i];
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        for(uint j = lane; j < n; j += lanes) sum += a[base + j] * xtile[j];
+    }
+
+    partial[lid] = sum;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for(uint s = lanes / 2; s > 0; s >>= 1) {
+        if (lane < s) partial[lid] += partial[lid + s];
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (lane == 0 && row < rows)
+        y[row] = alpha * partial[lid] + (beta != 0 ? beta * y[row] : 0);
+}
+
+// Every work-item along local size 0 owns a column of A, so that the reads
+// of a row are coalesced; the get_local_size(1) work-items of a column take
+// every get_local_size(1)-th row of each slice of x and are summed with a
+// tree in local memory.
+__kernel void gemv_t(__global const float* A,
+                     __global const float* x,
+                     __global float* y,
+                     uint rows,
+                     uint cols,
+                     float alpha,
+                     float beta,
+                     __local float* partial) {
+    __local float xtile[GEMV_TILE];
+
+    uint lanes = get_local_size(0);
+    uint slices = get_local_size(1);
+    uint lane = get_local_id(0);
+    uint slice = get_local_id(1);
+    uint lid = slice * lanes + lane;
+    uint col = get_global_id(0);
+
+    __global const float* a = A + min(col, cols - 1);
+    float sum = 0;
+
+    for(uint base = 0; base < rows; base += GEMV_TILE) {
+        uint n = min((uint)GEMV_TILE, rows - base);
+
+        barrier(CLK_LOCAL_MEM_FENCE);
+        for(uint i = lid; i < n; i += lanes * slices) xtile[i] = x[base + i];
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        for(uint i = slice; i < n; i += slices) sum += a[(size_t)(base + i) * cols] * xtile[i];
+    }
+
+    partial[lid] = sum;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for(uint s = slices / 2; s > 0; s >>= 1) {
+        if (slice < s) partial[lid] += partial[lid + s * lanes];
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    if (slice == 0 && col < cols)
+        y[col] = alpha * partial[lane] + (beta != 0 ? beta * y[col] : 0);
+}
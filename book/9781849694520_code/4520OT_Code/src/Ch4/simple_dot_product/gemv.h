@@ -0,0 +1,105 @@
+#ifndef GEMV_H
+#define GEMV_H
+
+#include <stdio.h>
+
+#ifdef APPLE
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+/**
+ * Host side of the gemv and gemv_t kernels of gemv.cl: y = alpha A x + beta y
+ * and y = alpha A^T x + beta y for a dense row-major rows x cols matrix.
+ *
+ * The shape of the work-groups is a run-time choice, so one build of the
+ * program serves every shape and gemvTune() only has to time launches. The
+ * best shape depends on the device and on the matrix: many work-items per
+ * row pay off for long rows, many rows per work-group for short ones.
+ */
+
+#define GEMV_MAX_GROUP 256
+#define GEMV_TUNE_RUNS 3
+
+typedef struct {
+    size_t x;   // work-items along a row of A, i.e. over consecutive columns
+    size_t y;   // work-items across the rows of A
+} GemvShape;
+
+/* Sets the arguments of a gemv or gemv_t kernel, except the local memory. */
+void gemvSetArgs(cl_kernel kernel, cl_mem A, cl_mem x, cl_mem y,
+                 cl_uint rows, cl_uint cols, float alpha, float beta) {
+    clSetKernelArg(kernel, 0, sizeof(cl_mem), &A);
+    clSetKernelArg(kernel, 1, sizeof(cl_mem), &x);
+    clSetKernelArg(kernel, 2, sizeof(cl_mem), &y);
+    clSetKernelArg(kernel, 3, sizeof(cl_uint), &rows);
+    clSetKernelArg(kernel, 4, sizeof(cl_uint), &cols);
+    clSetKernelArg(kernel, 5, sizeof(float), &alpha);
+    clSetKernelArg(kernel, 6, sizeof(float), &beta);
+}
+
+/* Enqueues the kernel with work-groups of the given shape. */
+cl_int gemvEnqueue(cl_command_queue queue, cl_kernel kernel, int transposed,
+                   cl_uint rows, cl_uint cols, GemvShape shape, cl_event* event) {
+    size_t local[] = {shape.x, shape.y};
+    size_t global[2];
+
+    if (transposed) {
+        global[0] = (cols + shape.x - 1) / shape.x * shape.x;
+        global[1] = shape.y;
+    } else {
+        global[0] = shape.x;
+        global[1] = (rows + shape.y - 1) / shape.y * shape.y;
+    }
+
+    clSetKernelArg(kernel, 7, shape.x * shape.y * sizeof(float), NULL);
+    return clEnqueueNDRangeKernel(queue, kernel, 2, NULL, global, local, 0, NULL, event);
+}
+
+/*
+ Times every power of two shape of 32 to GEMV_MAX_GROUP work-items the
+ kernel accepts on the device, each GEMV_TUNE_RUNS times on the profiling
+ queue, and returns the fastest; *seconds gets its time. The arguments of
+ the kernel have to be set, and y is overwritten. A shape of 0 x 0 means
+ that no launch succeeded.
+ */
+GemvShape gemvTune(cl_command_queue queue, cl_device_id device, cl_kernel kernel,
+                   int transposed, cl_uint rows, cl_uint cols, double* seconds) {
+    GemvShape best = {0, 0};
+    size_t maxGroup = 0;
+
+    clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t), &maxGroup, NULL);
+    if (maxGroup > GEMV_MAX_GROUP) maxGroup = GEMV_MAX_GROUP;
+    *seconds = -1;
+
+    for(size_t x = 1; x <= maxGroup; x *= 2) {
+        for(size_t y = 1; x * y <= maxGroup; y *= 2) {
+            GemvShape shape = {x, y};
+            double time = -1;
+
+            if (x * y < 32) continue;
+
+            for(int r = 0; r < GEMV_TUNE_RUNS; ++r) {
+                cl_event e;
+                cl_ulong start, end;
+
+                if (gemvEnqueue(queue, kernel, transposed, rows, cols, shape, &e) != CL_SUCCESS) break;
+                clWaitForEvents(1, &e);
+                clGetEventProfilingInfo(e, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
+                clGetEventProfilingInfo(e, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
+                clReleaseEvent(e);
+
+                if (time < 0 || (end - start) * 1e-9 < time) time = (end - start) * 1e-9;
+            }
+
+            if (time >= 0 && (*seconds < 0 || time < *seconds)) {
+                best = shape;
+                *seconds = time;
+            }
+        }
+    }
+    return best;
+}
+
+#endif
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <sys/types.h>
 #include <alloca.h>
+#include <math.h>
 #include "matvecmult_config.h"
 
 #ifdef APPLE
@@ -10,11 +11,15 @@
 #include <CL/cl.h>
 #endif
 
+#include "gemv.h"
+
 #define VECTOR_LENGTH 4
 //#define DATA_SIZE 16      // for test runs,
 #define DATA_SIZE 1048576 // for standard runs,
 //#define DATA_SIZE 2097152   // for large runs,
 
+#define GEMV_ORDER 4096     // rows and columns of the general matrix-vector product
+
 /*
     This program requires all the devices to be supported by the
     OpenCL 1.1 Refer to the Khronos Group for list of supported
@@ -71,6 +76,90 @@ void loadProgramSource(const char** files,
 	   }
 }
 
+/*
+ General matrix-vector products with the kernels of gemv.cl, unlike
+ MatVecMultUsingDotFn for any number of columns: the shape of the
+ work-groups is tuned on the device for A x and for A^T x, then the results
+ are checked against the host.
+ */
+void runGemv(cl_context context, cl_device_id device) {
+    const cl_uint n = GEMV_ORDER;
+    const char* names[] = {"gemv", "gemv_t"};
+    cl_int error;
+
+    cl_float* A = (cl_float*) malloc(sizeof(cl_float) * n * n);
+    cl_float* x = (cl_float*) malloc(sizeof(cl_float) * n);
+    cl_float* y = (cl_float*) malloc(sizeof(cl_float) * n);
+    for(size_t i = 0; i < (size_t)n * n; ++i) A[i] = (float)(i % 17) - 8.0f;
+    for(cl_uint i = 0; i < n; ++i) x[i] = (float)(i % 5) * 0.25f;
+
+    const char *file_names[] = {"gemv.cl"};
+    char* buffer[1];
+    size_t sizes[1];
+    loadProgramSource(file_names, 1, buffer, sizes);
+
+    cl_program program = clCreateProgramWithSource(context, 1, (const char**)buffer, sizes, &error);
+    free(buffer[0]);
+    if (error != CL_SUCCESS || clBuildProgram(program, 1, &device, NULL, NULL, NULL) != CL_SUCCESS) {
+        perror("Can't build gemv.cl");
+        exit(1);
+    }
+
+    cl_command_queue queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &error);
+    cl_mem aobj = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                 sizeof(cl_float) * n * n, A, &error);
+    cl_mem xobj = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                 sizeof(cl_float) * n, x, &error);
+    cl_mem yobj = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(cl_float) * n, NULL, &error);
+    if (error != CL_SUCCESS) {
+        perror("Unable to create the gemv buffers");
+        exit(1);
+    }
+
+    for(int t = 0; t < 2; ++t) {
+        double seconds;
+        cl_kernel kernel = clCreateKernel(program, names[t], &error);
+
+        gemvSetArgs(kernel, aobj, xobj, yobj, n, n, 1.0f, 0.0f);
+        GemvShape shape = gemvTune(queue, device, kernel, t, n, n, &seconds);
+        if (!shape.x) {
+            printf("%s: no work-group shape runs on this device\n", names[t]);
+            clReleaseKernel(kernel);
+            continue;
+        }
+
+        // the last tuning run is of some other shape
+        gemvEnqueue(queue, kernel, t, n, n, shape, NULL);
+        clEnqueueReadBuffer(queue, yobj, CL_TRUE, 0, sizeof(cl_float) * n, y, 0, NULL, NULL);
+
+        int ok = 1;
+        for(cl_uint i = 0; i < n && ok; ++i) {
+            double sum = 0, size = 0;
+            for(cl_uint j = 0; j < n; ++j) {
+                double p = (t ? A[(size_t)j * n + i] : A[(size_t)i * n + j]) * x[j];
+                sum += p;
+                size += fabs(p);
+            }
+            // float rounding grows with the terms, not with their sum
+            ok = fabs(y[i] - sum) <= 1e-5 * (1 + size);
+        }
+
+        printf("%-6s %ux%u, %zux%zu work-items per group: %.3f ms, %.1f GB/s, check %s\n",
+               names[t], n, n, shape.x, shape.y, seconds * 1e3,
+               sizeof(cl_float) * (double)n * n / seconds * 1e-9, ok ? "passed" : "failed");
+        clReleaseKernel(kernel);
+    }
+
+    clReleaseMemObject(aobj);
+    clReleaseMemObject(xobj);
+    clReleaseMemObject(yobj);
+    clReleaseCommandQueue(queue);
+    clReleaseProgram(program);
+    free(A);
+    free(x);
+    free(y);
+}
+
 int main(int argc, char** argv) {
 
    /* OpenCL 1.1 data structures */
@@ -263,6 +352,8 @@ int main(int argc, char** argv) {
 	            clReleaseMemObject(outobj);
 	        } 
 
+	        runGemv(context, devices[i]);
+
         /* Clean up */
         
         for(cl_uint i = 0; i < numOfKernels; i++) { clReleaseKernel(kernels[i]); }
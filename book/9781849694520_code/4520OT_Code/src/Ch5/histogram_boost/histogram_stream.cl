@@ -0,0 +1,56 @@
+#pragma OPENCL EXTENSION cl_khr_global_int32_base_atomics : enable
+#pragma OPENCL EXTENSION cl_khr_local_int32_base_atomics : enable
+
+#define BIN_SIZE 256
+
+/**
+ * Histograms of a batch of 8-bit gray images packed one after another.
+ *
+ * @param   pixels      - pixels of the batch
+ * @param   offset      - start of each image in 'pixels'; offset[count] is the end of the last one
+ * @param   count       - number of images in the batch
+ * @param   firstImage  - number of the first image of the batch in the whole stream
+ * @param   groupsPerImage - work-groups working on each image
+ * @param   hist        - per-image histograms of the whole stream, BIN_SIZE bins each
+ *
+ * Each work-group counts its share of one image into a block-histogram in
+ * local memory and adds it to the histogram of the image, so images of a
+ * batch need no host synchronization between them.
+ */
+__kernel
+void histogram_batch(__global const uchar* pixels,
+                     __global const uint* offset,
+                     uint count,
+                     uint firstImage,
+                     uint groupsPerImage,
+                     __global uint* hist)
+{
+    __local uint bins[BIN_SIZE];
+
+    size_t localId   = get_local_id(0);
+    size_t groupSize = get_local_size(0);
+    uint   image     = get_group_id(0) / groupsPerImage;
+    uint   part      = get_group_id(0) % groupsPerImage;
+
+    for(size_t i = localId; i < BIN_SIZE; i += groupSize)
+        bins[i] = 0;
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (image < count) {
+        uint begin = offset[image];
+        uint end   = offset[image + 1];
+
+        for(uint i = begin + part * groupSize + localId; i < end; i += groupsPerImage * groupSize)
+            atomic_inc(bins + pixels[i]);
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (image < count) {
+        __global uint* h = hist + (firstImage + image) * BIN_SIZE;
+
+        for(size_t i = localId; i < BIN_SIZE; i += groupSize)
+            if (bins[i]) atomic_add(h + i, bins[i]);
+    }
+}
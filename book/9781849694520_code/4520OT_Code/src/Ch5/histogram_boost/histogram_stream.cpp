@@ -0,0 +1,263 @@
+/*
+ Streaming histograms of a directory of JPEG images.
+
+ histogram.cpp decodes a single image with Boost.GIL and counts its pixels
+ serially. Here a pool of decoder threads converts images to 8-bit gray and
+ packs them into pinned (page-locked) staging buffers, while the device
+ counts the previous batch. Each batch is one buffer copy and one kernel
+ launch over all of its images; the per-image histograms accumulate on the
+ device and are read back once at the end, so there is no host/device
+ synchronization per image.
+
+ Usage: HistogramStream <directory> [batch bytes] [decoder threads]
+ */
+
+#define __CL_ENABLE_EXCEPTIONS
+
+#include <vexcl/vexcl.hpp>
+#include <boost/gil/image.hpp>
+#include <boost/gil/typedefs.hpp>
+#include <boost/gil/color_convert.hpp>
+#include <boost/gil/extension/io/jpeg_io.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/chrono.hpp>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+
+using namespace boost::gil;
+
+#define BIN_SIZE 256
+#define GROUP_SIZE 256
+#define GROUPS_PER_IMAGE 16
+
+typedef boost::chrono::high_resolution_clock clock_type;
+
+struct image_info {
+    std::string name;
+    size_t      pixels;
+};
+
+/*
+ Staging slot: pinned host memory the decoders write into, device copy of it,
+ and offsets of the images inside the batch. 'copied' completes when the
+ device no longer needs the host side of the slot.
+ */
+struct slot {
+    cl::Buffer pinned;
+    cl::Buffer pixels;
+    cl::Buffer offset;
+    cl_uchar*  host;
+    std::vector<cl_uint> start;
+    cl::Event  copied;
+};
+
+std::string loadSource(const char *fname) {
+    std::ifstream f(fname);
+    if (!f) {
+        std::cerr << "Couldn't read the program file " << fname << std::endl;
+        exit(1);
+    }
+    std::ostringstream s;
+    s << f.rdbuf();
+    return s.str();
+}
+
+std::vector<image_info> listImages(const std::string &dir, size_t capacity) {
+    std::vector<image_info> images;
+
+    for(boost::filesystem::directory_iterator p(dir), end; p != end; ++p) {
+        std::string ext = p->path().extension().string();
+        std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+        if (ext != ".jpg" && ext != ".jpeg") continue;
+
+        image_info img;
+        img.name = p->path().string();
+
+        point2<std::ptrdiff_t> dim = jpeg_read_dimensions(img.name);
+        img.pixels = dim.x * dim.y;
+
+        if (img.pixels > capacity) {
+            std::cerr << "Skipping " << img.name << ": larger than the batch buffer" << std::endl;
+            continue;
+        }
+
+        images.push_back(img);
+    }
+
+    std::sort(images.begin(), images.end(),
+            [](const image_info &a, const image_info &b) { return a.name < b.name; });
+
+    return images;
+}
+
+/*
+ Decodes images [first, last) into the slot with the given number of threads.
+ Image offsets are known in advance from the dimensions, so the threads fill
+ disjoint parts of the staging buffer.
+ */
+void decodeBatch(const std::vector<image_info> &images, size_t first, size_t last,
+                 slot &s, unsigned nthreads)
+{
+    s.start.resize(last - first + 1);
+    s.start[0] = 0;
+    for(size_t i = first; i < last; i++)
+        s.start[i - first + 1] = s.start[i - first] + images[i].pixels;
+
+    std::atomic<size_t> next(first);
+    std::vector<std::thread> pool;
+
+    for(unsigned t = 0; t < nthreads; t++)
+        pool.push_back(std::thread([&]() {
+            gray8_image_t img;
+            for(size_t i = next++; i < last; i = next++) {
+                jpeg_read_and_convert_image(images[i].name, img);
+
+                gray8c_view_t v = const_view(img);
+                cl_uchar *dst = s.host + s.start[i - first];
+                for(gray8c_view_t::iterator p = v.begin(); p != v.end(); ++p)
+                    *dst++ = get_color(*p, gray_color_t());
+            }
+        }));
+
+    for(auto t = pool.begin(); t != pool.end(); t++) t->join();
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <directory> [batch bytes] [decoder threads]" << std::endl;
+        return 1;
+    }
+
+    size_t   capacity = argc > 2 ? atol(argv[2]) : (64 << 20);
+    unsigned nthreads = argc > 3 ? atoi(argv[3]) : std::max(1u, std::thread::hardware_concurrency());
+
+    std::vector<image_info> images = listImages(argv[1], capacity);
+    if (images.empty()) {
+        std::cerr << "No JPEG images found in " << argv[1] << std::endl;
+        return 1;
+    }
+
+    vex::Context ctx(vex::Filter::Env && vex::Filter::Count(1));
+    if (!ctx.size()) {
+        std::cerr << "Can't locate any OpenCL compliant device" << std::endl;
+        return 1;
+    }
+    std::cout << ctx << std::endl;
+
+    try {
+        cl::Context      context = ctx.context(0);
+        cl::CommandQueue queue   = ctx.queue(0);
+
+        cl::Program program = vex::build_sources(context, loadSource("histogram_stream.cl"));
+        cl::Kernel  kernel(program, "histogram_batch");
+
+        size_t maxImages = 0;
+        {
+            size_t bytes = 0, count = 0;
+            for(auto i = images.begin(); i != images.end(); i++) {
+                if (bytes + i->pixels > capacity) {
+                    maxImages = std::max(maxImages, count);
+                    bytes = count = 0;
+                }
+                bytes += i->pixels;
+                count++;
+            }
+            maxImages = std::max(maxImages, count);
+        }
+
+        // Two slots: the decoders fill one while the device works on the other.
+        slot slots[2];
+        for(int k = 0; k < 2; k++) {
+            slots[k].pinned = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR, capacity);
+            slots[k].pixels = cl::Buffer(context, CL_MEM_READ_ONLY, capacity);
+            slots[k].offset = cl::Buffer(context, CL_MEM_READ_ONLY, (maxImages + 1) * sizeof(cl_uint));
+            slots[k].host   = static_cast<cl_uchar*>(queue.enqueueMapBuffer(
+                        slots[k].pinned, CL_TRUE, CL_MAP_WRITE, 0, capacity));
+        }
+
+        std::vector<cl_uint> hist(images.size() * BIN_SIZE, 0);
+        cl::Buffer histBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                hist.size() * sizeof(cl_uint), hist.data());
+
+        clock_type::time_point start = clock_type::now();
+
+        size_t batches = 0;
+        for(size_t first = 0; first < images.size(); batches++) {
+            slot &s = slots[batches % 2];
+
+            size_t last = first, bytes = 0;
+            while(last < images.size() && bytes + images[last].pixels <= capacity)
+                bytes += images[last++].pixels;
+
+            // The copy issued from this slot two batches ago should be done
+            // before the decoders overwrite it.
+            if (s.copied()) s.copied.wait();
+
+            decodeBatch(images, first, last, s, nthreads);
+
+            cl_uint count = last - first;
+
+            queue.enqueueWriteBuffer(s.offset, CL_FALSE, 0,
+                    s.start.size() * sizeof(cl_uint), s.start.data());
+            queue.enqueueWriteBuffer(s.pixels, CL_FALSE, 0, bytes, s.host, 0, &s.copied);
+
+            kernel.setArg(0, s.pixels);
+            kernel.setArg(1, s.offset);
+            kernel.setArg(2, count);
+            kernel.setArg(3, static_cast<cl_uint>(first));
+            kernel.setArg(4, static_cast<cl_uint>(GROUPS_PER_IMAGE));
+            kernel.setArg(5, histBuffer);
+
+            queue.enqueueNDRangeKernel(kernel, cl::NullRange,
+                    count * GROUPS_PER_IMAGE * GROUP_SIZE, GROUP_SIZE);
+
+            // Let the device start on the batch while the next one is decoded.
+            queue.flush();
+
+            first = last;
+        }
+
+        queue.enqueueReadBuffer(histBuffer, CL_TRUE, 0, hist.size() * sizeof(cl_uint), hist.data());
+
+        double seconds = boost::chrono::duration<double>(clock_type::now() - start).count();
+
+        for(int k = 0; k < 2; k++)
+            queue.enqueueUnmapMemObject(slots[k].pinned, slots[k].host);
+        queue.finish();
+
+        /* verify results: every pixel goes to exactly one bin */
+        int result = 1;
+        size_t pixels = 0;
+        for(size_t i = 0; i < images.size(); i++) {
+            size_t total = 0;
+            for(int j = 0; j < BIN_SIZE; j++) total += hist[i * BIN_SIZE + j];
+            if (total != images[i].pixels) result = 0;
+            pixels += images[i].pixels;
+        }
+
+        std::fstream histo_file("out-histogram.txt", std::ios::out);
+        for(size_t i = 0; i < images.size(); i++) {
+            histo_file << images[i].name;
+            for(int j = 0; j < BIN_SIZE; j++) histo_file << " " << hist[i * BIN_SIZE + j];
+            histo_file << std::endl;
+        }
+        histo_file.close();
+
+        std::cout << images.size() << " images in " << batches << " batches, "
+                  << seconds << " s, " << images.size() / seconds << " images/s, "
+                  << pixels / seconds * 1e-6 << " Mpixel/s" << std::endl;
+        std::cout << (result ? "Passed!" : "Failed") << std::endl;
+
+        return result ? 0 : 1;
+    } catch(const cl::Error &e) {
+        std::cerr << "OpenCL error: " << e.what() << " (" << e.err() << ")" << std::endl;
+        return 1;
+    }
+}
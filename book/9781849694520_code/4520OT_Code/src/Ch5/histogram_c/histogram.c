@@ -1,27 +1,344 @@
+#define _POSIX_C_SOURCE 200112L
+
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <math.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "histogram_c_config.h"
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
-#define DATA_SIZE 1024
+#ifdef USE_OPENCL_BENCH
+#ifdef  __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/cl.h>
+#endif
+#endif
+
+#define DATA_SIZE (1 << 24)
 #define BIN_SIZE 256
+#define NUM_THREADS 4
+#define GROUP_SIZE 128
+#define RUNS 10
+
+/*
+ Each thread counts into SUB_HISTOGRAMS copies of the histogram, one per
+ byte position modulo SUB_HISTOGRAMS. Runs of equal bytes (flat image areas)
+ then increment different counters, instead of waiting on the store of the
+ previous increment of the same counter.
+ */
+#define SUB_HISTOGRAMS 4
+
+typedef struct {
+    const unsigned char* data;
+    size_t begin;
+    size_t end;
+    int id;
+    int nthreads;
+    unsigned int (*priv)[BIN_SIZE];   /* private histograms of all threads */
+    unsigned int* bin;
+    pthread_barrier_t* barrier;
+} HistogramTask;
+
+double now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+/* Counts the 8 bytes of w into the sub-histograms */
+static inline void count8(uint64_t w, unsigned int sub[SUB_HISTOGRAMS][BIN_SIZE]) {
+    sub[0][(w      ) & 0xff]++;
+    sub[1][(w >>  8) & 0xff]++;
+    sub[2][(w >> 16) & 0xff]++;
+    sub[3][(w >> 24) & 0xff]++;
+    sub[0][(w >> 32) & 0xff]++;
+    sub[1][(w >> 40) & 0xff]++;
+    sub[2][(w >> 48) & 0xff]++;
+    sub[3][(w >> 56)       ]++;
+}
+
+void countBytes(const unsigned char* data, size_t n, unsigned int* bin) {
+    unsigned int sub[SUB_HISTOGRAMS][BIN_SIZE];
+    memset(sub, 0, sizeof(sub));
+
+    size_t i = 0;
+#ifdef __AVX2__
+    /* One 32-byte load, unpacked into four 64-bit words */
+    for(; i + 32 <= n; i += 32) {
+        __m256i v  = _mm256_loadu_si256((const __m256i*)(data + i));
+        __m128i lo = _mm256_castsi256_si128(v);
+        __m128i hi = _mm256_extracti128_si256(v, 1);
+
+        count8((uint64_t)_mm_cvtsi128_si64(lo), sub);
+        count8((uint64_t)_mm_extract_epi64(lo, 1), sub);
+        count8((uint64_t)_mm_cvtsi128_si64(hi), sub);
+        count8((uint64_t)_mm_extract_epi64(hi, 1), sub);
+    }
+#endif
+    for(; i + 8 <= n; i += 8) {
+        uint64_t w;
+        memcpy(&w, data + i, sizeof(w));
+        count8(w, sub);
+    }
+    for(; i < n; i++)
+        sub[0][data[i]]++;
+
+    for(int j = 0; j < BIN_SIZE; j++) {
+        unsigned int s = 0;
+        for(int k = 0; k < SUB_HISTOGRAMS; k++) s += sub[k][j];
+        bin[j] = s;
+    }
+}
+
+/*
+ Counts the thread's share of data into its private histogram, then merges
+ bins [id * BIN_SIZE / nthreads, (id + 1) * BIN_SIZE / nthreads) of all private
+ histograms, so that the merge is done in parallel as well.
+ */
+void* histogramThread(void* arg) {
+    HistogramTask* task = (HistogramTask*) arg;
+
+    countBytes(task->data + task->begin, task->end - task->begin, task->priv[task->id]);
+
+    pthread_barrier_wait(task->barrier);
+
+    int first = task->id * BIN_SIZE / task->nthreads;
+    int last  = (task->id + 1) * BIN_SIZE / task->nthreads;
+
+    for(int j = first; j < last; j++) {
+        unsigned int s = 0;
+        for(int t = 0; t < task->nthreads; t++) s += task->priv[t][j];
+        task->bin[j] = s;
+    }
+
+    return NULL;
+}
+
+void histogramCPU(const unsigned char* data, size_t n, unsigned int* bin, int nthreads) {
+    pthread_t threads[nthreads];
+    HistogramTask tasks[nthreads];
+    unsigned int (*priv)[BIN_SIZE] = malloc(nthreads * sizeof(*priv));
+    pthread_barrier_t barrier;
+
+    pthread_barrier_init(&barrier, NULL, nthreads);
+
+    for(int t = 0; t < nthreads; t++) {
+        tasks[t].data     = data;
+        tasks[t].begin    = n * t / nthreads;
+        tasks[t].end      = n * (t + 1) / nthreads;
+        tasks[t].id       = t;
+        tasks[t].nthreads = nthreads;
+        tasks[t].priv     = priv;
+        tasks[t].bin      = bin;
+        tasks[t].barrier  = &barrier;
+    }
+
+    for(int t = 1; t < nthreads; t++)
+        if (pthread_create(&threads[t], NULL, histogramThread, &tasks[t])) {
+            perror("Unable to create a thread");
+            exit(1);
+        }
+
+    histogramThread(&tasks[0]);
+
+    for(int t = 1; t < nthreads; t++) pthread_join(threads[t], NULL);
+
+    pthread_barrier_destroy(&barrier);
+    free(priv);
+}
+
+#ifdef USE_OPENCL_BENCH
+void loadProgramSource(const char** files,
+                       size_t length,
+                       char** buffer,
+                       size_t* sizes) {
+    /* Read each source file (*.cl) and store the contents into a temporary datastore */
+    for(size_t i=0; i < length; i++) {
+        FILE* file = fopen(files[i], "r");
+        if(file == NULL) {
+            perror("Couldn't read the program file");
+            exit(1);
+        }
+        fseek(file, 0, SEEK_END);
+        sizes[i] = ftell(file);
+        rewind(file); // reset the file pointer so that 'fread' reads from the front
+        buffer[i] = (char*)malloc(sizes[i]+1);
+        buffer[i][sizes[i]] = '\0';
+        fread(buffer[i], sizeof(char), sizes[i], file);
+        fclose(file);
+    }
+}
+
+/*
+ Runs histogram256 from Ch5/histogram on the same data, widened to the uint
+ format the kernel expects, and returns the kernel time per run in seconds,
+ including the summation of the sub-histograms on the host.
+ */
+double histogramGPU(const unsigned char* bytes, size_t n, unsigned int* bin) {
+    cl_platform_id platform;
+    cl_device_id device;
+    cl_int error;
+
+    if (clGetPlatformIDs(1, &platform, NULL) != CL_SUCCESS ||
+        clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &device, NULL) != CL_SUCCESS) {
+        printf("No OpenCL GPU found, skipping the histogram256 benchmark\n");
+        return 0;
+    }
+
+    cl_context context = clCreateContext(NULL, 1, &device, NULL, NULL, &error);
+    if(error != CL_SUCCESS) {
+        perror("Can't create a valid OpenCL context");
+        exit(1);
+    }
+    cl_command_queue queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &error);
+
+    const char *file_names[] = {"histogram.cl"};
+    char* buffer[1];
+    size_t sizes[1];
+    loadProgramSource(file_names, 1, buffer, sizes);
+
+    cl_program program = clCreateProgramWithSource(context, 1, (const char**)buffer, sizes, &error);
+    error = clBuildProgram(program, 1, &device, "", NULL, NULL);
+    if(error != CL_SUCCESS) {
+        size_t log_size;
+        clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
+        char *program_log = (char*) malloc(log_size+1);
+        program_log[log_size] = '\0';
+        clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, log_size+1, program_log, NULL);
+        printf("\n=== ERROR ===\n\n%s\n=============\n", program_log);
+        free(program_log);
+        exit(1);
+    }
+
+    cl_kernel kernel = clCreateKernel(program, "histogram256", &error);
+
+    /* each work-item counts BIN_SIZE values */
+    size_t subHistogramCount = n / (GROUP_SIZE * BIN_SIZE);
+    size_t globalThreads = subHistogramCount * GROUP_SIZE;
+    size_t localThreads  = GROUP_SIZE;
+
+    cl_uint* data = (cl_uint*) malloc(n * sizeof(cl_uint));
+    for(size_t i = 0; i < n; i++) data[i] = bytes[i];
+
+    cl_uint* intermediateBins = (cl_uint*) malloc(subHistogramCount * BIN_SIZE * sizeof(cl_uint));
+
+    cl_mem inputDataBuffer = clCreateBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR,
+                                            n * sizeof(cl_uint), data, &error);
+    cl_mem intermediateBinBuffer = clCreateBuffer(context, CL_MEM_WRITE_ONLY,
+                                                  subHistogramCount * BIN_SIZE * sizeof(cl_uint), NULL, &error);
+
+    clSetKernelArg(kernel, 0, sizeof(cl_mem), (void*)&inputDataBuffer);
+    clSetKernelArg(kernel, 1, BIN_SIZE * GROUP_SIZE * sizeof(cl_uchar), NULL);
+    clSetKernelArg(kernel, 2, sizeof(cl_mem), (void*)&intermediateBinBuffer);
+
+    double seconds = 0;
+    for(int r = 0; r < RUNS; r++) {
+        cl_event exeEvt;
+        cl_ulong start, end;
+
+        error = clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &globalThreads, &localThreads, 0, NULL, &exeEvt);
+        if(error != CL_SUCCESS) {
+            printf("Kernel execution failure!\n");
+            exit(-22);
+        }
+        clWaitForEvents(1, &exeEvt);
+        clGetEventProfilingInfo(exeEvt, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
+        clGetEventProfilingInfo(exeEvt, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
+        clReleaseEvent(exeEvt);
+
+        clEnqueueReadBuffer(queue, intermediateBinBuffer, CL_TRUE, 0,
+                            subHistogramCount * BIN_SIZE * sizeof(cl_uint), intermediateBins, 0, NULL, NULL);
+
+        double t0 = now();
+        memset(bin, 0, BIN_SIZE * sizeof(unsigned int));
+        for(size_t i = 0; i < subHistogramCount; ++i)
+            for(int j = 0; j < BIN_SIZE; ++j)
+                bin[j] += intermediateBins[i * BIN_SIZE + j];
+
+        seconds += (end - start) * 1e-9 + (now() - t0);
+    }
+
+    free(buffer[0]);
+    free(data);
+    free(intermediateBins);
+    clReleaseMemObject(inputDataBuffer);
+    clReleaseMemObject(intermediateBinBuffer);
+    clReleaseKernel(kernel);
+    clReleaseProgram(program);
+    clReleaseCommandQueue(queue);
+    clReleaseContext(context);
+
+    return seconds / RUNS;
+}
+#endif
+
+int verify(const unsigned int* bin, const unsigned int* ref) {
+    for(int i = 0; i < BIN_SIZE; i++)
+        if (bin[i] != ref[i]) return 0;
+    return 1;
+}
 
 int main(int argc, char** argv) {
-    unsigned int* data = (unsigned int*) malloc( DATA_SIZE * sizeof(unsigned int));
-    unsigned int* bin  = (unsigned int*) malloc( BIN_SIZE * sizeof(unsigned int));
-    memset(data, 0x0, DATA_SIZE * sizeof(unsigned int));
-    memset(bin, 0x0, BIN_SIZE * sizeof(unsigned int));
+    size_t n = argc > 1 ? (size_t)atol(argv[1]) : DATA_SIZE;
+    int nthreads = argc > 2 ? atoi(argv[2]) : NUM_THREADS;
+
+    /* histogram256 works on blocks of GROUP_SIZE * BIN_SIZE values */
+    n = (n / (GROUP_SIZE * BIN_SIZE) ? n / (GROUP_SIZE * BIN_SIZE) : 1) * (GROUP_SIZE * BIN_SIZE);
+
+    unsigned char* data = (unsigned char*) malloc(n);
+    unsigned int ref[BIN_SIZE], bin[BIN_SIZE];
+    memset(ref, 0x0, sizeof(ref));
+
+    /* values are drawn from a narrow range, as in real images */
+    for(size_t i = 0; i < n; i++)
+        data[i] = (rand() % 64) + (rand() % 64) + (rand() % 64) + (rand() % 64);
 
-    for( int i = 0; i < DATA_SIZE; i++) {
-        int indx = rand() % BIN_SIZE;
-        data[i] = indx;
+    /* serial scalar count, the original version of this program */
+    double t0 = now();
+    for(size_t i = 0; i < n; ++i) {
+       ref[data[i]]++;
     }
+    double serial = now() - t0;
 
-    for( int i = 0; i < DATA_SIZE; ++i) {
-       bin[data[i]]++; 
+    double cpu = 0;
+    for(int r = 0; r < RUNS; r++) {
+        t0 = now();
+        histogramCPU(data, n, bin, nthreads);
+        cpu += now() - t0;
     }
+    cpu /= RUNS;
 
+    printf("n = %zu, %d threads, %d sub-histograms per thread%s\n", n, nthreads, SUB_HISTOGRAMS,
+#ifdef __AVX2__
+           ", AVX2"
+#else
+           ""
+#endif
+           );
+    printf("serial:       %8.3f ms %8.2f GB/s\n", serial * 1e3, n / serial * 1e-9);
+    printf("threaded:     %8.3f ms %8.2f GB/s %s\n", cpu * 1e3, n / cpu * 1e-9,
+           verify(bin, ref) ? "Passed!" : "Failed");
+
+#ifdef USE_OPENCL_BENCH
+    double gpu = histogramGPU(data, n, bin);
+    if (gpu > 0)
+        printf("histogram256: %8.3f ms %8.2f GB/s %s\n", gpu * 1e3, n / gpu * 1e-9,
+               verify(bin, ref) ? "Passed!" : "Failed");
+#endif
+
+#ifdef DEBUG
     for( int i = 0; i < BIN_SIZE; i ++) {
-        if (bin[i] == 0) continue; else printf("bin[%d] = %d\n", i, bin[i]);
-    }    
+        if (ref[i] == 0) continue; else printf("bin[%d] = %d\n", i, ref[i]);
+    }
+#endif
+
+    free(data);
 }
@@ -1,8 +1,13 @@
+// mmap and threads of bmp.h, clock_gettime of the tiled mode
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
 #include <alloca.h>
+#include <sched.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
@@ -13,9 +18,13 @@
 #endif
 
 #include "bmp.h"
+#include "filter_chain.h"
 #include "sobelfilter_config.h"
 
 #define GROUP_SIZE 256
+#define TILE_X 16
+#define TILE_Y 16
+#define RUNS 10
 
 // This function will generate the data via a 
 // CPU and we'll use this to verify our result against
@@ -176,7 +185,527 @@ decipherEvent(cl_event* event) {
     return 0;
 }
 
+/*
+ Average execution time of the 2D kernel in seconds, or -1 if it fails to
+ launch (e.g. the work-group is too large for the device).
+ */
+double timeKernel(cl_command_queue queue, cl_kernel kernel,
+                  size_t* globalThreads, size_t* localThreads) {
+    double total = 0;
+    for(int r = 0; r < RUNS; ++r) {
+        cl_event exeEvt;
+        cl_ulong start, end;
+        cl_int error = clEnqueueNDRangeKernel(queue, kernel, 2, NULL,
+                                              globalThreads, localThreads, 0, NULL, &exeEvt);
+        if (error != CL_SUCCESS) return -1;
+        clWaitForEvents(1, &exeEvt);
+        clGetEventProfilingInfo(exeEvt, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &start, NULL);
+        clGetEventProfilingInfo(exeEvt, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
+        clReleaseEvent(exeEvt);
+        total += (end - start) * 1e-9;
+    }
+    return total / RUNS;
+}
+
+/*
+ Fused chain: grayscale, Gaussian blur, Sobel and threshold generated as a
+ single kernel (see filter_chain.h), so the intermediate images never leave
+ local memory. Writes the edge map into 'output' and returns the average
+ kernel time, or -1 if the chain doesn't fit the device.
+ */
+double runChain(cl_context context, cl_device_id device, cl_command_queue queue,
+                cl_mem input, cl_mem output, cl_uint width, cl_uint height, float threshold) {
+    FilterChain chain;
+    cl_int error;
+    cl_ulong localMem = 0;
+
+    chainInit(&chain);
+    chainAdd(&chain, FILTER_GRAYSCALE, 0);
+    chainAdd(&chain, FILTER_GAUSSIAN_5x5, 0);
+    chainAdd(&chain, FILTER_SOBEL, 0);
+    chainAdd(&chain, FILTER_THRESHOLD, threshold);
+
+    size_t localBytes = chainLocalSize(&chain, TILE_X, TILE_Y);
+    clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong), &localMem, NULL);
+    if (localBytes > localMem) return -1;
+
+    char* source = chainSource(&chain, TILE_X, TILE_Y);
+    cl_program program = clCreateProgramWithSource(context, 1, (const char**)&source, NULL, &error);
+    free(source);
+    if(error != CL_SUCCESS) {
+        perror("Can't create the filter chain program");
+        exit(1);
+    }
+    error = clBuildProgram(program, 1, &device, "", NULL, NULL);
+    if(error != CL_SUCCESS) {
+        size_t log_size;
+        clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
+        char* program_log = (char*) malloc(log_size+1);
+        program_log[log_size] = '\0';
+        clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG,
+                              log_size+1, program_log, NULL);
+        printf("\n=== ERROR ===\n\n%s\n=============\n", program_log);
+        free(program_log);
+        exit(1);
+    }
+
+    cl_kernel kernel = clCreateKernel(program, FILTER_CHAIN_KERNEL, &error);
+    clSetKernelArg(kernel, 0, sizeof(cl_mem), (void*)&input);
+    clSetKernelArg(kernel, 1, sizeof(cl_mem), (void*)&output);
+    clSetKernelArg(kernel, 2, sizeof(cl_uint), (void*)&width);
+    clSetKernelArg(kernel, 3, sizeof(cl_uint), (void*)&height);
+    clSetKernelArg(kernel, 4, localBytes / 2, NULL);
+    clSetKernelArg(kernel, 5, localBytes / 2, NULL);
+
+    size_t localThreads[]  = {TILE_X, TILE_Y};
+    size_t globalThreads[] = {(width + TILE_X - 1) / TILE_X * TILE_X,
+                              (height + TILE_Y - 1) / TILE_Y * TILE_Y};
+    double time = timeKernel(queue, kernel, globalThreads, localThreads);
+
+    clReleaseKernel(kernel);
+    clReleaseProgram(program);
+    return time;
+}
+
+/*
+ Streaming mode: frames go through a ring of RING_SIZE slots, each with
+ pinned input and output host memory and its own device buffers. Uploads,
+ filtering and downloads are issued to three queues and chained with events,
+ so the upload of one frame, the filtering of the previous one and the
+ download of the one before that overlap. A slot is reused once its last
+ download completes; its profiling events give the per-frame latency from
+ the upload being queued to the end of the download.
+ */
+#define RING_SIZE 3
+
+typedef struct {
+    cl_mem pinnedIn;
+    cl_mem pinnedOut;
+    cl_uchar4* hostIn;
+    cl_uchar4* hostOut;
+    cl_mem input;
+    cl_mem output;
+    cl_event uploaded;
+    cl_event computed;
+    cl_event downloaded;
+    int busy;
+} FrameSlot;
+
+void finishFrame(FrameSlot* slot, cl_ulong* first, cl_ulong* last,
+                 double* latencySum, double* latencyMax) {
+    cl_ulong queued, end;
+
+    clWaitForEvents(1, &slot->downloaded);
+    clGetEventProfilingInfo(slot->uploaded, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &queued, NULL);
+    clGetEventProfilingInfo(slot->downloaded, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &end, NULL);
+
+    double latency = (end - queued) * 1e-9;
+    *latencySum += latency;
+    if (latency > *latencyMax) *latencyMax = latency;
+    if (!*first || queued < *first) *first = queued;
+    if (end > *last) *last = end;
+
+    clReleaseEvent(slot->uploaded);
+    clReleaseEvent(slot->computed);
+    clReleaseEvent(slot->downloaded);
+    slot->busy = 0;
+}
+
+void streamFrames(cl_context context, cl_device_id device, cl_kernel kernel, int useImage,
+                  size_t* globalThreads, size_t* localThreads,
+                  cl_uint width, cl_uint height, const cl_uchar4** sources, int numSources,
+                  int frames) {
+    cl_int error;
+    size_t bytes = width * height * sizeof(cl_uchar4);
+    cl_command_queue uploadQueue  = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &error);
+    cl_command_queue computeQueue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &error);
+    cl_command_queue downloadQueue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &error);
+    cl_image_format format = {CL_RGBA, CL_UNSIGNED_INT8};
+    size_t origin[] = {0, 0, 0};
+    size_t region[] = {width, height, 1};
+    FrameSlot ring[RING_SIZE];
+
+    for(int k = 0; k < RING_SIZE; ++k) {
+        ring[k].pinnedIn  = clCreateBuffer(context, CL_MEM_READ_ONLY|CL_MEM_ALLOC_HOST_PTR, bytes, NULL, &error);
+        ring[k].pinnedOut = clCreateBuffer(context, CL_MEM_WRITE_ONLY|CL_MEM_ALLOC_HOST_PTR, bytes, NULL, &error);
+        ring[k].hostIn  = (cl_uchar4*) clEnqueueMapBuffer(uploadQueue, ring[k].pinnedIn, CL_TRUE, CL_MAP_WRITE,
+                                                          0, bytes, 0, NULL, NULL, &error);
+        ring[k].hostOut = (cl_uchar4*) clEnqueueMapBuffer(downloadQueue, ring[k].pinnedOut, CL_TRUE, CL_MAP_READ,
+                                                          0, bytes, 0, NULL, NULL, &error);
+        ring[k].input = useImage ?
+            clCreateImage2D(context, CL_MEM_READ_ONLY, &format, width, height, 0, NULL, &error) :
+            clCreateBuffer(context, CL_MEM_READ_ONLY, bytes, NULL, &error);
+        ring[k].output = clCreateBuffer(context, CL_MEM_WRITE_ONLY, bytes, NULL, &error);
+        ring[k].busy = 0;
+        if (error != CL_SUCCESS) {
+            perror("Can't allocate the frame buffers");
+            exit(1);
+        }
+    }
+
+    cl_ulong first = 0, last = 0;
+    double latencySum = 0, latencyMax = 0;
+
+    for(int f = 0; f < frames; ++f) {
+        FrameSlot* slot = ring + f % RING_SIZE;
+        if (slot->busy) finishFrame(slot, &first, &last, &latencySum, &latencyMax);
+
+        // stands in for the capture of the next camera frame
+        memcpy(slot->hostIn, sources[f % numSources], bytes);
+
+        if (useImage)
+            clEnqueueWriteImage(uploadQueue, slot->input, CL_FALSE, origin, region, 0, 0,
+                                slot->hostIn, 0, NULL, &slot->uploaded);
+        else
+            clEnqueueWriteBuffer(uploadQueue, slot->input, CL_FALSE, 0, bytes,
+                                 slot->hostIn, 0, NULL, &slot->uploaded);
+
+        clSetKernelArg(kernel, 0, sizeof(cl_mem), (void*)&slot->input);
+        clSetKernelArg(kernel, 1, sizeof(cl_mem), (void*)&slot->output);
+        error = clEnqueueNDRangeKernel(computeQueue, kernel, 2, NULL, globalThreads, localThreads,
+                                       1, &slot->uploaded, &slot->computed);
+        if (error != CL_SUCCESS) {
+            printf("Kernel execution failure!\n");
+            exit(-22);
+        }
+
+        clEnqueueReadBuffer(downloadQueue, slot->output, CL_FALSE, 0, bytes,
+                            slot->hostOut, 1, &slot->computed, &slot->downloaded);
+
+        clFlush(uploadQueue);
+        clFlush(computeQueue);
+        clFlush(downloadQueue);
+        slot->busy = 1;
+    }
+
+    for(int f = frames; f < frames + RING_SIZE; ++f)
+        if (ring[f % RING_SIZE].busy)
+            finishFrame(ring + f % RING_SIZE, &first, &last, &latencySum, &latencyMax);
+
+    double seconds = (last - first) * 1e-9;
+    printf("Streamed %d frames of %ux%u: %.1f frames/s, latency %.3f ms average, %.3f ms max\n",
+           frames, width, height, frames / seconds,
+           latencySum / frames * 1e3, latencyMax * 1e3);
+
+    for(int k = 0; k < RING_SIZE; ++k) {
+        clEnqueueUnmapMemObject(uploadQueue, ring[k].pinnedIn, ring[k].hostIn, 0, NULL, NULL);
+        clEnqueueUnmapMemObject(downloadQueue, ring[k].pinnedOut, ring[k].hostOut, 0, NULL, NULL);
+    }
+    clFinish(uploadQueue);
+    clFinish(downloadQueue);
+
+    for(int k = 0; k < RING_SIZE; ++k) {
+        clReleaseMemObject(ring[k].pinnedIn);
+        clReleaseMemObject(ring[k].pinnedOut);
+        clReleaseMemObject(ring[k].input);
+        clReleaseMemObject(ring[k].output);
+    }
+    clReleaseCommandQueue(uploadQueue);
+    clReleaseCommandQueue(computeQueue);
+    clReleaseCommandQueue(downloadQueue);
+}
+
+/*
+ Tiled mode, for images larger than one device allocation: the BMP file is
+ memory-mapped and cut into bands of full rows, each uploaded with a one row
+ halo above and below so that its rows are filtered exactly as in the whole
+ image. Bands are handed out from a work queue to every GPU of every
+ platform, TILE_SLOTS at a time per device, each slot with its own queue so
+ that the transfers of one band overlap the filtering of another; a device
+ takes the next band as soon as one of its slots completes, so faster
+ devices end up doing more of them. Rows go to the device straight from the
+ mapped file and come back straight into the mapped output file, which has
+ the headers of the input: UnpackBMP and PackBMP convert them on the device.
+ Rows are filtered in file order: the gradient magnitude does not depend on
+ the image being stored bottom-up.
+ */
+#define TILE_SLOTS 2
+#define MAX_TILE_DEVICES 16
+#define TILE_BYTES (64 << 20)
+
+typedef struct {
+    cl_command_queue queue;
+    cl_mem rawIn;
+    cl_mem input;
+    cl_mem output;
+    cl_mem rawOut;
+    cl_event downloaded;
+    cl_uint tile;
+    int busy;
+} TileSlot;
+
+typedef struct {
+    cl_device_id device;
+    cl_context context;
+    cl_program program;
+    cl_kernel unpack;
+    cl_kernel sobel;
+    cl_kernel pack;
+    TileSlot slots[TILE_SLOTS];
+    cl_uint tiles;
+} TileDevice;
+
+typedef struct {
+    MappedBitMap src;
+    MappedBitMap dst;
+    cl_uint width;
+    cl_uint height;
+    cl_uint bytesPerPixel;  // 3 or 4
+    cl_uint stride;
+    cl_uint rowsPerTile;
+} TiledImage;
+
+int eventDone(cl_event event) {
+    cl_int status = CL_QUEUED;
+    clGetEventInfo(event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(cl_int), &status, NULL);
+    return status == CL_COMPLETE;
+}
+
+// rows of the tile, the last one may be shorter
+cl_uint tileHeight(const TiledImage* img, cl_uint tile) {
+    cl_uint begin = tile * img->rowsPerTile;
+    return begin + img->rowsPerTile < img->height ? img->rowsPerTile : img->height - begin;
+}
+
+// rows [first, last) of the band of the tile, including its halo rows
+void tileRows(const TiledImage* img, cl_uint tile, cl_uint* first, cl_uint* last,
+              cl_uint* haloTop) {
+    cl_uint begin = tile * img->rowsPerTile;
+    cl_uint end = begin + tileHeight(img, tile);
+
+    *haloTop = begin > 0;
+    *first = begin - *haloTop;
+    *last = end < img->height ? end + 1 : end;
+}
+
+int setupTileDevice(TileDevice* dev, const TiledImage* img, char** source, size_t* sizes) {
+    cl_int error;
+    size_t rows = img->rowsPerTile + 2;
+    size_t pixelBytes = rows * img->width * sizeof(cl_uchar4);
+    size_t rawBytes = rows * img->stride;
+
+    dev->context = clCreateContext(NULL, 1, &dev->device, NULL, NULL, &error);
+    if (error != CL_SUCCESS) return FAILURE;
+    dev->program = clCreateProgramWithSource(dev->context, 1, (const char**)source, sizes, &error);
+    if (error != CL_SUCCESS ||
+        clBuildProgram(dev->program, 1, &dev->device, "", NULL, NULL) != CL_SUCCESS)
+        return FAILURE;
+    dev->unpack = clCreateKernel(dev->program, "UnpackBMP", &error);
+    dev->sobel  = clCreateKernel(dev->program, "SobelDetectorTiled", &error);
+    dev->pack   = clCreateKernel(dev->program, "PackBMP", &error);
+    dev->tiles = 0;
+
+    for(int k = 0; k < TILE_SLOTS; ++k) {
+        TileSlot* slot = dev->slots + k;
+        slot->queue  = clCreateCommandQueue(dev->context, dev->device, 0, &error);
+        slot->rawIn  = clCreateBuffer(dev->context, CL_MEM_READ_ONLY, rawBytes, NULL, &error);
+        slot->input  = clCreateBuffer(dev->context, CL_MEM_READ_WRITE, pixelBytes, NULL, &error);
+        slot->output = clCreateBuffer(dev->context, CL_MEM_READ_WRITE, pixelBytes, NULL, &error);
+        slot->rawOut = clCreateBuffer(dev->context, CL_MEM_WRITE_ONLY, rawBytes, NULL, &error);
+        if (error != CL_SUCCESS) return FAILURE;
+        slot->busy = 0;
+    }
+    return SUCCESS;
+}
+
+void releaseTileDevice(TileDevice* dev) {
+    for(int k = 0; k < TILE_SLOTS; ++k) {
+        TileSlot* slot = dev->slots + k;
+        clFinish(slot->queue);
+        clReleaseMemObject(slot->rawIn);
+        clReleaseMemObject(slot->input);
+        clReleaseMemObject(slot->output);
+        clReleaseMemObject(slot->rawOut);
+        clReleaseCommandQueue(slot->queue);
+    }
+    clReleaseKernel(dev->unpack);
+    clReleaseKernel(dev->sobel);
+    clReleaseKernel(dev->pack);
+    clReleaseProgram(dev->program);
+    clReleaseContext(dev->context);
+}
+
+void setConversionArgs(cl_kernel kernel, cl_mem first, cl_mem second,
+                       const TiledImage* img, const cl_uint* rows) {
+    clSetKernelArg(kernel, 0, sizeof(cl_mem), (void*)&first);
+    clSetKernelArg(kernel, 1, sizeof(cl_mem), (void*)&second);
+    clSetKernelArg(kernel, 2, sizeof(cl_uint), (void*)&img->width);
+    clSetKernelArg(kernel, 3, sizeof(cl_uint), (void*)rows);
+    clSetKernelArg(kernel, 4, sizeof(cl_uint), (void*)&img->stride);
+    clSetKernelArg(kernel, 5, sizeof(cl_uint), (void*)&img->bytesPerPixel);
+}
+
+// The queue of the slot is in order, so only the download needs an event.
+void startTile(TileDevice* dev, TileSlot* slot, const TiledImage* img, cl_uint tile) {
+    cl_uint first, last, halo;
+    tileRows(img, tile, &first, &last, &halo);
+
+    cl_uint rows = last - first;
+    size_t localThreads[] = {TILE_X, TILE_Y};
+    size_t globalThreads[] = {(img->width + TILE_X - 1) / TILE_X * TILE_X,
+                              (rows + TILE_Y - 1) / TILE_Y * TILE_Y};
+
+    clEnqueueWriteBuffer(slot->queue, slot->rawIn, CL_FALSE, 0, (size_t)rows * img->stride,
+                         img->src.pixels_ + (size_t)first * img->stride, 0, NULL, NULL);
+
+    setConversionArgs(dev->unpack, slot->rawIn, slot->input, img, &rows);
+    clSetKernelArg(dev->sobel, 0, sizeof(cl_mem), (void*)&slot->input);
+    clSetKernelArg(dev->sobel, 1, sizeof(cl_mem), (void*)&slot->output);
+    clSetKernelArg(dev->sobel, 2, sizeof(cl_uint), (void*)&img->width);
+    clSetKernelArg(dev->sobel, 3, sizeof(cl_uint), (void*)&rows);
+    clSetKernelArg(dev->sobel, 4, (TILE_X + 2) * (TILE_Y + 2) * sizeof(cl_uchar4), NULL);
+    setConversionArgs(dev->pack, slot->output, slot->rawOut, img, &rows);
+
+    cl_kernel passes[] = {dev->unpack, dev->sobel, dev->pack};
+    for(int p = 0; p < 3; ++p) {
+        if (clEnqueueNDRangeKernel(slot->queue, passes[p], 2, NULL, globalThreads, localThreads,
+                                   0, NULL, NULL) != CL_SUCCESS) {
+            printf("Kernel execution failure!\n");
+            exit(-22);
+        }
+    }
+
+    // the halo rows are filtered with clamping, and dropped here
+    clEnqueueReadBuffer(slot->queue, slot->rawOut, CL_FALSE, (size_t)halo * img->stride,
+                        (size_t)tileHeight(img, tile) * img->stride,
+                        img->dst.pixels_ + (size_t)tile * img->rowsPerTile * img->stride,
+                        0, NULL, &slot->downloaded);
+    clFlush(slot->queue);
+
+    slot->tile = tile;
+    slot->busy = 1;
+}
+
+void finishTile(TileDevice* dev, TileSlot* slot) {
+    clReleaseEvent(slot->downloaded);
+    slot->busy = 0;
+    dev->tiles++;
+}
+
+/*
+ SobelFilter --tiled input.bmp [output.bmp [rows]]: filters a 24 or 32 bit
+ uncompressed BMP of any size, in bands of 'rows' rows (by default as many
+ as fit TILE_BYTES and the allocation limit of every device).
+ */
+int filterTiled(const char* inputName, const char* outputName, cl_uint rowsPerTile) {
+    TileDevice devices[MAX_TILE_DEVICES];
+    cl_uint numDevices = 0;
+    cl_uint numOfPlatforms;
+    cl_platform_id* platforms;
+    TiledImage img;
+
+    if (mapFile(inputName, &img.src) != SUCCESS || img.src.infoHeader->bitsPerPixel == 8) {
+        printf("Only uncompressed 24 and 32 bit images can be tiled!\n");
+        return FAILURE;
+    }
+
+    img.width = img.src.infoHeader->width;
+    img.height = img.src.height_;
+    img.bytesPerPixel = img.src.infoHeader->bitsPerPixel / 8;
+    img.stride = img.src.stride_;
+
+    clGetPlatformIDs(0, NULL, &numOfPlatforms);
+    platforms = (cl_platform_id*) alloca(sizeof(cl_platform_id) * numOfPlatforms);
+    clGetPlatformIDs(numOfPlatforms, platforms, NULL);
+    for(cl_uint i = 0; i < numOfPlatforms && numDevices < MAX_TILE_DEVICES; ++i) {
+        cl_device_id ids[MAX_TILE_DEVICES];
+        cl_uint n = 0;
+        if (clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_GPU, MAX_TILE_DEVICES - numDevices,
+                           ids, &n) != CL_SUCCESS)
+            continue;
+        for(cl_uint j = 0; j < n && numDevices < MAX_TILE_DEVICES; ++j)
+            devices[numDevices++].device = ids[j];
+    }
+    if (!numDevices) {
+        perror("Can't locate a OpenCL compliant device i.e. GPU");
+        unmapFile(&img.src);
+        return FAILURE;
+    }
+
+    // four buffers per slot on every device, each within the allocation limit
+    size_t rowBytes = (size_t)img.width * sizeof(cl_uchar4);
+    size_t tileBytes = TILE_BYTES;
+    for(cl_uint d = 0; d < numDevices; ++d) {
+        cl_ulong maxAlloc, globalMem;
+        clGetDeviceInfo(devices[d].device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(cl_ulong), &maxAlloc, NULL);
+        clGetDeviceInfo(devices[d].device, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(cl_ulong), &globalMem, NULL);
+        if (maxAlloc < tileBytes) tileBytes = maxAlloc;
+        if (globalMem / (4 * TILE_SLOTS) < tileBytes) tileBytes = globalMem / (4 * TILE_SLOTS);
+    }
+    if (tileBytes / rowBytes < 3) {
+        printf("A row of the image does not fit the devices!\n");
+        unmapFile(&img.src);
+        return FAILURE;
+    }
+    if (!rowsPerTile || rowsPerTile > tileBytes / rowBytes - 2) rowsPerTile = tileBytes / rowBytes - 2;
+    img.rowsPerTile = rowsPerTile < img.height ? rowsPerTile : img.height;
+
+    if (createMapped(outputName, &img.src, &img.dst) != SUCCESS) {
+        perror("Can't create the output image");
+        unmapFile(&img.src);
+        return FAILURE;
+    }
+
+    const char *file_names[] = {"sobel_detector.cl"};
+    char* buffer[1];
+    size_t sizes[1];
+    loadProgramSource(file_names, 1, buffer, sizes);
+
+    for(cl_uint d = 0; d < numDevices; ++d) {
+        if (setupTileDevice(devices + d, &img, buffer, sizes) != SUCCESS) {
+            printf("Can't set up device %u for the tiles!\n", d);
+            exit(1);
+        }
+    }
+    free(buffer[0]);
+
+    cl_uint numTiles = (img.height + img.rowsPerTile - 1) / img.rowsPerTile;
+    cl_uint nextTile = 0, doneTiles = 0;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while(doneTiles < numTiles) {
+        int progress = 0;
+        for(cl_uint d = 0; d < numDevices; ++d) {
+            for(int k = 0; k < TILE_SLOTS; ++k) {
+                TileSlot* slot = devices[d].slots + k;
+                if (slot->busy && eventDone(slot->downloaded)) {
+                    finishTile(devices + d, slot);
+                    doneTiles++;
+                    progress = 1;
+                }
+                if (!slot->busy && nextTile < numTiles) {
+                    startTile(devices + d, slot, &img, nextTile++);
+                    progress = 1;
+                }
+            }
+        }
+        if (!progress) sched_yield();
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    printf("Filtered %ux%u in %u tiles of %u rows: %.3f s, %.1f Mpixels/s\n",
+           img.width, img.height, numTiles, img.rowsPerTile, seconds,
+           (double)img.width * img.height / seconds * 1e-6);
+
+    for(cl_uint d = 0; d < numDevices; ++d) {
+        char name[256];
+        clGetDeviceInfo(devices[d].device, CL_DEVICE_NAME, sizeof(name), name, NULL);
+        printf("  %-40s %u tiles\n", name, devices[d].tiles);
+        releaseTileDevice(devices + d);
+    }
+
+    unmapFile(&img.dst);
+    unmapFile(&img.src);
+    return SUCCESS;
+}
+
 int main(int argc, char** argv) {
+    if (argc > 2 && !strcmp(argv[1], "--tiled"))
+        return filterTiled(argv[2], argc > 3 ? argv[3] : "TiledOutput.bmp",
+                           argc > 4 ? atoi(argv[4]) : 0) == SUCCESS ? 0 : 1;
+
     /* OpenCL 1.1 data structures */
     cl_platform_id* platforms;
     cl_program program;
@@ -202,7 +731,7 @@ int main(int argc, char** argv) {
 
 	{
 	    // load input bitmap image 
-	    load("InputImage.bmp", &inputBitMap);
+	    loadMapped("InputImage.bmp", &inputBitMap);
 	
 	    // error if image did not load
 	    if(!isLoaded(&inputBitMap))
@@ -226,7 +755,7 @@ int main(int argc, char** argv) {
 	    memset(outputImageData, 0, width * height * pixelSize);
 	
 	    // get the pointer to pixel data 
-	    memcpy(pixelData, getPixels(&inputBitMap), width * height * pixelSize);
+	    pixelData = getPixels(&inputBitMap);
 	    if(pixelData == NULL)
 	    {
 	        printf("Failed to read pixel Data!\n");
@@ -310,9 +839,7 @@ int main(int argc, char** argv) {
             exit(1);
 	    }
         
-        queue = clCreateCommandQueue(context, device, 0, &error);
-
-        cl_kernel kernel = clCreateKernel(program, "SobelDetector", &error);
+        queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &error);
 
         inputImageBuffer = clCreateBuffer(context,
                                           CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR,
@@ -326,23 +853,102 @@ int main(int argc, char** argv) {
                                            outputImageData,
                                            &error);
 
-        clSetKernelArg(kernel, 0, sizeof(cl_mem),(void*)&inputImageBuffer);
-        clSetKernelArg(kernel, 1, sizeof(cl_mem),(void*)&outputImageBuffer);
-         
+        /*
+         Three variants of the filter: plain global buffer reads (skips the
+         border), buffer tiles staged in local memory, and reads from an image
+         object through the texture cache (both clamp at the border). Each is
+         timed on this device and the fastest one produces the output image.
+         */
+        size_t tileThreads[] = {TILE_X, TILE_Y};
+        size_t tileGlobal[]  = {(width + TILE_X - 1) / TILE_X * TILE_X,
+                                (height + TILE_Y - 1) / TILE_Y * TILE_Y};
         size_t globalThreads[] = {width, height};
         size_t localThreads[]  = {sizeX, sizeY};
 
-		cl_event exeEvt; 
-		error = clEnqueueNDRangeKernel(queue,
-		                               kernel,
-		                               2,
-		                               NULL, globalThreads, localThreads, 0, NULL, &exeEvt);
-		clWaitForEvents(1, &exeEvt);
-		if(error != CL_SUCCESS) {
-			printf("Kernel execution failure!\n");
-			exit(-22);
-		}	
-        clReleaseEvent(exeEvt);
+        cl_kernel kernels[3];
+        const char* names[3] = {"SobelDetector", "SobelDetectorTiled", "SobelDetectorImage"};
+        size_t* global[3] = {globalThreads, tileGlobal, tileGlobal};
+        size_t* local[3]  = {localThreads, tileThreads, tileThreads};
+        double times[3] = {-1, -1, -1};
+        cl_mem inputImage = NULL;
+
+        kernels[0] = clCreateKernel(program, "SobelDetector", &error);
+        clSetKernelArg(kernels[0], 0, sizeof(cl_mem),(void*)&inputImageBuffer);
+        clSetKernelArg(kernels[0], 1, sizeof(cl_mem),(void*)&outputImageBuffer);
+
+        kernels[1] = clCreateKernel(program, "SobelDetectorTiled", &error);
+        clSetKernelArg(kernels[1], 0, sizeof(cl_mem),(void*)&inputImageBuffer);
+        clSetKernelArg(kernels[1], 1, sizeof(cl_mem),(void*)&outputImageBuffer);
+        clSetKernelArg(kernels[1], 2, sizeof(cl_uint),(void*)&width);
+        clSetKernelArg(kernels[1], 3, sizeof(cl_uint),(void*)&height);
+        clSetKernelArg(kernels[1], 4, (TILE_X + 2) * (TILE_Y + 2) * sizeof(cl_uchar4), NULL);
+
+        kernels[2] = NULL;
+        cl_bool imageSupport = CL_FALSE;
+        clGetDeviceInfo(device, CL_DEVICE_IMAGE_SUPPORT, sizeof(cl_bool), &imageSupport, NULL);
+        if (imageSupport) {
+            cl_image_format format = {CL_RGBA, CL_UNSIGNED_INT8};
+            inputImage = clCreateImage2D(context,
+                                         CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR,
+                                         &format, width, height, 0,
+                                         inputImageData,
+                                         &error);
+            if (error == CL_SUCCESS) {
+                kernels[2] = clCreateKernel(program, "SobelDetectorImage", &error);
+                clSetKernelArg(kernels[2], 0, sizeof(cl_mem),(void*)&inputImage);
+                clSetKernelArg(kernels[2], 1, sizeof(cl_mem),(void*)&outputImageBuffer);
+                clSetKernelArg(kernels[2], 2, sizeof(cl_uint),(void*)&width);
+                clSetKernelArg(kernels[2], 3, sizeof(cl_uint),(void*)&height);
+            }
+        }
+
+        // the plain kernel needs the width to be a multiple of its work-group
+        int best = -1;
+        for(int k = 0; k < 3; ++k) {
+            if (!kernels[k] || (k == 0 && width % sizeX)) continue;
+            times[k] = timeKernel(queue, kernels[k], global[k], local[k]);
+            if (times[k] < 0) continue;
+            printf("%-20s %8.3f ms\n", names[k], times[k] * 1e3);
+            if (best < 0 || times[k] < times[best]) best = k;
+        }
+        if (best < 0) {
+            printf("Kernel execution failure!\n");
+            exit(-22);
+        }
+        printf("Using %s\n", names[best]);
+
+        // the output of the last timed run is overwritten by the chosen kernel
+        timeKernel(queue, kernels[best], global[best], local[best]);
+
+        // SobelFilter --stream [frames [dump.bmp ...]]: filter the image, or the
+        // frame dumps of the same size loaded in parallel, as a continuous feed
+        if (argc > 1 && !strcmp(argv[1], "--stream")) {
+            int numFiles = argc > 3 ? argc - 3 : 0;
+            BitMap* dumps = (BitMap*) malloc(sizeof(BitMap) * (numFiles + 1));
+            const cl_uchar4** sources = (const cl_uchar4**) malloc(sizeof(cl_uchar4*) * (numFiles + 1));
+            int numSources = 0;
+
+            loadBatch((const char**)argv + 3, dumps, numFiles, sysconf(_SC_NPROCESSORS_ONLN));
+            for(int k = 0; k < numFiles; ++k) {
+                if (isLoaded(dumps + k) && getWidth(dumps + k) == width && getHeight(dumps + k) == height)
+                    sources[numSources++] = (const cl_uchar4*) getPixels(dumps + k);
+                else
+                    printf("Skipping %s: not a %ux%u image\n", argv[3 + k], width, height);
+            }
+            if (!numSources) sources[numSources++] = inputImageData;
+
+            streamFrames(context, device, kernels[best], best == 2,
+                         global[best], local[best], width, height, sources, numSources,
+                         argc > 2 ? atoi(argv[2]) : 300);
+
+            for(int k = 0; k < numFiles; ++k) cleanUp(dumps + k);
+            free(dumps);
+            free(sources);
+        }
+
+        for(int k = 0; k < 3; ++k)
+            if (kernels[k]) clReleaseKernel(kernels[k]);
+        if (inputImage) clReleaseMemObject(inputImage);
  
         clEnqueueReadBuffer(queue,
                             outputImageBuffer,
@@ -354,6 +960,20 @@ int main(int argc, char** argv) {
                             NULL,
                             NULL);
         writeImage(width, height, pixelSize, pixelData, outputImageData, &inputBitMap, "OutputImage.bmp");
+
+        // SobelFilter --chain [threshold]: fused grayscale/blur/Sobel/threshold pass
+        if (argc > 1 && !strcmp(argv[1], "--chain")) {
+            double t = runChain(context, device, queue, inputImageBuffer, outputImageBuffer,
+                                width, height, argc > 2 ? atof(argv[2]) : 64.0f);
+            if (t < 0) {
+                printf("Filter chain does not fit the device\n");
+            } else {
+                printf("%-20s %8.3f ms\n", FILTER_CHAIN_KERNEL, t * 1e3);
+                clEnqueueReadBuffer(queue, outputImageBuffer, CL_TRUE, 0,
+                                    width * height * pixelSize, outputImageData, 0, NULL, NULL);
+                writeImage(width, height, pixelSize, pixelData, outputImageData, &inputBitMap, "ChainOutput.bmp");
+            }
+        }
         
         /* Clean up */
         for(i=0; i< NUMBER_OF_FILES; i++) { free(buffer[i]); }
@@ -4,6 +4,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
 
 #pragma pack(push,1)
 
@@ -266,30 +274,39 @@ void load(const char * filename, BitMap* bmp) {
 	            }
 	        }
 	
+	        // Pack each row with its padding and write it at once
+	        int bytesPerPixel = bmp->infoHeader.bitsPerPixel / 8;
+	        size_t stride = ((size_t)bmp->infoHeader.width * bmp->infoHeader.bitsPerPixel + 31) / 32 * 4;
+	        unsigned char * row = (unsigned char*)calloc(stride, 1);
+	        if (row == NULL) {
+	            fclose(fd);
+	            return false;
+	        }
+	
 	        for(int y = 0; y < bmp->infoHeader.height; y++) {
-	            for(int x = 0; x < bmp->infoHeader.width; x++) {
-	                // Read RGB values
+	            const uchar4 * src = bmp->pixels_ + (size_t)y * bmp->infoHeader.width;
+	            unsigned char * dst = row;
+	            for(int x = 0; x < bmp->infoHeader.width; x++, dst += bytesPerPixel) {
 	                if (bmp->infoHeader.bitsPerPixel == 8) {
-	                    fputc( colorIndex( bmp->pixels_[(y * bmp->infoHeader.width + x)],bmp), fd);
+	                    dst[0] = colorIndex(src[x], bmp);
 	                }
-	                else { // 24 bit
-	                    fputc(bmp->pixels_[(y * bmp->infoHeader.width + x)].z, fd);
-	                    fputc(bmp->pixels_[(y * bmp->infoHeader.width + x)].y, fd);
-	                    fputc(bmp->pixels_[(y * bmp->infoHeader.width + x)].x, fd);
-	
-	                    if (ferror(fd)) {
-	                        fclose(fd);
-	                        return false;
-	                    }
+	                else { // 24 or 32 bit
+	                    dst[0] = src[x].z;
+	                    dst[1] = src[x].y;
+	                    dst[2] = src[x].x;
+	                    if (bytesPerPixel == 4) dst[3] = src[x].w;
 	                }
 	            }
 	
-	            // Add padding
-	            for(int x = 0; x < (4 - (3 * bmp->infoHeader.width) % 4) % 4; x++) {
-	                fputc(0, fd);
+	            if (fwrite(row, stride, 1, fd) != 1) {
+	                free(row);
+	                fclose(fd);
+	                return false;
 	            }
 	        }
 	
+	        free(row);
+	        fclose(fd);
 	        return true;
 	    }
 	    return false;
@@ -405,5 +422,249 @@ void load(const char * filename, BitMap* bmp) {
     int isLoaded(BitMap *bmp) { return bmp->isLoaded_; }
 
 #pragma pack(pop)
+
+/**
+ * MappedBitMap
+ * a BMP file mapped into memory, so that its rows can be converted, or
+ * uploaded to a device, straight from the page cache
+ */
+struct MappedBitMap {
+    unsigned char * data_;          /** Whole file */
+    size_t size_;                   /** Size of the file */
+    BitMapHeader * header;
+    BitMapInfoHeader * infoHeader;
+    ColorPalette * colors_;         /** Palette of 8 bit images */
+    unsigned char * pixels_;        /** First row of the pixel array */
+    size_t stride_;                 /** Bytes per row, padded to 4 */
+    int height_;                    /** Rows, whichever the storage order */
+} ;
+
+typedef struct MappedBitMap MappedBitMap;
+
+    int checkMapped(MappedBitMap* map) {
+        if (map->size_ < sizeof(BitMapHeader) + sizeof(BitMapInfoHeader)) return FAILURE;
+
+        map->header = (BitMapHeader *)map->data_;
+        map->infoHeader = (BitMapInfoHeader *)(map->data_ + sizeof(BitMapHeader));
+
+        short bpp = map->infoHeader->bitsPerPixel;
+        if (map->header->id != bitMapID || map->infoHeader->compression ||
+            (bpp != 8 && bpp != 24 && bpp != 32)) {
+            return FAILURE;
+        }
+
+        map->colors_ = (ColorPalette *)(map->data_ + sizeof(BitMapHeader) + sizeof(BitMapInfoHeader));
+        map->pixels_ = map->data_ + map->header->offset;
+        map->stride_ = ((size_t)map->infoHeader->width * bpp + 31) / 32 * 4;
+        map->height_ = map->infoHeader->height < 0 ? -map->infoHeader->height : map->infoHeader->height;
+
+        if ((size_t)map->header->offset + map->stride_ * map->height_ > map->size_) return FAILURE;
+        return SUCCESS;
+    }
+
+    // Maps the file read-only; pixels are read in order, so tell the kernel.
+    int mapFile(const char * filename, MappedBitMap* map) {
+        struct stat st;
+        int fd = open(filename, O_RDONLY);
+
+        if (fd < 0) return FAILURE;
+        if (fstat(fd, &st) < 0) {
+            close(fd);
+            return FAILURE;
+        }
+
+        map->size_ = st.st_size;
+        map->data_ = (unsigned char*)mmap(NULL, map->size_, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map->data_ == MAP_FAILED) return FAILURE;
+
+        posix_madvise(map->data_, map->size_, POSIX_MADV_SEQUENTIAL);
+        if (checkMapped(map) != SUCCESS) {
+            munmap(map->data_, map->size_);
+            return FAILURE;
+        }
+        return SUCCESS;
+    }
+
+    // Creates a file of the size and with the headers of 'like', mapped for writing.
+    int createMapped(const char * filename, const MappedBitMap* like, MappedBitMap* map) {
+        int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+        if (fd < 0) return FAILURE;
+        if (ftruncate(fd, like->size_) < 0) {
+            close(fd);
+            return FAILURE;
+        }
+
+        map->size_ = like->size_;
+        map->data_ = (unsigned char*)mmap(NULL, map->size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map->data_ == MAP_FAILED) return FAILURE;
+
+        memcpy(map->data_, like->data_, like->header->offset);
+        return checkMapped(map);
+    }
+
+    void unmapFile(MappedBitMap* map) {
+        if (map->data_ != NULL) {
+            msync(map->data_, map->size_, MS_SYNC);
+            munmap(map->data_, map->size_);
+        }
+        map->data_ = NULL;
+    }
+
+    /**
+     * Converts rows [first, last) of the file, in storage order, to uchar4
+     * the way load() does: red in x and a white w for 24 and 32 bit images,
+     * raw palette entries for 8 bit ones. With SSSE3 one shuffle converts
+     * four pixels; the tail of each row is done one pixel at a time.
+     */
+    void unpackRows(const MappedBitMap* map, int first, int last, uchar4* dst) {
+        int width = map->infoHeader->width;
+        int bpp = map->infoHeader->bitsPerPixel / 8;
+
+        for(int y = first; y < last; y++) {
+            const unsigned char * src = map->pixels_ + (size_t)y * map->stride_;
+            int x = 0;
+
+            if (bpp == 1) {
+                for(; x < width; x++) *dst++ = map->colors_[src[x]];
+                continue;
+            }
+#ifdef __SSSE3__
+            {
+                // 16 bytes are loaded for 12 of a 24 bit row, stay within it
+                const __m128i alpha = _mm_set1_epi32((int)0xff000000);
+                const __m128i rgb = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+                const __m128i rgba = _mm_setr_epi8(2, 1, 0, -1, 6, 5, 4, -1, 10, 9, 8, -1, 14, 13, 12, -1);
+                const __m128i mask = bpp == 3 ? rgb : rgba;
+                int end = bpp == 3 ? width - 5 : width - 3;
+
+                for(; x < end; x += 4, dst += 4) {
+                    __m128i p = _mm_loadu_si128((const __m128i*)(src + x * bpp));
+                    _mm_storeu_si128((__m128i*)dst, _mm_or_si128(_mm_shuffle_epi8(p, mask), alpha));
+                }
+            }
+#endif
+            for(; x < width; x++, dst++) {
+                dst->x = src[x * bpp + 2];
+                dst->y = src[x * bpp + 1];
+                dst->z = src[x * bpp];
+                dst->w = 0xff;
+            }
+        }
+    }
+
+    /**
+     * Same as load(), with the file mapped instead of read and the pixels
+     * converted by unpackRows().
+     */
+    void loadMapped(const char * filename, BitMap* bmp) {
+        MappedBitMap map;
+
+        bmp->pixels_ = NULL;
+        bmp->colors_ = NULL;
+        bmp->numColors_ = 0;
+        bmp->isLoaded_ = false;
+
+        if (mapFile(filename, &map) != SUCCESS) return;
+
+        bmp->header = *map.header;
+        bmp->infoHeader = *map.infoHeader;
+
+        if (bmp->infoHeader.bitsPerPixel == 8) {
+            bmp->numColors_ = bmp->infoHeader.clrUsed ? bmp->infoHeader.clrUsed : 256;
+            bmp->colors_ = (ColorPalette*)malloc(sizeof(ColorPalette) * bmp->numColors_);
+            if (bmp->colors_ == NULL) {
+                unmapFile(&map);
+                return;
+            }
+            memcpy(bmp->colors_, map.colors_, sizeof(ColorPalette) * bmp->numColors_);
+        }
+
+        bmp->pixels_ = (uchar4*)malloc(sizeof(uchar4) * bmp->infoHeader.width * map.height_);
+        if (bmp->pixels_ == NULL) {
+            cleanUp(bmp);
+            unmapFile(&map);
+            return;
+        }
+
+        unpackRows(&map, 0, map.height_, bmp->pixels_);
+        munmap(map.data_, map.size_);
+        bmp->isLoaded_ = true;
+    }
+
+/**
+ * BitMapBatch
+ * work queue of a batch of files, taken one at a time by the threads
+ */
+struct BitMapBatch {
+    const char ** filenames;
+    BitMap * bmps;
+    int count;
+    int next;
+    int done;                       /** Files loaded or written */
+    int writing;                    /** writeA() instead of loadMapped() */
+    pthread_mutex_t lock;
+} ;
+
+typedef struct BitMapBatch BitMapBatch;
+
+    void* batchWorker(void* arg) {
+        BitMapBatch* batch = (BitMapBatch*)arg;
+
+        for(;;) {
+            pthread_mutex_lock(&batch->lock);
+            int i = batch->next++;
+            pthread_mutex_unlock(&batch->lock);
+
+            if (i >= batch->count) return NULL;
+
+            int ok;
+            if (batch->writing) {
+                ok = writeA(batch->filenames[i], batch->bmps + i) == true;
+            }
+            else {
+                loadMapped(batch->filenames[i], batch->bmps + i);
+                ok = batch->bmps[i].isLoaded_;
+            }
+
+            pthread_mutex_lock(&batch->lock);
+            batch->done += ok;
+            pthread_mutex_unlock(&batch->lock);
+        }
+    }
+
+    int runBatch(const char ** filenames, BitMap* bmps, int count, int threads, int writing) {
+        BitMapBatch batch = {filenames, bmps, count, 0, 0, writing};
+        pthread_t* pool = (pthread_t*)malloc(sizeof(pthread_t) * threads);
+        int started = 0;
+
+        pthread_mutex_init(&batch.lock, NULL);
+        for(; started < threads && started < count; started++) {
+            if (pthread_create(pool + started, NULL, batchWorker, &batch) != 0) break;
+        }
+        // the calling thread works too, in case no thread could be started
+        batchWorker(&batch);
+        for(int t = 0; t < started; t++) pthread_join(pool[t], NULL);
+
+        pthread_mutex_destroy(&batch.lock);
+        free(pool);
+        return batch.done;
+    }
+
+    /**
+     * Loads count files with loadMapped() on 'threads' threads, returns the
+     * number of images loaded; the others have isLoaded_ false.
+     */
+    int loadBatch(const char ** filenames, BitMap* bmps, int count, int threads) {
+        return runBatch(filenames, bmps, count, threads, false);
+    }
+
+    // Writes count images with writeA() on 'threads' threads, returns the number written.
+    int writeBatch(const char ** filenames, BitMap* bmps, int count, int threads) {
+        return runBatch(filenames, bmps, count, threads, true);
+    }
+
 #endif
 
@@ -0,0 +1,206 @@
+#ifndef FILTER_CHAIN_H
+#define FILTER_CHAIN_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+/**
+ * Chain of image filters fused into a single OpenCL kernel.
+ *
+ * Running grayscale conversion, blur, Sobel and thresholding as separate
+ * kernels makes every stage a full round-trip through global memory. Here
+ * each work-group loads a tile of the input once, widened by the combined
+ * halo of all stages, and runs the stages one after another on ping-pong
+ * buffers in local memory; each stage shrinks the valid region by its own
+ * halo. Only the final stage writes to global memory.
+ *
+ * Input coordinates are clamped at the image borders, so pixels near the
+ * border see the clamped input of the whole chain rather than clamped
+ * intermediate images.
+ */
+
+#define FILTER_CHAIN_MAX_STAGES 16
+#define FILTER_CHAIN_KERNEL "FilterChain"
+
+typedef enum {
+    FILTER_GRAYSCALE,    // luminance; only as the first stage
+    FILTER_GAUSSIAN_3x3,
+    FILTER_GAUSSIAN_5x5,
+    FILTER_SOBEL,        // gradient magnitude, as in SobelDetector
+    FILTER_THRESHOLD     // 255 where the value is at least 'param', 0 elsewhere
+} FilterKind;
+
+typedef struct {
+    FilterKind kind;
+    float param;
+} FilterStage;
+
+typedef struct {
+    FilterStage stages[FILTER_CHAIN_MAX_STAGES];
+    int count;
+} FilterChain;
+
+void chainInit(FilterChain* chain) {
+    chain->count = 0;
+}
+
+/* Appends a stage. Returns 0 if the chain is full or the stage is misplaced. */
+int chainAdd(FilterChain* chain, FilterKind kind, float param) {
+    if (chain->count == FILTER_CHAIN_MAX_STAGES) return 0;
+    if (kind == FILTER_GRAYSCALE && chain->count) return 0;
+
+    chain->stages[chain->count].kind = kind;
+    chain->stages[chain->count].param = param;
+    chain->count++;
+    return 1;
+}
+
+int stageHalo(FilterKind kind) {
+    switch(kind) {
+        case FILTER_GAUSSIAN_3x3: return 1;
+        case FILTER_GAUSSIAN_5x5: return 2;
+        case FILTER_SOBEL:        return 1;
+        default:                  return 0;
+    }
+}
+
+/* Halo of the whole chain: the apron around a tile of output pixels. */
+int chainHalo(const FilterChain* chain) {
+    int halo = 0;
+    for(int i = 0; i < chain->count; ++i) halo += stageHalo(chain->stages[i].kind);
+    return halo;
+}
+
+/* Pixels are single floats after grayscale conversion, float4 otherwise. */
+int chainIsGray(const FilterChain* chain) {
+    return chain->count && chain->stages[0].kind == FILTER_GRAYSCALE;
+}
+
+/* Local memory taken by the kernel for the given tile of output pixels. */
+size_t chainLocalSize(const FilterChain* chain, int tileX, int tileY) {
+    int halo = chainHalo(chain);
+    return 2 * (tileX + 2 * halo) * (tileY + 2 * halo) *
+        (chainIsGray(chain) ? sizeof(float) : 4 * sizeof(float));
+}
+
+/* Expression for the result of the stage at the center of S(dx, dy). */
+void stageExpression(char* out, size_t size, const FilterStage* stage) {
+    switch(stage->kind) {
+        case FILTER_GAUSSIAN_3x3:
+            snprintf(out, size,
+                "(S(-1,-1) + 2*S(0,-1) + S(1,-1) +"
+                " 2*S(-1,0) + 4*S(0,0) + 2*S(1,0) +"
+                " S(-1,1) + 2*S(0,1) + S(1,1)) / 16");
+            break;
+        case FILTER_GAUSSIAN_5x5:
+            snprintf(out, size, "gaussian5(src, inW, ix, iy)");
+            break;
+        case FILTER_SOBEL:
+            snprintf(out, size,
+                "hypot(S(-1,-1) + 2*S(0,-1) + S(1,-1) - S(-1,1) - 2*S(0,1) - S(1,1),"
+                " S(-1,-1) - S(1,-1) + 2*S(-1,0) - 2*S(1,0) + S(-1,1) - S(1,1)) / 2");
+            break;
+        case FILTER_THRESHOLD:
+            snprintf(out, size, "step((pix_t)(%ff), S(0,0)) * 255", stage->param);
+            break;
+        default:
+            snprintf(out, size, "S(0,0)");
+    }
+}
+
+/*
+ Generates the source of the fused kernel
+   FilterChain(global const uchar4* input, global uchar4* output, uint width, uint height,
+               local pix_t* bufA, local pix_t* bufB)
+ to be launched with tileX x tileY work-groups; each group produces a tile
+ of as many output pixels. Returns a malloc'ed string.
+ */
+char* chainSource(const FilterChain* chain, int tileX, int tileY) {
+    size_t size = 8192 + chain->count * 1024, len = 0;
+    char* src = (char*) malloc(size);
+    char expr[512];
+    int halo = chainHalo(chain);
+    int gray = chainIsGray(chain);
+
+#define EMIT(...) len += snprintf(src + len, size - len, __VA_ARGS__)
+    EMIT("#define TX %d\n#define TY %d\n#define HALO %d\n", tileX, tileY, halo);
+    EMIT("typedef %s pix_t;\n", gray ? "float" : "float4");
+    EMIT("#define S(dx, dy) src[(ix + (dx)) + (iy + (dy)) * inW]\n");
+    EMIT("pix_t gaussian5(local const pix_t* src, int inW, int ix, int iy) {\n"
+         "    const float w[5] = {1, 4, 6, 4, 1};\n"
+         "    pix_t s = 0;\n"
+         "    for(int dy = -2; dy <= 2; ++dy)\n"
+         "        for(int dx = -2; dx <= 2; ++dx)\n"
+         "            s += w[dx + 2] * w[dy + 2] * S(dx, dy);\n"
+         "    return s / 256;\n"
+         "}\n");
+    EMIT("__kernel void " FILTER_CHAIN_KERNEL "(__global const uchar4* input,\n"
+         "                          __global uchar4* output,\n"
+         "                          uint width, uint height,\n"
+         "                          __local pix_t* bufA, __local pix_t* bufB) {\n"
+         "    int lid = get_local_id(0) + get_local_id(1) * TX;\n"
+         "    int x0 = get_group_id(0) * TX, y0 = get_group_id(1) * TY;\n"
+         "    __local pix_t* src = bufA;\n"
+         "    __local pix_t* dst = bufB;\n");
+
+    // load the tile and its apron, clamped to the image
+    EMIT("    for(int t = lid; t < (TX + 2 * HALO) * (TY + 2 * HALO); t += TX * TY) {\n"
+         "        int gx = clamp(x0 - HALO + t %% (TX + 2 * HALO), 0, (int)width - 1);\n"
+         "        int gy = clamp(y0 - HALO + t / (TX + 2 * HALO), 0, (int)height - 1);\n"
+         "        float4 p = convert_float4(input[gx + gy * width]);\n"
+         "        src[t] = %s;\n"
+         "    }\n"
+         "    barrier(CLK_LOCAL_MEM_FENCE);\n",
+         gray ? "dot(p.xyz, (float3)(0.299f, 0.587f, 0.114f))" : "p");
+
+    int haloIn = halo;
+    int first = gray ? 1 : 0;
+
+    for(int i = first; i < chain->count; ++i) {
+        int haloOut = haloIn - stageHalo(chain->stages[i].kind);
+        int last = i == chain->count - 1;
+
+        stageExpression(expr, sizeof(expr), &chain->stages[i]);
+
+        EMIT("    { // stage %d\n"
+             "        const int inW = TX + 2 * %d, outW = TX + 2 * %d, outH = TY + 2 * %d;\n"
+             "        for(int t = lid; t < outW * outH; t += TX * TY) {\n"
+             "            int ox = t %% outW, oy = t / outW;\n"
+             "            int ix = ox + %d, iy = oy + %d;\n"
+             "            pix_t r = %s;\n",
+             i, haloIn, haloOut, haloOut, haloIn - haloOut, haloIn - haloOut, expr);
+
+        if (last)
+            EMIT("            int gx = x0 + ox, gy = y0 + oy;\n"
+                 "            if (gx < width && gy < height)\n"
+                 "                output[gx + gy * width] = %s;\n"
+                 "        }\n"
+                 "    }\n",
+                 gray ? "(uchar4)((uchar3)(convert_uchar_sat(r)), (uchar)255)" : "convert_uchar4_sat(r)");
+        else
+            EMIT("            dst[t] = r;\n"
+                 "        }\n"
+                 "        barrier(CLK_LOCAL_MEM_FENCE);\n"
+                 "        __local pix_t* tmp = src; src = dst; dst = tmp;\n"
+                 "    }\n");
+
+        haloIn = haloOut;
+    }
+
+    // a chain without stages after the load just converts the tile
+    if (chain->count == first)
+        EMIT("    int ox = get_local_id(0), oy = get_local_id(1);\n"
+             "    int gx = x0 + ox, gy = y0 + oy;\n"
+             "    pix_t r = src[ox + oy * TX];\n"
+             "    if (gx < width && gy < height)\n"
+             "        output[gx + gy * width] = %s;\n",
+             gray ? "(uchar4)((uchar3)(convert_uchar_sat(r)), (uchar)255)" : "convert_uchar4_sat(r)");
+
+    EMIT("}\n");
+#undef EMIT
+
+    return src;
+}
+
+#endif
@@ -45,25 +45,116 @@ __kernel void SobelDetector(__global uchar4* input, __global uchar4* output) {
 			
 }
 
-	
-
-	 
+// Gradient of the 3x3 neighbourhood, with the masks of SobelDetector
+float4 sobel(float4 i00, float4 i10, float4 i20,
+             float4 i01, float4 i11, float4 i21,
+             float4 i02, float4 i12, float4 i22) {
+	float4 Gx =   i00 + (float4)(2) * i10 + i20 - i02  - (float4)(2) * i12 - i22;
+	float4 Gy =   i00 - i20  + (float4)(2)*i01 - (float4)(2)*i21 + i02  -  i22;
+	return hypot(Gx, Gy)/(float4)(2);
+}
 
+// Reads go through the texture cache, and the sampler clamps the
+// coordinates at the borders, so border pixels are filtered as well.
+__constant sampler_t clampSampler = CLK_NORMALIZED_COORDS_FALSE |
+                                    CLK_ADDRESS_CLAMP_TO_EDGE |
+                                    CLK_FILTER_NEAREST;
 
+__kernel void SobelDetectorImage(__read_only image2d_t input,
+                                 __global uchar4* output,
+                                 uint width,
+                                 uint height) {
+	int x = get_global_id(0);
+	int y = get_global_id(1);
 
+	if (x >= width || y >= height) return;
 
+#define PIXEL(dx, dy) convert_float4(read_imageui(input, clampSampler, (int2)(x + (dx), y + (dy))))
+	float4 g = sobel(PIXEL(-1, -1), PIXEL(0, -1), PIXEL(1, -1),
+	                 PIXEL(-1,  0), PIXEL(0,  0), PIXEL(1,  0),
+	                 PIXEL(-1,  1), PIXEL(0,  1), PIXEL(1,  1));
+#undef PIXEL
 
+	output[x + y * width] = convert_uchar4(g);
+}
 
-	
+// Each work-group stages its block of pixels plus a one pixel apron in
+// local memory, so that every input pixel is read from global memory about
+// once instead of nine times. Coordinates of the apron are clamped to the
+// image, like the sampler of SobelDetectorImage does.
+__kernel void SobelDetectorTiled(__global const uchar4* input,
+                                 __global uchar4* output,
+                                 uint width,
+                                 uint height,
+                                 __local uchar4* tile) {
+	int x = get_global_id(0);
+	int y = get_global_id(1);
+	int lx = get_local_id(0);
+	int ly = get_local_id(1);
+	int sizeX = get_local_size(0);
+	int sizeY = get_local_size(1);
+	int tileWidth = sizeX + 2;
+
+	int x0 = get_group_id(0) * sizeX - 1;
+	int y0 = get_group_id(1) * sizeY - 1;
+
+	for(int ty = ly; ty < sizeY + 2; ty += sizeY)
+		for(int tx = lx; tx < tileWidth; tx += sizeX) {
+			int gx = clamp(x0 + tx, 0, (int)width - 1);
+			int gy = clamp(y0 + ty, 0, (int)height - 1);
+			tile[tx + ty * tileWidth] = input[gx + gy * width];
+		}
+
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (x >= width || y >= height) return;
+
+#define PIXEL(dx, dy) convert_float4(tile[(lx + 1 + (dx)) + (ly + 1 + (dy)) * tileWidth])
+	float4 g = sobel(PIXEL(-1, -1), PIXEL(0, -1), PIXEL(1, -1),
+	                 PIXEL(-1,  0), PIXEL(0,  0), PIXEL(1,  0),
+	                 PIXEL(-1,  1), PIXEL(0,  1), PIXEL(1,  1));
+#undef PIXEL
+
+	output[x + y * width] = convert_uchar4(g);
+}
 
-	
+// Rows of a BMP file as stored, blue, green, red and padding, to uchar4 with
+// red in x and a white w, like bmp.h does on the host. Lets the rows go to the
+// device straight from a mapped file, in a quarter fewer bytes for 24 bits.
+__kernel void UnpackBMP(__global const uchar* raw,
+                        __global uchar4* pixels,
+                        uint width,
+                        uint height,
+                        uint stride,
+                        uint bytesPerPixel) {
+	uint x = get_global_id(0);
+	uint y = get_global_id(1);
 
+	if (x >= width || y >= height) return;
 
+	__global const uchar* p = raw + y * stride + x * bytesPerPixel;
+	pixels[x + y * width] = (uchar4)(p[2], p[1], p[0], 255);
+}
 
+// The reverse of UnpackBMP, zeroing the padding at the end of the rows.
+__kernel void PackBMP(__global const uchar4* pixels,
+                      __global uchar* raw,
+                      uint width,
+                      uint height,
+                      uint stride,
+                      uint bytesPerPixel) {
+	uint x = get_global_id(0);
+	uint y = get_global_id(1);
 
-	
+	if (x >= width || y >= height) return;
 
-	
+	uchar4 c = pixels[x + y * width];
+	__global uchar* p = raw + y * stride + x * bytesPerPixel;
+	p[0] = c.z;
+	p[1] = c.y;
+	p[2] = c.x;
+	if (bytesPerPixel == 4) p[3] = 255;
 
-	
-	
+	if (x == width - 1)
+		for(uint b = width * bytesPerPixel; b < stride; ++b) raw[y * stride + b] = 0;
+}
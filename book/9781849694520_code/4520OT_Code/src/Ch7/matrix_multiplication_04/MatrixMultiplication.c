@@ -82,6 +82,115 @@ void fillRandom(int* data, unsigned int width, unsigned height, unsigned int see
             iptr[j+i*width] = rand() % 100;
 }
 
+#ifdef USE_BATCHED_GEMM
+#define BATCH_ELEMENTS (1 << 22) // elements of A over the whole batch
+#define BATCH_GROUP_SIZE 256
+
+/*
+ Runs the batched kernel over 'count' products of n x n matrices and checks
+ the results. With 'indexed' set, the matrices are placed in the buffers in
+ reverse order and located through per-matrix offsets (the pointer-array
+ layout); otherwise they are stored back to back.
+ */
+void runBatched(cl_context context, cl_command_queue queue, cl_program program,
+                cl_device_id device, int n, int indexed) {
+    cl_int error;
+    cl_int elems = n * n;
+    cl_int count = BATCH_ELEMENTS / elems;
+
+    cl_ulong localMemSize;
+    clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong), &localMemSize, NULL);
+
+    // as many matrices per group as fit into local memory and keep the group busy
+    cl_int matsPerGroup = (BATCH_GROUP_SIZE + elems - 1) / elems;
+    while(matsPerGroup > 1 && 2 * matsPerGroup * elems * sizeof(cl_int) > localMemSize)
+        matsPerGroup--;
+    if (2 * matsPerGroup * elems * sizeof(cl_int) > localMemSize) {
+        printf("Batched %dx%d: operands do not fit into local memory\n", n, n);
+        return;
+    }
+
+    cl_int* A = (cl_int*) malloc(count * elems * sizeof(cl_int));
+    cl_int* B = (cl_int*) malloc(count * elems * sizeof(cl_int));
+    cl_int* C = (cl_int*) malloc(count * elems * sizeof(cl_int));
+    cl_int* offset = (cl_int*) malloc(count * sizeof(cl_int));
+
+    srand(643);
+    for(int i = 0; i < count * elems; ++i) {
+        A[i] = rand() % 100;
+        B[i] = rand() % 100;
+    }
+    for(int m = 0; m < count; ++m)
+        offset[m] = (indexed ? count - 1 - m : m) * elems;
+
+    cl_mem AMemObj = clCreateBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR,
+                                    count * elems * sizeof(cl_int), A, &error);
+    cl_mem BMemObj = clCreateBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR,
+                                    count * elems * sizeof(cl_int), B, &error);
+    cl_mem CMemObj = clCreateBuffer(context, CL_MEM_WRITE_ONLY,
+                                    count * elems * sizeof(cl_int), NULL, &error);
+    cl_mem offsetMemObj = clCreateBuffer(context, CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR,
+                                         count * sizeof(cl_int), offset, &error);
+
+    cl_kernel kernel = clCreateKernel(program, indexed ? "mmmultBatchedIndexed" : "mmmultBatched", &error);
+
+    clSetKernelArg(kernel, 0, sizeof(cl_int), (void*)&n);
+    clSetKernelArg(kernel, 1, sizeof(cl_int), (void*)&count);
+    clSetKernelArg(kernel, 2, sizeof(cl_int), (void*)&matsPerGroup);
+    if (indexed) {
+        // the same offsets serve A, B and C
+        clSetKernelArg(kernel, 3, sizeof(cl_mem), (void*)&offsetMemObj);
+        clSetKernelArg(kernel, 4, sizeof(cl_mem), (void*)&offsetMemObj);
+        clSetKernelArg(kernel, 5, sizeof(cl_mem), (void*)&offsetMemObj);
+    } else {
+        clSetKernelArg(kernel, 3, sizeof(cl_int), (void*)&elems);
+        clSetKernelArg(kernel, 4, sizeof(cl_int), (void*)&elems);
+        clSetKernelArg(kernel, 5, sizeof(cl_int), (void*)&elems);
+    }
+    clSetKernelArg(kernel, 6, sizeof(cl_mem), (void*)&AMemObj);
+    clSetKernelArg(kernel, 7, sizeof(cl_mem), (void*)&BMemObj);
+    clSetKernelArg(kernel, 8, sizeof(cl_mem), (void*)&CMemObj);
+    clSetKernelArg(kernel, 9, 2 * matsPerGroup * elems * sizeof(cl_int), NULL);
+
+    size_t localThreads[] = {BATCH_GROUP_SIZE};
+    size_t globalThreads[] = {(count + matsPerGroup - 1) / matsPerGroup * BATCH_GROUP_SIZE};
+
+    cl_event exeEvt;
+    cl_ulong executionStart, executionEnd;
+    error = clEnqueueNDRangeKernel(queue, kernel, 1, NULL, globalThreads, localThreads, 0, NULL, &exeEvt);
+    clWaitForEvents(1, &exeEvt);
+    if(error != CL_SUCCESS) {
+        printf("Kernel execution failure!\n");
+        exit(-22);
+    }
+    clGetEventProfilingInfo(exeEvt, CL_PROFILING_COMMAND_START, sizeof(executionStart), &executionStart, NULL);
+    clGetEventProfilingInfo(exeEvt, CL_PROFILING_COMMAND_END, sizeof(executionEnd), &executionEnd, NULL);
+    clReleaseEvent(exeEvt);
+
+    clEnqueueReadBuffer(queue, CMemObj, CL_TRUE, 0, count * elems * sizeof(cl_int), C, 0, NULL, NULL);
+
+    int result = 1;
+    for(int m = 0; m < count && result; ++m)
+        result = compare(C + offset[m], A + offset[m], B + offset[m], n, n, n);
+
+    double seconds = (executionEnd - executionStart) * 1e-9;
+    printf("Batched %s %d x (%dx%d), %d per group: %.3f ms, %.2f GOPS %s\n",
+           indexed ? "indexed" : "strided", count, n, n, matsPerGroup,
+           seconds * 1e3, 2.0 * count * elems * n / seconds * 1e-9,
+           result ? "Passed!" : "Failed!");
+
+    clReleaseKernel(kernel);
+    clReleaseMemObject(AMemObj);
+    clReleaseMemObject(BMemObj);
+    clReleaseMemObject(CMemObj);
+    clReleaseMemObject(offsetMemObj);
+    free(A);
+    free(B);
+    free(C);
+    free(offset);
+}
+#endif
+
 int main(int argc, char** argv) {
     /* OpenCL 1.1 data structures */
     cl_platform_id* platforms;
@@ -186,7 +295,7 @@ int main(int argc, char** argv) {
 	    }
        
         // Queue is created with profiling enabled 
-        cl_command_queue_properties props;
+        cl_command_queue_properties props = 0;
         props |= CL_QUEUE_PROFILING_ENABLE;
 
         queue = clCreateCommandQueue(context, device, props, &error);
@@ -258,6 +367,13 @@ int main(int argc, char** argv) {
             printf("Passed!\n");
         else 
             printf("Failed!\n");
+
+#ifdef USE_BATCHED_GEMM
+        for(int n = 8; n <= 64; n *= 2) {
+            runBatched(context, queue, program, device, n, 0);
+            runBatched(context, queue, program, device, n, 1);
+        }
+#endif
  
         /* Clean up */
         for(i=0; i< NUMBER_OF_FILES; i++) { free(buffer[i]); }
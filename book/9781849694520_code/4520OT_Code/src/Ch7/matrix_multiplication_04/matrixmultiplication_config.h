@@ -1 +1,2 @@
 #define DEBUG
+#define USE_BATCHED_GEMM
@@ -37,3 +37,95 @@ __kernel void mmmult(int widthB,
 }
 
 
+
+/*
+  Batched products of many small n x n matrices (n up to 64).
+  Each work-group takes 'matsPerGroup' consecutive products of the batch,
+  stages both operands of all of them in local memory, and computes every
+  element of the results from there, so that each input element is read
+  from global memory only once.
+*/
+
+int mmmultLocal(int n, int elem,
+                __local const int* As,
+                __local const int* Bs) {
+    int i = elem / n;
+    int j = elem % n;
+    int tmp = 0;
+
+    for(int k = 0; k < n; ++k)
+        tmp += As[i * n + k] * Bs[k * n + j];
+
+    return tmp;
+}
+
+/* Matrices of the batch are 'stride' elements apart. */
+__kernel void mmmultBatched(int n,
+                            int count,
+                            int matsPerGroup,
+                            int strideA,
+                            int strideB,
+                            int strideC,
+                            __global const int* A,
+                            __global const int* B,
+                            __global int* C,
+                            __local  int* shared) {
+
+    int id = get_local_id(0);
+    int size = get_local_size(0);
+    int first = get_group_id(0) * matsPerGroup;
+    int elems = n * n;
+    int mats = min(matsPerGroup, count - first);
+
+    __local int* As = shared;
+    __local int* Bs = shared + matsPerGroup * elems;
+
+    for(int t = id; t < mats * elems; t += size) {
+        int m = t / elems, e = t % elems;
+        As[t] = A[(first + m) * strideA + e];
+        Bs[t] = B[(first + m) * strideB + e];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for(int t = id; t < mats * elems; t += size) {
+        int m = t / elems, e = t % elems;
+        C[(first + m) * strideC + e] = mmmultLocal(n, e, As + m * elems, Bs + m * elems);
+    }
+}
+
+/*
+  Pointer-array layout: each matrix of the batch starts at its own offset
+  (in elements) into A, B and C.
+*/
+__kernel void mmmultBatchedIndexed(int n,
+                                   int count,
+                                   int matsPerGroup,
+                                   __global const int* offsetA,
+                                   __global const int* offsetB,
+                                   __global const int* offsetC,
+                                   __global const int* A,
+                                   __global const int* B,
+                                   __global int* C,
+                                   __local  int* shared) {
+
+    int id = get_local_id(0);
+    int size = get_local_size(0);
+    int first = get_group_id(0) * matsPerGroup;
+    int elems = n * n;
+    int mats = min(matsPerGroup, count - first);
+
+    __local int* As = shared;
+    __local int* Bs = shared + matsPerGroup * elems;
+
+    for(int t = id; t < mats * elems; t += size) {
+        int m = t / elems, e = t % elems;
+        As[t] = A[offsetA[first + m] + e];
+        Bs[t] = B[offsetB[first + m] + e];
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for(int t = id; t < mats * elems; t += size) {
+        int m = t / elems, e = t % elems;
+        C[offsetC[first + m] + e] = mmmultLocal(n, e, As + m * elems, Bs + m * elems);
+    }
+}
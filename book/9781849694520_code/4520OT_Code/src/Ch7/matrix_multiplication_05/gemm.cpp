@@ -0,0 +1,90 @@
+#include <vexcl/vexcl.hpp>
+#include <boost/chrono.hpp>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <cmath>
+#include <cstdlib>
+
+/*
+ Tiled matrix-matrix product from vexcl/gemm.hpp on rectangular float,
+ double and int matrices, checked against a host product.
+
+ Set VEXCL_TUNE_GEMM=1 (and VEXCL_CACHE_DIR to keep the result) to pick the
+ tile sizes for the device before the run.
+ */
+
+typedef boost::chrono::high_resolution_clock clock_type;
+
+const int runs = 10;
+
+template <typename T>
+void hostGemm(size_t M, size_t N, size_t K, const std::vector<T> &A,
+              const std::vector<T> &B, std::vector<T> &C) {
+    for(size_t i = 0; i < M; i++)
+        for(size_t j = 0; j < N; j++) {
+            T s = 0;
+            for(size_t k = 0; k < K; k++) s += A[i * K + k] * B[k * N + j];
+            C[i * N + j] = s;
+        }
+}
+
+template <typename T>
+void bench(const vex::Context &ctx, size_t M, size_t N, size_t K, const std::string &type) {
+    std::vector<T> a(M * K), b(K * N), c(M * N), ref(M * N);
+    for(size_t i = 0; i < a.size(); i++) a[i] = static_cast<T>(rand() % 16);
+    for(size_t i = 0; i < b.size(); i++) b[i] = static_cast<T>(rand() % 16);
+
+    vex::vector<T> A(ctx, a), B(ctx, b), C(ctx, M * N);
+
+    vex::gemm_params prm = vex::gemm_tuning<>::get<T>(ctx.queue(0));
+
+    // Warm up (and compile the kernel).
+    vex::gemm(M, N, K, T(1), A, B, T(0), C);
+    ctx.finish();
+
+    clock_type::time_point start = clock_type::now();
+    for(int i = 0; i < runs; i++) vex::gemm(M, N, K, T(1), A, B, T(0), C);
+    ctx.finish();
+    double time = boost::chrono::duration<double>(clock_type::now() - start).count() / runs;
+
+    vex::copy(C, c);
+    hostGemm(M, N, K, a, b, ref);
+
+    bool result = true;
+    for(size_t i = 0; i < c.size(); i++)
+        if (std::fabs(static_cast<double>(c[i] - ref[i])) > 1e-3 * std::fabs(static_cast<double>(ref[i]))) {
+            result = false;
+            break;
+        }
+
+    std::cout << "  " << std::setw(8) << std::left << type
+              << M << "x" << N << "x" << K
+              << " tiles " << prm.tile_m() << "x" << prm.tile_n() << "x" << prm.tk
+              << " (" << prm.ry << "x" << prm.rx << " per work-item) "
+              << std::fixed << std::setprecision(2)
+              << 2.0 * M * N * K / time * 1e-9 << " GFLOPS "
+              << (result ? "Passed!" : "Failed") << std::endl;
+}
+
+int main(int argc, char** argv) {
+    size_t M = argc > 1 ? atoi(argv[1]) : 1000;
+    size_t N = argc > 2 ? atoi(argv[2]) : 1200;
+    size_t K = argc > 3 ? atoi(argv[3]) : 700;
+
+    vex::Context ctx(vex::Filter::Env && vex::Filter::Count(1));
+
+    if (!ctx) {
+        std::cerr << "No OpenCL devices found" << std::endl;
+        return 1;
+    }
+
+    std::cout << ctx << std::endl;
+
+    bench<cl_float>(ctx, M, N, K, "float");
+    bench<cl_int>(ctx, M, N, K, "int");
+
+    if (vex::Filter::DoublePrecision(ctx.device(0)))
+        bench<cl_double>(ctx, M, N, K, "double");
+}
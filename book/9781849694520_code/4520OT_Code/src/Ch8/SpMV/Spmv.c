@@ -874,7 +874,478 @@ void RunTest(cl_device_id dev, cl_context ctx, cl_command_queue queue,
     delete[] h_valPad, h_colsPad, h_rowDelimitersPad;
 }
 
+// ****************************************************************************
+// Struct: RowStats
+//
+// Purpose:
+//   Distribution of the row lengths (nonzeros per row) of a CSR matrix.
+//   The formats differ in how they cope with it: CSR-scalar suits short,
+//   even rows, CSR-vector suits long rows, and ELLPACK-R pays for every
+//   row being stored with the length of the longest one.
+// ****************************************************************************
+struct RowStats {
+    int    minLength, maxLength, median, p90;
+    double mean, stddev;
+    double ellFill;  // nonzeros / ELLPACK-R storage
+};
+
+RowStats analyseRowLengths(const int *rowDelimiters, int numRows)
+{
+    std::vector<int> len(numRows);
+    double sum = 0, sum2 = 0;
+    for (int i = 0; i < numRows; i++)
+    {
+        len[i] = rowDelimiters[i+1] - rowDelimiters[i];
+        sum  += len[i];
+        sum2 += (double)len[i] * len[i];
+    }
+    std::sort(len.begin(), len.end());
+
+    RowStats st;
+    st.minLength = len.front();
+    st.maxLength = len.back();
+    st.median    = len[numRows / 2];
+    st.p90       = len[std::min(numRows - 1, (int)(0.9 * numRows))];
+    st.mean      = sum / numRows;
+    st.stddev    = sqrt(std::max(0.0, sum2 / numRows - st.mean * st.mean));
+    st.ellFill   = st.maxLength ? sum / ((double)st.maxLength * numRows) : 1;
+    return st;
+}
+
+// ****************************************************************************
+// Struct: Candidate
+//
+// Purpose:
+//   One benchmarked kernel/configuration of the selection driver
+// ****************************************************************************
+struct Candidate {
+    string name;     // format and kernel
+    int    vectorSize;
+    bool   texture;  // x read through the texture cache
+    double seconds;  // average kernel time
+    double gflops;
+    double gbytes;   // effective bandwidth: bytes the kernel has to move
+};
+
+// ****************************************************************************
+// Function: buildSpmvProgram
+//
+// Purpose:
+//   Builds spmv.cl with the given flags; prints the build log and returns
+//   NULL on failure
+// ****************************************************************************
+cl_program buildSpmvProgram(cl_device_id dev, cl_context ctx, const string &flags)
+{
+    int err = 0;
+    cl_program prog = clCreateProgramWithSource(ctx, 1, &cl_source_spmv, NULL,
+            &err);
+    CL_CHECK_ERROR(err);
+
+    err = clBuildProgram(prog, 1, &dev, flags.c_str(), NULL, NULL);
+    if (err != CL_SUCCESS)
+    {
+        char log[5000];
+        size_t retsize = 0;
+        clGetProgramBuildInfo(prog, dev, CL_PROGRAM_BUILD_LOG, 5000
+                * sizeof(char), log, &retsize);
+        cout << "Build failed with " << flags << "\nLog: " << log << endl;
+        clReleaseProgram(prog);
+        return NULL;
+    }
+    return prog;
+}
+
+// ****************************************************************************
+// Function: timeSpmvKernel
+//
+// Purpose:
+//   Sets the arguments shared by all kernels in spmv.cl, runs the kernel
+//   iters times after a warm-up run and reads back the result.
+//
+// Returns:
+//   average kernel time in seconds, or -1 if the kernel fails to launch
+// ****************************************************************************
+double timeSpmvKernel(cl_command_queue queue, cl_kernel kernel,
+                      cl_mem d_val, cl_mem d_vec, cl_mem d_cols, cl_mem d_idx,
+                      int dim, cl_mem d_out, float *h_out, int numRows,
+                      size_t globalWorkSize, size_t localWorkSize, int iters)
+{
+    int err = 0;
+    err |= clSetKernelArg(kernel, 0, sizeof(cl_mem), (void*) &d_val);
+    err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), (void*) &d_vec);
+    err |= clSetKernelArg(kernel, 2, sizeof(cl_mem), (void*) &d_cols);
+    err |= clSetKernelArg(kernel, 3, sizeof(cl_mem), (void*) &d_idx);
+    err |= clSetKernelArg(kernel, 4, sizeof(cl_int), (void*) &dim);
+    err |= clSetKernelArg(kernel, 5, sizeof(cl_mem), (void*) &d_out);
+    CL_CHECK_ERROR(err);
+
+    // round up to a whole number of work-groups
+    globalWorkSize = (globalWorkSize + localWorkSize - 1) / localWorkSize
+                   * localWorkSize;
+
+    double total = 0;
+    for (int j = -1; j < iters; j++)
+    {
+        cl_event ev;
+        cl_ulong start, end;
+        err = clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &globalWorkSize,
+                &localWorkSize, 0, NULL, &ev);
+        if (err != CL_SUCCESS) return -1;
+        clWaitForEvents(1, &ev);
+        clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_START,
+                sizeof(cl_ulong), &start, NULL);
+        clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_END,
+                sizeof(cl_ulong), &end, NULL);
+        clReleaseEvent(ev);
+        if (j >= 0) total += (end - start) * 1e-9;
+    }
+
+    err = clEnqueueReadBuffer(queue, d_out, true, 0, numRows * sizeof(float),
+            h_out, 0, NULL, NULL);
+    CL_CHECK_ERROR(err);
+    return total / iters;
+}
+
+// ****************************************************************************
+// Function: resultsMatch
+//
+// Purpose:
+//   Quiet version of verifyResults used by the selection driver
+// ****************************************************************************
+bool resultsMatch(const float *ref, const float *out, int size)
+{
+    for (int i = 0; i < size; i++)
+    {
+        double scale = std::max(1.0, (double)fabs(ref[i]));
+        if (fabs(ref[i] - out[i]) / scale > 1e-4) return 0;
+    }
+    return 1;
+}
+
+cl_mem createSpmvBuffer(cl_context ctx, size_t size, void *data)
+{
+    int err = 0;
+    cl_mem buf = clCreateBuffer(ctx, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+            size, data, &err);
+    CL_CHECK_ERROR(err);
+    return buf;
+}
+
+// ****************************************************************************
+// Function: selectFormat
+//
+// Purpose:
+//   Benchmarks CSR-scalar, CSR-vector (for every VECTOR_SIZE the device
+//   allows), padded CSR and ELLPACK-R on the given matrix, prints GFLOP/s
+//   and effective bandwidth of each, and recommends the fastest one.
+//   When the device supports images, every kernel is also run with x read
+//   from an image (USE_TEXTURE in spmv.cl) to show whether the texture
+//   cache helps the irregular gathers on this device.
+//   The recommendation is also written to spmv.tune as key/value lines,
+//   including the vex::SpMat CSR kernel (csr_kernel::type) it maps to:
+//   ELLPACK-R corresponds to the default hybrid ELL format of vex::SpMat.
+//
+// Arguments:
+//   dev, ctx, queue: device to benchmark on; queue needs profiling enabled
+//   h_val, h_cols, h_rowDelimiters: the matrix in CSR format
+//   numRows, numNonZeroes: its dimensions
+//   iters: timed runs of each kernel
+// ****************************************************************************
+void selectFormat(cl_device_id dev, cl_context ctx, cl_command_queue queue,
+                  float *h_val, int *h_cols, int *h_rowDelimiters,
+                  int numRows, int numNonZeroes, int iters)
+{
+    int err = 0;
+    RowStats st = analyseRowLengths(h_rowDelimiters, numRows);
+
+    cout << "Rows: " << numRows << ", nonzeros: " << numNonZeroes << endl;
+    cout << "Row length: min " << st.minLength << ", median " << st.median
+         << ", 90% " << st.p90 << ", max " << st.maxLength
+         << ", mean " << st.mean << ", stddev " << st.stddev << endl;
+    cout << "ELLPACK-R fill: " << st.ellFill * 100 << "%" << endl;
+
+    float *h_vec  = new float[numRows];
+    float *h_out  = new float[numRows];
+    float *refOut = new float[numRows];
+    fill(h_vec, numRows, 10.0f);
+    spmvCpu(h_val, h_cols, h_rowDelimiters, h_vec, numRows, refOut);
+
+    // Padded CSR and column-major ELLPACK-R copies of the matrix
+    float *h_valPad;
+    int *h_colsPad, nItemsPadded;
+    int *h_rowDelimitersPad = new int[numRows+1];
+    convertToPadded(h_val, h_cols, numRows, h_rowDelimiters, &h_valPad,
+            &h_colsPad, h_rowDelimitersPad, &nItemsPadded);
+
+    int *h_rowLengths = new int[numRows];
+    for (int k = 0; k < numRows; k++)
+        h_rowLengths[k] = h_rowDelimiters[k+1] - h_rowDelimiters[k];
+    int maxrl = st.maxLength;
+    float *h_valcm = new float[std::max(1, maxrl * numRows)];
+    int *h_colscm = new int[std::max(1, maxrl * numRows)];
+    std::fill(h_colscm, h_colscm + std::max(1, maxrl * numRows), 0);
+    convertToColMajor(h_val, h_cols, numRows, h_rowDelimiters, h_valcm,
+            h_colscm, h_rowLengths, maxrl, false);
+
+    cl_mem d_vec  = createSpmvBuffer(ctx, numRows * sizeof(float), h_vec);
+    cl_mem d_out  = clCreateBuffer(ctx, CL_MEM_WRITE_ONLY,
+            numRows * sizeof(float), NULL, &err);
+    CL_CHECK_ERROR(err);
+
+    cl_mem d_val  = createSpmvBuffer(ctx, numNonZeroes * sizeof(float), h_val);
+    cl_mem d_cols = createSpmvBuffer(ctx, numNonZeroes * sizeof(int), h_cols);
+    cl_mem d_row  = createSpmvBuffer(ctx, (numRows+1) * sizeof(int),
+            h_rowDelimiters);
+
+    cl_mem d_valPad  = createSpmvBuffer(ctx, nItemsPadded * sizeof(float),
+            h_valPad);
+    cl_mem d_colsPad = createSpmvBuffer(ctx, nItemsPadded * sizeof(int),
+            h_colsPad);
+    cl_mem d_rowPad  = createSpmvBuffer(ctx, (numRows+1) * sizeof(int),
+            h_rowDelimitersPad);
+
+    cl_mem d_valcm  = createSpmvBuffer(ctx, std::max(1, maxrl * numRows)
+            * sizeof(float), h_valcm);
+    cl_mem d_colscm = createSpmvBuffer(ctx, std::max(1, maxrl * numRows)
+            * sizeof(int), h_colscm);
+    cl_mem d_rl     = createSpmvBuffer(ctx, numRows * sizeof(int),
+            h_rowLengths);
+
+    // Bytes each format has to move: values and column indices, row
+    // pointers or lengths, the result, and one gathered element of the
+    // dense vector per stored entry.
+    double csrBytes = (double)numNonZeroes * (2 * sizeof(float) + sizeof(int))
+                    + (numRows + 1) * sizeof(int) + numRows * sizeof(float);
+    double padBytes = (double)nItemsPadded * (2 * sizeof(float) + sizeof(int))
+                    + (numRows + 1) * sizeof(int) + numRows * sizeof(float);
+    double ellBytes = (double)maxrl * numRows * (2 * sizeof(float) + sizeof(int))
+                    + numRows * (sizeof(int) + sizeof(float));
+    double flop = 2.0 * numNonZeroes;
+
+    std::vector<Candidate> results;
+
+    // Image copy of x for the texture path, laid out as in spmv.cl
+    cl_bool images = CL_FALSE;
+    size_t maxImgWidth = 0;
+    clGetDeviceInfo(dev, CL_DEVICE_IMAGE_SUPPORT, sizeof(cl_bool), &images,
+            NULL);
+    clGetDeviceInfo(dev, CL_DEVICE_IMAGE2D_MAX_WIDTH, sizeof(size_t),
+            &maxImgWidth, NULL);
+
+    cl_mem d_vecImg = NULL;
+    int imgWidth = std::min<size_t>(maxImgWidth, numRows);
+    if (images && imgWidth)
+    {
+        int imgHeight = (numRows + imgWidth - 1) / imgWidth;
+        std::vector<float> h_vecImg((size_t)imgWidth * imgHeight, 0.0f);
+        std::copy(h_vec, h_vec + numRows, h_vecImg.begin());
+
+        cl_image_format fmt;
+        fmt.image_channel_order     = CL_R;
+        fmt.image_channel_data_type = CL_FLOAT;
+        d_vecImg = clCreateImage2D(ctx, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                &fmt, imgWidth, imgHeight, 0, &h_vecImg[0], &err);
+        if (err != CL_SUCCESS) d_vecImg = NULL;
+    }
+    if (!d_vecImg)
+        cout << "x through the texture cache: not supported" << endl;
+
+    // the local buffer of the vector kernels holds 128 partial sums
+    size_t maxLocal = 0;
+    clGetDeviceInfo(dev, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(size_t),
+            &maxLocal, NULL);
+    size_t blockSize = std::min<size_t>(128, maxLocal);
+
+    for (int tex = 0; tex < (d_vecImg ? 2 : 1); tex++)
+    for (int vs = 1; vs <= (int)blockSize && vs <= 64; vs *= 2)
+    {
+        char flags[128];
+        sprintf(flags, "-DSINGLE_PRECISION -DVECTOR_SIZE=%d", vs);
+        if (tex)
+            sprintf(flags + strlen(flags), " -DUSE_TEXTURE -DMAX_IMG_WIDTH=%d",
+                    imgWidth);
+        cl_program prog = buildSpmvProgram(dev, ctx, flags);
+        if (!prog) continue;
+
+        // the scalar kernels don't depend on VECTOR_SIZE
+        const char *names[] = {"CSR-Scalar", "Padded_CSR-Scalar", "ELLPACK-R",
+                               "CSR-Vector", "Padded_CSR-Vector"};
+        const char *kernels[] = {"spmv_csr_scalar_kernel",
+                                  "spmv_csr_scalar_kernel",
+                                  "spmv_ellpackr_kernel",
+                                  "spmv_csr_vector_kernel",
+                                  "spmv_csr_vector_kernel"};
+        cl_mem vals[] = {d_val, d_valPad, d_valcm, d_val, d_valPad};
+        cl_mem cols[] = {d_cols, d_colsPad, d_colscm, d_cols, d_colsPad};
+        cl_mem idx[]  = {d_row, d_rowPad, d_rl, d_row, d_rowPad};
+        double bytes[] = {csrBytes, padBytes, ellBytes, csrBytes, padBytes};
+
+        for (int c = (vs == 1 ? 0 : 3); c < (vs == 1 ? 3 : 5); c++)
+        {
+            cl_kernel k = clCreateKernel(prog, kernels[c], &err);
+            CL_CHECK_ERROR(err);
+
+            bool vector = c >= 3;
+            size_t local = vector ? blockSize / vs * vs : blockSize;
+
+            double t = timeSpmvKernel(queue, k, vals[c],
+                    tex ? d_vecImg : d_vec, cols[c],
+                    idx[c], numRows, d_out, h_out, numRows,
+                    vector ? (size_t)numRows * vs : numRows, local, iters);
+            clReleaseKernel(k);
+
+            if (t <= 0) continue;
+            if (!resultsMatch(refOut, h_out, numRows))
+            {
+                cout << names[c] << " (VECTOR_SIZE " << vs
+                     << (tex ? ", texture" : "")
+                     << ") produced wrong results" << endl;
+                continue;
+            }
+
+            Candidate cand;
+            cand.name       = names[c];
+            cand.vectorSize = vector ? vs : 1;
+            cand.texture    = tex;
+            cand.seconds    = t;
+            cand.gflops     = flop / t * 1e-9;
+            cand.gbytes     = bytes[c] / t * 1e-9;
+            results.push_back(cand);
+        }
+
+        clReleaseProgram(prog);
+    }
+
+    printf("\n%-20s %6s %8s %12s %10s %10s\n", "Kernel", "Vector", "x",
+           "Time (ms)", "GFLOP/s", "GB/s");
+    int best = -1;
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        printf("%-20s %6d %8s %12.4f %10.3f %10.3f\n", results[i].name.c_str(),
+               results[i].vectorSize, results[i].texture ? "texture" : "global",
+               results[i].seconds * 1e3,
+               results[i].gflops, results[i].gbytes);
+        if (best < 0 || results[i].seconds < results[best].seconds)
+            best = i;
+    }
+
+    // Which way of reading x is faster on this device, kernel by kernel
+    if (d_vecImg)
+    {
+        int faster = 0, compared = 0;
+        for (size_t i = 0; i < results.size(); i++)
+        {
+            if (!results[i].texture) continue;
+            for (size_t j = 0; j < results.size(); j++)
+            {
+                if (results[j].texture || results[j].name != results[i].name ||
+                    results[j].vectorSize != results[i].vectorSize) continue;
+                compared++;
+                if (results[i].seconds < results[j].seconds) faster++;
+            }
+        }
+        cout << "\nx through the texture cache is faster for " << faster
+             << " of " << compared << " kernels" << endl;
+    }
+
+    if (best >= 0)
+    {
+        const Candidate &b = results[best];
+        const char *method = b.name.find("Vector") != string::npos ? "vector"
+                           : b.name.find("CSR") != string::npos ? "scalar"
+                           : "automatic";
+
+        cout << "\nRecommended: " << b.name;
+        if (b.name.find("Vector") != string::npos)
+            cout << ", VECTOR_SIZE " << b.vectorSize;
+        if (b.texture)
+            cout << ", x through the texture cache";
+        cout << " (vex::SpMat method csr_kernel::" << method << ")" << endl;
+
+        std::ofstream tune("spmv.tune");
+        tune << "format "       << b.name       << "\n"
+             << "vector_size "  << b.vectorSize << "\n"
+             << "texture "      << b.texture    << "\n"
+             << "spmat_method " << method       << "\n"
+             << "gflops "       << b.gflops     << "\n"
+             << "gbytes "       << b.gbytes     << "\n";
+    }
+    else
+    {
+        cout << "No kernel produced correct results" << endl;
+    }
+
+    cl_mem all[] = {d_vec, d_out, d_val, d_cols, d_row, d_valPad, d_colsPad,
+                    d_rowPad, d_valcm, d_colscm, d_rl};
+    for (size_t i = 0; i < sizeof(all) / sizeof(all[0]); i++)
+        clReleaseMemObject(all[i]);
+    if (d_vecImg) clReleaseMemObject(d_vecImg);
+
+    delete[] h_vec; delete[] h_out; delete[] refOut;
+    delete[] h_valPad; delete[] h_colsPad; delete[] h_rowDelimitersPad;
+    delete[] h_rowLengths; delete[] h_valcm; delete[] h_colscm;
+}
+
+// ****************************************************************************
+// Function: main
+//
+// Purpose:
+//   Format selection driver:
+//     SpMV [matrix.mtx | random] [rows] [iterations]
+//   reads a Matrix Market file (or generates a random matrix with 1% of
+//   nonzeros) and benchmarks every kernel on the first GPU.
+// ****************************************************************************
 int main(int argc, char** argv) {
-return 0;
+    string inFileName = argc > 1 ? argv[1] : "random";
+    int nRows = argc > 2 ? atoi(argv[2]) : 4096;
+    int iters = argc > 3 ? atoi(argv[3]) : 20;
+
+    cl_platform_id platform;
+    cl_device_id dev;
+    int err = clGetPlatformIDs(1, &platform, NULL);
+    if (err == CL_SUCCESS)
+        err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &dev, NULL);
+    if (err != CL_SUCCESS)
+    {
+        perror("Can't locate a OpenCL compliant device i.e. GPU");
+        exit(1);
+    }
+
+    cl_context ctx = clCreateContext(NULL, 1, &dev, NULL, NULL, &err);
+    CL_CHECK_ERROR(err);
+    cl_command_queue queue = clCreateCommandQueue(ctx, dev,
+            CL_QUEUE_PROFILING_ENABLE, &err);
+    CL_CHECK_ERROR(err);
+
+    float *h_val;
+    int *h_cols, *h_rowDelimiters;
+    int nItems, numRows;
+
+    if (inFileName == "random")
+    {
+        numRows = nRows;
+        nItems = std::max(numRows, numRows * numRows / 100);
+        h_val = new float[nItems];
+        h_cols = new int[nItems];
+        h_rowDelimiters = new int[numRows+1];
+        fill(h_val, nItems, 10.0f);
+        initRandomMatrix(h_cols, h_rowDelimiters, nItems, numRows);
+    }
+    else
+    {
+        char filename[FIELD_LENGTH];
+        strncpy(filename, inFileName.c_str(), FIELD_LENGTH - 1);
+        filename[FIELD_LENGTH - 1] = '\0';
+        readMatrix(filename, &h_val, &h_cols, &h_rowDelimiters,
+                &nItems, &numRows);
+    }
+
+    selectFormat(dev, ctx, queue, h_val, h_cols, h_rowDelimiters,
+            numRows, nItems, iters);
+
+    delete[] h_val; delete[] h_cols; delete[] h_rowDelimiters;
+    clReleaseCommandQueue(queue);
+    clReleaseContext(ctx);
+    return 0;
 }
 
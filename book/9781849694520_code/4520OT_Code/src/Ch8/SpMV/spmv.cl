@@ -1,4 +1,8 @@
+// Work-items per row of the vector kernels: a power of two not larger than
+// the work-group size, set with -DVECTOR_SIZE=<n> when building the program
+#ifndef VECTOR_SIZE
 #define VECTOR_SIZE 32
+#endif
 
 #ifdef SINGLE_PRECISION
   #define float float
@@ -10,6 +14,26 @@
   #define float double
 #endif
 
+// The dense vector is read either through plain global loads, or, with
+// -DUSE_TEXTURE -DMAX_IMG_WIDTH=<w>, from a 2D image of single-channel
+// floats (element i at (i % w, i / w)) so that the irregular gathers go
+// through the texture cache. Images are only used in single precision.
+#if defined(USE_TEXTURE) && defined(SINGLE_PRECISION)
+__constant sampler_t texFetchSampler = CLK_NORMALIZED_COORDS_FALSE |
+                                       CLK_ADDRESS_NONE | CLK_FILTER_NEAREST;
+
+float texFetch(__read_only image2d_t image, const int idx) {
+    int2 coord = (int2)(idx % MAX_IMG_WIDTH, idx / MAX_IMG_WIDTH);
+    return read_imagef(image, texFetchSampler, coord).x;
+}
+
+#define VEC_TYPE __read_only image2d_t
+#define VEC(i) texFetch(vec, (i))
+#else
+#define VEC_TYPE __global const float * restrict
+#define VEC(i) vec[(i)]
+#endif
+
 
 // ****************************************************************************
 // Function: spmv_csr_scalar_kernel
@@ -38,7 +62,7 @@
 // ****************************************************************************
 __kernel void 
 spmv_csr_scalar_kernel( __global const float * restrict val, 
-                        __global const float * restrict vec, 
+                        VEC_TYPE vec, 
                         __global const int * restrict cols, 
                         __global const int * restrict rowDelimiters, 
                        const int dim, __global float * restrict out) 
@@ -51,7 +75,7 @@ spmv_csr_scalar_kernel( __global const float * restrict val,
         int end = rowDelimiters[myRow+1];
         for (int j = start; j < end; j++) {
             int col = cols[j]; 
-            t += val[j] * vec[col];
+            t += val[j] * VEC(col);
         }
         out[myRow] = t; 
     }
@@ -84,7 +108,7 @@ spmv_csr_scalar_kernel( __global const float * restrict val,
 // ****************************************************************************
 __kernel void 
 spmv_csr_vector_kernel(__global const float * restrict val, 
-                       __global const float * restrict vec, 
+                       VEC_TYPE vec, 
                        __global const int * restrict cols, 
                        __global const int * restrict rowDelimiters, 
                        const int dim, 
@@ -106,30 +130,23 @@ spmv_csr_vector_kernel(__global const float * restrict val,
         float mySum = 0;
         for (int j= vecStart + id; j < vecEnd; j += VECTOR_SIZE) {
             int col = cols[j]; 
-            mySum += val[j] * vec[col];
+            mySum += val[j] * VEC(col);
         }
 
         partialSums[t] = mySum;
-        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
 
-        // Reduce partial sums
-        // Needs to be modified if there is a change in vector
-        // length
-        if (id < 16) partialSums[t] += partialSums[t+16]; 
-        barrier(CLK_LOCAL_MEM_FENCE);
-        if (id <  8) partialSums[t] += partialSums[t+ 8];
-        barrier(CLK_LOCAL_MEM_FENCE);
-        if (id <  4) partialSums[t] += partialSums[t+ 4];
-        barrier(CLK_LOCAL_MEM_FENCE);
-        if (id <  2) partialSums[t] += partialSums[t+ 2];
-        barrier(CLK_LOCAL_MEM_FENCE);
-        if (id <  1) partialSums[t] += partialSums[t+ 1];
+    // Reduce partial sums. The barriers are outside of the row check, so
+    // that all work-items of the group reach them.
+    for (int s = VECTOR_SIZE / 2; s > 0; s >>= 1) {
+        if (id < s) partialSums[t] += partialSums[t + s];
         barrier(CLK_LOCAL_MEM_FENCE);
+    }
 
-        // Write result 
-        if (id == 0) {
-            out[myRow] = partialSums[t]; 
-        }
+    // Write result 
+    if (myRow < dim && id == 0) {
+        out[myRow] = partialSums[t]; 
     }
 }
 
@@ -157,7 +174,7 @@ spmv_csr_vector_kernel(__global const float * restrict val,
 // ****************************************************************************
 __kernel void
 spmv_ellpackr_kernel(__global const float * restrict val, 
-                     __global const float * restrict vec,                      
+                     VEC_TYPE vec,                      
                      __global const int   * restrict cols, 
                      __global const int   * restrict rowLengths, 
                      const int dim, 
@@ -172,7 +189,7 @@ spmv_ellpackr_kernel(__global const float * restrict val,
         // the thread is currently executing on.
         for (int i = 0; i < max; i++) {
             int ind = i * dim + t; 
-	        result += val[ind] * vec[cols[ind]];
+	        result += val[ind] * VEC(cols[ind]);
         }
         out[t] = result;
     }
@@ -201,7 +218,7 @@ spmv_ellpackr_kernel(__global const float * restrict val,
 // ****************************************************************************
 __kernel void
 spmv_ellpackr_vector_kernel(__global const float * restrict val, 
-                            __global const  float * restrict vec,                      
+                            VEC_TYPE vec,                      
                             __global const int * restrict cols, 
                             __global const int * restrict rowLengths, 
                             const int dim, 
@@ -215,36 +232,28 @@ spmv_ellpackr_vector_kernel(__global const float * restrict val,
     int row = get_global_id(0) / VECTOR_SIZE;
 
     __local float volatile partialSums[128];
+    partialSums[t] = 0;
 
     if (row < dim) {
         float result = 0.0;
-        int max = ceil(rowLengths[row]/VECTOR_SIZE); 
+        int max = (rowLengths[row] + VECTOR_SIZE - 1) / VECTOR_SIZE; 
         for (int i = 0 ; i < max; i ++) {
             int ind = i*(dim * VECTOR_SIZE) + row * VECTOR_SIZE + id; 
-	        result += val[ind] * vec[cols[ind]];
+	        result += val[ind] * VEC(cols[ind]);
         }
  
         partialSums[t] = result;
-        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
 
-        // Reduce partial sums
-        // Needs to be modified if there is a change in vector length
-        if (id < 16) partialSums[tid] += partialSums[t +16];
-        barrier(CLK_LOCAL_MEM_FENCE);
-        if (id <  8) partialSums[tid] += partialSums[t + 8];
-        barrier(CLK_LOCAL_MEM_FENCE);
-        if (id <  4) partialSums[tid] += partialSums[t + 4];
+    // Reduce partial sums
+    for (int s = VECTOR_SIZE / 2; s > 0; s >>= 1) {
+        if (id < s) partialSums[t] += partialSums[t + s];
         barrier(CLK_LOCAL_MEM_FENCE);
-        if (id <  2) partialSums[tid] += partialSums[t + 2];
-        barrier(CLK_LOCAL_MEM_FENCE);
-        if (id <  1) partialSums[tid] += partialSums[t + 1];
-        barrier(CLK_LOCAL_MEM_FENCE); 
-
-        // Write result 
-        if (tid == 0) { 
-            out[row] = partialSums[t]; 
-        } 
     }
-}
-
 
+    // Write result 
+    if (row < dim && id == 0) { 
+        out[row] = partialSums[t]; 
+    } 
+}
@@ -2,8 +2,20 @@
 #define SPMV_UTIL_H_
 
 #include <cassert>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <fstream>
+#include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <sys/stat.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "OptionParser.h"
 #include "ResultDatabase.h"
 
@@ -34,6 +46,9 @@ struct Coordinate {
 inline int intcmp(const void *v1, const void *v2);
 inline int coordcmp(const void *v1, const void *v2);
 template <typename floatType>
+inline bool colcmp(const std::pair<int, floatType> &a,
+                   const std::pair<int, floatType> &b);
+template <typename floatType>
 void readMatrix(char *filename, floatType **val_ptr, int **cols_ptr, 
                 int **rowDelimiters_ptr, int *n, int *size);
 template <typename floatType>
@@ -51,6 +66,173 @@ void convertToPadded(floatType *A, int *cols, int dim, int *rowDelimiters,
                      int *newSize); 
 
 
+// ****************************************************************************
+// Function: parseMatrixChunk
+//
+// Purpose:
+//   Parses coordinate entries of a Matrix Market file held in memory.
+//   The chunk [begin, end) should start at the beginning of a line.
+//   Entries are converted to zero-based indices, and mirror entries are
+//   added for symmetric matrices.
+//
+// Arguments:
+//   begin, end: bounds of the chunk
+//   pattern: the file has no values
+//   symmetric: only lower (or upper) triangle is stored in the file
+//   rows, cols, vals: output - coordinates and values of the entries
+//   mirror: output - marks entries added as mirrors (only when pattern)
+//
+// Returns:  nothing
+// ****************************************************************************
+template <typename floatType>
+void parseMatrixChunk(const char *begin, const char *end, bool pattern,
+                      bool symmetric, std::vector<int> &rows,
+                      std::vector<int> &cols, std::vector<floatType> &vals,
+                      std::vector<char> &mirror)
+{
+    const char *p = begin;
+
+    while (p < end)
+    {
+        while (p < end && isspace(*p)) p++;
+        if (p >= end) break;
+
+        char *q;
+        long i = strtol(p, &q, 10);
+
+        if (q == p)
+        {
+            // comment or garbage: skip the line
+            while (p < end && *p != '\n') p++;
+            continue;
+        }
+
+        p = q;
+        long j = strtol(p, &q, 10);
+        p = q;
+
+        double a = 0;
+        if (!pattern)
+        {
+            a = strtod(p, &q);
+            p = q;
+        }
+
+        while (p < end && *p != '\n') p++;
+
+        rows.push_back(i - 1);
+        cols.push_back(j - 1);
+        vals.push_back(a);
+        if (pattern) mirror.push_back(0);
+
+        // add the mirror element if not on main diagonal
+        if (symmetric && i != j)
+        {
+            rows.push_back(j - 1);
+            cols.push_back(i - 1);
+            vals.push_back(a);
+            if (pattern) mirror.push_back(1);
+        }
+    }
+}
+
+// ****************************************************************************
+// Function: readCachedMatrix / writeCachedMatrix
+//
+// Purpose:
+//   Load or store the CSR matrix in a binary sidecar file next to the
+//   Matrix Market file (filename + ".csr"). The sidecar is used only when
+//   it is newer than the Matrix Market file and was written with the same
+//   floating point type.
+//
+// Returns:  readCachedMatrix returns true when the sidecar was loaded
+// ****************************************************************************
+static const char CSR_CACHE_MAGIC[8] = {'S','P','M','V','C','S','R','1'};
+
+inline std::string matrixCacheName(const char *filename)
+{
+    return std::string(filename) + ".csr";
+}
+
+template <typename floatType>
+bool readCachedMatrix(const char *filename, floatType **val_ptr,
+                      int **cols_ptr, int **rowDelimiters_ptr, int *n,
+                      int *size)
+{
+    std::string cache = matrixCacheName(filename);
+
+    struct stat mtx_stat, csr_stat;
+    if (stat(filename, &mtx_stat) != 0 || stat(cache.c_str(), &csr_stat) != 0)
+        return false;
+    if (csr_stat.st_mtime < mtx_stat.st_mtime)
+        return false;
+
+    std::ifstream cfs(cache.c_str(), std::ios::binary);
+
+    char magic[8];
+    int valSize, nRows, nElements;
+
+    cfs.read(magic, sizeof(magic));
+    cfs.read((char*)&valSize, sizeof(int));
+    cfs.read((char*)&nRows, sizeof(int));
+    cfs.read((char*)&nElements, sizeof(int));
+
+    if (!cfs || memcmp(magic, CSR_CACHE_MAGIC, sizeof(magic)) != 0 ||
+        valSize != (int)sizeof(floatType))
+        return false;
+
+    floatType *val = new floatType[nElements];
+    int *cols = new int[nElements];
+    int *rowDelimiters = new int[nRows+1];
+
+    cfs.read((char*)rowDelimiters, (nRows + 1) * sizeof(int));
+    cfs.read((char*)cols, nElements * sizeof(int));
+    cfs.read((char*)val, nElements * sizeof(floatType));
+
+    if (!cfs)
+    {
+        delete[] val;
+        delete[] cols;
+        delete[] rowDelimiters;
+        return false;
+    }
+
+    *val_ptr = val;
+    *cols_ptr = cols;
+    *rowDelimiters_ptr = rowDelimiters;
+    *n = nElements;
+    *size = nRows;
+    return true;
+}
+
+template <typename floatType>
+void writeCachedMatrix(const char *filename, const floatType *val,
+                       const int *cols, const int *rowDelimiters,
+                       int nElements, int nRows)
+{
+    std::string cache = matrixCacheName(filename);
+    std::ofstream cfs(cache.c_str(), std::ios::binary | std::ios::trunc);
+
+    // the cache is an optimization only; ignore failures
+    if (!cfs) return;
+
+    int valSize = sizeof(floatType);
+
+    cfs.write(CSR_CACHE_MAGIC, sizeof(CSR_CACHE_MAGIC));
+    cfs.write((const char*)&valSize, sizeof(int));
+    cfs.write((const char*)&nRows, sizeof(int));
+    cfs.write((const char*)&nElements, sizeof(int));
+    cfs.write((const char*)rowDelimiters, (nRows + 1) * sizeof(int));
+    cfs.write((const char*)cols, nElements * sizeof(int));
+    cfs.write((const char*)val, nElements * sizeof(floatType));
+
+    if (!cfs)
+    {
+        cfs.close();
+        remove(cache.c_str());
+    }
+}
+
 // ****************************************************************************
 // Function: readMatrix
 //
@@ -58,6 +240,12 @@ void convertToPadded(floatType *A, int *cols, int dim, int *rowDelimiters,
 //   Reads a sparse matrix from a file of Matrix Market format 
 //   Returns the data structures for the CSR format
 //
+//   The file is read into memory at once and split into chunks at line
+//   boundaries, which are parsed in parallel (when compiled with OpenMP).
+//   Entries are bucketed by row with a counting sort, and each row is then
+//   sorted by column. The resulting CSR arrays are saved to a binary
+//   sidecar file (filename + ".csr"), which is loaded directly on later runs.
+//
 // Arguments:
 //   filename: c string with the name of the file to be opened
 //   val_ptr: input - pointer to uninitialized pointer
@@ -87,35 +275,50 @@ template <typename floatType>
 void readMatrix(char *filename, floatType **val_ptr, int **cols_ptr, 
                 int **rowDelimiters_ptr, int *n, int *size) 
 {
-    std::string line;
+    if (readCachedMatrix(filename, val_ptr, cols_ptr, rowDelimiters_ptr,
+                         n, size))
+    {
+        return;
+    }
+
     char id[FIELD_LENGTH];
     char object[FIELD_LENGTH]; 
     char format[FIELD_LENGTH]; 
     char field[FIELD_LENGTH]; 
     char symmetry[FIELD_LENGTH]; 
 
-    std::ifstream mfs( filename );
+    std::ifstream mfs( filename, std::ios::binary );
     if( !mfs.good() )
     {
         std::cerr << "Error: unable to open matrix file " << filename << std::endl;
         exit( 1 );
     }
 
+    // read the whole file into memory
+    mfs.seekg(0, std::ios::end);
+    size_t fileSize = mfs.tellg();
+    mfs.seekg(0, std::ios::beg);
+
+    std::vector<char> text(fileSize + 1);
+    mfs.read(&text[0], fileSize);
+    text[fileSize] = 0;
+
+    const char *p   = &text[0];
+    const char *end = p + fileSize;
+
     int symmetric = 0; 
     int pattern = 0; 
 
     int nRows, nCols, nElements;  
 
-    struct Coordinate *coords;
-
     // read matrix header
-    if( getline( mfs, line ).eof() )
+    if( fileSize == 0 )
     {
         std::cerr << "Error: file " << filename << " does not store a matrix" << std::endl;
         exit( 1 );
     }
 
-    sscanf(line.c_str(), "%s %s %s %s %s", id, object, format, field, symmetry); 
+    sscanf(p, "%127s %127s %127s %127s %127s", id, object, format, field, symmetry); 
 
     if (strcmp(object, "matrix") != 0) 
     {
@@ -139,87 +342,132 @@ void readMatrix(char *filename, floatType **val_ptr, int **cols_ptr,
         symmetric = 1; 
     }
 
-    while (!getline( mfs, line ).eof() )
+    // skip the header and comments
+    while (p < end && *p == '%')
     {
-        if (line[0] != '%') 
-        {
-            break; 
-        }
-    } 
+        while (p < end && *p != '\n') p++;
+        if (p < end) p++;
+    }
 
     // read the matrix size and number of non-zero elements
-    sscanf(line.c_str(), "%d %d %d", &nRows, &nCols, &nElements); 
+    sscanf(p, "%d %d %d", &nRows, &nCols, &nElements); 
+    while (p < end && *p != '\n') p++;
+
+    // split the entries into chunks at line boundaries
+    int nChunks = 1;
+#ifdef _OPENMP
+    nChunks = omp_get_max_threads();
+#endif
+
+    std::vector<const char*> chunk(nChunks + 1);
+    chunk[0] = p;
+    chunk[nChunks] = end;
+    for (int c = 1; c < nChunks; c++)
+    {
+        const char *q = p + (end - p) * c / nChunks;
+        while (q < end && *q != '\n') q++;
+        chunk[c] = std::max(q, chunk[c-1]);
+    }
 
-    int valSize = nElements * sizeof(struct Coordinate);
-    if (symmetric) 
+    std::vector< std::vector<int> > rows(nChunks), cols(nChunks);
+    std::vector< std::vector<floatType> > vals(nChunks);
+    std::vector< std::vector<char> > mirror(nChunks);
+
+#pragma omp parallel for schedule(static,1)
+    for (int c = 0; c < nChunks; c++)
     {
-        valSize*=2; 
-    }                     
-    coords = new Coordinate[valSize]; 
+        size_t reserve = (size_t)nElements / nChunks * (symmetric ? 2 : 1);
+        rows[c].reserve(reserve);
+        cols[c].reserve(reserve);
+        vals[c].reserve(reserve);
 
-    int index = 0; 
-    while (!getline( mfs, line ).eof() )
+        parseMatrixChunk(chunk[c], chunk[c+1], pattern, symmetric,
+                         rows[c], cols[c], vals[c], mirror[c]);
+    }
+
+    if (pattern) 
     {
-        if (pattern) 
-        {
-            sscanf(line.c_str(), "%d %d", &coords[index].x, &coords[index].y); 
-            // assign a random value 
-            coords[index].val = ((floatType) MAX_RANDOM_VAL * 
-                                 (rand() / (RAND_MAX + 1.0)));
-        }
-        else 
+        // assign random values in file order, so that the result does
+        // not depend on the number of threads
+        for (int c = 0; c < nChunks; c++)
         {
-            // read the value from file
-            sscanf(line.c_str(), "%d %d %f", &coords[index].x, &coords[index].y, 
-                   &coords[index].val); 
+            for (size_t i = 0; i < vals[c].size(); i++)
+            {
+                if (mirror[c][i])
+                    vals[c][i] = vals[c][i-1];
+                else
+                    vals[c][i] = ((floatType) MAX_RANDOM_VAL * 
+                                  (rand() / (RAND_MAX + 1.0)));
+            }
         }
+    }
 
-        // convert into index-0-as-start representation
-        coords[index].x--;
-        coords[index].y--;    
-        index++; 
+    // bucket the elements by row
+    int *rowDelimiters = new int[nRows+1]; 
+    std::fill(rowDelimiters, rowDelimiters + nRows + 1, 0);
 
-        // add the mirror element if not on main diagonal
-        if (symmetric && coords[index-1].x != coords[index-1].y) 
+    nElements = 0;
+    for (int c = 0; c < nChunks; c++)
+    {
+        nElements += rows[c].size();
+        for (size_t i = 0; i < rows[c].size(); i++)
+            rowDelimiters[rows[c][i] + 1]++;
+    }
+
+    for (int r = 0; r < nRows; r++)
+        rowDelimiters[r+1] += rowDelimiters[r];
+
+    floatType *val = new floatType[nElements]; 
+    int *colIdx = new int[nElements];
+
+    std::vector<int> pos(rowDelimiters, rowDelimiters + nRows);
+    for (int c = 0; c < nChunks; c++)
+    {
+        for (size_t i = 0; i < rows[c].size(); i++)
         {
-            coords[index].x = coords[index-1].y; 
-            coords[index].y = coords[index-1].x; 
-            coords[index].val = coords[index-1].val; 
-            index++;
+            int k = pos[rows[c][i]]++;
+            colIdx[k] = cols[c][i];
+            val[k] = vals[c][i];
         }
-    }  
 
-    nElements = index; 
-    // sort the elements
-    qsort(coords, nElements, sizeof(struct Coordinate), coordcmp); 
+        std::vector<int>().swap(rows[c]);
+        std::vector<int>().swap(cols[c]);
+        std::vector<floatType>().swap(vals[c]);
+    }
 
-    // create CSR data structures
-    *n = nElements; 
-    *size = nRows; 
-    *val_ptr = new floatType[nElements]; 
-    *cols_ptr = new int[nElements];
-    *rowDelimiters_ptr = new int[nRows+1]; 
-
-    floatType *val = *val_ptr; 
-    int *cols = *cols_ptr; 
-    int *rowDelimiters = *rowDelimiters_ptr; 
-
-    rowDelimiters[0] = 0; 
-    rowDelimiters[nRows] = nElements; 
-    int r=0; 
-    for (int i=0; i<nElements; i++) 
+    // sort each row by column
+#pragma omp parallel
     {
-        while (coords[i].x != r) 
+        std::vector< std::pair<int, floatType> > row;
+
+#pragma omp for schedule(dynamic,1024)
+        for (int r = 0; r < nRows; r++)
         {
-            rowDelimiters[++r] = i; 
+            int beg = rowDelimiters[r];
+            int len = rowDelimiters[r+1] - beg;
+
+            row.resize(len);
+            for (int j = 0; j < len; j++)
+                row[j] = std::make_pair(colIdx[beg+j], val[beg+j]);
+
+            std::sort(row.begin(), row.end(), colcmp<floatType>);
+
+            for (int j = 0; j < len; j++)
+            {
+                colIdx[beg+j] = row[j].first;
+                val[beg+j] = row[j].second;
+            }
         }
-        val[i] = coords[i].val; 
-        cols[i] = coords[i].y;    
     }
 
-    r = 0; 
+    writeCachedMatrix(filename, val, colIdx, rowDelimiters, nElements, nRows);
 
-    delete[] coords;
+    // create CSR data structures
+    *n = nElements; 
+    *size = nRows; 
+    *val_ptr = val; 
+    *cols_ptr = colIdx;
+    *rowDelimiters_ptr = rowDelimiters; 
 }
 
 // ****************************************************************************
@@ -498,6 +746,13 @@ inline int intcmp(const void *v1, const void *v2)
 }
 
 
+template <typename floatType>
+inline bool colcmp(const std::pair<int, floatType> &a,
+                   const std::pair<int, floatType> &b)
+{
+    return a.first < b.first;
+}
+
 inline int coordcmp(const void *v1, const void *v2)
 {
     struct Coordinate *c1 = (struct Coordinate *) v1;
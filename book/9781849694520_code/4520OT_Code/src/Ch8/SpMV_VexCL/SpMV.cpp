@@ -18,41 +18,35 @@ void gpuConjugateGradient(const std::vector<size_t> &row,
                         vex::Filter::DoublePrecision);
 
     size_t n = x.size();
-    vex::SpMat<real> A(oclCtx, n, n, row.data(), col.data(), val.data());
-    vex::vector<real> f(oclCtx, rhs);
-    vex::vector<real> u(oclCtx, x);
-    vex::vector<real> r(oclCtx, n);
-    vex::vector<real> p(oclCtx, n);
-    vex::vector<real> q(oclCtx, n);
-
-    vex::Reductor<real,vex::MAX> max(oclCtx);
-    vex::Reductor<real,vex::SUM> sum(oclCtx);
 
     /*
-     Solve the equation Au = f with the "conjugate gradient" method
-     See http://en.wikipedia.org/wiki/Conjugate_gradient_method
-     */  
-    real rho1, rho2;
-    r = f - A * u;
-    
-    for(uint iter = 0; max(fabs(r)) > 1e-8 && iter < n; iter++) {
-        rho1 = sum(r * r);
-        if(iter == 0 ) {
-          p = r;
-        } else { 
-          real beta = rho1 / rho2;
-          p = r + beta * p;
-        }
-
-        q = A * p;
+     The accurate matrix is used for the residual of the outer iterations,
+     the inner CG iterations use a copy with values stored in single
+     precision, which halves the traffic on matrix values.
+     */
+    vex::SpMat<real> A(oclCtx, n, n, row.data(), col.data(), val.data());
+    vex::SpMat<real, size_t, size_t, float> A_lo(oclCtx, n, n, row.data(), col.data(), val.data());
 
-        real alpha = rho1 / sum(p * q);
+    /*
+     Unpreconditioned CG needs close to n iterations on ill-conditioned
+     systems; one V-cycle of algebraic multigrid per iteration cuts that
+     to a few dozen
+     */
+    vex::precond::amg<real> M(oclCtx, n, row.data(), col.data(), val.data());
 
-        u += alpha * p;
-        r -= alpha * q;
+    vex::vector<real> f(oclCtx, rhs);
+    vex::vector<real> u(oclCtx, x);
 
-        rho2 = rho1;
-    }
+    /*
+     Mixed precision iterative refinement: each outer iteration solves the
+     residual equation with loose tolerance using the cheap matrix and the
+     conjugate gradient solver from vexcl/krylov.hpp
+     */
+    vex::refine(A, f, u,
+            [&](const vex::vector<real> &r, vex::vector<real> &e) {
+                vex::cg(A_lo, M, r, e, vex::krylov_params(1e-4, n));
+            },
+            static_cast<real>(1e-8));
 
     using namespace vex;
     vex::copy(u, x);
@@ -0,0 +1,104 @@
+#include <vexcl/vexcl.hpp>
+#include <boost/chrono.hpp>
+#include <iostream>
+#include <vector>
+#include <cstdlib>
+
+typedef double real;
+
+/*
+ Generates random n x n matrix with row widths drawn from a power-law
+ distribution, so that most rows are short and a few are very long.
+ */
+void randomMatrix(size_t n, size_t max_width,
+                  std::vector<size_t> &row,
+                  std::vector<size_t> &col,
+                  std::vector<real> &val) {
+    row.assign(1, 0);
+    col.clear();
+    val.clear();
+
+    for(size_t i = 0; i < n; i++) {
+        double u = (rand() + 1.0) / (RAND_MAX + 1.0);
+        size_t w = std::min<size_t>(max_width, 1 + static_cast<size_t>(4 / (u * u)));
+
+        for(size_t j = 0; j < w; j++) {
+            col.push_back(rand() % n);
+            val.push_back(rand() / (RAND_MAX + 1.0));
+        }
+
+        row.push_back(col.size());
+    }
+}
+
+void finish(const vex::Context &ctx) {
+    for(uint d = 0; d < ctx.size(); d++)
+        ctx.queue(d).finish();
+}
+
+/*
+ Average time of a single matrix-vector product in milliseconds.
+ */
+double benchmark(const vex::Context &ctx,
+                 const std::vector<size_t> &row,
+                 const std::vector<size_t> &col,
+                 const std::vector<real> &val,
+                 vex::csr_kernel::type method) {
+    const int runs = 100;
+    size_t n = row.size() - 1;
+
+    vex::SpMat<real> A(ctx, n, n, row.data(), col.data(), val.data(), method);
+    vex::vector<real> x(ctx, n);
+    vex::vector<real> y(ctx, n);
+
+    x = 1;
+
+    // Warm up.
+    y = A * x;
+    finish(ctx);
+
+    boost::chrono::high_resolution_clock::time_point start =
+        boost::chrono::high_resolution_clock::now();
+
+    for(int i = 0; i < runs; i++) y = A * x;
+    finish(ctx);
+
+    boost::chrono::duration<double> time =
+        boost::chrono::high_resolution_clock::now() - start;
+
+    return 1e3 * time.count() / runs;
+}
+
+int main(int argc, char** argv) {
+    size_t n = argc > 1 ? atoi(argv[1]) : 1 << 20;
+
+    vex::Context ctx(vex::Filter::Type(CL_DEVICE_TYPE_GPU) &&
+                     vex::Filter::DoublePrecision);
+
+    if (!ctx) {
+        std::cerr << "No GPUs found" << std::endl;
+        return 1;
+    }
+
+    std::cout << ctx << std::endl;
+
+    std::vector<size_t> row, col;
+    std::vector<real> val;
+
+    // The widest setting has a few rows with tens of thousands of nonzeros,
+    // as in web graphs.
+    const size_t widths[] = {4, 64, 1024, 1 << 16};
+
+    for(int w = 0; w < 4; w++) {
+        randomMatrix(n, widths[w], row, col, val);
+
+        std::cout << "n = " << n << ", max width = " << widths[w]
+                  << ", average width = " << (double)col.size() / n << std::endl;
+
+        std::cout << "  scalar:    " << benchmark(ctx, row, col, val, vex::csr_kernel::scalar)    << " ms" << std::endl;
+        std::cout << "  vector:    " << benchmark(ctx, row, col, val, vex::csr_kernel::vector)    << " ms" << std::endl;
+        std::cout << "  adaptive:  " << benchmark(ctx, row, col, val, vex::csr_kernel::adaptive)  << " ms" << std::endl;
+        std::cout << "  merge:     " << benchmark(ctx, row, col, val, vex::csr_kernel::merge)     << " ms" << std::endl;
+        std::cout << "  automatic: " << benchmark(ctx, row, col, val, vex::csr_kernel::automatic) << " ms" << std::endl;
+    }
+}
@@ -0,0 +1,175 @@
+#include <vexcl/vexcl.hpp>
+#include <boost/chrono.hpp>
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+typedef double real;
+
+/*
+ Lower triangle of the five-point Laplacian on a k x k grid: each row
+ depends on its west and south neighbours, so the levels are the 2k - 1
+ anti-diagonals of the grid.
+ */
+void gridMatrix(size_t k,
+                std::vector<size_t> &row,
+                std::vector<size_t> &col,
+                std::vector<real> &val) {
+    row.assign(1, 0);
+    col.clear();
+    val.clear();
+
+    for(size_t j = 0; j < k; j++) {
+        for(size_t i = 0; i < k; i++) {
+            size_t idx = j * k + i;
+
+            if (j > 0) {
+                col.push_back(idx - k);
+                val.push_back(-1);
+            }
+
+            if (i > 0) {
+                col.push_back(idx - 1);
+                val.push_back(-1);
+            }
+
+            col.push_back(idx);
+            val.push_back(4);
+
+            row.push_back(col.size());
+        }
+    }
+}
+
+/*
+ Lower triangular n x n matrix with up to 8 nonzeros per row in random
+ earlier columns and a dominant diagonal; the dependency chains are short.
+ */
+void randomMatrix(size_t n,
+                  std::vector<size_t> &row,
+                  std::vector<size_t> &col,
+                  std::vector<real> &val) {
+    row.assign(1, 0);
+    col.clear();
+    val.clear();
+
+    for(size_t i = 0; i < n; i++) {
+        size_t w = i ? rand() % 8 : 0;
+
+        std::vector<size_t> c;
+        for(size_t j = 0; j < w; j++) c.push_back(rand() % i);
+
+        std::sort(c.begin(), c.end());
+        c.erase(std::unique(c.begin(), c.end()), c.end());
+
+        for(size_t j = 0; j < c.size(); j++) {
+            col.push_back(c[j]);
+            val.push_back(-rand() / (RAND_MAX + 1.0));
+        }
+
+        col.push_back(i);
+        val.push_back(8);
+
+        row.push_back(col.size());
+    }
+}
+
+/*
+ Forward substitution on the host.
+ */
+void hostSolve(const std::vector<size_t> &row,
+               const std::vector<size_t> &col,
+               const std::vector<real> &val,
+               const std::vector<real> &b,
+               std::vector<real> &x) {
+    size_t n = row.size() - 1;
+
+    for(size_t i = 0; i < n; i++) {
+        real s = b[i], d = 1;
+
+        for(size_t j = row[i]; j < row[i + 1]; j++) {
+            if (col[j] == i) d = val[j];
+            else s -= val[j] * x[col[j]];
+        }
+
+        x[i] = s / d;
+    }
+}
+
+void finish(const vex::Context &ctx) {
+    for(uint d = 0; d < ctx.size(); d++)
+        ctx.queue(d).finish();
+}
+
+void benchmark(const vex::Context &ctx,
+               const std::vector<size_t> &row,
+               const std::vector<size_t> &col,
+               const std::vector<real> &val) {
+    const int runs = 20;
+    size_t n = row.size() - 1;
+
+    typedef boost::chrono::high_resolution_clock clock;
+
+    std::vector<real> b(n, 1), hx(n);
+
+    clock::time_point start = clock::now();
+    for(int i = 0; i < runs; i++) hostSolve(row, col, val, b, hx);
+    boost::chrono::duration<double> host = clock::now() - start;
+
+    start = clock::now();
+    vex::triangular_solver<real> L(ctx, n, row.data(), col.data(), val.data());
+    finish(ctx);
+    boost::chrono::duration<double> setup = clock::now() - start;
+
+    vex::vector<real> x(ctx, n);
+    vex::vector<real> f(ctx, b);
+
+    // Warm up.
+    L(f, x);
+    finish(ctx);
+
+    start = clock::now();
+    for(int i = 0; i < runs; i++) L(f, x);
+    finish(ctx);
+    boost::chrono::duration<double> device = clock::now() - start;
+
+    std::vector<real> dx(n);
+    vex::copy(x, dx);
+
+    real err = 0;
+    for(size_t i = 0; i < n; i++) err = std::max(err, std::fabs(dx[i] - hx[i]));
+
+    std::cout << "  levels: " << L.levels(0)
+              << ", analysis: " << 1e3 * setup.count() << " ms" << std::endl
+              << "  host:     " << 1e3 * host.count() / runs << " ms" << std::endl
+              << "  device:   " << 1e3 * device.count() / runs << " ms"
+              << " (max error " << err << ")" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    size_t k = argc > 1 ? atoi(argv[1]) : 1024;
+
+    // The triangular solve is exact on a single device only.
+    vex::Context ctx(vex::Filter::Type(CL_DEVICE_TYPE_GPU) &&
+                     vex::Filter::DoublePrecision && vex::Filter::Count(1));
+
+    if (!ctx) {
+        std::cerr << "No GPUs found" << std::endl;
+        return 1;
+    }
+
+    std::cout << ctx << std::endl;
+
+    std::vector<size_t> row, col;
+    std::vector<real> val;
+
+    gridMatrix(k, row, col, val);
+    std::cout << "Grid " << k << " x " << k << ", lower triangle:" << std::endl;
+    benchmark(ctx, row, col, val);
+
+    randomMatrix(k * k, row, col, val);
+    std::cout << "Random lower triangular, n = " << k * k << ":" << std::endl;
+    benchmark(ctx, row, col, val);
+}
@@ -0,0 +1,109 @@
+#include <vexcl/vexcl.hpp>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <cstring>
+
+/*
+ Offline generator of the kernel library. Records the kernels, which does
+ not require any OpenCL devices, and saves them as <dir>/<name>.vexkrn.
+ With --build the kernels are also compiled for every available device, so
+ that VEXCL_CACHE_DIR is populated with the binaries.
+
+ Usage: kernel_gen <dir> [--build]
+ */
+
+template <class state_type>
+void sys_func(const state_type &x, state_type &dx, double dt) {
+    dx = dt * sin(x);
+}
+
+template <class state_type, class SysFunction>
+void runge_kutta_4(SysFunction sys, state_type &x, double dt) {
+    state_type xtmp, k1, k2, k3, k4;
+
+    sys(x, k1, dt);
+
+    xtmp = x + 0.5 * k1;
+    sys(xtmp, k2, dt);
+
+    xtmp = x + 0.5 * k2;
+    sys(xtmp, k3, dt);
+
+    xtmp = x + k3;
+    sys(xtmp, k4, dt);
+
+    x += (k1 + 2 * k2 + 2 * k3 + k4) / 6;
+}
+
+vex::generator::kernel_source rk4_stepper() {
+    typedef vex::generator::symbolic<double> sym_state;
+
+    std::ostringstream body;
+    vex::generator::set_recorder(body);
+
+    sym_state sym_x(sym_state::VectorParameter);
+
+    runge_kutta_4(sys_func<sym_state>, sym_x, 0.01);
+
+    return vex::generator::build_source("rk4_stepper", body.str(), sym_x);
+}
+
+vex::generator::kernel_source axpby() {
+    typedef vex::generator::symbolic<double> sym_t;
+
+    std::ostringstream body;
+    vex::generator::set_recorder(body);
+
+    sym_t y(sym_t::VectorParameter);
+    sym_t x(sym_t::VectorParameter, sym_t::Const);
+    sym_t a(sym_t::ScalarParameter);
+    sym_t b(sym_t::ScalarParameter);
+
+    y = a * x + b * y;
+
+    return vex::generator::build_source("axpby", body.str(), y, x, a, b);
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <dir> [--build]" << std::endl;
+        return 1;
+    }
+
+    std::string dir   = argv[1];
+    bool        build = argc > 2 && !strcmp(argv[2], "--build");
+
+    std::vector<vex::generator::kernel_source> library;
+    library.push_back(rk4_stepper());
+    library.push_back(axpby());
+
+    try {
+        for(auto k = library.begin(); k != library.end(); k++) {
+            std::string fname = dir + "/" + k->name() + ".vexkrn";
+            k->save(fname);
+            std::cout << fname << std::endl;
+        }
+
+        if (build) {
+            vex::Context ctx(vex::Filter::DoublePrecision);
+
+            if (!ctx) {
+                std::cerr << "No devices found" << std::endl;
+                return 1;
+            }
+
+            std::cout << ctx << std::endl;
+
+            for(uint d = 0; d < ctx.size(); d++)
+                for(auto k = library.begin(); k != library.end(); k++)
+                    vex::build_sources(ctx.context(d), k->source());
+        }
+    } catch(const cl::Error &e) {
+        std::cerr << e << std::endl;
+        return 1;
+    } catch(const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -1,11 +1,21 @@
 /*
  * Inspired from http://www.iti.fh-flensburg.de/lang/algorithmen/sortieren/bitonic/bitonicen.htm 
+ *
+ * Without options the scalar network below sorts a small array. With -n the
+ * SIMD and multithreaded engine of cpusort.c sorts 2^n random keys instead
+ * (-t sets the number of threads, 0 for all processors); see sort_bench.cpp
+ * for its comparison with std::sort and the GPU sort.
  */
+#define _POSIX_C_SOURCE 200112L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <math.h>
+#include <time.h>
+
+#include "cpusort.h"
 
 extern char* optarg;
 
@@ -16,6 +26,7 @@ void sort(void);
 void compare(int i, int j, int dir);
 void bitonicMerge(int lo, int cnt, int dir);
 void bitonicSort(int lo, int cnt, int dir);
+void sortLarge(unsigned int log2Length, unsigned int threads);
 
 
 /* Globals: */
@@ -24,20 +35,70 @@ static int numiters = -1;
 int main(int argc, char **argv)
 {
   int option;
+  int log2Length = -1;
+  unsigned int threads = 0;
 
-  while ((option = getopt(argc, argv, "i:")) != -1)
+  while ((option = getopt(argc, argv, "i:n:t:")) != -1)
   {
     switch(option)
     {
     case 'i':
       numiters = atoi(optarg);
+      break;
+    case 'n':
+      log2Length = atoi(optarg);
+      break;
+    case 't':
+      threads = atoi(optarg);
+      break;
     }
   }
 
-  begin();
+  if (log2Length >= 0)
+    sortLarge(log2Length, threads);
+  else
+    begin();
   return 0;
 }
 
+/** Sorts 2^log2Length random keys with cpuSort and checks the result **/
+void sortLarge(unsigned int log2Length, unsigned int threads)
+{
+  unsigned int length = 1u << log2Length;
+  int* data = (int*)malloc(length * sizeof(int));
+  unsigned int i;
+  struct timespec start, end;
+
+  if (!data) {
+    perror("Unable to allocate the keys");
+    exit(1);
+  }
+
+  srand(42);
+  for (i = 0; i < length; i++)
+    data[i] = rand() % 255;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (cpuSort(data, length, threads) != 0) {
+    perror("Unable to allocate the merge buffer");
+    exit(1);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  unsigned long elapsed = (end.tv_sec - start.tv_sec) * 1000000000ul + end.tv_nsec - start.tv_nsec;
+  printf("Execution of the CPU sort (%u keys per register) took %lu.%09lu s\n",
+         cpuSortVectorWidth(), elapsed / 1000000000, elapsed % 1000000000);
+
+  for (i = 1; i < length; i++) {
+    if (data[i - 1] > data[i]) {
+      printf("CPU sort failed at %u\n", i);
+      break;
+    }
+  }
+
+  free(data);
+}
+
 #define N 32
 int a[N];         // the array to be sorted
 const int ASCENDING = 1;
@@ -0,0 +1,348 @@
+/*
+ SIMD and multithreaded bitonic/merge sort of integers.
+
+ 1. Each vector register of VW keys is sorted in place by the bitonic
+    sorting network of BitonicSort.c: every step exchanges lanes i and
+    i ^ j with a permute and keeps the minimum or the maximum per lane.
+ 2. Sorted runs are merged two registers at a time: the second register is
+    reversed, the lane-wise minimum and maximum of the pair are each a
+    bitonic sequence, and log2(VW) half-cleaner steps sort them. The lower
+    register is stored and the next register is taken from the run with the
+    smaller head (Inoue et al., 2007).
+ 3. Each thread sorts its chunk this way; chunks are then merged pairwise,
+    and every merge is split between all threads by merge path, so that each
+    thread writes an equal share of the output.
+*/
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "cpusort.h"
+
+#if defined(__AVX512F__)
+#include <immintrin.h>
+#define VW     16
+#define LOG_VW 4
+typedef __m512i   vec_t;
+typedef __mmask16 mask_t;
+#define vload(p)         _mm512_loadu_si512((const void*)(p))
+#define vstore(p, v)     _mm512_storeu_si512((void*)(p), (v))
+#define vmin(a, b)       _mm512_min_epi32((a), (b))
+#define vmax(a, b)       _mm512_max_epi32((a), (b))
+#define vperm(v, idx)    _mm512_permutexvar_epi32((idx), (v))
+#define vselect(m, a, b) _mm512_mask_blend_epi32((m), (a), (b))
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#define VW     8
+#define LOG_VW 3
+typedef __m256i vec_t;
+typedef __m256i mask_t;
+#define vload(p)         _mm256_loadu_si256((const __m256i*)(p))
+#define vstore(p, v)     _mm256_storeu_si256((__m256i*)(p), (v))
+#define vmin(a, b)       _mm256_min_epi32((a), (b))
+#define vmax(a, b)       _mm256_max_epi32((a), (b))
+#define vperm(v, idx)    _mm256_permutevar8x32_epi32((v), (idx))
+#define vselect(m, a, b) _mm256_blendv_epi8((a), (b), (m))
+#else
+#define VW 1
+#endif
+
+/* Chunks are not made smaller than this many keys per thread */
+#define MIN_CHUNK 4096
+
+#if VW > 1
+#define SORT_STEPS (LOG_VW * (LOG_VW + 1) / 2)
+
+/* A compare-exchange step of the network: lanes take the minimum or the
+   maximum (where takeMax is set) of themselves and lane idx */
+typedef struct {
+    vec_t  idx;
+    mask_t takeMax;
+} step_t;
+
+static step_t sortSteps[SORT_STEPS];
+static step_t mergeSteps[LOG_VW];
+static vec_t  reverseIdx;
+static pthread_once_t tablesOnce = PTHREAD_ONCE_INIT;
+
+static void setStep(step_t* step, const int* partner, const int* takeMax) {
+    step->idx = vload(partner);
+#if VW == 16
+    step->takeMax = 0;
+    for(int i = 0; i < VW; ++i)
+        if(takeMax[i]) step->takeMax |= (mask_t)(1u << i);
+#else
+    step->takeMax = vload(takeMax);
+#endif
+}
+
+static void initTables(void) {
+    int partner[VW], takeMax[VW];
+
+    /* Bitonic sort: lane i is in the ascending half of block k when
+       (i & k) == 0, and is the lower lane of its pair when (i & j) == 0 */
+    int s = 0;
+    for(int k = 2; k <= VW; k <<= 1) {
+        for(int j = k >> 1; j > 0; j >>= 1, ++s) {
+            for(int i = 0; i < VW; ++i) {
+                partner[i] = i ^ j;
+                takeMax[i] = (((i & j) == 0) != ((i & k) == 0)) ? -1 : 0;
+            }
+            setStep(&sortSteps[s], partner, takeMax);
+        }
+    }
+
+    /* Ascending bitonic merge */
+    s = 0;
+    for(int j = VW >> 1; j > 0; j >>= 1, ++s) {
+        for(int i = 0; i < VW; ++i) {
+            partner[i] = i ^ j;
+            takeMax[i] = (i & j) ? -1 : 0;
+        }
+        setStep(&mergeSteps[s], partner, takeMax);
+    }
+
+    for(int i = 0; i < VW; ++i) partner[i] = VW - 1 - i;
+    reverseIdx = vload(partner);
+}
+
+static inline vec_t exchange(vec_t v, const step_t* step) {
+    vec_t p = vperm(v, step->idx);
+    return vselect(step->takeMax, vmin(v, p), vmax(v, p));
+}
+
+static inline vec_t sortVector(vec_t v) {
+    for(int s = 0; s < SORT_STEPS; ++s) v = exchange(v, &sortSteps[s]);
+    return v;
+}
+
+static inline vec_t mergeBitonic(vec_t v) {
+    for(int s = 0; s < LOG_VW; ++s) v = exchange(v, &mergeSteps[s]);
+    return v;
+}
+
+/* Merges sorted registers: a receives the lower, b the upper half */
+static inline void mergeVectors(vec_t* a, vec_t* b) {
+    vec_t r  = vperm(*b, reverseIdx);
+    vec_t lo = vmin(*a, r);
+    vec_t hi = vmax(*a, r);
+    *a = mergeBitonic(lo);
+    *b = mergeBitonic(hi);
+}
+#endif
+
+static void mergeScalar(const int* a, size_t na, const int* b, size_t nb, int* out) {
+    size_t i = 0, j = 0;
+    while(i < na && j < nb) *out++ = (b[j] < a[i]) ? b[j++] : a[i++];
+    memcpy(out, a + i, (na - i) * sizeof(int));
+    memcpy(out + (na - i), b + j, (nb - j) * sizeof(int));
+}
+
+/* Merges the sorted arrays a and b into out */
+static void mergeRuns(const int* a, size_t na, const int* b, size_t nb, int* out) {
+#if VW > 1
+    if(na >= VW && nb >= VW) {
+        vec_t lo = vload(a), hi = vload(b);
+        size_t i = VW, j = VW;
+
+        mergeVectors(&lo, &hi);
+        vstore(out, lo);
+        out += VW;
+
+        while(i + VW <= na && j + VW <= nb) {
+            if(a[i] <= b[j]) {
+                lo = vload(a + i);
+                i += VW;
+            } else {
+                lo = vload(b + j);
+                j += VW;
+            }
+            mergeVectors(&lo, &hi);
+            vstore(out, lo);
+            out += VW;
+        }
+
+        /* hi holds VW keys not smaller than anything stored so far; merge
+           it with the tails */
+        int rest[VW], tmp[2 * VW];
+        vstore(rest, hi);
+
+        if(i + VW > na) {
+            mergeScalar(rest, VW, a + i, na - i, tmp);
+            mergeScalar(tmp, VW + na - i, b + j, nb - j, out);
+        } else {
+            mergeScalar(rest, VW, b + j, nb - j, tmp);
+            mergeScalar(tmp, VW + nb - j, a + i, na - i, out);
+        }
+        return;
+    }
+#endif
+    mergeScalar(a, na, b, nb, out);
+}
+
+/* Number of keys of a among the first k keys of the merge of a and b */
+static size_t coRank(size_t k, const int* a, size_t na, const int* b, size_t nb) {
+    size_t lo = k > nb ? k - nb : 0;
+    size_t hi = k < na ? k : na;
+
+    while(lo < hi) {
+        size_t i = lo + (hi - lo) / 2;
+        if(a[i] <= b[k - i - 1]) lo = i + 1;
+        else hi = i;
+    }
+    return lo;
+}
+
+/* Sorts n keys in data, using aux as the merge buffer */
+static void sortChunk(int* data, int* aux, size_t n) {
+#if VW > 1
+    size_t i = 0;
+    for(; i + VW <= n; i += VW)
+        vstore(data + i, sortVector(vload(data + i)));
+
+    /* Insertion sort of the tail */
+    for(size_t k = i + 1; k < n; ++k) {
+        int v = data[k];
+        size_t m = k;
+        for(; m > i && data[m - 1] > v; --m) data[m] = data[m - 1];
+        data[m] = v;
+    }
+#endif
+
+    int* src = data;
+    int* dst = aux;
+    for(size_t width = VW; width < n; width <<= 1) {
+        for(size_t m = 0; m < n; m += 2 * width) {
+            size_t na = width < n - m ? width : n - m;
+            size_t nb = n - m - na < width ? n - m - na : width;
+            mergeRuns(src + m, na, src + m + na, nb, dst + m);
+        }
+        int* t = src; src = dst; dst = t;
+    }
+
+    if(src != data) memcpy(data, src, n * sizeof(int));
+}
+
+typedef struct {
+    int*   src;
+    int*   dst;
+    size_t n;
+    size_t width;  /* length of the sorted runs in src */
+    size_t begin;  /* range of the output written by the thread */
+    size_t end;
+} task_t;
+
+static void* sortWorker(void* arg) {
+    task_t* t = (task_t*)arg;
+    if(t->end > t->begin)
+        sortChunk(t->src + t->begin, t->dst + t->begin, t->end - t->begin);
+    return NULL;
+}
+
+/* Writes [begin, end) of the output of the pairwise merges of runs */
+static void* mergeWorker(void* arg) {
+    task_t* t = (task_t*)arg;
+    size_t w = t->width;
+
+    for(size_t m = t->begin / (2 * w) * (2 * w); m < t->end; m += 2 * w) {
+        size_t na = w < t->n - m ? w : t->n - m;
+        size_t nb = t->n - m - na < w ? t->n - m - na : w;
+
+        const int* a = t->src + m;
+        const int* b = a + na;
+
+        size_t lo = (t->begin > m ? t->begin : m) - m;
+        size_t hi = (t->end < m + na + nb ? t->end : m + na + nb) - m;
+
+        size_t ia = coRank(lo, a, na, b, nb);
+        size_t ib = coRank(hi, a, na, b, nb);
+
+        mergeRuns(a + ia, ib - ia, b + (lo - ia), (hi - ib) - (lo - ia), t->dst + m + lo);
+    }
+    return NULL;
+}
+
+/* Runs the tasks on their own threads, the last one on the calling thread */
+static void runTasks(void* (*worker)(void*), task_t* tasks, unsigned int count) {
+    pthread_t* ids = (pthread_t*)malloc(count * sizeof(pthread_t));
+    int* spawned = (int*)calloc(count, sizeof(int));
+
+    for(unsigned int t = 0; t + 1 < count; ++t)
+        spawned[t] = ids && spawned && pthread_create(&ids[t], NULL, worker, &tasks[t]) == 0;
+
+    for(unsigned int t = 0; t + 1 < count; ++t)
+        if(!spawned || !spawned[t]) worker(&tasks[t]);
+
+    worker(&tasks[count - 1]);
+
+    for(unsigned int t = 0; t + 1 < count; ++t)
+        if(spawned && spawned[t]) pthread_join(ids[t], NULL);
+
+    free(ids);
+    free(spawned);
+}
+
+unsigned int cpuSortVectorWidth(void) {
+    return VW;
+}
+
+int cpuSort(int* data, unsigned int length, unsigned int threads) {
+    size_t n = length;
+    if(n < 2) return 0;
+
+#if VW > 1
+    pthread_once(&tablesOnce, initTables);
+#endif
+
+    if(!threads) {
+        long p = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = p > 0 ? (unsigned int)p : 1;
+    }
+    if(threads > (n + MIN_CHUNK - 1) / MIN_CHUNK)
+        threads = (unsigned int)((n + MIN_CHUNK - 1) / MIN_CHUNK);
+
+    int* aux = (int*)malloc(n * sizeof(int));
+    task_t* tasks = (task_t*)malloc(threads * sizeof(task_t));
+    if(!aux || !tasks) {
+        free(aux);
+        free(tasks);
+        return -1;
+    }
+
+    /* Chunks start at multiples of the vector width */
+    size_t chunk = ((n + threads - 1) / threads + VW - 1) / VW * VW;
+
+    for(unsigned int t = 0; t < threads; ++t) {
+        tasks[t].src   = data;
+        tasks[t].dst   = aux;
+        tasks[t].n     = n;
+        tasks[t].width = 0;
+        tasks[t].begin = t * chunk < n ? t * chunk : n;
+        tasks[t].end   = (t + 1) * chunk < n ? (t + 1) * chunk : n;
+    }
+    runTasks(sortWorker, tasks, threads);
+
+    int* src = data;
+    int* dst = aux;
+    for(size_t width = chunk; width < n; width <<= 1) {
+        for(unsigned int t = 0; t < threads; ++t) {
+            tasks[t].src   = src;
+            tasks[t].dst   = dst;
+            tasks[t].width = width;
+            tasks[t].begin = n * t / threads;
+            tasks[t].end   = n * (t + 1) / threads;
+        }
+        runTasks(mergeWorker, tasks, threads);
+
+        int* tmp = src; src = dst; dst = tmp;
+    }
+
+    if(src != data) memcpy(data, src, n * sizeof(int));
+
+    free(tasks);
+    free(aux);
+    return 0;
+}
@@ -0,0 +1,25 @@
+#ifndef CPUSORT_H
+#define CPUSORT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ Sorts length integers in ascending order on the CPU. Every vector
+ register of 16 (AVX-512) or 8 (AVX2) keys is sorted by a bitonic network,
+ sorted runs are merged with a bitonic merge network two registers at a
+ time, and the last merges are split between the threads by merge path.
+ threads = 0 uses all online processors.
+ Returns 0, or -1 if the merge buffer could not be allocated.
+*/
+int cpuSort(int* data, unsigned int length, unsigned int threads);
+
+/* Keys per vector register: 16 with AVX-512, 8 with AVX2, 1 without SIMD */
+unsigned int cpuSortVectorWidth(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
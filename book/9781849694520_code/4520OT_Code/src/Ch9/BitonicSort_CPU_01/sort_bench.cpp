@@ -0,0 +1,222 @@
+/*
+ Compares cpuSort (cpusort.c) on one and on all cores with std::sort and,
+ when built with OpenCL, with the hybrid bitonic/merge-path sort of
+ BitonicSort_GPU on the first GPU found.
+
+ Usage: sort_bench [log2 of the number of keys, 24 by default]
+*/
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#ifdef HAVE_OPENCL
+#ifdef __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/cl.h>
+#endif
+#endif
+
+#include "cpusort.h"
+
+typedef std::chrono::high_resolution_clock clock_type;
+
+const int runs = 3;
+
+/*
+ Prints the best time of a sort of n keys and its throughput
+ */
+void report(const std::string &name, size_t n, double seconds) {
+    std::cout << "  " << std::setw(28) << std::left << name
+              << std::setw(10) << std::right << std::fixed << std::setprecision(4)
+              << seconds << " s"
+              << std::setw(10) << std::setprecision(1)
+              << n / seconds * 1e-6 << " Mkeys/s" << std::endl;
+}
+
+/*
+ Best time of sort(copy of keys) over the runs; the result is checked
+ against the reference
+ */
+template <class F>
+double timeit(F sort, const std::vector<int> &keys, const std::vector<int> &sorted) {
+    double best = 1e30;
+
+    for(int r = 0; r < runs; ++r) {
+        std::vector<int> x = keys;
+
+        clock_type::time_point start = clock_type::now();
+        sort(x);
+        best = std::min(best, std::chrono::duration<double>(clock_type::now() - start).count());
+
+        if(x != sorted) {
+            std::cout << "  (result differs from std::sort)" << std::endl;
+            break;
+        }
+    }
+
+    return best;
+}
+
+#ifdef HAVE_OPENCL
+#define GROUP_SIZE      256              // must match BitonicSort.cl
+#define TILE            (GROUP_SIZE * 8)
+#define ITEMS_PER_MERGE 8
+
+/*
+ The hybrid sort of BitonicSort_GPU: one launch sorts the tiles in local
+ memory, merge-path passes then double the sorted runs. Timed on the host
+ from the first launch to the end of the last one; the transfers are not
+ included.
+ */
+struct gpu_sort {
+    cl_context       context;
+    cl_command_queue queue;
+    cl_program       program;
+    cl_kernel        tiles;
+    cl_kernel        merge;
+    bool             valid;
+
+    gpu_sort() : valid(false) {
+        cl_platform_id platform;
+        cl_device_id   device;
+        cl_uint        count = 0;
+        cl_int         error;
+
+        if(clGetPlatformIDs(1, &platform, &count) != CL_SUCCESS || !count) return;
+        if(clGetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 1, &device, NULL) != CL_SUCCESS) return;
+
+        FILE *file = fopen("BitonicSort.cl", "r");
+        if(!file) return;
+        std::string source;
+        for(int c; (c = fgetc(file)) != EOF; ) source += static_cast<char>(c);
+        fclose(file);
+
+        const char *src = source.c_str();
+        size_t size = source.size();
+
+        context = clCreateContext(NULL, 1, &device, NULL, NULL, &error);
+        queue   = clCreateCommandQueue(context, device, 0, &error);
+        program = clCreateProgramWithSource(context, 1, &src, &size, &error);
+
+        if(clBuildProgram(program, 1, &device, "", NULL, NULL) != CL_SUCCESS) return;
+
+        tiles = clCreateKernel(program, "bitonicSortTiles", &error);
+        merge = clCreateKernel(program, "mergePath", &error);
+        valid = true;
+    }
+
+    ~gpu_sort() {
+        if(!valid) return;
+        clReleaseKernel(tiles);
+        clReleaseKernel(merge);
+        clReleaseProgram(program);
+        clReleaseCommandQueue(queue);
+        clReleaseContext(context);
+    }
+
+    void operator()(std::vector<int> &x) {
+        cl_uint length = static_cast<cl_uint>(x.size());
+        cl_int  error;
+
+        cl_mem data = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                length * sizeof(cl_uint), x.data(), &error);
+        cl_mem temp = clCreateBuffer(context, CL_MEM_READ_WRITE,
+                length * sizeof(cl_uint), NULL, &error);
+        clFinish(queue);
+
+        clock_type::time_point start = clock_type::now();
+
+        size_t groups = (length + TILE - 1) / TILE;
+        size_t global = groups * GROUP_SIZE, local = GROUP_SIZE;
+
+        clSetKernelArg(tiles, 0, sizeof(cl_mem), &data);
+        clSetKernelArg(tiles, 1, sizeof(cl_uint), &length);
+        clSetKernelArg(tiles, 2, TILE * sizeof(cl_uint), NULL);
+        clEnqueueNDRangeKernel(queue, tiles, 1, NULL, &global, &local, 0, NULL, NULL);
+
+        size_t items = (length + ITEMS_PER_MERGE - 1) / ITEMS_PER_MERGE;
+        global = (items + GROUP_SIZE - 1) / GROUP_SIZE * GROUP_SIZE;
+
+        cl_mem src = data, dst = temp;
+        for(cl_uint run = TILE; run < length; run <<= 1) {
+            clSetKernelArg(merge, 0, sizeof(cl_mem), &src);
+            clSetKernelArg(merge, 1, sizeof(cl_mem), &dst);
+            clSetKernelArg(merge, 2, sizeof(cl_uint), &length);
+            clSetKernelArg(merge, 3, sizeof(cl_uint), &run);
+            clEnqueueNDRangeKernel(queue, merge, 1, NULL, &global, &local, 0, NULL, NULL);
+            std::swap(src, dst);
+        }
+        clFinish(queue);
+
+        elapsed = std::chrono::duration<double>(clock_type::now() - start).count();
+
+        clEnqueueReadBuffer(queue, src, CL_TRUE, 0, length * sizeof(cl_uint), x.data(), 0, NULL, NULL);
+
+        clReleaseMemObject(data);
+        clReleaseMemObject(temp);
+    }
+
+    double elapsed;
+};
+#endif
+
+int main(int argc, char *argv[]) {
+    unsigned int log2n = argc > 1 ? atoi(argv[1]) : 24;
+    size_t n = size_t(1) << log2n;
+
+#ifdef HAVE_OPENCL
+    gpu_sort gpu;
+#endif
+
+    // Keys are non-negative, so the unsigned GPU sort orders them the same.
+    const char *names[] = {"keys in [0, 255)", "keys in [0, 2^31)"};
+
+    for(int dist = 0; dist < 2; ++dist) {
+        std::vector<int> keys(n);
+        srand(42);
+        for(size_t i = 0; i < n; ++i)
+            keys[i] = dist ? ((rand() & 0x7fff) << 16 | (rand() & 0xffff)) & 0x7fffffff : rand() % 255;
+
+        std::vector<int> sorted = keys;
+        std::sort(sorted.begin(), sorted.end());
+
+        std::cout << n << " " << names[dist] << ", "
+                  << cpuSortVectorWidth() << " keys per register:" << std::endl;
+
+        report("std::sort", n, timeit([](std::vector<int> &x) {
+                    std::sort(x.begin(), x.end());
+                    }, keys, sorted));
+
+        report("cpuSort, 1 thread", n, timeit([](std::vector<int> &x) {
+                    cpuSort(x.data(), static_cast<unsigned int>(x.size()), 1);
+                    }, keys, sorted));
+
+        report("cpuSort, all threads", n, timeit([](std::vector<int> &x) {
+                    cpuSort(x.data(), static_cast<unsigned int>(x.size()), 0);
+                    }, keys, sorted));
+
+#ifdef HAVE_OPENCL
+        if(gpu.valid) {
+            double best = 1e30;
+            for(int r = 0; r < runs; ++r) {
+                std::vector<int> x = keys;
+                gpu(x);
+                best = std::min(best, gpu.elapsed);
+                if(x != sorted) {
+                    std::cout << "  (result differs from std::sort)" << std::endl;
+                    break;
+                }
+            }
+            report("GPU hybrid bitonic sort", n, best);
+        } else {
+            std::cout << "  (no GPU or BitonicSort.cl found)" << std::endl;
+        }
+#endif
+    }
+}
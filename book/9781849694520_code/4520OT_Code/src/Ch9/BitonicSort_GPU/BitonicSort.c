@@ -60,6 +60,142 @@ void fillRandom(int* data, unsigned int length, unsigned int seed) {
             iptr[i] = rand() % 255;
 }
 
+#ifdef USE_HYBRID_SORT
+#define TILE            (GROUP_SIZE * 8) // must match BitonicSort.cl
+#define ITEMS_PER_MERGE 8
+
+/* Runs the kernel to completion and returns its execution time in ns */
+cl_ulong runKernel(cl_command_queue queue,
+                   cl_kernel kernel,
+                   size_t* globalThreads,
+                   size_t* threadsPerGroup) {
+    cl_event exeEvt;
+    cl_ulong executionStart, executionEnd;
+    cl_int error = clEnqueueNDRangeKernel(queue,
+                                          kernel,
+                                          1,
+                                          NULL,
+                                          globalThreads,
+                                          threadsPerGroup,
+                                          0,
+                                          NULL,
+                                          &exeEvt);
+    if(error != CL_SUCCESS) {
+        printf("Kernel execution failure!\n");
+        exit(-22);
+    }
+    clWaitForEvents(1, &exeEvt);
+
+    clGetEventProfilingInfo(exeEvt, CL_PROFILING_COMMAND_START, sizeof(executionStart), &executionStart, NULL);
+    clGetEventProfilingInfo(exeEvt, CL_PROFILING_COMMAND_END, sizeof(executionEnd), &executionEnd, NULL);
+    clReleaseEvent(exeEvt);
+
+    return executionEnd - executionStart;
+}
+
+/*
+ Sorts the buffer in ascending order. A single launch sorts TILE-element
+ tiles in local memory; each following merge-path pass doubles the length
+ of the sorted runs, ping-ponging between the buffer and a temporary one.
+ That is 1 + log2(length/TILE) launches instead of the log2(length) *
+ (log2(length) + 1) / 2 launches of the global bitonic sort.
+*/
+cl_ulong hybridSort(cl_context context,
+                    cl_command_queue queue,
+                    cl_program program,
+                    cl_mem data,
+                    cl_uint length) {
+    cl_int error;
+    cl_ulong elapsed = 0;
+
+    cl_kernel tileKernel  = clCreateKernel(program, "bitonicSortTiles", &error);
+    cl_kernel mergeKernel = clCreateKernel(program, "mergePath", &error);
+    cl_mem temp = clCreateBuffer(context, CL_MEM_READ_WRITE, length * sizeof(cl_uint), NULL, &error);
+    if(error != CL_SUCCESS) {
+        perror("Unable to allocate the merge buffer");
+        exit(1);
+    }
+
+    size_t groups = (length + TILE - 1) / TILE;
+    size_t globalThreads[1] = {groups * GROUP_SIZE};
+    size_t threadsPerGroup[1] = {GROUP_SIZE};
+
+    clSetKernelArg(tileKernel, 0, sizeof(cl_mem), (void*)&data);
+    clSetKernelArg(tileKernel, 1, sizeof(cl_uint), (void*)&length);
+    clSetKernelArg(tileKernel, 2, TILE * sizeof(cl_uint), NULL);
+    elapsed += runKernel(queue, tileKernel, globalThreads, threadsPerGroup);
+
+    size_t items = (length + ITEMS_PER_MERGE - 1) / ITEMS_PER_MERGE;
+    globalThreads[0] = ((items + GROUP_SIZE - 1) / GROUP_SIZE) * GROUP_SIZE;
+
+    cl_mem src = data, dst = temp;
+    for(cl_uint run = TILE; run < length; run <<= 1) {
+        clSetKernelArg(mergeKernel, 0, sizeof(cl_mem), (void*)&src);
+        clSetKernelArg(mergeKernel, 1, sizeof(cl_mem), (void*)&dst);
+        clSetKernelArg(mergeKernel, 2, sizeof(cl_uint), (void*)&length);
+        clSetKernelArg(mergeKernel, 3, sizeof(cl_uint), (void*)&run);
+        elapsed += runKernel(queue, mergeKernel, globalThreads, threadsPerGroup);
+
+        cl_mem t = src; src = dst; dst = t;
+    }
+
+    if(src != data)
+        clEnqueueCopyBuffer(queue, src, data, 0, 0, length * sizeof(cl_uint), 0, NULL, NULL);
+    clFinish(queue);
+
+    clReleaseMemObject(temp);
+    clReleaseKernel(tileKernel);
+    clReleaseKernel(mergeKernel);
+
+    return elapsed;
+}
+
+/*
+ Sorts numOfSegments independent arrays stored back to back in the buffer;
+ segment i occupies [offsets[i], offsets[i+1]) and may hold up to TILE
+ elements. All segments are sorted in a single launch.
+*/
+cl_ulong segmentedSort(cl_context context,
+                       cl_command_queue queue,
+                       cl_program program,
+                       cl_mem data,
+                       cl_uint* offsets,
+                       cl_uint numOfSegments) {
+    cl_int error;
+
+    for(cl_uint i = 0; i < numOfSegments; ++i) {
+        if(offsets[i + 1] - offsets[i] > TILE) {
+            printf("Segment %u is longer than %u elements\n", i, TILE);
+            exit(1);
+        }
+    }
+
+    cl_kernel kernel = clCreateKernel(program, "bitonicSortSegments", &error);
+    cl_mem device_offsets = clCreateBuffer(context,
+                                           CL_MEM_READ_ONLY|CL_MEM_COPY_HOST_PTR,
+                                           (numOfSegments + 1) * sizeof(cl_uint),
+                                           offsets,
+                                           &error);
+    if(error != CL_SUCCESS) {
+        perror("Unable to allocate the segment offsets");
+        exit(1);
+    }
+
+    size_t globalThreads[1] = {numOfSegments * GROUP_SIZE};
+    size_t threadsPerGroup[1] = {GROUP_SIZE};
+
+    clSetKernelArg(kernel, 0, sizeof(cl_mem), (void*)&data);
+    clSetKernelArg(kernel, 1, sizeof(cl_mem), (void*)&device_offsets);
+    clSetKernelArg(kernel, 2, TILE * sizeof(cl_uint), NULL);
+    cl_ulong elapsed = runKernel(queue, kernel, globalThreads, threadsPerGroup);
+
+    clReleaseMemObject(device_offsets);
+    clReleaseKernel(kernel);
+
+    return elapsed;
+}
+#endif
+
 int main(int argc, char** argv) {
     /* OpenCL 1.1 data structures */
     cl_platform_id* platforms;
@@ -157,12 +293,50 @@ int main(int argc, char** argv) {
 
         queue = clCreateCommandQueue(context, device, props, &error);
 
+#ifdef USE_HYBRID_SORT
+        device_A_in = clCreateBuffer(context,
+                                     CL_MEM_READ_WRITE|CL_MEM_COPY_HOST_PTR,
+                                     LENGTH * sizeof(cl_int),
+                                     host_A_in,
+                                     &error);
+
+        cl_ulong elapsed = hybridSort(context, queue, program, device_A_in, LENGTH);
+        printf("Execution of the hybrid sort took %lu.%09lu s\n", elapsed/1000000000, elapsed%1000000000);
+
+        clEnqueueReadBuffer(queue, device_A_in, CL_TRUE, 0, LENGTH * sizeof(cl_int), host_A_out, 0, NULL, NULL);
+        for(cl_uint k = 1; k < LENGTH; ++k) {
+            if(host_A_out[k - 1] > host_A_out[k]) {
+                printf("Hybrid sort failed at %u\n", k);
+                break;
+            }
+        }
+
+        // Same data cut into many small arrays of random length.
+        cl_uint* offsets = (cl_uint*)malloc((LENGTH + 1) * sizeof(cl_uint));
+        cl_uint numOfSegments = 0;
+        offsets[0] = 0;
+        while(offsets[numOfSegments] < LENGTH) {
+            cl_uint size = 1 + rand() % TILE;
+            offsets[numOfSegments + 1] = offsets[numOfSegments] + size < LENGTH ?
+                                         offsets[numOfSegments] + size : LENGTH;
+            ++numOfSegments;
+        }
+
+        clEnqueueWriteBuffer(queue, device_A_in, CL_TRUE, 0, LENGTH * sizeof(cl_int), host_A_in, 0, NULL, NULL);
+        elapsed = segmentedSort(context, queue, program, device_A_in, offsets, numOfSegments);
+        printf("Execution of the segmented sort of %u arrays took %lu.%09lu s\n",
+               numOfSegments, elapsed/1000000000, elapsed%1000000000);
+        free(offsets);
+#else
 #ifdef USE_SHARED_MEM
         cl_kernel kernel = clCreateKernel(program, "bitonicSort_sharedmem", &error);
-#elif def USE_SHARED_MEM_2
+#elif defined(USE_SHARED_MEM_2)
         cl_kernel kernel = clCreateKernel(program, "bitonicSort_sharedmem_2", &error);
 #else
         cl_kernel kernel = clCreateKernel(program, "bitonicSort", &error);
+#endif
+#ifdef USE_LOCAL_STAGES
+        cl_kernel localKernel = clCreateKernel(program, "bitonicSort_localStages", &error);
 #endif
         device_A_in = clCreateBuffer(context,
                                      CL_MEM_READ_WRITE|CL_MEM_COPY_HOST_PTR,
@@ -178,9 +352,14 @@ int main(int argc, char** argv) {
         clSetKernelArg(kernel, 3, sizeof(cl_uint),(void*)&sortOrder);
 #ifdef USE_SHARED_MEM
         clSetKernelArg(kernel, 4, (GROUP_SIZE << 1) *sizeof(cl_uint),NULL);
-#elif def USE_SHARED_MEM_2
+#elif defined(USE_SHARED_MEM_2)
         clSetKernelArg(kernel, 5, (GROUP_SIZE << 2) *sizeof(cl_uint),NULL);
 #endif 
+#ifdef USE_LOCAL_STAGES
+        clSetKernelArg(localKernel, 0, sizeof(cl_mem),(void*)&device_A_in);
+        clSetKernelArg(localKernel, 3, sizeof(cl_uint),(void*)&sortOrder);
+        clSetKernelArg(localKernel, 4, (GROUP_SIZE << 1) *sizeof(cl_uint),NULL);
+#endif
         size_t globalThreads[1] = {LENGTH/2};
         size_t threadsPerGroup[1] = {GROUP_SIZE};
 
@@ -189,10 +368,21 @@ int main(int argc, char** argv) {
 
             for(cl_uint subStage = 0; subStage < stage +1; subStage++) {
                 clSetKernelArg(kernel, 2, sizeof(cl_uint),(void*)&subStage);
+                cl_kernel launch = kernel;
+#ifdef USE_LOCAL_STAGES
+                // The remaining sub-stages pair elements inside blocks of
+                // 2*GROUP_SIZE, so a single launch runs them all in local memory.
+                cl_uint distanceBetweenPairs = 1 << (stage - subStage);
+                if(distanceBetweenPairs <= GROUP_SIZE) {
+                    clSetKernelArg(localKernel, 1, sizeof(cl_uint),(void*)&stage);
+                    clSetKernelArg(localKernel, 2, sizeof(cl_uint),(void*)&subStage);
+                    launch = localKernel;
+                }
+#endif
 				cl_event exeEvt; 
 		        cl_ulong executionStart, executionEnd;
 				error = clEnqueueNDRangeKernel(queue,
-				                               kernel,
+				                               launch,
 				                               1,
 				                               NULL,
 		                                       globalThreads,
@@ -212,8 +402,11 @@ int main(int argc, char** argv) {
 		        clReleaseEvent(exeEvt);
 		
 		        printf("Execution of the bitonic sort took %lu.%lu s\n", (executionEnd - executionStart)/1000000000, (executionEnd - executionStart)%1000000000);
+
+                if(launch != kernel) break;
             }
         } 
+#endif
         clEnqueueReadBuffer(queue,
                             device_A_in,
                             CL_TRUE,
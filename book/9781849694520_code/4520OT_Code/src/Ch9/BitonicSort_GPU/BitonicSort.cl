@@ -187,3 +187,199 @@ void bitonicSort_sharedmem_2(__global uint * data,
     }
     
 }
+
+/*
+ Runs sub-stages subStage..stage of a stage in local memory. Once
+ distanceBetweenPairs is at most the work-group size, every compared pair
+ lies inside the block of 2*GROUP_SIZE elements owned by one work-group, so
+ the remaining sub-stages only need local barriers between them.
+*/
+__kernel
+void bitonicSort_localStages(__global uint * data,
+                             const uint stage,
+                             const uint subStage,
+                             const uint direction,
+                             __local uint* sharedMem) {
+
+    uint threadId = get_global_id(0);
+    uint lid      = get_local_id(0);
+    uint wg       = get_local_size(0);
+    uint base     = get_group_id(0) * wg * 2;
+
+    sharedMem[lid]      = data[base + lid];
+    sharedMem[lid + wg] = data[base + lid + wg];
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    uint sortIncreasing = direction;
+    uint sameDirectionBlockWidth = 1 << stage;
+
+    if((threadId/sameDirectionBlockWidth) % 2 == 1)
+        sortIncreasing = 1 - sortIncreasing;
+
+    for(uint s = subStage; s <= stage; ++s) {
+        uint distanceBetweenPairs = 1 << (stage - s);
+        uint blockWidth = distanceBetweenPairs << 1;
+
+        uint leftId = (threadId % distanceBetweenPairs) + (threadId / distanceBetweenPairs) * blockWidth - base;
+        uint rightId = leftId + distanceBetweenPairs;
+
+        uint leftElement  = sharedMem[leftId];
+        uint rightElement = sharedMem[rightId];
+
+        uint greater;
+        uint lesser;
+        if(leftElement > rightElement) {
+            greater = leftElement;
+            lesser  = rightElement;
+        } else {
+            greater = rightElement;
+            lesser  = leftElement;
+        }
+
+        if(sortIncreasing) {
+            sharedMem[leftId]  = lesser;
+            sharedMem[rightId] = greater;
+        } else {
+            sharedMem[leftId]  = greater;
+            sharedMem[rightId] = lesser;
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    data[base + lid]      = sharedMem[lid];
+    data[base + lid + wg] = sharedMem[lid + wg];
+}
+
+/*
+ Hybrid sort: bitonic sort of TILE-element tiles in local memory (one
+ launch for all tiles), followed by log2(N/TILE) merge-path passes that
+ merge pairs of sorted runs. This replaces the O(log^2 N) global-memory
+ launches of bitonicSort above with O(log N) launches.
+*/
+#define TILE            (GROUP_SIZE * 8)
+#define ITEMS_PER_MERGE 8
+
+// Ascending bitonic sort of n (a power of two) elements in local memory.
+void localBitonicSort(__local uint* tile, uint n) {
+    uint lid = get_local_id(0);
+    uint wg  = get_local_size(0);
+
+    for(uint k = 2; k <= n; k <<= 1) {
+        for(uint j = k >> 1; j > 0; j >>= 1) {
+            for(uint t = lid; t < (n >> 1); t += wg) {
+                uint left  = 2 * j * (t / j) + (t % j);
+                uint right = left + j;
+                uint sortIncreasing = (left & k) == 0;
+
+                uint leftElement  = tile[left];
+                uint rightElement = tile[right];
+
+                if((leftElement > rightElement) == sortIncreasing) {
+                    tile[left]  = rightElement;
+                    tile[right] = leftElement;
+                }
+            }
+            barrier(CLK_LOCAL_MEM_FENCE);
+        }
+    }
+}
+
+__kernel
+void bitonicSortTiles(__global uint * data,
+                      const uint length,
+                      __local uint* tile) {
+
+    uint lid = get_local_id(0);
+    uint wg  = get_local_size(0);
+    uint base = get_group_id(0) * TILE;
+
+    // Pad the last tile with the largest key so that it sorts to the end.
+    for(uint i = lid; i < TILE; i += wg)
+        tile[i] = base + i < length ? data[base + i] : UINT_MAX;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    localBitonicSort(tile, TILE);
+
+    for(uint i = lid; i < TILE; i += wg)
+        if(base + i < length) data[base + i] = tile[i];
+}
+
+/*
+ Merges pairs of sorted runs of the given width from src into dst. Each
+ work-item finds where its diagonal of the merge matrix crosses the merge
+ path by binary search, and then writes ITEMS_PER_MERGE outputs
+ sequentially. Ties are taken from the left run, so the merge is stable.
+*/
+__kernel
+void mergePath(__global const uint * src,
+               __global uint * dst,
+               const uint length,
+               const uint run) {
+
+    uint out = get_global_id(0) * ITEMS_PER_MERGE;
+    if(out >= length) return;
+
+    uint pairStart = (out / (2 * run)) * 2 * run;
+    uint aEnd = min(pairStart + run, length);
+    uint bEnd = min(aEnd + run, length);
+
+    __global const uint* a = src + pairStart;
+    __global const uint* b = src + aEnd;
+    uint lengthA = aEnd - pairStart;
+    uint lengthB = bEnd - aEnd;
+
+    uint diag = out - pairStart;
+    uint lo = diag > lengthB ? diag - lengthB : 0;
+    uint hi = min(diag, lengthA);
+
+    while(lo < hi) {
+        uint mid = (lo + hi) >> 1;
+        if(a[mid] <= b[diag - 1 - mid])
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    uint i = lo;
+    uint j = diag - lo;
+    uint end = min(out + ITEMS_PER_MERGE, bEnd);
+
+    for(uint k = out; k < end; ++k) {
+        if(j >= lengthB || (i < lengthA && a[i] <= b[j]))
+            dst[k] = a[i++];
+        else
+            dst[k] = b[j++];
+    }
+}
+
+/*
+ Segmented sort: work-group g sorts data[offsets[g] .. offsets[g+1]) in
+ local memory, so many small independent arrays are sorted in one launch.
+ Segments may not be longer than TILE elements.
+*/
+__kernel
+void bitonicSortSegments(__global uint * data,
+                         __global const uint * offsets,
+                         __local uint* tile) {
+
+    uint lid = get_local_id(0);
+    uint wg  = get_local_size(0);
+    uint seg = get_group_id(0);
+
+    uint base   = offsets[seg];
+    uint length = offsets[seg + 1] - base;
+
+    // The whole work-group computes the same size, so the barriers in
+    // localBitonicSort are uniform.
+    uint n = 2;
+    while(n < length) n <<= 1;
+
+    for(uint i = lid; i < n; i += wg)
+        tile[i] = i < length ? data[base + i] : UINT_MAX;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    localBitonicSort(tile, n);
+
+    for(uint i = lid; i < length; i += wg)
+        data[base + i] = tile[i];
+}
@@ -2,3 +2,5 @@
 #define DEBUG_VERBOSE
 /* #undef USE_SHARED_MEM */
 /* #undef USE_SHARED_MEM_2 */
+#define USE_HYBRID_SORT
+#define USE_LOCAL_STAGES
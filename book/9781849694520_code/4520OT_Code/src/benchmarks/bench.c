@@ -0,0 +1,572 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "bench.h"
+#include "bench_suite.h"
+
+#ifndef BENCH_KERNEL_DIR
+#define BENCH_KERNEL_DIR "."
+#endif
+
+#define MAX_SIZES   32
+#define MAX_DEVICES 32
+
+/* ------------------------------------------------------------------------ */
+/* Helpers for the benchmarks                                                */
+/* ------------------------------------------------------------------------ */
+
+cl_program benchProgram(const BenchContext* bc, const char* file, const char* options) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s", BENCH_KERNEL_DIR, file);
+
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Couldn't read the program file %s\n", path);
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    size_t size = ftell(f);
+    rewind(f);
+    char* source = (char*)malloc(size + 1);
+    size = fread(source, sizeof(char), size, f);
+    source[size] = '\0';
+    fclose(f);
+
+    cl_int error;
+    cl_program program = clCreateProgramWithSource(bc->context, 1, (const char**)&source,
+                                                   &size, &error);
+    free(source);
+    if (error != CL_SUCCESS) return NULL;
+
+    error = clBuildProgram(program, 1, &bc->device, options, NULL, NULL);
+    if (error != CL_SUCCESS) {
+        size_t length;
+        clGetProgramBuildInfo(program, bc->device, CL_PROGRAM_BUILD_LOG, 0, NULL, &length);
+        char* log = (char*)malloc(length + 1);
+        clGetProgramBuildInfo(program, bc->device, CL_PROGRAM_BUILD_LOG, length, log, NULL);
+        log[length] = '\0';
+        fprintf(stderr, "\n=== ERROR building %s ===\n\n%s\n=============\n", file, log);
+        free(log);
+        clReleaseProgram(program);
+        return NULL;
+    }
+    return program;
+}
+
+double benchEventSpan(const cl_event* events, unsigned int count) {
+    cl_ulong first = ~(cl_ulong)0, last = 0;
+
+    for(unsigned int i = 0; i < count; ++i) {
+        cl_ulong start, end;
+        if (clGetEventProfilingInfo(events[i], CL_PROFILING_COMMAND_START,
+                                    sizeof(cl_ulong), &start, NULL) != CL_SUCCESS ||
+            clGetEventProfilingInfo(events[i], CL_PROFILING_COMMAND_END,
+                                    sizeof(cl_ulong), &end, NULL) != CL_SUCCESS)
+            return -1;
+        if (start < first) first = start;
+        if (end > last)    last = end;
+    }
+    return count ? (last - first) * 1e-9 : -1;
+}
+
+double benchFinish(cl_int error, cl_event* events, unsigned int count) {
+    double span = -1;
+
+    if (error == CL_SUCCESS && count && clWaitForEvents(count, events) == CL_SUCCESS)
+        span = benchEventSpan(events, count);
+
+    for(unsigned int i = 0; i < count; ++i)
+        if (events[i]) clReleaseEvent(events[i]);
+    return span;
+}
+
+void benchRandom(cl_uint* data, size_t count, cl_uint range, unsigned int seed) {
+    // xorshift32, so that every platform sees the same data
+    cl_uint x = seed ? seed : 2463534242u;
+    for(size_t i = 0; i < count; ++i) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        data[i] = range ? x % range : x;
+    }
+}
+
+/* ------------------------------------------------------------------------ */
+/* Results                                                                   */
+/* ------------------------------------------------------------------------ */
+
+typedef enum { FORMAT_TEXT, FORMAT_CSV, FORMAT_JSON } Format;
+
+typedef struct Result {
+    const Benchmark*    bench;
+    const BenchContext* bc;
+    size_t              size;
+    unsigned int        runs;
+    double              min, median, mean, stddev, rate;
+    const char*         status;             /* ok, failed, wrong, skipped */
+} Result;
+
+static int compareDouble(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static void statistics(Result* r, double* times, unsigned int runs) {
+    qsort(times, runs, sizeof(double), compareDouble);
+
+    double sum = 0, sq = 0;
+    for(unsigned int i = 0; i < runs; ++i) sum += times[i];
+    r->mean = sum / runs;
+    for(unsigned int i = 0; i < runs; ++i) sq += (times[i] - r->mean) * (times[i] - r->mean);
+
+    r->min    = times[0];
+    r->median = runs % 2 ? times[runs / 2] : 0.5 * (times[runs / 2 - 1] + times[runs / 2]);
+    r->stddev = runs > 1 ? sqrt(sq / (runs - 1)) : 0;
+    r->rate   = r->median > 0 ? r->bench->work(r->size) / r->bench->scale / r->median : 0;
+}
+
+static void writeCsvString(FILE* out, const char* s) {
+    fputc('"', out);
+    for(; *s; ++s) {
+        if (*s == '"') fputc('"', out);
+        fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+static void writeJsonString(FILE* out, const char* s) {
+    fputc('"', out);
+    for(; *s; ++s) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') fprintf(out, "\\%c", c);
+        else if (c < 0x20)         fprintf(out, "\\u%04x", c);
+        else                       fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+static const char* csvHeader =
+    "benchmark,platform,device,driver,size,runs,min_s,median_s,mean_s,stddev_s,rate,unit,status\n";
+
+static void writeResult(FILE* out, Format format, const Result* r, int first) {
+    switch(format) {
+        case FORMAT_TEXT:
+            fprintf(out, "  %-18s %12lu %-9s %11.6f %11.6f %9.2f%% %10.2f %-8s %s\n",
+                    r->bench->name, (unsigned long)r->size, r->bench->sizeMeaning,
+                    r->min, r->median, r->median > 0 ? 100 * r->stddev / r->mean : 0,
+                    r->rate, r->bench->unit, r->status);
+            break;
+        case FORMAT_CSV:
+            writeCsvString(out, r->bench->name);     fputc(',', out);
+            writeCsvString(out, r->bc->platformName); fputc(',', out);
+            writeCsvString(out, r->bc->deviceName);  fputc(',', out);
+            writeCsvString(out, r->bc->driverVersion);
+            fprintf(out, ",%lu,%u,%.9g,%.9g,%.9g,%.9g,%.6g,", (unsigned long)r->size, r->runs,
+                    r->min, r->median, r->mean, r->stddev, r->rate);
+            writeCsvString(out, r->bench->unit);     fputc(',', out);
+            writeCsvString(out, r->status);          fputc('\n', out);
+            break;
+        case FORMAT_JSON:
+            fprintf(out, "%s\n    {\"benchmark\": ", first ? "" : ",");
+            writeJsonString(out, r->bench->name);
+            fprintf(out, ", \"platform\": ");  writeJsonString(out, r->bc->platformName);
+            fprintf(out, ", \"device\": ");    writeJsonString(out, r->bc->deviceName);
+            fprintf(out, ", \"driver\": ");    writeJsonString(out, r->bc->driverVersion);
+            fprintf(out, ", \"size\": %lu, \"size_meaning\": ", (unsigned long)r->size);
+            writeJsonString(out, r->bench->sizeMeaning);
+            fprintf(out, ", \"runs\": %u, \"min_s\": %.9g, \"median_s\": %.9g, \"mean_s\": %.9g,"
+                         " \"stddev_s\": %.9g, \"rate\": %.6g, \"unit\": ",
+                    r->runs, r->min, r->median, r->mean, r->stddev, r->rate);
+            writeJsonString(out, r->bench->unit);
+            fprintf(out, ", \"status\": ");    writeJsonString(out, r->status);
+            fprintf(out, "}");
+            break;
+    }
+}
+
+/* ------------------------------------------------------------------------ */
+/* Baseline of an earlier CSV run                                            */
+/* ------------------------------------------------------------------------ */
+
+typedef struct BaselineEntry {
+    char   key[384];                          /* benchmark|platform|device|size */
+    double median;
+} BaselineEntry;
+
+typedef struct Baseline {
+    BaselineEntry* entries;
+    size_t         count;
+} Baseline;
+
+static void makeKey(char* key, size_t length, const char* bench, const char* platform,
+                    const char* device, const char* size) {
+    snprintf(key, length, "%s|%s|%s|%s", bench, platform, device, size);
+}
+
+/* Splits a CSV line written by writeResult() into at most max fields, in place */
+static int splitCsv(char* line, char** fields, int max) {
+    int n = 0;
+    char* p = line;
+
+    line[strcspn(line, "\r\n")] = '\0';
+
+    while(*p && n < max) {
+        if (*p == '"') {
+            char* w = fields[n++] = ++p;
+            for(; *p; ++p) {
+                if (*p == '"') {
+                    if (p[1] != '"') { ++p; break; }
+                    ++p;
+                }
+                *w++ = *p;
+            }
+            *w = '\0';
+        } else {
+            fields[n++] = p;
+            while(*p && *p != ',') ++p;
+        }
+        if (*p == ',') *p++ = '\0';
+    }
+    return n;
+}
+
+static int loadBaseline(Baseline* b, const char* file) {
+    FILE* f = fopen(file, "r");
+    if (f == NULL) return -1;
+
+    char line[2048];
+    size_t capacity = 0;
+    b->entries = NULL;
+    b->count   = 0;
+
+    while(fgets(line, sizeof(line), f)) {
+        char* fields[13];
+        if (splitCsv(line, fields, 13) != 13 || !strcmp(fields[0], "benchmark")) continue;
+        if (strcmp(fields[12], "ok")) continue;
+
+        if (b->count == capacity) {
+            capacity = capacity ? 2 * capacity : 64;
+            b->entries = (BaselineEntry*)realloc(b->entries, capacity * sizeof(BaselineEntry));
+        }
+        makeKey(b->entries[b->count].key, sizeof(b->entries[0].key),
+                fields[0], fields[1], fields[2], fields[4]);
+        b->entries[b->count].median = atof(fields[7]);
+        ++b->count;
+    }
+    fclose(f);
+    return 0;
+}
+
+static const BaselineEntry* findBaseline(const Baseline* b, const Result* r) {
+    char key[384], size[32];
+    snprintf(size, sizeof(size), "%lu", (unsigned long)r->size);
+    makeKey(key, sizeof(key), r->bench->name, r->bc->platformName, r->bc->deviceName, size);
+
+    for(size_t i = 0; i < b->count; ++i)
+        if (!strcmp(b->entries[i].key, key)) return &b->entries[i];
+    return NULL;
+}
+
+/* ------------------------------------------------------------------------ */
+/* Driver                                                                    */
+/* ------------------------------------------------------------------------ */
+
+typedef struct Options {
+    unsigned int warmup, runs;
+    size_t       sizes[MAX_SIZES + 1];
+    int          customSizes;
+    const char*  filter;                    /* comma separated names, or NULL */
+    const char*  device;                    /* all, gpu, cpu, accelerator or an index */
+    Format       format;
+    const char*  output;
+    const char*  csv;                       /* extra CSV and JSON copies */
+    const char*  json;
+    const char*  baseline;
+    double       tolerance;                 /* in percent */
+} Options;
+
+static void usage(const char* name) {
+    printf("Usage: %s [options]\n"
+           "  --list               list the benchmarks and devices, then exit\n"
+           "  --filter a,b         run only these benchmarks\n"
+           "  --device all|gpu|cpu|accelerator|<index>   devices to run on (all)\n"
+           "  --warmup N           untimed runs before measuring (2)\n"
+           "  --runs N             timed runs per size (10)\n"
+           "  --sizes n1,n2,...    sizes to sweep instead of each benchmark's own\n"
+           "  --format text|csv|json   result format (text)\n"
+           "  --output FILE        write the results to FILE instead of stdout\n"
+           "  --csv FILE, --json FILE   also write the results to FILE in that format\n"
+           "  --baseline FILE      compare medians with an earlier CSV output\n"
+           "  --tolerance PCT      slow-down reported as a regression (10)\n"
+           "Exit status: 1 if a benchmark failed or gave a wrong result, 2 on regressions.\n",
+           name);
+}
+
+static int selected(const Options* opt, const char* name) {
+    if (opt->filter == NULL) return 1;
+
+    size_t length = strlen(name);
+    for(const char* p = opt->filter; *p; ) {
+        const char* end = strchr(p, ',');
+        size_t n = end ? (size_t)(end - p) : strlen(p);
+        if (n == length && !strncmp(p, name, n)) return 1;
+        p += n + (end != NULL);
+    }
+    return 0;
+}
+
+static int parseOptions(int argc, char** argv, Options* opt, int* list) {
+    memset(opt, 0, sizeof(*opt));
+    opt->warmup    = 2;
+    opt->runs      = 10;
+    opt->device    = "all";
+    opt->format    = FORMAT_TEXT;
+    opt->tolerance = 10;
+    *list = 0;
+
+    for(int i = 1; i < argc; ++i) {
+        const char* a = argv[i];
+        const char* v = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (!strcmp(a, "--list")) { *list = 1; continue; }
+        if (!strcmp(a, "--help") || v == NULL) { usage(argv[0]); return -1; }
+        ++i;
+
+        if      (!strcmp(a, "--filter"))    opt->filter = v;
+        else if (!strcmp(a, "--device"))    opt->device = v;
+        else if (!strcmp(a, "--warmup"))    opt->warmup = atoi(v);
+        else if (!strcmp(a, "--runs"))      opt->runs   = atoi(v) > 0 ? atoi(v) : 1;
+        else if (!strcmp(a, "--output"))    opt->output = v;
+        else if (!strcmp(a, "--csv"))       opt->csv = v;
+        else if (!strcmp(a, "--json"))      opt->json = v;
+        else if (!strcmp(a, "--baseline"))  opt->baseline = v;
+        else if (!strcmp(a, "--tolerance")) opt->tolerance = atof(v);
+        else if (!strcmp(a, "--format")) {
+            if      (!strcmp(v, "csv"))  opt->format = FORMAT_CSV;
+            else if (!strcmp(v, "json")) opt->format = FORMAT_JSON;
+            else if (!strcmp(v, "text")) opt->format = FORMAT_TEXT;
+            else { usage(argv[0]); return -1; }
+        } else if (!strcmp(a, "--sizes")) {
+            int n = 0;
+            for(const char* p = v; *p && n < MAX_SIZES; ) {
+                char* end;
+                size_t s = strtoul(p, &end, 10);
+                if (end == p) break;
+                if (s) opt->sizes[n++] = s;
+                p = *end == ',' ? end + 1 : end;
+            }
+            opt->sizes[n] = 0;
+            opt->customSizes = n > 0;
+        } else {
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Devices matching --device, in platform order */
+static unsigned int findDevices(const char* which, cl_platform_id* platforms, cl_device_id* devices) {
+    cl_platform_id ids[16];
+    cl_uint numPlatforms = 0, total = 0, chosen = 0;
+
+    if (clGetPlatformIDs(16, ids, &numPlatforms) != CL_SUCCESS) return 0;
+
+    cl_device_type type = CL_DEVICE_TYPE_ALL;
+    if (!strcmp(which, "gpu"))         type = CL_DEVICE_TYPE_GPU;
+    if (!strcmp(which, "cpu"))         type = CL_DEVICE_TYPE_CPU;
+    if (!strcmp(which, "accelerator")) type = CL_DEVICE_TYPE_ACCELERATOR;
+    char* end;
+    long index = strtol(which, &end, 10);
+    int byIndex = *which && *end == '\0';
+
+    for(cl_uint p = 0; p < numPlatforms && p < 16; ++p) {
+        cl_device_id ds[MAX_DEVICES];
+        cl_uint n = 0;
+        if (clGetDeviceIDs(ids[p], byIndex ? CL_DEVICE_TYPE_ALL : type, MAX_DEVICES, ds, &n) != CL_SUCCESS)
+            continue;
+        for(cl_uint d = 0; d < n && d < MAX_DEVICES; ++d, ++total) {
+            if ((byIndex && total != (cl_uint)index) || chosen == MAX_DEVICES) continue;
+            platforms[chosen] = ids[p];
+            devices[chosen++] = ds[d];
+        }
+    }
+    return chosen;
+}
+
+static int openDevice(BenchContext* bc, cl_platform_id platform, cl_device_id device) {
+    cl_int error;
+
+    memset(bc, 0, sizeof(*bc));
+    bc->platform = platform;
+    bc->device   = device;
+    clGetPlatformInfo(platform, CL_PLATFORM_NAME, sizeof(bc->platformName), bc->platformName, NULL);
+    clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(bc->deviceName), bc->deviceName, NULL);
+    clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(bc->driverVersion), bc->driverVersion, NULL);
+
+    bc->context = clCreateContext(NULL, 1, &device, NULL, NULL, &error);
+    if (error != CL_SUCCESS) return -1;
+    bc->queue = clCreateCommandQueue(bc->context, device, CL_QUEUE_PROFILING_ENABLE, &error);
+    if (error != CL_SUCCESS) {
+        clReleaseContext(bc->context);
+        return -1;
+    }
+    return 0;
+}
+
+/* An output of the results; the main one goes to stdout unless --output is given */
+typedef struct Sink {
+    FILE*  out;
+    Format format;
+} Sink;
+
+static int openSink(Sink* sink, const char* file, Format format, const Options* opt) {
+    sink->out    = file ? fopen(file, "w") : stdout;
+    sink->format = format;
+    if (sink->out == NULL) return -1;
+
+    if (format == FORMAT_CSV) fputs(csvHeader, sink->out);
+    if (format == FORMAT_JSON) {
+        char stamp[32];
+        time_t now = time(NULL);
+        strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+        fprintf(sink->out, "{\n  \"timestamp\": \"%s\", \"warmup\": %u, \"runs\": %u,\n  \"results\": [",
+                stamp, opt->warmup, opt->runs);
+    }
+    return 0;
+}
+
+static void closeDevice(BenchContext* bc) {
+    clReleaseCommandQueue(bc->queue);
+    clReleaseContext(bc->context);
+}
+
+/* Runs one benchmark at one size: warm-up, timed runs, check */
+static void measure(const Options* opt, const BenchContext* bc, const Benchmark* b,
+                    size_t size, Result* r) {
+    memset(r, 0, sizeof(*r));
+    r->bench  = b;
+    r->bc     = bc;
+    r->size   = size;
+    r->status = "skipped";
+
+    void* state = b->setup(bc, size);
+    if (state == NULL) return;
+
+    double* times = (double*)malloc(opt->runs * sizeof(double));
+    r->status = "ok";
+
+    for(unsigned int i = 0; i < opt->warmup; ++i)
+        if (b->run(state) < 0) r->status = "failed";
+
+    for(unsigned int i = 0; i < opt->runs && !strcmp(r->status, "ok"); ++i) {
+        times[i] = b->run(state);
+        if (times[i] < 0) r->status = "failed";
+        else ++r->runs;
+    }
+
+    if (r->runs) statistics(r, times, r->runs);
+    if (!strcmp(r->status, "ok") && b->check && !b->check(state)) r->status = "wrong";
+
+    free(times);
+    b->teardown(state);
+}
+
+int benchMain(int argc, char** argv, const Benchmark* const* suite, unsigned int count) {
+    Options opt;
+    int list;
+    if (parseOptions(argc, argv, &opt, &list)) return 1;
+
+    cl_platform_id platforms[MAX_DEVICES];
+    cl_device_id   devices[MAX_DEVICES];
+    unsigned int   numDevices = findDevices(opt.device, platforms, devices);
+
+    if (list) {
+        printf("Benchmarks:\n");
+        for(unsigned int i = 0; i < count; ++i) {
+            printf("  %-18s %-8s sizes (%s):", suite[i]->name, suite[i]->unit, suite[i]->sizeMeaning);
+            for(const size_t* s = suite[i]->sizes; *s; ++s) printf(" %lu", (unsigned long)*s);
+            printf("\n");
+        }
+        printf("Devices:\n");
+        for(unsigned int d = 0; d < numDevices; ++d) {
+            char name[128];
+            clGetDeviceInfo(devices[d], CL_DEVICE_NAME, sizeof(name), name, NULL);
+            printf("  %u: %s\n", d, name);
+        }
+        return 0;
+    }
+
+    if (numDevices == 0) {
+        fprintf(stderr, "No OpenCL device matches '%s'\n", opt.device);
+        return 1;
+    }
+
+    Baseline baseline = {NULL, 0};
+    if (opt.baseline && loadBaseline(&baseline, opt.baseline))
+        fprintf(stderr, "Couldn't read the baseline %s\n", opt.baseline);
+
+    Sink sinks[3];
+    unsigned int numSinks = 0;
+    if (openSink(&sinks[numSinks++], opt.output, opt.format, &opt) ||
+        (opt.csv  && openSink(&sinks[numSinks++], opt.csv, FORMAT_CSV, &opt)) ||
+        (opt.json && openSink(&sinks[numSinks++], opt.json, FORMAT_JSON, &opt))) {
+        perror("Couldn't open the output file");
+        return 1;
+    }
+
+    int failures = 0, regressions = 0, first = 1;
+
+    for(unsigned int d = 0; d < numDevices; ++d) {
+        BenchContext bc;
+        if (openDevice(&bc, platforms[d], devices[d])) {
+            fprintf(stderr, "Couldn't open device %u\n", d);
+            ++failures;
+            continue;
+        }
+        for(unsigned int k = 0; k < numSinks; ++k) {
+            if (sinks[k].format != FORMAT_TEXT) continue;
+            fprintf(sinks[k].out, "%s (%s, driver %s)\n", bc.deviceName, bc.platformName, bc.driverVersion);
+            fprintf(sinks[k].out, "  %-18s %12s %-9s %11s %11s %10s %10s\n", "benchmark", "size", "",
+                    "min s", "median s", "stddev", "rate");
+        }
+
+        for(unsigned int i = 0; i < count; ++i) {
+            if (!selected(&opt, suite[i]->name)) continue;
+
+            const size_t* sizes = opt.customSizes ? opt.sizes : suite[i]->sizes;
+            for(const size_t* s = sizes; *s; ++s) {
+                Result r;
+                measure(&opt, &bc, suite[i], *s, &r);
+                for(unsigned int k = 0; k < numSinks; ++k) {
+                    writeResult(sinks[k].out, sinks[k].format, &r, first);
+                    fflush(sinks[k].out);
+                }
+                first = 0;
+
+                if (!strcmp(r.status, "failed") || !strcmp(r.status, "wrong")) ++failures;
+
+                const BaselineEntry* e = baseline.count ? findBaseline(&baseline, &r) : NULL;
+                if (e && r.runs && r.median > e->median * (1 + opt.tolerance / 100)) {
+                    fprintf(stderr, "REGRESSION %s size %lu on %s: median %.6f s, baseline %.6f s (+%.1f%%)\n",
+                            r.bench->name, (unsigned long)r.size, bc.deviceName,
+                            r.median, e->median, 100 * (r.median / e->median - 1));
+                    ++regressions;
+                }
+            }
+        }
+        closeDevice(&bc);
+    }
+
+    for(unsigned int k = 0; k < numSinks; ++k) {
+        if (sinks[k].format == FORMAT_JSON) fprintf(sinks[k].out, "\n  ]\n}\n");
+        if (sinks[k].out != stdout) fclose(sinks[k].out);
+    }
+    free(baseline.entries);
+
+    return failures ? 1 : regressions ? 2 : 0;
+}
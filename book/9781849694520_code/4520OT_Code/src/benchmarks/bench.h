@@ -0,0 +1,67 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stddef.h>
+
+#ifdef APPLE
+#include <OpenCL/cl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Device a benchmark runs on; the queue has profiling enabled */
+typedef struct BenchContext {
+    cl_platform_id   platform;
+    cl_device_id     device;
+    cl_context       context;
+    cl_command_queue queue;
+    char             platformName[128];
+    char             deviceName[128];
+    char             driverVersion[64];
+} BenchContext;
+
+/*
+ One benchmark of the suite. setup() prepares the data for one size and
+ returns NULL when the device or the size is not supported, run() enqueues
+ a single run and returns its device time in seconds (< 0 on failure),
+ check() validates the result of the last run. work() is the amount of
+ work of a run at that size, in the unit of the reported rate.
+*/
+typedef struct Benchmark {
+    const char*   name;
+    const char*   unit;                    /* rate unit, e.g. "GB/s" */
+    double        scale;                   /* work() units per rate unit */
+    const char*   sizeMeaning;             /* what `size` counts */
+    const size_t* sizes;                   /* default sweep, 0-terminated */
+    void*  (*setup)(const BenchContext* bc, size_t size);
+    double (*run)(void* state);
+    int    (*check)(void* state);          /* may be NULL */
+    double (*work)(size_t size);
+    void   (*teardown)(void* state);
+} Benchmark;
+
+/*
+ Builds the kernels of file, looked up in BENCH_KERNEL_DIR (the build
+ directory, where CMake copies the kernels of the samples), with options.
+ Prints the build log and returns NULL on failure.
+*/
+cl_program benchProgram(const BenchContext* bc, const char* file, const char* options);
+
+/* Device time from the start of the first to the end of the last event, in seconds */
+double benchEventSpan(const cl_event* events, unsigned int count);
+
+/* Waits for and releases events, returning their span; < 0 if error is set */
+double benchFinish(cl_int error, cl_event* events, unsigned int count);
+
+/* Uniformly distributed unsigned integers in [0, range), from a fixed seed */
+void benchRandom(cl_uint* data, size_t count, cl_uint range, unsigned int seed);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
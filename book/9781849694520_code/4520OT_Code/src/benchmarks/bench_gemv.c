@@ -0,0 +1,130 @@
+/*
+ gemv and gemv_t of Ch4/simple_dot_product: y = A x and y = A^T x for a
+ random n x n matrix, with the shape of the work-groups tuned by gemvTune()
+ for the device and the size at setup; the chosen shape goes to stderr. The
+ check recomputes a few entries of y on the host.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "bench.h"
+#include "../Ch4/simple_dot_product/gemv.h"
+
+#define CHECKED_ENTRIES 64
+
+typedef struct Gemv {
+    const BenchContext* bc;
+    cl_program program;
+    cl_kernel  kernel;
+    cl_mem     a, x, y;
+    cl_uint    n;
+    int        transposed;
+    GemvShape  shape;
+    float*     A;
+    float*     X;
+} Gemv;
+
+static void teardown(void* state);
+
+static void* setup(const BenchContext* bc, size_t n, int transposed) {
+    if (n == 0 || n > 16384) return NULL;
+
+    Gemv*    g = (Gemv*)calloc(1, sizeof(Gemv));
+    cl_uint* noise = (cl_uint*)malloc(n * n * sizeof(cl_uint));
+    cl_int   error = CL_SUCCESS;
+    double   seconds;
+
+    g->bc = bc;
+    g->n  = (cl_uint)n;
+    g->transposed = transposed;
+    g->A  = (float*)malloc(n * n * sizeof(float));
+    g->X  = (float*)malloc(n * sizeof(float));
+
+    benchRandom(noise, n * n, 1000, 10);
+    for(size_t i = 0; i < n * n; ++i) g->A[i] = noise[i] * 1e-3f - 0.5f;
+    for(size_t i = 0; i < n; ++i)     g->X[i] = noise[i] * 1e-3f;
+    free(noise);
+
+    g->program = benchProgram(bc, "gemv.cl", NULL);
+    if (g->program) g->kernel = clCreateKernel(g->program, transposed ? "gemv_t" : "gemv", &error);
+
+    g->a = clCreateBuffer(bc->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                          n * n * sizeof(float), g->A, &error);
+    g->x = clCreateBuffer(bc->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                          n * sizeof(float), g->X, &error);
+    g->y = clCreateBuffer(bc->context, CL_MEM_READ_WRITE, n * sizeof(float), NULL, &error);
+
+    if (!g->kernel || !g->a || !g->x || !g->y) {
+        teardown(g);
+        return NULL;
+    }
+
+    gemvSetArgs(g->kernel, g->a, g->x, g->y, g->n, g->n, 1.0f, 0.0f);
+    g->shape = gemvTune(bc->queue, bc->device, g->kernel, transposed, g->n, g->n, &seconds);
+    if (!g->shape.x) {
+        teardown(g);
+        return NULL;
+    }
+    fprintf(stderr, "  (%s %u: %u x %u work-items)\n", transposed ? "gemv_t" : "gemv",
+            g->n, (unsigned)g->shape.x, (unsigned)g->shape.y);
+    return g;
+}
+
+static void* setupN(const BenchContext* bc, size_t n) { return setup(bc, n, 0); }
+static void* setupT(const BenchContext* bc, size_t n) { return setup(bc, n, 1); }
+
+static double run(void* state) {
+    Gemv*    g = (Gemv*)state;
+    cl_event e;
+
+    cl_int error = gemvEnqueue(g->bc->queue, g->kernel, g->transposed, g->n, g->n, g->shape, &e);
+    return benchFinish(error, &e, error == CL_SUCCESS);
+}
+
+static int check(void* state) {
+    Gemv*  g = (Gemv*)state;
+    cl_uint n = g->n;
+    float* y = (float*)malloc(n * sizeof(float));
+    int    ok = 1;
+
+    clEnqueueReadBuffer(g->bc->queue, g->y, CL_TRUE, 0, n * sizeof(float), y, 0, NULL, NULL);
+    for(int k = 0; k < CHECKED_ENTRIES && ok; ++k) {
+        cl_uint i = (cl_uint)((unsigned long)k * (n - 1) / (CHECKED_ENTRIES - 1));
+        double  sum = 0, size = 0;
+        for(cl_uint j = 0; j < n; ++j) {
+            double p = (g->transposed ? g->A[(size_t)j * n + i] : g->A[(size_t)i * n + j]) * g->X[j];
+            sum  += p;
+            size += fabs(p);
+        }
+        ok = fabs(y[i] - sum) <= 1e-5 * (1 + size);
+    }
+    free(y);
+    return ok;
+}
+
+// the matrix is read once, x and y are small next to it
+static double work(size_t n) {
+    return 4.0 * n * n;
+}
+
+static void teardown(void* state) {
+    Gemv* g = (Gemv*)state;
+    if (g->kernel)  clReleaseKernel(g->kernel);
+    if (g->program) clReleaseProgram(g->program);
+    if (g->a)       clReleaseMemObject(g->a);
+    if (g->x)       clReleaseMemObject(g->x);
+    if (g->y)       clReleaseMemObject(g->y);
+    free(g->A);
+    free(g->X);
+    free(g);
+}
+
+static const size_t sizes[] = {1024, 2048, 4096, 0};
+
+const Benchmark gemvBenchmark = {
+    "gemv", "GB/s", 1e9, "order", sizes, setupN, run, check, work, teardown
+};
+
+const Benchmark gemvTBenchmark = {
+    "gemv_t", "GB/s", 1e9, "order", sizes, setupT, run, check, work, teardown
+};
@@ -0,0 +1,104 @@
+/*
+ histogram256 of Ch5/histogram: every work-group of GROUP_SIZE work-items
+ builds a 256-bin histogram of GROUP_SIZE * BIN_SIZE values with per
+ work-item counters in local memory. The sub-histograms are added on the
+ host for the check.
+*/
+#include <stdlib.h>
+#include <string.h>
+#include "bench.h"
+
+#define BIN_SIZE   256                          // must match histogram.cl
+#define GROUP_SIZE 128
+
+typedef struct Histogram {
+    const BenchContext* bc;
+    cl_program program;
+    cl_kernel  kernel;
+    cl_mem     input, bins;
+    size_t     n, groups;
+    cl_uint    expected[BIN_SIZE];
+} Histogram;
+
+static void teardown(void* state);
+
+static void* setup(const BenchContext* bc, size_t n) {
+    if (n % (GROUP_SIZE * BIN_SIZE)) return NULL;
+
+    cl_ulong localMem = 0;
+    clGetDeviceInfo(bc->device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(localMem), &localMem, NULL);
+    if (localMem < BIN_SIZE * GROUP_SIZE) return NULL;
+
+    Histogram* h = (Histogram*)calloc(1, sizeof(Histogram));
+    cl_int error = CL_SUCCESS;
+
+    h->bc     = bc;
+    h->n      = n;
+    h->groups = n / (GROUP_SIZE * BIN_SIZE);
+
+    cl_uint* data = (cl_uint*)malloc(n * sizeof(cl_uint));
+    benchRandom(data, n, BIN_SIZE, 2);
+    for(size_t i = 0; i < n; ++i) ++h->expected[data[i]];
+
+    h->program = benchProgram(bc, "histogram.cl", NULL);
+    if (h->program) h->kernel = clCreateKernel(h->program, "histogram256", &error);
+
+    h->input = clCreateBuffer(bc->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                              n * sizeof(cl_uint), data, &error);
+    h->bins  = clCreateBuffer(bc->context, CL_MEM_WRITE_ONLY,
+                              h->groups * BIN_SIZE * sizeof(cl_uint), NULL, &error);
+    free(data);
+
+    if (h->kernel == NULL || h->input == NULL || h->bins == NULL) {
+        teardown(h);
+        return NULL;
+    }
+
+    clSetKernelArg(h->kernel, 0, sizeof(cl_mem), &h->input);
+    clSetKernelArg(h->kernel, 1, BIN_SIZE * GROUP_SIZE * sizeof(cl_uchar), NULL);
+    clSetKernelArg(h->kernel, 2, sizeof(cl_mem), &h->bins);
+    return h;
+}
+
+static double run(void* state) {
+    Histogram* h = (Histogram*)state;
+    size_t global = h->n / BIN_SIZE, local = GROUP_SIZE;
+    cl_event e;
+
+    cl_int error = clEnqueueNDRangeKernel(h->bc->queue, h->kernel, 1, NULL, &global, &local,
+                                          0, NULL, &e);
+    return benchFinish(error, &e, error == CL_SUCCESS);
+}
+
+static int check(void* state) {
+    Histogram* h = (Histogram*)state;
+    cl_uint* sub = (cl_uint*)malloc(h->groups * BIN_SIZE * sizeof(cl_uint));
+    cl_uint  bins[BIN_SIZE];
+
+    clEnqueueReadBuffer(h->bc->queue, h->bins, CL_TRUE, 0, h->groups * BIN_SIZE * sizeof(cl_uint),
+                        sub, 0, NULL, NULL);
+    memset(bins, 0, sizeof(bins));
+    for(size_t g = 0; g < h->groups; ++g)
+        for(int b = 0; b < BIN_SIZE; ++b) bins[b] += sub[g * BIN_SIZE + b];
+    free(sub);
+    return !memcmp(bins, h->expected, sizeof(bins));
+}
+
+static double work(size_t n) {
+    return n * sizeof(cl_uint);
+}
+
+static void teardown(void* state) {
+    Histogram* h = (Histogram*)state;
+    if (h->kernel)  clReleaseKernel(h->kernel);
+    if (h->program) clReleaseProgram(h->program);
+    if (h->input)   clReleaseMemObject(h->input);
+    if (h->bins)    clReleaseMemObject(h->bins);
+    free(h);
+}
+
+static const size_t sizes[] = {1 << 20, 1 << 22, 1 << 24, 0};
+
+const Benchmark histogramBenchmark = {
+    "histogram", "GB/s", 1e9, "values", sizes, setup, run, check, work, teardown
+};
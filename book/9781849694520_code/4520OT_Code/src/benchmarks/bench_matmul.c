@@ -0,0 +1,109 @@
+/*
+ mmmult of Ch7/matrix_multiplication_03: one work-item per row of the
+ product of two n x n integer matrices, with the row of A kept in private
+ memory (n is at most 1024). The check recomputes a few rows on the host.
+*/
+#include <stdlib.h>
+#include "bench.h"
+
+#define MAX_ORDER   1024                        // tmpData[1024] in mmult.cl
+#define CHECKED_ROWS 16
+
+typedef struct Matmul {
+    const BenchContext* bc;
+    cl_program program;
+    cl_kernel  kernel;
+    cl_mem     a, b, c;
+    cl_int     n;
+    cl_uint*   A;
+    cl_uint*   B;
+} Matmul;
+
+static void teardown(void* state);
+
+static void* setup(const BenchContext* bc, size_t n) {
+    if (n == 0 || n > MAX_ORDER) return NULL;
+
+    Matmul* m = (Matmul*)calloc(1, sizeof(Matmul));
+    cl_int  error = CL_SUCCESS;
+
+    m->bc = bc;
+    m->n  = (cl_int)n;
+    m->A  = (cl_uint*)malloc(n * n * sizeof(cl_uint));
+    m->B  = (cl_uint*)malloc(n * n * sizeof(cl_uint));
+    benchRandom(m->A, n * n, 16, 6);
+    benchRandom(m->B, n * n, 16, 7);
+
+    m->program = benchProgram(bc, "mmult.cl", NULL);
+    if (m->program) m->kernel = clCreateKernel(m->program, "mmmult", &error);
+
+    m->a = clCreateBuffer(bc->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                          n * n * sizeof(cl_int), m->A, &error);
+    m->b = clCreateBuffer(bc->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                          n * n * sizeof(cl_int), m->B, &error);
+    m->c = clCreateBuffer(bc->context, CL_MEM_WRITE_ONLY, n * n * sizeof(cl_int), NULL, &error);
+
+    if (!m->kernel || !m->a || !m->b || !m->c) {
+        teardown(m);
+        return NULL;
+    }
+
+    clSetKernelArg(m->kernel, 0, sizeof(cl_int), &m->n);
+    clSetKernelArg(m->kernel, 1, sizeof(cl_int), &m->n);
+    clSetKernelArg(m->kernel, 2, sizeof(cl_mem), &m->a);
+    clSetKernelArg(m->kernel, 3, sizeof(cl_mem), &m->b);
+    clSetKernelArg(m->kernel, 4, sizeof(cl_mem), &m->c);
+    return m;
+}
+
+static double run(void* state) {
+    Matmul*  m = (Matmul*)state;
+    size_t   global = m->n;
+    cl_event e;
+
+    cl_int error = clEnqueueNDRangeKernel(m->bc->queue, m->kernel, 1, NULL, &global, NULL,
+                                          0, NULL, &e);
+    return benchFinish(error, &e, error == CL_SUCCESS);
+}
+
+static int check(void* state) {
+    Matmul*  m = (Matmul*)state;
+    cl_int   n = m->n;
+    cl_uint* row = (cl_uint*)malloc(n * sizeof(cl_uint));
+    int      ok = 1;
+
+    for(int r = 0; r < CHECKED_ROWS && ok; ++r) {
+        int i = (int)((long)r * (n - 1) / (CHECKED_ROWS - 1));
+        clEnqueueReadBuffer(m->bc->queue, m->c, CL_TRUE, i * n * sizeof(cl_int),
+                            n * sizeof(cl_int), row, 0, NULL, NULL);
+        for(int j = 0; j < n && ok; ++j) {
+            cl_uint sum = 0;
+            for(int k = 0; k < n; ++k) sum += m->A[i * n + k] * m->B[k * n + j];
+            ok = row[j] == sum;
+        }
+    }
+    free(row);
+    return ok;
+}
+
+static double work(size_t n) {
+    return 2.0 * n * n * n;
+}
+
+static void teardown(void* state) {
+    Matmul* m = (Matmul*)state;
+    if (m->kernel)  clReleaseKernel(m->kernel);
+    if (m->program) clReleaseProgram(m->program);
+    if (m->a)       clReleaseMemObject(m->a);
+    if (m->b)       clReleaseMemObject(m->b);
+    if (m->c)       clReleaseMemObject(m->c);
+    free(m->A);
+    free(m->B);
+    free(m);
+}
+
+static const size_t sizes[] = {256, 512, 1024, 0};
+
+const Benchmark matmulBenchmark = {
+    "matmul", "GOP/s", 1e9, "order", sizes, setup, run, check, work, teardown
+};
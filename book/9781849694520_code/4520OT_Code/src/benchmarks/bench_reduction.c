@@ -0,0 +1,95 @@
+/*
+ reduce4 of Ch10/Reduction: every work-group sums 2 * BLOCK_SIZE integers
+ in local memory with the last wavefront unrolled. One run is a launch
+ over all n integers; the partial sums are added on the host for the check.
+*/
+#include <stdlib.h>
+#include "bench.h"
+
+#define BLOCK_SIZE 256                          // must match reduction.cl
+
+typedef struct Reduction {
+    const BenchContext* bc;
+    cl_program program;
+    cl_kernel  kernel;
+    cl_mem     input, output;
+    size_t     n, groups;
+    cl_uint    expected;
+} Reduction;
+
+static void teardown(void* state);
+
+static void* setup(const BenchContext* bc, size_t n) {
+    if (n % (2 * BLOCK_SIZE)) return NULL;
+
+    Reduction* r = (Reduction*)calloc(1, sizeof(Reduction));
+    cl_int error = CL_SUCCESS;
+
+    r->bc     = bc;
+    r->n      = n;
+    r->groups = n / (2 * BLOCK_SIZE);
+
+    cl_uint* data = (cl_uint*)malloc(n * sizeof(cl_uint));
+    benchRandom(data, n, 1024, 1);
+    for(size_t i = 0; i < n; ++i) r->expected += data[i];
+
+    r->program = benchProgram(bc, "reduction.cl", NULL);
+    if (r->program) r->kernel = clCreateKernel(r->program, "reduce4", &error);
+
+    r->input  = clCreateBuffer(bc->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                               n * sizeof(cl_uint), data, &error);
+    r->output = clCreateBuffer(bc->context, CL_MEM_WRITE_ONLY,
+                               r->groups * sizeof(cl_uint), NULL, &error);
+    free(data);
+
+    if (r->kernel == NULL || r->input == NULL || r->output == NULL) {
+        teardown(r);
+        return NULL;
+    }
+
+    clSetKernelArg(r->kernel, 0, sizeof(cl_mem), &r->input);
+    clSetKernelArg(r->kernel, 1, sizeof(cl_mem), &r->output);
+    clSetKernelArg(r->kernel, 2, BLOCK_SIZE * sizeof(cl_uint), NULL);
+    return r;
+}
+
+static double run(void* state) {
+    Reduction* r = (Reduction*)state;
+    size_t global = r->n / 2, local = BLOCK_SIZE;
+    cl_event e;
+
+    cl_int error = clEnqueueNDRangeKernel(r->bc->queue, r->kernel, 1, NULL, &global, &local,
+                                          0, NULL, &e);
+    return benchFinish(error, &e, error == CL_SUCCESS);
+}
+
+static int check(void* state) {
+    Reduction* r = (Reduction*)state;
+    cl_uint* partial = (cl_uint*)malloc(r->groups * sizeof(cl_uint));
+    cl_uint  sum = 0;
+
+    clEnqueueReadBuffer(r->bc->queue, r->output, CL_TRUE, 0, r->groups * sizeof(cl_uint),
+                        partial, 0, NULL, NULL);
+    for(size_t g = 0; g < r->groups; ++g) sum += partial[g];
+    free(partial);
+    return sum == r->expected;
+}
+
+static double work(size_t n) {
+    return n * sizeof(cl_uint);
+}
+
+static void teardown(void* state) {
+    Reduction* r = (Reduction*)state;
+    if (r->kernel)  clReleaseKernel(r->kernel);
+    if (r->program) clReleaseProgram(r->program);
+    if (r->input)   clReleaseMemObject(r->input);
+    if (r->output)  clReleaseMemObject(r->output);
+    free(r);
+}
+
+static const size_t sizes[] = {1 << 20, 1 << 22, 1 << 24, 0};
+
+const Benchmark reductionBenchmark = {
+    "reduction", "GB/s", 1e9, "integers", sizes, setup, run, check, work, teardown
+};
@@ -0,0 +1,123 @@
+/*
+ SobelDetectorTiled of Ch6/sobelfilter on a random size x size RGBA
+ image, with 16 x 16 work-groups staging their pixels and a one pixel apron
+ in local memory. The check filters the image on the host.
+*/
+#include <stdlib.h>
+#include <math.h>
+#include "bench.h"
+
+#define TILE_X 16
+#define TILE_Y 16
+
+typedef struct Sobel {
+    const BenchContext* bc;
+    cl_program     program;
+    cl_kernel      kernel;
+    cl_mem         input, output;
+    cl_uint        size;
+    unsigned char* image;
+} Sobel;
+
+static void teardown(void* state);
+
+static void* setup(const BenchContext* bc, size_t size) {
+    size_t maxGroup = 0;
+    clGetDeviceInfo(bc->device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(maxGroup), &maxGroup, NULL);
+    if (maxGroup < TILE_X * TILE_Y || size == 0 || size > 16384) return NULL;
+
+    Sobel* s = (Sobel*)calloc(1, sizeof(Sobel));
+    size_t bytes = size * size * 4;
+    cl_int error = CL_SUCCESS;
+
+    s->bc    = bc;
+    s->size  = (cl_uint)size;
+    s->image = (unsigned char*)malloc(bytes);
+
+    cl_uint* noise = (cl_uint*)malloc(size * size * sizeof(cl_uint));
+    benchRandom(noise, size * size, 0, 8);
+    for(size_t i = 0; i < size * size; ++i)
+        for(int c = 0; c < 4; ++c) s->image[4 * i + c] = (unsigned char)(noise[i] >> (8 * c));
+    free(noise);
+
+    s->program = benchProgram(bc, "sobel_detector.cl", NULL);
+    if (s->program) s->kernel = clCreateKernel(s->program, "SobelDetectorTiled", &error);
+
+    s->input  = clCreateBuffer(bc->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                               bytes, s->image, &error);
+    s->output = clCreateBuffer(bc->context, CL_MEM_WRITE_ONLY, bytes, NULL, &error);
+
+    if (!s->kernel || !s->input || !s->output) {
+        teardown(s);
+        return NULL;
+    }
+
+    clSetKernelArg(s->kernel, 0, sizeof(cl_mem), &s->input);
+    clSetKernelArg(s->kernel, 1, sizeof(cl_mem), &s->output);
+    clSetKernelArg(s->kernel, 2, sizeof(cl_uint), &s->size);
+    clSetKernelArg(s->kernel, 3, sizeof(cl_uint), &s->size);
+    clSetKernelArg(s->kernel, 4, (TILE_X + 2) * (TILE_Y + 2) * 4, NULL);
+    return s;
+}
+
+static double run(void* state) {
+    Sobel*   s = (Sobel*)state;
+    size_t   global[] = {(s->size + TILE_X - 1) / TILE_X * TILE_X,
+                         (s->size + TILE_Y - 1) / TILE_Y * TILE_Y};
+    size_t   local[]  = {TILE_X, TILE_Y};
+    cl_event e;
+
+    cl_int error = clEnqueueNDRangeKernel(s->bc->queue, s->kernel, 2, NULL, global, local,
+                                          0, NULL, &e);
+    return benchFinish(error, &e, error == CL_SUCCESS);
+}
+
+static int pixel(const Sobel* s, int x, int y, int c) {
+    int last = (int)s->size - 1;
+    x = x < 0 ? 0 : x > last ? last : x;
+    y = y < 0 ? 0 : y > last ? last : y;
+    return s->image[4 * (x + y * s->size) + c];
+}
+
+static int check(void* state) {
+    Sobel*         s = (Sobel*)state;
+    size_t         bytes = (size_t)s->size * s->size * 4;
+    unsigned char* out = (unsigned char*)malloc(bytes);
+    int            ok = 1;
+
+    clEnqueueReadBuffer(s->bc->queue, s->output, CL_TRUE, 0, bytes, out, 0, NULL, NULL);
+
+    for(int y = 0; y < (int)s->size && ok; ++y)
+        for(int x = 0; x < (int)s->size && ok; ++x)
+            for(int c = 0; c < 4; ++c) {
+#define P(dx, dy) pixel(s, x + (dx), y + (dy), c)
+                float gx = P(-1, -1) + 2 * P(0, -1) + P(1, -1) - P(-1, 1) - 2 * P(0, 1) - P(1, 1);
+                float gy = P(-1, -1) - P(1, -1) + 2 * P(-1, 0) - 2 * P(1, 0) + P(-1, 1) - P(1, 1);
+#undef P
+                float g = sqrtf(gx * gx + gy * gy) / 2;
+                // convert_uchar4 is only defined in range, allow one for rounding
+                if (g < 255 && fabsf(out[4 * (x + y * s->size) + c] - g) > 1) ok = 0;
+            }
+    free(out);
+    return ok;
+}
+
+static double work(size_t size) {
+    return 8.0 * size * size;                   // one RGBA read and write per pixel
+}
+
+static void teardown(void* state) {
+    Sobel* s = (Sobel*)state;
+    if (s->kernel)  clReleaseKernel(s->kernel);
+    if (s->program) clReleaseProgram(s->program);
+    if (s->input)   clReleaseMemObject(s->input);
+    if (s->output)  clReleaseMemObject(s->output);
+    free(s->image);
+    free(s);
+}
+
+static const size_t sizes[] = {512, 1024, 2048, 4096, 0};
+
+const Benchmark sobelBenchmark = {
+    "sobel", "GB/s", 1e9, "pixels^2", sizes, setup, run, check, work, teardown
+};
@@ -0,0 +1,137 @@
+/*
+ Hybrid sort of Ch9/BitonicSort_GPU: bitonicSortTiles sorts TILE keys per
+ work-group in local memory, then mergePath passes double the sorted runs.
+ Every run starts from a fresh copy of the unsorted keys; the copy is not
+ timed.
+*/
+#include <stdlib.h>
+#include "bench.h"
+
+#define GROUP_SIZE      256                     // must match BitonicSort.cl
+#define TILE            (GROUP_SIZE * 8)
+#define ITEMS_PER_MERGE 8
+#define MAX_PASSES      32
+
+typedef struct Sort {
+    const BenchContext* bc;
+    cl_program program;
+    cl_kernel  tiles, merge;
+    cl_mem     keys, data, temp, result;
+    cl_uint    n;
+} Sort;
+
+static void teardown(void* state);
+
+static void* setup(const BenchContext* bc, size_t n) {
+    size_t maxGroup = 0;
+    clGetDeviceInfo(bc->device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(maxGroup), &maxGroup, NULL);
+    if (maxGroup < GROUP_SIZE || n < 2 || n > 0xffffffffu / 2) return NULL;
+
+    Sort* s = (Sort*)calloc(1, sizeof(Sort));
+    cl_int error = CL_SUCCESS;
+
+    s->bc = bc;
+    s->n  = (cl_uint)n;
+
+    cl_uint* keys = (cl_uint*)malloc(n * sizeof(cl_uint));
+    benchRandom(keys, n, 0, 3);
+
+    s->program = benchProgram(bc, "BitonicSort.cl", NULL);
+    if (s->program) {
+        s->tiles = clCreateKernel(s->program, "bitonicSortTiles", &error);
+        s->merge = clCreateKernel(s->program, "mergePath", &error);
+    }
+
+    s->keys = clCreateBuffer(bc->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                             n * sizeof(cl_uint), keys, &error);
+    s->data = clCreateBuffer(bc->context, CL_MEM_READ_WRITE, n * sizeof(cl_uint), NULL, &error);
+    s->temp = clCreateBuffer(bc->context, CL_MEM_READ_WRITE, n * sizeof(cl_uint), NULL, &error);
+    free(keys);
+
+    if (!s->tiles || !s->merge || !s->keys || !s->data || !s->temp) {
+        teardown(s);
+        return NULL;
+    }
+    return s;
+}
+
+static double run(void* state) {
+    Sort*    s = (Sort*)state;
+    cl_event events[MAX_PASSES + 1];
+    cl_uint  count = 0;
+    cl_int   error;
+
+    error = clEnqueueCopyBuffer(s->bc->queue, s->keys, s->data, 0, 0, s->n * sizeof(cl_uint),
+                                0, NULL, NULL);
+
+    size_t groups = (s->n + TILE - 1) / TILE;
+    size_t global = groups * GROUP_SIZE, local = GROUP_SIZE;
+
+    clSetKernelArg(s->tiles, 0, sizeof(cl_mem), &s->data);
+    clSetKernelArg(s->tiles, 1, sizeof(cl_uint), &s->n);
+    clSetKernelArg(s->tiles, 2, TILE * sizeof(cl_uint), NULL);
+    if (error == CL_SUCCESS)
+        error = clEnqueueNDRangeKernel(s->bc->queue, s->tiles, 1, NULL, &global, &local,
+                                       0, NULL, &events[count]);
+    if (error == CL_SUCCESS) ++count;
+
+    size_t items = (s->n + ITEMS_PER_MERGE - 1) / ITEMS_PER_MERGE;
+    global = (items + GROUP_SIZE - 1) / GROUP_SIZE * GROUP_SIZE;
+
+    cl_mem src = s->data, dst = s->temp;
+    for(cl_uint width = TILE; width < s->n && error == CL_SUCCESS; width <<= 1) {
+        clSetKernelArg(s->merge, 0, sizeof(cl_mem), &src);
+        clSetKernelArg(s->merge, 1, sizeof(cl_mem), &dst);
+        clSetKernelArg(s->merge, 2, sizeof(cl_uint), &s->n);
+        clSetKernelArg(s->merge, 3, sizeof(cl_uint), &width);
+        error = clEnqueueNDRangeKernel(s->bc->queue, s->merge, 1, NULL, &global, &local,
+                                       0, NULL, &events[count]);
+        if (error == CL_SUCCESS) ++count;
+        cl_mem t = src; src = dst; dst = t;
+    }
+    s->result = src;
+
+    return benchFinish(error, events, count);
+}
+
+static int check(void* state) {
+    Sort*    s = (Sort*)state;
+    cl_uint* x = (cl_uint*)malloc(s->n * sizeof(cl_uint));
+    cl_uint* y = (cl_uint*)malloc(s->n * sizeof(cl_uint));
+    int      ok = 1;
+
+    clEnqueueReadBuffer(s->bc->queue, s->result, CL_TRUE, 0, s->n * sizeof(cl_uint), x, 0, NULL, NULL);
+    clEnqueueReadBuffer(s->bc->queue, s->keys, CL_TRUE, 0, s->n * sizeof(cl_uint), y, 0, NULL, NULL);
+
+    // sorted, and a permutation of the keys: same sum and xor
+    cl_uint sx = 0, sy = 0, xx = 0, xy = 0;
+    for(cl_uint i = 0; i < s->n; ++i) {
+        if (i && x[i - 1] > x[i]) ok = 0;
+        sx += x[i]; xx ^= x[i];
+        sy += y[i]; xy ^= y[i];
+    }
+    free(x);
+    free(y);
+    return ok && sx == sy && xx == xy;
+}
+
+static double work(size_t n) {
+    return (double)n;
+}
+
+static void teardown(void* state) {
+    Sort* s = (Sort*)state;
+    if (s->tiles)   clReleaseKernel(s->tiles);
+    if (s->merge)   clReleaseKernel(s->merge);
+    if (s->program) clReleaseProgram(s->program);
+    if (s->keys)    clReleaseMemObject(s->keys);
+    if (s->data)    clReleaseMemObject(s->data);
+    if (s->temp)    clReleaseMemObject(s->temp);
+    free(s);
+}
+
+static const size_t sizes[] = {1 << 16, 1 << 20, 1 << 24, 0};
+
+const Benchmark sortBenchmark = {
+    "sort", "Mkeys/s", 1e6, "keys", sizes, setup, run, check, work, teardown
+};
@@ -0,0 +1,131 @@
+/*
+ spmv_csr_vector_kernel of Ch8/SpMV in single precision: VECTOR_SIZE
+ work-items share every row of a CSR matrix. The matrix has ROW_NNZ
+ nonzeros per row, in random columns, so the gathers from the vector are
+ irregular.
+*/
+#include <stdlib.h>
+#include <math.h>
+#include "bench.h"
+
+#define VECTOR_SIZE 32
+#define GROUP_SIZE  128                         // partialSums[128] in spmv.cl
+#define ROW_NNZ     32
+
+typedef struct Spmv {
+    const BenchContext* bc;
+    cl_program program;
+    cl_kernel  kernel;
+    cl_mem     val, vec, cols, rows, out;
+    cl_int     n;
+    float*     expected;
+} Spmv;
+
+static void teardown(void* state);
+
+static void* setup(const BenchContext* bc, size_t n) {
+    size_t maxGroup = 0;
+    clGetDeviceInfo(bc->device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(maxGroup), &maxGroup, NULL);
+    if (maxGroup < GROUP_SIZE || n > 0x7fffffff / ROW_NNZ) return NULL;
+
+    Spmv*  s = (Spmv*)calloc(1, sizeof(Spmv));
+    size_t nnz = n * ROW_NNZ;
+    cl_int error = CL_SUCCESS;
+
+    s->bc = bc;
+    s->n  = (cl_int)n;
+
+    float*   val   = (float*)malloc(nnz * sizeof(float));
+    float*   vec   = (float*)malloc(n * sizeof(float));
+    cl_uint* cols  = (cl_uint*)malloc(nnz * sizeof(cl_uint));
+    cl_int*  rows  = (cl_int*)malloc((n + 1) * sizeof(cl_int));
+    cl_uint* noise = (cl_uint*)malloc(nnz * sizeof(cl_uint));
+
+    benchRandom(cols, nnz, (cl_uint)n, 4);
+    benchRandom(noise, nnz, 1000, 5);
+    for(size_t i = 0; i < nnz; ++i) val[i] = noise[i] * 1e-3f - 0.5f;
+    for(size_t i = 0; i < n; ++i)   vec[i] = noise[i] * 1e-3f;
+    for(size_t i = 0; i <= n; ++i)  rows[i] = (cl_int)(i * ROW_NNZ);
+
+    s->expected = (float*)malloc(n * sizeof(float));
+    for(size_t i = 0; i < n; ++i) {
+        double sum = 0;
+        for(size_t j = i * ROW_NNZ; j < (i + 1) * ROW_NNZ; ++j) sum += val[j] * vec[cols[j]];
+        s->expected[i] = (float)sum;
+    }
+
+    s->program = benchProgram(bc, "spmv.cl", "-DSINGLE_PRECISION -DVECTOR_SIZE=32");
+    if (s->program) s->kernel = clCreateKernel(s->program, "spmv_csr_vector_kernel", &error);
+
+    cl_mem_flags in = CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR;
+    s->val  = clCreateBuffer(bc->context, in, nnz * sizeof(float), val, &error);
+    s->vec  = clCreateBuffer(bc->context, in, n * sizeof(float), vec, &error);
+    s->cols = clCreateBuffer(bc->context, in, nnz * sizeof(cl_int), cols, &error);
+    s->rows = clCreateBuffer(bc->context, in, (n + 1) * sizeof(cl_int), rows, &error);
+    s->out  = clCreateBuffer(bc->context, CL_MEM_WRITE_ONLY, n * sizeof(float), NULL, &error);
+
+    free(val);
+    free(vec);
+    free(cols);
+    free(rows);
+    free(noise);
+
+    if (!s->kernel || !s->val || !s->vec || !s->cols || !s->rows || !s->out) {
+        teardown(s);
+        return NULL;
+    }
+
+    clSetKernelArg(s->kernel, 0, sizeof(cl_mem), &s->val);
+    clSetKernelArg(s->kernel, 1, sizeof(cl_mem), &s->vec);
+    clSetKernelArg(s->kernel, 2, sizeof(cl_mem), &s->cols);
+    clSetKernelArg(s->kernel, 3, sizeof(cl_mem), &s->rows);
+    clSetKernelArg(s->kernel, 4, sizeof(cl_int), &s->n);
+    clSetKernelArg(s->kernel, 5, sizeof(cl_mem), &s->out);
+    return s;
+}
+
+static double run(void* state) {
+    Spmv*    s = (Spmv*)state;
+    size_t   rowsPerGroup = GROUP_SIZE / VECTOR_SIZE;
+    size_t   global = (s->n + rowsPerGroup - 1) / rowsPerGroup * GROUP_SIZE, local = GROUP_SIZE;
+    cl_event e;
+
+    cl_int error = clEnqueueNDRangeKernel(s->bc->queue, s->kernel, 1, NULL, &global, &local,
+                                          0, NULL, &e);
+    return benchFinish(error, &e, error == CL_SUCCESS);
+}
+
+static int check(void* state) {
+    Spmv*  s = (Spmv*)state;
+    float* out = (float*)malloc(s->n * sizeof(float));
+    int    ok = 1;
+
+    clEnqueueReadBuffer(s->bc->queue, s->out, CL_TRUE, 0, s->n * sizeof(float), out, 0, NULL, NULL);
+    for(cl_int i = 0; i < s->n && ok; ++i)
+        ok = fabsf(out[i] - s->expected[i]) <= 1e-4f * (1 + fabsf(s->expected[i]));
+    free(out);
+    return ok;
+}
+
+static double work(size_t n) {
+    return 2.0 * ROW_NNZ * n;
+}
+
+static void teardown(void* state) {
+    Spmv* s = (Spmv*)state;
+    if (s->kernel)  clReleaseKernel(s->kernel);
+    if (s->program) clReleaseProgram(s->program);
+    if (s->val)     clReleaseMemObject(s->val);
+    if (s->vec)     clReleaseMemObject(s->vec);
+    if (s->cols)    clReleaseMemObject(s->cols);
+    if (s->rows)    clReleaseMemObject(s->rows);
+    if (s->out)     clReleaseMemObject(s->out);
+    free(s->expected);
+    free(s);
+}
+
+static const size_t sizes[] = {1 << 14, 1 << 17, 1 << 20, 0};
+
+const Benchmark spmvBenchmark = {
+    "spmv", "GFLOP/s", 1e9, "rows", sizes, setup, run, check, work, teardown
+};
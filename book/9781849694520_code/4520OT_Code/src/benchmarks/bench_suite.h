@@ -0,0 +1,36 @@
+#ifndef BENCH_SUITE_H
+#define BENCH_SUITE_H
+
+#include "bench.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The sample kernels, one file each */
+extern const Benchmark reductionBenchmark;    /* Ch10/Reduction */
+extern const Benchmark histogramBenchmark;    /* Ch5/histogram */
+extern const Benchmark sortBenchmark;         /* Ch9/BitonicSort_GPU */
+extern const Benchmark spmvBenchmark;         /* Ch8/SpMV */
+extern const Benchmark matmulBenchmark;       /* Ch7/matrix_multiplication_03 */
+extern const Benchmark sobelBenchmark;        /* Ch6/sobelfilter */
+extern const Benchmark gemvBenchmark;         /* Ch4/simple_dot_product */
+extern const Benchmark gemvTBenchmark;        /* Ch4/simple_dot_product, A^T x */
+
+#ifdef HAVE_VEXCL
+/* VexCL primitives on the same device, from bench_vexcl.cpp */
+extern const Benchmark* const vexclBenchmarks[];
+extern const unsigned int vexclBenchmarkCount;
+#endif
+
+/*
+ Parses the command line, then runs the selected benchmarks of suite on
+ the selected devices and writes the results. Returns the exit status.
+*/
+int benchMain(int argc, char** argv, const Benchmark* const* suite, unsigned int count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
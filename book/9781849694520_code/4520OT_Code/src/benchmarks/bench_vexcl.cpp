@@ -0,0 +1,334 @@
+/*
+ VexCL primitives on the device and queue of the harness. A run is timed
+ from a marker enqueued before the operation to one enqueued after it, so
+ operations made of several kernels, or with host work in between, are
+ timed as a whole.
+*/
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <functional>
+#include <vector>
+#include <vexcl/vexcl.hpp>
+#include <vexcl/gemm.hpp>
+
+#include "bench_suite.h"
+
+namespace {
+
+const size_t row_nnz = 32;
+
+// Base of the VexCL benchmarks: a vex::Context wrapping the harness queue.
+struct vexcl_state {
+    vex::Context ctx;
+
+    vexcl_state(const BenchContext *bc) : ctx(user_queue(bc)) {}
+    virtual ~vexcl_state() {}
+
+    // Untimed, before every run.
+    virtual void prepare() {}
+    // The timed operation.
+    virtual void operator()() = 0;
+    virtual bool check() = 0;
+
+    static std::vector<std::pair<cl::Context, cl::CommandQueue>>
+    user_queue(const BenchContext *bc) {
+        return std::vector<std::pair<cl::Context, cl::CommandQueue>>(1,
+                std::make_pair(vex::shared_context(bc->context), vex::shared_queue(bc->queue)));
+    }
+};
+
+std::vector<cl_uint> random_uints(size_t n, cl_uint range, unsigned seed) {
+    std::vector<cl_uint> v(n);
+    benchRandom(v.data(), n, range, seed);
+    return v;
+}
+
+struct axpy : vexcl_state {
+    vex::vector<float> x, y, z;
+
+    axpy(const BenchContext *bc, size_t n)
+        : vexcl_state(bc), x(ctx, n), y(ctx, n), z(ctx, n)
+    {
+        x = vex::element_index();
+        y = 1;
+    }
+
+    void operator()() { z = 2 * x + y; }
+
+    bool check() {
+        size_t n = z.size(), k = n / 3;
+        return z[0] == 1 && z[k] == 2.0f * k + 1 && z[n - 1] == 2.0f * (n - 1) + 1;
+    }
+
+    static double work(size_t n) { return 3.0 * n * sizeof(float); }
+};
+
+struct reduce : vexcl_state {
+    vex::vector<float> x;
+    vex::Reductor<float, vex::SUM> sum;
+    float result;
+
+    reduce(const BenchContext *bc, size_t n)
+        : vexcl_state(bc), x(ctx, n), sum(ctx), result(0)
+    {
+        x = 1;
+    }
+
+    void operator()() { result = sum(x); }
+
+    // integers stay exact in float up to 2^24
+    bool check() { return x.size() > (1 << 24) || result == x.size(); }
+
+    static double work(size_t n) { return 1.0 * n * sizeof(float); }
+};
+
+struct scan : vexcl_state {
+    vex::vector<cl_uint> x, y;
+
+    scan(const BenchContext *bc, size_t n) : vexcl_state(bc), x(ctx, n), y(ctx, n) {
+        x = 1;
+    }
+
+    void operator()() { vex::inclusive_scan(x, y); }
+
+    bool check() {
+        size_t n = y.size();
+        return y[0] == 1 && y[n / 2] == n / 2 + 1 && y[n - 1] == n;
+    }
+
+    static double work(size_t n) { return 2.0 * n * sizeof(cl_uint); }
+};
+
+struct sort : vexcl_state {
+    vex::vector<cl_uint> keys, x;
+
+    sort(const BenchContext *bc, size_t n)
+        : vexcl_state(bc), keys(ctx, random_uints(n, 0, 9)), x(ctx, n) {}
+
+    void prepare() { x = keys; }
+
+    void operator()() { vex::sort(x); }
+
+    bool check() {
+        std::vector<cl_uint> h(x.size());
+        vex::copy(x, h);
+        return std::is_sorted(h.begin(), h.end());
+    }
+
+    static double work(size_t n) { return 1.0 * n; }
+};
+
+// The 100 largest of random keys, to compare with sorting all of them.
+struct topk : vexcl_state {
+    std::vector<cl_uint> hkeys;
+    vex::vector<cl_uint> keys;
+    std::vector<cl_uint> result;
+
+    topk(const BenchContext *bc, size_t n)
+        : vexcl_state(bc), hkeys(random_uints(n, 0, 9)), keys(ctx, hkeys) {}
+
+    void operator()() { result = vex::top_k(keys, 100); }
+
+    bool check() {
+        std::vector<cl_uint> h = hkeys;
+        std::partial_sort(h.begin(), h.begin() + 100, h.end(), std::greater<cl_uint>());
+        return result.size() == 100 && std::equal(result.begin(), result.end(), h.begin());
+    }
+
+    static double work(size_t n) { return 1.0 * n; }
+};
+
+VEX_FUNCTION_TYPE(quarter_disk, float(float, float),
+        "return prm1 * prm1 + prm2 * prm2 < 1 ? 4.0f : 0.0f;");
+
+// Estimate of pi from n points in the unit square, fused into one kernel.
+struct montecarlo : vexcl_state {
+    size_t n;
+    vex::MonteCarlo<float> mc;
+    vex::monte_carlo_estimate<float> result;
+
+    montecarlo(const BenchContext *bc, size_t n) : vexcl_state(bc), n(n), mc(ctx, 7) {
+        result.samples = 0;
+    }
+
+    void operator()() { result = mc.uniform<2>(quarter_disk(), n); }
+
+    bool check() {
+        return result.samples >= n && std::fabs(result.mean - 3.14159265f) < 5 * result.error;
+    }
+
+    static double work(size_t n) { return 1.0 * n; }
+};
+
+// Back-to-back assignments to a small vector, so that the device waits on
+// the host and the time between the markers is the cost of the launches.
+struct launch : vexcl_state {
+    size_t count;
+    vex::vector<float> x, y;
+    float a;
+
+    launch(const BenchContext *bc, size_t n)
+        : vexcl_state(bc), count(n), x(ctx, 1024), y(ctx, 1024), a(0)
+    {
+        x = 1;
+        y = 0;
+    }
+
+    void prepare() { a = 0; }
+
+    // a changes every time, as a loop counter would
+    void operator()() {
+        for(size_t i = 0; i < count; ++i) y = x * (a += 1) + y;
+    }
+
+    bool check() {
+        float s = 0.5f * count * (count + 1);
+        return std::fabs(y[0] - s) <= 1e-3f * s;
+    }
+
+    static double work(size_t n) { return 1.0 * n; }
+};
+
+// Host CSR matrix with row_nnz nonzeros per row, in random columns.
+struct csr_matrix {
+    std::vector<size_t> row, col;
+    std::vector<float>  val, hx;
+
+    csr_matrix(size_t n) : row(n + 1), col(n * row_nnz), val(n * row_nnz), hx(n) {
+        std::vector<cl_uint> c = random_uints(n * row_nnz, static_cast<cl_uint>(n), 4);
+        std::vector<cl_uint> v = random_uints(n * row_nnz, 1000, 5);
+
+        for(size_t i = 0; i <= n; ++i) row[i] = i * row_nnz;
+        for(size_t i = 0; i < n; ++i) {
+            // sorted columns, as SpMat expects them
+            std::sort(c.begin() + row[i], c.begin() + row[i + 1]);
+            for(size_t j = row[i]; j < row[i + 1]; ++j) {
+                col[j] = c[j];
+                val[j] = v[j] * 1e-3f - 0.5f;
+            }
+            hx[i] = v[i] * 1e-3f;
+        }
+    }
+};
+
+struct spmv : vexcl_state, csr_matrix {
+    vex::SpMat<float>  A;
+    vex::vector<float> x, y;
+
+    spmv(const BenchContext *bc, size_t n)
+        : vexcl_state(bc), csr_matrix(n),
+          A(ctx, n, n, row.data(), col.data(), val.data()), x(ctx, hx), y(ctx, n)
+    {}
+
+    void operator()() { y = A * x; }
+
+    bool check() {
+        size_t n = y.size();
+        for(size_t i = 0; i < n; i += std::max<size_t>(1, n / 64)) {
+            double s = 0;
+            for(size_t j = row[i]; j < row[i + 1]; ++j) s += val[j] * hx[col[j]];
+            if (std::fabs(y[i] - s) > 1e-4 * (1 + std::fabs(s))) return false;
+        }
+        return true;
+    }
+
+    static double work(size_t n) { return 2.0 * row_nnz * n; }
+};
+
+struct gemm : vexcl_state {
+    size_t n;
+    vex::vector<float> A, B, C;
+
+    gemm(const BenchContext *bc, size_t n)
+        : vexcl_state(bc), n(n), A(ctx, n * n), B(ctx, n * n), C(ctx, n * n)
+    {
+        A = 1;
+        B = 0.5f;
+    }
+
+    void operator()() { vex::gemm(n, n, n, 1.0f, A, B, 0.0f, C); }
+
+    // every element is n / 2, exact in float for these orders
+    bool check() {
+        return C[0] == 0.5f * n && C[n * n / 2 + 1] == 0.5f * n && C[n * n - 1] == 0.5f * n;
+    }
+
+    static double work(size_t n) { return 2.0 * n * n * n; }
+};
+
+// C callbacks of a benchmark on top of a vexcl_state.
+template <class S>
+struct callbacks {
+    static void* setup(const BenchContext *bc, size_t n) {
+        try {
+            return new S(bc, n);
+        } catch(const std::exception &e) {
+            fprintf(stderr, "  (%s)\n", e.what());
+            return NULL;
+        }
+    }
+
+    static double run(void *state) {
+        S &s = *static_cast<S*>(state);
+        cl_command_queue q = s.ctx.queue(0)();
+        cl_event marks[2];
+
+        try {
+            s.prepare();
+            clEnqueueMarker(q, &marks[0]);
+            s();
+            clEnqueueMarker(q, &marks[1]);
+        } catch(const std::exception &e) {
+            fprintf(stderr, "  (%s)\n", e.what());
+            return -1;
+        }
+        return benchFinish(CL_SUCCESS, marks, 2);
+    }
+
+    static int check(void *state) {
+        try {
+            return static_cast<S*>(state)->check();
+        } catch(const std::exception&) {
+            return 0;
+        }
+    }
+
+    static double work(size_t n) { return S::work(n); }
+
+    static void teardown(void *state) { delete static_cast<S*>(state); }
+};
+
+#define VEXCL_BENCHMARK(type, unit, scale, meaning, ...)                      \
+  const size_t type##_sizes[] = {__VA_ARGS__, 0};                             \
+  const Benchmark type##_benchmark = {                                        \
+      "vexcl_" #type, unit, scale, meaning, type##_sizes,                     \
+      callbacks<type>::setup, callbacks<type>::run, callbacks<type>::check,   \
+      callbacks<type>::work, callbacks<type>::teardown                        \
+  };
+
+VEXCL_BENCHMARK(axpy,   "GB/s",    1e9, "elements", 1 << 20, 1 << 22, 1 << 24)
+VEXCL_BENCHMARK(reduce, "GB/s",    1e9, "elements", 1 << 20, 1 << 22, 1 << 24)
+VEXCL_BENCHMARK(scan,   "GB/s",    1e9, "elements", 1 << 20, 1 << 22, 1 << 24)
+VEXCL_BENCHMARK(sort,   "Mkeys/s", 1e6, "keys",     1 << 16, 1 << 20, 1 << 24)
+VEXCL_BENCHMARK(topk,   "Mkeys/s", 1e6, "keys",     1 << 16, 1 << 20, 1 << 24)
+VEXCL_BENCHMARK(montecarlo, "Msamples/s", 1e6, "samples", 1 << 20, 1 << 24, 1 << 28)
+VEXCL_BENCHMARK(launch, "Mlaunches/s", 1e6, "launches", 1 << 10, 1 << 12, 1 << 14)
+VEXCL_BENCHMARK(spmv,   "GFLOP/s", 1e9, "rows",     1 << 14, 1 << 17, 1 << 20)
+VEXCL_BENCHMARK(gemm,   "GFLOP/s", 1e9, "order",    256, 512, 1024)
+
+#undef VEXCL_BENCHMARK
+
+} // namespace
+
+extern "C" {
+
+const Benchmark* const vexclBenchmarks[] = {
+    &axpy_benchmark, &reduce_benchmark, &scan_benchmark,
+    &sort_benchmark, &topk_benchmark,   &spmv_benchmark,   &gemm_benchmark,
+    &montecarlo_benchmark, &launch_benchmark
+};
+
+const unsigned int vexclBenchmarkCount = sizeof(vexclBenchmarks) / sizeof(vexclBenchmarks[0]);
+
+}
@@ -0,0 +1,31 @@
+/*
+ Benchmark suite of the sample kernels and the VexCL primitives: warm-up,
+ repeated runs timed with profiling events, size sweeps and text, CSV or
+ JSON output, optionally compared with the CSV of an earlier run.
+
+ Usage: benchmarks --help
+*/
+#include "bench_suite.h"
+
+#define MAX_BENCHMARKS 32
+
+int main(int argc, char** argv) {
+    const Benchmark* suite[MAX_BENCHMARKS] = {
+        &reductionBenchmark,
+        &histogramBenchmark,
+        &sortBenchmark,
+        &spmvBenchmark,
+        &matmulBenchmark,
+        &sobelBenchmark,
+        &gemvBenchmark,
+        &gemvTBenchmark,
+    };
+    unsigned int count = 8;
+
+#ifdef HAVE_VEXCL
+    for(unsigned int i = 0; i < vexclBenchmarkCount && count < MAX_BENCHMARKS; ++i)
+        suite[count++] = vexclBenchmarks[i];
+#endif
+
+    return benchMain(argc, argv, suite, count);
+}
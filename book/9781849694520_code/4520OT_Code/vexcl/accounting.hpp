@@ -0,0 +1,291 @@
+#ifndef VEXCL_ACCOUNTING_HPP
+#define VEXCL_ACCOUNTING_HPP
+
+/*
+The MIT License
+
+Copyright (c) 2012-2013 Denis Demidov <ddemidov@ksu.ru>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/**
+ * \file   vexcl/accounting.hpp
+ * \author Denis Demidov <ddemidov@ksu.ru>
+ * \brief  Accounting of device memory allocations.
+ */
+
+#ifdef WIN32
+#  pragma warning(push)
+#  pragma warning(disable : 4267 4290)
+#  define NOMINMAX
+#endif
+
+#include <map>
+#include <string>
+#include <algorithm>
+#include <boost/chrono.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <CL/cl.hpp>
+
+namespace vex {
+
+/// Accounting of the device buffers allocated by VexCL.
+/**
+ * Every buffer VexCL allocates is recorded under its context and a tag naming
+ * the owner ("vector", "spmat", "fft", "pool" for buffers of the memory pool,
+ * and so on), and is accounted for until OpenCL destroys it, i.e. until the
+ * last cl::Buffer copy of it is released:
+ * \code
+ * vex::memory_account<>::usage u = vex::memory_account<>::of_tag("spmat");
+ * std::cout << u.live << " bytes in " << u.buffers << " buffers, peak "
+ *           << u.peak << std::endl;
+ * \endcode
+ * A budget may be set for a context. An allocation that would exceed it
+ * makes the memory pool release its cached buffers of the context first, and
+ * is refused with std::runtime_error if the budget is still exceeded, before
+ * the device runs out of memory in the middle of a computation.
+ *
+ * \note Release of a buffer is reported by the OpenCL destructor callback,
+ * which some implementations call with a delay after the last reference to
+ * the buffer is gone.
+ */
+template <bool dummy = true>
+class memory_account {
+    static_assert(dummy, "dummy parameter should be true");
+
+    public:
+        /// Memory usage of a context or a tag.
+        struct usage {
+            size_t live;        ///< Bytes currently allocated.
+            size_t peak;        ///< Maximum of live.
+            size_t buffers;     ///< Buffers currently allocated.
+            size_t allocations; ///< Allocations since the last reset().
+            size_t allocated;   ///< Bytes allocated since the last reset().
+            size_t refused;     ///< Allocations refused by the budget.
+
+            usage()
+                : live(0), peak(0), buffers(0),
+                  allocations(0), allocated(0), refused(0)
+            {}
+
+            /// Allocations per second since the last reset().
+            double allocation_rate() const {
+                return allocations / elapsed();
+            }
+
+            /// Allocated bytes per second since the last reset().
+            double byte_rate() const {
+                return allocated / elapsed();
+            }
+        };
+
+        /// Sets memory budget of the context in bytes; zero removes it.
+        static void set_budget(const cl::Context &context, size_t bytes) {
+            boost::lock_guard<boost::mutex> lock(mx);
+            budgets[context()] = bytes;
+        }
+
+        /// Memory budget of the context; zero when there is none.
+        static size_t budget(const cl::Context &context) {
+            boost::lock_guard<boost::mutex> lock(mx);
+
+            auto b = budgets.find(context());
+            return b == budgets.end() ? 0 : b->second;
+        }
+
+        /// Usage of the context.
+        static usage of_context(const cl::Context &context) {
+            boost::lock_guard<boost::mutex> lock(mx);
+
+            auto c = contexts.find(context());
+            return c == contexts.end() ? usage() : c->second;
+        }
+
+        /// Usage of the tag, over all contexts.
+        static usage of_tag(const std::string &tag) {
+            boost::lock_guard<boost::mutex> lock(mx);
+
+            auto t = tags.find(tag);
+            return t == tags.end() ? usage() : t->second;
+        }
+
+        /// Usage of all tags seen so far.
+        static std::map<std::string, usage> by_tag() {
+            boost::lock_guard<boost::mutex> lock(mx);
+            return tags;
+        }
+
+        /// Usage of all contexts.
+        static usage total() {
+            boost::lock_guard<boost::mutex> lock(mx);
+            return all;
+        }
+
+        /// Resets allocation and refusal counters and peaks to the live values.
+        static void reset() {
+            boost::lock_guard<boost::mutex> lock(mx);
+
+            reset(all);
+            for(auto c = contexts.begin(); c != contexts.end(); ++c) reset(c->second);
+            for(auto t = tags.begin(); t != tags.end(); ++t) reset(t->second);
+
+            start = clock::now();
+        }
+
+        /// Seconds since the last reset().
+        static double elapsed() {
+            return boost::chrono::duration<double>(clock::now() - start).count();
+        }
+
+        /// \cond INTERNAL
+
+        // Whether bytes more fit into the budget of the context.
+        static bool fits(cl_context context, size_t bytes) {
+            boost::lock_guard<boost::mutex> lock(mx);
+
+            auto b = budgets.find(context);
+            if (b == budgets.end() || !b->second) return true;
+
+            auto c = contexts.find(context);
+            size_t live = c == contexts.end() ? 0 : c->second.live;
+
+            return live + bytes <= b->second;
+        }
+
+        // Records a new buffer.
+        static void track(const cl::Buffer &buf, const std::string &tag) {
+            entry *e = new entry;
+            e->context = buf.getInfo<CL_MEM_CONTEXT>()();
+            e->tag     = tag;
+            e->bytes   = buf.getInfo<CL_MEM_SIZE>();
+
+            {
+                boost::lock_guard<boost::mutex> lock(mx);
+
+                add(all,                   e->bytes);
+                add(contexts[e->context],  e->bytes);
+                add(tags[e->tag],          e->bytes);
+            }
+
+            if (clSetMemObjectDestructorCallback(buf(), &released, e) != CL_SUCCESS) {
+                // The buffer would be counted forever otherwise.
+                released(buf(), e);
+            }
+        }
+
+        // Records an allocation refused by the budget.
+        static void refuse(cl_context context, const std::string &tag) {
+            boost::lock_guard<boost::mutex> lock(mx);
+
+            all.refused++;
+            contexts[context].refused++;
+            tags[tag].refused++;
+        }
+
+        // Drops the records of a destroyed context.
+        static void forget(cl_context context) {
+            boost::lock_guard<boost::mutex> lock(mx);
+
+            budgets.erase(context);
+            contexts.erase(context);
+        }
+
+        /// \endcond
+    private:
+        typedef boost::chrono::steady_clock clock;
+
+        struct entry {
+            cl_context  context;
+            std::string tag;
+            size_t      bytes;
+        };
+
+        static void add(usage &u, size_t bytes) {
+            u.live += bytes;
+            u.peak  = std::max(u.peak, u.live);
+            u.buffers++;
+            u.allocations++;
+            u.allocated += bytes;
+        }
+
+        static void remove(usage &u, size_t bytes) {
+            u.live -= bytes;
+            u.buffers--;
+        }
+
+        static void reset(usage &u) {
+            u.peak        = u.live;
+            u.allocations = 0;
+            u.allocated   = 0;
+            u.refused     = 0;
+        }
+
+        static void CL_CALLBACK released(cl_mem, void *data) {
+            entry *e = static_cast<entry*>(data);
+
+            {
+                boost::lock_guard<boost::mutex> lock(mx);
+
+                remove(all, e->bytes);
+                remove(tags[e->tag], e->bytes);
+
+                auto c = contexts.find(e->context);
+                if (c != contexts.end()) remove(c->second, e->bytes);
+            }
+
+            delete e;
+        }
+
+        static boost::mutex mx;
+        static usage all;
+        static std::map<cl_context, usage>  contexts;
+        static std::map<cl_context, size_t> budgets;
+        static std::map<std::string, usage> tags;
+        static clock::time_point start;
+};
+
+template <bool dummy>
+boost::mutex memory_account<dummy>::mx;
+
+template <bool dummy>
+typename memory_account<dummy>::usage memory_account<dummy>::all;
+
+template <bool dummy>
+std::map<cl_context, typename memory_account<dummy>::usage> memory_account<dummy>::contexts;
+
+template <bool dummy>
+std::map<cl_context, size_t> memory_account<dummy>::budgets;
+
+template <bool dummy>
+std::map<std::string, typename memory_account<dummy>::usage> memory_account<dummy>::tags;
+
+template <bool dummy>
+typename memory_account<dummy>::clock::time_point memory_account<dummy>::start =
+    memory_account<dummy>::clock::now();
+
+} // namespace vex
+
+#ifdef WIN32
+#  pragma warning(pop)
+#endif
+
+// vim: et
+#endif
@@ -0,0 +1,313 @@
+#ifndef VEXCL_AUTOTUNE_HPP
+#define VEXCL_AUTOTUNE_HPP
+
+/*
+The MIT License
+
+Copyright (c) 2012-2013 Denis Demidov <ddemidov@ksu.ru>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/**
+ * \file   vexcl/autotune.hpp
+ * \author Denis Demidov <ddemidov@ksu.ru>
+ * \brief  Work-group sizes of element-wise kernels tuned from launch timings.
+ */
+
+#ifdef WIN32
+#  pragma warning(push)
+#  pragma warning(disable : 4267 4290)
+#  define NOMINMAX
+#endif
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <algorithm>
+#include <limits>
+#include <atomic>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <CL/cl.hpp>
+#include <vexcl/util.hpp>
+#include <vexcl/trace.hpp>
+
+#ifndef VEXCL_WORKGROUP_TUNING_SAMPLES
+/// Timed launches per candidate work-group size.
+#  define VEXCL_WORKGROUP_TUNING_SAMPLES 3
+#endif
+
+namespace vex {
+
+/// Work-group sizes of the element-wise kernels.
+/**
+ * Vector and multivector expressions and the kernels of vex::generator are
+ * launched with the largest power of two work-group size the kernel accepts
+ * by default. When tuning is enabled (by VEXCL_TUNE_WORKGROUP environment
+ * variable or enable()), each such kernel instead tries the power of two
+ * sizes down to a sixteenth of the largest one (but not below 32) over its
+ * first launches, VEXCL_WORKGROUP_TUNING_SAMPLES times each, and keeps the
+ * size with the shortest time per element. Launches are timed from the
+ * profiling info of their events, without waiting for them, so the queues
+ * have to be created with CL_QUEUE_PROFILING_ENABLE; on other queues the
+ * largest size is kept. Launches over fewer than 64K elements are not timed.
+ *
+ * When VEXCL_CACHE_DIR is set, the chosen sizes are stored there per device
+ * and kernel source, and reused by later runs whether tuning is enabled or
+ * not.
+ *
+ * For reproducible runs a size may be pinned with pin() or with
+ * VEXCL_WORKGROUP_SIZE environment variable. It then replaces tuned and
+ * stored sizes, and bounds the work-group size of every other VexCL kernel
+ * as well (rounded down to a power of two). The pin applies to kernels
+ * compiled after it is set.
+ * \code
+ * vex::workgroup_tuning<>::pin(128);
+ * \endcode
+ */
+template <bool dummy = true>
+struct workgroup_tuning {
+    static_assert(dummy, "dummy parameter should be true");
+
+    /// Switches tuning of kernels compiled from now on.
+    static void enable(bool on = true) {
+        active = on;
+    }
+
+    /// Whether kernels compiled now are tuned.
+    static bool enabled() {
+        return active;
+    }
+
+    /// Pins the work-group size; zero removes the pin.
+    static void pin(size_t size) {
+        workgroup_pin<>::size = size;
+    }
+
+    /// Pinned work-group size, or zero.
+    static size_t pinned() {
+        return workgroup_pin<>::size;
+    }
+
+    private:
+        static std::atomic<bool> active;
+};
+
+template <bool dummy>
+std::atomic<bool> workgroup_tuning<dummy>::active(getenv("VEXCL_TUNE_WORKGROUP") != 0);
+
+/// \cond INTERNAL
+
+/// Work-group size of a cached kernel on a device.
+/**
+ * Kept by the kernel cache entry, so that the choice lives as long as the
+ * compiled kernel. Once the size is chosen, next() is a single atomic load.
+ */
+class workgroup_tuner {
+    public:
+        workgroup_tuner(const cl::Kernel &kernel, const cl::Device &device)
+            : device(device), limit(kernel_workgroup_size(kernel, device)),
+              choice(0), launches(0)
+        {
+            if (workgroup_pin<>::size) {
+                choice = limit;
+                return;
+            }
+
+            cl_ulong h;
+            if (program_sources<>::find(kernel.getInfo<CL_KERNEL_PROGRAM>(), h)) {
+                std::ostringstream k;
+                k << "workgroup " << kernel.getInfo<CL_KERNEL_FUNCTION_NAME>()
+                  << " " << std::hex << h;
+                key = k.str();
+
+                size_t stored;
+                if (device_properties<>::load(device, key, stored) &&
+                        stored && stored <= limit)
+                {
+                    choice = stored;
+                    return;
+                }
+            }
+
+            if (workgroup_tuning<>::enabled())
+                for(size_t w = limit; w >= std::max<size_t>(limit / 16, min_size); w /= 2)
+                    candidate.push_back(w);
+
+            if (candidate.size() < 2) {
+                choice = limit;
+                return;
+            }
+
+            best.resize(candidate.size(), std::numeric_limits<double>::max());
+            taken.resize(candidate.size(), 0);
+        }
+
+        /// Work-group size of the chosen one, or the largest one while tuning.
+        size_t size() const {
+            size_t c = choice;
+            return c ? c : limit;
+        }
+
+        /// Work-group size for the next launch over work elements.
+        /**
+         * Sets measure when the launch should be timed, in which case its
+         * event is to be passed to record().
+         */
+        size_t next(size_t work, bool &measure) {
+            measure = false;
+
+            if (size_t c = choice) return c;
+
+            boost::lock_guard<boost::mutex> lock(mx);
+
+            harvest();
+
+            if (size_t c = choice) return c;
+
+            if (work < min_work ||
+                    pending.size() >= candidate.size() * VEXCL_WORKGROUP_TUNING_SAMPLES)
+                return limit;
+
+            measure = true;
+
+            // The first launch is a warm-up, the rest take the candidates
+            // in turn, so that a drift in the device clock or load affects
+            // all of them alike.
+            return launches ? candidate[(launches - 1) % candidate.size()] : limit;
+        }
+
+        /// Keeps the event of a launch next() asked to time.
+        void record(size_t wgsize, size_t work, const cl::Event &e) {
+            boost::lock_guard<boost::mutex> lock(mx);
+
+            if (choice || !launches++) return;
+
+            auto c = std::find(candidate.begin(), candidate.end(), wgsize);
+            if (c != candidate.end())
+                pending.push_back(sample(c - candidate.begin(), work, e));
+        }
+
+    private:
+        enum {
+            min_size = 32,
+            min_work = 1 << 16
+        };
+
+        struct sample {
+            size_t    candidate;
+            size_t    work;
+            cl::Event event;
+
+            sample(size_t candidate, size_t work, const cl::Event &event)
+                : candidate(candidate), work(work), event(event) {}
+        };
+
+        cl::Device device;
+        size_t     limit;
+        std::string key;
+
+        std::atomic<size_t> choice;
+
+        boost::mutex        mx;
+        size_t              launches;
+        std::vector<size_t> candidate;
+        std::vector<double> best;   // shortest time per element of each candidate
+        std::vector<size_t> taken;  // timings of each candidate
+        std::vector<sample> pending;
+
+        // Takes the timings of the completed launches, and chooses the size
+        // once every candidate has enough of them.
+        void harvest() {
+            for(auto s = pending.begin(); s != pending.end(); ) {
+                cl_int status = s->event.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>();
+
+                if (status > CL_COMPLETE) {
+                    ++s;
+                    continue;
+                }
+
+                if (status == CL_COMPLETE) {
+                    try {
+                        double t = static_cast<double>(
+                                s->event.getProfilingInfo<CL_PROFILING_COMMAND_END>() -
+                                s->event.getProfilingInfo<CL_PROFILING_COMMAND_START>()
+                                ) / s->work;
+
+                        best[s->candidate] = std::min(best[s->candidate], t);
+                        ++taken[s->candidate];
+                    } catch(const cl::Error&) {
+                        // The queue does not time its commands.
+                        pending.clear();
+                        choice = limit;
+                        return;
+                    }
+                }
+
+                s = pending.erase(s);
+            }
+
+            for(auto t = taken.begin(); t != taken.end(); ++t)
+                if (*t < VEXCL_WORKGROUP_TUNING_SAMPLES) return;
+
+            size_t w = candidate[std::min_element(best.begin(), best.end()) - best.begin()];
+
+            pending.clear();
+            choice = w;
+
+            if (!key.empty()) device_properties<>::store(device, key, w);
+        }
+};
+
+/// Launches an element-wise kernel over work elements with the work-group size of the tuner.
+/**
+ * g_size returns the global size for a work-group size.
+ */
+template <class GlobalSize>
+void tuned_launch(const cl::CommandQueue &queue, const cl::Kernel &kernel,
+        workgroup_tuner &tuner, size_t work, GlobalSize g_size)
+{
+    bool measure;
+    size_t wgsize = tuner.next(work, measure);
+
+    if (measure) {
+        cl::Event e;
+
+        queue.enqueueNDRangeKernel(kernel, cl::NullRange,
+                g_size(wgsize), wgsize, 0, &e);
+
+        event_trace<>::add(queue, kernel, e);
+        tuner.record(wgsize, work, e);
+    } else {
+        queue.enqueueNDRangeKernel(kernel, cl::NullRange,
+                g_size(wgsize), wgsize, 0, event_trace<>::kernel(queue, kernel));
+    }
+}
+
+/// \endcond
+
+} // namespace vex
+
+#ifdef WIN32
+#  pragma warning(pop)
+#endif
+
+// vim: et
+#endif
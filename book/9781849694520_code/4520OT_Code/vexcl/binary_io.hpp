@@ -0,0 +1,294 @@
+#ifndef VEXCL_BINARY_IO_HPP
+#define VEXCL_BINARY_IO_HPP
+
+/*
+The MIT License
+
+Copyright (c) 2012-2013 Denis Demidov <ddemidov@ksu.ru>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/**
+ * \file   vexcl/binary_io.hpp
+ * \author Denis Demidov <ddemidov@ksu.ru>
+ * \brief  Memory-mapped binary files for vectors and sparse matrices.
+ */
+
+#ifdef WIN32
+#  pragma warning(push)
+#  pragma warning(disable : 4267 4290)
+#  define NOMINMAX
+#endif
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <fstream>
+#include <cstring>
+#include <stdexcept>
+#include <boost/cstdint.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <CL/cl.hpp>
+#include <vexcl/util.hpp>
+#include <vexcl/vector.hpp>
+
+namespace vex {
+
+/// \cond INTERNAL
+
+namespace binary {
+
+// File layout: header, followed by the arrays. Each array starts at a
+// multiple of 64 bytes from the beginning of the file, so that the mapped
+// data is suitably aligned for any element type.
+struct header {
+    char           magic[8];
+    boost::uint32_t val_size;
+    boost::uint32_t col_size;
+    boost::uint32_t idx_size;
+    boost::uint32_t reserved;
+    boost::uint64_t rows;
+    boost::uint64_t cols;
+    boost::uint64_t nnz;
+};
+
+static const char vector_magic[8] = {'V', 'E', 'X', 'V', 'E', 'C', '1', 0};
+static const char csr_magic[8]    = {'V', 'E', 'X', 'C', 'S', 'R', '1', 0};
+
+inline size_t aligned(size_t bytes) {
+    return alignup(bytes, 64);
+}
+
+// Creates file of the given size filled with zeros.
+inline void create_file(const std::string &fname, size_t bytes) {
+    std::filebuf fbuf;
+
+    if (!fbuf.open(fname.c_str(),
+                std::ios_base::in | std::ios_base::out |
+                std::ios_base::trunc | std::ios_base::binary))
+        throw std::runtime_error("Can not create " + fname);
+
+    fbuf.pubseekoff(bytes - 1, std::ios_base::beg);
+    fbuf.sputc(0);
+}
+
+class mapped_file {
+    public:
+        mapped_file(const std::string &fname, bool writable)
+            : file(fname.c_str(), writable ?
+                    boost::interprocess::read_write :
+                    boost::interprocess::read_only),
+              region(file, writable ?
+                    boost::interprocess::read_write :
+                    boost::interprocess::read_only)
+        {
+            if (region.get_size() < sizeof(header))
+                throw std::runtime_error(fname + " is not a VexCL binary file");
+        }
+
+        header& hdr() const {
+            return *static_cast<header*>(region.get_address());
+        }
+
+        template <typename T>
+        T* at(size_t offset) const {
+            return reinterpret_cast<T*>(
+                    static_cast<char*>(region.get_address()) + offset);
+        }
+
+        size_t size() const {
+            return region.get_size();
+        }
+    private:
+        boost::interprocess::file_mapping  file;
+        boost::interprocess::mapped_region region;
+};
+
+inline void check(const mapped_file &f, const char *magic, size_t bytes,
+        const std::string &fname)
+{
+    if (std::memcmp(f.hdr().magic, magic, sizeof(f.hdr().magic)))
+        throw std::runtime_error(fname + " has wrong format");
+
+    if (f.size() < bytes)
+        throw std::runtime_error(fname + " is truncated");
+}
+
+} // namespace binary
+
+/// \endcond
+
+/// Saves vector to a binary file.
+/**
+ * The device data is read directly into the mapped pages of the file.
+ */
+template <typename T>
+void save_binary(const std::string &fname, const vector<T> &x) {
+    size_t data  = binary::aligned(sizeof(binary::header));
+    size_t bytes = data + x.size() * sizeof(T);
+
+    binary::create_file(fname, bytes);
+    binary::mapped_file f(fname, true);
+
+    binary::header &h = f.hdr();
+    std::memcpy(h.magic, binary::vector_magic, sizeof(h.magic));
+    h.val_size = sizeof(T);
+    h.rows     = x.size();
+
+    if (x.size()) x.read_data(0, x.size(), f.at<T>(data), CL_TRUE);
+}
+
+/// Loads vector from a binary file created by save_binary().
+/**
+ * The device buffers are filled directly from the mapped pages of the file,
+ * so no intermediate host copy of the data is made.
+ */
+template <typename T>
+vector<T> load_binary(const std::vector<cl::CommandQueue> &queue,
+        const std::string &fname, cl_mem_flags flags = CL_MEM_READ_WRITE)
+{
+    size_t data = binary::aligned(sizeof(binary::header));
+
+    binary::mapped_file f(fname, false);
+    binary::check(f, binary::vector_magic, data, fname);
+
+    const binary::header &h = f.hdr();
+
+    if (h.val_size != sizeof(T))
+        throw std::runtime_error(fname + ": element size mismatch");
+
+    size_t n = static_cast<size_t>(h.rows);
+    binary::check(f, binary::vector_magic, data + n * sizeof(T), fname);
+
+    vector<T> x(queue, n, 0, flags);
+    if (n) x.write_data(0, n, f.at<const T>(data), CL_TRUE);
+
+    return x;
+}
+
+/// Saves CSR matrix to a binary file.
+/**
+ * The file contains a header with matrix dimensions and type sizes,
+ * followed by row, col, and val arrays. Use mapped_csr to load it.
+ */
+template <typename real, typename column_t, typename idx_t>
+void save_binary_csr(const std::string &fname, size_t n, size_t m,
+        const idx_t *row, const column_t *col, const real *val)
+{
+    size_t nnz = row[n];
+
+    size_t row_pos = binary::aligned(sizeof(binary::header));
+    size_t col_pos = row_pos + binary::aligned((n + 1) * sizeof(idx_t));
+    size_t val_pos = col_pos + binary::aligned(nnz * sizeof(column_t));
+    size_t bytes   = val_pos + nnz * sizeof(real);
+
+    binary::create_file(fname, bytes);
+    binary::mapped_file f(fname, true);
+
+    binary::header &h = f.hdr();
+    std::memcpy(h.magic, binary::csr_magic, sizeof(h.magic));
+    h.val_size = sizeof(real);
+    h.col_size = sizeof(column_t);
+    h.idx_size = sizeof(idx_t);
+    h.rows     = n;
+    h.cols     = m;
+    h.nnz      = nnz;
+
+    std::copy(row, row + n + 1, f.at<idx_t>(row_pos));
+    std::copy(col, col + nnz,   f.at<column_t>(col_pos));
+    std::copy(val, val + nnz,   f.at<real>(val_pos));
+}
+
+/// CSR matrix memory-mapped from a binary file.
+/**
+ * Gives direct access to the arrays of a file created by save_binary_csr(),
+ * so that device matrices are constructed from the mapped pages without
+ * parsing or intermediate copies:
+ * \code
+ * vex::mapped_csr<double, int, int> csr("matrix.bin");
+ * vex::SpMat<double, int, int> A(ctx, csr.rows(), csr.cols(),
+ *     csr.row(), csr.col(), csr.val());
+ * \endcode
+ * The pointers stay valid while the mapped_csr object (or any of its copies)
+ * is alive.
+ */
+template <typename real, typename column_t = size_t, typename idx_t = size_t>
+class mapped_csr {
+    public:
+        /// Maps the file.
+        mapped_csr(const std::string &fname)
+            : f(std::make_shared<binary::mapped_file>(fname, false))
+        {
+            size_t row_pos = binary::aligned(sizeof(binary::header));
+            binary::check(*f, binary::csr_magic, row_pos, fname);
+
+            const binary::header &h = f->hdr();
+
+            if (h.val_size != sizeof(real) ||
+                h.col_size != sizeof(column_t) ||
+                h.idx_size != sizeof(idx_t))
+                throw std::runtime_error(fname + ": element size mismatch");
+
+            n   = static_cast<size_t>(h.rows);
+            m   = static_cast<size_t>(h.cols);
+            nnz = static_cast<size_t>(h.nnz);
+
+            size_t col_pos = row_pos + binary::aligned((n + 1) * sizeof(idx_t));
+            size_t val_pos = col_pos + binary::aligned(nnz * sizeof(column_t));
+
+            binary::check(*f, binary::csr_magic, val_pos + nnz * sizeof(real), fname);
+
+            row_ptr = f->at<const idx_t>(row_pos);
+            col_ptr = f->at<const column_t>(col_pos);
+            val_ptr = f->at<const real>(val_pos);
+        }
+
+        /// Number of rows.
+        size_t rows() const { return n; }
+        /// Number of columns.
+        size_t cols() const { return m; }
+        /// Number of non-zero entries.
+        size_t nonzeros() const { return nnz; }
+
+        /// Row index into col and val arrays.
+        const idx_t* row() const { return row_ptr; }
+        /// Column numbers of nonzero elements.
+        const column_t* col() const { return col_ptr; }
+        /// Values of nonzero elements.
+        const real* val() const { return val_ptr; }
+    private:
+        std::shared_ptr<binary::mapped_file> f;
+
+        size_t n, m, nnz;
+
+        const idx_t    *row_ptr;
+        const column_t *col_ptr;
+        const real     *val_ptr;
+};
+
+} // namespace vex
+
+#ifdef WIN32
+#  pragma warning(pop)
+#endif
+
+// vim: et
+#endif
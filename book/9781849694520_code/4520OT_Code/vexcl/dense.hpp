@@ -0,0 +1,439 @@
+#ifndef VEXCL_DENSE_HPP
+#define VEXCL_DENSE_HPP
+
+/*
+The MIT License
+
+Copyright (c) 2012-2013 Denis Demidov <ddemidov@ksu.ru>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/**
+ * \file   vexcl/dense.hpp
+ * \author Denis Demidov <ddemidov@ksu.ru>
+ * \brief  Dense matrices.
+ */
+
+#ifdef WIN32
+#  pragma warning(push)
+#  pragma warning(disable : 4267 4290)
+#  define NOMINMAX
+#endif
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <memory>
+#include <stdexcept>
+#include <CL/cl.hpp>
+#include <vexcl/util.hpp>
+#include <vexcl/kernel_cache.hpp>
+#include <vexcl/trace.hpp>
+#include <vexcl/vector.hpp>
+#include <vexcl/spmat.hpp>
+#include <vexcl/gemm.hpp>
+
+namespace vex {
+
+/// Storage orders of dense matrices.
+namespace dense_layout {
+    enum type {
+        row_major, ///< Rows are stored contiguously.
+        col_major  ///< Columns are stored contiguously.
+    };
+}
+
+template <typename real>
+class dense_matrix;
+
+/// \cond INTERNAL
+
+template <typename real>
+struct dense_product {
+    const dense_matrix<real> &A;
+    const dense_matrix<real> &B;
+
+    dense_product(const dense_matrix<real> &A, const dense_matrix<real> &B)
+        : A(A), B(B) {}
+};
+
+template <typename real>
+struct dense_kernels {
+    cl::Kernel rows; // Row-major: work-group per row.
+    cl::Kernel cols; // Column-major: work-item per row.
+    size_t     wgsize;
+
+    static std::shared_ptr<dense_kernels> get(const cl::CommandQueue &queue) {
+        std::shared_ptr<dense_kernels> k = kernel_cache<>::find<dense_kernels>(queue);
+        if (k) return k;
+
+        cl::Context context = qctx(queue);
+        cl::Device  device  = qdev(queue);
+
+        std::ostringstream src;
+
+        src << standard_kernel_header <<
+            "typedef " << type_name<real>() << " real;\n"
+            "kernel void gemv_rows(\n"
+            "    uint n, uint m,\n"
+            "    global const real *A,\n"
+            "    global const real *x,\n"
+            "    global real *y,\n"
+            "    real alpha, int append,\n"
+            "    local real *part\n"
+            "    )\n"
+            "{\n"
+            "    size_t lid = get_local_id(0);\n"
+            "    size_t wg  = get_local_size(0);\n"
+            "    for(size_t i = get_group_id(0); i < n; i += get_num_groups(0)) {\n"
+            "        global const real *a = A + i * m;\n"
+            "        real s = 0;\n"
+            "        for(size_t j = lid; j < m; j += wg) s += a[j] * x[j];\n"
+            "        part[lid] = s;\n"
+            "        barrier(CLK_LOCAL_MEM_FENCE);\n"
+            "        for(size_t k = wg / 2; k > 0; k /= 2) {\n"
+            "            if (lid < k) part[lid] += part[lid + k];\n"
+            "            barrier(CLK_LOCAL_MEM_FENCE);\n"
+            "        }\n"
+            "        if (lid == 0) y[i] = append ? y[i] + alpha * part[0] : alpha * part[0];\n"
+            "        barrier(CLK_LOCAL_MEM_FENCE);\n"
+            "    }\n"
+            "}\n"
+            "kernel void gemv_cols(\n"
+            "    uint n, uint m,\n"
+            "    global const real *A,\n"
+            "    global const real *x,\n"
+            "    global real *y,\n"
+            "    real alpha, int append\n"
+            "    )\n"
+            "{\n"
+            "    for(size_t i = get_global_id(0); i < n; i += get_global_size(0)) {\n"
+            "        real s = 0;\n"
+            "        for(size_t j = 0; j < m; j++) s += A[j * n + i] * x[j];\n"
+            "        y[i] = append ? y[i] + alpha * s : alpha * s;\n"
+            "    }\n"
+            "}\n";
+
+        auto program = build_sources(context, src.str());
+
+        dense_kernels e;
+        e.rows = cl::Kernel(program, "gemv_rows");
+        e.cols = cl::Kernel(program, "gemv_cols");
+
+        // Tree reduction in gemv_rows needs power of two work-groups.
+        e.wgsize = device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU ? 1 :
+            std::min<size_t>(256, std::min(
+                        kernel_workgroup_size(e.rows, device),
+                        kernel_workgroup_size(e.cols, device)));
+
+        return kernel_cache<>::insert(queue, e);
+    }
+};
+
+/// \endcond
+
+/// Dense matrix.
+/**
+ * Rows of the matrix are split across devices in the same way as the
+ * elements of a vex::vector of the same size, and each device keeps its
+ * strip of rows in the chosen storage order. The matrix is a matrix terminal
+ * like vex::SpMat, so that its products with vectors may be used in vector
+ * expressions, and products of matrices are computed with vex::gemm:
+ * \code
+ * vex::dense_matrix<double> A(ctx, n, m, a.data());
+ * vex::dense_matrix<double> B(ctx, m, k, b.data()), C(ctx, n, k);
+ *
+ * y = 2 * z + A * x;
+ * C = A * B;
+ * \endcode
+ * Every device needs all of x (and all of B for matrix products); with more
+ * than one device these are gathered through host memory before the product.
+ */
+template <typename real>
+class dense_matrix : matrix_terminal {
+    public:
+        typedef real value_type;
+
+        /// Empty matrix.
+        dense_matrix() : nrows(0), ncols(0), order(dense_layout::row_major) {}
+
+        /// Constructor.
+        /**
+         * \param queue  vector of queues. Each queue represents one compute device.
+         * \param n      number of rows.
+         * \param m      number of columns.
+         * \param data   matrix elements in the given storage order, or NULL
+         *               to leave the matrix uninitialized.
+         * \param layout storage order of data and of the device matrix.
+         */
+        dense_matrix(const std::vector<cl::CommandQueue> &queue,
+                size_t n, size_t m, const real *data = 0,
+                dense_layout::type layout = dense_layout::row_major)
+            : queue(queue), part(partition(n, queue)),
+              nrows(n), ncols(m), order(layout), buf(queue.size())
+        {
+            for(uint d = 0; d < queue.size(); d++) {
+                size_t rows = part[d + 1] - part[d];
+                if (!rows || !m) continue;
+
+                buf[d] = memory_pool<>::create("dense",
+                        qctx(queue[d]), CL_MEM_READ_WRITE, rows * m * sizeof(real));
+
+                if (data) {
+                    std::vector<real> strip(rows * m);
+                    pack(data, d, strip.data());
+                    queue[d].enqueueWriteBuffer(buf[d], CL_TRUE, 0,
+                            strip.size() * sizeof(real), strip.data());
+                }
+            }
+        }
+
+        /// Matrix-vector multiplication.
+        /**
+         * Computes \f$y = \alpha Ax\f$ or, when append is set, \f$y += \alpha Ax\f$.
+         */
+        void mul(const vex::vector<real> &x, vex::vector<real> &y,
+                 real alpha = 1, bool append = false) const
+        {
+            if (x.size() != ncols || y.size() != nrows)
+                throw std::length_error("dense_matrix: vector size mismatch");
+
+            if (!ncols) {
+                if (!append) y = 0;
+                return;
+            }
+
+            const std::vector<cl::CommandQueue> &q = queue;
+
+            gather(x);
+
+            for(uint d = 0; d < q.size(); d++) {
+                size_t rows = part[d + 1] - part[d];
+                if (!rows) continue;
+
+                auto krn = dense_kernels<real>::get(q[d]);
+                cl::Device device = qdev(q[d]);
+
+                const cl::Buffer &xd = q.size() > 1 ? xfull[d] : x(d);
+
+                cl::Kernel &k = order == dense_layout::row_major ? krn->rows : krn->cols;
+
+                uint pos = 0;
+                k.setArg(pos++, static_cast<cl_uint>(rows));
+                k.setArg(pos++, static_cast<cl_uint>(ncols));
+                k.setArg(pos++, buf[d]);
+                k.setArg(pos++, xd);
+                k.setArg(pos++, y(d));
+                k.setArg(pos++, alpha);
+                k.setArg(pos++, static_cast<cl_int>(append));
+
+                size_t wg = krn->wgsize, g_size;
+
+                if (order == dense_layout::row_major) {
+                    k.setArg(pos++, cl::Local(wg * sizeof(real)));
+                    g_size = std::min(rows, static_cast<size_t>(
+                                device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * 16)) * wg;
+                } else {
+                    g_size = device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU ?
+                        alignup(rows, wg) :
+                        device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * wg * 4;
+                }
+
+                q[d].enqueueNDRangeKernel(k, cl::NullRange, g_size, wg, 0,
+                        event_trace<>::kernel(q[d], k,
+                            (rows * ncols + ncols + 2 * rows) * sizeof(real),
+                            2 * rows * ncols));
+            }
+        }
+
+        /// Matrix-matrix multiplication.
+        /**
+         * All three matrices should have the same storage order and should
+         * live on the same devices.
+         */
+        dense_matrix& operator=(const dense_product<real> &p) {
+            const dense_matrix &A = p.A, &B = p.B;
+
+            if (A.nrows != nrows || B.ncols != ncols || A.ncols != B.nrows)
+                throw std::length_error("dense_matrix: matrix size mismatch");
+
+            if (A.order != order || B.order != order)
+                throw std::invalid_argument("dense_matrix: storage orders differ");
+
+            if (&A == this || &B == this)
+                throw std::invalid_argument("dense_matrix: product overwrites its operand");
+
+            const std::vector<cl::CommandQueue> &q = queue;
+
+            std::vector<cl::Buffer> bfull = B.replicate();
+
+            for(uint d = 0; d < q.size(); d++) {
+                size_t rows = part[d + 1] - part[d];
+                if (!rows || !ncols) continue;
+
+                gemm_params prm = gemm_tuning<>::get<real>(q[d]);
+
+                if (order == dense_layout::row_major)
+                    gemm<real>(q[d], prm, rows, ncols, A.ncols,
+                            real(1), A.buf[d], bfull[d], real(0), buf[d]);
+                else
+                    // Column-major storage is row-major storage of the
+                    // transposed matrix: C^T = B^T A^T.
+                    gemm<real>(q[d], prm, ncols, rows, A.ncols,
+                            real(1), bfull[d], A.buf[d], real(0), buf[d]);
+            }
+
+            return *this;
+        }
+
+        /// Copies matrix to host memory in its storage order.
+        void read(real *data) const {
+            const std::vector<cl::CommandQueue> &q = queue;
+
+            for(uint d = 0; d < q.size(); d++) {
+                size_t rows = part[d + 1] - part[d];
+                if (!rows || !ncols) continue;
+
+                std::vector<real> strip(rows * ncols);
+                q[d].enqueueReadBuffer(buf[d], CL_TRUE, 0,
+                        strip.size() * sizeof(real), strip.data());
+                unpack(strip.data(), d, data);
+            }
+        }
+
+        /// Number of rows.
+        size_t rows() const { return nrows; }
+        /// Number of columns.
+        size_t cols() const { return ncols; }
+        /// Storage order.
+        dense_layout::type layout() const { return order; }
+
+        /// Strip of rows held by the given device.
+        const cl::Buffer& operator()(uint d = 0) const { return buf[d]; }
+    private:
+        std::vector<cl::CommandQueue> queue;
+        std::vector<size_t> part;
+
+        size_t nrows, ncols;
+        dense_layout::type order;
+
+        std::vector<cl::Buffer> buf;
+
+        mutable std::vector<cl::Buffer> xfull;
+        mutable std::vector<real>       xhost;
+
+        // Strip of device d in storage order, from the full matrix.
+        void pack(const real *data, uint d, real *strip) const {
+            size_t beg = part[d], rows = part[d + 1] - beg;
+
+            if (order == dense_layout::row_major)
+                std::copy(data + beg * ncols, data + (beg + rows) * ncols, strip);
+            else
+                for(size_t j = 0; j < ncols; j++)
+                    std::copy(data + j * nrows + beg, data + j * nrows + beg + rows,
+                            strip + j * rows);
+        }
+
+        void unpack(const real *strip, uint d, real *data) const {
+            size_t beg = part[d], rows = part[d + 1] - beg;
+
+            if (order == dense_layout::row_major)
+                std::copy(strip, strip + rows * ncols, data + beg * ncols);
+            else
+                for(size_t j = 0; j < ncols; j++)
+                    std::copy(strip + j * rows, strip + (j + 1) * rows,
+                            data + j * nrows + beg);
+        }
+
+        // Makes all of x available on each device. The parts are copied
+        // directly to devices sharing a context with all of them, and the
+        // rest get all of x from the host.
+        void gather(const vex::vector<real> &x) const {
+            const std::vector<cl::CommandQueue> &q = queue;
+            if (q.size() < 2 || !ncols) return;
+
+            if (xfull.empty())
+                for(uint d = 0; d < q.size(); d++)
+                    xfull.push_back(memory_pool<>::create("dense", qctx(q[d]), CL_MEM_READ_WRITE,
+                                ncols * sizeof(real)));
+
+            std::vector<cl::Event> copies;
+            bool read = false;
+
+            for(uint d = 0; d < q.size(); d++) {
+                bool peers = true;
+                for(uint s = 0; s < q.size(); s++)
+                    if (x.part_size(s) && !peer_copy(q[s], q[d])) peers = false;
+
+                if (peers) {
+                    for(uint s = 0; s < q.size(); s++)
+                        if (size_t n = x.part_size(s))
+                            copies.push_back(device_copy(
+                                        q[s], x(s),     0,
+                                        q[d], xfull[d], x.part_start(s) * sizeof(real),
+                                        n * sizeof(real)));
+                } else {
+                    if (!read) {
+                        xhost.resize(ncols);
+                        x.read_data(0, ncols, xhost.data(), CL_TRUE);
+                        read = true;
+                    }
+
+                    q[d].enqueueWriteBuffer(xfull[d], CL_TRUE, 0,
+                            ncols * sizeof(real), xhost.data());
+                }
+            }
+
+            if (!copies.empty()) cl::Event::waitForEvents(copies);
+        }
+
+        // Copies of the whole matrix on each device.
+        std::vector<cl::Buffer> replicate() const {
+            const std::vector<cl::CommandQueue> &q = queue;
+
+            if (q.size() == 1) return buf;
+
+            std::vector<real> host(nrows * ncols);
+            read(host.data());
+
+            std::vector<cl::Buffer> copy(q.size());
+            for(uint d = 0; d < q.size(); d++)
+                copy[d] = memory_pool<>::create("dense",
+                        qctx(q[d]), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                        host.size() * sizeof(real), host.data());
+
+            return copy;
+        }
+};
+
+/// Product of dense matrices.
+template <typename real>
+dense_product<real> operator*(const dense_matrix<real> &A, const dense_matrix<real> &B) {
+    return dense_product<real>(A, B);
+}
+
+} // namespace vex
+
+#ifdef WIN32
+#  pragma warning(pop)
+#endif
+
+// vim: et
+#endif
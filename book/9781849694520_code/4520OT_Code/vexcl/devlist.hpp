@@ -43,6 +43,8 @@ THE SOFTWARE.
 #include <tuple>
 #include <cstdlib>
 #include <vexcl/util.hpp>
+#include <vexcl/kernel_cache.hpp>
+#include <vexcl/memory_pool.hpp>
 #include <boost/interprocess/sync/file_lock.hpp>
 
 #ifdef __GNUC__
@@ -344,8 +346,69 @@ namespace Filter {
         return ExclusiveFilter<Filter>(filter);
     }
 
+    /// \internal Splits the CPU devices that pass a filter by NUMA node.
+    template <class Filter>
+    class NumaFilter {
+        public:
+            NumaFilter(const Filter &filter) : filter(filter) {}
+
+            bool operator()(const cl::Device &d) const {
+                return filter(d);
+            }
+        private:
+            const Filter &filter;
+    };
+
+    /// Uses a CPU device as one sub-device per NUMA node.
+    /**
+     * CPU devices that pass the filter are split with clCreateSubDevices()
+     * by the NUMA affinity domain, and each sub-device gets a context, a
+     * queue and a partition of the vectors of its own. The buffers of the
+     * vectors are first written from the sub-devices, so that their pages
+     * are placed on the memory of the node the sub-device runs on. Devices
+     * that are not CPUs or that cannot be split are used as they are; the
+     * split needs OpenCL 1.2. The filter should wrap the whole filter
+     * expression.
+     * \code
+     * vex::Context ctx( vex::Filter::NUMA(vex::Filter::Type(CL_DEVICE_TYPE_CPU)) );
+     * \endcode
+     */
+    template <class Filter>
+    NumaFilter<Filter> NUMA(const Filter &filter) {
+        return NumaFilter<Filter>(filter);
+    }
+
     /// \cond INTERNAL
 
+    /// Devices a selected device is used as: the device itself.
+    template <class Filter>
+    std::vector<cl::Device> split(const Filter&, const cl::Device &d) {
+        return std::vector<cl::Device>(1, d);
+    }
+
+    /// One sub-device per NUMA node for CPUs that may be split.
+    template <class Filter>
+    std::vector<cl::Device> split(const NumaFilter<Filter>&, const cl::Device &d) {
+#ifdef CL_VERSION_1_2
+        if (d.getInfo<CL_DEVICE_TYPE>() & CL_DEVICE_TYPE_CPU) {
+            const cl_device_partition_property prop[] = {
+                CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN,
+                CL_DEVICE_AFFINITY_DOMAIN_NUMA,
+                0
+            };
+
+            std::vector<cl::Device> sub;
+            try {
+                if (d.createSubDevices(prop, &sub) == CL_SUCCESS && sub.size() > 1)
+                    return sub;
+            } catch(const cl::Error&) {
+                // A single node, or no support for the partition.
+            }
+        }
+#endif
+        return std::vector<cl::Device>(1, d);
+    }
+
     /// Negation of a filter.
     template <class Flt>
         struct NegateFilter {
@@ -444,7 +507,8 @@ std::vector<cl::Device> device_list(DevFilter filter = Filter::All)
             if (!d->getInfo<CL_DEVICE_AVAILABLE>()) continue;
             if (!filter(*d)) continue;
 
-            device.push_back(*d);
+            std::vector<cl::Device> use = Filter::split(filter, *d);
+            device.insert(device.end(), use.begin(), use.end());
         }
     }
 
@@ -487,7 +551,8 @@ queue_list(
             if (!d->getInfo<CL_DEVICE_AVAILABLE>()) continue;
             if (!filter(*d)) continue;
 
-            device.push_back(*d);
+            std::vector<cl::Device> use = Filter::split(filter, *d);
+            device.insert(device.end(), use.begin(), use.end());
         }
 
         if (device.empty()) continue;
@@ -533,13 +598,37 @@ inline const Context& current_context() {
 /// VexCL context holder.
 /**
  * Holds vectors of cl::Contexts and cl::CommandQueues returned by queue_list.
+ *
+ * A context may be created with several streams, that is, several command
+ * queues per device. queue() returns the first stream; vectors allocated on
+ * stream(s) run their assignments, copies and transfers in that stream, so
+ * that work bound to different vectors overlaps:
+ * \code
+ * vex::Context ctx(vex::Filter::Env, 0, 2);
+ *
+ * vex::vector<double> x(ctx.stream(0), n), y(ctx.stream(1), n);
+ *
+ * y.write_data(0, n, host.data(), CL_FALSE); // Transfer in stream 1...
+ * x = sin(x);                                // ... overlaps with kernel in stream 0.
+ * x += y;                                    // Waits for the transfer.
+ * \endcode
+ * With more than one stream, each vector remembers the events of its last
+ * write and of the reads since, and commands wait for the events of other
+ * streams they conflict with (read after write, write after read or write).
+ * This covers vector expressions, copies, host transfers and reductions;
+ * other operations (sparse matrices, stencils, FFT) should be ordered by
+ * the user, e.g. by running them in the stream of their vectors.
  */
 class Context {
     public:
         /// Initialize context from a device filter.
+        /**
+         * \param streams Number of command queues per device.
+         */
         template <class DevFilter>
         explicit Context(
-                DevFilter filter, cl_command_queue_properties properties = 0
+                DevFilter filter, cl_command_queue_properties properties = 0,
+                uint streams = 1
                 )
         {
             std::tie(c, q) = queue_list(filter, properties);
@@ -548,6 +637,21 @@ class Context {
             if (q.empty()) throw std::logic_error("No compute devices found");
 #endif
 
+            s.push_back(q);
+            for(uint k = 1; k < streams; k++) {
+                std::vector<cl::CommandQueue> sq;
+                sq.reserve(q.size());
+
+                for(uint d = 0; d < q.size(); d++)
+                    sq.push_back(cl::CommandQueue(c[d], qdev(q[d]), properties));
+
+                s.push_back(sq);
+            }
+
+            if (streams > 1) stream_tracking<>::enabled = true;
+
+            guard = std::make_shared<cache_guard>(c);
+
             StaticContext<>::set(*this);
         }
 
@@ -560,6 +664,10 @@ class Context {
                 q.push_back(u->second);
             }
 
+            s.push_back(q);
+
+            guard = std::make_shared<cache_guard>(c);
+
             StaticContext<>::set(*this);
         }
 
@@ -587,6 +695,23 @@ class Context {
             return qdev(q[d]);
         }
 
+        /// Number of streams (command queues per device).
+        uint streams() const {
+            return s.size();
+        }
+
+        /// Command queues of the given stream.
+        const std::vector<cl::CommandQueue>& stream(uint k) const {
+            return s[k];
+        }
+
+        /// Waits for completion of all streams.
+        void finish() const {
+            for(auto k = s.begin(); k != s.end(); k++)
+                for(auto q = k->begin(); q != k->end(); q++)
+                    q->finish();
+        }
+
         size_t size() const {
             return q.size();
         }
@@ -599,8 +724,25 @@ class Context {
             return !empty();
         }
     private:
+        // Purges kernel caches when the last copy of the context is destroyed.
+        struct cache_guard {
+            std::vector<cl::Context> c;
+
+            cache_guard(const std::vector<cl::Context> &c) : c(c) {}
+
+            ~cache_guard() {
+                for(auto ctx = c.begin(); ctx != c.end(); ctx++) {
+                    purge_kernel_caches(*ctx);
+                    memory_pool<>::trim((*ctx)());
+                    memory_account<>::forget((*ctx)());
+                }
+            }
+        };
+
         std::vector<cl::Context>      c;
         std::vector<cl::CommandQueue> q;
+        std::vector< std::vector<cl::CommandQueue> > s;
+        std::shared_ptr<cache_guard>  guard;
 };
 
 } // namespace vex
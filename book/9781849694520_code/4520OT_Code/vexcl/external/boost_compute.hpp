@@ -32,11 +32,78 @@ THE SOFTWARE.
  */
 
 #include <algorithm>
+#include <iterator>
+#include <vector>
+#include <stdexcept>
+#include <vexcl/util.hpp>
 #include <vexcl/vector.hpp>
 #include <boost/compute.hpp>
 
 namespace vex {
 
+/// Views a Boost.Compute buffer of n elements as a VexCL vector.
+/**
+ * No data is copied: the vector shares the buffer and uses the queue:
+ * \code
+ * boost::compute::vector<float> v(n, ctx);
+ * vex::vector<float> x = vex::compute_view(q, v);
+ * \endcode
+ */
+template <typename T>
+vex::vector<T> compute_view(const boost::compute::command_queue &queue,
+        const boost::compute::buffer &buf, size_t n)
+{
+    std::vector<size_t> part(2, 0);
+    part[1] = n;
+
+    return vex::vector<T>(
+            std::vector<cl::CommandQueue>(1, shared_queue(queue.get())), part,
+            std::vector<cl::Buffer>(1, shared_buffer(buf.get()))
+            );
+}
+
+/// Views a Boost.Compute vector as a VexCL vector.
+template <typename T>
+vex::vector<T> compute_view(const boost::compute::command_queue &queue,
+        boost::compute::vector<T> &v)
+{
+    return compute_view<T>(queue, v.get_buffer(), v.size());
+}
+
+/// Boost.Compute buffer sharing the memory of a single-device VexCL vector.
+template <typename T>
+boost::compute::buffer compute_buffer(const vex::vector<T> &x) {
+    if (x.queue_list().size() != 1)
+        throw std::logic_error("compute_buffer: only single-device vectors are supported");
+
+    return boost::compute::buffer( x(0)() );
+}
+
+/// Boost.Compute queue of a single-device VexCL vector.
+template <typename T>
+boost::compute::command_queue compute_queue(const vex::vector<T> &x) {
+    return boost::compute::command_queue( x.queue_list()[0]() );
+}
+
+/// Boost.Compute iterators over a single-device VexCL vector.
+/**
+ * Boost.Compute algorithms then work on the memory of the vector:
+ * \code
+ * boost::compute::command_queue q = vex::compute_queue(x);
+ * boost::compute::transform(vex::compute_begin(x), vex::compute_end(x),
+ *         vex::compute_begin(x), boost::compute::sqrt<float>(), q);
+ * \endcode
+ */
+template <typename T>
+boost::compute::buffer_iterator<T> compute_begin(const vex::vector<T> &x) {
+    return boost::compute::make_buffer_iterator<T>(compute_buffer(x), 0);
+}
+
+template <typename T>
+boost::compute::buffer_iterator<T> compute_end(const vex::vector<T> &x) {
+    return boost::compute::make_buffer_iterator<T>(compute_buffer(x), x.size());
+}
+
 /// \cond INTERNAL
 template <typename T>
 void scan(const vex::vector<T> &src, vex::vector<T> &dst, bool exclusive = false) {
@@ -94,58 +161,178 @@ void exclusive_scan(const vex::vector<T> &src, vex::vector<T> &dst) {
     scan(src, dst, true);
 }
 
+/// \cond INTERNAL
+namespace sample_sort {
+
+// Samples taken from the partitions per device.
+const size_t oversampling = 32;
+
+template <typename T>
+void sort_buffer(const cl::CommandQueue &queue, const cl::Buffer &buf, size_t n) {
+    boost::compute::command_queue q( queue() );
+    boost::compute::buffer b( buf() );
+
+    boost::compute::sort(
+            boost::compute::make_buffer_iterator<T>(b, 0),
+            boost::compute::make_buffer_iterator<T>(b, n),
+            q
+            );
+}
+
+// Position of the first element not less than value in a sorted buffer.
+template <typename T>
+size_t lower_bound(const cl::CommandQueue &queue, const cl::Buffer &buf, size_t n, const T &value) {
+    boost::compute::command_queue q( queue() );
+    boost::compute::buffer b( buf() );
+
+    auto first = boost::compute::make_buffer_iterator<T>(b, 0);
+    auto last  = boost::compute::make_buffer_iterator<T>(b, n);
+
+    return std::distance(first, boost::compute::lower_bound(first, last, value, q));
+}
+
+// Copies count elements between buffers on two devices: directly when the
+// devices share a context, and through host memory otherwise.
+template <typename T>
+void copy(
+        const cl::CommandQueue &src_q, const cl::Buffer &src, size_t src_off,
+        const cl::CommandQueue &dst_q, const cl::Buffer &dst, size_t dst_off,
+        size_t count)
+{
+    if (!count) return;
+
+    if (qctx(src_q)() == qctx(dst_q)()) {
+        dst_q.enqueueCopyBuffer(src, dst,
+                src_off * sizeof(T), dst_off * sizeof(T), count * sizeof(T));
+    } else {
+        std::vector<T> host(count);
+        src_q.enqueueReadBuffer(src, CL_TRUE,
+                src_off * sizeof(T), count * sizeof(T), host.data());
+        dst_q.enqueueWriteBuffer(dst, CL_TRUE,
+                dst_off * sizeof(T), count * sizeof(T), host.data());
+    }
+}
+
+template <typename T>
+void finish(const std::vector<cl::CommandQueue> &queue) {
+    for(auto q = queue.begin(); q != queue.end(); ++q) q->finish();
+}
+
+} // namespace sample_sort
+/// \endcond
+
 /// Sort.
 /**
- * If there are more than one device in vector's queue list, then all
- * partitions are sorted individually on GPUs and then merged on CPU.
+ * Each partition is sorted on its device. Vectors spanning several devices
+ * are then sample sorted: a few elements of every sorted partition give
+ * a splitter per device boundary, each device receives the elements between
+ * its splitters from all partitions and sorts them, and the resulting
+ * buckets are shifted into place where they miss the partition bounds.
+ * Elements move between devices directly when these share a context and
+ * through host memory otherwise; only the samples and bucket sizes are read
+ * by the host. A device receives all elements equal to a splitter, so
+ * heavily repeated keys may make its bucket larger than its partition.
  */
 template <typename T>
 void sort(vex::vector<T> &x) {
     auto queue = x.queue_list();
+    const size_t ndev = queue.size();
 
-    for(unsigned d = 0; d < queue.size(); ++d) {
-        if (x.part_size(d)) {
-            boost::compute::command_queue q( queue[d]() );
-            boost::compute::buffer buf( x(d)() );
+    for(unsigned d = 0; d < ndev; ++d)
+        if (x.part_size(d))
+            sample_sort::sort_buffer<T>(queue[d], x(d), x.part_size(d));
 
-            boost::compute::sort(
-                    boost::compute::make_buffer_iterator<T>(buf, 0),
-                    boost::compute::make_buffer_iterator<T>(buf, x.part_size(d)),
-                    q
-                    );
-        }
+    if (ndev < 2 || x.size() < 2) return;
+
+    // Regularly spaced samples of the sorted partitions, as many per
+    // partition as its share of the vector.
+    std::vector<T> sample;
+    for(unsigned d = 0; d < ndev; ++d) {
+        size_t n = x.part_size(d);
+        if (!n) continue;
+
+        size_t k = (sample_sort::oversampling * ndev * n + x.size() - 1) / x.size();
+        k = std::min(k, n);
+
+        size_t pos = sample.size();
+        sample.resize(pos + k);
+
+        for(size_t i = 0; i < k; ++i)
+            queue[d].enqueueReadBuffer(x(d), CL_FALSE,
+                    ((2 * i + 1) * n / (2 * k)) * sizeof(T), sizeof(T),
+                    &sample[pos + i]);
     }
+    sample_sort::finish(queue);
 
-    if (queue.size() > 1) {
-        // Get sorted partitions to host side and do multiway merge sort.
+    std::sort(sample.begin(), sample.end());
 
-        std::vector<T> src(x.size()), dst(x.size());
-        vex::copy(x, src);
+    // Bucket t holds elements in [splitter[t - 1], splitter[t]). Splitters
+    // are taken at the sample ranks of the partition bounds, so that buckets
+    // come close in size to the partitions they end up in.
+    std::vector<T> splitter(ndev - 1);
+    for(unsigned t = 0; t + 1 < ndev; ++t)
+        splitter[t] = sample[std::min(sample.size() - 1,
+                sample.size() * x.part_start(t + 1) / x.size())];
 
-        std::vector< typename std::vector<T>::const_iterator > begin(queue.size());
-        std::vector< typename std::vector<T>::const_iterator > end  (queue.size());
+    // Bucket bounds within each sorted partition.
+    std::vector<size_t> bound(ndev * (ndev + 1), 0);
+    for(unsigned s = 0; s < ndev; ++s) {
+        size_t n = x.part_size(s);
+        size_t *b = &bound[s * (ndev + 1)];
 
-        for(unsigned d = 0; d < queue.size(); ++d) {
-            begin[d] = src.begin() + x.part_start(d);
-            end  [d] = src.begin() + x.part_start(d + 1);
-        }
+        for(unsigned t = 0; t + 1 < ndev; ++t)
+            b[t + 1] = n ? sample_sort::lower_bound<T>(queue[s], x(s), n, splitter[t]) : 0;
 
+        b[ndev] = n;
+    }
+
+    std::vector<size_t> bucket_start(ndev + 1, 0);
+    for(unsigned t = 0; t < ndev; ++t) {
+        bucket_start[t + 1] = bucket_start[t];
+        for(unsigned s = 0; s < ndev; ++s)
+            bucket_start[t + 1] += bound[s * (ndev + 1) + t + 1] - bound[s * (ndev + 1) + t];
+    }
 
-        for(auto pos = dst.begin(); pos != dst.end(); ++pos) {
-            int winner = -1;
-            for(unsigned d = 0; d < queue.size(); ++d) {
-                if (begin[d] == end[d])
-                    continue;
+    // All-to-all exchange of the buckets, then local sorts.
+    std::vector<cl::Buffer> bucket(ndev);
+    for(unsigned t = 0; t < ndev; ++t) {
+        size_t m = bucket_start[t + 1] - bucket_start[t];
+        if (!m) continue;
 
-                if (winner < 0 || *begin[d] < *begin[winner])
-                    winner = d;
-            }
+        bucket[t] = cl::Buffer(qctx(queue[t]), CL_MEM_READ_WRITE, m * sizeof(T));
 
-            *pos = *begin[winner]++;
+        size_t pos = 0;
+        for(unsigned s = 0; s < ndev; ++s) {
+            size_t lo = bound[s * (ndev + 1) + t];
+            size_t hi = bound[s * (ndev + 1) + t + 1];
+
+            if (lo < hi) {
+                sample_sort::copy<T>(queue[s], x(s), lo, queue[t], bucket[t], pos, hi - lo);
+                pos += hi - lo;
+            }
         }
+    }
+
+    for(unsigned t = 0; t < ndev; ++t)
+        if (size_t m = bucket_start[t + 1] - bucket_start[t])
+            sample_sort::sort_buffer<T>(queue[t], bucket[t], m);
 
-        vex::copy(dst, x);
+    sample_sort::finish(queue);
+
+    // Concatenated buckets are the sorted vector; move them into the
+    // partitions.
+    for(unsigned d = 0; d < ndev; ++d) {
+        for(unsigned t = 0; t < ndev; ++t) {
+            size_t lo = std::max(x.part_start(d),     bucket_start[t]);
+            size_t hi = std::min(x.part_start(d + 1), bucket_start[t + 1]);
+
+            if (lo < hi)
+                sample_sort::copy<T>(queue[t], bucket[t], lo - bucket_start[t],
+                        queue[d], x(d), lo - x.part_start(d), hi - lo);
+        }
     }
+
+    sample_sort::finish(queue);
 }
 
 }
@@ -63,5 +63,49 @@ namespace viennacl {
     }
 }
 
+namespace vex {
+
+/// Views the memory of a ViennaCL vector as a VexCL vector.
+/**
+ * No data is copied: both vectors share the same buffer, so the ViennaCL
+ * context should be the VexCL one (see viennacl::ocl::setup_context()):
+ * \code
+ * viennacl::ocl::setup_context(0, ctx.context(0)(), ctx.device(0)(), ctx.queue(0)());
+ * viennacl::vector<double> v(n);
+ * vex::vector<double> x = vex::viennacl_view(ctx.queue(0), v);
+ * x = sin(x);
+ * \endcode
+ * The view has the size of the ViennaCL vector and ignores its padding.
+ */
+template <class VCLVector>
+vex::vector<typename VCLVector::cpu_value_type>
+viennacl_view(const cl::CommandQueue &queue, VCLVector &v) {
+    std::vector<size_t> part(2, 0);
+    part[1] = v.size();
+
+    return vex::vector<typename VCLVector::cpu_value_type>(
+            std::vector<cl::CommandQueue>(1, queue), part,
+            std::vector<cl::Buffer>(1, shared_buffer(v.handle().opencl_handle().get()))
+            );
+}
+
+/// Views the memory of a single-device VexCL vector as a ViennaCL vector.
+/**
+ * The ViennaCL vector type is given explicitly, and its current context
+ * should be the one of x:
+ * \code
+ * auto v = vex::viennacl_vector< viennacl::vector<double> >(x);
+ * \endcode
+ */
+template <class VCLVector>
+VCLVector viennacl_vector(const vex::vector<typename VCLVector::cpu_value_type> &x) {
+    if (x.queue_list().size() != 1)
+        throw std::logic_error("viennacl_vector: only single-device vectors are supported");
+
+    return VCLVector(x(0)(), x.size());
+}
+
+} // namespace vex
+
 // vim: et
 #endif
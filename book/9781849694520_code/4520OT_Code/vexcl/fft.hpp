@@ -38,6 +38,7 @@ THE SOFTWARE.
 #   include <clAmdFft.h>
 #else
 #   include <vexcl/fft/plan.hpp>
+#   include <vexcl/fft/distributed.hpp>
 #endif
 
 namespace vex {
@@ -215,36 +216,95 @@ enum direction {
     forward, inverse
 };
 
+/// Storage of the spectrum of real-valued data.
+enum spectrum_layout {
+    full_spectrum, ///< All n complex values.
+    half_spectrum  ///< Only n/2+1 nonredundant values of the hermitian spectrum.
+};
+
 template <typename T0, typename T1 = T0, class Planner = fft::planner>
 struct FFT {
     typedef T0 input_t;
     typedef T1 output_t;
     typedef typename cl_scalar_of<T1>::type value_type;
 
-    fft::plan<T0, T1, Planner> plan;
+    // Plans are shared between FFT objects of the same configuration.
+    std::shared_ptr< fft::plan<T0, T1, Planner> > plan;
+
+    // Multidimensional transforms on several devices.
+    std::shared_ptr< fft::distributed_plan<T0, T1, Planner> > dplan;
 
     /// 1D constructor
     FFT(const std::vector<cl::CommandQueue> &queues,
         size_t length, direction dir = forward,
         const Planner &planner = Planner())
-        : plan(queues, std::vector<size_t>(1, length), dir == inverse, planner) {}
+        : plan(fft::cached_plan<T0, T1>(queues, std::vector<size_t>(1, length), dir == inverse, planner)) {}
+
+    /// Batched 1D constructor
+    /**
+     * Transforms batch contiguous sequences of the given length at once.
+     */
+    FFT(const std::vector<cl::CommandQueue> &queues,
+        size_t length, size_t batch, direction dir = forward,
+        const Planner &planner = Planner())
+        : plan(fft::cached_plan<T0, T1>(queues, std::vector<size_t>(1, length), dir == inverse, planner, batch)) {}
+
+    /// Real-to-complex or complex-to-real 1D constructor
+    /**
+     * With half_spectrum layout, the forward transform takes n reals
+     * (FFT<cl_float, cl_float2>) and gives n/2+1 complex values; the inverse
+     * one (FFT<cl_float2, cl_float>) goes the other way. The transform is
+     * done by a complex FFT of length n/2. n should be even.
+     */
+    FFT(const std::vector<cl::CommandQueue> &queues,
+        size_t length, direction dir, spectrum_layout layout,
+        const Planner &planner = Planner())
+        : plan(fft::cached_plan<T0, T1>(queues, std::vector<size_t>(1, length), dir == inverse, planner, 1, layout == half_spectrum)) {}
+
+    /// Batched real-to-complex or complex-to-real 1D constructor
+    FFT(const std::vector<cl::CommandQueue> &queues,
+        size_t length, size_t batch, direction dir, spectrum_layout layout,
+        const Planner &planner = Planner())
+        : plan(fft::cached_plan<T0, T1>(queues, std::vector<size_t>(1, length), dir == inverse, planner, batch, layout == half_spectrum)) {}
 
     /// N-D constructors
+    /**
+     * With several devices in the queue list, multidimensional transforms
+     * are distributed between the devices (see fft::distributed_plan).
+     */
     FFT(const std::vector<cl::CommandQueue> &queues,
         const std::vector<size_t> &lengths, direction dir = forward,
         const Planner &planner = Planner())
-        : plan(queues, lengths, dir == inverse, planner) {}
+    {
+        init(queues, lengths, dir, planner);
+    }
 
 #ifndef BOOST_NO_INITIALIZER_LISTS
     FFT(const std::vector<cl::CommandQueue> &queues,
         const std::initializer_list<size_t> &lengths, direction dir = forward,
         const Planner &planner = Planner())
-        : plan(queues, lengths, dir == inverse, planner) {}
+    {
+        init(queues, std::vector<size_t>(lengths), dir, planner);
+    }
 #endif
 
     template <bool negate, bool append, class Expr>
     void execute(const Expr &input, vector<T1> &output, value_type scale) {
-        plan(input, output, append, negate ? -scale : scale);
+        if (dplan)
+            (*dplan)(input, output, append, negate ? -scale : scale);
+        else
+            (*plan)(input, output, append, negate ? -scale : scale);
+    }
+
+    void init(const std::vector<cl::CommandQueue> &queues,
+        const std::vector<size_t> &lengths, direction dir,
+        const Planner &planner)
+    {
+        if (queues.size() > 1 && lengths.size() > 1)
+            dplan = std::make_shared< fft::distributed_plan<T0, T1, Planner> >(
+                    queues, lengths, dir == inverse, planner);
+        else
+            plan = fft::cached_plan<T0, T1>(queues, lengths, dir == inverse, planner);
     }
 
 
@@ -260,4 +320,8 @@ struct FFT {
 
 }
 
+#ifndef USE_AMD_FFT
+#   include <vexcl/fft/convolution.hpp>
+#endif
+
 #endif
@@ -0,0 +1,404 @@
+#ifndef VEXCL_FFT_CONVOLUTION_HPP
+#define VEXCL_FFT_CONVOLUTION_HPP
+
+/*
+The MIT License
+
+Copyright (c) 2012-2013 Denis Demidov <ddemidov@ksu.ru>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/**
+ * \file   fft/convolution.hpp
+ * \author Denis Demidov <ddemidov@ksu.ru>
+ * \brief  Convolution with long kernels by overlap-save FFT.
+ */
+
+#include <vector>
+#include <memory>
+#include <sstream>
+#include <algorithm>
+#include <cassert>
+
+#include <vexcl/vector.hpp>
+#include <vexcl/stencil.hpp>
+#include <vexcl/kernel_cache.hpp>
+
+namespace vex {
+
+/// Correlation or convolution of a vector with a long kernel.
+/**
+ * Computes the same result as vex::stencil,
+ * \f$y_i = \sum_j s_j x_{i + j - c}\f$, with points outside of the vector
+ * taking the value of the nearest boundary point. With flip set, the kernel
+ * is reversed, which gives convolution instead of correlation.
+ *
+ * Kernels not wider than direct_width are applied directly with vex::stencil.
+ * Wider kernels use the overlap-save method: the input is cut into
+ * overlapping blocks, which are transformed with a single batched
+ * real-to-complex FFT, multiplied by the spectrum of the kernel, and
+ * transformed back. The cost per output is then \f$O(\log K)\f$ instead of
+ * \f$O(K)\f$:
+ * \code
+ * vex::fft_convolution<float> fir(ctx, taps, taps.size() / 2);
+ * y = x * fir;
+ * \endcode
+ * The FFT path requires a single device; with several devices the direct
+ * path is always used.
+ */
+template <typename T>
+class fft_convolution {
+    public:
+        typedef T value_type;
+        typedef typename cl_vector_of<T, 2>::type T2;
+
+        /// Constructor.
+        /**
+         * \param queue        vector of queues.
+         * \param st           kernel values.
+         * \param center       center of the kernel.
+         * \param flip         reverse the kernel (convolution).
+         * \param direct_width widest kernel applied directly.
+         */
+        fft_convolution(const std::vector<cl::CommandQueue> &queue,
+                const std::vector<T> &st, uint center, bool flip = false,
+                size_t direct_width = 64)
+            : queue(queue), width(st.size()),
+              center(flip ? st.size() - 1 - center : center),
+              blocks(0), current(0)
+        {
+            assert(center < width);
+
+            std::vector<T> s(st);
+            if (flip) std::reverse(s.begin(), s.end());
+
+            if (width <= direct_width || queue.size() > 1) {
+                direct.reset(new stencil<T>(queue, s, this->center));
+                return;
+            }
+
+            // Block size: size of FFT, and number of outputs per block.
+            L = 1024;
+            while(L < 4 * width) L *= 2;
+            M = L - width + 1;
+
+            init_kernels();
+
+            std::vector<T> padded(L, static_cast<T>(0));
+            std::copy(s.begin(), s.end(), padded.begin());
+
+            vector<T> sp(queue, padded);
+            FFT<T, T2> f(queue, L, forward, half_spectrum);
+
+            spectrum.resize(queue, L / 2 + 1);
+            spectrum = f(sp);
+
+            for(int i = 0; i < 2; i++) {
+                history[i].resize(queue, width - 1);
+                history[i] = static_cast<T>(0);
+            }
+        }
+
+        /// Convolve with a vector.
+        /**
+         * y = alpha * y + beta * conv(x);
+         */
+        void convolve(const vector<T> &x, vector<T> &y,
+                T alpha = 0, T beta = 1) const
+        {
+            if (direct)
+                direct->convolve(x, y, alpha, beta);
+            else
+                apply(x, y, alpha, beta, false);
+        }
+
+        /// Processes the next chunk of a stream.
+        /**
+         * Successive calls treat their inputs as parts of a single stream:
+         * \f$y_i = \sum_j s_j x_{t + i + j - K + 1}\f$, where t is the
+         * position of the chunk in the stream, i.e. every output uses the
+         * last K samples of the stream. Samples before the start of the
+         * stream are zero. Only available on the FFT path.
+         */
+        void stream(const vector<T> &x, vector<T> &y) {
+            assert(!direct && "stream() needs the FFT path");
+
+            apply(x, y, 0, 1, true);
+
+            // Keep the last K - 1 samples of the stream.
+            cl::Kernel &k = krn->shift;
+            size_t hlen = width - 1;
+
+            uint pos = 0;
+            k.setArg(pos++, x.size());
+            k.setArg(pos++, hlen);
+            k.setArg(pos++, x(0));
+            k.setArg(pos++, history[current](0));
+            k.setArg(pos++, history[1 - current](0));
+
+            queue[0].enqueueNDRangeKernel(k, cl::NullRange,
+                    alignup(hlen, krn->wgsize), krn->wgsize, 0, event_trace<>::kernel(queue[0], k));
+
+            current = 1 - current;
+        }
+
+        /// Restarts the stream.
+        void reset() {
+            if (direct) return;
+            history[current] = static_cast<T>(0);
+        }
+    private:
+        const std::vector<cl::CommandQueue> &queue;
+
+        size_t width, center;
+        size_t L, M;
+
+        std::unique_ptr< stencil<T> > direct;
+
+        vector<T2> spectrum;
+
+        mutable size_t blocks;
+        mutable vector<T>  seg;
+        mutable vector<T2> sbuf;
+        mutable std::shared_ptr< FFT<T, T2> > fwd;
+        mutable std::shared_ptr< FFT<T2, T> > inv;
+
+        vector<T> history[2];
+        int current;
+
+        struct kernels {
+            cl::Kernel gather;
+            cl::Kernel multiply;
+            cl::Kernel scatter;
+            cl::Kernel shift;
+            uint       wgsize;
+        };
+
+        std::shared_ptr<kernels> krn;
+
+        void init_kernels();
+
+        void apply(const vector<T> &x, vector<T> &y, T alpha, T beta,
+                bool streaming) const;
+};
+
+template <typename T>
+void fft_convolution<T>::init_kernels() {
+    krn = kernel_cache<>::find<kernels>(queue[0]);
+
+    if (krn) return;
+
+    cl::Context context = qctx(queue[0]);
+    cl::Device  device  = qdev(queue[0]);
+
+    std::ostringstream source;
+
+    source << standard_kernel_header <<
+        "typedef " << type_name<T>()  << " real;\n"
+        "typedef " << type_name<T2>() << " real2;\n"
+        "kernel void gather(\n"
+        "    " << type_name<size_t>() << " n,\n"
+        "    " << type_name<size_t>() << " total,\n"
+        "    " << type_name<size_t>() << " M,\n"
+        "    " << type_name<size_t>() << " L,\n"
+        "    int lhalo,\n"
+        "    char streaming,\n"
+        "    global const real *x,\n"
+        "    global const real *hist,\n"
+        "    global real *seg\n"
+        "    )\n"
+        "{\n"
+        "    size_t grid_size = get_global_size(0);\n"
+        "    for(size_t idx = get_global_id(0); idx < total; idx += grid_size) {\n"
+        "        long i = (long)(idx / L) * M + idx % L - lhalo;\n"
+        "        real v;\n"
+        "        if (i < 0)\n"
+        "            v = streaming ? hist[lhalo + i] : x[0];\n"
+        "        else if (i >= n)\n"
+        "            v = streaming ? 0 : x[n - 1];\n"
+        "        else\n"
+        "            v = x[i];\n"
+        "        seg[idx] = v;\n"
+        "    }\n"
+        "}\n"
+        "kernel void multiply(\n"
+        "    " << type_name<size_t>() << " total,\n"
+        "    " << type_name<size_t>() << " m,\n"
+        "    global real2 *s,\n"
+        "    global const real2 *h\n"
+        "    )\n"
+        "{\n"
+        "    size_t grid_size = get_global_size(0);\n"
+        "    for(size_t idx = get_global_id(0); idx < total; idx += grid_size) {\n"
+        "        real2 a = s[idx];\n"
+        "        real2 b = h[idx % m];\n"
+        "        s[idx] = (real2)(a.x * b.x + a.y * b.y, a.y * b.x - a.x * b.y);\n"
+        "    }\n"
+        "}\n"
+        "kernel void scatter(\n"
+        "    " << type_name<size_t>() << " n,\n"
+        "    " << type_name<size_t>() << " M,\n"
+        "    " << type_name<size_t>() << " L,\n"
+        "    global const real *r,\n"
+        "    global real *y,\n"
+        "    real alpha, real beta\n"
+        "    )\n"
+        "{\n"
+        "    size_t grid_size = get_global_size(0);\n"
+        "    for(size_t i = get_global_id(0); i < n; i += grid_size) {\n"
+        "        real v = r[(i / M) * L + i % M];\n"
+        "        if (alpha)\n"
+        "            y[i] = alpha * y[i] + beta * v;\n"
+        "        else\n"
+        "            y[i] = beta * v;\n"
+        "    }\n"
+        "}\n"
+        "kernel void shift(\n"
+        "    " << type_name<size_t>() << " n,\n"
+        "    " << type_name<size_t>() << " hlen,\n"
+        "    global const real *x,\n"
+        "    global const real *hist,\n"
+        "    global real *next\n"
+        "    )\n"
+        "{\n"
+        "    size_t j = get_global_id(0);\n"
+        "    if (j < hlen)\n"
+        "        next[j] = (n + j < hlen) ? hist[n + j] : x[n + j - hlen];\n"
+        "}\n";
+
+    auto program = build_sources(context, source.str());
+
+    kernels k;
+
+    k.gather   = cl::Kernel(program, "gather");
+    k.multiply = cl::Kernel(program, "multiply");
+    k.scatter  = cl::Kernel(program, "scatter");
+    k.shift    = cl::Kernel(program, "shift");
+
+    k.wgsize = std::min(
+            std::min(kernel_workgroup_size(k.gather,   device),
+                     kernel_workgroup_size(k.multiply, device)),
+            std::min(kernel_workgroup_size(k.scatter,  device),
+                     kernel_workgroup_size(k.shift,    device))
+            );
+
+    krn = kernel_cache<>::insert(queue[0], k);
+}
+
+template <typename T>
+void fft_convolution<T>::apply(const vector<T> &x, vector<T> &y,
+        T alpha, T beta, bool streaming) const
+{
+    size_t n = x.size();
+    if (!n) return;
+
+    size_t nb = (n + M - 1) / M;
+
+    if (nb != blocks) {
+        blocks = nb;
+
+        seg.resize(queue, blocks * L);
+        sbuf.resize(queue, blocks * (L / 2 + 1));
+
+        fwd = std::make_shared< FFT<T, T2> >(queue, L, blocks, forward, half_spectrum);
+        inv = std::make_shared< FFT<T2, T> >(queue, L, blocks, inverse, half_spectrum);
+    }
+
+    cl::Device device = qdev(queue[0]);
+
+    size_t g_size = device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU ?
+        krn->wgsize * device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() :
+        krn->wgsize * device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * 4;
+
+    // Overlapping blocks of input.
+    {
+        cl::Kernel &k = krn->gather;
+
+        size_t total = blocks * L;
+        int    lhalo = streaming ? width - 1 : center;
+        char   strm  = streaming;
+
+        uint pos = 0;
+        k.setArg(pos++, n);
+        k.setArg(pos++, total);
+        k.setArg(pos++, M);
+        k.setArg(pos++, L);
+        k.setArg(pos++, lhalo);
+        k.setArg(pos++, strm);
+        k.setArg(pos++, x(0));
+        k.setArg(pos++, history[current](0));
+        k.setArg(pos++, seg(0));
+
+        queue[0].enqueueNDRangeKernel(k, cl::NullRange, g_size, krn->wgsize, 0, event_trace<>::kernel(queue[0], k));
+    }
+
+    sbuf = (*fwd)(seg);
+
+    // Correlation with the kernel in the frequency domain.
+    {
+        cl::Kernel &k = krn->multiply;
+
+        size_t m     = L / 2 + 1;
+        size_t total = blocks * m;
+
+        uint pos = 0;
+        k.setArg(pos++, total);
+        k.setArg(pos++, m);
+        k.setArg(pos++, sbuf(0));
+        k.setArg(pos++, spectrum(0));
+
+        queue[0].enqueueNDRangeKernel(k, cl::NullRange, g_size, krn->wgsize, 0, event_trace<>::kernel(queue[0], k));
+    }
+
+    seg = (*inv)(sbuf);
+
+    // The first M outputs of each block are not affected by wraparound.
+    {
+        cl::Kernel &k = krn->scatter;
+
+        uint pos = 0;
+        k.setArg(pos++, n);
+        k.setArg(pos++, M);
+        k.setArg(pos++, L);
+        k.setArg(pos++, seg(0));
+        k.setArg(pos++, y(0));
+        k.setArg(pos++, alpha);
+        k.setArg(pos++, beta);
+
+        queue[0].enqueueNDRangeKernel(k, cl::NullRange, g_size, krn->wgsize, 0, event_trace<>::kernel(queue[0], k));
+    }
+}
+
+template <typename T>
+conv< fft_convolution<T>, vector<T> >
+operator*( const fft_convolution<T> &s, const vector<T> &x ) {
+    return conv< fft_convolution<T>, vector<T> >(s, x);
+}
+
+template <typename T>
+conv< fft_convolution<T>, vector<T> >
+operator*( const vector<T> &x, const fft_convolution<T> &s ) {
+    return conv< fft_convolution<T>, vector<T> >(s, x);
+}
+
+} // namespace vex
+
+// vim: et
+#endif
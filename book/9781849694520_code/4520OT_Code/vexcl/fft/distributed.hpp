@@ -0,0 +1,350 @@
+#ifndef VEXCL_FFT_DISTRIBUTED_HPP
+#define VEXCL_FFT_DISTRIBUTED_HPP
+
+/*
+The MIT License
+
+Copyright (c) 2012-2013 Denis Demidov <ddemidov@ksu.ru>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/**
+ * \file   fft/distributed.hpp
+ * \author Denis Demidov <ddemidov@ksu.ru>
+ * \brief  Multidimensional FFT spanning several devices.
+ */
+
+#include <vector>
+#include <memory>
+#include <numeric>
+#include <algorithm>
+
+#include <vexcl/vector.hpp>
+#include <vexcl/fft/plan.hpp>
+
+namespace vex {
+namespace fft {
+
+/// Multidimensional FFT spanning several devices.
+/**
+ * Uses slab decomposition. For each dimension (starting with the fastest
+ * one) the data is viewed as a height x width matrix, where width is the
+ * current dimension. Rows of the matrix are split between devices, and each
+ * device does a batched 1D transform of its rows with a single-device plan.
+ * The matrix is then transposed globally: each device transposes its slab
+ * locally, and the blocks are sent to their new owners with rectangular
+ * copies (device to device inside a context, staged through the host
+ * between contexts). After the last dimension the data is back in its
+ * original order.
+ */
+template <class T0, class T1, class Planner = planner>
+struct distributed_plan {
+    typedef typename cl_scalar_of<T0>::type T0s;
+    typedef typename cl_scalar_of<T1>::type T1s;
+    static_assert(boost::is_same<T0s, T1s>::value, "Input and output must have same precision.");
+    typedef T0s T;
+
+    typedef typename cl_vector_of<T, 2>::type T2;
+    typedef plan<T2, T2, Planner> local_plan;
+
+    VEX_FUNCTION(r2c, T2(T), "return (" + type_name<T2>() + ")(prm1, 0);");
+    VEX_FUNCTION(c2r, T(T2), "return prm1.x;");
+
+    const std::vector<cl::CommandQueue> queues;
+    const std::vector<size_t> sizes;
+    T scale;
+
+    // Transform along one dimension.
+    struct stage {
+        size_t width, height;
+
+        // Rows of the height x width matrix owned by each device.
+        std::vector<size_t> row;
+
+        // Rows of the transposed matrix owned by each device.
+        std::vector<size_t> col;
+
+        std::vector< std::shared_ptr<local_plan> >  fft;
+        std::vector< std::shared_ptr<kernel_call> > transpose;
+    };
+
+    std::vector<stage> stages;
+
+    // Locally transposed slabs, and the result of the last stage.
+    std::vector<cl::Buffer> scratch, result;
+
+    vector<T2> tmp;
+
+    // \param sizes same as for plan; at least two dimensions.
+    distributed_plan(const std::vector<cl::CommandQueue> &queues,
+            const std::vector<size_t> &sizes, bool inverse,
+            const Planner &planner = Planner())
+        : queues(queues), sizes(sizes),
+          scratch(queues.size()), result(queues.size())
+    {
+        assert(sizes.size() >= 2);
+
+        const size_t ndev  = queues.size();
+        const size_t total = std::accumulate(sizes.begin(), sizes.end(),
+                static_cast<size_t>(1), std::multiplies<size_t>());
+
+        scale = inverse ? ((T)1 / total) : 1;
+
+        // The stages move data between the buffers of the 1D plans, so the
+        // plans keep buffers of their own.
+        Planner own = planner;
+        own.scratch.reset();
+        own.inplace = false;
+
+        std::vector<size_t> scratch_size(ndev, 1);
+
+        for(auto n = sizes.rbegin() ; n != sizes.rend() ; n++) {
+            stage s;
+
+            s.width  = *n;
+            s.height = total / *n;
+
+            if(stages.empty()) {
+                s.row = vex::partition(s.height, queues);
+            } else {
+                // Each row of the transposed matrix is a whole number of
+                // rows of the current one.
+                const stage &p = stages.back();
+                s.row.resize(ndev + 1);
+                for(size_t d = 0 ; d <= ndev ; d++)
+                    s.row[d] = p.col[d] * (p.height / s.width);
+            }
+
+            s.col = vex::partition(s.width, queues);
+
+            s.fft.resize(ndev);
+            s.transpose.resize(ndev);
+
+            for(size_t d = 0 ; d < ndev ; d++) {
+                size_t rows = s.row[d + 1] - s.row[d];
+                if(!rows) continue;
+
+                s.fft[d] = cached_plan<T2, T2>(
+                        std::vector<cl::CommandQueue>(1, queues[d]),
+                        std::vector<size_t>(1, s.width), inverse, own, rows);
+
+                scratch_size[d] = std::max(scratch_size[d], rows * s.width);
+            }
+
+            stages.push_back(s);
+        }
+
+        for(size_t d = 0 ; d < ndev ; d++) {
+            const stage &s = stages.back();
+
+            scratch[d] = memory_pool<>::create("fft", qctx(queues[d]), CL_MEM_READ_WRITE,
+                    sizeof(T2) * scratch_size[d]);
+
+            result[d] = memory_pool<>::create("fft", qctx(queues[d]), CL_MEM_READ_WRITE,
+                    sizeof(T2) * std::max<size_t>(1, (s.col[d + 1] - s.col[d]) * s.height));
+        }
+
+        for(auto s = stages.begin() ; s != stages.end() ; s++) {
+            for(size_t d = 0 ; d < ndev ; d++) {
+                if(!s->fft[d]) continue;
+
+                const local_plan &p = *s->fft[d];
+
+                s->transpose[d] = std::make_shared<kernel_call>(transpose_kernel<T>(
+                            queues[d], s->width, s->row[d + 1] - s->row[d],
+                            p.bufs[p.output], scratch[d]));
+            }
+        }
+    }
+
+    /// Execute the complete transformation.
+    template<class Expr>
+    void operator()(const Expr &in, vector<T1> &out, bool append, T ex_scale) {
+        const size_t ndev  = queues.size();
+        const size_t total = stages[0].width * stages[0].height;
+
+        if(tmp.size() != total) tmp = std::move(vector<T2>(queues, total));
+
+        if(std::is_same<T0, T>::value) tmp = r2c(in);
+        else tmp = in;
+
+        finish();
+
+        // Scatter the input to the slabs of the first stage.
+        {
+            const stage &s = stages[0];
+
+            for(size_t d = 0 ; d < ndev ; d++) {
+                if(!s.fft[d]) continue;
+
+                const local_plan &p = *s.fft[d];
+                scatter(p.bufs[p.input], d, s.row[d] * s.width, s.row[d + 1] * s.width, false);
+            }
+        }
+
+        finish();
+
+        for(size_t k = 0 ; k < stages.size() ; k++) {
+            const stage &s = stages[k];
+
+            for(size_t d = 0 ; d < ndev ; d++) {
+                if(!s.fft[d]) continue;
+
+                s.fft[d]->run();
+                queues[d].enqueueNDRangeKernel(s.transpose[d]->kernel,
+                        cl::NullRange, s.transpose[d]->global, s.transpose[d]->local, 0, event_trace<>::kernel(queues[d], s.transpose[d]->kernel));
+            }
+
+            finish();
+
+            // Send the transposed blocks to their new owners.
+            for(size_t dst = 0 ; dst < ndev ; dst++) {
+                size_t cols = s.col[dst + 1] - s.col[dst];
+                if(!cols) continue;
+
+                cl::Buffer target;
+                if(k + 1 < stages.size()) {
+                    const local_plan &p = *stages[k + 1].fft[dst];
+                    target = p.bufs[p.input];
+                } else {
+                    target = result[dst];
+                }
+
+                for(size_t src = 0 ; src < ndev ; src++) {
+                    size_t rows = s.row[src + 1] - s.row[src];
+                    if(!rows) continue;
+
+                    copy_block(src, scratch[src], s.col[dst], rows,
+                            dst, target, s.row[src], s.height, cols);
+                }
+            }
+
+            finish();
+        }
+
+        // Gather the result.
+        {
+            const stage &s = stages.back();
+
+            for(size_t d = 0 ; d < ndev ; d++)
+                if(s.col[d + 1] > s.col[d])
+                    scatter(result[d], d, s.col[d] * s.height, s.col[d + 1] * s.height, true);
+        }
+
+        finish();
+
+        if(std::is_same<T1, T>::value) {
+            if(append) out += c2r(tmp) * (ex_scale * scale);
+            else out = c2r(tmp) * (ex_scale * scale);
+        } else {
+            if(append) out += tmp * (ex_scale * scale);
+            else out = tmp * (ex_scale * scale);
+        }
+    }
+
+    private:
+        void finish() const {
+            for(auto q = queues.begin() ; q != queues.end() ; q++) q->finish();
+        }
+
+        bool same_context(size_t a, size_t b) const {
+            return qctx(queues[a])() == qctx(queues[b])();
+        }
+
+        // Copies elements [begin, end) between tmp and a buffer on device d
+        // holding this range.
+        void scatter(const cl::Buffer &buf, size_t d, size_t begin, size_t end, bool gather) {
+            for(uint v = 0 ; v < queues.size() ; v++) {
+                size_t lo = std::max(begin, tmp.part_start(v));
+                size_t hi = std::min(end, tmp.part_start(v + 1));
+                if(lo >= hi) continue;
+
+                size_t tmp_off = (lo - tmp.part_start(v)) * sizeof(T2);
+                size_t buf_off = (lo - begin) * sizeof(T2);
+                size_t bytes   = (hi - lo) * sizeof(T2);
+
+                if(same_context(v, d)) {
+                    if(gather)
+                        queues[v].enqueueCopyBuffer(buf, tmp(v), buf_off, tmp_off, bytes);
+                    else
+                        queues[d].enqueueCopyBuffer(tmp(v), buf, tmp_off, buf_off, bytes);
+                } else {
+                    std::vector<T2> host(hi - lo);
+                    if(gather) {
+                        queues[d].enqueueReadBuffer(buf, CL_TRUE, buf_off, bytes, host.data());
+                        queues[v].enqueueWriteBuffer(tmp(v), CL_TRUE, tmp_off, bytes, host.data());
+                    } else {
+                        queues[v].enqueueReadBuffer(tmp(v), CL_TRUE, tmp_off, bytes, host.data());
+                        queues[d].enqueueWriteBuffer(buf, CL_TRUE, buf_off, bytes, host.data());
+                    }
+                }
+            }
+        }
+
+        // Copies rows [row, row + nrows) of the transposed slab of device src
+        // (each row has width elements) to the columns [x, x + width) of the
+        // target buffer on device dst, which has pitch elements per row.
+        void copy_block(
+                size_t src, const cl::Buffer &slab, size_t row, size_t width,
+                size_t dst, const cl::Buffer &target, size_t x, size_t pitch,
+                size_t nrows)
+        {
+            cl::size_t<3> region;
+            region[0] = width * sizeof(T2);
+            region[1] = nrows;
+            region[2] = 1;
+
+            cl::size_t<3> dst_origin;
+            dst_origin[0] = x * sizeof(T2);
+            dst_origin[1] = 0;
+            dst_origin[2] = 0;
+
+            if(same_context(src, dst)) {
+                cl::size_t<3> src_origin;
+                src_origin[0] = 0;
+                src_origin[1] = row;
+                src_origin[2] = 0;
+
+                queues[dst].enqueueCopyBufferRect(slab, target,
+                        src_origin, dst_origin, region,
+                        width * sizeof(T2), 0, pitch * sizeof(T2), 0);
+            } else {
+                // The block is contiguous in the slab.
+                std::vector<T2> host(width * nrows);
+
+                queues[src].enqueueReadBuffer(slab, CL_TRUE,
+                        row * width * sizeof(T2), host.size() * sizeof(T2), host.data());
+
+                cl::size_t<3> host_origin;
+                host_origin[0] = 0;
+                host_origin[1] = 0;
+                host_origin[2] = 0;
+
+                queues[dst].enqueueWriteBufferRect(target, CL_TRUE,
+                        dst_origin, host_origin, region,
+                        pitch * sizeof(T2), 0, width * sizeof(T2), 0, host.data());
+            }
+        }
+};
+
+} // namespace fft
+} // namespace vex
+
+#endif
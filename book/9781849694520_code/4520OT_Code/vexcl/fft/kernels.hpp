@@ -32,6 +32,9 @@ THE SOFTWARE.
  */
 
 #include <cmath>
+#include <string>
+#include <vexcl/kernel_cache.hpp>
+#include <vexcl/memory_pool.hpp>
 
 namespace vex {
 namespace fft {
@@ -62,12 +65,37 @@ struct kernel_call {
     cl::Program program;
     cl::Kernel kernel;
     cl::NDRange global, local;
+    cl::Buffer table; // twiddle factors read by the kernel, if any
+    std::vector< std::pair<cl_uint, size_t> > args; // buffer arguments: (index, plan buffer)
     kernel_call(bool o, std::string d, cl::Program p, cl::Kernel k, cl::NDRange g, cl::NDRange l) : once(o), count(0), desc(d), program(p), kernel(k), global(g), local(l) {}
 };
 
 
 
 
+// Programs are shared between plans. Each plan creates its own kernels,
+// since kernel arguments are set once at planning time.
+struct program_entry {
+    cl::Program program;
+};
+
+inline cl::Program cached_program(const cl::CommandQueue &queue,
+        const std::string &source, const std::string &options = "")
+{
+    std::string sig = options + '\n' + source;
+
+    auto e = kernel_cache<>::find<program_entry>(queue, sig);
+
+    if (!e) {
+        program_entry entry;
+        entry.program = build_sources(qctx(queue), source, options);
+        e = kernel_cache<>::insert(queue, entry, sig);
+    }
+
+    return e->program;
+}
+
+
 // generates "(prefix vfrom,vfrom+1,...,vto)"
 inline void param_list(std::ostringstream &o, std::string prefix, size_t from, size_t to, size_t step = 1) {
     o << '(';
@@ -77,12 +105,16 @@ inline void param_list(std::ostringstream &o, std::string prefix, size_t from, s
     } o << ')';
 }
 
+// With a twiddle table, the factors of input k are at
+// tw[k * (radix - 1) + i - 1], i = 1..radix-1, in the address space given.
 template <class T>
-inline void kernel_radix(std::ostringstream &o, pow radix, bool invert) {
+inline void kernel_radix(std::ostringstream &o, pow radix, bool invert, const char *table = 0) {
     o << in_place_dft(radix.value, invert);
 
     // kernel.
-    o << "__kernel void radix(__global const real2_t *x, __global real2_t *y, uint p, uint threads) {\n"
+    o << "__kernel void radix(__global const real2_t *x, __global real2_t *y, uint p, uint threads";
+    if(table) o << ", " << table << " const real2_t *tw";
+    o << ") {\n"
       << "  const size_t i = get_global_id(0);\n"
       << "  if(i >= threads) return;\n"
         // index in input sequence, in 0..P-1
@@ -96,10 +128,16 @@ inline void kernel_radix(std::ostringstream &o, pow radix, bool invert) {
 
     // twiddle
     o << "  if(p != 1) {\n";
-    for(size_t i = 1 ; i < radix.value ; i++) {
-        const T alpha = -2 * static_cast<T>(M_PI) * i / radix.value;
-        o << "    v" << i << " = mul(v" << i << ", twiddle("
-          << "(real_t)" << alpha << " * k / p));\n";
+    if(table) {
+        o << "    tw += k * " << radix.value - 1 << ";\n";
+        for(size_t i = 1 ; i < radix.value ; i++)
+            o << "    v" << i << " = mul(v" << i << ", tw[" << i - 1 << "]);\n";
+    } else {
+        for(size_t i = 1 ; i < radix.value ; i++) {
+            const T alpha = -2 * static_cast<T>(M_PI) * i / radix.value;
+            o << "    v" << i << " = mul(v" << i << ", twiddle("
+              << "(real_t)" << alpha << " * k / p));\n";
+        }
     }
     o << "  }\n";
 
@@ -155,24 +193,63 @@ inline void twiddle_code(std::ostringstream &o) {
 }
 
 
+// Twiddle factors of a radix stage, exp(-2 pi i j k / (radix p)) for
+// k = 0..p-1, j = 1..radix-1, computed in double precision on the host.
+template <class T>
+inline cl::Buffer twiddle_table(const cl::CommandQueue &queue, pow radix, size_t p) {
+    typedef typename cl_vector_of<T, 2>::type T2;
+
+    std::vector<T2> tw(p * (radix.value - 1));
+    for(size_t k = 0 ; k < p ; k++)
+        for(size_t j = 1 ; j < radix.value ; j++) {
+            // reduce j * k modulo radix * p before conversion to real.
+            const double alpha = -2 * M_PI * ((j * k) % (radix.value * p)) / (radix.value * p);
+            T2 &t = tw[k * (radix.value - 1) + j - 1];
+            t.s[0] = static_cast<T>(std::cos(alpha));
+            t.s[1] = static_cast<T>(std::sin(alpha));
+        }
+
+    return memory_pool<>::create("fft", qctx(queue), CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+            sizeof(T2) * tw.size(), tw.data());
+}
+
+// With table set, twiddle factors are read from a precomputed table (in
+// constant memory when it fits) instead of being computed with sin/cos.
 template <class T>
-inline kernel_call radix_kernel(bool once, const cl::CommandQueue &queue, size_t n, size_t batch, bool invert, pow radix, size_t p, const cl::Buffer &in, const cl::Buffer &out) {
+inline kernel_call radix_kernel(bool once, const cl::CommandQueue &queue, size_t n, size_t batch, bool invert, pow radix, size_t p, const cl::Buffer &in, const cl::Buffer &out, bool table = false) {
+    typedef typename cl_vector_of<T, 2>::type T2;
+
+    // the first stage has no twiddles.
+    table = table && p > 1;
+
+    const char *space = 0;
+    if(table)
+        space = sizeof(T2) * p * (radix.value - 1) <=
+            qdev(queue).getInfo<CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE>() / 2
+            ? "__constant" : "__global";
+
     std::ostringstream o;
     o << std::setprecision(25);
     kernel_common<T>(o);
     mul_code(o, invert);
-    twiddle_code<T>(o);
+    if(!table) twiddle_code<T>(o);
 
     const size_t m = n / radix.value;
-    kernel_radix<T>(o, radix, invert);
+    kernel_radix<T>(o, radix, invert, space);
 
-    auto program = build_sources(qctx(queue), o.str(), "-cl-mad-enable -cl-fast-relaxed-math");
+    auto program = cached_program(queue, o.str(), "-cl-mad-enable -cl-fast-relaxed-math");
     cl::Kernel kernel(program, "radix");
     kernel.setArg(0, in);
     kernel.setArg(1, out);
     kernel.setArg<cl_uint>(2, p);
     kernel.setArg<cl_uint>(3, m);
 
+    cl::Buffer tw;
+    if(table) {
+        tw = twiddle_table<T>(queue, radix, p);
+        kernel.setArg(4, tw);
+    }
+
     const auto device = qdev(queue);
     const size_t wg_mul = kernel.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device);
     //const size_t max_cu = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
@@ -183,9 +260,13 @@ inline kernel_call radix_kernel(bool once, const cl::CommandQueue &queue, size_t
     const size_t threads = int_ceil(m, wg);
 
     std::ostringstream desc;
-    desc << "dft{r=" << radix << ", p=" << p << ", n=" << n << ", batch=" << batch << ", threads=" << m << "(" << threads << "), wg=" << wg << ", in=" << in() << ", out=" << out() << "}";
+    desc << "dft{r=" << radix << ", p=" << p << ", n=" << n << ", batch=" << batch << ", threads=" << m << "(" << threads << "), wg=" << wg << ", in=" << in() << ", out=" << out();
+    if(table) desc << ", twiddles=" << space;
+    desc << "}";
 
-    return kernel_call(once, desc.str(), program, kernel, cl::NDRange(threads, batch), cl::NDRange(wg, 1));
+    kernel_call call(once, desc.str(), program, kernel, cl::NDRange(threads, batch), cl::NDRange(wg, 1));
+    call.table = tw;
+    return call;
 }
 
 
@@ -227,7 +308,7 @@ inline kernel_call transpose_kernel(const cl::CommandQueue &queue, size_t width,
       << "    output[target_x + target_y * height] = block[local_x + local_y * block_size];\n"
       << "}\n";
 
-    auto program = build_sources(qctx(queue), o.str());
+    auto program = cached_program(queue, o.str());
     cl::Kernel kernel(program, "transpose");
     kernel.setArg(0, in);
     kernel.setArg(1, out);
@@ -265,7 +346,7 @@ inline kernel_call bluestein_twiddle(const cl::CommandQueue &queue, cl_uint n, b
       << "  output[x] = twiddle(sign * M_PI * xx / n);\n"
       << "}\n";
 
-    auto program = build_sources(qctx(queue), o.str());
+    auto program = cached_program(queue, o.str());
     cl::Kernel kernel(program, "bluestein_twiddle");
     kernel.setArg(0, out);
 
@@ -291,7 +372,7 @@ inline kernel_call bluestein_pad_kernel(const cl::CommandQueue &queue, size_t n,
       << "    output[x] = (real2_t)(0,0);\n"
       << "}\n";
 
-    auto program = build_sources(qctx(queue), o.str());
+    auto program = cached_program(queue, o.str());
     cl::Kernel kernel(program, "bluestein_pad_kernel");
     kernel.setArg(0, in);
     kernel.setArg(1, out);
@@ -333,7 +414,7 @@ inline kernel_call bluestein_mul_in(const cl::CommandQueue &queue, bool inverse,
       << "    output[out_off] = (real2_t)(0,0);"
       << "}\n";
 
-    auto program = build_sources(qctx(queue), o.str());
+    auto program = cached_program(queue, o.str());
     cl::Kernel kernel(program, "bluestein_mul_in");
     kernel.setArg(0, data);
     kernel.setArg(1, exp);
@@ -366,7 +447,7 @@ inline kernel_call bluestein_mul_out(const cl::CommandQueue &queue, cl_uint batc
       << "  output[out_off] = mul(data[in_off] * div, exp[l]);\n"
       << "}\n";
 
-    auto program = build_sources(qctx(queue), o.str());
+    auto program = cached_program(queue, o.str());
     cl::Kernel kernel(program, "bluestein_mul_out");
     kernel.setArg(0, data);
     kernel.setArg(1, exp);
@@ -394,7 +475,7 @@ inline kernel_call bluestein_mul(const cl::CommandQueue &queue, cl_uint n, cl_ui
       << "  output[off] = mul(data[off], exp[x]);\n"
       << "}\n";
 
-    auto program = build_sources(qctx(queue), o.str());
+    auto program = cached_program(queue, o.str());
     cl::Kernel kernel(program, "bluestein_mul");
     kernel.setArg(0, data);
     kernel.setArg(1, exp);
@@ -405,6 +486,74 @@ inline kernel_call bluestein_mul(const cl::CommandQueue &queue, cl_uint n, cl_ui
     return kernel_call(false, desc.str(), program, kernel, cl::NDRange(n, batch), cl::NullRange);
 }
 
+// Spectrum of n = 2m reals from the FFT of m packed complex values:
+// X[k] = E[k] + exp(-i pi k / m) O[k], k = 0..m, where
+// E[k] = (Z[k] + conj(Z[m-k])) / 2, O[k] = (Z[k] - conj(Z[m-k])) / 2i.
+template <class T>
+inline kernel_call r2c_post_kernel(const cl::CommandQueue &queue, size_t m, size_t batch, const cl::Buffer &in, const cl::Buffer &out) {
+    std::ostringstream o;
+    kernel_common<T>(o);
+    mul_code(o, false);
+    twiddle_code<T>(o);
+
+    o << "__kernel void r2c_post("
+      << "__global const real2_t *input, __global real2_t *output, uint m, real_t theta) {\n"
+      << "  const size_t k = get_global_id(0), b = get_global_id(1);\n"
+      << "  if(k > m) return;\n"
+      << "  real2_t a = input[b * m + k % m];\n"
+      << "  real2_t c = input[b * m + (m - k) % m];\n"
+      << "  c.y = -c.y;\n"
+      << "  const real2_t e = (a + c) * (real_t)0.5;\n"
+      << "  const real2_t d = (a - c) * (real_t)0.5;\n"
+      << "  output[b * (m + 1) + k] = e + mul((real2_t)(d.y, -d.x), twiddle(theta * k));\n"
+      << "}\n";
+
+    auto program = cached_program(queue, o.str());
+    cl::Kernel kernel(program, "r2c_post");
+    kernel.setArg(0, in);
+    kernel.setArg(1, out);
+    kernel.setArg<cl_uint>(2, m);
+    kernel.setArg<T>(3, -static_cast<T>(M_PI) / m);
+
+    std::ostringstream desc;
+    desc << "r2c_post{m=" << m << ", batch=" << batch << ", in=" << in() << ", out=" << out() << "}";
+    return kernel_call(false, desc.str(), program, kernel, cl::NDRange(m + 1, batch), cl::NullRange);
+}
+
+// Inverse of r2c_post: packs the hermitian half of the spectrum of 2m reals
+// into m complex values Z[k] = E[k] + i O[k], k = 0..m-1, where
+// E[k] = (X[k] + conj(X[m-k])) / 2, O[k] = exp(i pi k / m) (X[k] - conj(X[m-k])) / 2.
+template <class T>
+inline kernel_call c2r_pre_kernel(const cl::CommandQueue &queue, size_t m, size_t batch, const cl::Buffer &in, const cl::Buffer &out) {
+    std::ostringstream o;
+    kernel_common<T>(o);
+    mul_code(o, false);
+    twiddle_code<T>(o);
+
+    o << "__kernel void c2r_pre("
+      << "__global const real2_t *input, __global real2_t *output, uint m, real_t theta) {\n"
+      << "  const size_t k = get_global_id(0), b = get_global_id(1);\n"
+      << "  if(k >= m) return;\n"
+      << "  real2_t a = input[b * (m + 1) + k];\n"
+      << "  real2_t c = input[b * (m + 1) + m - k];\n"
+      << "  c.y = -c.y;\n"
+      << "  const real2_t e = (a + c) * (real_t)0.5;\n"
+      << "  const real2_t d = mul((a - c) * (real_t)0.5, twiddle(theta * k));\n"
+      << "  output[b * m + k] = e + (real2_t)(-d.y, d.x);\n"
+      << "}\n";
+
+    auto program = cached_program(queue, o.str());
+    cl::Kernel kernel(program, "c2r_pre");
+    kernel.setArg(0, in);
+    kernel.setArg(1, out);
+    kernel.setArg<cl_uint>(2, m);
+    kernel.setArg<T>(3, static_cast<T>(M_PI) / m);
+
+    std::ostringstream desc;
+    desc << "c2r_pre{m=" << m << ", batch=" << batch << ", in=" << in() << ", out=" << out() << "}";
+    return kernel_call(false, desc.str(), program, kernel, cl::NDRange(m, batch), cl::NullRange);
+}
+
 
 } // namespace fft
 } // namespace vex
@@ -33,8 +33,15 @@ THE SOFTWARE.
 
 #include <cmath>
 #include <queue>
+#include <memory>
+#include <sstream>
+#include <map>
+#include <limits>
+#include <stdexcept>
+#include <numeric>
 
 #include <vexcl/profiler.hpp>
+#include <vexcl/kernel_cache.hpp>
 #include <vexcl/vector.hpp>
 #include <vexcl/fft/unrolled_dft.hpp>
 #include <vexcl/fft/kernels.hpp>
@@ -100,11 +107,84 @@ inline size_t next_prime_power(Iterator begin, Iterator end, size_t target, size
 
 
 
+/// How the planner chooses the radix stages.
+enum planner_mode {
+    estimate, ///< Fixed heuristic.
+    measure   ///< Times the candidate factorisations on the device.
+};
+
+/// Where radix kernels take their twiddle factors from.
+enum twiddle_source {
+    computed_twiddles, ///< sincos for double, native_cos/native_sin for float.
+    table_twiddles     ///< Precomputed tables in constant (or global) memory.
+};
+
+/// Scratch buffers shared by several FFT plans.
+/**
+ * Plans made with the same workspace (see planner::scratch) take their
+ * temporary buffers from it instead of allocating their own, so that a set
+ * of transforms needs the scratch memory of the largest one only. Buffers
+ * grow as larger plans are made; the plans pick up the new buffers on their
+ * next run. Plans sharing a workspace have to run in the same queue.
+ */
+class workspace {
+    public:
+        /// Buffer number slot of at least the given size.
+        cl::Buffer get(const cl::Context &context, size_t slot, size_t bytes) {
+            if(slot >= buf.size()) buf.resize(slot + 1);
+
+            cl::Buffer &b = buf[slot];
+            if(!b() || b.getInfo<CL_MEM_SIZE>() < bytes ||
+                    b.getInfo<CL_MEM_CONTEXT>()() != context())
+                b = memory_pool<>::create("fft", context, CL_MEM_READ_WRITE, bytes);
+
+            return b;
+        }
+
+        /// Bytes held by the workspace.
+        size_t size() const {
+            size_t bytes = 0;
+            for(auto b = buf.begin() ; b != buf.end() ; b++)
+                if((*b)()) bytes += b->getInfo<CL_MEM_SIZE>();
+            return bytes;
+        }
+
+        /// Releases the buffers not held by a plan.
+        void clear() {
+            buf.clear();
+        }
+    private:
+        std::vector<cl::Buffer> buf;
+};
+
 struct planner {
     const size_t max_size;
     std::vector<size_t> primes;
 
-    planner(size_t s = 25) : max_size(std::min(s, supported_kernel_sizes().back())) {
+    planner_mode   mode;
+    twiddle_source twiddles;
+
+    // Temporary buffers of single-device plans come from this workspace
+    // when it is set.
+    std::shared_ptr<workspace> scratch;
+
+    // Single-device complex plans transform the data in place in the output
+    // vector (the input expression is first assigned to it), with a single
+    // scratch buffer of their own or from the workspace.
+    bool inplace;
+
+    // \param s        largest radix to use.
+    // \param mode     with measure, every candidate split of the sizes into
+    //                 supported radixes is timed with computed and with
+    //                 tabulated twiddles, like FFTW_MEASURE. The winners are
+    //                 kept as wisdom per device for the process, and in
+    //                 VEXCL_CACHE_DIR when it is set.
+    // \param twiddles twiddle source when the mode is estimate.
+    planner(size_t s = 25, planner_mode mode = estimate,
+            twiddle_source twiddles = computed_twiddles)
+        : max_size(std::min(s, supported_kernel_sizes().back())),
+          mode(mode), twiddles(twiddles), inplace(false)
+    {
         auto ps = supported_primes();
         for(auto i = ps.begin() ; i != ps.end() ; i++)
             if(*i <= s) primes.push_back(*i);
@@ -116,10 +196,12 @@ struct planner {
     }
 
     // splits n into a list of powers 2^a 2^b 2^c 3^d 5^e...
-    // exponents are limited by available kernels,
-    // if no kernel for prime is available, exponent will be 0, interpret as 1.
+    // exponents are limited by available kernels.
+    // the product of all factors without kernels is returned as a single
+    // entry with exponent 0, to be done by one Bluestein stage.
     std::vector<pow> factor(size_t n) const {
         std::vector<pow> out, factors = prime_factors(n);
+        size_t rest = 1;
         for(auto f = factors.begin() ; f != factors.end() ; f++) {
             if(std::find(primes.begin(), primes.end(), f->base) != primes.end()) {
                 // split exponent into reasonable parts.
@@ -128,14 +210,83 @@ struct planner {
                 std::copy(qs.rbegin(), qs.rend(), std::back_inserter(out));
             } else {
                 // unsupported prime.
-                for(size_t i = 0 ; i != f->exponent ; i++)
-                    out.push_back(pow(f->base, 0));
+                rest *= f->value;
+            }
+        }
+        if(rest != 1) out.push_back(pow(rest, 0));
+        return out;
+    }
+
+    // all splits of n into the stages factor() could use: every way to
+    // write the exponents of the supported primes as sums of exponents
+    // with kernels (smallest radix first), up to limit splits. factor(n)
+    // is always the first one.
+    std::vector< std::vector<pow> > candidates(size_t n, size_t limit = 64) const {
+        std::vector< std::vector<pow> > out(1, factor(n));
+
+        std::vector< std::vector<pow> > partial(1);
+        size_t rest = 1;
+
+        auto factors = prime_factors(n);
+        for(auto f = factors.begin() ; f != factors.end() ; f++) {
+            if(std::find(primes.begin(), primes.end(), f->base) == primes.end()) {
+                rest *= f->value;
+                continue;
             }
+
+            std::vector< std::vector<pow> > splits, next;
+            std::vector<pow> current;
+            exponent_splits(f->base, f->exponent, f->exponent, current, splits);
+
+            for(auto a = partial.begin() ; a != partial.end() ; a++)
+                for(auto b = splits.begin() ; b != splits.end() && next.size() < limit ; b++) {
+                    std::vector<pow> c(*a);
+                    c.insert(c.end(), b->begin(), b->end());
+                    next.push_back(c);
+                }
+
+            partial.swap(next);
+        }
+
+        for(auto c = partial.begin() ; c != partial.end() && out.size() < limit ; c++) {
+            if(rest != 1) c->push_back(pow(rest, 0));
+            if(!same_stages(*c, out[0])) out.push_back(*c);
         }
+
         return out;
     }
 
   private:
+    bool has_kernel(size_t base, size_t exponent) const {
+        const size_t v = pow(base, exponent).value;
+        auto ks = supported_kernel_sizes();
+        return v <= max_size && std::find(ks.begin(), ks.end(), v) != ks.end();
+    }
+
+    // splits e into non-increasing exponents not above top, stored
+    // smallest first.
+    void exponent_splits(size_t base, size_t e, size_t top,
+            std::vector<pow> &current, std::vector< std::vector<pow> > &out) const
+    {
+        if(e == 0) {
+            out.push_back(std::vector<pow>(current.rbegin(), current.rend()));
+            return;
+        }
+        for(size_t x = std::min(e, top) ; x > 0 ; x--) {
+            if(!has_kernel(base, x)) continue;
+            current.push_back(pow(base, x));
+            exponent_splits(base, e - x, x, current, out);
+            current.pop_back();
+        }
+    }
+
+    static bool same_stages(const std::vector<pow> &a, const std::vector<pow> &b) {
+        if(a.size() != b.size()) return false;
+        for(size_t i = 0 ; i < a.size() ; i++)
+            if(a[i].base != b[i].base || a[i].exponent != b[i].exponent) return false;
+        return true;
+    }
+
     std::vector<pow> stages(pow p) const {
         size_t t = static_cast<size_t>(std::log(max_size + 1.0) / std::log(static_cast<double>(p.base)));
         std::vector<pow> fs;
@@ -168,6 +319,47 @@ struct planner {
 };
 
 
+// Measured stage choices ("wisdom"), per device and transform. Kept for the
+// process, and in VEXCL_CACHE_DIR as device properties when it is set.
+template <bool dummy = true>
+struct wisdom {
+    static_assert(dummy, "dummy parameter should be true");
+
+    static bool find(const cl::CommandQueue &queue, const std::string &key, std::string &value) {
+        cl::Device device = qdev(queue);
+        boost::lock_guard<boost::mutex> lock(mx);
+
+        auto w = known.find(std::make_pair(device(), key));
+        if(w != known.end()) {
+            value = w->second;
+            return true;
+        }
+
+        if(!device_properties<>::load(device, key, value)) return false;
+
+        known[std::make_pair(device(), key)] = value;
+        return true;
+    }
+
+    static void store(const cl::CommandQueue &queue, const std::string &key, const std::string &value) {
+        cl::Device device = qdev(queue);
+        boost::lock_guard<boost::mutex> lock(mx);
+
+        known[std::make_pair(device(), key)] = value;
+        device_properties<>::store(device, key, value);
+    }
+
+    private:
+        static boost::mutex mx;
+        static std::map<std::pair<cl_device_id, std::string>, std::string> known;
+};
+
+template <bool dummy>
+boost::mutex wisdom<dummy>::mx;
+
+template <bool dummy>
+std::map<std::pair<cl_device_id, std::string>, std::string> wisdom<dummy>::known;
+
 template <class T0, class T1, class Planner = planner>
 struct plan {
     typedef typename cl_scalar_of<T0>::type T0s;
@@ -182,16 +374,24 @@ struct plan {
     VEX_FUNCTION(r2c, T2(T), "return (" + type_name<T2>() + ")(prm1, 0);");
     VEX_FUNCTION(c2r, T(T2), "return prm1.x;");
 
-    const std::vector<cl::CommandQueue> &queues;
+    const std::vector<cl::CommandQueue> queues;
     Planner planner;
     T scale;
     const std::vector<size_t> sizes;
+    const size_t batch;
+    const bool half;
 
     std::vector<kernel_call> kernels;
 
     size_t input, output;
     std::vector<cl::Buffer> bufs;
 
+    // Buffers taken from the planner workspace: (buffer, slot, bytes).
+    struct shared_buffer {
+        size_t index, slot, bytes;
+    };
+    std::vector<shared_buffer> shared;
+
 #ifdef FFT_PROFILE
     profiler profile;
 #endif
@@ -200,27 +400,46 @@ struct plan {
     //  1D case: {n}.
     //  2D case: {h, w} in row-major format: x + y * w. (like FFTw)
     //  etc.
-    plan(const std::vector<cl::CommandQueue> &_queues, const std::vector<size_t> sizes, bool inverse, const Planner &planner = Planner())
-        : queues(_queues), planner(planner), sizes(sizes)
+    // \param batch
+    //  number of contiguous 1D sequences transformed at once (1D case only).
+    // \param half
+    //  real-to-complex (forward) or complex-to-real (inverse) transform
+    //  with only n/2+1 elements of the hermitian spectrum stored
+    //  (1D case only, n even).
+    plan(const std::vector<cl::CommandQueue> &_queues, const std::vector<size_t> sizes, bool inverse, const Planner &planner = Planner(), size_t batch = 1, bool half = false)
+        : queues(_queues), planner(planner), sizes(sizes), batch(batch), half(half)
 #ifdef FFT_PROFILE
-          , profile(_queues)
+          , profile(queues)
 #endif
     {
         assert(sizes.size() >= 1);
         assert(queues.size() == 1);
+        assert(batch >= 1);
+        assert(batch == 1 || sizes.size() == 1);
         auto queue = queues[0];
         auto context = qctx(queue);
         auto device = qdev(queue);
 
-        size_t total_n = std::accumulate(sizes.begin(), sizes.end(), 1, std::multiplies<size_t>());
-        scale = inverse ? ((T)1 / total_n) : 1;
+        size_t n = std::accumulate(sizes.begin(), sizes.end(), 1, std::multiplies<size_t>());
+        size_t total_n = n * batch;
+        scale = inverse ? ((T)1 / n) : 1;
+
+        if(half) {
+            this->planner.inplace = false;
+            plan_half(inverse, n);
+            return;
+        }
 
-        size_t current = bufs.size(); bufs.push_back(cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(T2) * total_n));
-        size_t other = bufs.size(); bufs.push_back(cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(T2) * total_n));
+        // In place, the user's buffer is bound to current before each run.
+        size_t current = planner.inplace ? placeholder() : scratch_buffer(sizeof(T2) * total_n);
+        size_t other = scratch_buffer(sizeof(T2) * total_n);
 
         // Build the list of kernels.
         input = current;
-        for(auto d = sizes.rbegin() ; d != sizes.rend() ; d++) {
+        if(batch > 1) {
+            // independent rows, no transposition needed.
+            plan_cooley_tukey(inverse, n, batch, current, other, false);
+        } else for(auto d = sizes.rbegin() ; d != sizes.rend() ; d++) {
             const size_t w = *d, h = total_n / w;
             if(w > 1) {
                 // 1D, each row.
@@ -229,6 +448,7 @@ struct plan {
                 // transpose.
                 if(h > 1) {
                     kernels.push_back(transpose_kernel<T>(queue, w, h, bufs[current], bufs[other]));
+                    bound(0, current); bound(1, other);
                     std::swap(current, other);
                 }
             }
@@ -236,55 +456,186 @@ struct plan {
         output = current;
     }
 
+    // n reals are packed into n/2 complex values and transformed with a
+    // complex FFT of half size. Separation of the even and odd parts of the
+    // spectrum is done by a twiddle kernel (after the FFT for the forward
+    // transform, and before it for the inverse one).
+    void plan_half(bool inverse, size_t n) {
+        assert(sizes.size() == 1);
+        assert(n % 2 == 0);
+        assert(inverse ? (!std::is_same<T0, T>::value && std::is_same<T1, T>::value)
+                       : (std::is_same<T0, T>::value && !std::is_same<T1, T>::value));
+
+        auto context = qctx(queues[0]);
+        size_t m = n / 2;
+
+        // ifft of size m gives m * z with z packed halves of the output.
+        if(inverse) scale = (T)1 / m;
+
+        size_t current = scratch_buffer(sizeof(T2) * m * batch);
+        size_t other = scratch_buffer(sizeof(T2) * m * batch);
+        size_t spectrum = bufs.size(); bufs.push_back(memory_pool<>::create("fft",
+                context, CL_MEM_READ_WRITE, sizeof(T2) * (m + 1) * batch));
+
+        if(inverse) {
+            input = spectrum;
+            kernels.push_back(c2r_pre_kernel<T>(queues[0], m, batch, bufs[spectrum], bufs[current]));
+            bound(0, spectrum); bound(1, current);
+            plan_cooley_tukey(true, m, batch, current, other, false);
+            output = current;
+        } else {
+            input = current;
+            plan_cooley_tukey(false, m, batch, current, other, false);
+            kernels.push_back(r2c_post_kernel<T>(queues[0], m, batch, bufs[current], bufs[spectrum]));
+            bound(0, current); bound(1, spectrum);
+            output = spectrum;
+        }
+    }
+
     void plan_cooley_tukey(bool inverse, size_t n, size_t batch, size_t &current, size_t &other, bool once) {
         size_t p = 1;
-        auto rs = planner.factor(n);
+        bool table = planner.twiddles == table_twiddles;
+        auto rs = planner.mode == measure ? measured_factor(n, batch, table) : planner.factor(n);
         for(auto r = rs.begin() ; r != rs.end() ; r++) {
             if(r->exponent == 0) {
                 plan_bluestein(n, batch, inverse, r->base, p, current, other);
                 p *= r->base;
             } else {
                 kernels.push_back(radix_kernel<T>(once, queues[0], n, batch,
-                    inverse, *r, p, bufs[current], bufs[other]));
+                    inverse, *r, p, bufs[current], bufs[other], table));
+                bound(0, current); bound(1, other);
                 std::swap(current, other);
                 p *= r->value;
             }
         }
     }
 
-    // this as a numeric error in O(exp(n)), as opposed to O(sqrt(n)),
-    // which means it's a very bad idea to use this with float for sizes > 100,
-    // double's worst case is still better than float's best case though.
+    // The fastest of the planner candidates for n, with the twiddle source
+    // it was fastest with. Looked up in the wisdom first; otherwise every
+    // candidate is timed both ways and the winner is stored, as
+    // "2^3,2^3,43^0;table".
+    std::vector<pow> measured_factor(size_t n, size_t batch, bool &table) {
+        std::ostringstream key;
+        key << "fft wisdom " << type_name<T>() << " n=" << n << " batch=" << batch
+            << " radix=" << planner.max_size;
+
+        std::string w;
+        if(wisdom<>::find(queues[0], key.str(), w)) {
+            std::vector<pow> rs;
+            std::istringstream in(w);
+            size_t b, e;
+            char c;
+            while(in >> b >> c >> e) {
+                rs.push_back(pow(b, e));
+                if(!(in >> c) || c != ',') break;
+            }
+            std::string src;
+            in >> src;
+            table = src == "table";
+            if(!rs.empty()) return rs;
+        }
+
+        auto cs = planner.candidates(n);
+
+        size_t best = 0;
+        double best_time = std::numeric_limits<double>::max();
+
+        for(size_t i = 0 ; i < cs.size() ; i++)
+            for(int t = 0 ; t < 2 ; t++) {
+                double time = time_stages(cs[i], n, batch, t != 0);
+                if(time < best_time) {
+                    best_time = time;
+                    best  = i;
+                    table = t != 0;
+                }
+            }
+
+        std::ostringstream out;
+        for(auto r = cs[best].begin() ; r != cs[best].end() ; r++)
+            out << (r == cs[best].begin() ? "" : ",") << r->base << '^' << r->exponent;
+        out << ';' << (table ? "table" : "computed");
+        wisdom<>::store(queues[0], key.str(), out.str());
+
+        return cs[best];
+    }
+
+    // Run time of the radix stages of a candidate on zeroed scratch
+    // buffers. A Bluestein stage is the same for all candidates and is left
+    // out.
+    double time_stages(const std::vector<pow> &rs, size_t n, size_t batch, bool table) {
+        auto context = qctx(queues[0]);
+
+        std::vector<T2> zero(n * batch, T2());
+        cl::Buffer a(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, sizeof(T2) * zero.size(), zero.data());
+        cl::Buffer b(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, sizeof(T2) * zero.size(), zero.data());
+
+        std::vector<kernel_call> ks;
+        size_t p = 1;
+        for(auto r = rs.begin() ; r != rs.end() ; r++) {
+            if(r->exponent == 0) break;
+            bool even = ks.size() % 2 == 0;
+            ks.push_back(radix_kernel<T>(false, queues[0], n, batch, false, *r, p,
+                        even ? a : b, even ? b : a, table));
+            p *= r->value;
+        }
+
+        auto launch = [&]() {
+            for(auto k = ks.begin() ; k != ks.end() ; k++)
+                queues[0].enqueueNDRangeKernel(k->kernel, cl::NullRange, k->global, k->local);
+        };
+
+        // Skip the first run.
+        launch();
+        queues[0].finish();
+
+        profiler prof(queues);
+        prof.tic_cl("");
+        for(int i = 0 ; i < 3 ; i++) launch();
+        return prof.toc("");
+    }
+
+    // Bluestein's algorithm: DFT of arbitrary size n as a convolution with a
+    // chirp, done by FFTs of size best_size(2n) with the supported kernels.
+    // The chirp and its transform are computed once. Chirp arguments are
+    // reduced modulo 2n before conversion to real, so the error grows like
+    // for the other stages, i.e. with log(n).
     void plan_bluestein(size_t width, size_t batch, bool inverse, size_t n, size_t p, size_t &current, size_t &other) {
         size_t conv_n = planner.best_size(2 * n);
         size_t threads = width / n;
         auto context = qctx(queues[0]);
 
-        size_t b_twiddle = bufs.size(); bufs.push_back(cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(T2) * n));
-        size_t b_other = bufs.size(); bufs.push_back(cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(T2) * conv_n));
-        size_t b_current = bufs.size(); bufs.push_back(cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(T2) * conv_n));
-        size_t a_current = bufs.size(); bufs.push_back(cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(T2) * conv_n * batch * threads));
-        size_t a_other = bufs.size(); bufs.push_back(cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(T2) * conv_n * batch * threads));
+        size_t b_twiddle = bufs.size(); bufs.push_back(memory_pool<>::create("fft",
+                context, CL_MEM_READ_WRITE, sizeof(T2) * n));
+        size_t b_other = bufs.size(); bufs.push_back(memory_pool<>::create("fft",
+                context, CL_MEM_READ_WRITE, sizeof(T2) * conv_n));
+        size_t b_current = bufs.size(); bufs.push_back(memory_pool<>::create("fft",
+                context, CL_MEM_READ_WRITE, sizeof(T2) * conv_n));
+        size_t a_current = scratch_buffer(sizeof(T2) * conv_n * batch * threads);
+        size_t a_other = scratch_buffer(sizeof(T2) * conv_n * batch * threads);
 
         // calculate twiddle factors
         kernels.push_back(bluestein_twiddle<T>(queues[0], n, inverse,
             bufs[b_twiddle])); // once
+        bound(0, b_twiddle);
 
         // first part of the convolution
         kernels.push_back(bluestein_pad_kernel<T>(queues[0], n, conv_n,
             bufs[b_twiddle], bufs[b_current])); // once
+        bound(0, b_twiddle); bound(1, b_current);
 
         plan_cooley_tukey(false, conv_n, 1, b_current, b_other, /*once*/true);
 
         // other part of convolution
         kernels.push_back(bluestein_mul_in<T>(queues[0], inverse, batch, n, p, threads, conv_n,
             bufs[current], bufs[b_twiddle], bufs[a_current]));
+        bound(0, current); bound(1, b_twiddle); bound(2, a_current);
 
         plan_cooley_tukey(false, conv_n, threads * batch, a_current, a_other, false);
 
         // calculate convolution
         kernels.push_back(bluestein_mul<T>(queues[0], conv_n, threads * batch,
             bufs[a_current], bufs[b_current], bufs[a_other]));
+        bound(0, a_current); bound(1, b_current); bound(2, a_other);
         std::swap(a_current, a_other);
 
         plan_cooley_tukey(true, conv_n, threads * batch, a_current, a_other, false);
@@ -292,13 +643,108 @@ struct plan {
         // twiddle again
         kernels.push_back(bluestein_mul_out<T>(queues[0], batch, p, n, threads, conv_n,
             bufs[a_current], bufs[b_twiddle], bufs[other]));
+        bound(0, a_current); bound(1, b_twiddle); bound(2, other);
         std::swap(current, other);
     }
 
+    // Appends an own buffer of a single element, bound to the user's
+    // vector by in-place runs.
+    size_t placeholder() {
+        bufs.push_back(memory_pool<>::create("fft",
+                qctx(queues[0]), CL_MEM_READ_WRITE, sizeof(T2)));
+        return bufs.size() - 1;
+    }
+
+    // Appends a temporary buffer of the given size, taken from the planner
+    // workspace if there is one.
+    size_t scratch_buffer(size_t bytes) {
+        if (planner.scratch) {
+            shared_buffer s = {bufs.size(), shared.size(), bytes};
+            shared.push_back(s);
+            bufs.push_back(planner.scratch->get(qctx(queues[0]), s.slot, bytes));
+        } else {
+            bufs.push_back(memory_pool<>::create("fft", qctx(queues[0]), CL_MEM_READ_WRITE, bytes));
+        }
+        return bufs.size() - 1;
+    }
+
+    // Records that argument arg of the last kernel is bufs[i].
+    void bound(cl_uint arg, size_t i) {
+        kernels.back().args.push_back(std::make_pair(arg, i));
+    }
+
+    // Replaces bufs[i] in all the kernels using it.
+    void rebind(size_t i, const cl::Buffer &b) {
+        bufs[i] = b;
+        for(auto k = kernels.begin(); k != kernels.end(); ++k)
+            for(auto a = k->args.begin(); a != k->args.end(); ++a)
+                if (a->second == i) k->kernel.setArg(a->first, b);
+    }
+
+    // Picks up the workspace buffers grown by other plans since the last run.
+    void refresh() {
+        for(auto s = shared.begin(); s != shared.end(); ++s) {
+            cl::Buffer b = planner.scratch->get(qctx(queues[0]), s->slot, s->bytes);
+            if (b() != bufs[s->index]()) rebind(s->index, b);
+        }
+    }
+
+    // The part of bufs[i] used by the plan.
+    template <class V>
+    vector<V> view(size_t i) const {
+        for(auto s = shared.begin(); s != shared.end(); ++s)
+            if (s->index == i) return vector<V>(queues[0], bufs[i], s->bytes / sizeof(V));
+        return vector<V>(queues[0], bufs[i]);
+    }
+
+    /// Transforms x in place (planner::inplace plans only).
+    /**
+     * The kernels read and write x directly; a result left in the scratch
+     * buffer by an odd number of passes is copied back.
+     */
+    void run_inplace(vector<T2> &x) {
+        if (!planner.inplace)
+            throw std::logic_error("FFT plan was not made for in-place execution");
+        if (x.nparts() != 1 || x.size() !=
+                std::accumulate(sizes.begin(), sizes.end(), batch, std::multiplies<size_t>()))
+            throw std::length_error("In-place FFT: vector size mismatch");
+
+        cl::Buffer keep = bufs[input];
+        rebind(input, x(0));
+        run();
+        if (output != input)
+            queues[0].enqueueCopyBuffer(bufs[output], bufs[input], 0, 0, sizeof(T2) * x.size());
+        rebind(input, keep);
+    }
+
+    template <class Expr>
+    void inplace(const Expr &in, vector<T1> &out, bool append, T ex_scale, std::true_type) {
+        if (append)
+            throw std::logic_error("In-place FFT can not add to the output");
+
+        if(std::is_same<T0, T>::value) out = r2c(in);
+        else out = in;
+
+        run_inplace(out);
+
+        if (ex_scale * scale != 1) out = out * (ex_scale * scale);
+    }
+
+    template <class Expr>
+    void inplace(const Expr&, vector<T1>&, bool, T, std::false_type) {
+        throw std::logic_error("In-place FFT needs complex output");
+    }
+
     /// Execute the complete transformation.
     /// Converts real-valued input and output, supports multiply-adding to output.
     template<class Expr>
     void operator()(const Expr &in, vector<T1> &out, bool append, T ex_scale) {
+        if (planner.inplace) {
+            inplace(in, out, append, ex_scale, std::is_same<T1, T2>());
+            return;
+        }
+
+        refresh();
 #ifdef FFT_PROFILE
         std::ostringstream prof_name;
         prof_name << "fft(n={";
@@ -311,9 +757,15 @@ struct plan {
 
         profile.tic_cl("in");
 #endif
-        vector<T2> in_c(queues[0], bufs[input]);
-        if(std::is_same<T0, T>::value) in_c = r2c(in);
-        else in_c = in;
+        if(half && std::is_same<T0, T>::value) {
+            // reals are packed into complex values as they are.
+            vector<T> in_r = view<T>(input);
+            in_r = in;
+        } else {
+            vector<T2> in_c = view<T2>(input);
+            if(std::is_same<T0, T>::value) in_c = r2c(in);
+            else in_c = in;
+        }
 #ifdef FFT_PROFILE
         profile.toc("in");
 #endif
@@ -330,7 +782,7 @@ struct plan {
                 profile.tic_cl(run->desc);
 #endif
                 queues[0].enqueueNDRangeKernel(run->kernel, cl::NullRange,
-                    run->global, run->local);
+                    run->global, run->local, 0, event_trace<>::kernel(queues[0], run->kernel));
                 run->count++;
 #ifdef FFT_PROFILE
                 profile.toc(run->desc);
@@ -347,8 +799,12 @@ struct plan {
 #ifdef FFT_PROFILE
         profile.tic_cl("out");
 #endif
-        vector<T2> out_c(queues[0], bufs[output]);
-        if(std::is_same<T1, T>::value) {
+        vector<T2> out_c = view<T2>(output);
+        if(half && std::is_same<T1, T>::value) {
+            vector<T> out_r = view<T>(output);
+            if(append) out += out_r * (ex_scale * scale);
+            else out = out_r * (ex_scale * scale);
+        } else if(std::is_same<T1, T>::value) {
             if(append) out += c2r(out_c) * (ex_scale * scale);
             else out = c2r(out_c) * (ex_scale * scale);
         } else {
@@ -361,6 +817,19 @@ struct plan {
 #endif
     }
 
+    /// Runs the kernels on data already in bufs[input].
+    /// The result is left in bufs[output].
+    void run() {
+        refresh();
+        for(auto k = kernels.begin(); k != kernels.end(); ++k) {
+            if(!k->once || k->count == 0) {
+                queues[0].enqueueNDRangeKernel(k->kernel, cl::NullRange,
+                    k->global, k->local, 0, event_trace<>::kernel(queues[0], k->kernel));
+                k->count++;
+            }
+        }
+    }
+
     std::string desc() const {
         std::ostringstream o;
         o << "FFT(";
@@ -377,12 +846,61 @@ struct plan {
                 }
             }
         }
+        if(half) o << ", half";
+        if(batch > 1) o << " x" << batch;
         o << ")";
         return o.str();
     }
 };
 
 
+/// \cond INTERNAL
+
+template <class Plan>
+struct plan_entry {
+    std::shared_ptr<Plan> plan;
+};
+
+/// \endcond
+
+/// Returns plan for the given configuration, creating it on first request.
+/**
+ * Plans are stored in vex::kernel_cache and keyed by context, device,
+ * precision, sizes, batch, direction, and planner settings, so repeated
+ * construction of identical transforms costs a single lookup. A cached plan
+ * (with its buffers) is shared by all FFT objects of the same configuration,
+ * and is released together with the other kernels of its context.
+ */
+template <class T0, class T1, class Planner>
+std::shared_ptr< plan<T0, T1, Planner> > cached_plan(
+        const std::vector<cl::CommandQueue> &queues,
+        const std::vector<size_t> &sizes, bool inverse,
+        const Planner &planner = Planner(), size_t batch = 1, bool half = false)
+{
+    typedef plan<T0, T1, Planner> plan_t;
+
+    std::ostringstream sig;
+    sig << (inverse ? "inverse" : "forward") << (half ? " half" : "") << " batch=" << batch
+        << " radix=" << planner.max_size
+        << (planner.mode == measure ? " measure" : "")
+        << (planner.twiddles == table_twiddles ? " table" : "")
+        << (planner.inplace ? " inplace" : "");
+    if (planner.scratch) sig << " workspace=" << planner.scratch.get();
+    sig << " n=";
+    for(auto n = sizes.begin() ; n != sizes.end() ; n++) sig << *n << ',';
+
+    auto e = kernel_cache<>::find< plan_entry<plan_t> >(queues[0], sig.str());
+
+    if (!e) {
+        plan_entry<plan_t> entry;
+        entry.plan = std::make_shared<plan_t>(queues, sizes, inverse, planner, batch, half);
+        e = kernel_cache<>::insert(queues[0], entry, sig.str());
+    }
+
+    return e->plan;
+}
+
+
 template <class T0, class T1, class P>
 inline std::ostream &operator<<(std::ostream &o, const plan<T0,T1,P> &p) {
     o << p.desc() << "{\n";
@@ -31,7 +31,15 @@ THE SOFTWARE.
  * \brief  Gather scattered points from OpenCL device vector.
  */
 
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <numeric>
+#include <sstream>
+#include <cassert>
 #include <CL/cl.hpp>
+#include <vexcl/kernel_cache.hpp>
+#include <vexcl/vector.hpp>
 
 namespace vex {
 
@@ -43,7 +51,8 @@ class gather {
                 size_t src_size, std::vector<size_t> indices
               )
             : queue(queue), ptr(queue.size() + 1, 0),
-              idx(queue.size()), val(queue.size()), ev(queue.size())
+              idx(queue.size()), val(queue.size()), ev(queue.size()),
+              krn(queue.size())
         {
             assert(std::is_sorted(indices.begin(), indices.end()));
 
@@ -62,7 +71,9 @@ class gather {
                 cl::Context context = qctx(queue[d]);
                 cl::Device  device  = qdev(queue[d]);
 
-                if (!compiled[context()]) {
+                krn[d] = kernel_cache<>::find<kernel_t>(queue[d]);
+
+                if (!krn[d]) {
                     std::ostringstream source;
 
                     source << standard_kernel_header <<
@@ -80,17 +91,15 @@ class gather {
 
                     auto program = build_sources(context, source.str());
 
-                    krn[context()] = cl::Kernel(program, "gather");
-
-                    wgsize[context()] = kernel_workgroup_size(
-                            krn[context()], device);
-
-                    compiled[context()] = true;
+                    krn[d] = kernel_cache<>::insert(queue[d], kernel_t(
+                                cl::Kernel(program, "gather"), device));
                 }
 
                 if (size_t n = ptr[d + 1] - ptr[d]) {
-                    idx[d] = cl::Buffer(context, CL_MEM_READ_ONLY,  n * sizeof(size_t));
-                    val[d] = cl::Buffer(context, CL_MEM_WRITE_ONLY, n * sizeof(T));
+                    idx[d] = memory_pool<>::create("gather",
+                            context, CL_MEM_READ_ONLY,  n * sizeof(size_t));
+                    val[d] = memory_pool<>::create("gather",
+                            context, CL_MEM_WRITE_ONLY, n * sizeof(T));
 
                     queue[d].enqueueWriteBuffer(idx[d], CL_FALSE,
                             0, n * sizeof(size_t), &indices[ptr[d]], 0, &ev[d]);
@@ -105,18 +114,16 @@ class gather {
         void operator()(const vex::vector<T> &src, HostVector &dst) {
             for(uint d = 0; d < queue.size(); d++) {
                 if (size_t n = ptr[d + 1] - ptr[d]) {
-                    cl::Context context = qctx(queue[d]);
-
-                    size_t g_size = alignup(n, wgsize[context()]);
+                    size_t g_size = alignup(n, krn[d]->wgsize);
 
                     uint pos = 0;
-                    krn[context()].setArg(pos++, n);
-                    krn[context()].setArg(pos++, src(d));
-                    krn[context()].setArg(pos++, idx[d]);
-                    krn[context()].setArg(pos++, val[d]);
+                    krn[d]->kernel.setArg(pos++, n);
+                    krn[d]->kernel.setArg(pos++, src(d));
+                    krn[d]->kernel.setArg(pos++, idx[d]);
+                    krn[d]->kernel.setArg(pos++, val[d]);
 
-                    queue[d].enqueueNDRangeKernel(krn[context()],
-                            cl::NullRange, g_size, wgsize[context()]);
+                    queue[d].enqueueNDRangeKernel(krn[d]->kernel,
+                            cl::NullRange, g_size, krn[d]->wgsize, 0, event_trace<>::kernel(queue[d], krn[d]->kernel));
 
                     queue[d].enqueueReadBuffer(
                             val[d], CL_FALSE, 0, n * sizeof(T), &dst[ptr[d]],
@@ -134,14 +141,422 @@ class gather {
         std::vector<cl::Buffer> val;
         std::vector<cl::Event>  ev;
 
-        static std::map<cl_context, bool>       compiled;
-        static std::map<cl_context, cl::Kernel> krn;
-        static std::map<cl_context, uint>       wgsize;
+        struct kernel_t {
+            cl::Kernel kernel;
+            uint       wgsize;
+
+            kernel_t(const cl::Kernel &kernel, const cl::Device &device)
+                : kernel(kernel), wgsize(kernel_workgroup_size(kernel, device))
+            {}
+        };
+
+        std::vector< std::shared_ptr<kernel_t> > krn;
+};
+
+/// Reusable set of indices for device-side reindexing.
+/**
+ * Holds indices into a vector of the given size, and the communication
+ * pattern needed to apply them to vectors partitioned across several
+ * devices. The pattern is computed once for each partitioning of the
+ * vectors involved:
+ * \code
+ * vex::index_set idx(ctx, indices, x.size());
+ *
+ * y = vex::permute(idx, x);     // y[i] = x[indices[i]]
+ * vex::scatter_add(idx, v, x);  // x[indices[i]] += v[i]
+ * \endcode
+ * Each required element is transferred at most once to each device. Values
+ * owned by other devices go through the host. Repeated indices in
+ * scatter_add() are summed deterministically, without atomics.
+ */
+class index_set {
+    public:
+        /// Constructor.
+        /**
+         * \param queue   vector of queues.
+         * \param indices indices into a vector of size n.
+         * \param n       size of the indexed vector.
+         */
+        index_set(const std::vector<cl::CommandQueue> &queue,
+                const std::vector<size_t> &indices, size_t n)
+            : queue(queue), idx(indices), n(n)
+        {
+            for(auto q = queue.begin(); q != queue.end(); q++)
+                single.push_back(std::vector<cl::CommandQueue>(1, *q));
+        }
+
+        /// Number of indices.
+        size_t size() const {
+            return idx.size();
+        }
+
+        /// Size of the indexed vector.
+        size_t range() const {
+            return n;
+        }
+
+        /// \cond INTERNAL
+
+        // y[i] = alpha * y[i] + beta * x[idx[i]]
+        template <typename T>
+        void permute(const vector<T> &x, vector<T> &y, T alpha, T beta) const {
+            assert(x.size() == n && y.size() == idx.size());
+            apply(get_plan(gplan, x.partition(), y.partition(), false),
+                    x, y, alpha, beta);
+        }
+
+        // y[idx[i]] += beta * v[i]
+        template <typename T>
+        void scatter_add(const vector<T> &v, vector<T> &y, T beta) const {
+            assert(v.size() == idx.size() && y.size() == n);
+            apply(get_plan(splan, v.partition(), y.partition(), true),
+                    v, y, static_cast<T>(1), beta);
+        }
+
+        /// \endcond
+    private:
+        std::vector<cl::CommandQueue> queue;
+        std::vector< std::vector<cl::CommandQueue> > single;
+        std::vector<size_t> idx;
+        size_t n;
+
+        // Transfer of source elements into per-device staging buffers,
+        // followed by sparse reduction of the staging buffer into the
+        // destination: y[tgt[r]] = alpha * y[tgt[r]] + beta * sum stage[col].
+        struct plan {
+            std::vector<size_t> spart, dpart;
+
+            // [s][d]: number of elements sent from s to d, offset of their
+            // indices inside sidx[s].
+            std::vector< std::vector<size_t> > cnt, soff;
+
+            // [d][s]: offset of elements received from s inside stage[d].
+            std::vector< std::vector<size_t> > doff;
+
+            std::vector<cl::Buffer> sidx;
+            std::vector<size_t>     nsend;
+
+            std::vector<size_t>     nstage, nrows;
+            std::vector<cl::Buffer> tgt, ptr, col;
+        };
+
+        mutable std::shared_ptr<plan> gplan, splan;
+
+        template <typename T>
+        struct kernels {
+            cl::Kernel gather;
+            cl::Kernel reduce;
+            uint       wgsize;
+        };
+
+        const plan& get_plan(std::shared_ptr<plan> &p,
+                const std::vector<size_t> &spart,
+                const std::vector<size_t> &dpart, bool scatter) const
+        {
+            if (!p || p->spart != spart || p->dpart != dpart)
+                p = build_plan(spart, dpart, scatter);
+
+            return *p;
+        }
+
+        std::shared_ptr<plan> build_plan(
+                const std::vector<size_t> &spart,
+                const std::vector<size_t> &dpart, bool scatter) const
+        {
+            const uint nd = queue.size();
+
+            std::shared_ptr<plan> p = std::make_shared<plan>();
+
+            p->spart = spart;
+            p->dpart = dpart;
+
+            p->cnt .resize(nd, std::vector<size_t>(nd, 0));
+            p->soff.resize(nd, std::vector<size_t>(nd, 0));
+            p->doff.resize(nd, std::vector<size_t>(nd, 0));
+
+            p->sidx.resize(nd);
+            p->nsend.resize(nd, 0);
+            p->nstage.resize(nd, 0);
+            p->nrows.resize(nd, 0);
+            p->tgt.resize(nd);
+            p->ptr.resize(nd);
+            p->col.resize(nd);
+
+            // (destination, source) pairs grouped by destination device.
+            std::vector< std::vector< std::pair<size_t, size_t> > > pairs(nd);
+            column_owner owner(dpart);
+
+            for(size_t k = 0; k < idx.size(); k++) {
+                size_t dst = scatter ? idx[k] : k;
+                size_t src = scatter ? k : idx[k];
+                pairs[owner(dst)].push_back(std::make_pair(dst, src));
+            }
+
+            std::vector< std::vector<size_t> > hsidx(nd);
+
+            for(uint d = 0; d < nd; d++) {
+                auto &pd = pairs[d];
+
+                // Unique source elements, sorted and so grouped by owner.
+                std::vector<size_t> uniq;
+                uniq.reserve(pd.size());
+                for(auto q = pd.begin(); q != pd.end(); q++)
+                    uniq.push_back(q->second);
+
+                std::sort(uniq.begin(), uniq.end());
+                uniq.erase(std::unique(uniq.begin(), uniq.end()), uniq.end());
+
+                p->nstage[d] = uniq.size();
+
+                for(uint s = 0; s < nd; s++) {
+                    auto b = std::lower_bound(uniq.begin(), uniq.end(), spart[s]);
+                    auto e = std::lower_bound(uniq.begin(), uniq.end(), spart[s + 1]);
+
+                    p->doff[d][s] = b - uniq.begin();
+                    p->cnt [s][d] = e - b;
+                    p->soff[s][d] = hsidx[s].size();
+
+                    for(; b != e; b++) hsidx[s].push_back(*b - spart[s]);
+                }
+
+                // Rows of the reduction.
+                std::stable_sort(pd.begin(), pd.end(),
+                        [](const std::pair<size_t, size_t> &a,
+                           const std::pair<size_t, size_t> &b) {
+                            return a.first < b.first;
+                        });
+
+                std::vector<size_t> htgt, hptr(1, 0), hcol;
+                hcol.reserve(pd.size());
+
+                for(auto q = pd.begin(); q != pd.end(); q++) {
+                    if (htgt.empty() || htgt.back() != q->first - dpart[d]) {
+                        if (!htgt.empty()) hptr.push_back(hcol.size());
+                        htgt.push_back(q->first - dpart[d]);
+                    }
+
+                    hcol.push_back(std::lower_bound(uniq.begin(), uniq.end(),
+                                q->second) - uniq.begin());
+                }
+                if (!htgt.empty()) hptr.push_back(hcol.size());
+
+                if ((p->nrows[d] = htgt.size())) {
+                    cl::Context context = qctx(queue[d]);
+
+                    p->tgt[d] = memory_pool<>::create("gather",
+                            context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                            htgt.size() * sizeof(size_t), htgt.data());
+                    p->ptr[d] = memory_pool<>::create("gather",
+                            context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                            hptr.size() * sizeof(size_t), hptr.data());
+                    p->col[d] = memory_pool<>::create("gather",
+                            context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                            hcol.size() * sizeof(size_t), hcol.data());
+                }
+            }
+
+            for(uint s = 0; s < nd; s++) {
+                if ((p->nsend[s] = hsidx[s].size())) {
+                    p->sidx[s] = memory_pool<>::create("gather", qctx(queue[s]),
+                            CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                            hsidx[s].size() * sizeof(size_t), hsidx[s].data());
+                }
+            }
+
+            return p;
+        }
+
+        template <typename T>
+        std::shared_ptr< kernels<T> > get_kernels(const cl::CommandQueue &q) const {
+            auto krn = kernel_cache<>::find< kernels<T> >(q);
+
+            if (krn) return krn;
+
+            cl::Context context = qctx(q);
+            cl::Device  device  = qdev(q);
+
+            std::ostringstream source;
+
+            source << standard_kernel_header <<
+                "typedef " << type_name<T>() << " real;\n"
+                "kernel void gather(\n"
+                "    " << type_name<size_t>() << " n,\n"
+                "    global const real *src,\n"
+                "    global const " << type_name<size_t>() << " *idx,\n"
+                "    " << type_name<size_t>() << " ioff,\n"
+                "    global real *dst,\n"
+                "    " << type_name<size_t>() << " doff\n"
+                "    )\n"
+                "{\n"
+                "    size_t i = get_global_id(0);\n"
+                "    if (i < n) dst[doff + i] = src[idx[ioff + i]];\n"
+                "}\n"
+                "kernel void reduce(\n"
+                "    " << type_name<size_t>() << " n,\n"
+                "    global const " << type_name<size_t>() << " *tgt,\n"
+                "    global const " << type_name<size_t>() << " *ptr,\n"
+                "    global const " << type_name<size_t>() << " *col,\n"
+                "    global const real *stage,\n"
+                "    global real *y,\n"
+                "    real alpha, real beta\n"
+                "    )\n"
+                "{\n"
+                "    size_t grid_size = get_global_size(0);\n"
+                "    for(size_t r = get_global_id(0); r < n; r += grid_size) {\n"
+                "        real sum = 0;\n"
+                "        for(size_t j = ptr[r], e = ptr[r + 1]; j < e; j++)\n"
+                "            sum += stage[col[j]];\n"
+                "        size_t i = tgt[r];\n"
+                "        if (alpha)\n"
+                "            y[i] = alpha * y[i] + beta * sum;\n"
+                "        else\n"
+                "            y[i] = beta * sum;\n"
+                "    }\n"
+                "}\n";
+
+            auto program = build_sources(context, source.str());
+
+            kernels<T> k;
+            k.gather = cl::Kernel(program, "gather");
+            k.reduce = cl::Kernel(program, "reduce");
+            k.wgsize = std::min(
+                    kernel_workgroup_size(k.gather, device),
+                    kernel_workgroup_size(k.reduce, device));
+
+            return kernel_cache<>::insert(q, k);
+        }
+
+        template <typename T>
+        void apply(const plan &p, const vector<T> &x, vector<T> &y,
+                T alpha, T beta) const
+        {
+            const uint nd = queue.size();
+
+            std::vector< std::shared_ptr< kernels<T> > > krn(nd);
+            for(uint d = 0; d < nd; d++) krn[d] = get_kernels<T>(queue[d]);
+
+            std::vector< vector<T> > stage(nd), send(nd);
+
+            for(uint d = 0; d < nd; d++) {
+                if (p.nstage[d]) stage[d] = vector<T>(single[d], p.nstage[d]);
+                if (p.nsend[d])  send[d]  = vector<T>(single[d], p.nsend[d]);
+            }
+
+            auto gather = [&](uint s, const cl::Buffer &dst, size_t doff, size_t cnt, size_t ioff) {
+                cl::Kernel &k = krn[s]->gather;
+
+                uint pos = 0;
+                k.setArg(pos++, cnt);
+                k.setArg(pos++, x(s));
+                k.setArg(pos++, p.sidx[s]);
+                k.setArg(pos++, ioff);
+                k.setArg(pos++, dst);
+                k.setArg(pos++, doff);
+
+                queue[s].enqueueNDRangeKernel(k, cl::NullRange,
+                        alignup(cnt, krn[s]->wgsize), krn[s]->wgsize, 0, event_trace<>::kernel(queue[s], k));
+            };
+
+            // Local elements go to the staging buffer directly, remote ones
+            // are packed and copied over (see device_copy()).
+            for(uint s = 0; s < nd; s++) {
+                for(uint d = 0; d < nd; d++) {
+                    size_t cnt = p.cnt[s][d];
+                    if (!cnt) continue;
+
+                    if (s == d)
+                        gather(s, stage[d](0), p.doff[d][s], cnt, p.soff[s][d]);
+                    else
+                        gather(s, send[s](0), p.soff[s][d], cnt, p.soff[s][d]);
+                }
+            }
+
+            std::vector<cl::Event> wev;
+
+            for(uint d = 0; d < nd; d++) {
+                for(uint s = 0; s < nd; s++) {
+                    size_t cnt = p.cnt[s][d];
+                    if (s == d || !cnt) continue;
+
+                    wev.push_back(device_copy(
+                                queue[s], send[s](0),  p.soff[s][d] * sizeof(T),
+                                queue[d], stage[d](0), p.doff[d][s] * sizeof(T),
+                                cnt * sizeof(T)));
+                }
+
+                if (size_t nr = p.nrows[d]) {
+                    cl::Kernel &k = krn[d]->reduce;
+                    cl::Device device = qdev(queue[d]);
+
+                    size_t g_size = device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU ?
+                        alignup(nr, krn[d]->wgsize) :
+                        device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * krn[d]->wgsize * 4;
+
+                    uint pos = 0;
+                    k.setArg(pos++, nr);
+                    k.setArg(pos++, p.tgt[d]);
+                    k.setArg(pos++, p.ptr[d]);
+                    k.setArg(pos++, p.col[d]);
+                    k.setArg(pos++, stage[d](0));
+                    k.setArg(pos++, y(d));
+                    k.setArg(pos++, alpha);
+                    k.setArg(pos++, beta);
+
+                    queue[d].enqueueNDRangeKernel(k, cl::NullRange, g_size, krn[d]->wgsize, 0, event_trace<>::kernel(queue[d], k));
+                }
+            }
+
+            // Send buffers should outlive the transfers.
+            if (!wev.empty()) cl::Event::waitForEvents(wev);
+        }
+};
+
+/// \cond INTERNAL
+
+template <typename T>
+struct permutation_expr
+    : vector_expression< boost::proto::terminal< additive_vector_transform >::type >
+{
+    typedef T value_type;
+
+    const index_set &idx;
+    const vector<T> &x;
+
+    value_type scale;
+
+    permutation_expr(const index_set &idx, const vector<T> &x)
+        : idx(idx), x(x), scale(1) {}
+
+    template<bool negate, bool append>
+    void apply(vector<T> &y) const
+    {
+        idx.permute(x, y, static_cast<T>(append ? 1 : 0), negate ? -scale : scale);
+    }
 };
 
-template<typename T> std::map<cl_context, bool>       gather<T>::compiled;
-template<typename T> std::map<cl_context, cl::Kernel> gather<T>::krn;
-template<typename T> std::map<cl_context, uint>       gather<T>::wgsize;
+template <typename T>
+struct is_scalable< permutation_expr<T> > : std::true_type {};
+
+/// \endcond
+
+/// Device-side gather: y = permute(idx, x) sets y[i] = x[idx[i]].
+/**
+ * May be combined with other terms of a vector expression:
+ * \code
+ * y = 2 * z + vex::permute(idx, x);
+ * \endcode
+ */
+template <typename T>
+permutation_expr<T> permute(const index_set &idx, const vector<T> &x) {
+    return permutation_expr<T>(idx, x);
+}
+
+/// Device-side scatter: y[idx[i]] += v[i].
+template <typename T>
+void scatter_add(const index_set &idx, const vector<T> &v, vector<T> &y) {
+    idx.scatter_add(v, y, static_cast<T>(1));
+}
+
 } // namespace vex
 
 #endif
@@ -0,0 +1,438 @@
+#ifndef VEXCL_GEMM_HPP
+#define VEXCL_GEMM_HPP
+
+/*
+The MIT License
+
+Copyright (c) 2012-2013 Denis Demidov <ddemidov@ksu.ru>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/**
+ * \file   vexcl/gemm.hpp
+ * \author Denis Demidov <ddemidov@ksu.ru>
+ * \brief  Dense matrix-matrix products.
+ */
+
+#ifdef WIN32
+#  pragma warning(push)
+#  pragma warning(disable : 4267 4290)
+#  define NOMINMAX
+#endif
+
+#include <vector>
+#include <map>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <cstdlib>
+#include <boost/chrono.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <CL/cl.hpp>
+#include <vexcl/util.hpp>
+#include <vexcl/kernel_cache.hpp>
+#include <vexcl/trace.hpp>
+#include <vexcl/vector.hpp>
+
+namespace vex {
+
+/// Tile sizes of the matrix-matrix product kernel.
+/**
+ * A work-group of wx x wy work-items computes a (wy * ry) x (wx * rx) tile
+ * of the result, each work-item holding ry x rx outputs in registers. Tiles
+ * of A and B of depth tk are staged in local memory.
+ */
+struct gemm_params {
+    size_t wx, wy; ///< Work-group dimensions.
+    size_t rx, ry; ///< Outputs per work-item.
+    size_t tk;     ///< Depth of the local memory tiles.
+
+    gemm_params(size_t wx = 16, size_t wy = 16, size_t rx = 4, size_t ry = 4, size_t tk = 16)
+        : wx(wx), wy(wy), rx(rx), ry(ry), tk(tk) {}
+
+    /// Rows of the result tile.
+    size_t tile_m() const { return wy * ry; }
+    /// Columns of the result tile.
+    size_t tile_n() const { return wx * rx; }
+
+    /// Local memory used by the kernel.
+    size_t local_bytes(size_t elem) const {
+        return (tk * (tile_m() + 1) + tk * tile_n()) * elem;
+    }
+};
+
+/// \cond INTERNAL
+
+/// Per-device tile sizes of the matrix-matrix product.
+/**
+ * The defaults are used unless VEXCL_TUNE_GEMM environment variable is set.
+ * In that case a range of tile sizes is benchmarked once per device and
+ * value type, and the fastest one is kept for the lifetime of the process.
+ * When VEXCL_CACHE_DIR is set, the result is also stored there next to the
+ * program binaries and is reused by later runs.
+ */
+template <bool dummy = true>
+struct gemm_tuning {
+    static_assert(dummy, "dummy parameter should be true");
+
+    /// Tile sizes for the given queue and value type.
+    template <typename T>
+    static gemm_params get(const cl::CommandQueue &queue);
+
+    /// Tile sizes are usable on the device.
+    template <typename T>
+    static bool fits(const cl::Device &device, const gemm_params &prm);
+
+    private:
+        static boost::mutex mx;
+        static std::map<std::pair<cl_device_id, std::string>, gemm_params> known;
+
+        static std::string path(const cl::Device &device, const std::string &type);
+        static bool load(const cl::Device &device, const std::string &type, gemm_params &prm);
+        static void store(const cl::Device &device, const std::string &type, const gemm_params &prm);
+
+        template <typename T>
+        static gemm_params benchmark(const cl::CommandQueue &queue);
+};
+
+template <typename T>
+struct gemm_kernel {
+    cl::Kernel kernel;
+
+    gemm_kernel(const cl::Kernel &k, const cl::Device&) : kernel(k) {}
+
+    static std::string signature(const gemm_params &p) {
+        std::ostringstream s;
+        s << "gemm_" << type_name<T>() << "_"
+          << p.wx << "_" << p.wy << "_" << p.rx << "_" << p.ry << "_" << p.tk;
+        return s.str();
+    }
+
+    // Tiles fully inside the matrices are loaded with vload4 and no bounds
+    // checks; border tiles are loaded element by element and padded with
+    // zeros. A tile is stored transposed, so that the work-items of a row
+    // read consecutive addresses in the inner loop.
+    static std::string source(const gemm_params &p) {
+        std::ostringstream src;
+
+        src << standard_kernel_header <<
+            "typedef " << type_name<T>() << " real;\n"
+            "typedef " << type_name<T>() << "4 real4;\n"
+            "#define WX " << p.wx << "\n"
+            "#define WY " << p.wy << "\n"
+            "#define RX " << p.rx << "\n"
+            "#define RY " << p.ry << "\n"
+            "#define TK " << p.tk << "\n"
+            "#define TM (WY * RY)\n"
+            "#define TN (WX * RX)\n"
+            "#define WG (WX * WY)\n"
+            "kernel __attribute__((reqd_work_group_size(WX, WY, 1)))\n"
+            "void gemm(\n"
+            "    uint M, uint N, uint K,\n"
+            "    real alpha,\n"
+            "    global const real *A,\n"
+            "    global const real *B,\n"
+            "    real beta,\n"
+            "    global real *C\n"
+            "    )\n"
+            "{\n"
+            "    local real As[TK][TM + 1];\n"
+            "    local real Bs[TK][TN];\n"
+            "    uint tx = get_local_id(0);\n"
+            "    uint ty = get_local_id(1);\n"
+            "    uint lid = ty * WX + tx;\n"
+            "    uint row0 = get_group_id(1) * TM;\n"
+            "    uint col0 = get_group_id(0) * TN;\n"
+            "    real acc[RY][RX];\n"
+            "    for(uint i = 0; i < RY; i++)\n"
+            "        for(uint j = 0; j < RX; j++) acc[i][j] = 0;\n"
+            "    for(uint k0 = 0; k0 < K; k0 += TK) {\n"
+            "        if (row0 + TM <= M && col0 + TN <= N && k0 + TK <= K) {\n"
+            "            for(uint v = lid; v < TM * TK / 4; v += WG) {\n"
+            "                uint m = v / (TK / 4), k = (v % (TK / 4)) * 4;\n"
+            "                real4 a = vload4(0, A + (size_t)(row0 + m) * K + k0 + k);\n"
+            "                As[k    ][m] = a.s0;\n"
+            "                As[k + 1][m] = a.s1;\n"
+            "                As[k + 2][m] = a.s2;\n"
+            "                As[k + 3][m] = a.s3;\n"
+            "            }\n"
+            "            for(uint v = lid; v < TK * TN / 4; v += WG) {\n"
+            "                uint k = v / (TN / 4), n = (v % (TN / 4)) * 4;\n"
+            "                vstore4(vload4(0, B + (size_t)(k0 + k) * N + col0 + n), 0, &Bs[k][n]);\n"
+            "            }\n"
+            "        } else {\n"
+            "            for(uint v = lid; v < TM * TK; v += WG) {\n"
+            "                uint m = v / TK, k = v % TK;\n"
+            "                uint r = row0 + m, c = k0 + k;\n"
+            "                As[k][m] = (r < M && c < K) ? A[(size_t)r * K + c] : 0;\n"
+            "            }\n"
+            "            for(uint v = lid; v < TK * TN; v += WG) {\n"
+            "                uint k = v / TN, n = v % TN;\n"
+            "                uint r = k0 + k, c = col0 + n;\n"
+            "                Bs[k][n] = (r < K && c < N) ? B[(size_t)r * N + c] : 0;\n"
+            "            }\n"
+            "        }\n"
+            "        barrier(CLK_LOCAL_MEM_FENCE);\n"
+            "#pragma unroll\n"
+            "        for(uint k = 0; k < TK; k++) {\n"
+            "            real a[RY], b[RX];\n"
+            "            for(uint i = 0; i < RY; i++) a[i] = As[k][ty + i * WY];\n"
+            "            for(uint j = 0; j < RX; j++) b[j] = Bs[k][tx + j * WX];\n"
+            "            for(uint i = 0; i < RY; i++)\n"
+            "                for(uint j = 0; j < RX; j++) acc[i][j] += a[i] * b[j];\n"
+            "        }\n"
+            "        barrier(CLK_LOCAL_MEM_FENCE);\n"
+            "    }\n"
+            "    for(uint i = 0; i < RY; i++) {\n"
+            "        uint r = row0 + ty + i * WY;\n"
+            "        if (r >= M) break;\n"
+            "        for(uint j = 0; j < RX; j++) {\n"
+            "            uint c = col0 + tx + j * WX;\n"
+            "            if (c >= N) break;\n"
+            "            size_t pos = (size_t)r * N + c;\n"
+            "            C[pos] = beta ? alpha * acc[i][j] + beta * C[pos] : alpha * acc[i][j];\n"
+            "        }\n"
+            "    }\n"
+            "}\n";
+
+        return src.str();
+    }
+
+    static std::shared_ptr<gemm_kernel> get(const cl::CommandQueue &queue, const gemm_params &p) {
+        std::string sig = signature(p);
+
+        std::shared_ptr<gemm_kernel> k = kernel_cache<>::find<gemm_kernel>(queue, sig);
+        if (k) return k;
+
+        return kernel_cache<>::build<gemm_kernel>(queue, source(p), "gemm", "", sig);
+    }
+};
+
+template <typename T>
+void gemm(const cl::CommandQueue &queue, const gemm_params &p,
+        size_t M, size_t N, size_t K,
+        T alpha, const cl::Buffer &A, const cl::Buffer &B, T beta, const cl::Buffer &C)
+{
+    cl::Kernel &krn = gemm_kernel<T>::get(queue, p)->kernel;
+
+    uint pos = 0;
+    krn.setArg(pos++, static_cast<cl_uint>(M));
+    krn.setArg(pos++, static_cast<cl_uint>(N));
+    krn.setArg(pos++, static_cast<cl_uint>(K));
+    krn.setArg(pos++, alpha);
+    krn.setArg(pos++, A);
+    krn.setArg(pos++, B);
+    krn.setArg(pos++, beta);
+    krn.setArg(pos++, C);
+
+    queue.enqueueNDRangeKernel(krn, cl::NullRange,
+            cl::NDRange(
+                (N + p.tile_n() - 1) / p.tile_n() * p.wx,
+                (M + p.tile_m() - 1) / p.tile_m() * p.wy),
+            cl::NDRange(p.wx, p.wy),
+            0, event_trace<>::kernel(queue, krn,
+                (M * K + K * N + 2 * M * N) * sizeof(T), 2 * M * N * K));
+}
+
+/// \endcond
+
+/// Matrix-matrix product C = alpha * A * B + beta * C.
+/**
+ * A is M x K, B is K x N, and C is M x N matrix; all are stored densely in
+ * row-major order. Works with float, double and int vectors located on a
+ * single device. Tile sizes are taken from the per-device tuning (see
+ * VEXCL_TUNE_GEMM) unless given explicitly:
+ * \code
+ * vex::vector<float> A(ctx, M * K), B(ctx, K * N), C(ctx, M * N);
+ * vex::gemm(M, N, K, 1.0f, A, B, 0.0f, C);
+ * \endcode
+ */
+template <typename T>
+void gemm(size_t M, size_t N, size_t K,
+        T alpha, const vector<T> &A, const vector<T> &B, T beta, vector<T> &C,
+        const gemm_params *prm = 0)
+{
+    const std::vector<cl::CommandQueue> &queue = C.queue_list();
+
+    if (queue.size() != 1 || A.queue_list().size() != 1 || B.queue_list().size() != 1)
+        throw std::invalid_argument("gemm: matrices should be located on a single device");
+
+    if (A.size() < M * K || B.size() < K * N || C.size() < M * N)
+        throw std::length_error("gemm: matrix size mismatch");
+
+    if (!M || !N) return;
+
+    gemm_params p = prm ? *prm : gemm_tuning<>::get<T>(queue[0]);
+
+    if (!gemm_tuning<>::fits<T>(qdev(queue[0]), p))
+        throw std::invalid_argument("gemm: tile sizes do not fit the device");
+
+    gemm(queue[0], p, M, N, K, alpha, A(0), B(0), beta, C(0));
+}
+
+/// \cond INTERNAL
+
+template <bool dummy>
+boost::mutex gemm_tuning<dummy>::mx;
+
+template <bool dummy>
+std::map<std::pair<cl_device_id, std::string>, gemm_params> gemm_tuning<dummy>::known;
+
+template <bool dummy>
+template <typename T>
+gemm_params gemm_tuning<dummy>::get(const cl::CommandQueue &queue) {
+    cl::Device  device = qdev(queue);
+    std::string type   = type_name<T>();
+
+    boost::lock_guard<boost::mutex> lock(mx);
+
+    auto p = known.find(std::make_pair(device(), type));
+    if (p != known.end()) return p->second;
+
+    gemm_params prm;
+
+    if (device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU)
+        prm = gemm_params(4, 4, 4, 4, 16);
+
+    if (!load(device, type, prm)) {
+        if (getenv("VEXCL_TUNE_GEMM")) {
+            prm = benchmark<T>(queue);
+            store(device, type, prm);
+        } else {
+            // Fall back to smaller tiles on devices with little local memory.
+            while(!fits<T>(device, prm) && prm.rx > 1) {
+                prm.rx /= 2;
+                prm.ry /= 2;
+            }
+            while(!fits<T>(device, prm) && prm.wx > 4) {
+                prm.wx /= 2;
+                prm.wy /= 2;
+            }
+        }
+    }
+
+    known.insert(std::make_pair(std::make_pair(device(), type), prm));
+    return prm;
+}
+
+template <bool dummy>
+template <typename T>
+bool gemm_tuning<dummy>::fits(const cl::Device &device, const gemm_params &prm) {
+    return prm.wx * prm.wy <= device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>()
+        && prm.local_bytes(sizeof(T)) <= device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>()
+        && prm.tk % 4 == 0
+        && prm.tile_n() % 4 == 0;
+}
+
+template <bool dummy>
+std::string gemm_tuning<dummy>::path(const cl::Device &device, const std::string &type) {
+    return program_binaries<>::path(device, "gemm tuning " + type, "", ".tune");
+}
+
+template <bool dummy>
+bool gemm_tuning<dummy>::load(const cl::Device &device, const std::string &type, gemm_params &prm) {
+    if (!program_binaries<>::dir()) return false;
+
+    std::ifstream f(path(device, type).c_str());
+
+    size_t wx, wy, rx, ry, tk;
+    if (!(f >> wx >> wy >> rx >> ry >> tk) || !wx || !wy || !rx || !ry || !tk)
+        return false;
+
+    prm = gemm_params(wx, wy, rx, ry, tk);
+    return true;
+}
+
+template <bool dummy>
+void gemm_tuning<dummy>::store(const cl::Device &device, const std::string &type, const gemm_params &prm) {
+    if (!program_binaries<>::dir()) return;
+
+    std::ofstream f(path(device, type).c_str());
+    f << prm.wx << " " << prm.wy << " " << prm.rx << " " << prm.ry << " " << prm.tk << std::endl;
+}
+
+template <bool dummy>
+template <typename T>
+gemm_params gemm_tuning<dummy>::benchmark(const cl::CommandQueue &queue) {
+    typedef boost::chrono::high_resolution_clock clock;
+
+    const size_t n = 1024;
+    const int    repeat = 4;
+
+    cl::Device device = qdev(queue);
+
+    std::vector<cl::CommandQueue> q(1, queue);
+    vex::vector<T> A(q, n * n), B(q, n * n), C(q, n * n);
+    A = 1;
+    B = 1;
+
+    gemm_params best;
+    double best_time = std::numeric_limits<double>::max();
+
+    static const size_t wg[][2] = {{8, 8}, {16, 8}, {16, 16}, {32, 8}};
+    static const size_t rb[][2] = {{1, 1}, {2, 2}, {4, 2}, {4, 4}, {8, 4}, {8, 8}};
+    static const size_t tk[]    = {8, 16, 32};
+
+    for(size_t w = 0; w < sizeof(wg) / sizeof(wg[0]); w++) {
+        for(size_t r = 0; r < sizeof(rb) / sizeof(rb[0]); r++) {
+            for(size_t t = 0; t < sizeof(tk) / sizeof(tk[0]); t++) {
+                gemm_params prm(wg[w][0], wg[w][1], rb[r][0], rb[r][1], tk[t]);
+
+                if (!fits<T>(device, prm)) continue;
+
+                try {
+                    // Warm up: compiles the kernel on the first pass.
+                    gemm<T>(queue, prm, n, n, n, T(1), A(0), B(0), T(0), C(0));
+                    queue.finish();
+
+                    clock::time_point start = clock::now();
+                    for(int i = 0; i < repeat; i++)
+                        gemm<T>(queue, prm, n, n, n, T(1), A(0), B(0), T(0), C(0));
+                    queue.finish();
+                    double time = boost::chrono::duration<double>(clock::now() - start).count();
+
+                    if (time < best_time) {
+                        best_time = time;
+                        best = prm;
+                    }
+                } catch(const cl::Error&) {
+                    // Kernel does not fit the device (registers, work-group size).
+                }
+            }
+        }
+    }
+
+    return best;
+}
+
+/// \endcond
+
+} // namespace vex
+
+#ifdef WIN32
+#  pragma warning(pop)
+#endif
+
+// vim: et
+#endif
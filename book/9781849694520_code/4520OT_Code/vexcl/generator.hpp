@@ -39,10 +39,14 @@ THE SOFTWARE.
 
 #include <iostream>
 #include <sstream>
+#include <fstream>
 #include <string>
+#include <vector>
 #include <stdexcept>
 #include <boost/proto/proto.hpp>
 #include <vexcl/util.hpp>
+#include <vexcl/kernel_cache.hpp>
+#include <vexcl/autotune.hpp>
 #include <vexcl/operations.hpp>
 
 /// Vector expression template library for OpenCL.
@@ -284,6 +288,7 @@ class symbolic
             LocalVar        = 0, ///< Local variable.
             VectorParameter = 1, ///< Vector kernel parameter.
             ScalarParameter = 2, ///< Scalar kernel parameter.
+            LoopCounter     = 3  ///< Counter of a symbolic loop. Declared by the loop statement.
         };
 
         /// Constness of vector parameter.
@@ -347,7 +352,7 @@ class symbolic
         std::string init() const {
             std::ostringstream s;
 
-            if (scope != LocalVar) {
+            if (scope == VectorParameter || scope == ScalarParameter) {
                 s << type_name<T>() << " " << *this << " = p_" << *this;
 
                 switch (scope) {
@@ -357,7 +362,7 @@ class symbolic
                     case ScalarParameter:
                         s << ";\n";
                         break;
-                    case LocalVar:
+                    default:
                         break;
                 }
             }
@@ -405,118 +410,220 @@ std::ostream& operator<<(std::ostream &os, const symbolic<T> &sym) {
     return os << "var" << sym.id();
 }
 
-/// Autogenerated kernel.
-template <size_t NP>
-class Kernel {
+//---------------------------------------------------------------------------
+// Control flow.
+//---------------------------------------------------------------------------
+
+/// Records a loop over [begin, end).
+/**
+ * Instead of unrolling the host loop into the kernel source, emits an OpenCL
+ * for loop. The body is called once with the symbolic loop counter:
+ * \code
+ * vex::generator::loop(0, 500, [&](vex::generator::symbolic<int>) {
+ *     runge_kutta_4(sys_func<sym_state>, sym_x, dt);
+ * });
+ * \endcode
+ * Both bounds may be numbers, symbolic variables (for example, scalar kernel
+ * parameters), or symbolic expressions. Variables declared inside the body
+ * are local to the loop.
+ */
+template <class Begin, class End, class Body>
+void loop(const Begin &begin, const End &end, Body body) {
+    symbolic<int> i(symbolic<int>::LoopCounter);
+
+    get_recorder() << "for(int " << i << " = ";
+    record(begin);
+    get_recorder() << "; " << i << " < ";
+    record(end);
+    get_recorder() << "; ++" << i << ") {\n";
+
+    body(i);
+
+    get_recorder() << "}\n";
+}
+
+/// Records a loop over [0, n).
+template <class End, class Body>
+void loop(const End &n, Body body) {
+    loop(0, n, body);
+}
+
+/// Records a conditional statement.
+/**
+ * Emits an OpenCL if statement; the body is recorded once:
+ * \code
+ * vex::generator::if_(sym_x > 1, [&]() { sym_x = 1; });
+ * \endcode
+ */
+template <class Cond, class Then>
+void if_(const Cond &cond, Then then_branch) {
+    get_recorder() << "if (";
+    record(cond);
+    get_recorder() << ") {\n";
+
+    then_branch();
+
+    get_recorder() << "}\n";
+}
+
+/// Records a conditional statement with an alternative branch.
+template <class Cond, class Then, class Else>
+void if_(const Cond &cond, Then then_branch, Else else_branch) {
+    get_recorder() << "if (";
+    record(cond);
+    get_recorder() << ") {\n";
+
+    then_branch();
+
+    get_recorder() << "} else {\n";
+
+    else_branch();
+
+    get_recorder() << "}\n";
+}
+
+/// Generated kernel source together with its parameter signature.
+/**
+ * Recording a host algorithm does not need any OpenCL devices, so the
+ * source may be generated once (for example, at build time), saved to a
+ * file, and loaded later to construct a ready generator::Kernel without
+ * repeating the recording:
+ * \code
+ * // Offline:
+ * auto src = vex::generator::build_source("rk4_stepper", body.str(), sym_x);
+ * src.save("rk4_stepper.vexkrn");
+ *
+ * // At runtime:
+ * vex::generator::Kernel<1> kernel(ctx,
+ *     vex::generator::kernel_source::load("rk4_stepper.vexkrn"));
+ * kernel(x);
+ * \endcode
+ * Compiled binaries of the loaded kernels are stored in the program binary
+ * cache as any other VexCL kernel when VEXCL_CACHE_DIR is set.
+ */
+class kernel_source {
     public:
+        kernel_source() {}
+
+        /// Records kernel source from body and symbolic parameters.
         template <class ArgTuple>
-        Kernel(
-                const std::vector<cl::CommandQueue> &queue,
-                const std::string &name, const std::string &body,
-                const ArgTuple& args
-              ) : queue(queue)
+        kernel_source(const std::string &name, const std::string &body,
+                const ArgTuple &args)
+            : kname(name)
         {
-            static_assert(
-                    std::tuple_size<ArgTuple>::value == NP,
-                    "Wrong number of kernel parameters"
-                    );
-
-            std::ostringstream source;
+            std::ostringstream s;
 
-            source
-                << standard_kernel_header
+            s   << standard_kernel_header
                 << "kernel void " << name << "(\n"
                 << "\t" << type_name<size_t>() << " n";
 
-            declare_params declprm(source);
+            declare_params declprm(s, prm);
             for_each<0>(args, declprm);
 
-            source <<
+            s <<
                 "\n)\n{\n\t"
                 "for(size_t idx = get_global_id(0); idx < n; "
                 "idx += get_global_size(0)) {\n";
 
-            read_params readprm(source);
+            read_params readprm(s);
             for_each<0>(args, readprm);
 
-            source << body;
+            s << body;
 
-            write_params writeprm(source);
+            write_params writeprm(s);
             for_each<0>(args, writeprm);
 
-            source << "\t}\n}\n";
+            s << "\t}\n}\n";
 
-            for(auto q = queue.begin(); q != queue.end(); q++) {
-                cl::Context context = qctx(*q);
-                cl::Device  device  = qdev(*q);
+            src = s.str();
+        }
 
-                auto program = build_sources(context, source.str());
+        /// Kernel name.
+        const std::string& name() const {
+            return kname;
+        }
 
-                krn[context()] = cl::Kernel(program, name.c_str());
-                wgs[context()] = kernel_workgroup_size(krn[context()], device);
-            }
+        /// Complete OpenCL source of the kernel.
+        const std::string& source() const {
+            return src;
         }
 
-#ifndef BOOST_NO_VARIADIC_TEMPLATES
-        /// Launches kernel with provided parameters.
-        template <class... Param>
-        void operator()(const Param&... param) {
-            launch(std::tie(param...));
+        /// Declarations of kernel parameters (excluding the size parameter).
+        const std::vector<std::string>& params() const {
+            return prm;
         }
-#else
 
-#define PRINT_PARAM(z, n, data) const Param ## n &param ## n
-#define FUNCALL_OPERATOR(z, n, data) \
-        template < BOOST_PP_ENUM_PARAMS(n, class Param) > \
-        void operator()( BOOST_PP_ENUM(n, PRINT_PARAM, ~) ) { \
-            launch(std::tie( BOOST_PP_ENUM_PARAMS(n, param) )); \
+        /// Writes kernel to a stream.
+        void save(std::ostream &os) const {
+            os << magic() << "\n" << kname << "\n" << prm.size() << "\n";
+            for(auto p = prm.begin(); p != prm.end(); p++)
+                os << *p << "\n";
+            os << src.size() << "\n" << src;
         }
 
-BOOST_PP_REPEAT_FROM_TO(1, VEXCL_MAX_ARITY, FUNCALL_OPERATOR, ~)
+        /// Writes kernel to a file.
+        void save(const std::string &fname) const {
+            std::ofstream f(fname.c_str(), std::ios::binary);
+            if (!f) throw std::runtime_error("Can not create " + fname);
+            save(f);
+            if (!f) throw std::runtime_error("Failed to write " + fname);
+        }
 
-#undef PRINT_PARAM
-#undef FUNCALL_OPERATOR
+        /// Reads kernel saved by save().
+        static kernel_source load(std::istream &is) {
+            kernel_source k;
 
-#endif
-    private:
+            std::string m;
+            std::getline(is, m);
+            if (m != magic())
+                throw std::runtime_error("Not a VexCL kernel file");
 
-        template <class ParamTuple>
-        void launch(const ParamTuple &param) {
-            static_assert(
-                    std::tuple_size<ParamTuple>::value == NP,
-                    "Wrong number of kernel parameters"
-                    );
+            size_t np = 0, len = 0;
 
-            for(uint d = 0; d < queue.size(); d++) {
-                if (size_t psize = prm_size<0>(d, param)) {
-                    cl::Context context = qctx(queue[d]);
-                    cl::Device  device  = qdev(queue[d]);
+            std::getline(is, k.kname);
+            is >> np; is.ignore();
 
-                    uint pos = 0;
-                    krn[context()].setArg(pos++, psize);
+            k.prm.resize(np);
+            for(size_t i = 0; i < np; i++)
+                std::getline(is, k.prm[i]);
 
-                    set_params setprm(krn[context()], d, pos);
-                    for_each<0>(param, setprm);
+            is >> len; is.ignore();
 
-                    size_t g_size = device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU ?
-                        alignup(psize, wgs[context()]) :
-                        device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * wgs[context()] * 4;
+            k.src.resize(len);
+            if (len) is.read(&k.src[0], len);
 
-                    queue[d].enqueueNDRangeKernel(krn[context()],
-                            cl::NullRange, g_size, wgs[context()]
-                            );
-                }
-            }
+            if (!is || k.kname.empty())
+                throw std::runtime_error("Truncated VexCL kernel file");
+
+            return k;
+        }
+
+        /// Reads kernel from a file created by save().
+        static kernel_source load(const std::string &fname) {
+            std::ifstream f(fname.c_str(), std::ios::binary);
+            if (!f) throw std::runtime_error("Can not open " + fname);
+            return load(f);
+        }
+    private:
+        std::string kname;
+        std::string src;
+        std::vector<std::string> prm;
+
+        static const char* magic() {
+            return "vexcl-kernel 1";
         }
 
         struct declare_params {
             std::ostream &os;
+            std::vector<std::string> &prm;
 
-            declare_params(std::ostream &os) : os(os) {}
+            declare_params(std::ostream &os, std::vector<std::string> &prm)
+                : os(os), prm(prm) {}
 
             template <class T>
             void operator()(const T &v) const {
-                os << ",\n\t" << v.prmdecl();
+                prm.push_back(v.prmdecl());
+                os << ",\n\t" << prm.back();
             }
         };
 
@@ -541,6 +648,95 @@ BOOST_PP_REPEAT_FROM_TO(1, VEXCL_MAX_ARITY, FUNCALL_OPERATOR, ~)
                 os << v.write();
             }
         };
+};
+
+/// Autogenerated kernel.
+template <size_t NP>
+class Kernel {
+    public:
+        template <class ArgTuple>
+        Kernel(
+                const std::vector<cl::CommandQueue> &queue,
+                const std::string &name, const std::string &body,
+                const ArgTuple& args
+              ) : queue(queue), krn(queue.size()), src(name, body, args)
+        {
+            static_assert(
+                    std::tuple_size<ArgTuple>::value == NP,
+                    "Wrong number of kernel parameters"
+                    );
+
+            build();
+        }
+
+        /// Builds kernel from previously generated (or loaded) source.
+        Kernel(
+                const std::vector<cl::CommandQueue> &queue,
+                const kernel_source &src
+              ) : queue(queue), krn(queue.size()), src(src)
+        {
+            if (src.params().size() != NP)
+                throw std::runtime_error("Kernel " + src.name() +
+                        ": wrong number of kernel parameters");
+
+            build();
+        }
+
+        /// Generated source of the kernel.
+        const kernel_source& source() const {
+            return src;
+        }
+
+#ifndef BOOST_NO_VARIADIC_TEMPLATES
+        /// Launches kernel with provided parameters.
+        template <class... Param>
+        void operator()(const Param&... param) {
+            launch(std::tie(param...));
+        }
+#else
+
+#define PRINT_PARAM(z, n, data) const Param ## n &param ## n
+#define FUNCALL_OPERATOR(z, n, data) \
+        template < BOOST_PP_ENUM_PARAMS(n, class Param) > \
+        void operator()( BOOST_PP_ENUM(n, PRINT_PARAM, ~) ) { \
+            launch(std::tie( BOOST_PP_ENUM_PARAMS(n, param) )); \
+        }
+
+BOOST_PP_REPEAT_FROM_TO(1, VEXCL_MAX_ARITY, FUNCALL_OPERATOR, ~)
+
+#undef PRINT_PARAM
+#undef FUNCALL_OPERATOR
+
+#endif
+    private:
+
+        template <class ParamTuple>
+        void launch(const ParamTuple &param) {
+            static_assert(
+                    std::tuple_size<ParamTuple>::value == NP,
+                    "Wrong number of kernel parameters"
+                    );
+
+            for(uint d = 0; d < queue.size(); d++) {
+                if (size_t psize = prm_size<0>(d, param)) {
+                    cl::Device device = qdev(queue[d]);
+
+                    uint pos = 0;
+                    krn[d]->kernel.setArg(pos++, psize);
+
+                    set_params setprm(krn[d]->kernel, d, pos);
+                    for_each<0>(param, setprm);
+
+                    bool   cpu   = device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU;
+                    size_t units = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+
+                    tuned_launch(queue[d], krn[d]->kernel, *krn[d]->tuner, psize,
+                            [cpu, units, psize](size_t wgsize) {
+                                return cpu ? alignup(psize, wgsize) : units * wgsize * 4;
+                            });
+                }
+            }
+        }
 
         struct set_params {
             cl::Kernel &krn;
@@ -561,8 +757,37 @@ BOOST_PP_REPEAT_FROM_TO(1, VEXCL_MAX_ARITY, FUNCALL_OPERATOR, ~)
 
         std::vector<cl::CommandQueue> queue;
 
-        std::map<cl_context, cl::Kernel> krn;
-        std::map<cl_context, uint> wgs;
+        struct kernel_t {
+            cl::Kernel kernel;
+            std::shared_ptr<workgroup_tuner> tuner;
+
+            kernel_t(const cl::Kernel &kernel, const cl::Device &device)
+                : kernel(kernel), tuner(std::make_shared<workgroup_tuner>(kernel, device))
+            {}
+        };
+
+        std::vector< std::shared_ptr<kernel_t> > krn;
+
+        kernel_source src;
+
+        void build() {
+            // Identical kernels recorded by different instances share the
+            // compiled program.
+            for(uint d = 0; d < queue.size(); d++) {
+                krn[d] = kernel_cache<>::find<kernel_t>(queue[d], src.source());
+
+                if (!krn[d]) {
+                    cl::Context context = qctx(queue[d]);
+                    cl::Device  device  = qdev(queue[d]);
+
+                    auto program = build_sources(context, src.source());
+
+                    krn[d] = kernel_cache<>::insert(queue[d], kernel_t(
+                                cl::Kernel(program, src.name().c_str()), device),
+                            src.source());
+                }
+            }
+        }
 
         template <class T>
         size_t prm_part_size(uint, const T &) const {
@@ -625,6 +850,39 @@ BOOST_PP_REPEAT_FROM_TO(1, VEXCL_MAX_ARITY, BUILD_KERNEL, ~)
 
 #endif
 
+#ifndef BOOST_NO_VARIADIC_TEMPLATES
+/// Generates kernel source from recorded expression sequence and symbolic parameter list.
+/**
+ * Does not need an OpenCL context. The result may be saved and later used
+ * to construct generator::Kernel.
+ */
+template <class... Args>
+kernel_source build_source(
+        const std::string &name, const std::string& body, const Args&... args
+        )
+{
+    return kernel_source(name, body, std::tie(args...));
+}
+#else
+
+#define PRINT_ARG(z, n, data) const Arg ## n &arg ## n
+#define BUILD_SOURCE(z, n, data) \
+template < BOOST_PP_ENUM_PARAMS(n, class Arg) > \
+kernel_source build_source( \
+        const std::string &name, const std::string& body, \
+        BOOST_PP_ENUM(n, PRINT_ARG, ~) \
+        ) \
+{ \
+    return kernel_source(name, body, std::tie( BOOST_PP_ENUM_PARAMS(n, arg) )); \
+}
+
+BOOST_PP_REPEAT_FROM_TO(1, VEXCL_MAX_ARITY, BUILD_SOURCE, ~)
+
+#undef PRINT_ARG
+#undef BUILD_SOURCE
+
+#endif
+
 } // namespace generator;
 
 } // namespace vex;
@@ -0,0 +1,231 @@
+#ifndef VEXCL_GRAPH_HPP
+#define VEXCL_GRAPH_HPP
+
+/*
+The MIT License
+
+Copyright (c) 2012-2013 Denis Demidov <ddemidov@ksu.ru>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/**
+ * \file   vexcl/graph.hpp
+ * \author Denis Demidov <ddemidov@ksu.ru>
+ * \brief  Recorded graph of device operations for repeated execution.
+ */
+
+#ifdef WIN32
+#  pragma warning(push)
+#  pragma warning(disable : 4267 4290)
+#  define NOMINMAX
+#endif
+
+#include <vector>
+#include <functional>
+#include <stdexcept>
+#include <algorithm>
+#include <CL/cl.hpp>
+#include <vexcl/util.hpp>
+#include <vexcl/vector.hpp>
+#include <vexcl/trace.hpp>
+
+namespace vex {
+
+/// Graph of device operations recorded once and executed many times.
+/**
+ * Nodes are either vector assignments or arbitrary host callbacks that
+ * enqueue device work (sparse matrix products, FFTs, copies, reductions into
+ * vex::scalar). Each node lists the nodes it depends on; since a node may
+ * only depend on previously added nodes, the order of addition is a valid
+ * execution order:
+ * \code
+ * vex::graph g;
+ *
+ * auto a = g.call(ctx, [&]{ X = fft(x); });
+ * auto b = g.assign(X, X * H, {a});
+ * auto c = g.call(ctx, [&]{ y = ifft(X); }, {b});
+ *          g.call(ctx, [&]{ sum(s, y * y); }, {c});
+ *
+ * for(int i = 0; i < n; i++) g.run();
+ * g.wait();
+ * \endcode
+ * Assignment nodes get private copies of their kernels with all arguments
+ * set at recording time, so replaying a node costs a single
+ * clEnqueueNDRangeKernel call. Values that change between runs should be
+ * passed as vex::scalar terminals, which are read by the kernels from device
+ * memory. Dependencies between nodes in the same command queue are implied
+ * by the queue order; only dependencies between different queues (see
+ * vex::Context streams) are expressed with events. run() does not block and
+ * flushes each queue once.
+ */
+class graph {
+    public:
+        /// Node handle.
+        typedef size_t node;
+
+        /// Records assignment y = expr.
+        /**
+         * The vectors in the expression should stay alive and should not be
+         * reallocated while the graph is in use.
+         */
+        template <typename T, class Expr>
+        node assign(vector<T> &y, const Expr &expr,
+                const std::vector<node> &deps = std::vector<node>())
+        {
+            task t(y.queue_list(), check(deps));
+
+            for(uint d = 0; d < t.queue.size(); d++) {
+                t.kernel.push_back(cl::Kernel());
+                t.gsize.push_back(0);
+                t.wgsize.push_back(0);
+
+                if (!y.bind_assignment(d, expr, t.kernel[d], t.gsize[d], t.wgsize[d]))
+                    t.kernel[d] = cl::Kernel();
+            }
+
+            // Every replay writes y.
+            t.written = [&y]() { y.touch(); };
+
+            return add(t);
+        }
+
+        /// Records host callback that enqueues work into the given queues.
+        /**
+         * The callback should only enqueue commands into the given queues
+         * and should not wait for them.
+         */
+        node call(const std::vector<cl::CommandQueue> &queue,
+                const std::function<void()> &f,
+                const std::vector<node> &deps = std::vector<node>())
+        {
+            task t(queue, check(deps));
+            t.fn = f;
+            return add(t);
+        }
+
+        /// Enqueues all nodes in the order of recording.
+        void run() {
+            for(auto t = tasks.begin(); t != tasks.end(); t++) {
+                for(uint d = 0; d < t->queue.size(); d++) {
+                    wait.clear();
+
+                    for(auto p = t->deps.begin(); p != t->deps.end(); p++) {
+                        const task &dep = tasks[*p];
+                        if (d < dep.done.size() && dep.done[d]() &&
+                                dep.queue[d]() != t->queue[d]())
+                            wait.push_back(dep.done[d]);
+                    }
+
+                    cl::Event *ev = t->signal ? &t->done[d] : 0;
+
+                    if (t->fn) {
+                        if (!wait.empty()) t->queue[d].enqueueWaitForEvents(wait);
+                    } else if (t->kernel[d]()) {
+                        t->queue[d].enqueueNDRangeKernel(t->kernel[d],
+                                cl::NullRange, t->gsize[d], t->wgsize[d],
+                                wait.empty() ? 0 : &wait,
+                                ev ? ev : event_trace<>::kernel(t->queue[d], t->kernel[d]));
+                    } else if (ev) {
+                        t->queue[d].enqueueMarker(ev);
+                    }
+                }
+
+                if (t->written) t->written();
+
+                if (t->fn) {
+                    t->fn();
+
+                    if (t->signal)
+                        for(uint d = 0; d < t->queue.size(); d++)
+                            t->queue[d].enqueueMarker(&t->done[d]);
+                }
+            }
+
+            for(auto q = queues.begin(); q != queues.end(); q++) q->flush();
+        }
+
+        /// Waits for completion of the last run.
+        void wait() {
+            for(auto q = queues.begin(); q != queues.end(); q++) q->finish();
+        }
+
+        /// Number of recorded nodes.
+        size_t size() const {
+            return tasks.size();
+        }
+    private:
+        struct task {
+            std::vector<cl::CommandQueue> queue;
+            std::vector<node>             deps;
+
+            std::vector<cl::Kernel>       kernel;
+            std::vector<size_t>           gsize, wgsize;
+            std::function<void()>         fn;
+            std::function<void()>         written;
+
+            // Whether a later node in another queue waits for this one.
+            bool                          signal;
+            std::vector<cl::Event>        done;
+
+            task(const std::vector<cl::CommandQueue> &queue,
+                    const std::vector<node> &deps)
+                : queue(queue), deps(deps), signal(false), done(queue.size())
+            {}
+        };
+
+        std::vector<task>             tasks;
+        std::vector<cl::CommandQueue> queues;
+        std::vector<cl::Event>        wait;
+
+        const std::vector<node>& check(const std::vector<node> &deps) const {
+            for(auto p = deps.begin(); p != deps.end(); p++)
+                if (*p >= tasks.size())
+                    throw std::invalid_argument("graph node depends on unknown node");
+            return deps;
+        }
+
+        node add(const task &t) {
+            for(auto p = t.deps.begin(); p != t.deps.end(); p++) {
+                task &dep = tasks[*p];
+
+                for(uint d = 0; d < std::min(t.queue.size(), dep.queue.size()); d++)
+                    if (dep.queue[d]() != t.queue[d]()) dep.signal = true;
+            }
+
+            for(auto q = t.queue.begin(); q != t.queue.end(); q++) {
+                bool known = false;
+                for(auto k = queues.begin(); k != queues.end(); k++)
+                    if ((*k)() == (*q)()) known = true;
+                if (!known) queues.push_back(*q);
+            }
+
+            tasks.push_back(t);
+            return tasks.size() - 1;
+        }
+};
+
+} // namespace vex
+
+#ifdef WIN32
+#  pragma warning(pop)
+#endif
+
+// vim: et
+#endif
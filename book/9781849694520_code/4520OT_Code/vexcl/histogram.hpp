@@ -0,0 +1,457 @@
+#ifndef VEXCL_HISTOGRAM_HPP
+#define VEXCL_HISTOGRAM_HPP
+
+/*
+The MIT License
+
+Copyright (c) 2012-2013 Denis Demidov <ddemidov@ksu.ru>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/**
+ * \file   vexcl/histogram.hpp
+ * \author Denis Demidov <ddemidov@ksu.ru>
+ * \brief  Histograms of device vectors and vector expressions.
+ */
+
+#ifdef WIN32
+#  pragma warning(push)
+#  pragma warning(disable : 4267 4290)
+#  define NOMINMAX
+#endif
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <iomanip>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+#include <CL/cl.hpp>
+#include <vexcl/util.hpp>
+#include <vexcl/kernel_cache.hpp>
+#include <vexcl/vector.hpp>
+
+namespace vex {
+
+/// \cond INTERNAL
+
+namespace hist {
+
+// Histogram kernels for the given binning function. Sub-histograms are kept
+// in local memory as private per-thread counters (few bins), as several
+// replicas of the group histogram updated with local atomics (so that
+// neighbouring work-items hit different copies), or as a single group
+// histogram; bin counts that do not fit into local memory are updated with
+// global atomics directly. Sub-histograms are merged into the global one by
+// all work-items of the group, one bin per work-item.
+//
+// The binned values are those of a vector expression, evaluated as they are
+// read.
+template <typename T, class Expr>
+struct kernels {
+    cl::Kernel zero;
+    cl::Kernel priv;
+    cl::Kernel shared;
+    cl::Kernel global;
+    size_t     wgsize;
+    size_t     lmem;
+
+    static std::string source(const std::string &binning, const Expr &expr) {
+        std::ostringstream src, val;
+
+        vector_expr_context ctx(val);
+        boost::proto::eval(expr, ctx);
+
+        std::ostringstream prm;
+        extract_terminals()( expr, declare_expression_parameter(prm) );
+
+        src << standard_kernel_header <<
+            "typedef " << type_name<T>() << " real;\n"
+            "typedef " << type_name<size_t>() << " idx_t;\n"
+            << binning;
+
+        extract_user_functions()( expr, declare_user_function(src) );
+
+        src <<
+            "kernel void hist_zero(uint bins, global uint *h) {\n"
+            "    for(size_t b = get_global_id(0); b < bins; b += get_global_size(0))\n"
+            "        h[b] = 0;\n"
+            "}\n"
+            "kernel void hist_private(\n"
+            "    idx_t n, uint bins" << prm.str() << ",\n"
+            "    global uint *h,\n"
+            "    local uint *cnt\n"
+            "    )\n"
+            "{\n"
+            "    size_t lid = get_local_id(0), wg = get_local_size(0);\n"
+            "    for(uint b = 0; b < bins; b++) cnt[b * wg + lid] = 0;\n"
+            "    for(idx_t idx = get_global_id(0); idx < n; idx += get_global_size(0)) {\n"
+            "        uint b = bin_index(" << val.str() << ");\n"
+            "        if (b < bins) cnt[b * wg + lid]++;\n"
+            "    }\n"
+            "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+            "    for(uint b = lid; b < bins; b += wg) {\n"
+            "        uint s = 0;\n"
+            "        for(size_t t = 0; t < wg; t++) s += cnt[b * wg + t];\n"
+            "        if (s) atomic_add(h + b, s);\n"
+            "    }\n"
+            "}\n"
+            "kernel void hist_shared(\n"
+            "    idx_t n, uint bins, uint replicas" << prm.str() << ",\n"
+            "    global uint *h,\n"
+            "    local uint *cnt\n"
+            "    )\n"
+            "{\n"
+            "    size_t lid = get_local_id(0), wg = get_local_size(0);\n"
+            "    for(uint k = lid; k < bins * replicas; k += wg) cnt[k] = 0;\n"
+            "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+            "    local uint *my = cnt + (lid % replicas) * bins;\n"
+            "    for(idx_t idx = get_global_id(0); idx < n; idx += get_global_size(0)) {\n"
+            "        uint b = bin_index(" << val.str() << ");\n"
+            "        if (b < bins) atomic_inc(my + b);\n"
+            "    }\n"
+            "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+            "    for(uint b = lid; b < bins; b += wg) {\n"
+            "        uint s = 0;\n"
+            "        for(uint r = 0; r < replicas; r++) s += cnt[r * bins + b];\n"
+            "        if (s) atomic_add(h + b, s);\n"
+            "    }\n"
+            "}\n"
+            "kernel void hist_global(\n"
+            "    idx_t n, uint bins" << prm.str() << ",\n"
+            "    global uint *h\n"
+            "    )\n"
+            "{\n"
+            "    for(idx_t idx = get_global_id(0); idx < n; idx += get_global_size(0)) {\n"
+            "        uint b = bin_index(" << val.str() << ");\n"
+            "        if (b < bins) atomic_inc(h + b);\n"
+            "    }\n"
+            "}\n";
+
+        return src.str();
+    }
+
+    static std::shared_ptr<kernels> get(const cl::CommandQueue &queue,
+            const std::string &binning, const Expr &expr)
+    {
+        std::shared_ptr<kernels> k = kernel_cache<>::find<kernels>(queue, binning);
+        if (k) return k;
+
+        cl::Context context = qctx(queue);
+        cl::Device  device  = qdev(queue);
+
+        auto program = build_sources(context, source(binning, expr));
+
+        kernels e;
+        e.zero   = cl::Kernel(program, "hist_zero");
+        e.priv   = cl::Kernel(program, "hist_private");
+        e.shared = cl::Kernel(program, "hist_shared");
+        e.global = cl::Kernel(program, "hist_global");
+
+        e.wgsize = std::min<size_t>(256, std::min(
+                    kernel_workgroup_size(e.priv, device),
+                    kernel_workgroup_size(e.shared, device)));
+
+        // Leave room for the compiler's own use of local memory.
+        e.lmem = static_cast<size_t>(device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>()) / 2;
+
+        return kernel_cache<>::insert(queue, e, binning);
+    }
+};
+
+// Uniform bins over [lo, hi). The constants are baked into the source, so
+// that the binning costs one subtraction and one multiplication.
+template <typename T>
+std::string uniform_binning(size_t bins, T lo, T hi) {
+    if (!(hi > lo))
+        throw std::invalid_argument("histogram: empty range");
+
+    typedef typename std::conditional<
+        std::is_same<T, cl_double>::value, cl_double, cl_float>::type float_t;
+
+    std::ostringstream src;
+    src << std::scientific << std::setprecision(std::numeric_limits<double>::digits10 + 2);
+
+    double scale = static_cast<double>(bins) / (static_cast<double>(hi) - static_cast<double>(lo));
+
+    src << "uint bin_index(real prm1) {\n"
+           "    " << type_name<float_t>() << " t = ((" << type_name<float_t>() << ")prm1 - "
+        << static_cast<double>(lo) << ") * " << scale << ";\n"
+           "    return t >= 0 && t < " << bins << " ? (uint)t : " << bins << ";\n"
+           "}\n";
+
+    return src.str();
+}
+
+} // namespace hist
+
+/// \endcond
+
+/// Histogram of device vectors and vector expressions.
+/**
+ * The number of bins is set at construction and may be as large as 64K.
+ * Values are mapped to bins either uniformly over a range, or by a user
+ * function returning the bin number; values outside of the range (or bin
+ * numbers not less than the number of bins) are not counted:
+ * \code
+ * vex::histogram<float> h(ctx, 100, 0.0f, 1.0f);
+ * std::vector<cl_uint> counts = h(x);
+ *
+ * // The expression is evaluated inside the binning kernel.
+ * counts = h(sqrt(x * x + y * y));
+ *
+ * VEX_FUNCTION_TYPE(parity_t, cl_uint(int), "return prm1 & 1;");
+ * vex::histogram<int> p(ctx, 2, parity_t());
+ * \endcode
+ * Sub-histograms are kept in local memory in the form that suits the number
+ * of bins: private per-thread counters for a few bins, replicated group
+ * histograms with local atomics for moderate counts, and a single group
+ * histogram up to the size of local memory. Larger histograms are updated
+ * with global atomics. Each device fills its own histogram, and the results
+ * are summed on the host.
+ */
+template <typename T>
+class histogram {
+    public:
+        /// Strategy used for privatisation of bins.
+        enum strategy {
+            per_thread, ///< Private counters of each work-item.
+            replicated, ///< Several copies of the group histogram.
+            per_group,  ///< Single group histogram.
+            global      ///< Global atomics only.
+        };
+
+        /// Uniform bins over [lo, hi).
+        histogram(const std::vector<cl::CommandQueue> &queue,
+                size_t bins, T lo, T hi)
+            : queue(queue), bins(bins), binning(hist::uniform_binning(bins, lo, hi))
+        {
+            init();
+        }
+
+        /// Bins given by a user function with signature cl_uint(T).
+        template <class BinFun>
+        histogram(const std::vector<cl::CommandQueue> &queue,
+                size_t bins, const BinFun&)
+            : queue(queue), bins(bins)
+        {
+            std::ostringstream src;
+            BinFun::define(src, "bin_index");
+            binning = src.str();
+
+            init();
+        }
+
+        /// Number of bins.
+        size_t size() const {
+            return bins;
+        }
+
+        /// Strategy chosen for the given device.
+        strategy method(uint d) const {
+            return choose(krn[d]->wgsize, krn[d]->lmem).first;
+        }
+
+        /// Counts of the vector (or vector expression) elements in each bin.
+        template <class Expr>
+        typename std::enable_if<
+            boost::proto::matches<Expr, vector_expr_grammar>::value,
+            std::vector<cl_uint>
+        >::type
+        operator()(const Expr &x) const {
+            return count(x);
+        }
+
+        /// Counts of the elements in each bin, stored into a device vector.
+        /**
+         * The per-device histograms are summed on the host and written to
+         * h, which is resized to the number of bins when necessary.
+         */
+        template <class Expr>
+        typename std::enable_if<
+            boost::proto::matches<Expr, vector_expr_grammar>::value,
+            void
+        >::type
+        operator()(const Expr &x, vector<cl_uint> &h) const {
+            std::vector<cl_uint> result = count(x);
+
+            if (h.size() != bins) h.resize(queue, bins);
+            vex::copy(result, h);
+        }
+    private:
+        typedef hist::kernels< T, vector<T> > kernels_t;
+
+        const std::vector<cl::CommandQueue> &queue;
+        size_t      bins;
+        std::string binning;
+
+        std::vector< std::shared_ptr<kernels_t> > krn;
+        std::vector<cl::Buffer> hbuf;
+
+        mutable std::vector< std::vector<cl_uint> > part;
+        mutable std::vector<cl::Event> event;
+
+        void init() {
+            if (bins == 0 || bins > 65536)
+                throw std::invalid_argument("histogram: number of bins should be in [1, 65536]");
+
+            for(auto q = queue.begin(); q != queue.end(); q++) {
+                krn.push_back(kernels_t::get(*q, binning, vector<T>()));
+                hbuf.push_back(memory_pool<>::create("histogram",
+                        qctx(*q), CL_MEM_READ_WRITE, bins * sizeof(cl_uint)));
+            }
+
+            part.resize(queue.size(), std::vector<cl_uint>(bins));
+            event.resize(queue.size());
+        }
+
+        template <class Expr>
+        std::vector<cl_uint> count(const Expr &x) const {
+            get_expression_properties prop;
+            extract_terminals()(x, prop);
+
+            if (!prop.queue)
+                throw std::invalid_argument("histogram: expression has no vector terminals");
+
+            if (prop.queue->size() != queue.size())
+                throw std::invalid_argument("histogram: expression and histogram use different queues");
+
+            std::vector<cl_uint> result(bins, 0);
+
+            for(uint d = 0; d < queue.size(); d++) {
+                size_t n = prop.part_size(d);
+                if (!n) continue;
+
+                const hist::kernels<T, Expr> &k =
+                    *hist::kernels<T, Expr>::get(queue[d], binning, x);
+
+                cl::Device device = qdev(queue[d]);
+
+                size_t wg = k.wgsize;
+                size_t g_size = device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU ?
+                    device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * wg :
+                    device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * wg * 4;
+
+                cl_uint nb = static_cast<cl_uint>(bins);
+
+                k.zero.setArg(0, nb);
+                k.zero.setArg(1, hbuf[d]);
+                queue[d].enqueueNDRangeKernel(k.zero, cl::NullRange,
+                        alignup(bins, wg), wg, 0, event_trace<>::kernel(queue[d], k.zero));
+
+                std::pair<strategy, cl_uint> s = choose(k.wgsize, k.lmem);
+
+                cl::Kernel run;
+                uint pos = 0;
+
+                switch(s.first) {
+                    case per_thread:
+                        run = k.priv;
+                        run.setArg(pos++, n);
+                        run.setArg(pos++, nb);
+                        extract_terminals()(x, set_expression_argument(run, d, pos, prop.part_start(d)));
+                        run.setArg(pos++, hbuf[d]);
+                        run.setArg(pos++, cl::Local(bins * wg * sizeof(cl_uint)));
+                        break;
+                    case replicated:
+                    case per_group:
+                        run = k.shared;
+                        run.setArg(pos++, n);
+                        run.setArg(pos++, nb);
+                        run.setArg(pos++, s.second);
+                        extract_terminals()(x, set_expression_argument(run, d, pos, prop.part_start(d)));
+                        run.setArg(pos++, hbuf[d]);
+                        run.setArg(pos++, cl::Local(bins * s.second * sizeof(cl_uint)));
+                        break;
+                    case global:
+                        run = k.global;
+                        run.setArg(pos++, n);
+                        run.setArg(pos++, nb);
+                        extract_terminals()(x, set_expression_argument(run, d, pos, prop.part_start(d)));
+                        run.setArg(pos++, hbuf[d]);
+                        break;
+                }
+
+                queue[d].enqueueNDRangeKernel(run, cl::NullRange, g_size, wg,
+                        0, event_trace<>::kernel(queue[d], run, n * sizeof(T)));
+
+                queue[d].enqueueReadBuffer(hbuf[d], CL_FALSE, 0,
+                        bins * sizeof(cl_uint), &part[d][0], 0, &event[d]);
+            }
+
+            for(uint d = 0; d < queue.size(); d++) {
+                if (!prop.part_size(d)) continue;
+
+                event[d].wait();
+                for(size_t b = 0; b < bins; b++) result[b] += part[d][b];
+            }
+
+            return result;
+        }
+
+        // Strategy and number of replicas.
+        std::pair<strategy, cl_uint> choose(size_t wg, size_t lmem) const {
+            size_t row = bins * sizeof(cl_uint);
+
+            if (row * wg <= lmem)
+                return std::make_pair(per_thread, static_cast<cl_uint>(wg));
+
+            // One replica per group of 32 work-items at most.
+            size_t r = std::min(lmem / row, std::max<size_t>(wg / 32, 1));
+
+            if (r > 1) return std::make_pair(replicated, static_cast<cl_uint>(r));
+            if (r == 1) return std::make_pair(per_group, 1u);
+
+            return std::make_pair(global, 0u);
+        }
+};
+
+/// Histogram of a vector expression with uniform bins over [lo, hi).
+/**
+ * A shorthand for a one-off vex::histogram on the queues of the expression:
+ * \code
+ * std::vector<cl_uint> h = vex::histogram_of(x - y, 64, -1.0, 1.0);
+ * \endcode
+ */
+template <typename T, class Expr>
+typename std::enable_if<
+    boost::proto::matches<Expr, vector_expr_grammar>::value,
+    std::vector<cl_uint>
+>::type
+histogram_of(const Expr &x, size_t bins, T lo, T hi) {
+    get_expression_properties prop;
+    extract_terminals()(x, prop);
+
+    if (!prop.queue)
+        throw std::invalid_argument("histogram: expression has no vector terminals");
+
+    return histogram<T>(*prop.queue, bins, lo, hi)(x);
+}
+
+} // namespace vex
+
+#ifdef WIN32
+#  pragma warning(pop)
+#endif
+
+// vim: et
+#endif
@@ -0,0 +1,313 @@
+#ifndef VEXCL_KERNEL_CACHE_HPP
+#define VEXCL_KERNEL_CACHE_HPP
+
+/*
+The MIT License
+
+Copyright (c) 2012-2013 Denis Demidov <ddemidov@ksu.ru>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/**
+ * \file   vexcl/kernel_cache.hpp
+ * \author Denis Demidov <ddemidov@ksu.ru>
+ * \brief  Thread-safe registry of compiled kernels.
+ */
+
+#ifdef WIN32
+#  pragma warning(push)
+#  pragma warning(disable : 4267 4290)
+#  define NOMINMAX
+#endif
+
+#include <map>
+#include <string>
+#include <memory>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/future.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <vexcl/util.hpp>
+
+namespace vex {
+
+/// \cond INTERNAL
+
+/// Unique address for each cache entry type.
+template <class Entry>
+struct kernel_cache_tag {
+    static const char id;
+};
+
+template <class Entry>
+const char kernel_cache_tag<Entry>::id = 0;
+
+/// \endcond
+
+/// Registry of compiled kernels shared by all VexCL objects.
+/**
+ * Entries are keyed by OpenCL context, device, entry type and an optional
+ * signature string (used by objects whose kernels are not uniquely defined by
+ * their type, e.g. generator::Kernel). Entry is any user-defined structure
+ * holding cl::Kernel objects and associated data (work-group size, local
+ * memory requirements, etc).
+ *
+ * Lookups take a shared lock and may proceed concurrently; only insertion and
+ * eviction are exclusive. Entries are returned by shared_ptr, so an entry
+ * evicted from the cache stays valid while it is in use.
+ *
+ * Entries may also be compiled in the background (see build_async()). A
+ * lookup of an entry which is still being compiled waits for the build to
+ * finish instead of starting another one.
+ *
+ * \note Kernel arguments are part of cl::Kernel state. Host threads that
+ * launch the same kernel on the same device concurrently should serialize the
+ * setArg()/enqueueNDRangeKernel() sequence.
+ */
+template <bool dummy = true>
+class kernel_cache {
+    static_assert(dummy, "dummy parameter should be true");
+
+    public:
+        /// Find entry for the given queue. Returns empty pointer on miss.
+        template <class Entry>
+        static std::shared_ptr<Entry> find(
+                const cl::CommandQueue &queue, const std::string &sig = ""
+                )
+        {
+            key_type key = make_key<Entry>(queue, sig);
+
+            boost::shared_future< std::shared_ptr<void> > building;
+
+            {
+                boost::shared_lock<boost::shared_mutex> lock(mx);
+
+                auto e = cache.find(key);
+                if (e != cache.end())
+                    return std::static_pointer_cast<Entry>(e->second);
+
+                auto p = pending.find(key);
+                if (p == pending.end())
+                    return std::shared_ptr<Entry>();
+
+                building = p->second;
+            }
+
+            return std::static_pointer_cast<Entry>(building.get());
+        }
+
+        /// Compile kernel from source and insert new entry into the cache.
+        /**
+         * Entry should be constructible from (const cl::Kernel&, const cl::Device&).
+         */
+        template <class Entry>
+        static std::shared_ptr<Entry> build(
+                const cl::CommandQueue &queue,
+                const std::string &source, const std::string &name,
+                const std::string &options = "", const std::string &sig = ""
+                )
+        {
+            cl::Context context = qctx(queue);
+            cl::Device  device  = qdev(queue);
+
+            auto program = build_sources(context, source, options);
+
+            return insert(queue, Entry(cl::Kernel(program, name.c_str()), device), sig);
+        }
+
+        /// Compile kernel in a background thread.
+        /**
+         * Returns immediately. The entry becomes available to find() when the
+         * build completes; find() calls made in the meantime block until then.
+         * Does nothing if the entry is already cached or being compiled.
+         */
+        template <class Entry>
+        static void build_async(
+                const cl::CommandQueue &queue,
+                const std::string &source, const std::string &name,
+                const std::string &options = "", const std::string &sig = ""
+                )
+        {
+            key_type key = make_key<Entry>(queue, sig);
+
+            std::shared_ptr< boost::promise< std::shared_ptr<void> > > promise =
+                std::make_shared< boost::promise< std::shared_ptr<void> > >();
+
+            {
+                boost::unique_lock<boost::shared_mutex> lock(mx);
+
+                if (cache.count(key) || pending.count(key)) return;
+
+                pending.insert(std::make_pair(key,
+                            boost::shared_future< std::shared_ptr<void> >(
+                                promise->get_future())));
+            }
+
+            boost::thread(async_builder<Entry>(
+                        queue, source, name, options, sig, key, promise)
+                    ).detach();
+        }
+
+        /// Insert entry for the given queue.
+        /**
+         * If another thread managed to insert the same entry first, its
+         * copy is kept and returned.
+         */
+        template <class Entry>
+        static std::shared_ptr<Entry> insert(
+                const cl::CommandQueue &queue, const Entry &entry,
+                const std::string &sig = ""
+                )
+        {
+            key_type key = make_key<Entry>(queue, sig);
+            std::shared_ptr<void> ptr = std::make_shared<Entry>(entry);
+
+            boost::unique_lock<boost::shared_mutex> lock(mx);
+
+            auto e = cache.insert(std::make_pair(key, ptr)).first;
+
+            return std::static_pointer_cast<Entry>(e->second);
+        }
+
+        /// Evict all entries associated with the given context.
+        static void purge(cl_context context) {
+            boost::unique_lock<boost::shared_mutex> lock(mx);
+
+            auto b = cache.lower_bound(key_type(context, 0, 0, ""));
+            auto e = b;
+
+            while(e != cache.end() && e->first.context == context) ++e;
+
+            cache.erase(b, e);
+        }
+
+        /// Evict all entries.
+        static void clear() {
+            boost::unique_lock<boost::shared_mutex> lock(mx);
+            cache.clear();
+        }
+
+        /// Number of background builds still in progress.
+        static size_t building() {
+            boost::shared_lock<boost::shared_mutex> lock(mx);
+            return pending.size();
+        }
+    private:
+        struct key_type {
+            cl_context   context;
+            cl_device_id device;
+            const void  *tag;
+            std::string  sig;
+
+            key_type(cl_context c, cl_device_id d, const void *t, const std::string &s)
+                : context(c), device(d), tag(t), sig(s) {}
+
+            bool operator<(const key_type &k) const {
+                if (context != k.context) return context < k.context;
+                if (device  != k.device)  return device  < k.device;
+                if (tag     != k.tag)     return tag     < k.tag;
+                return sig < k.sig;
+            }
+        };
+
+        template <class Entry>
+        static key_type make_key(const cl::CommandQueue &queue, const std::string &sig) {
+            cl_context   context;
+            cl_device_id device;
+
+            queue.getInfo(CL_QUEUE_CONTEXT, &context);
+            queue.getInfo(CL_QUEUE_DEVICE,  &device);
+
+            return key_type(context, device, &kernel_cache_tag<Entry>::id, sig);
+        }
+
+        template <class Entry>
+        struct async_builder {
+            cl::CommandQueue queue;
+            std::string source, name, options, sig;
+            key_type key;
+            std::shared_ptr< boost::promise< std::shared_ptr<void> > > promise;
+
+            async_builder(
+                    const cl::CommandQueue &queue,
+                    const std::string &source, const std::string &name,
+                    const std::string &options, const std::string &sig,
+                    const key_type &key,
+                    const std::shared_ptr< boost::promise< std::shared_ptr<void> > > &promise
+                    )
+                : queue(queue), source(source), name(name), options(options),
+                  sig(sig), key(key), promise(promise)
+            {}
+
+            void operator()() {
+                try {
+                    std::shared_ptr<void> entry =
+                        build<Entry>(queue, source, name, options, sig);
+
+                    promise->set_value(entry);
+                } catch(const cl::Error &e) {
+                    // Compilation error is rethrown from find().
+                    promise->set_exception(boost::copy_exception(e));
+                } catch(...) {
+                    promise->set_exception(boost::current_exception());
+                }
+
+                boost::unique_lock<boost::shared_mutex> lock(mx);
+                pending.erase(key);
+            }
+        };
+
+        static boost::shared_mutex mx;
+        static std::map< key_type, std::shared_ptr<void> > cache;
+        static std::map< key_type, boost::shared_future< std::shared_ptr<void> > > pending;
+};
+
+template <bool dummy>
+boost::shared_mutex kernel_cache<dummy>::mx;
+
+template <bool dummy>
+std::map<
+    typename kernel_cache<dummy>::key_type, std::shared_ptr<void>
+    > kernel_cache<dummy>::cache;
+
+template <bool dummy>
+std::map<
+    typename kernel_cache<dummy>::key_type,
+    boost::shared_future< std::shared_ptr<void> >
+    > kernel_cache<dummy>::pending;
+
+/// Release all kernels compiled for the given context.
+/**
+ * vex::Context calls this automatically when its last copy is destroyed.
+ * Call it manually before releasing contexts that were not created through
+ * vex::Context.
+ */
+inline void purge_kernel_caches(const cl::Context &context) {
+    kernel_cache<>::purge(context());
+}
+
+} // namespace vex
+
+#ifdef WIN32
+#  pragma warning(pop)
+#endif
+
+// vim: et
+#endif
@@ -0,0 +1,466 @@
+#ifndef VEXCL_KRYLOV_HPP
+#define VEXCL_KRYLOV_HPP
+
+/*
+The MIT License
+
+Copyright (c) 2012-2013 Denis Demidov <ddemidov@ksu.ru>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+/**
+ * \file   vexcl/krylov.hpp
+ * \author Denis Demidov <ddemidov@ksu.ru>
+ * \brief  Krylov solvers for matrix-free linear operators.
+ */
+
+#ifdef WIN32
+#  pragma warning(push)
+#  pragma warning(disable : 4267 4290)
+#  define NOMINMAX
+#endif
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <vector>
+#include <tuple>
+#include <type_traits>
+#include <CL/cl.hpp>
+#include <vexcl/vector.hpp>
+#include <vexcl/multivector.hpp>
+#include <vexcl/reduce.hpp>
+#include <vexcl/spmat.hpp>
+#include <vexcl/stencil.hpp>
+
+namespace vex {
+
+/// Linear operator adapter used by the Krylov solvers.
+/**
+ * The solvers only need the product y = A x. By default A is a functor
+ * called as A(x, y):
+ * \code
+ * // Normal equations A^T A u = A^T f without forming A^T A.
+ * auto AtA = [&](const vex::vector<double> &x, vex::vector<double> &y) {
+ *     A.mul(x, tmp);
+ *     At.mul(tmp, y);
+ * };
+ * vex::cg(AtA, Atf, u);
+ * \endcode
+ * Sparse and dense matrices (vex::SpMat, vex::dense_matrix, and anything
+ * else derived from matrix_terminal) and stencils (vex::stencil,
+ * vex::StencilOperator) are supported out of the box. Other operator types
+ * may specialize this template.
+ */
+template <class Op, class Enable = void>
+struct linear_operator {
+    template <typename real>
+    static void apply(const Op &A, const vector<real> &x, vector<real> &y) {
+        A(x, y);
+    }
+};
+
+/// \cond INTERNAL
+
+template <class M>
+struct linear_operator<M,
+    typename std::enable_if<std::is_base_of<matrix_terminal, M>::value>::type
+    >
+{
+    template <typename real>
+    static void apply(const M &A, const vector<real> &x, vector<real> &y) {
+        A.mul(x, y);
+    }
+};
+
+template <typename T>
+struct linear_operator< stencil<T> > {
+    static void apply(const stencil<T> &A, const vector<T> &x, vector<T> &y) {
+        A.convolve(x, y);
+    }
+};
+
+template <typename T, uint width, uint center, class Impl>
+struct linear_operator< StencilOperator<T, width, center, Impl> > {
+    static void apply(const StencilOperator<T, width, center, Impl> &A,
+            const vector<T> &x, vector<T> &y)
+    {
+        A.convolve(x, y);
+    }
+};
+
+/// \endcond
+
+/// Parameters of the Krylov solvers.
+struct krylov_params {
+    double tol;     ///< Tolerance relative to the norm of the right-hand side.
+    size_t maxiter; ///< Maximum number of iterations.
+    size_t restart; ///< Size of the Krylov subspace in gmres().
+
+    krylov_params(double tol = 1e-8, size_t maxiter = 1000, size_t restart = 30)
+        : tol(tol), maxiter(maxiter), restart(restart)
+    {}
+};
+
+/// Outcome of a Krylov solve.
+struct krylov_report {
+    size_t iters; ///< Number of iterations (operator applications in gmres()).
+    double resid; ///< Residual norm relative to the norm of the right-hand side.
+};
+
+/// \cond INTERNAL
+
+// Stands for the absent preconditioner; applying it costs nothing.
+struct identity_operator {};
+
+template <class P, typename real>
+const vector<real>& precondition(const P &M, const vector<real> &x, vector<real> &y) {
+    linear_operator<P>::apply(M, x, y);
+    return y;
+}
+
+template <typename real>
+const vector<real>& precondition(const identity_operator&, const vector<real> &x, vector<real>&) {
+    return x;
+}
+
+template <class P>
+struct is_preconditioned
+    : std::integral_constant<bool, !std::is_same<P, identity_operator>::value>
+{};
+
+/// \endcond
+
+/// Preconditioned conjugate gradients for symmetric positive definite operators.
+/**
+ * Solves \f$Au = f\f$; u should contain the initial approximation. P is
+ * applied as P(r, z) to get \f$z \approx A^{-1} r\f$ (see vexcl/precond.hpp),
+ * and has to be symmetric positive definite as well. Each iteration applies
+ * the operator and the preconditioner once; the update of u and r is fused
+ * with the new residual norm.
+ */
+template <class Op, class Precond, typename real>
+krylov_report cg(const Op &A, const Precond &P,
+        const vector<real> &f, vector<real> &u,
+        const krylov_params &prm = krylov_params())
+{
+    const std::vector<cl::CommandQueue> &queue = f.queue_list();
+    const size_t n = f.size();
+    const bool pre = is_preconditioned<Precond>::value;
+
+    Reductor<real, SUM> sum(queue);
+
+    vector<real> r(queue, n);
+    vector<real> p(queue, n);
+    vector<real> q(queue, n);
+    vector<real> s(queue, pre ? n : 0);
+
+    real norm_f = std::sqrt(sum(f * f));
+    if (norm_f == 0) norm_f = 1;
+
+    const real eps = static_cast<real>(prm.tol) * norm_f;
+
+    linear_operator<Op>::apply(A, u, q);
+    r = f - q;
+
+    real res = sum(r * r), rho = 1;
+
+    krylov_report rep = {0, std::sqrt(res) / norm_f};
+
+    for(; rep.iters < prm.maxiter && std::sqrt(res) > eps; rep.iters++) {
+        const vector<real> &z = precondition(P, r, s);
+
+        real rho_old = rho;
+        rho = pre ? sum(r * z) : res;
+
+        if (rep.iters)
+            p = z + (rho / rho_old) * p;
+        else
+            p = z;
+
+        linear_operator<Op>::apply(A, p, q);
+
+        real alpha = rho / sum(p * q);
+
+        res = sum(vex::tie(u, r), std::make_tuple(u + alpha * p, r - alpha * q), r * r);
+    }
+
+    rep.resid = std::sqrt(res) / norm_f;
+    return rep;
+}
+
+/// Conjugate gradients for symmetric positive definite operators.
+/**
+ * Solves \f$Au = f\f$; u should contain the initial approximation. Each
+ * iteration applies the operator once and makes three passes over the
+ * vectors: the dot product \f$(p, Ap)\f$, the update of u and r fused with
+ * the new residual norm, and the update of the search direction.
+ */
+template <class Op, typename real>
+krylov_report cg(const Op &A, const vector<real> &f, vector<real> &u,
+        const krylov_params &prm = krylov_params())
+{
+    return cg(A, identity_operator(), f, u, prm);
+}
+
+/// Right-preconditioned stabilized biconjugate gradients for general operators.
+/**
+ * Solves \f$Au = f\f$; u should contain the initial approximation. Each
+ * iteration applies the operator and the preconditioner twice; pairs of dot
+ * products sharing a vector are computed with vex::MultiReductor in a single
+ * pass, and the intermediate residual is computed together with its norm.
+ */
+template <class Op, class Precond, typename real>
+krylov_report bicgstab(const Op &A, const Precond &P,
+        const vector<real> &f, vector<real> &u,
+        const krylov_params &prm = krylov_params())
+{
+    const std::vector<cl::CommandQueue> &queue = f.queue_list();
+    const size_t n = f.size();
+    const bool pre = is_preconditioned<Precond>::value;
+
+    Reductor<real, SUM> sum(queue);
+    MultiReductor<real, std::tuple<SUM, SUM> > sum2(queue);
+
+    vector<real> r (queue, n);
+    vector<real> r0(queue, n);
+    vector<real> p (queue, n);
+    vector<real> v (queue, n);
+    vector<real> s (queue, n);
+    vector<real> t (queue, n);
+    vector<real> ph(queue, pre ? n : 0);
+    vector<real> sh(queue, pre ? n : 0);
+
+    real norm_f = std::sqrt(sum(f * f));
+    if (norm_f == 0) norm_f = 1;
+
+    const real eps = static_cast<real>(prm.tol) * norm_f;
+
+    linear_operator<Op>::apply(A, u, t);
+    r  = f - t;
+    r0 = r;
+    p  = 0;
+    v  = 0;
+
+    real rho = 1, alpha = 1, omega = 1;
+
+    std::array<real, 2> rr = sum2(std::make_tuple(r0 * r, r * r));
+
+    krylov_report rep = {0, std::sqrt(rr[1]) / norm_f};
+
+    for(; rep.iters < prm.maxiter && std::sqrt(rr[1]) > eps; rep.iters++) {
+        real rho_old = rho;
+        rho = rr[0];
+
+        // Breakdown: r became orthogonal to the shadow residual.
+        if (rho == 0) break;
+
+        real beta = (rho / rho_old) * (alpha / omega);
+
+        p = r + beta * (p - omega * v);
+
+        const vector<real> &pp = precondition(P, p, ph);
+        linear_operator<Op>::apply(A, pp, v);
+
+        alpha = rho / sum(r0 * v);
+
+        real ss = sum(vex::tie(s), std::make_tuple(r - alpha * v), s * s);
+
+        if (std::sqrt(ss) <= eps) {
+            u += alpha * pp;
+            rr[1] = ss;
+            rep.iters++;
+            break;
+        }
+
+        const vector<real> &ps = precondition(P, s, sh);
+        linear_operator<Op>::apply(A, ps, t);
+
+        std::array<real, 2> ts = sum2(std::make_tuple(t * s, t * t));
+        omega = ts[0] / ts[1];
+
+        vex::tie(u, r) = std::make_tuple(u + alpha * pp + omega * ps, s - omega * t);
+
+        rr = sum2(std::make_tuple(r0 * r, r * r));
+    }
+
+    rep.resid = std::sqrt(rr[1]) / norm_f;
+    return rep;
+}
+
+/// Stabilized biconjugate gradients for general operators.
+/**
+ * Solves \f$Au = f\f$; u should contain the initial approximation. Each
+ * iteration applies the operator twice; pairs of dot products sharing a
+ * vector are computed with vex::MultiReductor in a single pass, and the
+ * intermediate residual is computed together with its norm.
+ */
+template <class Op, typename real>
+krylov_report bicgstab(const Op &A, const vector<real> &f, vector<real> &u,
+        const krylov_params &prm = krylov_params())
+{
+    return bicgstab(A, identity_operator(), f, u, prm);
+}
+
+/// Right-preconditioned restarted GMRES for general operators.
+/**
+ * Solves \f$Au = f\f$; u should contain the initial approximation. The
+ * Krylov basis of \f$AP\f$ with prm.restart vectors is orthogonalized with
+ * modified Gram-Schmidt, where each projection is fused with the dot product
+ * for the next basis vector, so that step j of the Arnoldi process makes
+ * j + 2 passes over the vectors besides the operator application.
+ */
+template <class Op, class Precond, typename real>
+krylov_report gmres(const Op &A, const Precond &P,
+        const vector<real> &f, vector<real> &u,
+        const krylov_params &prm = krylov_params())
+{
+    const std::vector<cl::CommandQueue> &queue = f.queue_list();
+    const size_t n = f.size();
+    const size_t m = std::max<size_t>(prm.restart, 1);
+    const bool pre = is_preconditioned<Precond>::value;
+
+    Reductor<real, SUM> sum(queue);
+
+    vector<real> r(queue, n);
+    vector<real> z(queue, pre ? n : 0);
+    std::vector< vector<real> > V(m + 1, vector<real>(queue, n));
+
+    std::vector<real> H((m + 1) * m), g(m + 1), cs(m), sn(m), y(m);
+
+    real norm_f = std::sqrt(sum(f * f));
+    if (norm_f == 0) norm_f = 1;
+
+    const real eps = static_cast<real>(prm.tol) * norm_f;
+
+    krylov_report rep = {0, 0};
+
+    // H is stored column-wise: H(i, j) = H[j * (m + 1) + i].
+#define VEXCL_GMRES_H(i, j) H[(j) * (m + 1) + (i)]
+
+    for(;;) {
+        linear_operator<Op>::apply(A, u, r);
+
+        real beta = std::sqrt(sum(vex::tie(r), std::make_tuple(f - r), r * r));
+        rep.resid = beta / norm_f;
+
+        if (beta <= eps || rep.iters >= prm.maxiter) break;
+
+        V[0] = r / beta;
+
+        std::fill(g.begin(), g.end(), static_cast<real>(0));
+        g[0] = beta;
+
+        size_t k = 0;
+        for(; k < m && rep.iters < prm.maxiter; ) {
+            vector<real> &w = V[k + 1];
+
+            linear_operator<Op>::apply(A, precondition(P, V[k], z), w);
+            rep.iters++;
+
+            VEXCL_GMRES_H(0, k) = sum(w * V[0]);
+            for(size_t i = 0; i < k; i++)
+                VEXCL_GMRES_H(i + 1, k) = sum(vex::tie(w),
+                        std::make_tuple(w - VEXCL_GMRES_H(i, k) * V[i]), w * V[i + 1]);
+
+            real hn = std::sqrt(sum(vex::tie(w),
+                        std::make_tuple(w - VEXCL_GMRES_H(k, k) * V[k]), w * w));
+            VEXCL_GMRES_H(k + 1, k) = hn;
+
+            // Apply previous Givens rotations to the new column.
+            for(size_t i = 0; i < k; i++) {
+                real a = VEXCL_GMRES_H(i,     k);
+                real b = VEXCL_GMRES_H(i + 1, k);
+
+                VEXCL_GMRES_H(i,     k) =  cs[i] * a + sn[i] * b;
+                VEXCL_GMRES_H(i + 1, k) = -sn[i] * a + cs[i] * b;
+            }
+
+            // New rotation eliminating H(k + 1, k).
+            real a = VEXCL_GMRES_H(k, k);
+            real d = std::sqrt(a * a + hn * hn);
+
+            cs[k] = d ? a / d : 1;
+            sn[k] = d ? hn / d : 0;
+
+            VEXCL_GMRES_H(k,     k) = d;
+            VEXCL_GMRES_H(k + 1, k) = 0;
+
+            g[k + 1] = -sn[k] * g[k];
+            g[k]     =  cs[k] * g[k];
+
+            k++;
+
+            rep.resid = std::fabs(g[k]) / norm_f;
+
+            // Happy breakdown or convergence.
+            if (hn == 0 || std::fabs(g[k]) <= eps) break;
+
+            w /= hn;
+        }
+
+        // Solve the triangular system H y = g and update the solution.
+        for(size_t i = k; i-- > 0; ) {
+            real s = g[i];
+            for(size_t j = i + 1; j < k; j++) s -= VEXCL_GMRES_H(i, j) * y[j];
+            y[i] = s / VEXCL_GMRES_H(i, i);
+        }
+
+        if (pre) {
+            r = y[0] * V[0];
+            for(size_t i = 1; i < k; i++)
+                r += y[i] * V[i];
+
+            u += precondition(P, r, z);
+        } else {
+            for(size_t i = 0; i < k; i++)
+                u += y[i] * V[i];
+        }
+    }
+
+#undef VEXCL_GMRES_H
+
+    return rep;
+}
+
+/// Restarted generalized minimal residual method for general operators.
+/**
+ * Solves \f$Au = f\f$; u should contain the initial approximation. The
+ * Krylov basis of prm.restart vectors is orthogonalized with modified
+ * Gram-Schmidt, where each projection is fused with the dot product for
+ * the next basis vector, so that step j of the Arnoldi process makes j + 2
+ * passes over the vectors besides the operator application.
+ */
+template <class Op, typename real>
+krylov_report gmres(const Op &A, const vector<real> &f, vector<real> &u,
+        const krylov_params &prm = krylov_params())
+{
+    return gmres(A, identity_operator(), f, u, prm);
+}
+
+} // namespace vex
+
+#ifdef WIN32
+#  pragma warning(pop)
+#endif
+
+// vim: et
+#endif
@@ -0,0 +1,412 @@
+#ifndef VEXCL_MATHLIB_HPP
+#define VEXCL_MATHLIB_HPP
+
+/*
+The MIT License
+
+Copyright (c) 2012-2013 Denis Demidov <ddemidov@ksu.ru>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/**
+ * \file   vexcl/mathlib.hpp
+ * \author Denis Demidov <ddemidov@ksu.ru>
+ * \brief  Math functions of selectable accuracy and their benchmark.
+ */
+
+#ifdef WIN32
+#  pragma warning(push)
+#  pragma warning(disable : 4267 4290)
+#  define NOMINMAX
+#endif
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <iostream>
+#include <iomanip>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <algorithm>
+#include <boost/chrono.hpp>
+#include <CL/cl.hpp>
+#include <vexcl/util.hpp>
+#include <vexcl/operations.hpp>
+#include <vexcl/vector.hpp>
+
+namespace vex {
+
+/// Single precision minimax polynomial approximations.
+/**
+ * The functions take the largest error in units in the last place (ulp)
+ * the caller accepts, and use the cheapest polynomial within that bound:
+ * \code
+ * y = vex::minimax::sin<32>(x) * vex::minimax::exp<2>(-x);
+ * \endcode
+ * The bounds available are
+ *   - sin, cos: 16384, 32, 2 (for |x| <= 65536; larger arguments go to the
+ *     builtin);
+ *   - exp: 2048, 128, 16, 2;
+ *   - log: 16384, 2048, 256, 32, 8, 2, 1.
+ *
+ * A bound between two of these selects the more accurate polynomial. The
+ * coefficients were fitted with the Remez algorithm for relative error, and
+ * the bounds are the largest errors found on millions of random arguments,
+ * rounded up. Range reduction and polynomials are evaluated with fma(), so
+ * devices without hardware single precision fma should prefer the
+ * native_* and half_* builtins. Infinities, NaNs and arguments out of range
+ * are passed to the builtin functions.
+ */
+namespace minimax {
+
+/// \cond INTERNAL
+
+namespace detail {
+
+// Polynomial c[0] + c[1] t + ... in Horner form with fma().
+inline std::string horner(const float *c, size_t n, const char *t) {
+    std::ostringstream s;
+    s << std::scientific << std::setprecision(9);
+
+    for(size_t i = 1; i < n; i++) s << "fma(";
+    s << c[n - 1] << "f";
+    for(size_t i = n - 1; i-- > 0; )
+        s << ", " << t << ", " << c[i] << "f)";
+
+    return s.str();
+}
+
+// sin(r) = r + r^3 P(r^2) and cos(r) = 1 - r^2 / 2 + r^4 Q(r^2) for
+// |r| <= pi / 4, after reduction by multiples of pi / 2 split into three
+// floats.
+inline std::string sincos_body(bool cosine, unsigned deg) {
+    static const float P[3][3] = {
+        {-1.623431295e-01f},
+        {-1.666325629e-01f, 8.159871213e-03f},
+        {-1.666665375e-01f, 8.332112804e-03f, -1.950874139e-04f}
+    };
+    static const float Q[3][3] = {
+        {4.088383168e-02f},
+        {4.166084155e-02f, -1.364384196e-03f},
+        {4.166664556e-02f, -1.388725126e-03f, 2.442568075e-05f}
+    };
+
+    std::ostringstream s;
+    s <<
+        "    if (!(fabs(prm1) <= 65536.0f)) return " << (cosine ? "cos" : "sin") << "(prm1);\n"
+        "    float k = rint(prm1 * 0.636619772f);\n"
+        "    float r = fma(-k, 1.570796371e+00f, prm1);\n"
+        "    r = fma(-k, -4.371138829e-08f, r);\n"
+        "    r = fma(-k, -1.715099417e-15f, r);\n"
+        "    float t = r * r;\n"
+        "    float s = fma(r * t, " << horner(P[deg - 1], deg, "t") << ", r);\n"
+        "    float c = fma(t * t, " << horner(Q[deg - 1], deg, "t") << ", fma(-0.5f, t, 1.0f));\n"
+        "    int q = convert_int(k)" << (cosine ? " + 1" : "") << ";\n"
+        "    float v = (q & 1) ? c : s;\n"
+        "    return (q & 2) ? -v : v;";
+    return s.str();
+}
+
+// exp(r) = 1 + r + r^2 P(r) for |r| <= ln(2) / 2, after reduction by
+// multiples of ln(2) split into two floats.
+inline std::string exp_body(unsigned deg) {
+    static const float P[4][5] = {
+        {5.040175319e-01f, 1.666251868e-01f},
+        {5.000532269e-01f, 1.675525606e-01f, 4.127013683e-02f},
+        {4.999950230e-01f, 1.666518301e-01f, 4.185605049e-02f, 8.535085246e-03f},
+        {5.000000000e-01f, 1.666653454e-01f, 4.166597128e-02f, 8.367408067e-03f, 1.399127184e-03f}
+    };
+
+    std::ostringstream s;
+    s <<
+        "    if (!(fabs(prm1) < 104.0f)) return exp(prm1);\n"
+        "    float k = rint(prm1 * 1.442695041f);\n"
+        "    float r = fma(-k, 6.931471825e-01f, prm1);\n"
+        "    r = fma(-k, -1.904654212e-09f, r);\n"
+        "    return ldexp(fma(r * r, " << horner(P[deg - 2], deg, "r") << ", r + 1.0f), convert_int(k));";
+    return s.str();
+}
+
+// log(1 + f) = f - f^2 / 2 + f^3 P(f) for sqrt(1/2) <= 1 + f < sqrt(2),
+// where 1 + f is the mantissa of the argument.
+inline std::string log_body(unsigned deg) {
+    static const float P[7][8] = {
+        {3.502780199e-01f, -2.372923642e-01f},
+        {3.356798887e-01f, -2.646432817e-01f, 1.732425839e-01f},
+        {3.328527212e-01f, -2.524566352e-01f, 2.178032398e-01f, -1.459250152e-01f},
+        {3.332079947e-01f, -2.494359314e-01f, 2.044340521e-01f, -1.841100156e-01f,
+         1.178159118e-01f},
+        {3.333425224e-01f, -2.498318553e-01f, 1.992417574e-01f, -1.713841707e-01f,
+         1.602826715e-01f, -1.019162610e-01f},
+        {3.333391547e-01f, -2.500134706e-01f, 1.996288300e-01f, -1.657718867e-01f,
+         1.491649747e-01f, -1.427151412e-01f, 8.700320870e-02f},
+        {3.333333135e-01f, -2.500082552e-01f, 2.000123560e-01f, -1.662314385e-01f,
+         1.420136839e-01f, -1.316200346e-01f, 1.276542842e-01f, -7.634390146e-02f}
+    };
+
+    std::ostringstream s;
+    s <<
+        "    if (!(prm1 > 0.0f) || isinf(prm1)) return log(prm1);\n"
+        "    int e;\n"
+        "    float m = frexp(prm1, &e);\n"
+        "    if (m < 0.707106781f) { m += m; e--; }\n"
+        "    float f = m - 1.0f;\n"
+        "    float z = f * f;\n"
+        "    float y = f * z * " << horner(P[deg - 2], deg, "f") << ";\n"
+        "    y = fma((float)e, -1.904654212e-09f, y);\n"
+        "    y = fma(-0.5f, z, y);\n"
+        "    return fma((float)e, 6.931471825e-01f, f + y);";
+    return s.str();
+}
+
+} // namespace detail
+
+template <unsigned Ulp>
+struct sin_func : UserFunction<sin_func<Ulp>, float(float)> {
+    static_assert(Ulp >= 2, "No minimax sin within this bound; use vex::sin");
+    static std::string body() {
+        return detail::sincos_body(false, Ulp >= 16384 ? 1 : Ulp >= 32 ? 2 : 3);
+    }
+};
+
+template <unsigned Ulp>
+struct cos_func : UserFunction<cos_func<Ulp>, float(float)> {
+    static_assert(Ulp >= 2, "No minimax cos within this bound; use vex::cos");
+    static std::string body() {
+        return detail::sincos_body(true, Ulp >= 16384 ? 1 : Ulp >= 32 ? 2 : 3);
+    }
+};
+
+template <unsigned Ulp>
+struct exp_func : UserFunction<exp_func<Ulp>, float(float)> {
+    static_assert(Ulp >= 2, "No minimax exp within this bound; use vex::exp");
+    static std::string body() {
+        return detail::exp_body(Ulp >= 2048 ? 2 : Ulp >= 128 ? 3 : Ulp >= 16 ? 4 : 5);
+    }
+};
+
+template <unsigned Ulp>
+struct log_func : UserFunction<log_func<Ulp>, float(float)> {
+    static_assert(Ulp >= 1, "No minimax log within this bound; use vex::log");
+    static std::string body() {
+        return detail::log_body(
+                Ulp >= 16384 ? 2 : Ulp >= 2048 ? 3 : Ulp >= 256 ? 4 :
+                Ulp >= 32    ? 5 : Ulp >= 8    ? 6 : Ulp >= 2   ? 7 : 8);
+    }
+};
+
+/// \endcond
+
+#define VEXCL_MINIMAX_FUNCTION(func) \
+template <unsigned Ulp, typename Arg> \
+typename boost::proto::result_of::make_expr< \
+    boost::proto::tag::function, \
+    func##_func<Ulp>, \
+    const Arg& \
+>::type const \
+func(const Arg &arg) { \
+    return boost::proto::make_expr<boost::proto::tag::function>( \
+            func##_func<Ulp>(), \
+            boost::ref(arg) \
+            ); \
+}
+
+VEXCL_MINIMAX_FUNCTION(sin)
+VEXCL_MINIMAX_FUNCTION(cos)
+VEXCL_MINIMAX_FUNCTION(exp)
+VEXCL_MINIMAX_FUNCTION(log)
+
+#undef VEXCL_MINIMAX_FUNCTION
+
+} // namespace minimax
+
+/// Accuracy and throughput of an implementation of a math function.
+struct math_benchmark_entry {
+    std::string function;       ///< sin, cos, exp or log.
+    std::string implementation; ///< builtin, native, half or minimax<ulp>.
+    double      max_ulp;        ///< Largest error found, in ulp of the result.
+    double      ns_per_element; ///< Time of y = f(x), per element.
+};
+
+/// Benchmark of the float math functions on a device.
+struct math_benchmark_table {
+    std::string device;
+    std::vector<math_benchmark_entry> rows;
+};
+
+/// \cond INTERNAL
+
+namespace mathlib {
+
+// Error of v in units in the last place of the correctly rounded result.
+inline double ulp_error(float v, long double ref) {
+    float r = static_cast<float>(ref);
+
+    if (std::isnan(r) || std::isinf(r))
+        return (v == r || (std::isnan(v) && std::isnan(r))) ? 0 : std::numeric_limits<double>::infinity();
+
+    long double u = static_cast<long double>(
+            std::nextafter(std::fabs(r), std::numeric_limits<float>::infinity())) - std::fabs(r);
+
+    return static_cast<double>(std::fabs(static_cast<long double>(v) - ref) / u);
+}
+
+template <class Expr, class Ref>
+void measure(math_benchmark_table &table,
+        const char *function, const std::string &implementation,
+        const std::vector<float> &hx, vector<float> &y, const Expr &expr, Ref ref)
+{
+    typedef boost::chrono::high_resolution_clock clock;
+
+    const int repeat = 8;
+    const cl::CommandQueue &queue = y.queue_list()[0];
+
+    // Warm up: compiles the kernel on the first pass.
+    y = expr;
+    queue.finish();
+
+    clock::time_point start = clock::now();
+    for(int i = 0; i < repeat; i++) y = expr;
+    queue.finish();
+    double time = boost::chrono::duration<double>(clock::now() - start).count();
+
+    std::vector<float> hy(hx.size());
+    copy(y, hy);
+
+    math_benchmark_entry e;
+    e.function       = function;
+    e.implementation = implementation;
+    e.max_ulp        = 0;
+    e.ns_per_element = 1e9 * time / repeat / hx.size();
+
+    for(size_t i = 0; i < hx.size(); i++)
+        e.max_ulp = std::max(e.max_ulp, ulp_error(hy[i], ref(static_cast<long double>(hx[i]))));
+
+    table.rows.push_back(e);
+}
+
+inline long double ref_sin(long double x) { return std::sin(x); }
+inline long double ref_cos(long double x) { return std::cos(x); }
+inline long double ref_exp(long double x) { return std::exp(x); }
+inline long double ref_log(long double x) { return std::log(x); }
+
+} // namespace mathlib
+
+/// \endcond
+
+/// Measures float sin, cos, exp and log of every accuracy tier on a device.
+/**
+ * Each implementation (the builtin, native_*, half_* and minimax polynomials
+ * of every bound) is timed on n elements, and its results are compared with
+ * long double host results. Arguments are random: |x| <= 100 for sin and
+ * cos, |x| <= 80 for exp, and 2^-60 <= x <= 2^60 for log.
+ * \code
+ * std::cout << vex::math_benchmark(ctx.queue(0)) << std::endl;
+ * \endcode
+ */
+inline math_benchmark_table math_benchmark(const cl::CommandQueue &queue, size_t n = 1 << 22) {
+    using namespace mathlib;
+
+    math_benchmark_table table;
+    table.device = qdev(queue).getInfo<CL_DEVICE_NAME>();
+
+    std::vector<cl::CommandQueue> q(1, queue);
+    vex::vector<float> x(q, n), y(q, n);
+    std::vector<float> hx(n);
+
+    std::mt19937 gen(42);
+
+    {
+        std::uniform_real_distribution<float> rnd(-100.0f, 100.0f);
+        for(size_t i = 0; i < n; i++) hx[i] = rnd(gen);
+        copy(hx, x);
+
+        measure(table, "sin", "builtin",           hx, y, vex::sin(x),               ref_sin);
+        measure(table, "sin", "native",            hx, y, vex::native_sin(x),        ref_sin);
+        measure(table, "sin", "half",              hx, y, vex::half_sin(x),          ref_sin);
+        measure(table, "sin", "minimax<16384>",    hx, y, minimax::sin<16384>(x),    ref_sin);
+        measure(table, "sin", "minimax<32>",       hx, y, minimax::sin<32>(x),       ref_sin);
+        measure(table, "sin", "minimax<2>",        hx, y, minimax::sin<2>(x),        ref_sin);
+
+        measure(table, "cos", "builtin",           hx, y, vex::cos(x),               ref_cos);
+        measure(table, "cos", "native",            hx, y, vex::native_cos(x),        ref_cos);
+        measure(table, "cos", "half",              hx, y, vex::half_cos(x),          ref_cos);
+        measure(table, "cos", "minimax<16384>",    hx, y, minimax::cos<16384>(x),    ref_cos);
+        measure(table, "cos", "minimax<32>",       hx, y, minimax::cos<32>(x),       ref_cos);
+        measure(table, "cos", "minimax<2>",        hx, y, minimax::cos<2>(x),        ref_cos);
+    }
+
+    {
+        std::uniform_real_distribution<float> rnd(-80.0f, 80.0f);
+        for(size_t i = 0; i < n; i++) hx[i] = rnd(gen);
+        copy(hx, x);
+
+        measure(table, "exp", "builtin",           hx, y, vex::exp(x),               ref_exp);
+        measure(table, "exp", "native",            hx, y, vex::native_exp(x),        ref_exp);
+        measure(table, "exp", "half",              hx, y, vex::half_exp(x),          ref_exp);
+        measure(table, "exp", "minimax<2048>",     hx, y, minimax::exp<2048>(x),     ref_exp);
+        measure(table, "exp", "minimax<128>",      hx, y, minimax::exp<128>(x),      ref_exp);
+        measure(table, "exp", "minimax<16>",       hx, y, minimax::exp<16>(x),       ref_exp);
+        measure(table, "exp", "minimax<2>",        hx, y, minimax::exp<2>(x),        ref_exp);
+    }
+
+    {
+        std::uniform_real_distribution<float> rnd(-60.0f, 60.0f);
+        for(size_t i = 0; i < n; i++) hx[i] = std::exp2(rnd(gen));
+        copy(hx, x);
+
+        measure(table, "log", "builtin",           hx, y, vex::log(x),               ref_log);
+        measure(table, "log", "native",            hx, y, vex::native_log(x),        ref_log);
+        measure(table, "log", "half",              hx, y, vex::half_log(x),          ref_log);
+        measure(table, "log", "minimax<16384>",    hx, y, minimax::log<16384>(x),    ref_log);
+        measure(table, "log", "minimax<2048>",     hx, y, minimax::log<2048>(x),     ref_log);
+        measure(table, "log", "minimax<256>",      hx, y, minimax::log<256>(x),      ref_log);
+        measure(table, "log", "minimax<32>",       hx, y, minimax::log<32>(x),       ref_log);
+        measure(table, "log", "minimax<8>",        hx, y, minimax::log<8>(x),        ref_log);
+        measure(table, "log", "minimax<2>",        hx, y, minimax::log<2>(x),        ref_log);
+        measure(table, "log", "minimax<1>",        hx, y, minimax::log<1>(x),        ref_log);
+    }
+
+    return table;
+}
+
+/// Prints the benchmark as a table.
+inline std::ostream& operator<<(std::ostream &os, const math_benchmark_table &table) {
+    os << table.device << "\n"
+       << std::left << std::setw(10) << "function" << std::setw(18) << "implementation"
+       << std::right << std::setw(14) << "max ulp" << std::setw(14) << "ns/element" << "\n";
+
+    for(auto r = table.rows.begin(); r != table.rows.end(); r++)
+        os << std::left << std::setw(10) << r->function << std::setw(18) << r->implementation
+           << std::right << std::fixed << std::setprecision(2)
+           << std::setw(14) << r->max_ulp << std::setw(14) << r->ns_per_element << "\n";
+
+    return os;
+}
+
+} // namespace vex
+
+#ifdef WIN32
+#  pragma warning(pop)
+#endif
+
+// vim: et
+#endif
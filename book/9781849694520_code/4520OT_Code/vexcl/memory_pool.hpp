@@ -0,0 +1,269 @@
+#ifndef VEXCL_MEMORY_POOL_HPP
+#define VEXCL_MEMORY_POOL_HPP
+
+/*
+The MIT License
+
+Copyright (c) 2012-2013 Denis Demidov <ddemidov@ksu.ru>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/**
+ * \file   vexcl/memory_pool.hpp
+ * \author Denis Demidov <ddemidov@ksu.ru>
+ * \brief  Pool of reusable device buffers.
+ */
+
+#ifdef WIN32
+#  pragma warning(push)
+#  pragma warning(disable : 4267 4290)
+#  define NOMINMAX
+#endif
+
+#include <map>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <stdexcept>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <CL/cl.hpp>
+#include <vexcl/accounting.hpp>
+
+namespace vex {
+
+/// Pool of device buffers shared by all vex::vectors.
+/**
+ * Buffers released by destroyed vectors are kept in the pool and handed out
+ * again to new vectors of similar size in the same context, which saves the
+ * clCreateBuffer/clReleaseMemObject pair for short-lived temporaries.
+ * Requested sizes are rounded up to size classes (four classes per power of
+ * two), so at most 25% of memory is wasted on rounding.
+ *
+ * Only buffers without host pointer flags are pooled, and a buffer is not
+ * returned to the pool while other cl::Buffer copies of it are alive. The
+ * pool is disabled by defining VEXCL_NO_MEMORY_POOL before including VexCL
+ * headers. Cached buffers are released by trim(), by vex::Context
+ * destructor, or automatically when an allocation fails.
+ *
+ * \note A pooled buffer may be reused as soon as its vector is destroyed.
+ * Commands that were enqueued for the old vector on a different queue than
+ * the one used by the new owner are not ordered with respect to the new
+ * owner's commands.
+ */
+template <bool dummy = true>
+class memory_pool {
+    static_assert(dummy, "dummy parameter should be true");
+
+    public:
+        /// Pool usage statistics.
+        struct statistics {
+            size_t hits;       ///< Allocations served from the pool.
+            size_t misses;     ///< Allocations that created new buffers.
+            size_t in_use;     ///< Bytes currently held by vectors.
+            size_t cached;     ///< Bytes currently cached in the pool.
+            size_t high_water; ///< Maximum of in_use + cached.
+
+            statistics() : hits(0), misses(0), in_use(0), cached(0), high_water(0) {}
+        };
+
+        /// Get buffer of at least the given size.
+        static cl::Buffer allocate(
+                const cl::Context &context, cl_mem_flags flags, size_t bytes)
+        {
+            key_type key(context(), flags, size_class(bytes));
+
+            {
+                boost::lock_guard<boost::mutex> lock(mx);
+
+                auto f = idle.find(key);
+                if (f != idle.end() && !f->second.empty()) {
+                    cl::Buffer buf = f->second.back();
+                    f->second.pop_back();
+
+                    used.insert(std::make_pair(buf(), key));
+
+                    stat.hits++;
+                    stat.cached -= key.size;
+                    stat.in_use += key.size;
+
+                    return buf;
+                }
+            }
+
+            cl::Buffer buf = create("pool", context, flags, key.size);
+
+            boost::lock_guard<boost::mutex> lock(mx);
+
+            used.insert(std::make_pair(buf(), key));
+
+            stat.misses++;
+            stat.in_use += key.size;
+            stat.high_water = std::max(stat.high_water, stat.in_use + stat.cached);
+
+            return buf;
+        }
+
+        /// Create buffer outside of the pool.
+        /**
+         * The buffer is accounted under the tag (see memory_account). When
+         * the allocation would exceed the memory budget of the context, or
+         * the driver fails it, the cached buffers of the context are
+         * released first; if the budget is still exceeded, std::runtime_error
+         * is thrown. All VexCL allocations go through here.
+         */
+        static cl::Buffer create(const std::string &tag,
+                const cl::Context &context, cl_mem_flags flags, size_t bytes,
+                void *host = 0)
+        {
+            if (!memory_account<>::fits(context(), bytes)) {
+                trim(context());
+
+                if (!memory_account<>::fits(context(), bytes)) {
+                    memory_account<>::refuse(context(), tag);
+                    throw std::runtime_error(
+                            "VexCL: allocation for " + tag + " exceeds the memory budget");
+                }
+            }
+
+            cl::Buffer buf;
+
+            try {
+                buf = cl::Buffer(context, flags, bytes, host);
+            } catch(const cl::Error&) {
+                // Give the cached memory back to the driver and try again.
+                trim(context());
+                buf = cl::Buffer(context, flags, bytes, host);
+            }
+
+            memory_account<>::track(buf, tag);
+
+            return buf;
+        }
+
+        /// Return buffer to the pool.
+        /**
+         * Buffers that were not allocated by the pool are ignored.
+         */
+        static void release(const cl::Buffer &buf) {
+            if (!buf()) return;
+
+            boost::lock_guard<boost::mutex> lock(mx);
+
+            auto u = used.find(buf());
+            if (u == used.end()) return;
+
+            key_type key = u->second;
+            used.erase(u);
+
+            stat.in_use -= key.size;
+
+            // Somebody else still holds the buffer, so it may not be reused.
+            if (buf.getInfo<CL_MEM_REFERENCE_COUNT>() > 1) return;
+
+            idle[key].push_back(buf);
+
+            stat.cached += key.size;
+        }
+
+        /// Release all cached buffers.
+        static void trim() {
+            boost::lock_guard<boost::mutex> lock(mx);
+
+            idle.clear();
+            stat.cached = 0;
+        }
+
+        /// Release cached buffers of the given context.
+        static void trim(cl_context context) {
+            boost::lock_guard<boost::mutex> lock(mx);
+
+            auto b = idle.lower_bound(key_type(context, 0, 0));
+            auto e = b;
+
+            for(; e != idle.end() && e->first.context == context; ++e)
+                stat.cached -= e->first.size * e->second.size();
+
+            idle.erase(b, e);
+        }
+
+        /// Current pool statistics.
+        static statistics stats() {
+            boost::lock_guard<boost::mutex> lock(mx);
+            return stat;
+        }
+    private:
+        struct key_type {
+            cl_context   context;
+            cl_mem_flags flags;
+            size_t       size;
+
+            key_type(cl_context c, cl_mem_flags f, size_t s)
+                : context(c), flags(f), size(s) {}
+
+            bool operator<(const key_type &k) const {
+                if (context != k.context) return context < k.context;
+                if (flags   != k.flags)   return flags   < k.flags;
+                return size < k.size;
+            }
+        };
+
+        static size_t size_class(size_t bytes) {
+            const size_t min_size = 4096;
+
+            if (bytes <= min_size) return min_size;
+
+            size_t p = min_size;
+            while(p <= bytes / 2) p *= 2;
+
+            size_t step = p / 4;
+            return (bytes + step - 1) / step * step;
+        }
+
+        static boost::mutex mx;
+        static std::map< key_type, std::vector<cl::Buffer> > idle;
+        static std::map< cl_mem, key_type > used;
+        static statistics stat;
+};
+
+template <bool dummy>
+boost::mutex memory_pool<dummy>::mx;
+
+template <bool dummy>
+std::map<
+    typename memory_pool<dummy>::key_type, std::vector<cl::Buffer>
+    > memory_pool<dummy>::idle;
+
+template <bool dummy>
+std::map<
+    cl_mem, typename memory_pool<dummy>::key_type
+    > memory_pool<dummy>::used;
+
+template <bool dummy>
+typename memory_pool<dummy>::statistics memory_pool<dummy>::stat;
+
+} // namespace vex
+
+#ifdef WIN32
+#  pragma warning(pop)
+#endif
+
+// vim: et
+#endif
@@ -35,5 +35,7 @@ THE SOFTWARE.
 #include <vexcl/mpi/multivector.hpp>
 #include <vexcl/mpi/reduce.hpp>
 #include <vexcl/mpi/spmat.hpp>
+#include <vexcl/mpi/stencil.hpp>
+#include <vexcl/mpi/fft.hpp>
 
 #endif
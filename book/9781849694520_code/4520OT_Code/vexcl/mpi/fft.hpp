@@ -0,0 +1,404 @@
+#ifndef VEXCL_MPI_FFT_HPP
+#define VEXCL_MPI_FFT_HPP
+
+/*
+The MIT License
+
+Copyright (c) 2012-2013 Denis Demidov <ddemidov@ksu.ru>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/**
+ * \file   mpi/fft.hpp
+ * \author Denis Demidov <ddemidov@ksu.ru>
+ * \brief  Multidimensional FFT of data distributed between MPI processes.
+ */
+
+#include <vector>
+#include <memory>
+#include <numeric>
+#include <algorithm>
+
+#include <mpi.h>
+
+#include <vexcl/fft.hpp>
+#include <vexcl/mpi/util.hpp>
+#include <vexcl/mpi/vector.hpp>
+
+namespace vex {
+namespace mpi {
+
+/// \cond INTERNAL
+template <class F, class V>
+struct mpi_fft_expr
+    : mpi_vector_expression< boost::proto::terminal< mpi_additive_vector_transform >::type >
+{
+    F &f;
+    const V &x;
+
+    mpi_fft_expr(F &f, const V &x) : f(f), x(x) {}
+
+    template <bool negate, bool append, class W>
+    typename std::enable_if<
+        std::is_base_of<mpi_vector_terminal_expression, W>::value &&
+        std::is_same<typename F::output_t, typename W::value_type>::value,
+        void
+    >::type
+    apply(W &y) const {
+        f.template execute<negate, append>(x, y);
+    }
+};
+/// \endcond
+
+/// Multidimensional FFT of data distributed between MPI processes.
+/**
+ * The data is decomposed into slabs along the slowest dimension: with sizes
+ * {n0, n1, ...} in row-major order, each process holds a continuous range
+ * of the n0 planes, on a single device.
+ * \code
+ * vex::mpi::fft<cl_double2> fft(MPI_COMM_WORLD, ctx, {n0, n1, n2}, planes);
+ * y = fft(x);
+ * \endcode
+ * Every process first transforms the dimensions of its planes with batched
+ * single-device plans, leaving them transposed so that the columns of n1
+ * owned by each process are contiguous. One all-to-all exchange hands each
+ * process all n0 planes of its range of n1; after the transform along n0,
+ * a second exchange returns the data to its original slabs and order.
+ *
+ * The all-to-all exchanges are done with non-blocking point-to-point
+ * messages: every block is sent as soon as its download from the device
+ * completes, and uploaded as soon as it arrives.
+ */
+template <typename T0, typename T1 = T0, class Planner = vex::fft::planner>
+class fft {
+    public:
+        typedef T0 input_t;
+        typedef T1 output_t;
+        typedef typename cl_scalar_of<T1>::type value_type;
+
+        typedef typename cl_scalar_of<T0>::type T0s;
+        typedef typename cl_scalar_of<T1>::type T1s;
+        static_assert(boost::is_same<T0s, T1s>::value, "Input and output must have same precision.");
+        typedef T0s T;
+
+        typedef typename cl_vector_of<T, 2>::type T2;
+        typedef vex::fft::plan<T2, T2, Planner> local_plan;
+
+        VEX_FUNCTION(r2c, T2(T), "return (" + type_name<T2>() + ")(prm1, 0);");
+        VEX_FUNCTION(c2r, T(T2), "return prm1.x;");
+
+        /// Constructor.
+        /**
+         * \param comm   MPI communicator.
+         * \param queue  command queue of the single local device.
+         * \param sizes  global sizes, slowest dimension first; at least two
+         *               dimensions.
+         * \param planes number of the n0 planes held by this process.
+         * \param dir    direction of the transform.
+         */
+        fft(MPI_Comm comm, const std::vector<cl::CommandQueue> &queue,
+                const std::vector<size_t> &sizes, size_t planes,
+                direction dir = forward, const Planner &planner = Planner()
+           )
+            : mpi(comm), queue(queue), sizes(sizes), m0(planes)
+        {
+            mpi.precondition(queue.size() == 1,
+                    "vex::mpi::fft: one device per process is supported");
+            mpi.precondition(sizes.size() >= 2,
+                    "vex::mpi::fft: at least two dimensions are required");
+
+            const bool inverse = dir == vex::inverse;
+
+            n0 = sizes[0];
+            n1 = sizes[1];
+            M  = std::accumulate(sizes.begin() + 1, sizes.end(),
+                    static_cast<size_t>(1), std::multiplies<size_t>());
+            R  = M / n1;
+
+            scale = inverse ? ((T)1 / (n0 * M)) : 1;
+
+            plane = mpi.restore_partitioning(m0);
+            mpi.precondition(plane.back() == n0,
+                    "vex::mpi::fft: planes do not add up to the slowest dimension");
+
+            column.resize(mpi.size + 1);
+            for(int p = 0; p <= mpi.size; p++)
+                column[p] = n1 * p / mpi.size;
+
+            k = column[mpi.rank + 1] - column[mpi.rank];
+
+            cl::Context context = qctx(queue[0]);
+
+            // The transposes write straight into the buffers of the next
+            // plan, so the plans keep buffers of their own.
+            Planner own = planner;
+            own.scratch.reset();
+            own.inplace = false;
+
+            pack     = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(T2) * std::max<size_t>(1, m0 * M));
+            unpack   = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(T2) * std::max<size_t>(1, k * R * n0));
+            result   = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(T2) * std::max<size_t>(1, m0 * M));
+
+            // Local dimensions, fastest first. Each transform leaves its
+            // dimension the slowest one, so the planes end up as the
+            // fastest dimension in pack.
+            if (m0) {
+                for(size_t d = sizes.size(); d-- > 1; ) {
+                    stage s;
+                    s.width = sizes[d];
+                    s.rows  = m0 * M / sizes[d];
+                    s.fft   = std::make_shared<local_plan>(queue, std::vector<size_t>(1, s.width),
+                            inverse, own, s.rows);
+                    local.push_back(s);
+                }
+
+                for(size_t i = 0; i < local.size(); i++) {
+                    const local_plan &p = *local[i].fft;
+                    const cl::Buffer &target = i + 1 < local.size()
+                        ? local[i + 1].fft->bufs[local[i + 1].fft->input] : pack;
+
+                    local[i].transpose = std::make_shared<vex::fft::kernel_call>(
+                            vex::fft::transpose_kernel<T>(queue[0], local[i].width, local[i].rows,
+                                p.bufs[p.output], target));
+                }
+            }
+
+            // The slowest dimension, for the columns of n1 owned here.
+            if (k) {
+                global.width = n0;
+                global.rows  = k * R;
+                global.fft   = std::make_shared<local_plan>(queue, std::vector<size_t>(1, n0),
+                        inverse, own, global.rows);
+
+                const local_plan &p = *global.fft;
+                global.transpose = std::make_shared<vex::fft::kernel_call>(
+                        vex::fft::transpose_kernel<T>(queue[0], n0, global.rows,
+                            p.bufs[p.output], unpack));
+            }
+
+            size_t staging = std::max<size_t>(1, std::max(m0 * M, k * R * n0));
+            sendbuf.resize(queue[0], staging);
+            recvbuf.resize(queue[0], staging);
+        }
+
+        /// Transforms the local part of x into the local part of y.
+        template <bool negate, bool append, class V, class W>
+        void execute(const V &x, W &y) {
+            T s = negate ? -scale : scale;
+
+            if (m0) {
+                const local_plan &p = *local[0].fft;
+                vex::vector<T2> in(queue[0], p.bufs[p.input]);
+
+                load(in, x.data());
+
+                for(auto l = local.begin(); l != local.end(); l++) run(*l);
+            }
+
+            // pack is [n1][rest][planes]: send the columns of n1 to their
+            // owners, which put them at the planes of the sender.
+            {
+                std::vector<size_t> sdisp(mpi.size + 1), width(mpi.size), col(mpi.size);
+                for(int p = 0; p <= mpi.size; p++) sdisp[p] = column[p] * R * m0;
+                for(int p = 0; p <  mpi.size; p++) {
+                    width[p] = plane[p + 1] - plane[p];
+                    col[p]   = plane[p];
+                }
+
+                const cl::Buffer &dst = k ? global.fft->bufs[global.fft->input] : unpack;
+                redistribute(pack, sdisp, dst, k * R, width, col, n0);
+            }
+
+            if (k) run(global);
+
+            // unpack is [n0][columns][rest]: send the planes back.
+            {
+                std::vector<size_t> sdisp(mpi.size + 1), width(mpi.size), col(mpi.size);
+                for(int p = 0; p <= mpi.size; p++) sdisp[p] = plane[p] * k * R;
+                for(int p = 0; p <  mpi.size; p++) {
+                    width[p] = (column[p + 1] - column[p]) * R;
+                    col[p]   = column[p] * R;
+                }
+
+                redistribute(unpack, sdisp, result, m0, width, col, M);
+            }
+
+            if (!m0) return;
+
+            vex::vector<T2> out(queue[0], result);
+            store<append>(y.data(), out, s);
+        }
+
+        /// User call.
+        template <class V>
+        mpi_fft_expr<fft, V> operator()(const V &x) {
+            return mpi_fft_expr<fft, V>(*this, x);
+        }
+    private:
+        struct stage {
+            size_t width, rows;
+            std::shared_ptr<local_plan> fft;
+            std::shared_ptr<vex::fft::kernel_call> transpose;
+        };
+
+        comm_data mpi;
+        std::vector<cl::CommandQueue> queue;
+        std::vector<size_t> sizes;
+
+        size_t n0, n1, M, R, m0, k;
+        T scale;
+
+        // Planes of n0 and columns of n1 owned by each process.
+        std::vector<size_t> plane, column;
+
+        std::vector<stage> local;
+        stage global;
+
+        cl::Buffer pack, unpack, result;
+
+        staging_buffer<T2> sendbuf, recvbuf;
+        std::vector<cl::Event> upload;
+
+        void run(stage &s) {
+            s.fft->run();
+            queue[0].enqueueNDRangeKernel(s.transpose->kernel, cl::NullRange,
+                    s.transpose->global, s.transpose->local, 0,
+                    event_trace<>::kernel(queue[0], s.transpose->kernel));
+        }
+
+        template <class V>
+        typename std::enable_if<std::is_same<typename V::value_type, T>::value, void>::type
+        load(vex::vector<T2> &in, const V &x) {
+            in = r2c(x);
+        }
+
+        template <class V>
+        typename std::enable_if<!std::is_same<typename V::value_type, T>::value, void>::type
+        load(vex::vector<T2> &in, const V &x) {
+            in = x;
+        }
+
+        template <bool append, class V>
+        typename std::enable_if<std::is_same<typename V::value_type, T>::value, void>::type
+        store(V &y, const vex::vector<T2> &out, T s) {
+            if (append) y += c2r(out) * s;
+            else        y  = c2r(out) * s;
+        }
+
+        template <bool append, class V>
+        typename std::enable_if<!std::is_same<typename V::value_type, T>::value, void>::type
+        store(V &y, const vex::vector<T2> &out, T s) {
+            if (append) y += out * s;
+            else        y  = out * s;
+        }
+
+        // Sends elements [sdisp[p], sdisp[p + 1]) of src to every process p.
+        // The block from process p arrives as rows x width[p] elements and
+        // is written at column col[p] of dst, which has pitch elements per
+        // row. The block of this process is copied on the device.
+        void redistribute(const cl::Buffer &src, const std::vector<size_t> &sdisp,
+                const cl::Buffer &dst, size_t rows,
+                const std::vector<size_t> &width, const std::vector<size_t> &col,
+                size_t pitch)
+        {
+            static const int tagBlock = get_mpi_tag<VEXCL_MPI_TAG_START>();
+
+            // The receive area may still be read by the previous uploads.
+            for(auto e = upload.begin(); e != upload.end(); e++) e->wait();
+            upload.clear();
+
+            std::vector<size_t> rdisp(mpi.size + 1, 0);
+            for(int p = 0; p < mpi.size; p++)
+                rdisp[p + 1] = rdisp[p] + rows * width[p];
+
+            std::vector<MPI_Request> recv(mpi.size, MPI_REQUEST_NULL);
+            std::vector<MPI_Request> send(mpi.size, MPI_REQUEST_NULL);
+
+            for(int p = 0; p < mpi.size; p++)
+                if (p != mpi.rank && rdisp[p + 1] > rdisp[p])
+                    MPI_Irecv(&recvbuf[rdisp[p]], 2 * (rdisp[p + 1] - rdisp[p]),
+                            mpi_type<T>(), p, tagBlock, mpi.comm, &recv[p]);
+
+            // Download all outgoing blocks at once; send each when it is
+            // ready, starting with the next process to spread the load.
+            std::vector<cl::Event> download(mpi.size);
+
+            for(int p = 0; p < mpi.size; p++)
+                if (p != mpi.rank && sdisp[p + 1] > sdisp[p])
+                    queue[0].enqueueReadBuffer(src, CL_FALSE,
+                            sizeof(T2) * sdisp[p], sizeof(T2) * (sdisp[p + 1] - sdisp[p]),
+                            &sendbuf[sdisp[p]], 0, &download[p]);
+
+            if (rows && width[mpi.rank])
+                copy_block(src, sdisp[mpi.rank], dst, rows, width[mpi.rank], col[mpi.rank], pitch);
+
+            queue[0].flush();
+
+            for(int i = 1; i < mpi.size; i++) {
+                int p = (mpi.rank + i) % mpi.size;
+                if (sdisp[p + 1] == sdisp[p]) continue;
+
+                download[p].wait();
+                MPI_Isend(&sendbuf[sdisp[p]], 2 * (sdisp[p + 1] - sdisp[p]),
+                        mpi_type<T>(), p, tagBlock, mpi.comm, &send[p]);
+            }
+
+            for(;;) {
+                int p;
+                MPI_Waitany(mpi.size, recv.data(), &p, MPI_STATUS_IGNORE);
+                if (p == MPI_UNDEFINED) break;
+
+                cl::size_t<3> buf_origin, host_origin, region;
+                buf_origin[0]  = col[p] * sizeof(T2); buf_origin[1]  = 0; buf_origin[2]  = 0;
+                host_origin[0] = 0;                   host_origin[1] = 0; host_origin[2] = 0;
+                region[0]      = width[p] * sizeof(T2); region[1] = rows; region[2] = 1;
+
+                cl::Event e;
+                queue[0].enqueueWriteBufferRect(dst, CL_FALSE,
+                        buf_origin, host_origin, region,
+                        pitch * sizeof(T2), 0, width[p] * sizeof(T2), 0,
+                        &recvbuf[rdisp[p]], 0, &e);
+                upload.push_back(e);
+            }
+
+            queue[0].flush();
+
+            MPI_Waitall(mpi.size, send.data(), MPI_STATUSES_IGNORE);
+        }
+
+        // Copies the dense rows x width block at offset off of src to
+        // column col of dst.
+        void copy_block(const cl::Buffer &src, size_t off, const cl::Buffer &dst,
+                size_t rows, size_t width, size_t col, size_t pitch)
+        {
+            cl::size_t<3> src_origin, dst_origin, region;
+            src_origin[0] = off * sizeof(T2);   src_origin[1] = 0; src_origin[2] = 0;
+            dst_origin[0] = col * sizeof(T2);   dst_origin[1] = 0; dst_origin[2] = 0;
+            region[0]     = width * sizeof(T2); region[1] = rows;  region[2] = 1;
+
+            queue[0].enqueueCopyBufferRect(src, dst, src_origin, dst_origin, region,
+                    width * sizeof(T2), 0, pitch * sizeof(T2), 0);
+        }
+};
+
+} // namespace mpi
+} // namespace vex
+
+#endif
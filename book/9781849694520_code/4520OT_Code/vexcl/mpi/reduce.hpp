@@ -31,6 +31,9 @@ THE SOFTWARE.
  * \brief  MPI wrapper for vex::Reductor.
  */
 
+#include <array>
+#include <vector>
+#include <memory>
 #include <mpi.h>
 #include <vexcl/reduce.hpp>
 #include <vexcl/mpi/util.hpp>
@@ -55,8 +58,134 @@ DEFINE_REDUCE_OP(vex::MIN, MPI_MIN);
 
 #undef DEFINE_REDUCE_OP
 
+// Global reduction of N values. Values with the same operation travel in a
+// single message. With MPI-3 the reduction is non-blocking.
+template <typename T, size_t N>
+struct allreduce_state {
+    std::array<T, N>      local, global;
+    std::array<MPI_Op, N> op;
+
+    std::vector< std::vector<size_t> > group;
+    std::vector< std::vector<T> >      sbuf, rbuf;
+    std::vector<MPI_Request>           req;
+
+    void start(MPI_Comm comm, bool blocking) {
+        for(size_t i = 0; i < N; i++) {
+            size_t g = 0;
+            while(g < group.size() && op[group[g][0]] != op[i]) g++;
+
+            if (g == group.size()) group.push_back(std::vector<size_t>());
+            group[g].push_back(i);
+        }
+
+        sbuf.resize(group.size());
+        rbuf.resize(group.size());
+        req.resize(group.size(), MPI_REQUEST_NULL);
+
+        for(size_t g = 0; g < group.size(); g++) {
+            for(auto i = group[g].begin(); i != group[g].end(); i++)
+                sbuf[g].push_back(local[*i]);
+
+            rbuf[g].resize(sbuf[g].size());
+
+#if MPI_VERSION >= 3
+            if (!blocking) {
+                MPI_Iallreduce(sbuf[g].data(), rbuf[g].data(), sbuf[g].size(),
+                        mpi_type<T>(), op[group[g][0]], comm, &req[g]);
+                continue;
+            }
+#endif
+            MPI_Allreduce(sbuf[g].data(), rbuf[g].data(), sbuf[g].size(),
+                    mpi_type<T>(), op[group[g][0]], comm);
+        }
+
+        if (blocking) unpack();
+    }
+
+    bool test() {
+        int flag;
+        MPI_Testall(req.size(), req.data(), &flag, MPI_STATUSES_IGNORE);
+        return flag != 0;
+    }
+
+    void wait() {
+        MPI_Waitall(req.size(), req.data(), MPI_STATUSES_IGNORE);
+        unpack();
+    }
+
+    void unpack() {
+        for(size_t g = 0; g < group.size(); g++)
+            for(size_t j = 0; j < group[g].size(); j++)
+                global[group[g][j]] = rbuf[g][j];
+    }
+};
+
+template <class RDCTuple, size_t I = 0, size_t K = std::tuple_size<RDCTuple>::value>
+struct reduce_ops {
+    template <size_t N>
+    static void get(std::array<MPI_Op, N> &op) {
+        op[I] = mpi_reduce_op<typename std::tuple_element<I, RDCTuple>::type>();
+        reduce_ops<RDCTuple, I + 1, K>::get(op);
+    }
+};
+
+template <class RDCTuple, size_t K>
+struct reduce_ops<RDCTuple, K, K> {
+    template <size_t N>
+    static void get(std::array<MPI_Op, N>&) {}
+};
+
 /// \endcond
 
+/// Result of a non-blocking global reduction.
+/**
+ * The reduction is started when the future is created and completes in the
+ * background while the process does other work. Requires MPI-3
+ * (MPI_Iallreduce); with older MPI versions the reduction completes
+ * immediately.
+ */
+template <typename T, size_t N>
+class reduction_future {
+    public:
+        /// Whether the result is available.
+        bool ready() const {
+            if (!done && s->test()) {
+                s->unpack();
+                done = true;
+            }
+            return done;
+        }
+
+        /// Waits for the result.
+        const std::array<T, N>& get() const {
+            if (!done) {
+                s->wait();
+                done = true;
+            }
+            return s->global;
+        }
+
+        /// Waits for the result of a single reduction.
+        T value(size_t i = 0) const {
+            return get()[i];
+        }
+    private:
+        std::shared_ptr< allreduce_state<T, N> > s;
+        mutable bool done;
+
+        reduction_future(MPI_Comm comm, std::shared_ptr< allreduce_state<T, N> > state)
+            : s(state), done(false)
+        {
+            s->start(comm, false);
+#if MPI_VERSION < 3
+            done = true;
+#endif
+        }
+
+        template <typename, class> friend class Reductor;
+        template <typename, class> friend class MultiReductor;
+};
+
 /// MPI wrapper for vex::Reductor class template.
 template <typename T, class RDC>
 class Reductor {
@@ -85,6 +214,30 @@ class Reductor {
             return global;
         }
 
+        /// Starts non-blocking reduction of the input expression.
+        /**
+         * The local part is reduced immediately; the global reduction
+         * proceeds while the caller does other work:
+         * \code
+         * auto rho = dot.async(r * r);
+         * q = A * p;                   // Overlaps with MPI_Iallreduce.
+         * double alpha = rho.value() / pq;
+         * \endcode
+         */
+        template <class Expr>
+        typename std::enable_if<
+            boost::proto::matches<Expr, mpi_vector_expr_grammar>::value,
+            reduction_future<T, 1>
+        >::type
+        async(const Expr &expr) const {
+            auto s = std::make_shared< allreduce_state<T, 1> >();
+
+            s->local[0] = reduce(extract_local_expression()(boost::proto::as_child(expr)));
+            s->op[0]    = mpi_reduce_op<RDC>();
+
+            return reduction_future<T, 1>(mpi.comm, s);
+        }
+
 #ifdef VEXCL_MPI_MULTIVECTOR_HPP
         template <class Expr>
         typename std::enable_if<
@@ -108,6 +261,68 @@ class Reductor {
         vex::Reductor<T,RDC> reduce;
 };
 
+#ifndef BOOST_NO_VARIADIC_TEMPLATES
+
+/// MPI wrapper for vex::MultiReductor class template.
+/**
+ * Several expressions are reduced locally in a single kernel, and the local
+ * results are combined across processes with one message per distinct
+ * reduction kind (e.g. both dot products of a CG iteration go in one
+ * MPI_Allreduce):
+ * \code
+ * vex::mpi::MultiReductor<double, std::tuple<vex::SUM, vex::SUM>> dot2(comm, ctx);
+ *
+ * std::array<double, 2> v = dot2(r * r, r * z);
+ *
+ * auto f = dot2.async(r * r, r * z);
+ * // ... other work ...
+ * std::array<double, 2> w = f.get();
+ * \endcode
+ */
+template <typename T, class RDCTuple>
+class MultiReductor {
+    public:
+        /// Number of reductions computed at once.
+        static const size_t K = std::tuple_size<RDCTuple>::value;
+
+        /// Constructor.
+        MultiReductor(MPI_Comm comm, const std::vector<cl::CommandQueue> &queue)
+            : mpi(comm), reduce(queue)
+        {}
+
+        /// Computes global reductions of the input expressions.
+        template <class... Expr>
+        typename std::enable_if<sizeof...(Expr) == K, std::array<T, K>>::type
+        operator()(const Expr&... expr) const {
+            allreduce_state<T, K> s;
+            local(s, expr...);
+            s.start(mpi.comm, true);
+            return s.global;
+        }
+
+        /// Starts non-blocking global reductions of the input expressions.
+        template <class... Expr>
+        typename std::enable_if<sizeof...(Expr) == K, reduction_future<T, K>>::type
+        async(const Expr&... expr) const {
+            auto s = std::make_shared< allreduce_state<T, K> >();
+            local(*s, expr...);
+            return reduction_future<T, K>(mpi.comm, s);
+        }
+    private:
+        comm_data mpi;
+        vex::MultiReductor<T, RDCTuple> reduce;
+
+        template <class... Expr>
+        void local(allreduce_state<T, K> &s, const Expr&... expr) const {
+            s.local = reduce(std::make_tuple(
+                        extract_local_expression()(boost::proto::as_child(expr))...
+                        ));
+            reduce_ops<RDCTuple>::get(s.op);
+        }
+};
+
+#endif
+
 } // namespace mpi
 } // namespace vex
 
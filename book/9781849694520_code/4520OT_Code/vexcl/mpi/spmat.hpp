@@ -149,7 +149,7 @@ class SpMat : public mpi_matrix_terminal {
         SpMat(MPI_Comm comm, const std::vector<cl::CommandQueue> &queue,
                 size_t n, size_t m,
                 const idx_t *row, const column_t *col, const real *val
-             ) : mpi(comm)
+             ) : mpi(comm), queue(queue)
         {
             // Split into local and remote parts; renumber columns.
             std::vector<idx_t> loc_row(n + 1, 0);
@@ -238,6 +238,8 @@ class SpMat : public mpi_matrix_terminal {
          * Matrix vector multiplication (\f$y = \alpha Ax\f$ or \f$y += \alpha
          * Ax\f$) is performed in parallel on all registered compute devices.
          * Ghost values of x are transfered across MPI processes as needed.
+         * The local part of the product runs on the devices while the ghost
+         * values are in flight; the remote part is enqueued once they arrive.
          * \param x      input vector.
          * \param y      output vector.
          * \param alpha  coefficient in front of matrix-vector product
@@ -262,6 +264,9 @@ class SpMat : public mpi_matrix_terminal {
             else if (!append)
                 y.data() = 0;
 
+            // Make sure the local product is submitted before blocking in MPI.
+            for(auto q = queue.begin(); q != queue.end(); q++) q->flush();
+
             if (rem_mtx) {
                 exc->finish(rem_x);
                 rem_mtx->mul(rem_x, y.data(), alpha, true);
@@ -269,6 +274,7 @@ class SpMat : public mpi_matrix_terminal {
         }
     private:
         comm_data mpi;
+        std::vector<cl::CommandQueue> queue;
 
         std::unique_ptr< vex::SpMat<real, column_t, idx_t> > loc_mtx;
         std::unique_ptr< vex::SpMat<real, column_t, idx_t> > rem_mtx;
@@ -0,0 +1,267 @@
+#ifndef VEXCL_MPI_STENCIL_HPP
+#define VEXCL_MPI_STENCIL_HPP
+
+/*
+The MIT License
+
+Copyright (c) 2012-2013 Denis Demidov <ddemidov@ksu.ru>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/**
+ * \file   mpi/stencil.hpp
+ * \author Denis Demidov <ddemidov@ksu.ru>
+ * \brief  MPI wrapper for vex::stencil.
+ */
+
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+#include <mpi.h>
+
+#include <vexcl/stencil.hpp>
+#include <vexcl/mpi/util.hpp>
+#include <vexcl/mpi/vector.hpp>
+
+namespace vex {
+namespace mpi {
+
+/// \cond INTERNAL
+struct mpi_stencil_terminal {};
+
+template <class S, class V>
+struct mpi_conv
+    : mpi_vector_expression< boost::proto::terminal< mpi_additive_vector_transform >::type >
+{
+    const S &s;
+    const V &x;
+
+    mpi_conv(const S &s, const V &x) : s(s), x(x) {}
+
+    template <bool negate, bool append, class W>
+    typename std::enable_if<
+        std::is_base_of<mpi_vector_terminal_expression, W>::value &&
+        std::is_same<typename S::value_type, typename W::value_type>::value,
+        void
+    >::type
+    apply(W &y) const {
+        s.convolve(x, y, append ? 1 : 0, negate ? -1 : 1);
+    }
+};
+
+template <class V, class S>
+typename std::enable_if<
+    std::is_base_of<mpi_stencil_terminal,           S>::value &&
+    std::is_base_of<mpi_vector_terminal_expression, V>::value &&
+    std::is_same<typename S::value_type, typename V::value_type>::value,
+    mpi_conv< S, V >
+>::type
+operator*(const V &x, const S &s) {
+    return mpi_conv< S, V >(s, x);
+}
+
+/// \endcond
+
+/// MPI wrapper for vex::stencil class template.
+/**
+ * Convolves a vector distributed between MPI processes (each process
+ * holding a continuous strip of it) the way vex::stencil convolves a
+ * vex::vector: the values past the ends of the global vector repeat its
+ * first and last elements.
+ * \code
+ * vex::mpi::stencil<double> s(MPI_COMM_WORLD, ctx, {1, -2, 1}, 1);
+ * y = x * s;
+ * \endcode
+ * The local part is convolved with a vex::stencil while the halos travel
+ * between the neighbour processes with non-blocking MPI. The local
+ * convolution takes the ends of the strip for the missing halos, so once
+ * the halos arrive, only the few points closer to the strip ends than the
+ * stencil width are corrected by the contribution of the difference.
+ *
+ * The local part on every process has to hold at least as many elements as
+ * each of the halos of the stencil.
+ */
+template <typename T>
+class stencil : public mpi_stencil_terminal {
+    public:
+        typedef T value_type;
+
+        /// Constructor.
+        /**
+         * \param comm   MPI communicator.
+         * \param queue  vector of command queues.
+         * \param st     vector holding stencil values.
+         * \param center center of the stencil.
+         */
+        stencil(MPI_Comm comm, const std::vector<cl::CommandQueue> &queue,
+                const std::vector<T> &st, uint center
+               )
+            : mpi(comm), queue(queue), st(st),
+              lhalo(center), rhalo(st.size() - center - 1),
+              local(this->queue, st, center),
+              lrecv(lhalo), rrecv(rhalo), head(rhalo + 1), tail(lhalo + 1),
+              fix_event(queue.size())
+        {
+            recv.resize(2, MPI_REQUEST_NULL);
+            send.resize(2, MPI_REQUEST_NULL);
+        }
+
+        /// Convolve stencil with a vector.
+        /**
+         * y = alpha * y + beta * conv(x);
+         * \param x input vector.
+         * \param y output vector.
+         * \param alpha Scaling coefficient in front of y.
+         * \param beta  Scaling coefficient in front of convolution.
+         */
+        template <class V, class W>
+        typename std::enable_if<
+            std::is_base_of<mpi_vector_terminal_expression, V>::value &&
+            std::is_same<T, typename V::value_type>::value &&
+            std::is_base_of<mpi_vector_terminal_expression, W>::value &&
+            std::is_same<T, typename W::value_type>::value,
+            void
+        >::type
+        convolve(const V &x, W &y, T alpha = 0, T beta = 1) const {
+            static const int tagHalo = get_mpi_tag<VEXCL_MPI_TAG_START>();
+
+            const vex::vector<T> &xl = x.data();
+            const size_t n = xl.size();
+
+            if (n == 0 || n < static_cast<size_t>(std::max(lhalo, rhalo)))
+                throw std::invalid_argument(
+                        "vex::mpi::stencil: local part is smaller than the stencil halo");
+
+            const int prev = mpi.rank - 1;
+            const int next = mpi.rank + 1 < mpi.size ? mpi.rank + 1 : -1;
+
+            // Halos we receive and parts of them we send.
+            const bool left       = prev >= 0 && lhalo > 0;
+            const bool right      = next >= 0 && rhalo > 0;
+            const bool send_left  = prev >= 0 && rhalo > 0;
+            const bool send_right = next >= 0 && lhalo > 0;
+
+            // The previous correction may still be uploaded from fix.
+            for(auto e = fix_event.begin(); e != fix_event.end(); e++)
+                if ((*e)()) e->wait();
+
+            if (left)
+                MPI_Irecv(lrecv.data(), lhalo, mpi_type<T>(), prev, tagHalo, mpi.comm, &recv[0]);
+            if (right)
+                MPI_Irecv(rrecv.data(), rhalo, mpi_type<T>(), next, tagHalo, mpi.comm, &recv[1]);
+
+            // Ends of the strip: sent to the neighbours, and taken by the
+            // local convolution for the missing halos.
+            size_t hsize = std::max<size_t>(send_left  ? rhalo : 0, left  ? 1 : 0);
+            size_t tsize = std::max<size_t>(send_right ? lhalo : 0, right ? 1 : 0);
+
+            std::vector<cl::Event> hev(queue.size()), tev(queue.size());
+
+            xl.read_data(0,         hsize, head.data(), CL_FALSE, &hev);
+            xl.read_data(n - tsize, tsize, tail.data(), CL_FALSE, &tev);
+
+            for(auto e = hev.begin(); e != hev.end(); e++) if ((*e)()) e->wait();
+            for(auto e = tev.begin(); e != tev.end(); e++) if ((*e)()) e->wait();
+
+            if (send_left)
+                MPI_Isend(head.data(), rhalo, mpi_type<T>(), prev, tagHalo, mpi.comm, &send[0]);
+            if (send_right)
+                MPI_Isend(tail.data() + tsize - lhalo, lhalo, mpi_type<T>(), next, tagHalo, mpi.comm, &send[1]);
+
+            local.convolve(xl, y.data(), alpha, beta);
+
+            // Make sure the convolution is submitted before blocking in MPI.
+            for(auto q = queue.begin(); q != queue.end(); q++) q->flush();
+
+            MPI_Waitall(2, recv.data(), MPI_STATUSES_IGNORE);
+
+            if (left || right) {
+                const size_t a = left  ? lhalo : 0;
+                const size_t b = right ? rhalo : 0;
+
+                // The corrected points, as one range when they overlap.
+                const bool merged = a + b >= n;
+                const size_t rbeg = merged ? 0 : a;
+
+                fix.resize(merged ? n : a + b);
+
+                vex::vector<T> &yl = y.data();
+
+                if (merged) {
+                    yl.read_data(0, n, fix.data(), CL_TRUE);
+                } else {
+                    if (a) yl.read_data(0,     a, fix.data(),     CL_TRUE);
+                    if (b) yl.read_data(n - b, b, fix.data() + a, CL_TRUE);
+                }
+
+                const int c = lhalo;
+
+                // Point i misses st[k] * (halo - x[0]) for i + k < c.
+                if (left) {
+                    const T x0 = head[0];
+                    for(int i = 0; i < lhalo; i++) {
+                        T d = 0;
+                        for(int k = 0; k < c - i; k++)
+                            d += st[k] * (lrecv[i + k] - x0);
+                        fix[i] += beta * d;
+                    }
+                }
+
+                // Point n - rhalo + r misses st[k] * (halo - x[n - 1]) for
+                // k > c + rhalo - r - 1.
+                if (right) {
+                    const T xn = tail[tsize - 1];
+                    for(int r = 0; r < rhalo; r++) {
+                        T d = 0;
+                        for(int k = c + rhalo - r; k <= c + rhalo; k++)
+                            d += st[k] * (rrecv[r + k - c - rhalo] - xn);
+                        fix[rbeg + (merged ? n - rhalo : 0) + r] += beta * d;
+                    }
+                }
+
+                if (merged) {
+                    yl.write_data(0, n, fix.data(), CL_FALSE, &fix_event);
+                } else {
+                    if (a) yl.write_data(0,     a, fix.data(),     CL_FALSE, &fix_event);
+                    if (b) yl.write_data(n - b, b, fix.data() + a, CL_FALSE, &fix_event);
+                }
+            }
+
+            MPI_Waitall(2, send.data(), MPI_STATUSES_IGNORE);
+        }
+    private:
+        comm_data mpi;
+        std::vector<cl::CommandQueue> queue;
+
+        std::vector<T> st;
+        int lhalo, rhalo;
+
+        vex::stencil<T> local;
+
+        mutable std::vector<T> lrecv, rrecv, head, tail, fix;
+        mutable std::vector<MPI_Request> recv, send;
+        mutable std::vector<cl::Event> fix_event;
+};
+
+} // namespace mpi
+} // namespace vex
+
+#endif
@@ -122,7 +122,58 @@ int get_mpi_tag() {
     return ++tag;
 }
 
+/// Page-locked host array used as MPI staging area.
+/**
+ * The memory is allocated by OpenCL with CL_MEM_ALLOC_HOST_PTR and stays
+ * mapped, so that device transfers to and from it go by DMA without an
+ * intermediate copy, and MPI may send and receive from it directly.
+ */
+template <typename T>
+class staging_buffer {
+    public:
+        staging_buffer() : ptr(0) {}
+
+        ~staging_buffer() {
+            if (ptr) queue.enqueueUnmapMemObject(buf, ptr);
+        }
+
+        /// Allocates n elements in the context of the queue.
+        void resize(const cl::CommandQueue &q, size_t n) {
+            if (ptr) queue.enqueueUnmapMemObject(buf, ptr);
+            ptr = 0;
+
+            if (!n) return;
+
+            queue = q;
+            buf   = cl::Buffer(qctx(q),
+                    CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, n * sizeof(T));
+            ptr   = static_cast<T*>(queue.enqueueMapBuffer(buf, CL_TRUE,
+                        CL_MAP_READ | CL_MAP_WRITE, 0, n * sizeof(T)));
+        }
+
+        T* data() const {
+            return ptr;
+        }
+
+        T& operator[](size_t i) const {
+            return ptr[i];
+        }
+    private:
+        cl::CommandQueue queue;
+        cl::Buffer       buf;
+        T               *ptr;
+
+        staging_buffer(const staging_buffer&);
+        staging_buffer& operator=(const staging_buffer&);
+};
+
 /// Ghost points exchanger.
+/**
+ * Ghost values travel through page-locked staging buffers: the device
+ * gathers the values to send directly into pinned memory, and received
+ * values are uploaded asynchronously, so that the host does not block on
+ * the transfer before the remote part of the product is enqueued.
+ */
 template <typename value_t>
 class exchange {
     public:
@@ -140,7 +191,7 @@ class exchange {
                 const std::vector<size_t> &part,
                 const std::set<column_t>  &remote_cols
                 )
-            : mpi(comm)
+            : mpi(comm), upload(queue.size())
         {
             static const int tagExcCols = get_mpi_tag<VEXCL_MPI_TAG_START>();
 
@@ -162,7 +213,7 @@ class exchange {
                     mpi.comm);
 
             std::partial_sum(recv.idx.begin(), recv.idx.end(), recv.idx.begin());
-            recv.val.resize(recv.idx.back());
+            if (!queue.empty()) recv.val.resize(queue[0], recv.idx.back());
 
             send.idx.reserve(mpi.size + 1);
             send.idx.push_back(0);
@@ -171,7 +222,7 @@ class exchange {
                         + comm_matrix[mpi.size * i + mpi.rank]);
 
             send.col.resize(send.idx.back());
-            send.val.resize(send.idx.back());
+            if (!queue.empty()) send.val.resize(queue[0], send.idx.back());
 
             // Ready to exchange exact column numbers.
             std::vector<size_t> rcols(remote_cols.begin(), remote_cols.end());
@@ -210,24 +261,38 @@ class exchange {
         void start(const vex::vector<value_t> &local_data) {
             static const int tagExcVals = get_mpi_tag<VEXCL_MPI_TAG_START>();
 
-            (*get)(local_data, send.val);
+            // The staging area may still be read by the previous upload.
+            for(auto e = upload.begin(); e != upload.end(); e++)
+                if ((*e)()) e->wait();
 
+            // Post receives first, so that the incoming messages do not have
+            // to wait for the gather below.
             for(int i = 0; i < mpi.size; ++i)
                 if (int n = recv.idx[i + 1] - recv.idx[i])
                     MPI_Irecv(&recv.val[recv.idx[i]], n, mpi_type<value_t>(),
                             i, tagExcVals, mpi.comm, &recv.req[i]);
 
+            if (send.idx.back()) {
+                value_t *dst = send.val.data();
+                (*get)(local_data, dst);
+            }
+
             for(int i = 0; i < mpi.size; ++i)
                 if (int n = send.idx[i + 1] - send.idx[i])
                     MPI_Isend(&send.val[send.idx[i]], n, mpi_type<value_t>(),
                             i, tagExcVals, mpi.comm, &send.req[i]);
         }
 
-        /// Blocks until asyncronous exchange of ghost points is done.
+        /// Waits for the ghost points and enqueues their upload to the devices.
+        /**
+         * The upload is not waited for; commands enqueued afterwards in the
+         * queues of remote_data see the uploaded values.
+         */
         void finish(vex::vector<value_t> &remote_data) {
             MPI_Waitall(mpi.size, recv.req.data(), MPI_STATUSES_IGNORE);
 
-            vex::copy(recv.val, remote_data);
+            remote_data.write_data(0, recv.idx.back(), recv.val.data(),
+                    CL_FALSE, &upload);
 
             MPI_Waitall(mpi.size, send.req.data(), MPI_STATUSES_IGNORE);
         }
@@ -236,17 +301,19 @@ class exchange {
 
         struct {
             std::vector<size_t>      idx;
-            std::vector<value_t>     val;
+            staging_buffer<value_t>  val;
             std::vector<MPI_Request> req;
         } recv;
 
         struct {
             std::vector<size_t>      idx;
             std::vector<size_t>      col;
-            std::vector<value_t>     val;
+            staging_buffer<value_t>  val;
             std::vector<MPI_Request> req;
         } send;
 
+        std::vector<cl::Event> upload;
+
         std::unique_ptr< gather<value_t> > get;
 };
 
@@ -33,6 +33,8 @@ THE SOFTWARE.
 
 #include <mpi.h>
 #include <memory>
+#include <numeric>
+#include <algorithm>
 #include <vexcl/vector.hpp>
 #include <vexcl/mpi/util.hpp>
 #include <vexcl/mpi/operations.hpp>
@@ -62,6 +64,54 @@ typedef mpi_vector_expression<
 
 /// \endcond
 
+/// Aggregate throughput of the devices of this process.
+/**
+ * Sum of the device weights of the local partitioning scheme (measured with
+ * vex::device_vector_perf() unless set otherwise, and updated by
+ * vex::load_balancer), so that processes and their devices are weighted
+ * alike.
+ */
+inline double rank_weight(const std::vector<cl::CommandQueue> &queue) {
+    double w = 0;
+    for(auto q = queue.begin(); q != queue.end(); q++)
+        w += partitioning_scheme<>::device(*q);
+    return w;
+}
+
+/// Global partitioning proportional to the throughput of the processes.
+/**
+ * Splits n elements between the processes of comm in proportion to their
+ * rank_weight(). Process p gets elements [part[p], part[p + 1]) of the
+ * returned vector, so in a heterogeneous cluster
+ * \code
+ * auto part = vex::mpi::partition(MPI_COMM_WORLD, ctx, n);
+ * vex::mpi::vector<double> x(MPI_COMM_WORLD, ctx, part[rank + 1] - part[rank]);
+ * \endcode
+ * gives the nodes with more or faster devices larger strips.
+ * \note Involves collective MPI operation.
+ */
+inline std::vector<size_t> partition(MPI_Comm comm,
+        const std::vector<cl::CommandQueue> &queue, size_t n)
+{
+    comm_data mpi(comm);
+
+    double w = rank_weight(queue);
+    std::vector<double> cumsum(mpi.size + 1, 0);
+
+    MPI_Allgather(&w, 1, MPI_DOUBLE, cumsum.data() + 1, 1, MPI_DOUBLE, comm);
+    std::partial_sum(cumsum.begin(), cumsum.end(), cumsum.begin());
+
+    std::vector<size_t> part(mpi.size + 1);
+
+    for(int p = 0; p <= mpi.size; p++)
+        part[p] = cumsum.back() > 0
+            ? std::min(n, static_cast<size_t>(n * (cumsum[p] / cumsum.back()) + 0.5))
+            : n * p / mpi.size;
+
+    part.back() = n;
+    return part;
+}
+
 /// MPI wrapper for vex::vector class template.
 template <typename T, bool own>
 class vector : public mpi_vector_terminal_expression {
@@ -197,6 +247,81 @@ class vector : public mpi_vector_terminal_expression {
             return *this;
         }
 
+        /// Moves ranges of the vector between processes.
+        /**
+         * After the call, the process p holds the elements [part[p],
+         * part[p + 1]) of the global vector. Each process sends the pieces
+         * of its old strip that others now own and receives the pieces it
+         * now owns, staged through the host.
+         * \note Involves collective MPI operation.
+         */
+        void repartition(const std::vector<size_t> &part) {
+            static_assert(own, "Non-owning vector can not be repartitioned");
+            static const int tagMigrate = get_mpi_tag<VEXCL_MPI_TAG_START>();
+
+            std::vector<size_t> old = mpi.restore_partitioning(l_size);
+
+            mpi.precondition(
+                    part.size() == old.size() && part.back() == old.back(),
+                    "Partitioning does not match the global vector size");
+
+            std::vector<cl::CommandQueue> queue = local_data->queue_list();
+
+            const size_t begin = part[mpi.rank];
+            const size_t size  = part[mpi.rank + 1] - begin;
+
+            std::vector<T> src(l_size), dst(size);
+            if (l_size) local_data->read_data(0, l_size, src.data(), CL_TRUE);
+
+            std::vector<MPI_Request> req;
+            req.reserve(2 * mpi.size);
+
+            for(int p = 0; p < mpi.size; p++) {
+                // What we now own from their old strip.
+                size_t lo = std::max(begin, old[p]);
+                size_t hi = std::min(begin + size, old[p + 1]);
+
+                if (lo < hi) {
+                    if (p == mpi.rank) {
+                        std::copy(src.begin() + (lo - old[p]), src.begin() + (hi - old[p]),
+                                dst.begin() + (lo - begin));
+                    } else {
+                        req.push_back(MPI_REQUEST_NULL);
+                        MPI_Irecv(&dst[lo - begin], static_cast<int>(hi - lo), mpi_type<T>(),
+                                p, tagMigrate, mpi.comm, &req.back());
+                    }
+                }
+
+                // What they now own from our old strip.
+                lo = std::max(old[mpi.rank],     part[p]);
+                hi = std::min(old[mpi.rank + 1], part[p + 1]);
+
+                if (lo < hi && p != mpi.rank) {
+                    req.push_back(MPI_REQUEST_NULL);
+                    MPI_Isend(&src[lo - old[mpi.rank]], static_cast<int>(hi - lo), mpi_type<T>(),
+                            p, tagMigrate, mpi.comm, &req.back());
+                }
+            }
+
+            MPI_Waitall(static_cast<int>(req.size()), req.data(), MPI_STATUSES_IGNORE);
+
+            local_data.reset(new base_type(queue, dst));
+            l_size = size;
+        }
+
+        /// Repartitions the vector according to the current process weights.
+        /**
+         * The weights follow the local device weights, so after
+         * vex::load_balancer has updated them on the processes, rebalance()
+         * moves work from the slower nodes to the faster ones. All vectors
+         * taking part in the same expressions should be rebalanced together.
+         * \see partition()
+         * \note Involves collective MPI operation.
+         */
+        void rebalance() {
+            repartition(partition(mpi.comm, local_data->queue_list(), global_size()));
+        }
+
         /// MPI communicator used by the vector.
         MPI_Comm comm() const {
             return mpi.comm;
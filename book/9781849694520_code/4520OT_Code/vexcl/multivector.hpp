@@ -45,11 +45,16 @@ THE SOFTWARE.
 #include <string>
 #include <type_traits>
 #include <functional>
+#include <memory>
+#include <algorithm>
+#include <cassert>
 #include <boost/proto/proto.hpp>
 #include <CL/cl.hpp>
 #include <vexcl/util.hpp>
 #include <vexcl/operations.hpp>
 #include <vexcl/vector.hpp>
+#include <vexcl/kernel_cache.hpp>
+#include <vexcl/autotune.hpp>
 
 /// Vector expression template library for OpenCL.
 namespace vex {
@@ -69,6 +74,9 @@ struct multivector_storage<T, false> {
     typedef vex::vector<T>* type;
 };
 
+template <typename real, class RDC>
+class Reductor;
+
 /// \endcond
 
 typedef multivector_expression<
@@ -338,11 +346,12 @@ class multivector : public multivector_terminal_expression {
         operator=(const Expr& expr) {
             const std::vector<cl::CommandQueue> &queue = vec[0]->queue_list();
 
-            for(auto q = queue.begin(); q != queue.end(); q++) {
-                cl::Context context = qctx(*q);
-                cl::Device  device  = qdev(*q);
+            for(uint d = 0; d < queue.size(); d++) {
+                auto krn = kernel_cache<>::find< exdata<Expr> >(queue[d]);
 
-                if (!exdata<Expr>::compiled[context()]) {
+                if (!krn) {
+                    cl::Context context = qctx(queue[d]);
+                    cl::Device  device  = qdev(queue[d]);
 
                     std::ostringstream kernel_name;
                     kernel_name << "multi_";
@@ -377,40 +386,25 @@ class multivector : public multivector_terminal_expression {
 
                     auto program = build_sources(context, kernel.str());
 
-                    exdata<Expr>::kernel[context()]   = cl::Kernel(program, kernel_name.str().c_str());
-                    exdata<Expr>::compiled[context()] = true;
-                    exdata<Expr>::wgsize[context()]   = kernel_workgroup_size(
-                            exdata<Expr>::kernel[context()], device);
-
+                    krn = kernel_cache<>::insert(queue[d], exdata<Expr>(
+                                cl::Kernel(program, kernel_name.str().c_str()), device));
                 }
-            }
 
-            for(uint d = 0; d < queue.size(); d++) {
                 if (size_t psize = vec[0]->part_size(d)) {
-                    cl::Context context = qctx(queue[d]);
-                    cl::Device  device  = qdev(queue[d]);
-
-                    size_t g_size = device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU ?
-                        alignup(psize, exdata<Expr>::wgsize[context()]) :
-                        device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * exdata<Expr>::wgsize[context()] * 4;
-
                     uint pos = 0;
-                    exdata<Expr>::kernel[context()].setArg(pos++, psize);
+                    krn->kernel.setArg(pos++, psize);
 
                     for(uint i = 0; i < N; i++)
-                        exdata<Expr>::kernel[context()].setArg(pos++, vec[i]->operator()(d));
+                        krn->kernel.setArg(pos++, vec[i]->operator()(d));
 
                     set_kernel_args<N>(
                             boost::proto::as_child(expr),
-                            exdata<Expr>::kernel[context()],
+                            krn->kernel,
                             d, pos, vec[0]->part_start(d)
                             );
 
-                    queue[d].enqueueNDRangeKernel(
-                            exdata<Expr>::kernel[context()],
-                            cl::NullRange,
-                            g_size, exdata<Expr>::wgsize[context()]
-                            );
+                    tuned_launch(queue[d], krn->kernel, *krn->tuner, psize,
+                            exdata_global_size(qdev(queue[d]), psize));
                 }
             }
 
@@ -439,11 +433,13 @@ class multivector : public multivector_terminal_expression {
 #endif
             const std::vector<cl::CommandQueue> &queue = vec[0]->queue_list();
 
-            for(auto q = queue.begin(); q != queue.end(); q++) {
-                cl::Context context = qctx(*q);
-                cl::Device  device  = qdev(*q);
+            for(uint d = 0; d < queue.size(); d++) {
+                auto krn = kernel_cache<>::find< exdata<ExprTuple> >(queue[d]);
+
+                if (!krn) {
+                    cl::Context context = qctx(queue[d]);
+                    cl::Device  device  = qdev(queue[d]);
 
-                if (!exdata<ExprTuple>::compiled[context()]) {
                     std::ostringstream kernel;
 
                     kernel << standard_kernel_header;
@@ -484,39 +480,24 @@ class multivector : public multivector_terminal_expression {
 
                     auto program = build_sources(context, kernel.str());
 
-                    exdata<ExprTuple>::kernel[context()]   = cl::Kernel(program, "multi_expr_tuple");
-                    exdata<ExprTuple>::compiled[context()] = true;
-                    exdata<ExprTuple>::wgsize[context()]   = kernel_workgroup_size(
-                            exdata<ExprTuple>::kernel[context()], device);
-
+                    krn = kernel_cache<>::insert(queue[d], exdata<ExprTuple>(
+                                cl::Kernel(program, "multi_expr_tuple"), device));
                 }
-            }
 
-            for(uint d = 0; d < queue.size(); d++) {
                 if (size_t psize = vec[0]->part_size(d)) {
-                    cl::Context context = qctx(queue[d]);
-                    cl::Device  device  = qdev(queue[d]);
-
-                    size_t g_size = device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU ?
-                        alignup(psize, exdata<ExprTuple>::wgsize[context()]) :
-                        device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * exdata<ExprTuple>::wgsize[context()] * 4;
-
                     uint pos = 0;
-                    exdata<ExprTuple>::kernel[context()].setArg(pos++, psize);
+                    krn->kernel.setArg(pos++, psize);
 
                     for(uint i = 0; i < N; i++)
-                        exdata<ExprTuple>::kernel[context()].setArg(pos++, (*vec[i])(d));
+                        krn->kernel.setArg(pos++, (*vec[i])(d));
 
                     {
-                        set_arguments f(exdata<ExprTuple>::kernel[context()], d, pos, vec[0]->part_start(d));
+                        set_arguments f(krn->kernel, d, pos, vec[0]->part_start(d));
                         for_each<0>(expr, f);
                     }
 
-                    queue[d].enqueueNDRangeKernel(
-                            exdata<ExprTuple>::kernel[context()],
-                            cl::NullRange,
-                            g_size, exdata<ExprTuple>::wgsize[context()]
-                            );
+                    tuned_launch(queue[d], krn->kernel, *krn->tuner, psize,
+                            exdata_global_size(qdev(queue[d]), psize));
                 }
             }
 
@@ -585,6 +566,8 @@ class multivector : public multivector_terminal_expression {
 
         /** @} */
     private:
+        template <typename, class> friend class Reductor;
+
         template <size_t I, class Expr>
             typename std::enable_if<I == N>::type
             expr_list_loop(const Expr &, std::ostream &) { }
@@ -686,20 +669,29 @@ class multivector : public multivector_terminal_expression {
 
         template <class Expr>
         struct exdata {
-            static std::map<cl_context,bool>       compiled;
-            static std::map<cl_context,cl::Kernel> kernel;
-            static std::map<cl_context,size_t>     wgsize;
+            cl::Kernel kernel;
+            std::shared_ptr<workgroup_tuner> tuner;
+
+            exdata(const cl::Kernel &kernel, const cl::Device &device)
+                : kernel(kernel), tuner(std::make_shared<workgroup_tuner>(kernel, device))
+            {}
         };
-};
 
-template <class T, size_t N, bool own> template <class Expr>
-std::map<cl_context,bool> multivector<T,N,own>::exdata<Expr>::compiled;
+        // Global size of the expression kernels for a work-group size.
+        struct exdata_global_size {
+            bool   cpu;
+            size_t psize, units;
 
-template <class T, size_t N, bool own> template <class Expr>
-std::map<cl_context,cl::Kernel> multivector<T,N,own>::exdata<Expr>::kernel;
+            exdata_global_size(const cl::Device &device, size_t psize)
+                : cpu(device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU),
+                  psize(psize), units(device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>())
+            {}
 
-template <class T, size_t N, bool own> template <class Expr>
-std::map<cl_context,size_t> multivector<T,N,own>::exdata<Expr>::wgsize;
+            size_t operator()(size_t wgsize) const {
+                return cpu ? alignup(psize, wgsize) : units * wgsize * 4;
+            }
+        };
+};
 
 /// Copy multivector to host vector.
 template <class T, size_t N, bool own>
@@ -716,6 +708,350 @@ void copy(const std::vector<T> &hv, multivector<T,N,own> &mv) {
                 mv(i).begin());
 }
 
+/// Element type of the interleaved storage of N-component data.
+/**
+ * Three-component data is padded to four components, as OpenCL 3-vectors
+ * take the space of 4-vectors anyway.
+ */
+template <typename T, size_t N>
+struct packed_type {
+    typedef typename cl_vector_of<T, N == 3 ? 4 : N>::type type;
+};
+
+/// \cond INTERNAL
+
+template <typename T, size_t N>
+struct packing_kernels {
+    cl::Kernel pack;
+    cl::Kernel unpack;
+    uint       wgsize;
+};
+
+template <typename T, size_t N>
+std::shared_ptr< packing_kernels<T, N> > get_packing_kernels(
+        const cl::CommandQueue &queue)
+{
+    typedef packing_kernels<T, N> kernels;
+    typedef typename packed_type<T, N>::type packed;
+
+    auto krn = kernel_cache<>::find<kernels>(queue);
+    if (krn) return krn;
+
+    const size_t M = cl_vector_length<packed>::value;
+
+    cl::Context context = qctx(queue);
+    cl::Device  device  = qdev(queue);
+
+    std::ostringstream source;
+
+    source << standard_kernel_header <<
+        "typedef " << type_name<T>() << " real;\n"
+        "typedef " << type_name<packed>() << " packed;\n"
+        "kernel void pack(\n"
+        "    " << type_name<size_t>() << " n";
+    for(size_t i = 0; i < N; i++)
+        source << ",\n    global const real *x" << i;
+    source << ",\n    global packed *y\n    )\n{\n"
+        "    size_t grid_size = get_global_size(0);\n"
+        "    for(size_t idx = get_global_id(0); idx < n; idx += grid_size)\n"
+        "        y[idx] = (packed)(";
+    for(size_t i = 0; i < M; i++) {
+        if (i) source << ", ";
+        if (i < N) source << "x" << i << "[idx]"; else source << "0";
+    }
+    source << ");\n}\n"
+        "kernel void unpack(\n"
+        "    " << type_name<size_t>() << " n,\n"
+        "    global const packed *y";
+    for(size_t i = 0; i < N; i++)
+        source << ",\n    global real *x" << i;
+    source << "\n    )\n{\n"
+        "    size_t grid_size = get_global_size(0);\n"
+        "    for(size_t idx = get_global_id(0); idx < n; idx += grid_size) {\n"
+        "        packed v = y[idx];\n";
+    for(size_t i = 0; i < N; i++)
+        source << "        x" << i << "[idx] = v.s" << std::hex << i << std::dec << ";\n";
+    source << "    }\n}\n";
+
+    auto program = build_sources(context, source.str());
+
+    kernels k;
+    k.pack   = cl::Kernel(program, "pack");
+    k.unpack = cl::Kernel(program, "unpack");
+    k.wgsize = std::min(
+            kernel_workgroup_size(k.pack,   device),
+            kernel_workgroup_size(k.unpack, device));
+
+    return kernel_cache<>::insert(queue, k);
+}
+
+template <typename T, size_t N, bool own, bool to_packed>
+void convert_layout(
+        const multivector<T,N,own> &mv,
+        const vector<typename packed_type<T, N>::type> &pv)
+{
+    const std::vector<cl::CommandQueue> &queue = mv.queue_list();
+
+    assert(mv.size() == pv.size() && mv(0).partition() == pv.partition());
+
+    for(uint d = 0; d < queue.size(); d++) {
+        if (size_t psize = pv.part_size(d)) {
+            auto krn = get_packing_kernels<T, N>(queue[d]);
+            cl::Kernel &k = to_packed ? krn->pack : krn->unpack;
+
+            cl::Device device = qdev(queue[d]);
+            size_t g_size = device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU ?
+                alignup(psize, krn->wgsize) :
+                device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * krn->wgsize * 4;
+
+            uint pos = 0;
+            k.setArg(pos++, psize);
+            if (!to_packed) k.setArg(pos++, pv(d));
+            for(uint i = 0; i < N; i++) k.setArg(pos++, mv(i)(d));
+            if (to_packed) k.setArg(pos++, pv(d));
+
+            queue[d].enqueueNDRangeKernel(k, cl::NullRange, g_size, krn->wgsize, 0, event_trace<>::kernel(queue[d], k));
+        }
+    }
+}
+
+/// \endcond
+
+/// Copies multivector components into interleaved storage.
+/**
+ * The structure-of-arrays layout of vex::multivector is best for kernels
+ * that use some of the components. When all components are processed
+ * together, as with particle coordinates, a vex::vector of OpenCL vector
+ * type keeps each element in a single vector load, and Reductor reduces
+ * all components at once:
+ * \code
+ * vex::multivector<float, 3> x(ctx, n);
+ * vex::vector<cl_float4> p(ctx, n);
+ *
+ * vex::pack(x, p);
+ * p = p + dt * v;
+ * vex::unpack(p, x);
+ * \endcode
+ * The vectors should have the same size and partitioning.
+ */
+template <typename T, size_t N, bool own>
+void pack(const multivector<T,N,own> &mv,
+        vector<typename packed_type<T, N>::type> &pv)
+{
+    convert_layout<T, N, own, true>(mv, pv);
+}
+
+/// Copies interleaved storage into multivector components.
+template <typename T, size_t N, bool own>
+void unpack(const vector<typename packed_type<T, N>::type> &pv,
+        multivector<T,N,own> &mv)
+{
+    convert_layout<T, N, own, false>(mv, pv);
+}
+
+/// \cond INTERNAL
+
+// Conversion between multivector components and records of N scalars
+// interleaved in a single vector. On GPUs a work-group stages a tile of
+// records in local memory, so that both the component and the record sides
+// are accessed with coalesced loads and stores; the tile is padded every 32
+// words against bank conflicts of the strided side. On CPUs, when N is a
+// width of OpenCL vectors, a work-item loads N records as an N x N block of
+// vector registers and transposes it with component swizzles instead.
+template <typename T, size_t N>
+struct record_kernels {
+    cl::Kernel pack;
+    cl::Kernel unpack;
+    size_t     wgsize;
+    bool       registers;
+};
+
+// Elements of the padded record tile of a work-group.
+inline size_t record_tile(size_t wgsize, size_t N) {
+    return wgsize * N + wgsize * N / 32 + 1;
+}
+
+template <typename T, size_t N>
+std::shared_ptr< record_kernels<T, N> > get_record_kernels(
+        const cl::CommandQueue &queue)
+{
+    typedef record_kernels<T, N> kernels;
+
+    auto krn = kernel_cache<>::find<kernels>(queue);
+    if (krn) return krn;
+
+    cl::Context context = qctx(queue);
+    cl::Device  device  = qdev(queue);
+
+    bool registers = device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU &&
+        (N == 2 || N == 4 || N == 8 || N == 16);
+
+    const char *s = "0123456789abcdef";
+
+    std::ostringstream source;
+
+    source << standard_kernel_header <<
+        "typedef " << type_name<T>() << " real;\n"
+        "typedef " << type_name<size_t>() << " idx_t;\n"
+        "#define PAD(k) ((k) + (k) / 32)\n";
+
+    for(int to_packed = 1; to_packed >= 0; to_packed--) {
+        source << "kernel void " << (to_packed ? "pack" : "unpack") << "(\n"
+            "    idx_t n";
+        for(size_t i = 0; i < N; i++)
+            source << ",\n    global " << (to_packed ? "const " : "") << "real *x" << i;
+        source << ",\n    global " << (to_packed ? "" : "const ") << "real *y";
+        if (!registers) source << ",\n    local real *tile";
+        source << "\n    )\n{\n";
+
+        if (registers) {
+            source <<
+                "    size_t grid_size = get_global_size(0);\n"
+                "    idx_t chunks = n / " << N << ";\n"
+                "    for(idx_t c = get_global_id(0); c < chunks; c += grid_size) {\n"
+                "        idx_t idx = c * " << N << ";\n";
+            for(size_t i = 0; i < N; i++) {
+                source << "        " << type_name<T>() << N << " v" << i << " = vload" << N << "(0, ";
+                if (to_packed) source << "x" << i << " + idx);\n";
+                else source << "y + (idx + " << i << ") * " << N << ");\n";
+            }
+            for(size_t j = 0; j < N; j++) {
+                source << "        vstore" << N << "((" << type_name<T>() << N << ")(";
+                for(size_t i = 0; i < N; i++)
+                    source << (i ? ", " : "") << "v" << i << ".s" << s[j];
+                source << "), 0, ";
+                if (to_packed) source << "y + (idx + " << j << ") * " << N << ");\n";
+                else source << "x" << j << " + idx);\n";
+            }
+            source <<
+                "    }\n"
+                "    for(idx_t idx = chunks * " << N << " + get_global_id(0); idx < n; idx += grid_size) {\n";
+            for(size_t i = 0; i < N; i++) {
+                if (to_packed)
+                    source << "        y[idx * " << N << " + " << i << "] = x" << i << "[idx];\n";
+                else
+                    source << "        x" << i << "[idx] = y[idx * " << N << " + " << i << "];\n";
+            }
+            source << "    }\n}\n";
+        } else {
+            source <<
+                "    size_t lid = get_local_id(0), wg = get_local_size(0);\n"
+                "    for(idx_t base = get_group_id(0) * wg; base < n; base += get_num_groups(0) * wg) {\n"
+                "        size_t m = min((idx_t)wg, n - base);\n";
+            if (to_packed) {
+                source << "        if (lid < m) {\n";
+                for(size_t i = 0; i < N; i++)
+                    source << "            tile[PAD(lid * " << N << " + " << i << ")] = x" << i << "[base + lid];\n";
+                source <<
+                    "        }\n"
+                    "        barrier(CLK_LOCAL_MEM_FENCE);\n"
+                    "        for(size_t k = lid; k < m * " << N << "; k += wg)\n"
+                    "            y[base * " << N << " + k] = tile[PAD(k)];\n";
+            } else {
+                source <<
+                    "        for(size_t k = lid; k < m * " << N << "; k += wg)\n"
+                    "            tile[PAD(k)] = y[base * " << N << " + k];\n"
+                    "        barrier(CLK_LOCAL_MEM_FENCE);\n"
+                    "        if (lid < m) {\n";
+                for(size_t i = 0; i < N; i++)
+                    source << "            x" << i << "[base + lid] = tile[PAD(lid * " << N << " + " << i << ")];\n";
+                source << "        }\n";
+            }
+            source <<
+                "        barrier(CLK_LOCAL_MEM_FENCE);\n"
+                "    }\n"
+                "}\n";
+        }
+    }
+
+    auto program = build_sources(context, source.str());
+
+    kernels k;
+    k.pack      = cl::Kernel(program, "pack");
+    k.unpack    = cl::Kernel(program, "unpack");
+    k.registers = registers;
+
+    size_t w = std::min(
+            kernel_workgroup_size(k.pack,   device),
+            kernel_workgroup_size(k.unpack, device));
+
+    if (registers) {
+        k.wgsize = w;
+    } else {
+        size_t lmem = static_cast<size_t>(device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>());
+
+        k.wgsize = 1;
+        while(k.wgsize * 2 <= std::min<size_t>(w, 256) &&
+                record_tile(k.wgsize * 2, N) * sizeof(T) <= lmem / 2)
+            k.wgsize *= 2;
+    }
+
+    return kernel_cache<>::insert(queue, k);
+}
+
+template <typename T, size_t N, bool own, bool to_packed>
+void convert_records(const multivector<T,N,own> &mv, const vector<T> &rv) {
+    const std::vector<cl::CommandQueue> &queue = mv.queue_list();
+
+    if (rv.size() != N * mv.size())
+        throw std::invalid_argument("pack: record vector should hold N elements per multivector element");
+
+    for(uint d = 0; d < queue.size(); d++) {
+        size_t psize = mv(0).part_size(d);
+
+        if (rv.part_size(d) != N * psize)
+            throw std::invalid_argument("pack: vectors are partitioned differently");
+
+        if (!psize) continue;
+
+        auto krn = get_record_kernels<T, N>(queue[d]);
+        cl::Kernel &k = to_packed ? krn->pack : krn->unpack;
+
+        cl::Device device = qdev(queue[d]);
+        size_t g_size = device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU ?
+            alignup(krn->registers ? psize / N + psize % N : psize, krn->wgsize) :
+            device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * krn->wgsize * 4;
+
+        uint pos = 0;
+        k.setArg(pos++, psize);
+        for(uint i = 0; i < N; i++) k.setArg(pos++, mv(i)(d));
+        k.setArg(pos++, rv(d));
+        if (!krn->registers)
+            k.setArg(pos++, cl::Local(record_tile(krn->wgsize, N) * sizeof(T)));
+
+        queue[d].enqueueNDRangeKernel(k, cl::NullRange, g_size, krn->wgsize, 0,
+                event_trace<>::kernel(queue[d], k, 2 * N * psize * sizeof(T)));
+    }
+}
+
+/// \endcond
+
+/// Interleaves multivector components into records of N scalars.
+/**
+ * Element j of component i goes to rv[j * N + i], so that records without
+ * an OpenCL vector type of their own (such as xyz triples) need no padding:
+ * \code
+ * vex::multivector<float, 3> x(ctx, n);
+ * vex::vector<float> xyz(ctx, 3 * n);
+ *
+ * vex::unpack(xyz, x); // ingested records to components
+ * x = x * 2;
+ * vex::pack(x, xyz);
+ * \endcode
+ * rv should hold N elements per element of mv, and each device should hold
+ * the records of its part of mv.
+ */
+template <typename T, size_t N, bool own>
+void pack(const multivector<T,N,own> &mv, vector<T> &rv) {
+    convert_records<T, N, own, true>(mv, rv);
+}
+
+/// Splits records of N interleaved scalars into multivector components.
+template <typename T, size_t N, bool own>
+void unpack(const vector<T> &rv, multivector<T,N,own> &mv) {
+    convert_records<T, N, own, false>(mv, rv);
+}
+
 #ifndef BOOST_NO_VARIADIC_TEMPLATES
 /// Ties several vex::vectors into a multivector.
 /**
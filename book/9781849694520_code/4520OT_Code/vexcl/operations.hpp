@@ -36,8 +36,17 @@ THE SOFTWARE.
 #  define NOMINMAX
 #endif
 
+#include <algorithm>
 #include <array>
 #include <tuple>
+#include <string>
+#include <sstream>
+#include <map>
+#include <vector>
+#include <typeinfo>
+#include <utility>
+#include <limits>
+#include <type_traits>
 #include <boost/proto/proto.hpp>
 #include <boost/mpl/max.hpp>
 
@@ -300,10 +309,81 @@ BUILTIN_FUNCTION_2(distance);
 BUILTIN_FUNCTION_1(length);
 BUILTIN_FUNCTION_1(normalize);
 
+// Reduced accuracy (half_*) and implementation-defined accuracy (native_*)
+// variants of float builtins.
+BUILTIN_FUNCTION_1(half_cos);
+BUILTIN_FUNCTION_2(half_divide);
+BUILTIN_FUNCTION_1(half_exp);
+BUILTIN_FUNCTION_1(half_exp10);
+BUILTIN_FUNCTION_1(half_exp2);
+BUILTIN_FUNCTION_1(half_log);
+BUILTIN_FUNCTION_1(half_log10);
+BUILTIN_FUNCTION_1(half_log2);
+BUILTIN_FUNCTION_2(half_powr);
+BUILTIN_FUNCTION_1(half_recip);
+BUILTIN_FUNCTION_1(half_rsqrt);
+BUILTIN_FUNCTION_1(half_sin);
+BUILTIN_FUNCTION_1(half_sqrt);
+BUILTIN_FUNCTION_1(half_tan);
+BUILTIN_FUNCTION_1(native_cos);
+BUILTIN_FUNCTION_2(native_divide);
+BUILTIN_FUNCTION_1(native_exp);
+BUILTIN_FUNCTION_1(native_exp10);
+BUILTIN_FUNCTION_1(native_exp2);
+BUILTIN_FUNCTION_1(native_log);
+BUILTIN_FUNCTION_1(native_log10);
+BUILTIN_FUNCTION_1(native_log2);
+BUILTIN_FUNCTION_2(native_powr);
+BUILTIN_FUNCTION_1(native_recip);
+BUILTIN_FUNCTION_1(native_rsqrt);
+BUILTIN_FUNCTION_1(native_sin);
+BUILTIN_FUNCTION_1(native_sqrt);
+BUILTIN_FUNCTION_1(native_tan);
+
 #undef BUILTIN_FUNCTION_1
 #undef BUILTIN_FUNCTION_2
 #undef BUILTIN_FUNCTION_3
 
+// Builtins that take and return gentype, and so apply to floatN/doubleN
+// component-wise.
+template <class F> struct is_simd_function : std::false_type {};
+
+#define SIMD_FUNCTION(func) \
+template <> struct is_simd_function<func##_func> : std::true_type {}
+
+SIMD_FUNCTION(acos);      SIMD_FUNCTION(acosh);     SIMD_FUNCTION(acospi);
+SIMD_FUNCTION(asin);      SIMD_FUNCTION(asinh);     SIMD_FUNCTION(asinpi);
+SIMD_FUNCTION(atan);      SIMD_FUNCTION(atan2);     SIMD_FUNCTION(atanh);
+SIMD_FUNCTION(atanpi);    SIMD_FUNCTION(atan2pi);   SIMD_FUNCTION(cbrt);
+SIMD_FUNCTION(ceil);      SIMD_FUNCTION(copysign);  SIMD_FUNCTION(cos);
+SIMD_FUNCTION(cosh);      SIMD_FUNCTION(cospi);     SIMD_FUNCTION(erfc);
+SIMD_FUNCTION(erf);       SIMD_FUNCTION(exp);       SIMD_FUNCTION(exp2);
+SIMD_FUNCTION(exp10);     SIMD_FUNCTION(expm1);     SIMD_FUNCTION(fabs);
+SIMD_FUNCTION(fdim);      SIMD_FUNCTION(floor);     SIMD_FUNCTION(fma);
+SIMD_FUNCTION(fmax);      SIMD_FUNCTION(fmin);      SIMD_FUNCTION(fmod);
+SIMD_FUNCTION(hypot);     SIMD_FUNCTION(lgamma);    SIMD_FUNCTION(log);
+SIMD_FUNCTION(log2);      SIMD_FUNCTION(log10);     SIMD_FUNCTION(log1p);
+SIMD_FUNCTION(logb);      SIMD_FUNCTION(mad);       SIMD_FUNCTION(maxmag);
+SIMD_FUNCTION(minmag);    SIMD_FUNCTION(nextafter); SIMD_FUNCTION(pow);
+SIMD_FUNCTION(powr);      SIMD_FUNCTION(remainder); SIMD_FUNCTION(rint);
+SIMD_FUNCTION(round);     SIMD_FUNCTION(rsqrt);     SIMD_FUNCTION(sin);
+SIMD_FUNCTION(sinh);      SIMD_FUNCTION(sinpi);     SIMD_FUNCTION(sqrt);
+SIMD_FUNCTION(tan);       SIMD_FUNCTION(tanh);      SIMD_FUNCTION(tanpi);
+SIMD_FUNCTION(tgamma);    SIMD_FUNCTION(trunc);
+
+SIMD_FUNCTION(half_cos);      SIMD_FUNCTION(half_divide);   SIMD_FUNCTION(half_exp);
+SIMD_FUNCTION(half_exp10);    SIMD_FUNCTION(half_exp2);     SIMD_FUNCTION(half_log);
+SIMD_FUNCTION(half_log10);    SIMD_FUNCTION(half_log2);     SIMD_FUNCTION(half_powr);
+SIMD_FUNCTION(half_recip);    SIMD_FUNCTION(half_rsqrt);    SIMD_FUNCTION(half_sin);
+SIMD_FUNCTION(half_sqrt);     SIMD_FUNCTION(half_tan);
+SIMD_FUNCTION(native_cos);    SIMD_FUNCTION(native_divide); SIMD_FUNCTION(native_exp);
+SIMD_FUNCTION(native_exp10);  SIMD_FUNCTION(native_exp2);   SIMD_FUNCTION(native_log);
+SIMD_FUNCTION(native_log10);  SIMD_FUNCTION(native_log2);   SIMD_FUNCTION(native_powr);
+SIMD_FUNCTION(native_recip);  SIMD_FUNCTION(native_rsqrt);  SIMD_FUNCTION(native_sin);
+SIMD_FUNCTION(native_sqrt);   SIMD_FUNCTION(native_tan);
+
+#undef SIMD_FUNCTION
+
 #define VEXCL_VECTOR_EXPR_EXTRACTOR(name, VG, AG, FG) \
 struct name \
     : boost::proto::or_< \
@@ -367,6 +447,8 @@ struct UserFunction {};
 template<class Impl, class RetType, class... ArgType>
 struct UserFunction<Impl, RetType(ArgType...)> : user_function
 {
+    typedef RetType return_type;
+
     template <class... Arg>
     typename boost::proto::result_of::make_expr<
         boost::proto::tag::function,
@@ -413,6 +495,7 @@ struct UserFunction<Impl, RetType(ArgType...)> : user_function
 template< class Impl, class RetType, BOOST_PP_ENUM_PARAMS(n, class ArgType) > \
 struct UserFunction<Impl, RetType( BOOST_PP_ENUM_PARAMS(n, ArgType) )> : user_function \
 { \
+    typedef RetType return_type; \
     template < BOOST_PP_ENUM_PARAMS(n, class Arg) > \
     typename boost::proto::result_of::make_expr< \
         boost::proto::tag::function, \
@@ -557,12 +640,16 @@ struct extract_user_functions
 struct vector_terminal {};
 template <typename T> class vector;
 
+struct scalar_terminal {};
+template <typename T> class scalar;
+
 //--- Vector grammar --------------------------------------------------------
 struct vector_expr_grammar
     : boost::proto::or_<
           boost::proto::or_<
               boost::proto::or_< boost::proto::terminal< elem_index > >, \
               boost::proto::terminal< vector_terminal >,
+              boost::proto::terminal< scalar_terminal >,
               boost::proto::and_<
                   boost::proto::terminal< boost::proto::_ >,
                   boost::proto::if_< is_cl_native< boost::proto::_value >() >
@@ -694,22 +781,576 @@ struct vector_name_context {
 };
 
 
-// Builds textual representation for a vector expression.
+// Estimates per-element memory traffic and arithmetic of a vector
+// expression. Each vector terminal is counted as one read of its element,
+// and each operation or function call as one flop.
+struct vector_cost_context {
+    size_t bytes;
+    size_t flops;
+
+    vector_cost_context() : bytes(0), flops(0) {}
+
+    template <typename T>
+    static size_t terminal_bytes(const vector<T>&) {
+        return sizeof(T);
+    }
+
+    template <typename Term>
+    static size_t terminal_bytes(const Term&) {
+        return 0;
+    }
+
+    template <typename Expr, typename Tag = typename Expr::proto_tag>
+    struct eval {
+        typedef void result_type;
+
+        void operator()(const Expr &expr, vector_cost_context &ctx) const {
+            ctx.flops++;
+            boost::fusion::for_each(expr, do_eval<vector_cost_context>(ctx));
+        }
+    };
+
+    template <typename Expr>
+    struct eval<Expr, boost::proto::tag::function> {
+        typedef void result_type;
+
+        void operator()(const Expr &expr, vector_cost_context &ctx) const {
+            ctx.flops++;
+            boost::fusion::for_each(
+                    boost::fusion::pop_front(expr),
+                    do_eval<vector_cost_context>(ctx)
+                    );
+        }
+    };
+
+    template <typename Expr>
+    struct eval<Expr, boost::proto::tag::terminal> {
+        typedef void result_type;
+
+        void operator()(const Expr &expr, vector_cost_context &ctx) const {
+            ctx.bytes += terminal_bytes(boost::proto::value(expr));
+        }
+    };
+};
+
+
+//--- Common subexpressions --------------------------------------------------
+
+// Type of a subexpression in the generated code, or void where it is not
+// known. Scalar arithmetic follows the C++ rules, which are those of
+// OpenCL C; a scalar combined with an OpenCL vector gives the vector type.
+// Side effects (increments and decrements) make the type unknown.
+template <class Expr, class Tag = typename boost::proto::tag_of<Expr>::type>
+struct cse_type {
+    typedef void type;
+};
+
+template <class Expr, long I>
+struct cse_child_type {
+    typedef typename cse_type<
+        typename std::decay<
+            typename boost::proto::result_of::child_c<Expr, I>::type
+        >::type
+    >::type type;
+};
+
+template <class Expr>
+struct cse_type<Expr, boost::proto::tag::terminal> {
+    typedef typename std::decay<
+        typename boost::proto::result_of::value<Expr>::type
+        >::type value_type;
+
+    typedef typename std::conditional<
+        std::is_same<value_type, elem_index>::value, size_t,
+        typename std::conditional<
+            is_cl_native<value_type>::value, value_type, void
+            >::type
+        >::type type;
+};
+
+template <typename T>
+struct cse_type<vector<T>, boost::proto::tag::terminal> {
+    typedef typename element_access<T>::compute_type type;
+};
+
+template <typename T>
+struct cse_type<scalar<T>, boost::proto::tag::terminal> {
+    typedef typename element_access<T>::compute_type type;
+};
+
+template <class L, class R,
+         bool known  = !std::is_void<L>::value && !std::is_void<R>::value,
+         bool scalar = std::is_arithmetic<L>::value && std::is_arithmetic<R>::value>
+struct cse_arithmetic {
+    typedef void type;
+};
+
+template <class L, class R>
+struct cse_arithmetic<L, R, true, true> {
+    typedef decltype(std::declval<L>() * std::declval<R>()) type;
+};
+
+template <class L, class R>
+struct cse_arithmetic<L, R, true, false> {
+    typedef typename std::conditional<
+        std::is_same<L, R>::value || std::is_arithmetic<R>::value, L,
+        typename std::conditional<std::is_arithmetic<L>::value, R, void>::type
+        >::type type;
+};
+
+template <class L, class R,
+         bool scalar = std::is_arithmetic<L>::value && std::is_arithmetic<R>::value>
+struct cse_shift : cse_arithmetic<L, R> {};
+
+template <class L, class R>
+struct cse_shift<L, R, true> {
+    typedef decltype(std::declval<L>() << std::declval<R>()) type;
+};
+
+template <class L, class R>
+struct cse_logical {
+    typedef typename std::conditional<
+        std::is_arithmetic<L>::value && std::is_arithmetic<R>::value, int, void
+        >::type type;
+};
+
+template <class A, bool scalar = std::is_arithmetic<A>::value>
+struct cse_promoted {
+    typedef A type;
+};
+
+template <class A>
+struct cse_promoted<A, true> {
+    typedef decltype(+std::declval<A>()) type;
+};
+
+#define VEXCL_CSE_BINARY(the_tag, rule) \
+    template <class Expr> \
+    struct cse_type<Expr, boost::proto::tag::the_tag> \
+        : rule< \
+            typename cse_child_type<Expr, 0>::type, \
+            typename cse_child_type<Expr, 1>::type \
+          > \
+    {}
+
+VEXCL_CSE_BINARY(plus,          cse_arithmetic);
+VEXCL_CSE_BINARY(minus,         cse_arithmetic);
+VEXCL_CSE_BINARY(multiplies,    cse_arithmetic);
+VEXCL_CSE_BINARY(divides,       cse_arithmetic);
+VEXCL_CSE_BINARY(modulus,       cse_arithmetic);
+VEXCL_CSE_BINARY(bitwise_and,   cse_arithmetic);
+VEXCL_CSE_BINARY(bitwise_or,    cse_arithmetic);
+VEXCL_CSE_BINARY(bitwise_xor,   cse_arithmetic);
+VEXCL_CSE_BINARY(shift_left,    cse_shift);
+VEXCL_CSE_BINARY(shift_right,   cse_shift);
+VEXCL_CSE_BINARY(less,          cse_logical);
+VEXCL_CSE_BINARY(greater,       cse_logical);
+VEXCL_CSE_BINARY(less_equal,    cse_logical);
+VEXCL_CSE_BINARY(greater_equal, cse_logical);
+VEXCL_CSE_BINARY(equal_to,      cse_logical);
+VEXCL_CSE_BINARY(not_equal_to,  cse_logical);
+VEXCL_CSE_BINARY(logical_and,   cse_logical);
+VEXCL_CSE_BINARY(logical_or,    cse_logical);
+
+#undef VEXCL_CSE_BINARY
+
+template <class Expr>
+struct cse_type<Expr, boost::proto::tag::unary_plus>
+    : cse_promoted<typename cse_child_type<Expr, 0>::type> {};
+
+template <class Expr>
+struct cse_type<Expr, boost::proto::tag::negate>
+    : cse_promoted<typename cse_child_type<Expr, 0>::type> {};
+
+template <class Expr>
+struct cse_type<Expr, boost::proto::tag::logical_not>
+    : cse_logical<typename cse_child_type<Expr, 0>::type, int> {};
+
+// Common type of the arguments of a function call (void if they differ),
+// and whether the types of all of them are known.
+template <class Expr, long I = 1, long N = boost::proto::arity_of<Expr>::value,
+         int state = (I >= N ? 0 : (I + 1 == N ? 1 : 2))>
+struct cse_arguments {
+    typedef void common;
+    static const bool known = true;
+};
+
+template <class Expr, long I, long N>
+struct cse_arguments<Expr, I, N, 1> {
+    typedef typename cse_child_type<Expr, I>::type common;
+    static const bool known = !std::is_void<common>::value;
+};
+
+template <class Expr, long I, long N>
+struct cse_arguments<Expr, I, N, 2> {
+    typedef typename cse_child_type<Expr, I>::type head;
+    typedef cse_arguments<Expr, I + 1, N> tail;
+
+    typedef typename std::conditional<
+        std::is_same<head, typename tail::common>::value, head, void
+        >::type common;
+    static const bool known = !std::is_void<head>::value && tail::known;
+};
+
+// User functions return their declared type; builtins that take and return
+// gentype return the type of their arguments.
+template <class Expr, class F,
+         int kind = std::is_base_of<user_function, F>::value ? 1 :
+                    is_simd_function<F>::value ? 2 : 0>
+struct cse_function {
+    typedef void type;
+};
+
+template <class Expr, class F>
+struct cse_function<Expr, F, 1> {
+    typedef typename std::conditional<
+        cse_arguments<Expr>::known, typename F::return_type, void
+        >::type type;
+};
+
+template <class Expr, class F>
+struct cse_function<Expr, F, 2> {
+    typedef typename cse_arguments<Expr>::common type;
+};
+
+template <class Expr>
+struct cse_type<Expr, boost::proto::tag::function>
+    : cse_function<Expr,
+        typename std::decay<
+            typename boost::proto::result_of::value<
+                typename boost::proto::result_of::child_c<Expr, 0>::type
+            >::type
+        >::type
+      >
+{};
+
+// Records, for each parameter of an expression, the first parameter that
+// refers to the same terminal object: the same vector or scalar, or the
+// same literal variable. Each function call gets the first call of the same
+// user function.
+struct find_aliases {
+    std::vector<int> &alias;
+    mutable std::vector< std::pair<const void*, const std::type_info*> > seen;
+
+    find_aliases(std::vector<int> &alias) : alias(alias) {}
+
+    template <class Term>
+    void operator()(const Term &term) const {
+        std::pair<const void*, const std::type_info*> key(
+                &boost::proto::value(term), &typeid(boost::proto::value(term)));
+
+        auto s = std::find(seen.begin(), seen.end(), key);
+
+        alias.push_back(static_cast<int>(s - seen.begin()) + 1);
+        if (s == seen.end()) seen.push_back(key);
+        else seen.push_back(std::make_pair(static_cast<const void*>(0), key.second));
+    }
+};
+
+struct find_function_aliases {
+    std::vector<int> &alias;
+    mutable std::vector<const std::type_info*> seen;
+
+    find_function_aliases(std::vector<int> &alias) : alias(alias) {}
+
+    template <class FunCall>
+    void operator()(const FunCall &expr) const {
+        const std::type_info *key = &typeid(boost::proto::value(expr));
+
+        auto s = std::find(seen.begin(), seen.end(), key);
+
+        alias.push_back(static_cast<int>(s - seen.begin()) + 1);
+        seen.push_back(s == seen.end() ? key : 0);
+    }
+};
+
+// Common subexpression elimination in the code of an expression.
+// Parameters that refer to the same terminal are written with the name of
+// the first of them, so that repeated subexpressions of the code are
+// textually equal. A counting pass over the expression finds the repeated
+// ones, which are then written once into private temporaries declared
+// ahead of the statement using the expression (see write_with_cse()).
+// Aliasing of the parameters depends on the terminals and not only on the
+// expression type, so kernels with aliases are cached under signature().
+// Defining VEXCL_NO_CSE turns the elimination off.
+struct expression_cse {
+    enum pass_type {
+        rename, // Parameters are written with their aliases.
+        count,  // Occurrences of subexpressions are counted.
+        emit    // Repeated subexpressions are written as temporaries.
+    };
+
+    std::vector<int> prm_alias, fun_alias;
+
+    std::map<std::string, int>         uses;
+    std::map<std::string, std::string> temp;
+    std::vector<std::string>           decl;
+
+    template <class Expr>
+    explicit expression_cse(const Expr &expr) {
+#ifndef VEXCL_NO_CSE
+        extract_terminals()(expr, find_aliases(prm_alias));
+        extract_user_functions()(expr, find_function_aliases(fun_alias));
+#else
+        (void)expr;
+#endif
+    }
+
+    // The parameter (function) that parameter (function) i is written as.
+    int parameter(int i) const {
+        return i <= static_cast<int>(prm_alias.size()) ? prm_alias[i - 1] : i;
+    }
+
+    int function(int i) const {
+        return i <= static_cast<int>(fun_alias.size()) ? fun_alias[i - 1] : i;
+    }
+
+    // Declarations of the temporaries, one per line.
+    std::string declarations(const std::string &indent) const {
+        std::string s;
+        for(auto d = decl.begin(); d != decl.end(); ++d)
+            s += indent + *d + "\n";
+        return s;
+    }
+
+    // Kernel cache signature of the parameter aliases of expr; empty
+    // when every parameter refers to its own terminal.
+    template <class Expr>
+    static std::string signature(const Expr &expr) {
+#ifndef VEXCL_NO_CSE
+        std::vector<int> alias;
+        extract_terminals()(expr, find_aliases(alias));
+
+        bool aliased = false;
+        for(size_t i = 0; i < alias.size(); i++)
+            if (alias[i] != static_cast<int>(i + 1)) aliased = true;
+
+        if (aliased) {
+            std::ostringstream s;
+            s << " cse=";
+            for(size_t i = 0; i < alias.size(); i++) s << alias[i] << ',';
+            return s.str();
+        }
+#else
+        (void)expr;
+#endif
+        return std::string();
+    }
+};
+
+// Common subexpression elimination at a node of the expression written by
+// ctx (vector_expr_context or vector_simd_context). Returns true when the
+// node has been written: as a temporary, or in full while counting.
+template <class Context, class Expr>
+bool write_common_subexpression(Context &ctx, const Expr &expr) {
+    expression_cse *cse = ctx.cse;
+
+    if (!cse || ctx.cse_pass == expression_cse::rename) return false;
+    if (ctx.cse_skip) {
+        ctx.cse_skip = false;
+        return false;
+    }
+
+    int prm_idx = ctx.prm_idx, fun_idx = ctx.fun_idx;
+
+    if (ctx.cse_pass == expression_cse::count) {
+        std::string s = ctx.render(expr, expression_cse::count);
+        cse->uses[ctx.cse_key(s)]++;
+        ctx.os << s;
+        return true;
+    }
+
+    if (!ctx.template cse_hoistable<Expr>()) return false;
+
+    std::string key = ctx.cse_key(ctx.render(expr, expression_cse::rename));
+
+    if (cse->uses[key] < 2) {
+        ctx.prm_idx = prm_idx;
+        ctx.fun_idx = fun_idx;
+        return false;
+    }
+
+    auto t = cse->temp.find(key);
+    if (t == cse->temp.end()) {
+        ctx.prm_idx = prm_idx;
+        ctx.fun_idx = fun_idx;
+
+        std::string value = ctx.render(expr, expression_cse::emit);
+        std::string name  = "cse_" + std::to_string(ctx.cmp_idx)
+                          + "_" + std::to_string(cse->decl.size() + 1);
+
+        cse->decl.push_back(ctx.template cse_type_name<Expr>()
+                + " " + name + " = " + value + ";");
+
+        t = cse->temp.insert(std::make_pair(key, name)).first;
+    }
+
+    ctx.os << t->second;
+    return true;
+}
+
+// Writes expr with ctx, with its repeated subexpressions computed into the
+// temporaries of cse.
+template <class Context, class Expr>
+void write_with_cse(Context &ctx, const Expr &expr, expression_cse &cse) {
+#ifndef VEXCL_NO_CSE
+    int prm_idx = ctx.prm_idx, fun_idx = ctx.fun_idx;
+
+    ctx.cse = &cse;
+    ctx.render(expr, expression_cse::count);
+
+    ctx.prm_idx  = prm_idx;
+    ctx.fun_idx  = fun_idx;
+    ctx.cse_pass = expression_cse::emit;
+#else
+    (void)cse;
+#endif
+    boost::proto::eval(expr, ctx);
+}
+
+template <class Context, class L, class R>
+bool write_contraction(Context &ctx, const L &l, const R &r, bool minus);
+
+// Builds textual representation for a vector expression. With
+// fold_literals, arithmetic literals are referred to by the VEXCL_SPEC_*
+// macros of define_expression_literal instead of kernel parameters. After
+// contract<T>(), multiply-adds on T are written as calls to fma_fun (see
+// write_contraction()).
 struct vector_expr_context {
     std::ostream &os;
     int cmp_idx, prm_idx, fun_idx;
+    bool fold_literals;
+    std::string fma_fun, fma_type;
+    size_t fma_size;
+
+    expression_cse            *cse;
+    expression_cse::pass_type cse_pass;
+    bool                      cse_skip;
+
+    vector_expr_context(std::ostream &os, int cmp_idx = 1, bool fold_literals = false)
+        : os(os), cmp_idx(cmp_idx), prm_idx(0), fun_idx(0),
+          fold_literals(fold_literals), fma_size(0),
+          cse(0), cse_pass(expression_cse::rename), cse_skip(false) {}
+
+    // Number the next parameter is written with.
+    int prm_number() {
+        ++prm_idx;
+        return cse ? cse->parameter(prm_idx) : prm_idx;
+    }
 
-    vector_expr_context(std::ostream &os, int cmp_idx = 1)
-        : os(os), cmp_idx(cmp_idx), prm_idx(0), fun_idx(0) {}
+    // Number the next user function is called with.
+    int fun_number() {
+        ++fun_idx;
+        return cse ? cse->function(fun_idx) : fun_idx;
+    }
+
+    // Name of the next parameter.
+    std::string prm_name() {
+        return "prm_" + std::to_string(cmp_idx) + "_" + std::to_string(prm_number());
+    }
+
+    // Continues the numbering, contraction and elimination of ctx.
+    void inherit(const vector_expr_context &ctx) {
+        prm_idx  = ctx.prm_idx;
+        fun_idx  = ctx.fun_idx;
+        fma_fun  = ctx.fma_fun;
+        fma_type = ctx.fma_type;
+        fma_size = ctx.fma_size;
+        cse      = ctx.cse;
+        cse_pass = ctx.cse_pass;
+    }
+
+    // Writes the subexpression on its own, in the given pass of the common
+    // subexpression elimination (see write_common_subexpression()).
+    template <class Expr>
+    std::string render(const Expr &expr, expression_cse::pass_type pass) {
+        std::ostringstream s;
+        vector_expr_context ctx(s, cmp_idx, fold_literals);
+        ctx.inherit(*this);
+        ctx.cse_pass = pass;
+        ctx.cse_skip = true;
+
+        boost::proto::eval(expr, ctx);
+
+        prm_idx = ctx.prm_idx;
+        fun_idx = ctx.fun_idx;
+
+        return s.str();
+    }
+
+    static const std::string& cse_key(const std::string &code) {
+        return code;
+    }
+
+    template <class Expr>
+    static bool cse_hoistable() {
+        return is_cl_native<typename cse_type<Expr>::type>::value;
+    }
+
+    template <class Expr>
+    static std::string cse_type_name() {
+        return type_name<typename cse_type<Expr>::type>();
+    }
+
+    // Contracts multiply-adds computed in T into fun ("fma" or "mad").
+    template <typename T>
+    void contract(const std::string &fun) {
+        typedef typename element_access<T>::compute_type real;
+
+        if (fun.empty() || !std::is_floating_point<real>::value) return;
+
+        fma_fun  = fun;
+        fma_type = type_name<real>();
+        fma_size = sizeof(real);
+    }
+
+    // Operand of a contracted multiply-add, converted to fma_type.
+    template <class Expr>
+    std::string fma_operand(const Expr &expr) {
+        std::ostringstream s;
+        vector_expr_context ctx(s, cmp_idx, fold_literals);
+        ctx.inherit(*this);
+
+        s << "((" << fma_type << ")(";
+        boost::proto::eval(expr, ctx);
+        s << "))";
+
+        prm_idx = ctx.prm_idx;
+        fun_idx = ctx.fun_idx;
+
+        return s.str();
+    }
 
     template <typename Expr, typename Tag = typename Expr::proto_tag>
     struct eval {};
 
+#define ADDITIVE_OPERATION(the_tag, the_op, minus) \
+    template <typename Expr> \
+    struct eval<Expr, boost::proto::tag::the_tag> { \
+        typedef void result_type; \
+        void operator()(const Expr &expr, vector_expr_context &ctx) const { \
+            if (write_common_subexpression(ctx, expr)) return; \
+            if (write_contraction(ctx, boost::proto::left(expr), \
+                        boost::proto::right(expr), minus)) return; \
+            ctx.os << "( "; \
+            boost::proto::eval(boost::proto::left(expr), ctx); \
+            ctx.os << " " #the_op " "; \
+            boost::proto::eval(boost::proto::right(expr), ctx); \
+            ctx.os << " )"; \
+        } \
+    }
+
+    ADDITIVE_OPERATION(plus,  +, false);
+    ADDITIVE_OPERATION(minus, -, true);
+
+#undef ADDITIVE_OPERATION
+
 #define BINARY_OPERATION(the_tag, the_op) \
     template <typename Expr> \
     struct eval<Expr, boost::proto::tag::the_tag> { \
         typedef void result_type; \
         void operator()(const Expr &expr, vector_expr_context &ctx) const { \
+            if (write_common_subexpression(ctx, expr)) return; \
             ctx.os << "( "; \
             boost::proto::eval(boost::proto::left(expr), ctx); \
             ctx.os << " " #the_op " "; \
@@ -718,8 +1359,6 @@ struct vector_expr_context {
         } \
     }
 
-    BINARY_OPERATION(plus,          +);
-    BINARY_OPERATION(minus,         -);
     BINARY_OPERATION(multiplies,    *);
     BINARY_OPERATION(divides,       /);
     BINARY_OPERATION(modulus,       %);
@@ -744,6 +1383,7 @@ struct vector_expr_context {
     struct eval<Expr, boost::proto::tag::the_tag> { \
         typedef void result_type; \
         void operator()(const Expr &expr, vector_expr_context &ctx) const { \
+            if (write_common_subexpression(ctx, expr)) return; \
             ctx.os << "( " #the_op "( "; \
             boost::proto::eval(boost::proto::child(expr), ctx); \
             ctx.os << " ) )"; \
@@ -763,6 +1403,7 @@ struct vector_expr_context {
     struct eval<Expr, boost::proto::tag::the_tag> { \
         typedef void result_type; \
         void operator()(const Expr &expr, vector_expr_context &ctx) const { \
+            if (write_common_subexpression(ctx, expr)) return; \
             ctx.os << "( ( "; \
             boost::proto::eval(boost::proto::child(expr), ctx); \
             ctx.os << " )" #the_op " )"; \
@@ -802,6 +1443,7 @@ struct vector_expr_context {
         void
         >::type
         operator()(const FunCall &expr, vector_expr_context &ctx) const {
+            if (write_common_subexpression(ctx, expr)) return;
             ctx.os << boost::proto::value(boost::proto::child_c<0>(expr)).name() << "( ";
             boost::fusion::for_each(
                     boost::fusion::pop_front(expr), do_eval(ctx)
@@ -820,7 +1462,8 @@ struct vector_expr_context {
         void
         >::type
         operator()(const FunCall &expr, vector_expr_context &ctx) const {
-            ctx.os << "func_" << ctx.cmp_idx << "_" << ++ctx.fun_idx << "( ";
+            if (write_common_subexpression(ctx, expr)) return;
+            ctx.os << "func_" << ctx.cmp_idx << "_" << ctx.fun_number() << "( ";
             boost::fusion::for_each(
                     boost::fusion::pop_front(expr), do_eval(ctx)
                     );
@@ -833,8 +1476,15 @@ struct vector_expr_context {
         typedef void result_type;
 
         template <typename T>
-        void operator()(const vector<T> &, vector_expr_context &ctx) const {
-            ctx.os << "prm_" << ctx.cmp_idx << "_" << ++ctx.prm_idx << "[idx]";
+        void operator()(const vector<T> &term, vector_expr_context &ctx) const {
+            if (write_common_subexpression(ctx, term)) return;
+            ctx.os << element_access<T>::load(ctx.prm_name(), "idx");
+        }
+
+        template <typename T>
+        void operator()(const scalar<T> &term, vector_expr_context &ctx) const {
+            if (write_common_subexpression(ctx, term)) return;
+            ctx.os << element_access<T>::load(ctx.prm_name(), "0");
         }
 
         template <typename Term>
@@ -843,7 +1493,12 @@ struct vector_expr_context {
             void
         >::type
         operator()(const Term &, vector_expr_context &ctx) const {
-            ctx.os << "prm_" << ctx.cmp_idx << "_" << ++ctx.prm_idx;
+            typedef typename std::decay<
+                typename boost::proto::result_of::value<Term>::type
+                >::type value_type;
+
+            ctx.os << (ctx.fold_literals && std::is_arithmetic<value_type>::value ?
+                    "VEXCL_SPEC_" : "prm_") << ctx.cmp_idx << "_" << ctx.prm_number();
         }
 
         template <typename Term>
@@ -852,72 +1507,993 @@ struct vector_expr_context {
             void
         >::type
         operator()(const Term &, vector_expr_context &ctx) const {
-            ctx.os << "( prm_" << ctx.cmp_idx << "_" << ++ctx.prm_idx
+            ctx.os << "( prm_" << ctx.cmp_idx << "_" << ctx.prm_number()
                    << " + idx )";
         }
     };
 };
 
-struct declare_user_function {
-    std::ostream &os;
-    int cmp_idx;
-    mutable int fun_idx;
-
-    declare_user_function(std::ostream &os, int cmp_idx = 1)
-        : os(os), cmp_idx(cmp_idx), fun_idx(0) {}
-
-        template <class FunCall>
-        void operator()(const FunCall &expr) const {
-            std::ostringstream name;
-            name << "func_" << cmp_idx << "_" << ++fun_idx;
-
-            // Output function definition and continue with parameters.
-            boost::proto::value(expr).define(os, name.str());
-        }
-};
-
-struct declare_expression_parameter {
-    std::ostream &os;
-    int cmp_idx;
-    mutable int prm_idx;
+// Counts vector terminals of an expression.
+struct count_vector_terminals {
+    size_t &count;
 
-    declare_expression_parameter(std::ostream &os, int cmp_idx = 1)
-    : os(os), cmp_idx(cmp_idx), prm_idx(0) {}
+    count_vector_terminals(size_t &count) : count(count) {}
 
     template <typename T>
     void operator()(const vector<T> &) const {
-        os << ",\n\tglobal " << type_name<T>() << " *prm_"
-           << cmp_idx << "_" << ++prm_idx;
+        ++count;
     }
 
     template <typename Term>
-    void operator()(const Term &) const {
-        os << ",\n\t"
-           << type_name< typename boost::proto::result_of::value<Term>::type >()
-           << " prm_" << cmp_idx << "_" << ++prm_idx;
-    }
+    void operator()(const Term &) const {}
 };
 
-struct set_expression_argument {
-    cl::Kernel &krn;
-    uint dev, &pos;
-    size_t part_start;
+template <class Expr>
+bool has_vector_terminals(const Expr &expr) {
+    size_t count = 0;
+    extract_terminals()(expr, count_vector_terminals(count));
+    return count > 0;
+}
 
-    set_expression_argument(cl::Kernel &krn, uint dev, uint &pos, size_t part_start)
-        : krn(krn), dev(dev), pos(pos), part_start(part_start) {}
+// Operations that apply component-wise to OpenCL vectors of T.
+template <class Tag, typename T>
+struct simd_operation : std::false_type {};
+
+#define SIMD_OPERATION(the_tag, cond) \
+template <typename T> \
+struct simd_operation<boost::proto::tag::the_tag, T> \
+    : std::integral_constant<bool, cond> {}
+
+SIMD_OPERATION(plus,        true);
+SIMD_OPERATION(minus,       true);
+SIMD_OPERATION(multiplies,  true);
+SIMD_OPERATION(divides,     true);
+SIMD_OPERATION(unary_plus,  true);
+SIMD_OPERATION(negate,      true);
+SIMD_OPERATION(modulus,     std::is_integral<T>::value);
+SIMD_OPERATION(shift_left,  std::is_integral<T>::value);
+SIMD_OPERATION(shift_right, std::is_integral<T>::value);
+SIMD_OPERATION(bitwise_and, std::is_integral<T>::value);
+SIMD_OPERATION(bitwise_or,  std::is_integral<T>::value);
+SIMD_OPERATION(bitwise_xor, std::is_integral<T>::value);
+
+#undef SIMD_OPERATION
+
+// Checks if a vector expression with result type V may be evaluated for
+// several consecutive elements at once on OpenCL vector types (see
+// vector_simd_context). This is the case when all vector terminals are of
+// type V, the scalars convert to the type T that V is computed in exactly as
+// they would in the scalar kernel, and only component-wise operations and
+// builtins are applied. Comparisons and logical operations (-1 is true for
+// vector types), user functions and element indices keep the expression
+// scalar.
+template <typename V>
+struct vector_simd_check {
+    typedef typename element_access<V>::compute_type T;
+
+    bool ok;
+
+    vector_simd_check()
+        : ok(std::is_arithmetic<T>::value && !std::is_same<T, bool>::value) {}
+
+    template <typename U>
+    struct convertible : std::integral_constant<bool,
+        std::is_arithmetic<U>::value && !std::is_same<U, bool>::value &&
+        sizeof(U) <= sizeof(T) &&
+        (std::is_floating_point<T>::value || std::is_integral<U>::value)
+        >
+    {};
 
-    template <typename T>
-    void operator()(const vector<T> &term) const {
-        krn.setArg(pos++, term(dev));
-    }
+    template <typename Expr, typename Tag = typename Expr::proto_tag>
+    struct eval {
+        typedef void result_type;
 
-    template <typename Term>
+        void operator()(const Expr &expr, vector_simd_check &ctx) const {
+            ctx.ok = ctx.ok && simd_operation<Tag, T>::value;
+            boost::fusion::for_each(expr, do_eval<vector_simd_check>(ctx));
+        }
+    };
+
+    template <typename Expr>
+    struct eval<Expr, boost::proto::tag::function> {
+        typedef void result_type;
+
+        template <class FunCall>
+        void operator()(const FunCall &expr, vector_simd_check &ctx) const {
+            typedef typename boost::proto::result_of::value<
+                typename boost::proto::result_of::child_c<FunCall,0>::type
+                >::type fun;
+
+            ctx.ok = ctx.ok && std::is_floating_point<T>::value &&
+                is_simd_function<typename std::decay<fun>::type>::value;
+
+            boost::fusion::for_each(
+                    boost::fusion::pop_front(expr),
+                    do_eval<vector_simd_check>(ctx)
+                    );
+        }
+    };
+
+    template <typename Expr>
+    struct eval<Expr, boost::proto::tag::terminal> {
+        typedef void result_type;
+
+        template <typename U>
+        void operator()(const vector<U> &, vector_simd_check &ctx) const {
+            ctx.ok = ctx.ok && std::is_same<U, V>::value;
+        }
+
+        template <typename U>
+        void operator()(const scalar<U> &, vector_simd_check &ctx) const {
+            ctx.ok = ctx.ok && convertible<U>::value;
+        }
+
+        template <typename Term>
+        void operator()(const Term &, vector_simd_check &ctx) const {
+            typedef typename std::decay<
+                typename boost::proto::result_of::value<Term>::type
+                >::type value_type;
+
+            ctx.ok = ctx.ok && convertible<value_type>::value;
+        }
+    };
+};
+
+template <typename T, class Expr>
+bool vector_simd_ok(const Expr &expr) {
+    vector_simd_check<T> ctx;
+    boost::proto::eval(expr, ctx);
+    return ctx.ok;
+}
+
+// Checks if an operand of a multiply-add may be converted to the floating
+// point type the multiply-add is contracted on without changing the result
+// of any operation in it. This is the case when its vector and scalar
+// terminals are of the type, its literals are arithmetic and not larger
+// than the type, and only arithmetic operations and component-wise builtins
+// are applied. 'typed' is set when the operand has a vector or scalar
+// terminal, and so is itself computed in the type.
+struct contraction_check {
+    const std::string &type;
+    size_t size;
+    bool ok, typed;
+
+    contraction_check(const std::string &type, size_t size)
+        : type(type), size(size), ok(true), typed(false) {}
+
+    template <typename Expr, typename Tag = typename Expr::proto_tag>
+    struct eval {
+        typedef void result_type;
+
+        void operator()(const Expr &expr, contraction_check &ctx) const {
+            ctx.ok = ctx.ok && simd_operation<Tag, double>::value;
+            boost::fusion::for_each(expr, do_eval<contraction_check>(ctx));
+        }
+    };
+
+    template <typename Expr>
+    struct eval<Expr, boost::proto::tag::function> {
+        typedef void result_type;
+
+        template <class FunCall>
+        void operator()(const FunCall &expr, contraction_check &ctx) const {
+            typedef typename boost::proto::result_of::value<
+                typename boost::proto::result_of::child_c<FunCall,0>::type
+                >::type fun;
+
+            ctx.ok = ctx.ok && is_simd_function<typename std::decay<fun>::type>::value;
+
+            boost::fusion::for_each(
+                    boost::fusion::pop_front(expr),
+                    do_eval<contraction_check>(ctx)
+                    );
+        }
+    };
+
+    template <typename Expr>
+    struct eval<Expr, boost::proto::tag::terminal> {
+        typedef void result_type;
+
+        template <typename U>
+        void operator()(const vector<U> &, contraction_check &ctx) const {
+            typed<U>(ctx);
+        }
+
+        template <typename U>
+        void operator()(const scalar<U> &, contraction_check &ctx) const {
+            typed<U>(ctx);
+        }
+
+        template <typename Term>
+        void operator()(const Term &, contraction_check &ctx) const {
+            typedef typename std::decay<
+                typename boost::proto::result_of::value<Term>::type
+                >::type value_type;
+
+            ctx.ok = ctx.ok &&
+                std::is_arithmetic<value_type>::value &&
+                !std::is_same<value_type, bool>::value &&
+                sizeof(value_type) <= ctx.size;
+        }
+
+        template <typename U>
+        static void typed(contraction_check &ctx) {
+            ctx.ok = ctx.ok &&
+                type_name<typename element_access<U>::compute_type>() == ctx.type;
+            ctx.typed = true;
+        }
+    };
+};
+
+template <class Context, class Mul, class Add>
+typename std::enable_if<
+    !std::is_same<typename Mul::proto_tag, boost::proto::tag::multiplies>::value,
+    bool
+>::type
+write_product_sum(Context&, const Mul&, const Add&, bool, bool, bool) {
+    return false;
+}
+
+// Writes [-]a * b + [-]c as fma_fun(a, b, c) when mul = a * b and the
+// operands pass contraction_check, with a or b computed in the type. The
+// operands are evaluated in the order they occur in the expression, so that
+// parameter numbering is unchanged.
+template <class Context, class Mul, class Add>
+typename std::enable_if<
+    std::is_same<typename Mul::proto_tag, boost::proto::tag::multiplies>::value,
+    bool
+>::type
+write_product_sum(Context &ctx, const Mul &mul, const Add &add,
+        bool mul_first, bool neg_mul, bool neg_add)
+{
+    contraction_check a(ctx.fma_type, ctx.fma_size);
+    contraction_check b(ctx.fma_type, ctx.fma_size);
+    contraction_check c(ctx.fma_type, ctx.fma_size);
+
+    boost::proto::eval(boost::proto::left(mul),  a);
+    boost::proto::eval(boost::proto::right(mul), b);
+    boost::proto::eval(add, c);
+
+    if (!(a.ok && b.ok && c.ok && (a.typed || b.typed))) return false;
+
+    std::string sa, sb, sc;
+    if (mul_first) {
+        sa = ctx.fma_operand(boost::proto::left(mul));
+        sb = ctx.fma_operand(boost::proto::right(mul));
+        sc = ctx.fma_operand(add);
+    } else {
+        sc = ctx.fma_operand(add);
+        sa = ctx.fma_operand(boost::proto::left(mul));
+        sb = ctx.fma_operand(boost::proto::right(mul));
+    }
+
+    ctx.os << ctx.fma_fun << "( " << (neg_mul ? "-" : "") << sa << ", " << sb
+           << ", " << (neg_add ? "-" : "") << sc << " )";
+
+    return true;
+}
+
+// Writes l + r (l - r when minus) as a contracted multiply-add, if the
+// context contracts and either side is a suitable product. Returns false
+// when nothing was written.
+template <class Context, class L, class R>
+bool write_contraction(Context &ctx, const L &l, const R &r, bool minus) {
+    if (ctx.fma_fun.empty()) return false;
+
+    return write_product_sum(ctx, l, r, true,  false, minus) ||
+           write_product_sum(ctx, r, l, false, minus, false);
+}
+
+// Builds textual representation for a vector expression evaluated for
+// 'width' consecutive elements starting at idx. Vector terminals are loaded
+// with vloadN; subexpressions without vector terminals are generated as in
+// vector_expr_context and broadcast to the vector type, so that scalar
+// arithmetic (e.g. integer division of literals) is left unchanged.
+// Parameter names and contracted multiply-adds match those of
+// vector_expr_context.
+struct vector_simd_context {
+    std::ostream &os;
+    std::string vtype;
+    uint width;
+    int cmp_idx, prm_idx, fun_idx;
+    bool fold_literals;
+    std::string fma_fun, fma_type;
+    size_t fma_size;
+
+    expression_cse            *cse;
+    expression_cse::pass_type cse_pass;
+    bool                      cse_skip;
+
+    vector_simd_context(std::ostream &os, const std::string &type, uint width,
+            int cmp_idx = 1, bool fold_literals = false)
+        : os(os), vtype(type + std::to_string(width)), width(width),
+          cmp_idx(cmp_idx), prm_idx(0), fun_idx(0), fold_literals(fold_literals),
+          fma_size(0), cse(0), cse_pass(expression_cse::rename), cse_skip(false) {}
+
+    // Number the next parameter is written with.
+    int prm_number() {
+        ++prm_idx;
+        return cse ? cse->parameter(prm_idx) : prm_idx;
+    }
+
+    // Contracts multiply-adds computed in T into fun ("fma" or "mad").
+    template <typename T>
+    void contract(const std::string &fun) {
+        vector_expr_context ctx(os);
+        ctx.contract<T>(fun);
+
+        fma_fun  = ctx.fma_fun;
+        fma_type = ctx.fma_type;
+        fma_size = ctx.fma_size;
+    }
+
+    // Writes the subexpression as in vector_expr_context.
+    template <class Expr>
+    void scalar(const Expr &expr) {
+        vector_expr_context scalar_ctx(os, cmp_idx, fold_literals);
+        scalar_ctx.prm_idx  = prm_idx;
+        scalar_ctx.fun_idx  = fun_idx;
+        scalar_ctx.fma_fun  = fma_fun;
+        scalar_ctx.fma_type = fma_type;
+        scalar_ctx.fma_size = fma_size;
+        scalar_ctx.cse      = cse;
+        scalar_ctx.cse_pass = cse_pass;
+
+        boost::proto::eval(expr, scalar_ctx);
+
+        prm_idx = scalar_ctx.prm_idx;
+        fun_idx = scalar_ctx.fun_idx;
+    }
+
+    // Operand of a contracted multiply-add, as a vector.
+    template <class Expr>
+    std::string fma_operand(const Expr &expr) {
+        std::ostringstream s;
+        vector_simd_context ctx(s, "", width, cmp_idx, fold_literals);
+        ctx.inherit(*this);
+
+        s << "(";
+        boost::proto::eval(expr, ctx);
+        s << ")";
+
+        prm_idx = ctx.prm_idx;
+        fun_idx = ctx.fun_idx;
+
+        return s.str();
+    }
+
+    // Continues the type, numbering, contraction and elimination of ctx.
+    void inherit(const vector_simd_context &ctx) {
+        vtype    = ctx.vtype;
+        prm_idx  = ctx.prm_idx;
+        fun_idx  = ctx.fun_idx;
+        fma_fun  = ctx.fma_fun;
+        fma_type = ctx.fma_type;
+        fma_size = ctx.fma_size;
+        cse      = ctx.cse;
+        cse_pass = ctx.cse_pass;
+    }
+
+    // Writes the subexpression on its own, as in vector_expr_context.
+    template <class Expr>
+    std::string render(const Expr &expr, expression_cse::pass_type pass) {
+        std::ostringstream s;
+        vector_simd_context ctx(s, "", width, cmp_idx, fold_literals);
+        ctx.inherit(*this);
+        ctx.cse_pass = pass;
+        ctx.cse_skip = true;
+
+        boost::proto::eval(expr, ctx);
+
+        prm_idx = ctx.prm_idx;
+        fun_idx = ctx.fun_idx;
+
+        return s.str();
+    }
+
+    // Every subexpression written here is of the vector type; the keys are
+    // kept apart from those of the scalar subexpressions.
+    std::string cse_key(const std::string &code) const {
+        return vtype + ": " + code;
+    }
+
+    template <class Expr>
+    static bool cse_hoistable() {
+        return true;
+    }
+
+    template <class Expr>
+    std::string cse_type_name() const {
+        return vtype;
+    }
+
+    // Writes the subexpression as a broadcast scalar. Returns false if it
+    // has vector terminals and so has to be vectorized itself.
+    template <class Expr>
+    bool broadcast(const Expr &expr) {
+        if (has_vector_terminals(expr)) return false;
+
+        os << "((" << vtype << ")(";
+        scalar(expr);
+        os << "))";
+        return true;
+    }
+
+    // Operations rejected by vector_simd_check only get here in kernels
+    // that are never generated; they are written as scalars to compile.
+    template <typename Expr, typename Tag = typename Expr::proto_tag>
+    struct eval {
+        typedef void result_type;
+
+        void operator()(const Expr &expr, vector_simd_context &ctx) const {
+            ctx.scalar(expr);
+        }
+    };
+
+#define ADDITIVE_OPERATION(the_tag, the_op, minus) \
+    template <typename Expr> \
+    struct eval<Expr, boost::proto::tag::the_tag> { \
+        typedef void result_type; \
+        void operator()(const Expr &expr, vector_simd_context &ctx) const { \
+            if (write_common_subexpression(ctx, expr)) return; \
+            if (ctx.broadcast(expr)) return; \
+            if (write_contraction(ctx, boost::proto::left(expr), \
+                        boost::proto::right(expr), minus)) return; \
+            ctx.os << "( "; \
+            boost::proto::eval(boost::proto::left(expr), ctx); \
+            ctx.os << " " #the_op " "; \
+            boost::proto::eval(boost::proto::right(expr), ctx); \
+            ctx.os << " )"; \
+        } \
+    }
+
+    ADDITIVE_OPERATION(plus,  +, false);
+    ADDITIVE_OPERATION(minus, -, true);
+
+#undef ADDITIVE_OPERATION
+
+#define BINARY_OPERATION(the_tag, the_op) \
+    template <typename Expr> \
+    struct eval<Expr, boost::proto::tag::the_tag> { \
+        typedef void result_type; \
+        void operator()(const Expr &expr, vector_simd_context &ctx) const { \
+            if (write_common_subexpression(ctx, expr)) return; \
+            if (ctx.broadcast(expr)) return; \
+            ctx.os << "( "; \
+            boost::proto::eval(boost::proto::left(expr), ctx); \
+            ctx.os << " " #the_op " "; \
+            boost::proto::eval(boost::proto::right(expr), ctx); \
+            ctx.os << " )"; \
+        } \
+    }
+
+    BINARY_OPERATION(multiplies,    *);
+    BINARY_OPERATION(divides,       /);
+    BINARY_OPERATION(modulus,       %);
+    BINARY_OPERATION(shift_left,   <<);
+    BINARY_OPERATION(shift_right,  >>);
+    BINARY_OPERATION(bitwise_and,   &);
+    BINARY_OPERATION(bitwise_or,    |);
+    BINARY_OPERATION(bitwise_xor,   ^);
+
+#undef BINARY_OPERATION
+
+#define UNARY_PRE_OPERATION(the_tag, the_op) \
+    template <typename Expr> \
+    struct eval<Expr, boost::proto::tag::the_tag> { \
+        typedef void result_type; \
+        void operator()(const Expr &expr, vector_simd_context &ctx) const { \
+            if (write_common_subexpression(ctx, expr)) return; \
+            if (ctx.broadcast(expr)) return; \
+            ctx.os << "( " #the_op "( "; \
+            boost::proto::eval(boost::proto::child(expr), ctx); \
+            ctx.os << " ) )"; \
+        } \
+    }
+
+    UNARY_PRE_OPERATION(unary_plus,   +);
+    UNARY_PRE_OPERATION(negate,       -);
+
+#undef UNARY_PRE_OPERATION
+
+    template <typename Expr>
+    struct eval<Expr, boost::proto::tag::function> {
+        typedef void result_type;
+
+        struct do_eval {
+            mutable int pos;
+            vector_simd_context &ctx;
+
+            do_eval(vector_simd_context &ctx) : pos(0), ctx(ctx) {}
+
+            template <typename Arg>
+            void operator()(const Arg &arg) const {
+                if (pos++) ctx.os << ", ";
+                boost::proto::eval(arg, ctx);
+            }
+        };
+
+        template <class FunCall>
+        typename std::enable_if<
+            std::is_base_of<
+                builtin_function,
+                typename boost::proto::result_of::value<
+                    typename boost::proto::result_of::child_c<FunCall,0>::type
+                >::type
+            >::value,
+        void
+        >::type
+        operator()(const FunCall &expr, vector_simd_context &ctx) const {
+            if (write_common_subexpression(ctx, expr)) return;
+            if (ctx.broadcast(expr)) return;
+
+            ctx.os << boost::proto::value(boost::proto::child_c<0>(expr)).name() << "( ";
+            boost::fusion::for_each(
+                    boost::fusion::pop_front(expr), do_eval(ctx)
+                    );
+            ctx.os << " )";
+        }
+
+        template <class FunCall>
+        typename std::enable_if<
+            std::is_base_of<
+                user_function,
+                typename boost::proto::result_of::value<
+                    typename boost::proto::result_of::child_c<FunCall,0>::type
+                >::type
+            >::value,
+        void
+        >::type
+        operator()(const FunCall &expr, vector_simd_context &ctx) const {
+            ctx.scalar(expr);
+        }
+    };
+
+    template <typename Expr>
+    struct eval<Expr, boost::proto::tag::terminal> {
+        typedef void result_type;
+
+        template <typename T>
+        void operator()(const vector<T> &term, vector_simd_context &ctx) const {
+            if (write_common_subexpression(ctx, term)) return;
+            ctx.os << element_access<T>::load(ctx.width,
+                    "prm_" + std::to_string(ctx.cmp_idx) + "_" + std::to_string(ctx.prm_number()),
+                    "idx");
+        }
+
+        template <typename Term>
+        void operator()(const Term &term, vector_simd_context &ctx) const {
+            ctx.broadcast(term);
+        }
+    };
+};
+
+// Counts terminals of an expression that take part in double-float
+// arithmetic: dfloat vectors, scalars and literals, and floating point
+// literals, which dfloat kernels receive as dfloat.
+struct count_dfloat_terminals {
+    size_t &count;
+
+    count_dfloat_terminals(size_t &count) : count(count) {}
+
+    void operator()(const vector<dfloat> &) const {
+        ++count;
+    }
+
+    void operator()(const scalar<dfloat> &) const {
+        ++count;
+    }
+
+    template <typename Term>
+    void operator()(const Term &) const {
+        typedef typename std::decay<
+            typename boost::proto::result_of::value<Term>::type
+            >::type value_type;
+
+        if (std::is_same<value_type, dfloat>::value || std::is_floating_point<value_type>::value)
+            ++count;
+    }
+};
+
+// Builds textual representation for a vector expression computed in
+// double-float arithmetic (see vex::dfloat). Arithmetic on dfloat values is
+// written as calls to the df_* functions of dfloat_kernel_header, and sqrt,
+// fabs, fmax and fmin map to their df_* counterparts. Subexpressions without
+// dfloat terminals are generated as in vector_expr_context and converted
+// with df_from(). Anything else applied to dfloat values throws. Parameter
+// names match those of vector_expr_context; floating point literals are
+// expected to be declared with dfloat_literals.
+struct dfloat_expr_context {
+    std::ostream &os;
+    int cmp_idx, prm_idx, fun_idx;
+
+    dfloat_expr_context(std::ostream &os, int cmp_idx = 1)
+        : os(os), cmp_idx(cmp_idx), prm_idx(0), fun_idx(0) {}
+
+    // Writes the subexpression as a float converted to dfloat. Returns false
+    // if it has dfloat terminals and so has to be computed in dfloat.
+    template <class Expr>
+    bool lift(const Expr &expr) {
+        size_t count = 0;
+        extract_terminals()(expr, count_dfloat_terminals(count));
+        if (count) return false;
+
+        vector_expr_context float_ctx(os, cmp_idx);
+        float_ctx.prm_idx = prm_idx;
+        float_ctx.fun_idx = fun_idx;
+
+        os << "df_from((float)(";
+        boost::proto::eval(expr, float_ctx);
+        os << "))";
+
+        prm_idx = float_ctx.prm_idx;
+        fun_idx = float_ctx.fun_idx;
+        return true;
+    }
+
+    static void unsupported() {
+        throw std::logic_error("Operation is not supported for vex::dfloat");
+    }
+
+    template <typename Expr, typename Tag = typename Expr::proto_tag>
+    struct eval {
+        typedef void result_type;
+
+        void operator()(const Expr &expr, dfloat_expr_context &ctx) const {
+            if (!ctx.lift(expr)) unsupported();
+        }
+    };
+
+#define BINARY_OPERATION(the_tag, the_fun) \
+    template <typename Expr> \
+    struct eval<Expr, boost::proto::tag::the_tag> { \
+        typedef void result_type; \
+        void operator()(const Expr &expr, dfloat_expr_context &ctx) const { \
+            if (ctx.lift(expr)) return; \
+            ctx.os << #the_fun "( "; \
+            boost::proto::eval(boost::proto::left(expr), ctx); \
+            ctx.os << ", "; \
+            boost::proto::eval(boost::proto::right(expr), ctx); \
+            ctx.os << " )"; \
+        } \
+    }
+
+    BINARY_OPERATION(plus,       df_add);
+    BINARY_OPERATION(minus,      df_sub);
+    BINARY_OPERATION(multiplies, df_mul);
+    BINARY_OPERATION(divides,    df_div);
+
+#undef BINARY_OPERATION
+
+    template <typename Expr>
+    struct eval<Expr, boost::proto::tag::unary_plus> {
+        typedef void result_type;
+
+        void operator()(const Expr &expr, dfloat_expr_context &ctx) const {
+            if (ctx.lift(expr)) return;
+            boost::proto::eval(boost::proto::child(expr), ctx);
+        }
+    };
+
+    template <typename Expr>
+    struct eval<Expr, boost::proto::tag::negate> {
+        typedef void result_type;
+
+        void operator()(const Expr &expr, dfloat_expr_context &ctx) const {
+            if (ctx.lift(expr)) return;
+            ctx.os << "df_neg( ";
+            boost::proto::eval(boost::proto::child(expr), ctx);
+            ctx.os << " )";
+        }
+    };
+
+    template <typename Expr>
+    struct eval<Expr, boost::proto::tag::function> {
+        typedef void result_type;
+
+        struct do_eval {
+            mutable int pos;
+            dfloat_expr_context &ctx;
+
+            do_eval(dfloat_expr_context &ctx) : pos(0), ctx(ctx) {}
+
+            template <typename Arg>
+            void operator()(const Arg &arg) const {
+                if (pos++) ctx.os << ", ";
+                boost::proto::eval(arg, ctx);
+            }
+        };
+
+        template <class FunCall>
+        typename std::enable_if<
+            std::is_base_of<
+                builtin_function,
+                typename boost::proto::result_of::value<
+                    typename boost::proto::result_of::child_c<FunCall,0>::type
+                >::type
+            >::value,
+        void
+        >::type
+        operator()(const FunCall &expr, dfloat_expr_context &ctx) const {
+            if (ctx.lift(expr)) return;
+
+            std::string name = boost::proto::value(boost::proto::child_c<0>(expr)).name();
+
+            if (name == "sqrt")
+                ctx.os << "df_sqrt( ";
+            else if (name == "fabs")
+                ctx.os << "df_abs( ";
+            else if (name == "fmax")
+                ctx.os << "df_max( ";
+            else if (name == "fmin")
+                ctx.os << "df_min( ";
+            else
+                unsupported();
+
+            boost::fusion::for_each(
+                    boost::fusion::pop_front(expr), do_eval(ctx)
+                    );
+            ctx.os << " )";
+        }
+
+        template <class FunCall>
+        typename std::enable_if<
+            std::is_base_of<
+                user_function,
+                typename boost::proto::result_of::value<
+                    typename boost::proto::result_of::child_c<FunCall,0>::type
+                >::type
+            >::value,
+        void
+        >::type
+        operator()(const FunCall &expr, dfloat_expr_context &ctx) const {
+            if (!ctx.lift(expr)) unsupported();
+        }
+    };
+
+    template <typename Expr>
+    struct eval<Expr, boost::proto::tag::terminal> {
+        typedef void result_type;
+
+        void operator()(const vector<dfloat> &, dfloat_expr_context &ctx) const {
+            ctx.os << "prm_" << ctx.cmp_idx << "_" << ++ctx.prm_idx << "[idx]";
+        }
+
+        void operator()(const scalar<dfloat> &, dfloat_expr_context &ctx) const {
+            ctx.os << "prm_" << ctx.cmp_idx << "_" << ++ctx.prm_idx << "[0]";
+        }
+
+        // Lifted, unless a dfloat or floating point literal.
+        template <typename Term>
+        void operator()(const Term &term, dfloat_expr_context &ctx) const {
+            if (ctx.lift(term)) return;
+            ctx.os << "prm_" << ctx.cmp_idx << "_" << ++ctx.prm_idx;
+        }
+    };
+};
+
+struct declare_user_function {
+    std::ostream &os;
+    int cmp_idx;
+    mutable int fun_idx;
+
+    declare_user_function(std::ostream &os, int cmp_idx = 1)
+        : os(os), cmp_idx(cmp_idx), fun_idx(0) {}
+
+        template <class FunCall>
+        void operator()(const FunCall &expr) const {
+            std::ostringstream name;
+            name << "func_" << cmp_idx << "_" << ++fun_idx;
+
+            // Output function definition and continue with parameters.
+            boost::proto::value(expr).define(os, name.str());
+        }
+};
+
+// Declares kernel parameters for the terminals of an expression. With
+// dfloat_literals, floating point literals are passed as vex::dfloat (see
+// dfloat_expr_context).
+struct declare_expression_parameter {
+    std::ostream &os;
+    int cmp_idx;
+    mutable int prm_idx;
+    bool dfloat_literals;
+
+    declare_expression_parameter(std::ostream &os, int cmp_idx = 1, bool dfloat_literals = false)
+    : os(os), cmp_idx(cmp_idx), prm_idx(0), dfloat_literals(dfloat_literals) {}
+
+    template <typename T>
+    void operator()(const vector<T> &) const {
+        os << ",\n\tglobal " << type_name<T>() << " *prm_"
+           << cmp_idx << "_" << ++prm_idx;
+    }
+
+    template <typename T>
+    void operator()(const scalar<T> &) const {
+        os << ",\n\tglobal const " << type_name<T>() << " *prm_"
+           << cmp_idx << "_" << ++prm_idx;
+    }
+
+    template <typename Term>
+    void operator()(const Term &) const {
+        typedef typename boost::proto::result_of::value<Term>::type value_type;
+
+        os << ",\n\t"
+           << (dfloat_literals && std::is_floating_point<
+                       typename std::decay<value_type>::type>::value ?
+                   type_name<dfloat>() : type_name<value_type>())
+           << " prm_" << cmp_idx << "_" << ++prm_idx;
+    }
+};
+
+// Writes the values of arithmetic literals of an expression as
+// VEXCL_SPEC_<cmp>_<prm> macros, for kernels specialized on them (see
+// vex::specialize()). Floating point values are written with enough digits
+// to convert back exactly.
+struct define_expression_literal {
+    std::ostream &os;
+    int cmp_idx;
+    mutable int prm_idx;
+
+    define_expression_literal(std::ostream &os, int cmp_idx = 1)
+        : os(os), cmp_idx(cmp_idx), prm_idx(0) {}
+
+    template <typename T>
+    void operator()(const vector<T> &) const {
+        ++prm_idx;
+    }
+
+    template <typename T>
+    void operator()(const scalar<T> &) const {
+        ++prm_idx;
+    }
+
+    template <typename Term>
+    void operator()(const Term &term) const {
+        ++prm_idx;
+        define(boost::proto::value(term));
+    }
+
+    template <typename T>
+    typename std::enable_if<std::is_floating_point<T>::value, void>::type
+    define(const T &value) const {
+        os << "#define VEXCL_SPEC_" << cmp_idx << "_" << prm_idx
+           << " ((" << type_name<T>() << ")(";
+
+        if (value != value) {
+            os << "NAN";
+        } else if (value == std::numeric_limits<T>::infinity()) {
+            os << "INFINITY";
+        } else if (value == -std::numeric_limits<T>::infinity()) {
+            os << "-INFINITY";
+        } else {
+            std::ostringstream v;
+            v.precision(std::numeric_limits<T>::max_digits10);
+            v << std::scientific << value;
+            os << v.str() << (sizeof(T) < sizeof(double) ? "f" : "");
+        }
+
+        os << "))\n";
+    }
+
+    template <typename T>
+    typename std::enable_if<std::is_integral<T>::value, void>::type
+    define(const T &value) const {
+        os << "#define VEXCL_SPEC_" << cmp_idx << "_" << prm_idx
+           << " ((" << type_name<T>() << ")(" << +value
+           << (std::is_unsigned<T>::value ? "u" : "") << "))\n";
+    }
+
+    template <typename T>
+    typename std::enable_if<!std::is_arithmetic<T>::value, void>::type
+    define(const T &) const {}
+};
+
+// Kernel that remembers the arguments set on it and skips setArg() for the
+// ones that did not change. Buffer arguments are compared by handle, and
+// the buffers are retained, so that a handle cannot be reused by another
+// buffer while it is remembered. Only valid as long as nobody else sets
+// arguments on the same kernel object: a private copy of a cached kernel.
+// Constructed without arguments known, so a wrapper of a shared kernel
+// sets all of them.
+class kernel_arguments {
+    public:
+        kernel_arguments() {}
+
+        explicit kernel_arguments(const cl::Kernel &krn) : krn(krn) {}
+
+        template <typename T>
+        void setArg(cl_uint pos, const T &value) {
+            const char *bytes = reinterpret_cast<const char*>(&value);
+
+            if (known(pos) && mem[pos]() == 0 &&
+                    val[pos].size() == sizeof(T) &&
+                    std::equal(bytes, bytes + sizeof(T), val[pos].begin()))
+                return;
+
+            krn.setArg(pos, value);
+
+            val[pos].assign(bytes, bytes + sizeof(T));
+            mem[pos] = cl::Memory();
+        }
+
+        void setArg(cl_uint pos, const cl::Buffer &value) {
+            if (known(pos) && mem[pos]() != 0 && mem[pos]() == value()) return;
+
+            krn.setArg(pos, value);
+
+            val[pos].clear();
+            mem[pos] = value;
+        }
+
+        /// Forgets the arguments, so that all of them are set next time.
+        void reset() {
+            val.clear();
+            mem.clear();
+        }
+
+        const cl::Kernel& kernel() const { return krn; }
+    private:
+        cl::Kernel krn;
+
+        std::vector< std::vector<char> > val;
+        std::vector<cl::Memory> mem;
+
+        bool known(cl_uint pos) {
+            if (pos < val.size()) return true;
+
+            val.resize(pos + 1);
+            mem.resize(pos + 1);
+            return false;
+        }
+};
+
+// Sets kernel arguments for the terminals of an expression; Kernel is
+// cl::Kernel or kernel_arguments.
+template <class Kernel>
+struct basic_set_expression_argument {
+    Kernel &krn;
+    uint dev, &pos;
+    size_t part_start;
+    bool dfloat_literals;
+
+    basic_set_expression_argument(Kernel &krn, uint dev, uint &pos, size_t part_start,
+            bool dfloat_literals = false)
+        : krn(krn), dev(dev), pos(pos), part_start(part_start),
+          dfloat_literals(dfloat_literals) {}
+
+    template <typename T>
+    void operator()(const vector<T> &term) const {
+        krn.setArg(pos++, term(dev));
+    }
+
+    template <typename T>
+    void operator()(const scalar<T> &term) const {
+        krn.setArg(pos++, term(dev));
+    }
+
+    template <typename Term>
     typename std::enable_if<
         !std::is_same<typename boost::proto::result_of::value<Term>::type, elem_index>::value,
         void
     >::type
     operator()(const Term &term) const {
-        krn.setArg(pos++, boost::proto::value(term));
+        literal(boost::proto::value(term));
+    }
+
+    template <typename T>
+    typename std::enable_if<std::is_floating_point<T>::value, void>::type
+    literal(const T &value) const {
+        if (dfloat_literals)
+            krn.setArg(pos++, dfloat(value));
+        else
+            krn.setArg(pos++, value);
+    }
+
+    template <typename T>
+    typename std::enable_if<!std::is_floating_point<T>::value, void>::type
+    literal(const T &value) const {
+        krn.setArg(pos++, value);
     }
 
     template <typename Term>
@@ -930,6 +2506,8 @@ struct set_expression_argument {
     }
 };
 
+typedef basic_set_expression_argument<cl::Kernel> set_expression_argument;
+
 struct get_expression_properties {
     mutable std::vector<cl::CommandQueue> const* queue;
     mutable std::vector<size_t> const* part;
@@ -0,0 +1,164 @@
+#ifndef VEXCL_PRECISION_HPP
+#define VEXCL_PRECISION_HPP
+
+/*
+The MIT License
+
+Copyright (c) 2012-2013 Denis Demidov <ddemidov@ksu.ru>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/**
+ * \file   vexcl/precision.hpp
+ * \author Denis Demidov <ddemidov@ksu.ru>
+ * \brief  Floating point precision policy of generated kernels.
+ */
+
+#ifdef WIN32
+#  pragma warning(push)
+#  pragma warning(disable : 4267 4290)
+#  define NOMINMAX
+#endif
+
+#include <map>
+#include <atomic>
+#include <string>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <vexcl/util.hpp>
+
+namespace vex {
+
+/// Floating point precision policies.
+namespace precision {
+    /// How multiply-add patterns of vector expressions are compiled.
+    /**
+     * With fma and fast_relaxed, a * b + c, a * b - c and c - a * b in the
+     * generated assignment and reduction kernels are written as calls to
+     * fma() or mad(), provided the operands are all of the floating point
+     * type the kernel computes in (or literals that convert to it unchanged).
+     */
+    enum policy {
+        standard,    ///< Expressions as written, compiler defaults.
+        strict,      ///< No contraction: FP_CONTRACT is switched off.
+        fma,         ///< fma(): the product is rounded once, with the sum.
+        fast_relaxed ///< mad() with -cl-mad-enable -cl-fast-relaxed-math.
+    };
+}
+
+/// \cond INTERNAL
+
+/// Precision policy of each context.
+template <bool dummy = true>
+struct precision_policy {
+    static_assert(dummy, "dummy parameter should be true");
+
+    /// Policy of the context of the queue.
+    static precision::policy get(const cl::CommandQueue &queue) {
+        return get(qctx(queue)());
+    }
+
+    /// Policy of the context.
+    static precision::policy get(cl_context context) {
+        boost::lock_guard<boost::mutex> lock(mx);
+
+        auto p = known.find(context);
+        return p == known.end() ? precision::standard : p->second;
+    }
+
+    /// Replaces policy of the context.
+    static void set(const cl::Context &context, precision::policy p) {
+        boost::lock_guard<boost::mutex> lock(mx);
+        known[context()] = p;
+        ++rev;
+    }
+
+    /// Changes with every set(), so that cached policies may be checked
+    /// without the lock.
+    static size_t revision() {
+        return rev;
+    }
+
+    private:
+        static boost::mutex mx;
+        static std::map<cl_context, precision::policy> known;
+        static std::atomic<size_t> rev;
+};
+
+template <bool dummy>
+boost::mutex precision_policy<dummy>::mx;
+
+template <bool dummy>
+std::map<cl_context, precision::policy> precision_policy<dummy>::known;
+
+template <bool dummy>
+std::atomic<size_t> precision_policy<dummy>::rev(0);
+
+/// Builtin multiply-add patterns are contracted into; empty for none.
+inline std::string precision_contraction(precision::policy p) {
+    switch (p) {
+        case precision::fma:          return "fma";
+        case precision::fast_relaxed: return "mad";
+        default:                      return "";
+    }
+}
+
+/// Source lines preceding kernels compiled with the policy.
+inline std::string precision_header(precision::policy p) {
+    return p == precision::strict ? "#pragma OPENCL FP_CONTRACT OFF\n" : "";
+}
+
+/// Compiler options for kernels compiled with the policy.
+inline std::string precision_options(precision::policy p) {
+    return p == precision::fast_relaxed ? "-cl-mad-enable -cl-fast-relaxed-math" : "";
+}
+
+/// Kernel cache signature of the policy.
+inline std::string precision_signature(precision::policy p) {
+    return p == precision::standard ? "" : "precision=" + std::to_string(static_cast<int>(p)) + "\n";
+}
+
+/// \endcond
+
+/// Sets precision policy of the kernels generated for the context.
+/**
+ * Affects kernels compiled afterwards; kernels are cached per policy.
+ * \code
+ * vex::set_precision(ctx.context(0), vex::precision::fma);
+ * Y = A * X + Y; // fma(A[i], X[i], Y[i])
+ * \endcode
+ */
+inline void set_precision(const cl::Context &context, precision::policy p) {
+    precision_policy<>::set(context, p);
+}
+
+/// Precision policy of the context of the queue.
+inline precision::policy get_precision(const cl::CommandQueue &queue) {
+    return precision_policy<>::get(queue);
+}
+
+} // namespace vex
+
+#ifdef WIN32
+#  pragma warning(pop)
+#endif
+
+// vim: et
+#endif
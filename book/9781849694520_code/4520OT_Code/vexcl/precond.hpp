@@ -0,0 +1,751 @@
+#ifndef VEXCL_PRECOND_HPP
+#define VEXCL_PRECOND_HPP
+
+/*
+The MIT License
+
+Copyright (c) 2012-2013 Denis Demidov <ddemidov@ksu.ru>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+/**
+ * \file   vexcl/precond.hpp
+ * \author Denis Demidov <ddemidov@ksu.ru>
+ * \brief  Preconditioners for the Krylov solvers.
+ */
+
+#ifdef WIN32
+#  pragma warning(push)
+#  pragma warning(disable : 4267 4290)
+#  define NOMINMAX
+#endif
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <numeric>
+#include <stdexcept>
+#include <vector>
+#include <tuple>
+#include <CL/cl.hpp>
+#include <vexcl/vector.hpp>
+#include <vexcl/multivector.hpp>
+#include <vexcl/spmat.hpp>
+#include <vexcl/trisolve.hpp>
+
+namespace vex {
+
+/// Preconditioners for vex::cg(), vex::bicgstab() and vex::gmres().
+/**
+ * All preconditioners are set up from the same CSR arrays that vex::SpMat
+ * takes; setup is done on the host, application on the compute devices. A
+ * preconditioner M is applied as M(r, z) to get \f$z \approx A^{-1} r\f$,
+ * so it may also be passed anywhere a linear operator is expected:
+ * \code
+ * vex::SpMat<double>         A(ctx, n, n, row.data(), col.data(), val.data());
+ * vex::precond::amg<double>  M(ctx, n, row.data(), col.data(), val.data());
+ *
+ * vex::krylov_report rep = vex::cg(A, M, f, u);
+ * \endcode
+ */
+namespace precond {
+
+/// \cond INTERNAL
+
+// Host-side CSR matrix used during setup.
+template <typename real>
+struct host_matrix {
+    size_t n, m;
+    std::vector<size_t> row, col;
+    std::vector<real>   val;
+
+    host_matrix(size_t n = 0, size_t m = 0) : n(n), m(m), row(n + 1, 0) {}
+
+    template <typename idx_t, typename column_t>
+    host_matrix(size_t n, const idx_t *r, const column_t *c, const real *v)
+        : n(n), m(n), row(r, r + n + 1), col(c, c + r[n]), val(v, v + r[n])
+    {}
+
+    std::vector<real> diagonal() const {
+        std::vector<real> d(n, 0);
+
+        for(size_t i = 0; i < n; i++)
+            for(size_t j = row[i]; j < row[i + 1]; j++)
+                if (col[j] == i) d[i] += val[j];
+
+        for(size_t i = 0; i < n; i++)
+            if (d[i] == 0) throw std::runtime_error("Zero diagonal entry");
+
+        return d;
+    }
+
+    // Gershgorin bound for the spectral radius of D^{-1} A.
+    real spectral_radius(const std::vector<real> &d) const {
+        real rmax = 0;
+
+        for(size_t i = 0; i < n; i++) {
+            real s = 0;
+            for(size_t j = row[i]; j < row[i + 1]; j++) s += std::fabs(val[j]);
+            rmax = std::max(rmax, s / std::fabs(d[i]));
+        }
+
+        return rmax;
+    }
+
+    SpMat<real>* device(const std::vector<cl::CommandQueue> &queue) const {
+        return new SpMat<real>(queue, n, m, row.data(), col.data(), val.data());
+    }
+};
+
+// Accumulates a row of a matrix being built; marker[c] holds the position
+// of column c in the current row, or something below row_beg.
+template <typename real>
+inline void add_to_row(host_matrix<real> &A, std::vector<ptrdiff_t> &marker,
+        ptrdiff_t row_beg, size_t c, real v)
+{
+    if (marker[c] < row_beg) {
+        marker[c] = A.col.size();
+        A.col.push_back(c);
+        A.val.push_back(v);
+    } else {
+        A.val[marker[c]] += v;
+    }
+}
+
+template <typename real>
+host_matrix<real> transpose(const host_matrix<real> &A) {
+    host_matrix<real> T(A.m, A.n);
+
+    T.col.resize(A.col.size());
+    T.val.resize(A.val.size());
+
+    for(size_t j = 0; j < A.col.size(); j++) T.row[A.col[j] + 1]++;
+    std::partial_sum(T.row.begin(), T.row.end(), T.row.begin());
+
+    std::vector<size_t> pos(T.row.begin(), T.row.end() - 1);
+
+    for(size_t i = 0; i < A.n; i++)
+        for(size_t j = A.row[i]; j < A.row[i + 1]; j++) {
+            size_t k = pos[A.col[j]]++;
+            T.col[k] = i;
+            T.val[k] = A.val[j];
+        }
+
+    return T;
+}
+
+template <typename real>
+host_matrix<real> product(const host_matrix<real> &A, const host_matrix<real> &B) {
+    host_matrix<real> C(A.n, B.m);
+    std::vector<ptrdiff_t> marker(B.m, -1);
+
+    for(size_t i = 0; i < A.n; i++) {
+        ptrdiff_t row_beg = C.col.size();
+
+        for(size_t ja = A.row[i]; ja < A.row[i + 1]; ja++) {
+            size_t k  = A.col[ja];
+            real   va = A.val[ja];
+
+            for(size_t jb = B.row[k]; jb < B.row[k + 1]; jb++)
+                add_to_row(C, marker, row_beg, B.col[jb], va * B.val[jb]);
+        }
+
+        C.row[i + 1] = C.col.size();
+    }
+
+    return C;
+}
+
+/// \endcond
+
+/// Jacobi preconditioner.
+/**
+ * \f$z = D^{-1} r\f$, where D is the diagonal of the matrix. Costs one pass
+ * over the vectors.
+ */
+template <typename real>
+class jacobi {
+    public:
+        /// Constructor.
+        /**
+         * \param queue vector of queues.
+         * \param n     number of rows in the matrix.
+         * \param row   row index into col and val vectors.
+         * \param col   column numbers of nonzero elements of the matrix.
+         * \param val   values of nonzero elements of the matrix.
+         */
+        template <typename idx_t, typename column_t>
+        jacobi(const std::vector<cl::CommandQueue> &queue,
+                size_t n, const idx_t *row, const column_t *col, const real *val)
+            : dinv(queue, n)
+        {
+            std::vector<real> d = host_matrix<real>(n, row, col, val).diagonal();
+            for(auto i = d.begin(); i != d.end(); i++) *i = 1 / *i;
+            copy(d, dinv);
+        }
+
+        /// Applies the preconditioner: \f$z = D^{-1} r\f$.
+        void operator()(const vector<real> &r, vector<real> &z) const {
+            z = dinv * r;
+        }
+    private:
+        vector<real> dinv;
+};
+
+/// Chebyshev polynomial preconditioner.
+/**
+ * Applies degree - 1 steps of Jacobi-preconditioned Chebyshev iteration to
+ * \f$Az = r\f$ starting from \f$z = 0\f$. The spectrum of \f$D^{-1}A\f$ is
+ * assumed to lie in \f$[\lambda_{max} / ratio, \lambda_{max}]\f$, with
+ * \f$\lambda_{max}\f$ estimated by the Gershgorin theorem. Each step costs a
+ * matrix-vector product and one fused update of the iterate and the search
+ * direction; there are no dot products, so the polynomial is cheap on
+ * several devices. The matrix has to be symmetric positive definite.
+ */
+template <typename real>
+class chebyshev {
+    public:
+        /// Constructor.
+        /**
+         * \param queue  vector of queues.
+         * \param n      number of rows in the matrix.
+         * \param row    row index into col and val vectors.
+         * \param col    column numbers of nonzero elements of the matrix.
+         * \param val    values of nonzero elements of the matrix.
+         * \param degree degree of the polynomial.
+         * \param ratio  ratio of the largest and smallest eigenvalue targeted.
+         */
+        template <typename idx_t, typename column_t>
+        chebyshev(const std::vector<cl::CommandQueue> &queue,
+                size_t n, const idx_t *row, const column_t *col, const real *val,
+                unsigned degree = 3, real ratio = 30
+                )
+            : degree(std::max(degree, 1u)), dinv(queue, n), d(queue, n), t(queue, n)
+        {
+            host_matrix<real> H(n, row, col, val);
+            std::vector<real> diag = H.diagonal();
+
+            real lmax = H.spectral_radius(diag);
+            real lmin = lmax / ratio;
+
+            theta = (lmax + lmin) / 2;
+            delta = (lmax - lmin) / 2;
+
+            for(auto i = diag.begin(); i != diag.end(); i++) *i = 1 / *i;
+            copy(diag, dinv);
+
+            A.reset(H.device(queue));
+        }
+
+        /// Applies the preconditioner.
+        void operator()(const vector<real> &r, vector<real> &z) const {
+            real sigma = theta / delta;
+            real rho   = 1 / sigma;
+
+            d = (1 / theta) * dinv * r;
+            z = d;
+
+            for(unsigned k = 1; k < degree; k++) {
+                real rho_new = 1 / (2 * sigma - rho);
+                real c1 = rho_new * rho;
+                real c2 = 2 * rho_new / delta;
+
+                A->mul(z, t);
+
+                vex::tie(d, z) = std::make_tuple(
+                        c1 * d + c2 * dinv * (r - t),
+                        z + c1 * d + c2 * dinv * (r - t)
+                        );
+
+                rho = rho_new;
+            }
+        }
+    private:
+        unsigned degree;
+        real theta, delta;
+
+        std::unique_ptr< SpMat<real> > A;
+        vector<real> dinv;
+
+        mutable vector<real> d, t;
+};
+
+/// Block-Jacobi ILU(0) preconditioner.
+/**
+ * Each compute device owns the diagonal block of the matrix for its
+ * partition of the vectors; couplings between the blocks are dropped, so the
+ * preconditioner never exchanges data between devices. Each block is
+ * factored with incomplete LU without fill-in on the host. By default the
+ * triangular solves are approximated with a few Jacobi sweeps each:
+ * \f$y \leftarrow r - Ly\f$ for the unit lower factor and
+ * \f$z \leftarrow D_U^{-1}(y - Uz)\f$ for the upper one. With zero sweeps
+ * the factors are solved exactly by vex::triangular_solver, at the cost of a
+ * kernel launch per level of each factor.
+ */
+template <typename real>
+class block_ilu0 {
+    public:
+        /// Constructor.
+        /**
+         * \param queue  vector of queues.
+         * \param n      number of rows in the matrix.
+         * \param row    row index into col and val vectors.
+         * \param col    column numbers of nonzero elements of the matrix.
+         * \param val    values of nonzero elements of the matrix.
+         * \param sweeps Jacobi sweeps per triangular solve; 0 for exact
+         *               level-scheduled solves.
+         */
+        template <typename idx_t, typename column_t>
+        block_ilu0(const std::vector<cl::CommandQueue> &queue,
+                size_t n, const idx_t *row, const column_t *col, const real *val,
+                unsigned sweeps = 2
+                )
+            : sweeps(sweeps), dinv(queue, n), y(queue, n), t(queue, n)
+        {
+            std::vector<size_t> part = partition(n, queue);
+
+            // Diagonal blocks with rows sorted by column.
+            host_matrix<real> B(n, n);
+            std::vector<size_t> diag(n);
+
+            for(uint d = 0; d < queue.size(); d++) {
+                for(size_t i = part[d]; i < part[d + 1]; i++) {
+                    std::vector< std::pair<size_t, real> > a;
+
+                    for(size_t j = row[i]; j < static_cast<size_t>(row[i + 1]); j++) {
+                        size_t c = col[j];
+                        if (c >= part[d] && c < part[d + 1])
+                            a.push_back(std::make_pair(c, val[j]));
+                    }
+
+                    std::sort(a.begin(), a.end());
+
+                    diag[i] = B.col.size();
+                    for(auto e = a.begin(); e != a.end(); e++) {
+                        if (e->first < i) diag[i]++;
+                        B.col.push_back(e->first);
+                        B.val.push_back(e->second);
+                    }
+
+                    if (diag[i] == B.col.size() || B.col[diag[i]] != i)
+                        throw std::runtime_error("Missing diagonal entry in ILU(0)");
+
+                    B.row[i + 1] = B.col.size();
+                }
+            }
+
+            // ILU(0), IKJ variant.
+            std::vector<ptrdiff_t> pos(n, -1);
+
+            for(size_t i = 0; i < n; i++) {
+                for(size_t j = B.row[i]; j < B.row[i + 1]; j++) pos[B.col[j]] = j;
+
+                for(size_t j = B.row[i]; j < diag[i]; j++) {
+                    size_t k = B.col[j];
+
+                    B.val[j] /= B.val[diag[k]];
+
+                    for(size_t jk = diag[k] + 1; jk < B.row[k + 1]; jk++)
+                        if (pos[B.col[jk]] >= 0)
+                            B.val[pos[B.col[jk]]] -= B.val[j] * B.val[jk];
+                }
+
+                for(size_t j = B.row[i]; j < B.row[i + 1]; j++) pos[B.col[j]] = -1;
+
+                if (B.val[diag[i]] == 0)
+                    throw std::runtime_error("Zero pivot in ILU(0)");
+            }
+
+            // Split into strictly lower, strictly upper and diagonal parts.
+            host_matrix<real> L(n, n), U(n, n);
+            std::vector<real> d(n);
+
+            for(size_t i = 0; i < n; i++) {
+                for(size_t j = B.row[i]; j < B.row[i + 1]; j++) {
+                    host_matrix<real> &T = j < diag[i] ? L : U;
+
+                    if (j == diag[i]) {
+                        d[i] = 1 / B.val[j];
+
+                        // The exact upper solve keeps the diagonal.
+                        if (!sweeps) {
+                            U.col.push_back(B.col[j]);
+                            U.val.push_back(B.val[j]);
+                        }
+                    } else {
+                        T.col.push_back(B.col[j]);
+                        T.val.push_back(B.val[j]);
+                    }
+                }
+
+                L.row[i + 1] = L.col.size();
+                U.row[i + 1] = U.col.size();
+            }
+
+            if (!sweeps) {
+                lower_solve.reset(new triangular_solver<real>(queue, n,
+                            L.row.data(), L.col.data(), L.val.data(),
+                            triangular_solver<real>::lower, true));
+                upper_solve.reset(new triangular_solver<real>(queue, n,
+                            U.row.data(), U.col.data(), U.val.data(),
+                            triangular_solver<real>::upper));
+                return;
+            }
+
+            copy(d, dinv);
+
+            lower.reset(L.device(queue));
+            upper.reset(U.device(queue));
+        }
+
+        /// Applies the preconditioner.
+        void operator()(const vector<real> &r, vector<real> &z) const {
+            if (!sweeps) {
+                (*lower_solve)(r, y);
+                (*upper_solve)(y, z);
+                return;
+            }
+
+            y = r;
+            for(unsigned k = 0; k < sweeps; k++) {
+                lower->mul(y, t);
+                y = r - t;
+            }
+
+            z = dinv * y;
+            for(unsigned k = 0; k < sweeps; k++) {
+                upper->mul(z, t);
+                z = dinv * (y - t);
+            }
+        }
+    private:
+        unsigned sweeps;
+
+        std::unique_ptr< SpMat<real> > lower, upper;
+        std::unique_ptr< triangular_solver<real> > lower_solve, upper_solve;
+        vector<real> dinv;
+
+        mutable vector<real> y, t;
+};
+
+/// Smoothed aggregation algebraic multigrid.
+/**
+ * One V-cycle per application. The hierarchy is built on the host: nodes
+ * are grouped into aggregates of strongly connected neighbours, the
+ * piecewise constant tentative prolongation is smoothed with one damped
+ * Jacobi step, and coarse operators are formed as \f$P^T A P\f$. Every level
+ * is then moved to the compute devices as vex::SpMat, so products on all
+ * levels use the usual multi-device ghost exchange. Damped Jacobi is the
+ * smoother; the coarsest level is solved directly on the host.
+ */
+template <typename real>
+class amg {
+    public:
+        /// AMG parameters.
+        struct params {
+            double   eps_strong;    ///< Strength of connection threshold; halved on each level.
+            size_t   coarse_enough; ///< Stop coarsening at this many unknowns.
+            unsigned max_levels;    ///< Maximum number of levels.
+            unsigned npre;          ///< Pre-smoothing sweeps.
+            unsigned npost;         ///< Post-smoothing sweeps.
+            real     relax;         ///< Damping factor of the Jacobi smoother.
+
+            params()
+                : eps_strong(0.08), coarse_enough(500), max_levels(20),
+                  npre(1), npost(1), relax(static_cast<real>(0.72))
+            {}
+        };
+
+        /// Constructor.
+        /**
+         * \param queue vector of queues.
+         * \param n     number of rows in the matrix.
+         * \param row   row index into col and val vectors.
+         * \param col   column numbers of nonzero elements of the matrix.
+         * \param val   values of nonzero elements of the matrix.
+         * \param prm   AMG parameters.
+         */
+        template <typename idx_t, typename column_t>
+        amg(const std::vector<cl::CommandQueue> &queue,
+                size_t n, const idx_t *row, const column_t *col, const real *val,
+                const params &prm = params()
+                )
+            : prm(prm)
+        {
+            host_matrix<real> A(n, row, col, val);
+            double eps = prm.eps_strong;
+
+            while(A.n > prm.coarse_enough && levels.size() + 1 < prm.max_levels) {
+                std::vector<real> d = A.diagonal();
+
+                std::vector<ptrdiff_t> agg;
+                size_t nc = aggregate(A, d, eps, agg);
+
+                if (nc == 0 || nc >= A.n) break;
+
+                host_matrix<real> P = smoothed_prolongation(A, d, agg, nc);
+                host_matrix<real> R = transpose(P);
+
+                levels.push_back(new level(queue, A, d));
+                levels.back()->P.reset(P.device(queue));
+                levels.back()->R.reset(R.device(queue));
+
+                A = product(R, product(A, P));
+                eps *= 0.5;
+            }
+
+            levels.push_back(new level(queue, A, std::vector<real>()));
+            factorize(A);
+        }
+
+        ~amg() {
+            for(auto l = levels.begin(); l != levels.end(); l++) delete *l;
+        }
+
+        /// Number of levels in the hierarchy.
+        size_t size() const {
+            return levels.size();
+        }
+
+        /// Applies one V-cycle to \f$Az = r\f$ starting from \f$z = 0\f$.
+        void operator()(const vector<real> &r, vector<real> &z) const {
+            cycle(0, r, z);
+        }
+    private:
+        struct level {
+            std::unique_ptr< SpMat<real> > A, P, R;
+            vector<real> dinv, f, u, t;
+
+            level(const std::vector<cl::CommandQueue> &queue,
+                    const host_matrix<real> &H, std::vector<real> d)
+                : dinv(queue, d.size()), f(queue, H.n), u(queue, H.n), t(queue, d.size())
+            {
+                if (!d.empty()) {
+                    for(auto i = d.begin(); i != d.end(); i++) *i = 1 / *i;
+                    copy(d, dinv);
+                    A.reset(H.device(queue));
+                }
+            }
+        };
+
+        params prm;
+        std::vector<level*> levels;
+
+        // Dense LU factorization of the coarsest matrix with partial pivoting.
+        std::vector<real>   lu;
+        std::vector<size_t> perm;
+
+        mutable std::vector<real> fh, uh;
+
+        amg(const amg&);
+        amg& operator=(const amg&);
+
+        // Plain aggregation: returns the number of aggregates, agg[i] is the
+        // aggregate of node i, or -1 for nodes without strong connections
+        // that are left to the smoother.
+        static size_t aggregate(const host_matrix<real> &A, const std::vector<real> &d,
+                double eps, std::vector<ptrdiff_t> &agg)
+        {
+            const ptrdiff_t undefined = -2, removed = -1;
+
+            std::vector<char> strong(A.col.size());
+            agg.assign(A.n, undefined);
+
+            for(size_t i = 0; i < A.n; i++) {
+                bool any = false;
+
+                for(size_t j = A.row[i]; j < A.row[i + 1]; j++) {
+                    size_t c = A.col[j];
+                    real   v = A.val[j];
+
+                    strong[j] = c != i && v * v > eps * eps * std::fabs(d[i] * d[c]);
+                    any = any || strong[j];
+                }
+
+                if (!any) agg[i] = removed;
+            }
+
+            size_t nc = 0;
+
+            // Seeds whose strong neighbourhood is still free.
+            for(size_t i = 0; i < A.n; i++) {
+                if (agg[i] != undefined) continue;
+
+                bool free = true;
+                for(size_t j = A.row[i]; free && j < A.row[i + 1]; j++)
+                    if (strong[j] && agg[A.col[j]] != undefined) free = false;
+
+                if (!free) continue;
+
+                agg[i] = nc;
+                for(size_t j = A.row[i]; j < A.row[i + 1]; j++)
+                    if (strong[j]) agg[A.col[j]] = nc;
+                nc++;
+            }
+
+            // Attach the rest to a neighbouring aggregate, or start new ones.
+            std::vector<ptrdiff_t> seed(agg);
+
+            for(size_t i = 0; i < A.n; i++) {
+                if (agg[i] != undefined) continue;
+
+                for(size_t j = A.row[i]; j < A.row[i + 1]; j++)
+                    if (strong[j] && seed[A.col[j]] >= 0) {
+                        agg[i] = seed[A.col[j]];
+                        break;
+                    }
+            }
+
+            for(size_t i = 0; i < A.n; i++) {
+                if (agg[i] != undefined) continue;
+
+                agg[i] = nc;
+                for(size_t j = A.row[i]; j < A.row[i + 1]; j++)
+                    if (strong[j] && agg[A.col[j]] == undefined) agg[A.col[j]] = nc;
+                nc++;
+            }
+
+            return nc;
+        }
+
+        // P = (I - omega D^{-1} A) P_tent, omega = 4 / (3 rho(D^{-1} A)).
+        static host_matrix<real> smoothed_prolongation(const host_matrix<real> &A,
+                const std::vector<real> &d, const std::vector<ptrdiff_t> &agg, size_t nc)
+        {
+            real omega = 4 / (3 * A.spectral_radius(d));
+
+            host_matrix<real> P(A.n, nc);
+            std::vector<ptrdiff_t> marker(nc, -1);
+
+            for(size_t i = 0; i < A.n; i++) {
+                ptrdiff_t row_beg = P.col.size();
+                real s = -omega / d[i];
+
+                if (agg[i] >= 0) add_to_row<real>(P, marker, row_beg, agg[i], 1);
+
+                for(size_t j = A.row[i]; j < A.row[i + 1]; j++)
+                    if (agg[A.col[j]] >= 0)
+                        add_to_row(P, marker, row_beg, agg[A.col[j]], s * A.val[j]);
+
+                P.row[i + 1] = P.col.size();
+            }
+
+            return P;
+        }
+
+        void factorize(const host_matrix<real> &A) {
+            const size_t n = A.n;
+
+            lu.assign(n * n, 0);
+            perm.resize(n);
+            fh.resize(n);
+            uh.resize(n);
+
+            for(size_t i = 0; i < n; i++) {
+                perm[i] = i;
+                for(size_t j = A.row[i]; j < A.row[i + 1]; j++)
+                    lu[i * n + A.col[j]] += A.val[j];
+            }
+
+            for(size_t k = 0; k < n; k++) {
+                size_t p = k;
+                for(size_t i = k + 1; i < n; i++)
+                    if (std::fabs(lu[i * n + k]) > std::fabs(lu[p * n + k])) p = i;
+
+                if (lu[p * n + k] == 0)
+                    throw std::runtime_error("Singular coarse level matrix");
+
+                if (p != k) {
+                    std::swap_ranges(&lu[k * n], &lu[k * n] + n, &lu[p * n]);
+                    std::swap(perm[k], perm[p]);
+                }
+
+                for(size_t i = k + 1; i < n; i++) {
+                    real l = lu[i * n + k] /= lu[k * n + k];
+                    for(size_t j = k + 1; j < n; j++)
+                        lu[i * n + j] -= l * lu[k * n + j];
+                }
+            }
+        }
+
+        void coarse_solve(const vector<real> &f, vector<real> &u) const {
+            const size_t n = perm.size();
+
+            copy(f, fh);
+
+            for(size_t i = 0; i < n; i++) {
+                real s = fh[perm[i]];
+                for(size_t j = 0; j < i; j++) s -= lu[i * n + j] * uh[j];
+                uh[i] = s;
+            }
+
+            for(size_t i = n; i-- > 0; ) {
+                real s = uh[i];
+                for(size_t j = i + 1; j < n; j++) s -= lu[i * n + j] * uh[j];
+                uh[i] = s / lu[i * n + i];
+            }
+
+            copy(uh, u);
+        }
+
+        void cycle(size_t l, const vector<real> &f, vector<real> &u) const {
+            if (l + 1 == levels.size()) {
+                coarse_solve(f, u);
+                return;
+            }
+
+            level &L = *levels[l];
+            level &C = *levels[l + 1];
+
+            if (prm.npre)
+                u = prm.relax * L.dinv * f;
+            else
+                u = 0;
+
+            for(unsigned k = 1; k < prm.npre; k++) {
+                L.A->mul(u, L.t);
+                u += prm.relax * L.dinv * (f - L.t);
+            }
+
+            L.A->mul(u, L.t);
+            L.t = f - L.t;
+            L.R->mul(L.t, C.f);
+
+            cycle(l + 1, C.f, C.u);
+
+            L.P->mul(C.u, u, 1, true);
+
+            for(unsigned k = 0; k < prm.npost; k++) {
+                L.A->mul(u, L.t);
+                u += prm.relax * L.dinv * (f - L.t);
+            }
+        }
+};
+
+} // namespace precond
+} // namespace vex
+
+#ifdef WIN32
+#  pragma warning(pop)
+#endif
+
+// vim: et
+#endif
@@ -56,6 +56,7 @@ THE SOFTWARE.
 #endif
 
 #include <CL/cl.hpp>
+#include <vexcl/trace.hpp>
 
 
 namespace vex {
@@ -247,6 +248,32 @@ class profiler {
             root->print(out, 0, length, root->max_line_width(0));
         }
 
+        /// Starts or stops recording of per-kernel event trace.
+        /**
+         * Unlike tic_cl()/toc(), the trace does not synchronize the queues,
+         * so it may stay enabled for the whole run. The queues should be
+         * created with CL_QUEUE_PROFILING_ENABLE.
+         * \see event_trace
+         */
+        void trace(bool on = true) {
+            event_trace<>::enable(on);
+        }
+
+        /// Writes recorded event trace in Chrome trace event format.
+        void write_trace(std::ostream &out) const {
+            event_trace<>::write(out);
+        }
+
+        /// Writes per-kernel time, bandwidth and throughput from the event trace.
+        /**
+         * Traffic and operation counts are estimated for vector expression
+         * kernels from the expression terminals. Peak device bandwidth may be
+         * set with event_trace<>::peak_bandwidth().
+         */
+        void print_kernels(std::ostream &out) const {
+            event_trace<>::summary(out);
+        }
+
     private:
         const std::vector<cl::CommandQueue> &queue;
         std::deque<std::shared_ptr<profile_unit>> stack;
@@ -31,6 +31,14 @@ THE SOFTWARE.
  * \brief  Random generators.
  */
 
+#include <vector>
+#include <string>
+#include <sstream>
+#include <memory>
+#include <type_traits>
+#include <cmath>
+#include <vexcl/vector.hpp>
+#include <vexcl/kernel_cache.hpp>
 #include <vexcl/random/philox.hpp>
 #include <vexcl/random/threefry.hpp>
 
@@ -173,7 +181,597 @@ struct RandomNormal : UserFunction<RandomNormal<T,Generator>, T(cl_ulong, cl_ulo
 };
 
 
+/// Stateful generator filling vectors with random numbers.
+/**
+ * Unlike vex::Random, which uses a single output word of the generator per
+ * element, RandomStream uses all four words of each counter, and keeps the
+ * position in the stream between calls, so that successive calls produce
+ * fresh numbers:
+ * \code
+ * vex::RandomStream<double> rnd(ctx, seed);
+ * rnd.normal(x);        // Standard normal distribution.
+ * rnd.uniform(y);       // Uniform distribution on [0, 1].
+ * rnd.exponential(z, 2);
+ *
+ * vex::RandomStream<cl_int> irnd(ctx, seed);
+ * irnd.uniform_int(k, 1, 6);
+ * \endcode
+ * Element i of the stream is given by word i % 4 of the generator output
+ * for counter i / 4 and the key made of the seed, so the result does not
+ * depend on the number or type of the devices. After each call the stream
+ * position is advanced by the vector size rounded up to a multiple of four.
+ *
+ * T should be a 32 or 64 bit scalar type.
+ */
+template <class T, class Generator = random::philox>
+class RandomStream {
+    public:
+        static_assert(
+                sizeof(T) == 4 || sizeof(T) == 8,
+                "Only 32 and 64 bit scalar types are supported."
+                );
+
+        /// Constructor.
+        RandomStream(const std::vector<cl::CommandQueue> &queue,
+                cl_ulong seed = 0)
+            : queue(queue), key(seed), pos(0)
+        {
+            init_kernels();
+        }
+
+        /// Fills x with uniformly distributed numbers.
+        /**
+         * Integral values span the complete range of the type, floating
+         * point values lie in [0, 1].
+         */
+        void uniform(vector<T> &x) {
+            fill(&kernels::uniform, x, 0, 0);
+        }
+
+        /// Fills x with normally distributed numbers.
+        void normal(vector<T> &x, T mean = 0, T stddev = 1) {
+            static_assert(is_floating, "Must use float or double.");
+            fill(&kernels::normal, x, mean, stddev);
+        }
+
+        /// Fills x with exponentially distributed numbers.
+        void exponential(vector<T> &x, T lambda = 1) {
+            static_assert(is_floating, "Must use float or double.");
+            fill(&kernels::exponential, x, lambda, 0);
+        }
+
+        /// Fills x with integers uniformly distributed on [lo, hi].
+        void uniform_int(vector<T> &x, T lo, T hi) {
+            static_assert(!is_floating, "Must use an integral type.");
+            fill(&kernels::uniform_int, x, lo, hi);
+        }
+
+        /// Current position in the stream.
+        cl_ulong offset() const {
+            return pos;
+        }
+
+        /// Moves to the given position in the stream.
+        void seek(cl_ulong offset) {
+            pos = offset;
+        }
+    private:
+        static const bool is_floating =
+            boost::is_same<T, cl_float>::value ||
+            boost::is_same<T, cl_double>::value;
+
+        typedef typename std::conditional<
+            sizeof(T) == 4, cl_uint4, cl_ulong4
+            >::type ctr_type;
+
+        typedef typename cl_scalar_of<ctr_type>::type word_type;
+
+        std::vector<cl::CommandQueue> queue;
+        cl_ulong key;
+        cl_ulong pos;
+
+        struct kernels {
+            cl::Kernel uniform;
+            cl::Kernel normal;
+            cl::Kernel exponential;
+            cl::Kernel uniform_int;
+            uint       wgsize;
+        };
+
+        std::vector< std::shared_ptr<kernels> > kernel_list;
+
+        static void kernel(std::ostream &o, const std::string &name,
+                const std::string &body)
+        {
+            o << "kernel void " << name << "(\n"
+                 "    " << type_name<size_t>() << " n,\n"
+                 "    ulong start,\n"
+                 "    ulong seed,\n"
+                 "    real p1, real p2,\n"
+                 "    global real *x\n"
+                 "    )\n"
+                 "{\n"
+                 "    ulong c0 = start / 4;\n"
+                 "    ulong c1 = (start + n + 3) / 4;\n"
+                 "    for(ulong c = c0 + get_global_id(0); c < c1; c += get_global_size(0)) {\n";
+
+            if (sizeof(T) == 4)
+                o << "        ctr_t ctr = (ctr_t)((uint)c, (uint)(c >> 32), 0, 0);\n"
+                     "        key_t key = (key_t)((uint)seed, (uint)(seed >> 32));\n";
+            else
+                o << "        ctr_t ctr = (ctr_t)(c, 0, 0, 0);\n"
+                     "        key_t key = (key_t)(seed, 0);\n";
+
+            o << "        rand(ctr, key);\n"
+                 "        word w[4] = {ctr.s0, ctr.s1, ctr.s2, ctr.s3};\n"
+                 "        real v[4];\n"
+              << body <<
+                 "        for(int k = 0; k < 4; k++) {\n"
+                 "            ulong g = c * 4 + k;\n"
+                 "            if (g >= start && g < start + n) x[g - start] = v[k];\n"
+                 "        }\n"
+                 "    }\n"
+                 "}\n";
+        }
+
+        void init_kernels() {
+            std::ostringstream source;
+
+            source << standard_kernel_header
+                   << "typedef " << type_name<T>() << " real;\n"
+                   << "typedef " << type_name<word_type>() << " word;\n";
+
+            Generator::template macro<ctr_type>(source, "rand");
+
+            // Uniform [0, 1] and open (0, 1) floating point values.
+            if (boost::is_same<T, cl_float>::value)
+                source <<
+                    "#define CLOSED(w) (convert_float(w) / 4294967295.0f)\n"
+                    "#define OPEN(w) ((convert_float((w) >> 8) + 0.5f) * 5.9604644775390625e-8f)\n";
+            else if (boost::is_same<T, cl_double>::value)
+                source <<
+                    "#define CLOSED(w) (convert_double(w) / 18446744073709551615.0)\n"
+                    "#define OPEN(w) ((convert_double((w) >> 11) + 0.5) * 1.1102230246251565e-16)\n";
+
+            if (is_floating) {
+                kernel(source, "uniform",
+                        "        for(int k = 0; k < 4; k++) v[k] = CLOSED(w[k]);\n"
+                        );
+                kernel(source, "normal",
+                        "        for(int k = 0; k < 4; k += 2) {\n"
+                        "            real r = sqrt(-2 * log(OPEN(w[k])));\n"
+                        "            real a = 2 * OPEN(w[k + 1]);\n"
+                        "            v[k]     = p1 + p2 * r * cospi(a);\n"
+                        "            v[k + 1] = p1 + p2 * r * sinpi(a);\n"
+                        "        }\n"
+                        );
+                kernel(source, "exponential",
+                        "        for(int k = 0; k < 4; k++) v[k] = -log(OPEN(w[k])) / p1;\n"
+                        );
+            } else {
+                kernel(source, "uniform",
+                        "        for(int k = 0; k < 4; k++) v[k] = (real)w[k];\n"
+                        );
+                // Multiply-high maps the word onto the range without the
+                // bias of the modulo operation. Zero range means full range.
+                kernel(source, "uniform_int",
+                        "        word range = (word)p2 - (word)p1 + 1;\n"
+                        "        for(int k = 0; k < 4; k++)\n"
+                        "            v[k] = range ? (real)((word)p1 + mul_hi(w[k], range)) : (real)w[k];\n"
+                        );
+            }
+
+            for(auto q = queue.begin(); q != queue.end(); q++) {
+                std::shared_ptr<kernels> k = kernel_cache<>::find<kernels>(*q);
+
+                if (!k) {
+                    cl::Context context = qctx(*q);
+                    cl::Device  device  = qdev(*q);
+
+                    auto program = build_sources(context, source.str());
+
+                    kernels e;
+
+                    e.uniform = cl::Kernel(program, "uniform");
+                    e.wgsize  = kernel_workgroup_size(e.uniform, device);
+
+                    if (is_floating) {
+                        e.normal      = cl::Kernel(program, "normal");
+                        e.exponential = cl::Kernel(program, "exponential");
+
+                        e.wgsize = std::min(e.wgsize, std::min(
+                                    kernel_workgroup_size(e.normal, device),
+                                    kernel_workgroup_size(e.exponential, device)));
+                    } else {
+                        e.uniform_int = cl::Kernel(program, "uniform_int");
+
+                        e.wgsize = std::min(e.wgsize,
+                                kernel_workgroup_size(e.uniform_int, device));
+                    }
+
+                    k = kernel_cache<>::insert(*q, e);
+                }
+
+                kernel_list.push_back(k);
+            }
+        }
+
+        void fill(cl::Kernel kernels::*kptr, vector<T> &x, T p1, T p2) {
+            for(uint d = 0; d < queue.size(); d++) {
+                if (size_t psize = x.part_size(d)) {
+                    kernels   &k = *kernel_list[d];
+                    cl::Kernel &K = k.*kptr;
+
+                    cl::Device device = qdev(queue[d]);
+
+                    cl_ulong start = pos + x.part_start(d);
+                    size_t   nctr  = (start + psize + 3) / 4 - start / 4;
+
+                    size_t g_size = device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU ?
+                        alignup(nctr, k.wgsize) :
+                        device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * k.wgsize * 4;
+
+                    uint p = 0;
+                    K.setArg(p++, psize);
+                    K.setArg(p++, start);
+                    K.setArg(p++, key);
+                    K.setArg(p++, p1);
+                    K.setArg(p++, p2);
+                    K.setArg(p++, x(d));
+
+                    queue[d].enqueueNDRangeKernel(K, cl::NullRange, g_size, k.wgsize, 0, event_trace<>::kernel(queue[d], K));
+                }
+            }
+
+            pos += alignup(x.size(), 4);
+        }
+};
+
+/// Result of a Monte Carlo estimate.
+template <typename T>
+struct monte_carlo_estimate {
+    T      mean;    ///< Sample mean of the integrand.
+    T      stddev;  ///< Sample standard deviation of the integrand.
+    T      error;   ///< Standard error of the mean, stddev / sqrt(samples).
+    size_t samples; ///< Number of samples taken.
+};
+
+/// Monte Carlo estimator with the random numbers generated on the fly.
+/**
+ * Sampling, evaluation of the integrand and accumulation of the statistics
+ * are fused into a single kernel. Each work-item generates its samples from
+ * all four words of every counter it owns and takes many samples, so that
+ * neither random vectors nor the integrand values are ever stored:
+ * \code
+ * VEX_FUNCTION_TYPE(inside_t, double(double, double),
+ *     "return prm1 * prm1 + prm2 * prm2 < 1 ? 4.0 : 0.0;");
+ *
+ * vex::MonteCarlo<double> mc(ctx, seed);
+ * vex::monte_carlo_estimate<double> pi = mc.uniform<2>(inside_t(), 1 << 24);
+ * std::cout << pi.mean << " +- " << pi.error << std::endl;
+ * \endcode
+ * The integrand is a user function taking Dim arguments of type T; sample
+ * i gets the stream elements i * Dim ... i * Dim + Dim - 1, counted from the
+ * current position rounded up to a multiple of four. Like vex::RandomStream,
+ * the estimator remembers its position between calls, so that successive
+ * estimates are independent.
+ */
+template <class T, class Generator = random::philox>
+class MonteCarlo {
+    public:
+        static_assert(
+                boost::is_same<T, cl_float>::value ||
+                boost::is_same<T, cl_double>::value,
+                "Must use float or double."
+                );
+
+        /// Constructor.
+        MonteCarlo(const std::vector<cl::CommandQueue> &queue,
+                cl_ulong seed = 0)
+            : queue(queue), key(seed), pos(0), partials(queue.size())
+        { }
+
+        /// Estimates the mean of f over the unit cube [0, 1]^Dim.
+        /**
+         * f is evaluated at least `samples` times: the count is rounded up
+         * to whole counter blocks.
+         */
+        template <unsigned Dim = 1, class F>
+        monte_carlo_estimate<T> uniform(const F&, size_t samples) {
+            return estimate<Dim, F>(uniform_dist, samples);
+        }
 
+        /// Estimates the mean of f over Dim independent standard normals.
+        template <unsigned Dim = 1, class F>
+        monte_carlo_estimate<T> normal(const F&, size_t samples) {
+            return estimate<Dim, F>(normal_dist, samples);
+        }
+
+        /// Current position in the stream.
+        cl_ulong offset() const {
+            return pos;
+        }
+
+        /// Moves to the given position in the stream.
+        void seek(cl_ulong offset) {
+            pos = offset;
+        }
+    private:
+        enum distribution { uniform_dist, normal_dist };
+
+        typedef typename std::conditional<
+            sizeof(T) == 4, cl_uint4, cl_ulong4
+            >::type ctr_type;
+
+        typedef typename cl_scalar_of<ctr_type>::type word_type;
+
+        std::vector<cl::CommandQueue> queue;
+        cl_ulong key;
+        cl_ulong pos;
+
+        // Per-group partial statistics.
+        struct partial_buffers {
+            cl::Buffer mean, m2, count;
+            size_t     size;
+
+            partial_buffers() : size(0) {}
+        };
+
+        std::vector<partial_buffers> partials;
+
+        struct kernels {
+            cl::Kernel estimate;
+            uint       wgsize;
+        };
+
+        // Counters per block: a block holds a whole number of samples.
+        template <unsigned Dim>
+        static size_t block_counters() {
+            size_t words = 4;
+            while(words % Dim) words += 4;
+            return words / 4;
+        }
+
+        template <unsigned Dim, class F>
+        static std::string source(distribution dist) {
+            const size_t ctrs  = block_counters<Dim>();
+            const size_t words = 4 * ctrs;
+
+            std::ostringstream src;
+
+            src << standard_kernel_header
+                << "typedef " << type_name<T>() << " real;\n"
+                << "typedef " << type_name<word_type>() << " word;\n";
+
+            Generator::template macro<ctr_type>(src, "rand");
+
+            if (boost::is_same<T, cl_float>::value)
+                src << "#define OPEN(w) ((convert_float((w) >> 8) + 0.5f) * 5.9604644775390625e-8f)\n";
+            else
+                src << "#define OPEN(w) ((convert_double((w) >> 11) + 0.5) * 1.1102230246251565e-16)\n";
+
+            F::define(src, "integrand");
+
+            src <<
+                "kernel void mc_estimate(\n"
+                "    ulong nblk,\n"
+                "    ulong start,\n"
+                "    ulong seed,\n"
+                "    global real  *g_mean,\n"
+                "    global real  *g_m2,\n"
+                "    global ulong *g_count,\n"
+                "    local  real  *l_mean,\n"
+                "    local  real  *l_m2,\n"
+                "    local  ulong *l_count\n"
+                "    )\n"
+                "{\n"
+                "    size_t lid = get_local_id(0);\n"
+                "    size_t wg  = get_local_size(0);\n"
+                "\n"
+                // Sums are shifted by the first value to avoid cancellation
+                // in the variance.
+                "    real  shift = 0, s1 = 0, s2 = 0;\n"
+                "    ulong n = 0;\n"
+                "\n"
+                "    for(ulong b = get_global_id(0); b < nblk; b += get_global_size(0)) {\n"
+                "        real v[" << words << "];\n"
+                "        for(int j = 0; j < " << ctrs << "; j++) {\n"
+                "            ulong c = start + b * " << ctrs << " + j;\n";
+
+            if (sizeof(T) == 4)
+                src << "            ctr_t ctr = (ctr_t)((uint)c, (uint)(c >> 32), 0, 0);\n"
+                       "            key_t key = (key_t)((uint)seed, (uint)(seed >> 32));\n";
+            else
+                src << "            ctr_t ctr = (ctr_t)(c, 0, 0, 0);\n"
+                       "            key_t key = (key_t)(seed, 0);\n";
+
+            src << "            rand(ctr, key);\n"
+                   "            word w[4] = {ctr.s0, ctr.s1, ctr.s2, ctr.s3};\n";
+
+            if (dist == uniform_dist)
+                src << "            for(int k = 0; k < 4; k++) v[4 * j + k] = OPEN(w[k]);\n";
+            else
+                src << "            for(int k = 0; k < 4; k += 2) {\n"
+                       "                real r = sqrt(-2 * log(OPEN(w[k])));\n"
+                       "                real a = 2 * OPEN(w[k + 1]);\n"
+                       "                v[4 * j + k]     = r * cospi(a);\n"
+                       "                v[4 * j + k + 1] = r * sinpi(a);\n"
+                       "            }\n";
+
+            src << "        }\n"
+                   "        for(int s = 0; s < " << words / Dim << "; s++) {\n"
+                   "            real f = integrand(";
+
+            for(unsigned i = 0; i < Dim; i++)
+                src << (i ? ", " : "") << "v[s * " << Dim << " + " << i << "]";
+
+            src << ");\n"
+                "            if (n == 0) shift = f;\n"
+                "            f -= shift;\n"
+                "            s1 += f;\n"
+                "            s2 += f * f;\n"
+                "            n++;\n"
+                "        }\n"
+                "    }\n"
+                "\n"
+                "    l_mean [lid] = n ? shift + s1 / n : 0;\n"
+                "    l_m2   [lid] = n ? s2 - s1 * s1 / n : 0;\n"
+                "    l_count[lid] = n;\n"
+                "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+                "\n"
+                // Pairwise combination of (count, mean, M2), wg is a power
+                // of two.
+                "    for(size_t s = wg / 2; s > 0; s >>= 1) {\n"
+                "        if (lid < s && l_count[lid + s]) {\n"
+                "            ulong na = l_count[lid];\n"
+                "            ulong nn = na + l_count[lid + s];\n"
+                "            real  d  = l_mean[lid + s] - l_mean[lid];\n"
+                "            real  w  = (real)l_count[lid + s] / nn;\n"
+                "            l_mean [lid] += d * w;\n"
+                "            l_m2   [lid] += l_m2[lid + s] + d * d * na * w;\n"
+                "            l_count[lid]  = nn;\n"
+                "        }\n"
+                "        barrier(CLK_LOCAL_MEM_FENCE);\n"
+                "    }\n"
+                "\n"
+                "    if (lid == 0) {\n"
+                "        size_t g = get_group_id(0);\n"
+                "        g_mean [g] = l_mean [0];\n"
+                "        g_m2   [g] = l_m2   [0];\n"
+                "        g_count[g] = l_count[0];\n"
+                "    }\n"
+                "}\n";
+
+            return src.str();
+        }
+
+        template <unsigned Dim, class F>
+        static std::shared_ptr<kernels> get(
+                const cl::CommandQueue &queue, distribution dist)
+        {
+            std::ostringstream sig;
+            sig << dist << " " << Dim << " " << F::body();
+
+            std::shared_ptr<kernels> k = kernel_cache<>::find<kernels>(queue, sig.str());
+            if (k) return k;
+
+            cl::Context context = qctx(queue);
+            cl::Device  device  = qdev(queue);
+
+            auto program = build_sources(context, source<Dim, F>(dist));
+
+            kernels e;
+            e.estimate = cl::Kernel(program, "mc_estimate");
+
+            size_t w = kernel_workgroup_size(e.estimate, device);
+
+            e.wgsize = 1;
+            while(e.wgsize * 2 <= std::min<size_t>(w, 256)) e.wgsize *= 2;
+
+            return kernel_cache<>::insert(queue, e, sig.str());
+        }
+
+        template <unsigned Dim, class F>
+        monte_carlo_estimate<T> estimate(distribution dist, size_t samples) {
+            static_assert(Dim > 0, "Integrand should take at least one argument.");
+
+            const size_t ctrs = block_counters<Dim>();
+            const size_t spb  = 4 * ctrs / Dim;
+
+            size_t   nblk = (samples + spb - 1) / spb;
+            cl_ulong base = (pos + 3) / 4;
+
+            std::vector<size_t> part = partition(nblk, queue);
+            std::vector<size_t> ngroups(queue.size(), 0);
+
+            for(uint d = 0; d < queue.size(); d++) {
+                size_t dblk = part[d + 1] - part[d];
+                if (!dblk) continue;
+
+                std::shared_ptr<kernels> k = get<Dim, F>(queue[d], dist);
+
+                cl::Device device = qdev(queue[d]);
+                size_t cu = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+
+                size_t g_size = device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU ?
+                    cu * k->wgsize : cu * k->wgsize * 4;
+
+                g_size = std::min(g_size, alignup(dblk, k->wgsize));
+                ngroups[d] = g_size / k->wgsize;
+
+                partial_buffers &p = partials[d];
+                if (p.size < ngroups[d]) {
+                    cl::Context context = qctx(queue[d]);
+
+                    p.size  = ngroups[d];
+                    p.mean  = memory_pool<>::create("random",
+                            context, CL_MEM_READ_WRITE, p.size * sizeof(T));
+                    p.m2    = memory_pool<>::create("random",
+                            context, CL_MEM_READ_WRITE, p.size * sizeof(T));
+                    p.count = memory_pool<>::create("random",
+                            context, CL_MEM_READ_WRITE, p.size * sizeof(cl_ulong));
+                }
+
+                cl_ulong start = base + part[d] * ctrs;
+
+                cl::Kernel &K = k->estimate;
+
+                uint a = 0;
+                K.setArg(a++, static_cast<cl_ulong>(dblk));
+                K.setArg(a++, start);
+                K.setArg(a++, key);
+                K.setArg(a++, p.mean);
+                K.setArg(a++, p.m2);
+                K.setArg(a++, p.count);
+                K.setArg(a++, cl::Local(k->wgsize * sizeof(T)));
+                K.setArg(a++, cl::Local(k->wgsize * sizeof(T)));
+                K.setArg(a++, cl::Local(k->wgsize * sizeof(cl_ulong)));
+
+                queue[d].enqueueNDRangeKernel(K, cl::NullRange, g_size, k->wgsize,
+                        0, event_trace<>::kernel(queue[d], K));
+            }
+
+            // Combine the group partials on the host, in double precision.
+            double   mean = 0, m2 = 0;
+            cl_ulong n    = 0;
+
+            for(uint d = 0; d < queue.size(); d++) {
+                if (!ngroups[d]) continue;
+
+                std::vector<T>        gmean(ngroups[d]), gm2(ngroups[d]);
+                std::vector<cl_ulong> gcount(ngroups[d]);
+
+                queue[d].enqueueReadBuffer(partials[d].mean, CL_FALSE, 0,
+                        ngroups[d] * sizeof(T), gmean.data());
+                queue[d].enqueueReadBuffer(partials[d].m2, CL_FALSE, 0,
+                        ngroups[d] * sizeof(T), gm2.data());
+                queue[d].enqueueReadBuffer(partials[d].count, CL_TRUE, 0,
+                        ngroups[d] * sizeof(cl_ulong), gcount.data());
+
+                for(size_t g = 0; g < ngroups[d]; g++) {
+                    if (!gcount[g]) continue;
+
+                    cl_ulong nn = n + gcount[g];
+                    double   dm = gmean[g] - mean;
+                    double   w  = static_cast<double>(gcount[g]) / nn;
+
+                    mean += dm * w;
+                    m2   += gm2[g] + dm * dm * n * w;
+                    n     = nn;
+                }
+            }
+
+            pos = (base + nblk * ctrs) * 4;
+
+            monte_carlo_estimate<T> r;
+            r.samples = n;
+            r.mean    = static_cast<T>(mean);
+            r.stddev  = static_cast<T>(n > 1 ? std::sqrt(m2 / (n - 1)) : 0);
+            r.error   = static_cast<T>(n > 0 ? r.stddev / std::sqrt(static_cast<double>(n)) : 0);
+
+            return r;
+        }
+};
 
 } // namespace vex
 
@@ -41,7 +41,18 @@ THE SOFTWARE.
 #include <sstream>
 #include <numeric>
 #include <limits>
+#include <tuple>
+#include <array>
+#include <memory>
+#include <functional>
+#include <map>
+#include <fstream>
+#include <cstdlib>
+#include <boost/chrono.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
 #include <vexcl/vector.hpp>
+#include <vexcl/scalar.hpp>
 
 namespace vex {
 
@@ -107,6 +118,271 @@ struct MIN {
     }
 };
 
+/// Compensated (Kahan) summation. Should be used as a template parameter for Reductor class.
+/**
+ * Each work-item carries the rounding error of its running sum along and
+ * feeds it back into the next addition, so the sum of a float vector keeps
+ * nearly the accuracy of a double one at the bandwidth of float. Partial
+ * sums of work-items are combined pairwise in local memory, and those of
+ * work-groups are summed with compensation on the host.
+ */
+struct SUM_KAHAN {
+    template <typename T>
+    static T initial() {
+        return T();
+    };
+
+    template <typename T>
+    struct function : UserFunction<function<T>, T(T, T)> {
+        static std::string body() { return "return prm1 + prm2;"; }
+    };
+
+    template <class Iterator>
+    static typename std::iterator_traits<Iterator>::value_type
+    reduce(Iterator begin, Iterator end) {
+        typedef typename std::iterator_traits<Iterator>::value_type T;
+
+        T sum = initial<T>(), err = initial<T>();
+        for(; begin != end; ++begin) {
+            T y = *begin - err;
+            T t = sum + y;
+            err = (t - sum) - y;
+            sum = t;
+        }
+        return sum - err;
+    }
+};
+
+/// Blocked pairwise summation. Should be used as a template parameter for Reductor class.
+/**
+ * Each work-item sums its elements in blocks of VEXCL_PAIRWISE_BLOCK and
+ * adds up the block sums, which bounds the error by the block size plus the
+ * number of blocks rather than by the number of elements. Cheaper than
+ * SUM_KAHAN, but somewhat less accurate for very long vectors.
+ */
+struct SUM_PAIRWISE {
+    template <typename T>
+    static T initial() {
+        return T();
+    };
+
+    template <typename T>
+    struct function : UserFunction<function<T>, T(T, T)> {
+        static std::string body() { return "return prm1 + prm2;"; }
+    };
+
+    template <class Iterator>
+    static typename std::iterator_traits<Iterator>::value_type
+    reduce(Iterator begin, Iterator end) {
+        typedef typename std::iterator_traits<Iterator>::value_type T;
+
+        if (end - begin <= 8)
+            return std::accumulate(begin, end, initial<T>());
+
+        Iterator mid = begin + (end - begin) / 2;
+        return reduce(begin, mid) + reduce(mid, end);
+    }
+};
+
+/// \cond INTERNAL
+
+#ifndef VEXCL_PAIRWISE_BLOCK
+/// Number of elements a work-item sums before adding them to its SUM_PAIRWISE total.
+#  define VEXCL_PAIRWISE_BLOCK 128
+#endif
+
+/// Accumulation of expression values into mySum inside reduction kernels.
+/**
+ * declare() introduces the state a work-item needs besides mySum,
+ * increment() writes the single statement adding a value, and finish()
+ * folds the state into mySum before the work-group stage.
+ */
+template <class RDC>
+struct reduction_accumulator {
+    /// The accumulation relies on exactly rounded additions.
+    static const bool compensated = false;
+
+    static void declare(std::ostream &, const std::string &) {}
+
+    static void increment(std::ostream &os, const std::string &, const std::string &value) {
+        os << "mySum = reduce_operation(mySum, " << value << ");\n";
+    }
+
+    static void finish(std::ostream &) {}
+};
+
+template <>
+struct reduction_accumulator<SUM_KAHAN> {
+    static const bool compensated = true;
+
+    static void declare(std::ostream &os, const std::string &type) {
+        os << "    " << type << " myErr = 0;\n";
+    }
+
+    static void increment(std::ostream &os, const std::string &type, const std::string &value) {
+        os << "{ " << type << " y = (" << value << ") - myErr; "
+           << type << " t = mySum + y; myErr = (t - mySum) - y; mySum = t; }\n";
+    }
+
+    static void finish(std::ostream &os) {
+        os << "    mySum -= myErr;\n";
+    }
+};
+
+template <>
+struct reduction_accumulator<SUM_PAIRWISE> {
+    static const bool compensated = false;
+
+    static void declare(std::ostream &os, const std::string &type) {
+        os << "    " << type << " myBlock = 0;\n"
+              "    uint myCount = 0;\n";
+    }
+
+    static void increment(std::ostream &os, const std::string &, const std::string &value) {
+        os << "{ myBlock += " << value << "; if (++myCount == " << VEXCL_PAIRWISE_BLOCK
+           << ") { mySum += myBlock; myBlock = 0; myCount = 0; } }\n";
+    }
+
+    static void finish(std::ostream &os) {
+        os << "    mySum += myBlock;\n";
+    }
+};
+
+// Double-float reductions bring the df_* functions they call along.
+#define DFLOAT_REDUCTION(rdc, fun) \
+template <> \
+struct rdc::function<dfloat> : UserFunction<rdc::function<dfloat>, dfloat(dfloat, dfloat)> { \
+    static void define(std::ostream &os, const std::string &name) { \
+        os << dfloat_kernel_header; \
+        UserFunction<rdc::function<dfloat>, dfloat(dfloat, dfloat)>::define(os, name); \
+    } \
+    static std::string body() { return "return " #fun "(prm1, prm2);"; } \
+}
+
+DFLOAT_REDUCTION(SUM, df_add);
+DFLOAT_REDUCTION(MAX, df_max);
+DFLOAT_REDUCTION(MIN, df_min);
+
+#undef DFLOAT_REDUCTION
+
+/// Reductions whose function body also combines OpenCL vectors component-wise.
+/**
+ * Kernels for these accumulate vectorized expressions in vector registers
+ * (see vector_simd_context) and fold the components at the end.
+ */
+template <class RDC> struct is_simd_reduction : std::false_type {};
+
+template <> struct is_simd_reduction<SUM> : std::true_type {};
+template <> struct is_simd_reduction<MAX> : std::true_type {};
+template <> struct is_simd_reduction<MIN> : std::true_type {};
+
+/// \endcond
+
+/// Launch configuration of reduction kernels.
+struct reduction_params {
+    size_t wgsize; ///< Upper limit for work-group size.
+    size_t groups; ///< Number of work-groups per compute unit.
+
+    reduction_params(size_t wgsize = 1024, size_t groups = 2)
+        : wgsize(wgsize), groups(groups) {}
+};
+
+/// \cond INTERNAL
+
+/// Per-device launch configuration of reduction kernels.
+/**
+ * The default configuration is used unless VEXCL_TUNE_REDUCTION environment
+ * variable is set. In that case a range of work-group sizes and grid sizes is
+ * benchmarked once per device, and the fastest configuration is kept for the
+ * lifetime of the process. When VEXCL_CACHE_DIR is set, the result is also
+ * stored there next to the program binaries and is reused by later runs.
+ */
+template <bool dummy = true>
+struct reduction_tuning {
+    static_assert(dummy, "dummy parameter should be true");
+
+    /// Launch configuration for the given queue.
+    static reduction_params get(const cl::CommandQueue &queue);
+
+    private:
+        static boost::mutex mx;
+        static std::map<cl_device_id, reduction_params> known;
+
+        static std::string path(const cl::Device &device);
+        static bool load(const cl::Device &device, reduction_params &prm);
+        static void store(const cl::Device &device, const reduction_params &prm);
+        static reduction_params benchmark(const cl::CommandQueue &queue);
+};
+
+/// \endcond
+
+template <typename real, class RDC>
+class Reductor;
+
+template <typename real, class RDCTuple>
+class MultiReductor;
+
+/// Result of an asynchronous reduction.
+/**
+ * Returned by Reductor::async(). Partial results are transferred to the host
+ * in the background; get() waits for the transfers to complete and finishes
+ * the reduction on the host.
+ */
+template <typename T>
+class future {
+    public:
+        /// Constructs invalid future.
+        future() {}
+
+        /// Whether the future refers to a reduction.
+        bool valid() const {
+            return static_cast<bool>(state);
+        }
+
+        /// Checks if the partial results are available without blocking.
+        bool ready() const {
+            for(auto e = state->event.begin(); e != state->event.end(); e++)
+                if (e->getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() != CL_COMPLETE)
+                    return false;
+
+            return true;
+        }
+
+        /// Waits for the partial results to arrive.
+        void wait() const {
+            for(auto e = state->event.begin(); e != state->event.end(); e++)
+                e->wait();
+
+            state->event.clear();
+        }
+
+        /// Waits for the result and returns it.
+        T get() const {
+            if (!state->done) {
+                wait();
+
+                state->value = state->finish(state->data);
+                state->done  = true;
+            }
+
+            return state->value;
+        }
+    private:
+        struct shared_state {
+            std::vector<cl::Event> event;
+            std::vector<T> data;
+            std::function<T(const std::vector<T>&)> finish;
+            bool done;
+            T    value;
+
+            shared_state() : done(false) {}
+        };
+
+        std::shared_ptr<shared_state> state;
+
+        template <typename, class> friend class Reductor;
+};
+
 /// Parallel reduction of arbitrary expression.
 /**
  * Reduction uses small temporary buffer on each device present in the queue
@@ -119,6 +395,10 @@ class Reductor {
         /// Constructor.
         Reductor(const std::vector<cl::CommandQueue> &queue);
 
+        /// Constructor with explicit launch configuration for all devices.
+        Reductor(const std::vector<cl::CommandQueue> &queue,
+                const reduction_params &prm);
+
         /// Compute reduction of the input expression.
         /**
          * The input expression may be as simple as a single vector, although
@@ -131,6 +411,46 @@ class Reductor {
         >::type
         operator()(const Expr &expr) const;
 
+        /// Start reduction of the input expression without waiting for the result.
+        /**
+         * The partial results are read back asynchronously, so the host may
+         * enqueue more work or do something useful before calling get() on
+         * the returned future.
+         */
+        template <class Expr>
+        typename std::enable_if<
+            boost::proto::matches<Expr, vector_expr_grammar>::value,
+            future<real>
+        >::type
+        async(const Expr &expr) const;
+
+        /// Compute reduction of the input expression and keep result on the device.
+        /**
+         * The final reduction stage runs on the device, and the result is
+         * stored into the device-resident scalar, which may be used directly
+         * in subsequent vector expressions. In multi-device contexts each
+         * device reduces its own part, and the per-device values are combined
+         * on the host.
+         */
+        template <class Expr>
+        typename std::enable_if<
+            boost::proto::matches<Expr, vector_expr_grammar>::value,
+            void
+        >::type
+        operator()(scalar<real> &result, const Expr &expr) const;
+
+        /// Compile reduction kernel for the expression in background.
+        /**
+         * Returns immediately. The first call to operator() with the same
+         * expression type blocks only until the background build is complete.
+         */
+        template <class Expr>
+        typename std::enable_if<
+            boost::proto::matches<Expr, vector_expr_grammar>::value,
+            void
+        >::type
+        prewarm(const Expr &expr) const;
+
 #ifdef VEXCL_MULTIVECTOR_HPP
         template <class Expr>
         typename std::enable_if<
@@ -138,22 +458,189 @@ class Reductor {
             std::array<real, boost::result_of<mutltiex_dimension(Expr)>::type::value>
         >::type
         operator()(const Expr &expr) const;
+
+        /// Assign expressions to vectors and reduce another expression in a single kernel.
+        /**
+         * The reduced expression is evaluated after the assignment, so it
+         * sees updated values of the target vectors. The following results
+         * in a single pass over global memory:
+         * \code
+         * real rho = sum(vex::tie(u, r), std::make_tuple(u + alpha * p, r - alpha * q), r * r);
+         * \endcode
+         * The expressions in the tuple should not refer to elements of target
+         * vectors other than the one being assigned.
+         */
+        template <size_t N, class ExprTuple, class Expr>
+        typename std::enable_if<
+            N == std::tuple_size<ExprTuple>::value &&
+            boost::proto::matches<Expr, vector_expr_grammar>::value,
+            real
+        >::type
+        operator()(const multivector<real, N, false> &target,
+                const ExprTuple &assign, const Expr &expr) const;
 #endif
     private:
         const std::vector<cl::CommandQueue> &queue;
         std::vector<size_t> idx;
+        std::vector<size_t> wglimit;
         std::vector<cl::Buffer> dbuf;
 
         mutable std::vector<real> hbuf;
         mutable std::vector<cl::Event> event;
 
+        void init(const std::vector<reduction_params> &prm);
+
         template <class Expr>
         struct exdata {
-            static std::map<cl_context, bool>       compiled;
-            static std::map<cl_context, cl::Kernel> kernel;
-            static std::map<cl_context, size_t>     wgsize;
+            cl::Kernel kernel;
+            size_t     wgsize;
+
+            exdata(const cl::Kernel &kernel, const cl::Device &device)
+                : kernel(kernel)
+            {
+                if (device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU) {
+                    wgsize = 1;
+                } else {
+                    wgsize = kernel_workgroup_size(kernel, device);
+
+                    size_t smem = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() -
+                        kernel.getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(device);
+                    while(wgsize * sizeof(real) > smem)
+                        wgsize /= 2;
+                }
+            }
+        };
+
+        template <class Expr>
+        static std::string reduce_source(const Expr &expr, const cl::Device &device,
+                precision::policy prec, std::string &name);
+
+        // Double-float arithmetic relies on exact rounding of each operation,
+        // so its kernels ignore the precision policy.
+        static precision::policy kernel_precision(const cl::CommandQueue &q) {
+            if (std::is_same<real, dfloat>::value) return precision::standard;
+
+            // Fast relaxed math would cancel the compensation term.
+            precision::policy p = get_precision(q);
+            return reduction_accumulator<RDC>::compensated && p == precision::fast_relaxed ?
+                precision::standard : p;
+        }
+
+        // Writes the value of element idx of the expression, with the
+        // temporaries of its common subexpressions declared in cse.
+        template <class Expr>
+        static void write_element(std::ostream &os, const Expr &expr,
+                precision::policy prec, expression_cse &cse, std::false_type)
+        {
+            vector_expr_context ctx(os);
+            ctx.contract<real>(precision_contraction(prec));
+            write_with_cse(ctx, expr, cse);
+        }
+
+        template <class Expr>
+        static void write_element(std::ostream &os, const Expr &expr,
+                precision::policy, expression_cse&, std::true_type)
+        {
+            dfloat_expr_context ctx(os);
+            boost::proto::eval(expr, ctx);
+        }
+
+        // Wraps the statements of an element into a block declaring the
+        // temporaries of its common subexpressions.
+        static std::string with_temporaries(const expression_cse &cse,
+                const std::string &statement)
+        {
+            if (cse.decl.empty()) return statement;
+
+            return "{\n" + cse.declarations("            ") +
+                "            " + statement + "        }\n";
+        }
+
+        // Kernel cache signature (see vector<T>::assign_signature()).
+        template <class Expr>
+        static std::string reduce_signature(precision::policy prec, const Expr &expr) {
+            return std::is_same<real, dfloat>::value ? precision_signature(prec) :
+                precision_signature(prec) + expression_cse::signature(expr);
+        }
+
+        template <class Expr>
+        void launch(const Expr &expr, const get_expression_properties &prop) const;
+
+        static real finish(const std::vector<real> &data) {
+            return RDC::reduce(data.begin(), data.end());
+        }
+
+        struct final_kernel {
+            cl::Kernel kernel;
+
+            final_kernel(const cl::Kernel &kernel, const cl::Device &)
+                : kernel(kernel) {}
+        };
+
+        static std::string final_source();
+
+        static void reduce_body(std::ostream &source,
+                const std::string &increment_line, bool device_is_cpu);
+
+        static void reduce_body(std::ostream &source,
+                const std::string &increment_line, const std::string &simd_line,
+                uint width, bool device_is_cpu);
+
+        static void local_reduction(std::ostream &source);
+
+#ifdef VEXCL_MULTIVECTOR_HPP
+        template <size_t N, class ExprTuple, class Expr>
+        static std::string fused_source(
+                const ExprTuple &assign, const Expr &expr, const cl::Device &device);
+#endif
+
+#if defined(VEXCL_MULTIVECTOR_HPP) && !defined(BOOST_NO_VARIADIC_TEMPLATES)
+        // Tuple of N copies of RDC.
+        template <size_t N, class... R>
+        struct repeat_rdc {
+            typedef typename repeat_rdc<N - 1, RDC, R...>::type type;
+        };
+
+        template <class... R>
+        struct repeat_rdc<0, R...> {
+            typedef std::tuple<R...> type;
+        };
+
+        // Tuple of component expressions of a multivector expression.
+        template <size_t I, size_t N, class Expr>
+        struct component_tuple {
+            typedef typename boost::result_of<
+                extract_subexpression<I>(const Expr&)
+                >::type head;
+
+            typedef component_tuple<I + 1, N, Expr> tail;
+
+            typedef decltype(std::tuple_cat(
+                        std::declval< std::tuple<head> >(),
+                        std::declval< typename tail::type >()
+                        )) type;
+
+            static type get(const Expr &expr) {
+                return std::tuple_cat(
+                        std::tuple<head>(extract_subexpression<I>()(expr)),
+                        tail::get(expr));
+            }
         };
 
+        template <size_t N, class Expr>
+        struct component_tuple<N, N, Expr> {
+            typedef std::tuple<> type;
+
+            static type get(const Expr &) {
+                return type();
+            }
+        };
+
+        // MultiReductors for multivector expressions, indexed by number of
+        // components.
+        mutable std::map< size_t, std::shared_ptr<void> > fused_components;
+#endif
+
         template <size_t I, size_t N, class Expr>
         typename std::enable_if<I == N, void>::type
         assign_subexpressions(std::array<real, N> &, const Expr &) const
@@ -169,177 +656,338 @@ class Reductor {
         }
 };
 
-template <typename real, class RDC> template <class Expr>
-std::map<cl_context, bool> Reductor<real,RDC>::exdata<Expr>::compiled;
+template <typename real, class RDC>
+Reductor<real,RDC>::Reductor(const std::vector<cl::CommandQueue> &queue)
+    : queue(queue), event(queue.size())
+{
+    std::vector<reduction_params> prm;
+    prm.reserve(queue.size());
 
-template <typename real, class RDC> template <class Expr>
-std::map<cl_context, cl::Kernel> Reductor<real,RDC>::exdata<Expr>::kernel;
+    for(auto q = queue.begin(); q != queue.end(); q++)
+        prm.push_back(reduction_tuning<>::get(*q));
 
-template <typename real, class RDC> template <class Expr>
-std::map<cl_context, size_t> Reductor<real,RDC>::exdata<Expr>::wgsize;
+    init(prm);
+}
 
 template <typename real, class RDC>
-Reductor<real,RDC>::Reductor(const std::vector<cl::CommandQueue> &queue)
+Reductor<real,RDC>::Reductor(
+        const std::vector<cl::CommandQueue> &queue, const reduction_params &prm)
     : queue(queue), event(queue.size())
 {
+    init(std::vector<reduction_params>(queue.size(), prm));
+}
+
+template <typename real, class RDC>
+void Reductor<real,RDC>::init(const std::vector<reduction_params> &prm) {
     idx.reserve(queue.size() + 1);
     idx.push_back(0);
 
-    for(auto q = queue.begin(); q != queue.end(); q++) {
-        cl::Context context = qctx(*q);
-        cl::Device  device  = qdev(*q);
+    wglimit.reserve(queue.size());
 
-        size_t bufsize = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * 2U;
+    for(uint d = 0; d < queue.size(); d++) {
+        cl::Context context = qctx(queue[d]);
+        cl::Device  device  = qdev(queue[d]);
+
+        size_t bufsize = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * prm[d].groups;
         idx.push_back(idx.back() + bufsize);
 
-        dbuf.push_back(cl::Buffer(context, CL_MEM_READ_WRITE, bufsize * sizeof(real)));
+        wglimit.push_back(prm[d].wgsize);
+
+        dbuf.push_back(memory_pool<>::create("reductor",
+                context, CL_MEM_READ_WRITE, bufsize * sizeof(real)));
     }
 
     hbuf.resize(idx.back());
 }
 
 template <typename real, class RDC> template <class Expr>
-typename std::enable_if<
-    boost::proto::matches<Expr, vector_expr_grammar>::value,
-    real
->::type
-Reductor<real,RDC>::operator()(const Expr &expr) const {
-    for(auto q = queue.begin(); q != queue.end(); q++) {
-        cl::Context context = qctx(*q);
-        cl::Device  device  = qdev(*q);
-
-        if (!exdata<Expr>::compiled[context()]) {
+std::string Reductor<real,RDC>::reduce_source(const Expr &expr, const cl::Device &device,
+        precision::policy prec, std::string &name)
+{
+    bool device_is_cpu = device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU;
 
-            bool device_is_cpu = device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU;
+    std::ostringstream kernel_name;
+    vector_name_context name_ctx(kernel_name);
 
-            std::ostringstream kernel_name;
-            vector_name_context name_ctx(kernel_name);
+    kernel_name << "reduce_";
+    boost::proto::eval(expr, name_ctx);
 
-            kernel_name << "reduce_";
-            boost::proto::eval(expr, name_ctx);
+    std::ostringstream increment_line, value;
 
-            std::ostringstream increment_line;
-            vector_expr_context expr_ctx(increment_line);
+    expression_cse cse(expr);
+    write_element(value, expr, prec, cse, std::is_same<real, dfloat>());
+    {
+        std::ostringstream inc;
+        reduction_accumulator<RDC>::increment(inc, type_name<real>(), value.str());
+        increment_line << with_temporaries(cse, inc.str());
+    }
 
-            increment_line << "mySum = reduce_operation(mySum, ";
-            boost::proto::eval(expr, expr_ctx);
-            increment_line << ");\n";
+    uint width = is_simd_reduction<RDC>::value && vector_simd_ok<real>(expr) ?
+        simd_width<real>(device) : 1;
 
-            std::ostringstream source;
-            source << standard_kernel_header;
+    std::ostringstream source;
+    source << standard_kernel_header << precision_header(prec);
 
-            typedef typename RDC::template function<real> fun;
-            fun::define(source, "reduce_operation");
+    typedef typename RDC::template function<real> fun;
+    fun::define(source, "reduce_operation");
 
-            extract_user_functions()( expr, declare_user_function(source) );
+    std::ostringstream simd_line;
+    if (width > 1) {
+        std::ostringstream vtype;
+        vtype << type_name<real>() << width;
 
-            source << "kernel void " << kernel_name.str() << "(\n\t"
-                << type_name<size_t>() << " n";
+        source << vtype.str() << " reduce_vector(\n"
+            "\t" << vtype.str() << " prm1,\n"
+            "\t" << vtype.str() << " prm2\n"
+            ")\n{\n" << fun::body() << "\n}\n\n";
 
-            extract_terminals()( expr, declare_expression_parameter(source) );
+        std::ostringstream simd_value;
+        vector_simd_context simd_ctx(simd_value, type_name<real>(), width);
+        simd_ctx.contract<real>(precision_contraction(prec));
 
-            source << ",\n\tglobal " << type_name<real>() << " *g_odata,\n"
-                "\tlocal  " << type_name<real>() << " *sdata\n"
-                "\t)\n"
-                "{\n";
-            if (device_is_cpu) {
-                source <<
-                    "    size_t grid_size  = get_global_size(0);\n"
-                    "    size_t chunk_size = (n + grid_size - 1) / grid_size;\n"
-                    "    size_t chunk_id   = get_global_id(0);\n"
-                    "    size_t start      = min(n, chunk_size * chunk_id);\n"
-                    "    size_t stop       = min(n, chunk_size * (chunk_id + 1));\n"
-                    "    " << type_name<real>() << " mySum = " << RDC::template initial<real>() << ";\n"
-                    "    for (size_t idx = start; idx < stop; idx++) {\n"
-                    "        " << increment_line.str() <<
-                    "    }\n"
-                    "\n"
-                    "    g_odata[get_group_id(0)] = mySum;\n"
-                    "}\n";
-            } else {
-                source <<
-                    "    size_t tid        = get_local_id(0);\n"
-                    "    size_t block_size = get_local_size(0);\n"
-                    "    size_t p          = get_group_id(0) * block_size * 2 + tid;\n"
-                    "    size_t gridSize   = get_global_size(0) * 2;\n"
-                    "    size_t idx;\n"
-                    "    " << type_name<real>() << " mySum = " << RDC::template initial<real>() << ";\n"
-                    "    while (p < n) {\n"
-                    "        idx = p;\n"
-                    "        " << increment_line.str() <<
-                    "        idx = p + block_size;\n"
-                    "        if (idx < n)\n"
-                    "            " << increment_line.str() <<
-                    "        p += gridSize;\n"
-                    "    }\n"
-                    "    sdata[tid] = mySum;\n"
-                    "\n"
-                    "    barrier(CLK_LOCAL_MEM_FENCE);\n"
-                    "    if (block_size >= 1024) { if (tid < 512) { sdata[tid] = mySum = reduce_operation(mySum, sdata[tid + 512]); } barrier(CLK_LOCAL_MEM_FENCE); }\n"
-                    "    if (block_size >=  512) { if (tid < 256) { sdata[tid] = mySum = reduce_operation(mySum, sdata[tid + 256]); } barrier(CLK_LOCAL_MEM_FENCE); }\n"
-                    "    if (block_size >=  256) { if (tid < 128) { sdata[tid] = mySum = reduce_operation(mySum, sdata[tid + 128]); } barrier(CLK_LOCAL_MEM_FENCE); }\n"
-                    "    if (block_size >=  128) { if (tid <  64) { sdata[tid] = mySum = reduce_operation(mySum, sdata[tid +  64]); } barrier(CLK_LOCAL_MEM_FENCE); }\n"
-                    "\n"
-                    "    if (tid < 32) {\n"
-                    "        local volatile " << type_name<real>() << "* smem = sdata;\n"
-                    "        if (block_size >=  64) { smem[tid] = mySum = reduce_operation(mySum, smem[tid + 32]); }\n"
-                    "        if (block_size >=  32) { smem[tid] = mySum = reduce_operation(mySum, smem[tid + 16]); }\n"
-                    "        if (block_size >=  16) { smem[tid] = mySum = reduce_operation(mySum, smem[tid +  8]); }\n"
-                    "        if (block_size >=   8) { smem[tid] = mySum = reduce_operation(mySum, smem[tid +  4]); }\n"
-                    "        if (block_size >=   4) { smem[tid] = mySum = reduce_operation(mySum, smem[tid +  2]); }\n"
-                    "        if (block_size >=   2) { smem[tid] = mySum = reduce_operation(mySum, smem[tid +  1]); }\n"
-                    "    }\n"
-                    "    if (tid == 0) g_odata[get_group_id(0)] = sdata[0];\n"
-                    "}\n";
-            }
+        expression_cse simd_cse(expr);
+        write_with_cse(simd_ctx, expr, simd_cse);
 
-            auto program = build_sources(context, source.str());
+        simd_line << with_temporaries(simd_cse,
+                "vecSum = reduce_vector(vecSum, " + simd_value.str() + ");\n");
+    }
 
-            exdata<Expr>::kernel[context()]   = cl::Kernel(program, kernel_name.str().c_str());
-            exdata<Expr>::compiled[context()] = true;
+    extract_user_functions()( expr, declare_user_function(source) );
 
-            if (device_is_cpu) {
-                exdata<Expr>::wgsize[context()] = 1;
-            } else {
-                exdata<Expr>::wgsize[context()] = kernel_workgroup_size(
-                        exdata<Expr>::kernel[context()], device);
+    source << "kernel void " << kernel_name.str() << "(\n\t"
+        << type_name<size_t>() << " n";
 
-                size_t smem = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() -
-                    static_cast<cl::Kernel>(
-                            exdata<Expr>::kernel[context()]
-                            ).getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(device);
-                while(exdata<Expr>::wgsize[context()] * sizeof(real) > smem)
-                    exdata<Expr>::wgsize[context()] /= 2;
-            }
-        }
-    }
+    extract_terminals()( expr,
+            declare_expression_parameter(source, 1, std::is_same<real, dfloat>::value) );
 
+    source << ",\n\tglobal " << type_name<real>() << " *g_odata,\n"
+        "\tlocal  " << type_name<real>() << " *sdata\n"
+        "\t)\n";
 
-    get_expression_properties prop;
-    extract_terminals()(expr, prop);
+    if (width > 1)
+        reduce_body(source, increment_line.str(), simd_line.str(), width, device_is_cpu);
+    else
+        reduce_body(source, increment_line.str(), device_is_cpu);
 
-    for(uint d = 0; d < queue.size(); d++) {
-        if (size_t psize = prop.part_size(d)) {
-            cl::Context context = qctx(queue[d]);
+    name = kernel_name.str();
+    return source.str();
+}
 
-            size_t g_size = (idx[d + 1] - idx[d]) * exdata<Expr>::wgsize[context()];
-            auto lmem = cl::Local(exdata<Expr>::wgsize[context()] * sizeof(real));
+template <typename real, class RDC>
+void Reductor<real,RDC>::reduce_body(
+        std::ostream &source, const std::string &increment_line, bool device_is_cpu)
+{
+    typedef reduction_accumulator<RDC> acc;
+
+    source << "{\n";
+    if (device_is_cpu) {
+        source <<
+            "    size_t grid_size  = get_global_size(0);\n"
+            "    size_t chunk_size = (n + grid_size - 1) / grid_size;\n"
+            "    size_t chunk_id   = get_global_id(0);\n"
+            "    size_t start      = min(n, chunk_size * chunk_id);\n"
+            "    size_t stop       = min(n, chunk_size * (chunk_id + 1));\n"
+            "    " << type_name<real>() << " mySum = " << RDC::template initial<real>() << ";\n";
+        acc::declare(source, type_name<real>());
+        source <<
+            "    for (size_t idx = start; idx < stop; idx++) {\n"
+            "        " << increment_line <<
+            "    }\n";
+        acc::finish(source);
+        source <<
+            "\n"
+            "    g_odata[get_group_id(0)] = mySum;\n"
+            "}\n";
+    } else {
+        source <<
+            "    size_t tid        = get_local_id(0);\n"
+            "    size_t block_size = get_local_size(0);\n"
+            "    size_t p          = get_group_id(0) * block_size * 2 + tid;\n"
+            "    size_t gridSize   = get_global_size(0) * 2;\n"
+            "    size_t idx;\n"
+            "    " << type_name<real>() << " mySum = " << RDC::template initial<real>() << ";\n";
+        acc::declare(source, type_name<real>());
+        source <<
+            "    while (p < n) {\n"
+            "        idx = p;\n"
+            "        " << increment_line <<
+            "        idx = p + block_size;\n"
+            "        if (idx < n)\n"
+            "            " << increment_line <<
+            "        p += gridSize;\n"
+            "    }\n";
+        acc::finish(source);
+        source <<
+            "    sdata[tid] = mySum;\n"
+            "\n";
+
+        local_reduction(source);
+    }
+}
 
-            uint pos = 0;
-            exdata<Expr>::kernel[context()].setArg(pos++, psize);
+template <typename real, class RDC>
+void Reductor<real,RDC>::local_reduction(std::ostream &source) {
+    source <<
+            "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+            "    if (block_size >= 1024) { if (tid < 512) { sdata[tid] = mySum = reduce_operation(mySum, sdata[tid + 512]); } barrier(CLK_LOCAL_MEM_FENCE); }\n"
+            "    if (block_size >=  512) { if (tid < 256) { sdata[tid] = mySum = reduce_operation(mySum, sdata[tid + 256]); } barrier(CLK_LOCAL_MEM_FENCE); }\n"
+            "    if (block_size >=  256) { if (tid < 128) { sdata[tid] = mySum = reduce_operation(mySum, sdata[tid + 128]); } barrier(CLK_LOCAL_MEM_FENCE); }\n"
+            "    if (block_size >=  128) { if (tid <  64) { sdata[tid] = mySum = reduce_operation(mySum, sdata[tid +  64]); } barrier(CLK_LOCAL_MEM_FENCE); }\n"
+            "\n"
+            "    if (tid < 32) {\n"
+            "        local volatile " << type_name<real>() << "* smem = sdata;\n"
+            "        if (block_size >=  64) { smem[tid] = mySum = reduce_operation(mySum, smem[tid + 32]); }\n"
+            "        if (block_size >=  32) { smem[tid] = mySum = reduce_operation(mySum, smem[tid + 16]); }\n"
+            "        if (block_size >=  16) { smem[tid] = mySum = reduce_operation(mySum, smem[tid +  8]); }\n"
+            "        if (block_size >=   8) { smem[tid] = mySum = reduce_operation(mySum, smem[tid +  4]); }\n"
+            "        if (block_size >=   4) { smem[tid] = mySum = reduce_operation(mySum, smem[tid +  2]); }\n"
+            "        if (block_size >=   2) { smem[tid] = mySum = reduce_operation(mySum, smem[tid +  1]); }\n"
+            "    }\n"
+            "    if (tid == 0) g_odata[get_group_id(0)] = sdata[0];\n"
+            "}\n";
+}
 
-            extract_terminals()(
+/*
+ The vectorized expression runs over chunks of 'width' elements, split among
+ work-items as the elements are in the scalar kernel, and accumulates in
+ vecSum; the n % width elements left over go to mySum, which then takes the
+ components of vecSum. Work-group reduction is the same as in the scalar
+ kernel.
+ */
+template <typename real, class RDC>
+void Reductor<real,RDC>::reduce_body(
+        std::ostream &source, const std::string &increment_line,
+        const std::string &simd_line, uint width, bool device_is_cpu)
+{
+    std::ostringstream vtype, fold;
+    vtype << type_name<real>() << width;
+
+    for(uint i = 0; i < width; i++)
+        fold << "    mySum = reduce_operation(mySum, vecSum.s" << "0123456789abcdef"[i] << ");\n";
+
+    source << "{\n"
+        "    size_t chunks     = n / " << width << ";\n"
+        "    " << vtype.str() << " vecSum = (" << vtype.str() << ")("
+            << RDC::template initial<real>() << ");\n"
+        "    " << type_name<real>() << " mySum = " << RDC::template initial<real>() << ";\n";
+
+    if (device_is_cpu) {
+        source <<
+            "    size_t grid_size  = get_global_size(0);\n"
+            "    size_t chunk_size = (chunks + grid_size - 1) / grid_size;\n"
+            "    size_t chunk_id   = get_global_id(0);\n"
+            "    size_t start      = min(chunks, chunk_size * chunk_id);\n"
+            "    size_t stop       = min(chunks, chunk_size * (chunk_id + 1));\n"
+            "    for (size_t i = start; i < stop; i++) {\n"
+            "        size_t idx = i * " << width << ";\n"
+            "        " << simd_line <<
+            "    }\n"
+            "    for (size_t idx = chunks * " << width << " + chunk_id; idx < n; idx += grid_size) {\n"
+            "        " << increment_line <<
+            "    }\n"
+            << fold.str() <<
+            "\n"
+            "    g_odata[get_group_id(0)] = mySum;\n"
+            "}\n";
+    } else {
+        source <<
+            "    size_t tid        = get_local_id(0);\n"
+            "    size_t block_size = get_local_size(0);\n"
+            "    for (size_t i = get_global_id(0); i < chunks; i += get_global_size(0)) {\n"
+            "        size_t idx = i * " << width << ";\n"
+            "        " << simd_line <<
+            "    }\n"
+            "    for (size_t idx = chunks * " << width << " + get_global_id(0); idx < n; idx += get_global_size(0)) {\n"
+            "        " << increment_line <<
+            "    }\n"
+            << fold.str() <<
+            "    sdata[tid] = mySum;\n"
+            "\n";
+
+        local_reduction(source);
+    }
+}
+
+template <typename real, class RDC> template <class Expr>
+typename std::enable_if<
+    boost::proto::matches<Expr, vector_expr_grammar>::value,
+    void
+>::type
+Reductor<real,RDC>::prewarm(const Expr &expr) const {
+    for(auto q = queue.begin(); q != queue.end(); q++) {
+        precision::policy prec = kernel_precision(*q);
+
+        std::string name, source = reduce_source(expr, qdev(*q), prec, name);
+
+        kernel_cache<>::build_async< exdata<Expr> >(*q, source, name,
+                precision_options(prec), reduce_signature(prec, expr));
+    }
+}
+
+template <typename real, class RDC> template <class Expr>
+void Reductor<real,RDC>::launch(
+        const Expr &expr, const get_expression_properties &prop) const
+{
+    for(uint d = 0; d < queue.size(); d++) {
+        precision::policy prec = kernel_precision(queue[d]);
+
+        std::string sig = reduce_signature(prec, expr);
+
+        auto krn = kernel_cache<>::find< exdata<Expr> >(queue[d], sig);
+
+        if (!krn) {
+            std::string name, source = reduce_source(expr, qdev(queue[d]), prec, name);
+
+            krn = kernel_cache<>::build< exdata<Expr> >(queue[d], source, name,
+                    precision_options(prec), sig);
+        }
+
+        if (size_t psize = prop.part_size(d)) {
+            size_t wgsize = std::min(krn->wgsize, wglimit[d]);
+            size_t g_size = (idx[d + 1] - idx[d]) * wgsize;
+            auto lmem = cl::Local(wgsize * sizeof(real));
+
+            uint pos = 0;
+            krn->kernel.setArg(pos++, psize);
+
+            extract_terminals()(
                     expr,
-                    set_expression_argument(exdata<Expr>::kernel[context()], d, pos, prop.part_start(d))
+                    set_expression_argument(krn->kernel, d, pos, prop.part_start(d),
+                        std::is_same<real, dfloat>::value)
                     );
 
-            exdata<Expr>::kernel[context()].setArg(pos++, dbuf[d]);
-            exdata<Expr>::kernel[context()].setArg(pos++, lmem);
+            krn->kernel.setArg(pos++, dbuf[d]);
+            krn->kernel.setArg(pos++, lmem);
+
+            if (stream_tracking<>::enabled) {
+                std::vector<cl::Event> wait;
+                cl::Event e;
+
+                extract_terminals()(expr, expression_dependencies(d, wait));
 
-            queue[d].enqueueNDRangeKernel(exdata<Expr>::kernel[context()],
-                    cl::NullRange, g_size, exdata<Expr>::wgsize[context()]);
+                queue[d].enqueueNDRangeKernel(krn->kernel,
+                        cl::NullRange, g_size, wgsize, wait.empty() ? 0 : &wait, &e);
+
+                event_trace<>::add(queue[d], krn->kernel, e);
+                extract_terminals()(expr, expression_reader(d, e));
+            } else {
+                queue[d].enqueueNDRangeKernel(krn->kernel,
+                        cl::NullRange, g_size, wgsize, 0, event_trace<>::kernel(queue[d], krn->kernel));
+            }
         }
     }
+}
+
+template <typename real, class RDC> template <class Expr>
+typename std::enable_if<
+    boost::proto::matches<Expr, vector_expr_grammar>::value,
+    real
+>::type
+Reductor<real,RDC>::operator()(const Expr &expr) const {
+    get_expression_properties prop;
+    extract_terminals()(expr, prop);
+
+    launch(expr, prop);
 
     std::fill(hbuf.begin(), hbuf.end(), RDC::template initial<real>());
 
@@ -355,6 +1003,101 @@ Reductor<real,RDC>::operator()(const Expr &expr) const {
     return RDC::reduce(hbuf.begin(), hbuf.end());
 }
 
+template <typename real, class RDC>
+std::string Reductor<real,RDC>::final_source() {
+    std::ostringstream source;
+    source << standard_kernel_header;
+
+    typedef typename RDC::template function<real> fun;
+    fun::define(source, "reduce_operation");
+
+    source << "kernel void reduce_final(\n\t"
+        << type_name<size_t>() << " n,\n"
+        "\tglobal const " << type_name<real>() << " *g_idata,\n"
+        "\tglobal " << type_name<real>() << " *g_odata\n"
+        "\t)\n"
+        "{\n"
+        "    " << type_name<real>() << " mySum = " << RDC::template initial<real>() << ";\n"
+        "    for (size_t i = 0; i < n; i++)\n"
+        "        mySum = reduce_operation(mySum, g_idata[i]);\n"
+        "    g_odata[0] = mySum;\n"
+        "}\n";
+
+    return source.str();
+}
+
+template <typename real, class RDC> template <class Expr>
+typename std::enable_if<
+    boost::proto::matches<Expr, vector_expr_grammar>::value,
+    void
+>::type
+Reductor<real,RDC>::operator()(scalar<real> &result, const Expr &expr) const {
+    get_expression_properties prop;
+    extract_terminals()(expr, prop);
+
+    launch(expr, prop);
+
+    for(uint d = 0; d < queue.size(); d++) {
+        auto krn = kernel_cache<>::find<final_kernel>(queue[d]);
+
+        if (!krn)
+            krn = kernel_cache<>::build<final_kernel>(
+                    queue[d], final_source(), "reduce_final");
+
+        size_t n = prop.part_size(d) ? idx[d + 1] - idx[d] : 0;
+
+        krn->kernel.setArg(0, n);
+        krn->kernel.setArg(1, dbuf[d]);
+        krn->kernel.setArg(2, result(d));
+
+        queue[d].enqueueNDRangeKernel(krn->kernel, cl::NullRange, 1, 1, 0, event_trace<>::kernel(queue[d], krn->kernel));
+    }
+
+    if (queue.size() > 1) {
+        std::vector<real> part(queue.size());
+
+        for(uint d = 0; d < queue.size(); d++)
+            queue[d].enqueueReadBuffer(result(d), CL_FALSE,
+                    0, sizeof(real), &part[d], 0, &event[d]);
+
+        for(uint d = 0; d < queue.size(); d++)
+            event[d].wait();
+
+        result = RDC::reduce(part.begin(), part.end());
+    }
+}
+
+template <typename real, class RDC> template <class Expr>
+typename std::enable_if<
+    boost::proto::matches<Expr, vector_expr_grammar>::value,
+    future<real>
+>::type
+Reductor<real,RDC>::async(const Expr &expr) const {
+    get_expression_properties prop;
+    extract_terminals()(expr, prop);
+
+    launch(expr, prop);
+
+    future<real> result;
+    result.state = std::make_shared<typename future<real>::shared_state>();
+
+    result.state->data.resize(idx.back(), RDC::template initial<real>());
+    result.state->finish = finish;
+
+    for(uint d = 0; d < queue.size(); d++) {
+        if (!prop.part_size(d)) continue;
+
+        cl::Event e;
+        queue[d].enqueueReadBuffer(dbuf[d], CL_FALSE,
+                0, sizeof(real) * (idx[d + 1] - idx[d]),
+                &result.state->data[idx[d]], 0, &e);
+
+        result.state->event.push_back(e);
+    }
+
+    return result;
+}
+
 #ifdef VEXCL_MULTIVECTOR_HPP
 template <typename real, class RDC> template <class Expr>
 typename std::enable_if<
@@ -363,14 +1106,795 @@ typename std::enable_if<
 >::type
 Reductor<real,RDC>::operator()(const Expr &expr) const {
     const size_t dim = boost::result_of<mutltiex_dimension(Expr)>::type::value;
+
+#ifndef BOOST_NO_VARIADIC_TEMPLATES
+    // All components are reduced in a single pass.
+    typedef MultiReductor<real, typename repeat_rdc<dim>::type> fused_t;
+
+    std::shared_ptr<void> &f = fused_components[dim];
+    if (!f) f = std::make_shared<fused_t>(queue);
+
+    return (*std::static_pointer_cast<fused_t>(f))(
+            component_tuple<0, dim, Expr>::get(expr));
+#else
     std::array<real, dim> result;
 
     assign_subexpressions<0, dim, Expr>(result, expr);
 
     return result;
+#endif
+}
+
+template <typename real, class RDC> template <size_t N, class ExprTuple, class Expr>
+std::string Reductor<real,RDC>::fused_source(
+        const ExprTuple &assign, const Expr &expr, const cl::Device &device)
+{
+    typedef multivector<real, N, false> target_t;
+
+    bool device_is_cpu = device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU;
+
+    std::ostringstream increment_line;
+    increment_line << "{\n";
+
+    {
+        typename target_t::get_expressions f(increment_line);
+        for_each<0>(assign, f);
+    }
+
+    for(uint i = 1; i <= N; i++)
+        increment_line << "\t\tres_" << i << "[idx] = buf_" << i << ";\n";
+
+    std::ostringstream value;
+    vector_expr_context expr_ctx(value, N + 1);
+    boost::proto::eval(expr, expr_ctx);
+
+    increment_line << "\t\t";
+    reduction_accumulator<RDC>::increment(increment_line, type_name<real>(), value.str());
+    increment_line << "\t}\n";
+
+    std::ostringstream source;
+    source << standard_kernel_header;
+
+    typedef typename RDC::template function<real> fun;
+    fun::define(source, "reduce_operation");
+
+    {
+        typename target_t::get_header f(source);
+        for_each<0>(assign, f);
+    }
+
+    extract_user_functions()( expr, declare_user_function(source, N + 1) );
+
+    source << "kernel void fused_reduce(\n\t"
+        << type_name<size_t>() << " n";
+
+    for(uint i = 1; i <= N; i++)
+        source << ",\n\tglobal " << type_name<real>() << " *res_" << i;
+
+    {
+        typename target_t::get_params f(source);
+        for_each<0>(assign, f);
+    }
+
+    extract_terminals()( expr, declare_expression_parameter(source, N + 1) );
+
+    source << ",\n\tglobal " << type_name<real>() << " *g_odata,\n"
+        "\tlocal  " << type_name<real>() << " *sdata\n"
+        "\t)\n";
+
+    reduce_body(source, increment_line.str(), device_is_cpu);
+
+    return source.str();
+}
+
+template <typename real, class RDC> template <size_t N, class ExprTuple, class Expr>
+typename std::enable_if<
+    N == std::tuple_size<ExprTuple>::value &&
+    boost::proto::matches<Expr, vector_expr_grammar>::value,
+    real
+>::type
+Reductor<real,RDC>::operator()(const multivector<real, N, false> &target,
+        const ExprTuple &assign, const Expr &expr) const
+{
+    typedef multivector<real, N, false> target_t;
+    typedef exdata< std::tuple<ExprTuple, Expr> > fused_t;
+
+    for(uint d = 0; d < queue.size(); d++) {
+        auto krn = kernel_cache<>::find<fused_t>(queue[d]);
+
+        if (!krn) {
+            std::string source = fused_source<N>(assign, expr, qdev(queue[d]));
+
+            krn = kernel_cache<>::build<fused_t>(queue[d], source, "fused_reduce");
+        }
+
+        if (size_t psize = target(0).part_size(d)) {
+            size_t wgsize = std::min(krn->wgsize, wglimit[d]);
+            size_t g_size = (idx[d + 1] - idx[d]) * wgsize;
+            auto lmem = cl::Local(wgsize * sizeof(real));
+            size_t part_start = target(0).part_start(d);
+
+            uint pos = 0;
+            krn->kernel.setArg(pos++, psize);
+
+            for(uint i = 0; i < N; i++)
+                krn->kernel.setArg(pos++, target(i)(d));
+
+            {
+                typename target_t::set_arguments f(krn->kernel, d, pos, part_start);
+                for_each<0>(assign, f);
+            }
+
+            extract_terminals()(
+                    expr,
+                    set_expression_argument(krn->kernel, d, pos, part_start)
+                    );
+
+            krn->kernel.setArg(pos++, dbuf[d]);
+            krn->kernel.setArg(pos++, lmem);
+
+            queue[d].enqueueNDRangeKernel(krn->kernel,
+                    cl::NullRange, g_size, wgsize, 0, event_trace<>::kernel(queue[d], krn->kernel));
+        }
+    }
+
+    std::fill(hbuf.begin(), hbuf.end(), RDC::template initial<real>());
+
+    for(uint d = 0; d < queue.size(); d++) {
+        if (target(0).part_size(d))
+            queue[d].enqueueReadBuffer(dbuf[d], CL_FALSE,
+                    0, sizeof(real) * (idx[d + 1] - idx[d]), &hbuf[idx[d]], 0, &event[d]);
+    }
+
+    for(uint d = 0; d < queue.size(); d++)
+        if (target(0).part_size(d)) event[d].wait();
+
+    return RDC::reduce(hbuf.begin(), hbuf.end());
 }
 #endif
 
+/// Parallel reduction of several expressions in a single kernel.
+/**
+ * RDCTuple is a std::tuple of reduction kinds, one for each expression. All
+ * expressions are evaluated in a single pass over the input, and the partial
+ * results are read back with a single transfer per device:
+ * \code
+ * vex::MultiReductor<double, std::tuple<vex::SUM, vex::MAX>> sum_max(ctx);
+ *
+ * std::array<double, 2> v = sum_max( std::make_tuple(r * r, fabs(r)) );
+ * \endcode
+ * All expressions should have the same size.
+ */
+template <typename real, class RDCTuple>
+class MultiReductor {
+    public:
+        /// Number of reductions computed at once.
+        static const size_t K = std::tuple_size<RDCTuple>::value;
+
+        /// Constructor.
+        MultiReductor(const std::vector<cl::CommandQueue> &queue);
+
+        /// Compute reductions of the input expressions.
+        template <class ExprTuple>
+        typename std::enable_if<
+            std::tuple_size<ExprTuple>::value == K,
+            std::array<real, K>
+        >::type
+        operator()(const ExprTuple &expr) const;
+    private:
+        const std::vector<cl::CommandQueue> &queue;
+        std::vector<size_t> idx;
+        std::vector<cl::Buffer> dbuf;
+
+        mutable std::vector<real> hbuf;
+        mutable std::vector<cl::Event> event;
+
+        template <class ExprTuple>
+        struct exdata {
+            cl::Kernel kernel;
+            size_t     wgsize;
+
+            exdata(const cl::Kernel &kernel, const cl::Device &device)
+                : kernel(kernel)
+            {
+                if (device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU) {
+                    wgsize = 1;
+                } else {
+                    wgsize = kernel_workgroup_size(kernel, device);
+
+                    size_t smem = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() -
+                        kernel.getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(device);
+                    while(wgsize * K * sizeof(real) > smem)
+                        wgsize /= 2;
+                }
+            }
+        };
+
+        struct source_parts {
+            std::ostringstream functions, params, init, increment, local, tree, store;
+        };
+
+        template <class ExprTuple>
+        static std::string reduce_source(const ExprTuple &expr, const cl::Device &device);
+
+        template <size_t I, class ExprTuple>
+        static typename std::enable_if<I == K, void>::type
+        get_source(const ExprTuple &, source_parts &)
+        { }
+
+        template <size_t I, class ExprTuple>
+        static typename std::enable_if<I < K, void>::type
+        get_source(const ExprTuple &expr, source_parts &src)
+        {
+            typedef typename std::tuple_element<I, RDCTuple>::type RDC;
+            typedef typename RDC::template function<real> fun;
+
+            const int k = I + 1;
+
+            std::ostringstream op;
+            op << "reduce_operation_" << k;
+
+            fun::define(src.functions, op.str());
+
+            extract_user_functions()(
+                    std::get<I>(expr), declare_user_function(src.functions, k));
+
+            extract_terminals()(
+                    std::get<I>(expr), declare_expression_parameter(src.params, k));
+
+            src.init << "    " << type_name<real>() << " mySum_" << k << " = "
+                << RDC::template initial<real>() << ";\n";
+
+            vector_expr_context expr_ctx(src.increment, k);
+            src.increment << "        mySum_" << k << " = " << op.str()
+                << "(mySum_" << k << ", ";
+            boost::proto::eval(std::get<I>(expr), expr_ctx);
+            src.increment << ");\n";
+
+            src.local <<
+                "    local " << type_name<real>() << " *sdata_" << k
+                << " = sdata + " << I << " * block_size;\n"
+                "    sdata_" << k << "[tid] = mySum_" << k << ";\n";
+
+            src.tree <<
+                "            sdata_" << k << "[tid] = mySum_" << k << " = "
+                << op.str() << "(mySum_" << k << ", sdata_" << k << "[tid + s]);\n";
+
+            src.store <<
+                "        g_odata[" << I << " * groups + get_group_id(0)] = mySum_" << k << ";\n";
+
+            get_source<I + 1, ExprTuple>(expr, src);
+        }
+
+        template <size_t I, class ExprTuple>
+        static typename std::enable_if<I == K, void>::type
+        set_arguments(const ExprTuple &, cl::Kernel &, uint, uint &, size_t)
+        { }
+
+        template <size_t I, class ExprTuple>
+        static typename std::enable_if<I < K, void>::type
+        set_arguments(const ExprTuple &expr,
+                cl::Kernel &krn, uint d, uint &pos, size_t part_start)
+        {
+            extract_terminals()(
+                    std::get<I>(expr),
+                    set_expression_argument(krn, d, pos, part_start)
+                    );
+
+            set_arguments<I + 1, ExprTuple>(expr, krn, d, pos, part_start);
+        }
+
+        template <size_t I>
+        typename std::enable_if<I == K, void>::type
+        get_result(std::array<real, K> &, const get_expression_properties &) const
+        { }
+
+        template <size_t I>
+        typename std::enable_if<I < K, void>::type
+        get_result(std::array<real, K> &result, const get_expression_properties &prop) const
+        {
+            typedef typename std::tuple_element<I, RDCTuple>::type RDC;
+
+            std::vector<real> part;
+            part.reserve(idx.back());
+
+            for(uint d = 0; d < queue.size(); d++) {
+                if (!prop.part_size(d)) continue;
+
+                size_t groups = idx[d + 1] - idx[d];
+                auto begin = hbuf.begin() + K * idx[d] + I * groups;
+
+                part.insert(part.end(), begin, begin + groups);
+            }
+
+            result[I] = part.empty() ?
+                RDC::template initial<real>() :
+                RDC::reduce(part.begin(), part.end());
+
+            get_result<I + 1>(result, prop);
+        }
+};
+
+template <typename real, class RDCTuple>
+const size_t MultiReductor<real,RDCTuple>::K;
+
+template <typename real, class RDCTuple>
+MultiReductor<real,RDCTuple>::MultiReductor(const std::vector<cl::CommandQueue> &queue)
+    : queue(queue), event(queue.size())
+{
+    idx.reserve(queue.size() + 1);
+    idx.push_back(0);
+
+    for(auto q = queue.begin(); q != queue.end(); q++) {
+        cl::Context context = qctx(*q);
+        cl::Device  device  = qdev(*q);
+
+        size_t bufsize = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * 2U;
+        idx.push_back(idx.back() + bufsize);
+
+        dbuf.push_back(memory_pool<>::create("reductor",
+                context, CL_MEM_READ_WRITE, K * bufsize * sizeof(real)));
+    }
+
+    hbuf.resize(K * idx.back());
+}
+
+template <typename real, class RDCTuple> template <class ExprTuple>
+std::string MultiReductor<real,RDCTuple>::reduce_source(
+        const ExprTuple &expr, const cl::Device &device)
+{
+    bool device_is_cpu = device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU;
+
+    source_parts src;
+    get_source<0, ExprTuple>(expr, src);
+
+    std::ostringstream source;
+
+    source << standard_kernel_header << src.functions.str() <<
+        "kernel void multi_reduce(\n\t" << type_name<size_t>() << " n"
+        << src.params.str() <<
+        ",\n\tglobal " << type_name<real>() << " *g_odata,\n"
+        "\tlocal  " << type_name<real>() << " *sdata\n"
+        "\t)\n"
+        "{\n"
+        "    size_t tid        = get_local_id(0);\n"
+        "    size_t block_size = get_local_size(0);\n"
+        "    size_t groups     = get_num_groups(0);\n"
+        << src.init.str();
+
+    if (device_is_cpu) {
+        source <<
+            "    size_t grid_size  = get_global_size(0);\n"
+            "    size_t chunk_size = (n + grid_size - 1) / grid_size;\n"
+            "    size_t chunk_id   = get_global_id(0);\n"
+            "    size_t start      = min(n, chunk_size * chunk_id);\n"
+            "    size_t stop       = min(n, chunk_size * (chunk_id + 1));\n"
+            "    for (size_t idx = start; idx < stop; idx++) {\n"
+            << src.increment.str() <<
+            "    }\n";
+    } else {
+        source <<
+            "    for (size_t idx = get_global_id(0); idx < n; idx += get_global_size(0)) {\n"
+            << src.increment.str() <<
+            "    }\n";
+    }
+
+    source << "\n" << src.local.str() <<
+        "\n"
+        "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+        "    for (size_t s = block_size / 2; s > 0; s >>= 1) {\n"
+        "        if (tid < s) {\n"
+        << src.tree.str() <<
+        "        }\n"
+        "        barrier(CLK_LOCAL_MEM_FENCE);\n"
+        "    }\n"
+        "\n"
+        "    if (tid == 0) {\n"
+        << src.store.str() <<
+        "    }\n"
+        "}\n";
+
+    return source.str();
+}
+
+template <typename real, class RDCTuple> template <class ExprTuple>
+typename std::enable_if<
+    std::tuple_size<ExprTuple>::value == MultiReductor<real,RDCTuple>::K,
+    std::array<real, MultiReductor<real,RDCTuple>::K>
+>::type
+MultiReductor<real,RDCTuple>::operator()(const ExprTuple &expr) const {
+    get_expression_properties prop;
+    extract_terminals()(std::get<0>(expr), prop);
+
+    for(uint d = 0; d < queue.size(); d++) {
+        auto krn = kernel_cache<>::find< exdata<ExprTuple> >(queue[d]);
+
+        if (!krn) {
+            std::string source = reduce_source(expr, qdev(queue[d]));
+
+            krn = kernel_cache<>::build< exdata<ExprTuple> >(
+                    queue[d], source, "multi_reduce");
+        }
+
+        if (size_t psize = prop.part_size(d)) {
+            size_t g_size = (idx[d + 1] - idx[d]) * krn->wgsize;
+            auto lmem = cl::Local(K * krn->wgsize * sizeof(real));
+
+            uint pos = 0;
+            krn->kernel.setArg(pos++, psize);
+
+            set_arguments<0, ExprTuple>(expr, krn->kernel, d, pos, prop.part_start(d));
+
+            krn->kernel.setArg(pos++, dbuf[d]);
+            krn->kernel.setArg(pos++, lmem);
+
+            queue[d].enqueueNDRangeKernel(krn->kernel,
+                    cl::NullRange, g_size, krn->wgsize, 0, event_trace<>::kernel(queue[d], krn->kernel));
+        }
+    }
+
+    for(uint d = 0; d < queue.size(); d++) {
+        if (prop.part_size(d))
+            queue[d].enqueueReadBuffer(dbuf[d], CL_FALSE,
+                    0, K * sizeof(real) * (idx[d + 1] - idx[d]),
+                    &hbuf[K * idx[d]], 0, &event[d]);
+    }
+
+    for(uint d = 0; d < queue.size(); d++)
+        if (prop.part_size(d)) event[d].wait();
+
+    std::array<real, K> result;
+    get_result<0>(result, prop);
+
+    return result;
+}
+
+/// Index of the extreme element of an expression.
+/**
+ * RDC selects between two values (vex::MIN, vex::MAX, or a user reduction
+ * kind whose operation returns one of its arguments). The result is the
+ * position of the selected element; ties go to the smallest index:
+ * \code
+ * vex::ArgReductor<double, vex::MAX> argmax(ctx);
+ * size_t i = argmax(fabs(x));
+ * \endcode
+ * Each work-item keeps a (value, index) pair over a grid-stride loop, the
+ * pairs are reduced in local memory, and the per-group pairs are reduced on
+ * the host.
+ */
+template <typename real, class RDC>
+class ArgReductor {
+    public:
+        /// Constructor.
+        ArgReductor(const std::vector<cl::CommandQueue> &queue)
+            : queue(queue), event(queue.size())
+        {
+            idx.reserve(queue.size() + 1);
+            idx.push_back(0);
+
+            for(auto q = queue.begin(); q != queue.end(); q++) {
+                cl::Context context = qctx(*q);
+                cl::Device  device  = qdev(*q);
+
+                size_t bufsize = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() *
+                    reduction_tuning<>::get(*q).groups;
+                idx.push_back(idx.back() + bufsize);
+
+                vbuf.push_back(memory_pool<>::create("reductor",
+                        context, CL_MEM_READ_WRITE, bufsize * sizeof(real)));
+                ibuf.push_back(memory_pool<>::create("reductor",
+                        context, CL_MEM_READ_WRITE, bufsize * sizeof(size_t)));
+            }
+
+            hval.resize(idx.back());
+            hidx.resize(idx.back());
+        }
+
+        /// Position of the extreme element of the expression.
+        template <class Expr>
+        typename std::enable_if<
+            boost::proto::matches<Expr, vector_expr_grammar>::value,
+            size_t
+        >::type
+        operator()(const Expr &expr) const {
+            get_expression_properties prop;
+            extract_terminals()(expr, prop);
+
+            size_t none = prop.size;
+
+            for(uint d = 0; d < queue.size(); d++) {
+                size_t psize = prop.part_size(d);
+                if (!psize) continue;
+
+                auto krn = kernel_cache<>::find< exdata<Expr> >(queue[d]);
+
+                if (!krn) {
+                    std::string name, source = reduce_source(expr, qdev(queue[d]), name);
+                    krn = kernel_cache<>::build< exdata<Expr> >(queue[d], source, name);
+                }
+
+                size_t wgsize = krn->wgsize;
+                size_t g_size = (idx[d + 1] - idx[d]) * wgsize;
+
+                uint pos = 0;
+                krn->kernel.setArg(pos++, psize);
+                krn->kernel.setArg(pos++, prop.part_start(d));
+
+                extract_terminals()(
+                        expr,
+                        set_expression_argument(krn->kernel, d, pos, prop.part_start(d))
+                        );
+
+                krn->kernel.setArg(pos++, vbuf[d]);
+                krn->kernel.setArg(pos++, ibuf[d]);
+                krn->kernel.setArg(pos++, cl::Local(wgsize * sizeof(real)));
+                krn->kernel.setArg(pos++, cl::Local(wgsize * sizeof(size_t)));
+
+                queue[d].enqueueNDRangeKernel(krn->kernel,
+                        cl::NullRange, g_size, wgsize, 0,
+                        event_trace<>::kernel(queue[d], krn->kernel));
+            }
+
+            std::fill(hidx.begin(), hidx.end(), none);
+
+            for(uint d = 0; d < queue.size(); d++) {
+                if (!prop.part_size(d)) continue;
+
+                size_t m = idx[d + 1] - idx[d];
+
+                queue[d].enqueueReadBuffer(vbuf[d], CL_FALSE,
+                        0, m * sizeof(real), &hval[idx[d]]);
+                queue[d].enqueueReadBuffer(ibuf[d], CL_FALSE,
+                        0, m * sizeof(size_t), &hidx[idx[d]], 0, &event[d]);
+            }
+
+            for(uint d = 0; d < queue.size(); d++)
+                if (prop.part_size(d)) event[d].wait();
+
+            // Groups that got no elements report index n of their part; the
+            // parts are visited in order, so ties keep the smallest index.
+            size_t best = none;
+            real   value = RDC::template initial<real>();
+            for(uint d = 0; d < queue.size(); d++) {
+                size_t end = prop.part_start(d) + prop.part_size(d);
+
+                for(size_t j = idx[d]; j < idx[d + 1]; j++) {
+                    if (hidx[j] >= end) continue;
+
+                    if (best == none || better(hval[j], value) ||
+                            (hval[j] == value && hidx[j] < best))
+                    {
+                        best  = hidx[j];
+                        value = hval[j];
+                    }
+                }
+            }
+
+            return best;
+        }
+    private:
+        const std::vector<cl::CommandQueue> &queue;
+        std::vector<size_t> idx;
+        std::vector<cl::Buffer> vbuf, ibuf;
+
+        mutable std::vector<real> hval;
+        mutable std::vector<size_t> hidx;
+        mutable std::vector<cl::Event> event;
+
+        // Whether RDC prefers a to b.
+        static bool better(real a, real b) {
+            real pair[] = {b, a};
+            real r = RDC::reduce(pair, pair + 2);
+            return r == a && a != b;
+        }
+
+        template <class Expr>
+        struct exdata {
+            cl::Kernel kernel;
+            size_t     wgsize;
+
+            exdata(const cl::Kernel &kernel, const cl::Device &device)
+                : kernel(kernel)
+            {
+                if (device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU) {
+                    wgsize = 1;
+                    return;
+                }
+
+                // The local tree needs a power of two.
+                size_t w = kernel_workgroup_size(kernel, device);
+                size_t smem = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() -
+                    kernel.getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(device);
+
+                wgsize = 1;
+                while(wgsize * 2 <= w && wgsize * 2 * (sizeof(real) + sizeof(size_t)) <= smem)
+                    wgsize *= 2;
+            }
+        };
+
+        template <class Expr>
+        static std::string reduce_source(const Expr &expr,
+                const cl::Device &device, std::string &name)
+        {
+            bool device_is_cpu = device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU;
+
+            std::ostringstream kernel_name;
+            vector_name_context name_ctx(kernel_name);
+
+            kernel_name << "argreduce_";
+            boost::proto::eval(expr, name_ctx);
+
+            std::ostringstream value;
+            vector_expr_context expr_ctx(value);
+            boost::proto::eval(expr, expr_ctx);
+
+            std::string real_t = type_name<real>();
+            std::string idx_t  = type_name<size_t>();
+
+            std::ostringstream source;
+            source << standard_kernel_header;
+
+            typedef typename RDC::template function<real> fun;
+            fun::define(source, "reduce_operation");
+
+            extract_user_functions()( expr, declare_user_function(source) );
+
+            // Candidate b replaces a when it is selected over a, or when it
+            // is equal and comes first.
+            source <<
+                "bool take(" << real_t << " a, " << idx_t << " ia, "
+                << real_t << " b, " << idx_t << " ib, " << idx_t << " n) {\n"
+                "    if (ib >= n) return false;\n"
+                "    if (ia >= n) return true;\n"
+                "    " << real_t << " r = reduce_operation(a, b);\n"
+                "    return (r == b && r != a) || (a == b && ib < ia);\n"
+                "}\n\n"
+                "kernel void " << kernel_name.str() << "(\n\t"
+                << idx_t << " n,\n\t"
+                << idx_t << " start";
+
+            extract_terminals()( expr, declare_expression_parameter(source) );
+
+            source << ",\n"
+                "\tglobal " << real_t << " *g_val,\n"
+                "\tglobal " << idx_t  << " *g_idx,\n"
+                "\tlocal  " << real_t << " *s_val,\n"
+                "\tlocal  " << idx_t  << " *s_idx\n"
+                "\t)\n"
+                "{\n"
+                "    size_t tid = get_local_id(0);\n"
+                "    size_t block_size = get_local_size(0);\n"
+                "    " << real_t << " best = " << RDC::template initial<real>() << ";\n"
+                "    " << idx_t  << " best_idx = n;\n"
+                "    size_t grid_size  = get_global_size(0);\n";
+
+            // Contiguous chunks on CPUs, grid-stride loop elsewhere.
+            if (device_is_cpu)
+                source <<
+                    "    size_t chunk_size = (n + grid_size - 1) / grid_size;\n"
+                    "    size_t start_idx  = min(n, chunk_size * get_global_id(0));\n"
+                    "    size_t stop_idx   = min(n, start_idx + chunk_size);\n"
+                    "    for(size_t idx = start_idx; idx < stop_idx; idx++) {\n";
+            else
+                source <<
+                    "    for(size_t idx = get_global_id(0); idx < n; idx += grid_size) {\n";
+
+            source <<
+                "        " << real_t << " v = " << value.str() << ";\n"
+                "        if (take(best, best_idx, v, idx, n)) { best = v; best_idx = idx; }\n"
+                "    }\n"
+                "    s_val[tid] = best;\n"
+                "    s_idx[tid] = best_idx;\n"
+                "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+                "    for(size_t s = block_size / 2; s > 0; s >>= 1) {\n"
+                "        if (tid < s && take(s_val[tid], s_idx[tid], s_val[tid + s], s_idx[tid + s], n)) {\n"
+                "            s_val[tid] = s_val[tid + s];\n"
+                "            s_idx[tid] = s_idx[tid + s];\n"
+                "        }\n"
+                "        barrier(CLK_LOCAL_MEM_FENCE);\n"
+                "    }\n"
+                "    if (tid == 0) {\n"
+                "        g_val[get_group_id(0)] = s_val[0];\n"
+                "        g_idx[get_group_id(0)] = s_idx[0] < n ? start + s_idx[0] : start + n;\n"
+                "    }\n"
+                "}\n";
+
+            name = kernel_name.str();
+            return source.str();
+        }
+};
+
+template <bool dummy>
+boost::mutex reduction_tuning<dummy>::mx;
+
+template <bool dummy>
+std::map<cl_device_id, reduction_params> reduction_tuning<dummy>::known;
+
+template <bool dummy>
+reduction_params reduction_tuning<dummy>::get(const cl::CommandQueue &queue) {
+    cl::Device device = qdev(queue);
+
+    boost::lock_guard<boost::mutex> lock(mx);
+
+    auto p = known.find(device());
+    if (p != known.end()) return p->second;
+
+    reduction_params prm;
+
+    if (!load(device, prm) && getenv("VEXCL_TUNE_REDUCTION")) {
+        prm = benchmark(queue);
+        store(device, prm);
+    }
+
+    known.insert(std::make_pair(device(), prm));
+    return prm;
+}
+
+template <bool dummy>
+std::string reduction_tuning<dummy>::path(const cl::Device &device) {
+    return program_binaries<>::path(device, "reduction tuning", "", ".tune");
+}
+
+template <bool dummy>
+bool reduction_tuning<dummy>::load(const cl::Device &device, reduction_params &prm) {
+    if (!program_binaries<>::dir()) return false;
+
+    std::ifstream f(path(device).c_str());
+
+    size_t wgsize, groups;
+    if (!(f >> wgsize >> groups) || !wgsize || !groups) return false;
+
+    prm = reduction_params(wgsize, groups);
+    return true;
+}
+
+template <bool dummy>
+void reduction_tuning<dummy>::store(const cl::Device &device, const reduction_params &prm) {
+    if (!program_binaries<>::dir()) return;
+
+    std::ofstream f(path(device).c_str());
+    f << prm.wgsize << " " << prm.groups << std::endl;
+}
+
+template <bool dummy>
+reduction_params reduction_tuning<dummy>::benchmark(const cl::CommandQueue &queue) {
+    typedef boost::chrono::high_resolution_clock clock;
+
+    const size_t n = 1 << 22;
+    const int    repeat = 8;
+
+    bool device_is_cpu =
+        qdev(queue).getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU;
+
+    std::vector<cl::CommandQueue> q(1, queue);
+    vex::vector<float> x(q, n);
+    x = 1;
+
+    reduction_params best;
+    double best_time = std::numeric_limits<double>::max();
+
+    for(size_t wgsize = device_is_cpu ? 1 : 1024; wgsize >= (device_is_cpu ? 1 : 32); wgsize /= 2) {
+        for(size_t groups = 1; groups <= 16; groups *= 2) {
+            reduction_params prm(wgsize, groups);
+            Reductor<float, SUM> sum(q, prm);
+
+            // Warm up: compiles the kernel on the first pass.
+            sum(x);
+
+            clock::time_point start = clock::now();
+            for(int i = 0; i < repeat; i++) sum(x);
+            double time = boost::chrono::duration<double>(clock::now() - start).count();
+
+            if (time < best_time) {
+                best_time = time;
+                best = prm;
+            }
+        }
+    }
+
+    return best;
+}
+
 } // namespace vex
 
 #ifdef WIN32
@@ -0,0 +1,605 @@
+#ifndef VEXCL_REDUCE_BY_KEY_HPP
+#define VEXCL_REDUCE_BY_KEY_HPP
+
+/*
+The MIT License
+
+Copyright (c) 2012-2013 Denis Demidov <ddemidov@ksu.ru>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/**
+ * \file   vexcl/reduce_by_key.hpp
+ * \author Denis Demidov <ddemidov@ksu.ru>
+ * \brief  Reductions of device vectors by key.
+ */
+
+#ifdef WIN32
+#  pragma warning(push)
+#  pragma warning(disable : 4267 4290)
+#  define NOMINMAX
+#endif
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <stdexcept>
+#include <type_traits>
+#include <CL/cl.hpp>
+#include <vexcl/util.hpp>
+#include <vexcl/kernel_cache.hpp>
+#include <vexcl/vector.hpp>
+#include <vexcl/reduce.hpp>
+#include <vexcl/scan.hpp>
+
+namespace vex {
+
+/// \cond INTERNAL
+
+namespace reduce_by_key_detail {
+
+// Kernels of the reduction by sorted keys. rbk_heads marks the first element
+// of every run of equal keys; once the heads are scanned into run numbers and
+// the values are scanned by segment, the last element of each run holds its
+// key and its total, and rbk_scatter writes them out at the run number. When
+// the first run continues a run of the preceding device part, its total goes
+// to carry instead, and the other runs move one position down.
+template <typename K, typename V>
+struct sorted_kernels {
+    cl::Kernel heads;
+    cl::Kernel scatter;
+    size_t     wgsize;
+    size_t     g_size;
+
+    static std::string source() {
+        std::ostringstream src;
+
+        src << standard_kernel_header <<
+            "typedef " << type_name<K>() << " key_t;\n"
+            "typedef " << type_name<V>() << " real;\n"
+            "typedef " << type_name<size_t>() << " idx_t;\n"
+            "kernel void rbk_heads(\n"
+            "    idx_t n,\n"
+            "    global const key_t *key,\n"
+            "    global uint *head\n"
+            "    )\n"
+            "{\n"
+            "    for(idx_t i = get_global_id(0); i < n; i += get_global_size(0))\n"
+            "        head[i] = (i == 0) || (key[i] != key[i - 1]);\n"
+            "}\n"
+            "kernel void rbk_scatter(\n"
+            "    idx_t n, uint cont,\n"
+            "    global const key_t *key,\n"
+            "    global const uint *pos,\n"
+            "    global const real *sum,\n"
+            "    global key_t *okey,\n"
+            "    global real *oval,\n"
+            "    global real *carry\n"
+            "    )\n"
+            "{\n"
+            "    for(idx_t i = get_global_id(0); i < n; i += get_global_size(0)) {\n"
+            "        if (i + 1 < n && pos[i + 1] == pos[i]) continue;\n"
+            "        uint p = pos[i] - 1;\n"
+            "        if (cont && p == 0) {\n"
+            "            carry[0] = sum[i];\n"
+            "        } else {\n"
+            "            okey[p - cont] = key[i];\n"
+            "            oval[p - cont] = sum[i];\n"
+            "        }\n"
+            "    }\n"
+            "}\n";
+
+        return src.str();
+    }
+
+    static std::shared_ptr<sorted_kernels> get(const cl::CommandQueue &queue) {
+        std::shared_ptr<sorted_kernels> k = kernel_cache<>::find<sorted_kernels>(queue);
+        if (k) return k;
+
+        cl::Context context = qctx(queue);
+        cl::Device  device  = qdev(queue);
+
+        auto program = build_sources(context, source());
+
+        sorted_kernels e;
+        e.heads   = cl::Kernel(program, "rbk_heads");
+        e.scatter = cl::Kernel(program, "rbk_scatter");
+
+        e.wgsize = std::min<size_t>(256, std::min(
+                    kernel_workgroup_size(e.heads, device),
+                    kernel_workgroup_size(e.scatter, device)));
+
+        e.g_size = device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU ?
+            device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * e.wgsize :
+            device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * e.wgsize * 4;
+
+        return kernel_cache<>::insert(queue, e);
+    }
+};
+
+// Native atomic for the reduction kind, if there is one for 32-bit integers.
+template <class OP> struct native_atomic {
+    static const char* name() { return 0; }
+};
+
+template <> struct native_atomic<SUM> {
+    static const char* name() { return "atomic_add"; }
+};
+
+template <> struct native_atomic<MIN> {
+    static const char* name() { return "atomic_min"; }
+};
+
+template <> struct native_atomic<MAX> {
+    static const char* name() { return "atomic_max"; }
+};
+
+// Atomic update of a group in the given address space: a native atomic for
+// 32-bit integers where OP has one, a compare-and-swap loop on the bits of
+// the value otherwise.
+template <class OP, typename V>
+std::string group_update(const std::string &space) {
+    const bool wide = sizeof(V) == 8;
+    const char *native = native_atomic<OP>::name();
+
+    std::ostringstream src;
+
+    src << "void update_" << space << "(" << space << " real *p, real v) {\n";
+
+    if (native && std::is_integral<V>::value && !wide) {
+        src << "    " << native << "(p, v);\n";
+    } else {
+        src <<
+            "    union { real r; bits b; } old, upd;\n"
+            "    do {\n"
+            "        old.r = *p;\n"
+            "        upd.r = oper(old.r, v);\n"
+            "    } while(" << (wide ? "atom_cmpxchg" : "atomic_cmpxchg") <<
+            "((volatile " << space << " bits*)p, old.b, upd.b) != old.b);\n";
+    }
+
+    src << "}\n";
+
+    return src.str();
+}
+
+// Kernels of the reduction by unsorted keys from [0, nkeys). Group totals
+// are kept in local memory, updated atomically by the work-items of the
+// group and merged into the global ones at the end, when all of them fit;
+// otherwise the work-items update the global totals directly.
+template <class OP, typename K, typename V>
+struct group_kernels {
+    cl::Kernel init;
+    cl::Kernel local_groups;
+    cl::Kernel global_groups;
+    size_t     wgsize;
+    size_t     g_size;
+    size_t     lmem;
+
+    static std::string source() {
+        const bool wide = sizeof(V) == 8;
+
+        std::ostringstream src;
+
+        src << standard_kernel_header;
+
+        if (wide) src <<
+            "#pragma OPENCL EXTENSION cl_khr_int64_base_atomics: enable\n";
+
+        src <<
+            "typedef " << type_name<K>() << " key_t;\n"
+            "typedef " << type_name<V>() << " real;\n"
+            "typedef " << (wide ? "ulong" : "uint") << " bits;\n"
+            "typedef " << type_name<size_t>() << " idx_t;\n";
+
+        OP::template function<V>::define(src, "oper");
+
+        src << group_update<OP, V>("global") << group_update<OP, V>("local") <<
+            "kernel void group_init(idx_t m, real identity, global real *y) {\n"
+            "    for(idx_t i = get_global_id(0); i < m; i += get_global_size(0))\n"
+            "        y[i] = identity;\n"
+            "}\n"
+            "kernel void group_local(\n"
+            "    idx_t n, uint nkeys, real identity,\n"
+            "    global const key_t *key,\n"
+            "    global const real *val,\n"
+            "    global real *y,\n"
+            "    local real *acc\n"
+            "    )\n"
+            "{\n"
+            "    size_t lid = get_local_id(0), wg = get_local_size(0);\n"
+            "    for(uint k = lid; k < nkeys; k += wg) acc[k] = identity;\n"
+            "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+            "    for(idx_t i = get_global_id(0); i < n; i += get_global_size(0)) {\n"
+            "        key_t k = key[i];\n"
+            "        if ((ulong)k < nkeys) update_local(acc + k, val[i]);\n"
+            "    }\n"
+            "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+            "    for(uint k = lid; k < nkeys; k += wg)\n"
+            "        if (acc[k] != identity) update_global(y + k, acc[k]);\n"
+            "}\n"
+            "kernel void group_global(\n"
+            "    idx_t n, ulong nkeys,\n"
+            "    global const key_t *key,\n"
+            "    global const real *val,\n"
+            "    global real *y\n"
+            "    )\n"
+            "{\n"
+            "    for(idx_t i = get_global_id(0); i < n; i += get_global_size(0)) {\n"
+            "        key_t k = key[i];\n"
+            "        if ((ulong)k < nkeys) update_global(y + k, val[i]);\n"
+            "    }\n"
+            "}\n";
+
+        return src.str();
+    }
+
+    static std::shared_ptr<group_kernels> get(const cl::CommandQueue &queue) {
+        std::shared_ptr<group_kernels> k = kernel_cache<>::find<group_kernels>(queue);
+        if (k) return k;
+
+        static_assert(std::is_integral<K>::value, "group_by: keys should be integral");
+        static_assert(sizeof(V) == 4 || sizeof(V) == 8, "group_by: values should be 32 or 64-bit");
+
+        cl::Context context = qctx(queue);
+        cl::Device  device  = qdev(queue);
+
+        if (sizeof(V) == 8 && device.getInfo<CL_DEVICE_EXTENSIONS>().find(
+                    "cl_khr_int64_base_atomics") == std::string::npos)
+            throw std::runtime_error("group_by: 64-bit values need cl_khr_int64_base_atomics");
+
+        auto program = build_sources(context, source());
+
+        group_kernels e;
+        e.init          = cl::Kernel(program, "group_init");
+        e.local_groups  = cl::Kernel(program, "group_local");
+        e.global_groups = cl::Kernel(program, "group_global");
+
+        e.wgsize = std::min<size_t>(256, std::min(
+                    kernel_workgroup_size(e.local_groups, device),
+                    kernel_workgroup_size(e.global_groups, device)));
+
+        e.g_size = device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU ?
+            device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * e.wgsize :
+            device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * e.wgsize * 4;
+
+        // Leave room for the compiler's own use of local memory.
+        e.lmem = static_cast<size_t>(device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>()) / 2;
+
+        return kernel_cache<>::insert(queue, e);
+    }
+};
+
+// Copies count elements of a buffer on queue[d] to y, starting at position
+// pos of y (see device_copy()).
+template <typename T>
+void place(const std::vector<cl::CommandQueue> &queue, uint d,
+        const cl::Buffer &src, size_t count, size_t pos, vector<T> &y)
+{
+    std::vector<cl::Event> copies;
+
+    for(uint e = 0; e < queue.size(); e++) {
+        size_t lo = std::max(pos,         y.part_start(e));
+        size_t hi = std::min(pos + count, y.part_start(e) + y.part_size(e));
+
+        if (lo >= hi) continue;
+
+        copies.push_back(device_copy(
+                    queue[d], src,  (lo - pos) * sizeof(T),
+                    queue[e], y(e), (lo - y.part_start(e)) * sizeof(T),
+                    (hi - lo) * sizeof(T)));
+    }
+
+    // The source is a temporary of the caller.
+    if (!copies.empty()) cl::Event::waitForEvents(copies);
+}
+
+} // namespace reduce_by_key_detail
+
+/// \endcond
+
+/// Reduction of values by runs of equal keys.
+/**
+ * For every run of equal consecutive keys, writes the key to okeys and the
+ * OP-reduction of the corresponding values to ovals; OP is vex::SUM,
+ * vex::MIN, vex::MAX or any other reduction kind of vex::Reductor. When the
+ * keys are sorted, this is a reduction by key. okeys and ovals are resized to
+ * the number of runs, which is returned:
+ * \code
+ * vex::sort_by_key(keys, vals);
+ * size_t m = vex::reduce_by_key(keys, vals, ukeys, sums);
+ * vex::reduce_by_key<vex::MAX>(keys, vals, ukeys, maxima);
+ * \endcode
+ * The heads of the runs are marked and scanned into run numbers, the values
+ * are scanned by segment, and the last element of each run is written out.
+ * Each device reduces its own part; a run spanning parts is joined on the
+ * host, and the reduced parts are placed into the outputs directly where the
+ * output part lives on the same device, through the host otherwise. keys and
+ * vals should have the same size and partitioning.
+ */
+template <class OP = SUM, typename K, typename V>
+size_t reduce_by_key(const vector<K> &keys, const vector<V> &vals,
+        vector<K> &okeys, vector<V> &ovals)
+{
+    typedef reduce_by_key_detail::sorted_kernels<K, V> kernels_t;
+
+    const std::vector<cl::CommandQueue> &queue = keys.queue_list();
+
+    if (keys.size() != vals.size())
+        throw std::invalid_argument("reduce_by_key: vector sizes differ");
+
+    if (keys.size() > std::numeric_limits<cl_uint>::max())
+        throw std::invalid_argument("reduce_by_key: too many elements");
+
+    for(uint d = 0; d < queue.size(); d++)
+        if (keys.part_size(d) != vals.part_size(d))
+            throw std::invalid_argument("reduce_by_key: vectors are partitioned differently");
+
+    // The first run of a part continues the last run of the preceding
+    // nonempty part when their boundary keys are equal.
+    std::vector<K> first(queue.size()), last(queue.size());
+    std::vector<cl::Event> event(2 * queue.size());
+
+    for(uint d = 0; d < queue.size(); d++) {
+        size_t n = keys.part_size(d);
+        if (!n) continue;
+
+        queue[d].enqueueReadBuffer(keys(d), CL_FALSE, 0, sizeof(K),
+                &first[d], 0, &event[2 * d]);
+        queue[d].enqueueReadBuffer(keys(d), CL_FALSE, (n - 1) * sizeof(K), sizeof(K),
+                &last[d], 0, &event[2 * d + 1]);
+    }
+
+    std::vector<cl_uint> cont(queue.size(), 0);
+
+    for(uint d = 0, prev = 0, seen = 0; d < queue.size(); d++) {
+        if (!keys.part_size(d)) continue;
+
+        event[2 * d].wait();
+        event[2 * d + 1].wait();
+
+        cont[d] = seen && first[d] == last[prev];
+        prev = d;
+        seen = 1;
+    }
+
+    // Runs of every part.
+    std::vector< vector<cl_uint> > pos(queue.size());
+    std::vector< vector<V> >       sum(queue.size());
+    std::vector<cl_uint>           runs(queue.size(), 0);
+    std::vector<cl::Event>         done(queue.size());
+
+    for(uint d = 0; d < queue.size(); d++) {
+        size_t n = keys.part_size(d);
+        if (!n) continue;
+
+        const kernels_t &k = *kernels_t::get(queue[d]);
+
+        std::vector<cl::CommandQueue> q(1, queue[d]);
+
+        vector<cl_uint> head(q, n);
+
+        pos[d].resize(q, n);
+        sum[d].resize(q, n);
+
+        uint p = 0;
+        k.heads.setArg(p++, n);
+        k.heads.setArg(p++, keys(d));
+        k.heads.setArg(p++, head(0));
+
+        queue[d].enqueueNDRangeKernel(k.heads, cl::NullRange,
+                std::min(alignup(n, k.wgsize), k.g_size), k.wgsize,
+                0, event_trace<>::kernel(queue[d], k.heads, n * sizeof(K)));
+
+        inclusive_scan(head, pos[d]);
+        inclusive_scan_by_segment<OP>(vector<V>(queue[d], vals(d), n), head, sum[d]);
+
+        queue[d].enqueueReadBuffer(pos[d](0), CL_FALSE, (n - 1) * sizeof(cl_uint),
+                sizeof(cl_uint), &runs[d], 0, &done[d]);
+    }
+
+    std::vector<size_t>     m(queue.size(), 0);
+    std::vector<cl::Buffer> rkey(queue.size()), rval(queue.size()), carry(queue.size());
+
+    for(uint d = 0; d < queue.size(); d++) {
+        size_t n = keys.part_size(d);
+        if (!n) continue;
+
+        done[d].wait();
+        m[d] = runs[d] - cont[d];
+
+        const kernels_t &k = *kernels_t::get(queue[d]);
+
+        cl::Context context = qctx(queue[d]);
+
+        rkey[d]  = memory_pool<>::create("reduce_by_key",
+                context, CL_MEM_READ_WRITE, std::max<size_t>(m[d], 1) * sizeof(K));
+        rval[d]  = memory_pool<>::create("reduce_by_key",
+                context, CL_MEM_READ_WRITE, std::max<size_t>(m[d], 1) * sizeof(V));
+        carry[d] = memory_pool<>::create("reduce_by_key", context, CL_MEM_READ_WRITE, sizeof(V));
+
+        uint p = 0;
+        k.scatter.setArg(p++, n);
+        k.scatter.setArg(p++, cont[d]);
+        k.scatter.setArg(p++, keys(d));
+        k.scatter.setArg(p++, pos[d](0));
+        k.scatter.setArg(p++, sum[d](0));
+        k.scatter.setArg(p++, rkey[d]);
+        k.scatter.setArg(p++, rval[d]);
+        k.scatter.setArg(p++, carry[d]);
+
+        queue[d].enqueueNDRangeKernel(k.scatter, cl::NullRange,
+                std::min(alignup(n, k.wgsize), k.g_size), k.wgsize,
+                0, event_trace<>::kernel(queue[d], k.scatter, n * (sizeof(K) + sizeof(V))));
+    }
+
+    // Runs continued from a preceding part are joined with the last run of
+    // the part where they start.
+    for(uint d = 0; d < queue.size(); d++) {
+        if (!cont[d]) continue;
+
+        uint o = d - 1;
+        while(!m[o]) o--;
+
+        V v[2];
+        queue[o].enqueueReadBuffer(rval[o], CL_TRUE, (m[o] - 1) * sizeof(V), sizeof(V), &v[0]);
+        queue[d].enqueueReadBuffer(carry[d], CL_TRUE, 0, sizeof(V), &v[1]);
+
+        v[0] = OP::reduce(v, v + 2);
+
+        queue[o].enqueueWriteBuffer(rval[o], CL_TRUE, (m[o] - 1) * sizeof(V), sizeof(V), &v[0]);
+    }
+
+    size_t total = std::accumulate(m.begin(), m.end(), static_cast<size_t>(0));
+
+    okeys.resize(queue, total);
+    ovals.resize(queue, total);
+
+    for(uint d = 0, start = 0; d < queue.size(); start += m[d++]) {
+        if (!m[d]) continue;
+
+        reduce_by_key_detail::place(queue, d, rkey[d], m[d], start, okeys);
+        reduce_by_key_detail::place(queue, d, rval[d], m[d], start, ovals);
+    }
+
+    return total;
+}
+
+/// Reduction of values by unsorted keys from a bounded range.
+/**
+ * out[k] receives the OP-reduction of the values whose key is k, for the
+ * integer keys in [0, nkeys); values with keys outside of the range are
+ * ignored, and groups without values receive OP::initial(). out is resized
+ * to nkeys:
+ * \code
+ * vex::group_by(store, sales, nstores, revenue);
+ * vex::group_by(store, ones, nstores, count);
+ * vex::group_by<vex::MAX>(store, sales, nstores, best);
+ * \endcode
+ * The keys need not be sorted. When the groups fit into local memory, every
+ * work-group reduces into its own copy with local atomics, and the copies
+ * are merged into the result with global atomics; larger key ranges are
+ * updated with global atomics directly. Sums, minima and maxima of 32-bit
+ * integers use the native atomics, other cases a compare-and-swap loop
+ * (64-bit values need cl_khr_int64_base_atomics). On several devices each
+ * device reduces its part into all groups, and the partial results are
+ * combined on the host.
+ */
+template <class OP = SUM, typename K, typename V>
+void group_by(const vector<K> &keys, const vector<V> &vals, size_t nkeys,
+        vector<V> &out)
+{
+    typedef reduce_by_key_detail::group_kernels<OP, K, V> kernels_t;
+
+    const std::vector<cl::CommandQueue> &queue = keys.queue_list();
+
+    if (keys.size() != vals.size())
+        throw std::invalid_argument("group_by: vector sizes differ");
+
+    for(uint d = 0; d < queue.size(); d++)
+        if (keys.part_size(d) != vals.part_size(d))
+            throw std::invalid_argument("group_by: vectors are partitioned differently");
+
+    out.resize(queue, nkeys);
+    if (!nkeys) return;
+
+    const V identity = OP::template initial<V>();
+    const bool single = queue.size() == 1;
+
+    std::vector<cl::Buffer> part(queue.size());
+
+    for(uint d = 0; d < queue.size(); d++) {
+        size_t n = keys.part_size(d);
+        if (!n && !single) continue;
+
+        const kernels_t &k = *kernels_t::get(queue[d]);
+
+        part[d] = single ? out(0) :
+            memory_pool<>::create("reduce_by_key",
+                    qctx(queue[d]), CL_MEM_READ_WRITE, nkeys * sizeof(V));
+
+        uint p = 0;
+        k.init.setArg(p++, nkeys);
+        k.init.setArg(p++, identity);
+        k.init.setArg(p++, part[d]);
+
+        queue[d].enqueueNDRangeKernel(k.init, cl::NullRange,
+                std::min(alignup(nkeys, k.wgsize), k.g_size), k.wgsize,
+                0, event_trace<>::kernel(queue[d], k.init));
+
+        if (!n) continue;
+
+        cl::Kernel run;
+        p = 0;
+
+        if (nkeys * sizeof(V) <= k.lmem) {
+            run = k.local_groups;
+            run.setArg(p++, n);
+            run.setArg(p++, static_cast<cl_uint>(nkeys));
+            run.setArg(p++, identity);
+            run.setArg(p++, keys(d));
+            run.setArg(p++, vals(d));
+            run.setArg(p++, part[d]);
+            run.setArg(p++, cl::Local(nkeys * sizeof(V)));
+        } else {
+            run = k.global_groups;
+            run.setArg(p++, n);
+            run.setArg(p++, static_cast<cl_ulong>(nkeys));
+            run.setArg(p++, keys(d));
+            run.setArg(p++, vals(d));
+            run.setArg(p++, part[d]);
+        }
+
+        queue[d].enqueueNDRangeKernel(run, cl::NullRange,
+                std::min(alignup(n, k.wgsize), k.g_size), k.wgsize,
+                0, event_trace<>::kernel(queue[d], run, n * (sizeof(K) + sizeof(V))));
+    }
+
+    if (single) return;
+
+    // Partial results of the devices are combined on the host.
+    std::vector<V> result(nkeys, identity), h(nkeys);
+
+    for(uint d = 0; d < queue.size(); d++) {
+        if (!keys.part_size(d)) continue;
+
+        queue[d].enqueueReadBuffer(part[d], CL_TRUE, 0, nkeys * sizeof(V), h.data());
+
+        for(size_t i = 0; i < nkeys; i++) {
+            V v[2] = {result[i], h[i]};
+            result[i] = OP::reduce(v, v + 2);
+        }
+    }
+
+    vex::copy(result, out);
+}
+
+} // namespace vex
+
+#ifdef WIN32
+#  pragma warning(pop)
+#endif
+
+// vim: et
+#endif
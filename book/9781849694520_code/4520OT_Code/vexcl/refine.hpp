@@ -0,0 +1,104 @@
+#ifndef VEXCL_REFINE_HPP
+#define VEXCL_REFINE_HPP
+
+/*
+The MIT License
+
+Copyright (c) 2012-2013 Denis Demidov <ddemidov@ksu.ru>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/**
+ * \file   vexcl/refine.hpp
+ * \author Denis Demidov <ddemidov@ksu.ru>
+ * \brief  Mixed precision iterative refinement.
+ */
+
+#ifdef WIN32
+#  pragma warning(push)
+#  pragma warning(disable : 4267 4290)
+#  define NOMINMAX
+#endif
+
+#include <cmath>
+#include <vector>
+#include <CL/cl.hpp>
+#include <vexcl/vector.hpp>
+#include <vexcl/reduce.hpp>
+#include <vexcl/spmat.hpp>
+
+namespace vex {
+
+/// Mixed precision iterative refinement.
+/**
+ * Solves \f$Au = f\f$ by repeatedly solving the residual equation
+ * \f$Ae = r\f$ approximately with inner(r, e) and updating \f$u += e\f$. The
+ * residual is always computed with the accurate matrix A, while the inner
+ * solver may use a cheaper copy of the matrix, e.g. one with values stored in
+ * single or half precision:
+ * \code
+ * vex::SpMat<double>                      A(ctx, n, n, row, col, val);
+ * vex::SpMat<double, size_t, size_t, float> A_lo(ctx, n, n, row, col, val);
+ *
+ * vex::refine(A, f, u, [&](const vex::vector<double> &r, vex::vector<double> &e) {
+ *     cg(A_lo, r, e, 1e-3); // Loose inner tolerance.
+ * });
+ * \endcode
+ * Iterations stop when the residual norm drops below tol times the norm of
+ * the right-hand side. u should contain the initial approximation; e is
+ * zeroed before each call of the inner solver. Returns the number of outer
+ * iterations.
+ */
+template <class Matrix, typename real, class InnerSolver>
+size_t refine(const Matrix &A, const vector<real> &f, vector<real> &u,
+        InnerSolver &&inner, real tol = 1e-8, size_t maxiter = 100)
+{
+    const std::vector<cl::CommandQueue> &queue = f.queue_list();
+
+    Reductor<real, SUM> sum(queue);
+
+    vector<real> r(queue, f.size());
+    vector<real> e(queue, f.size());
+
+    real norm_f = std::sqrt(sum(f * f));
+    if (norm_f == 0) norm_f = 1;
+
+    r = f - A * u;
+
+    size_t iter = 0;
+    for(; iter < maxiter && std::sqrt(sum(r * r)) > tol * norm_f; iter++) {
+        e = 0;
+        inner(static_cast<const vector<real>&>(r), e);
+
+        u += e;
+        r = f - A * u;
+    }
+
+    return iter;
+}
+
+} // namespace vex
+
+#ifdef WIN32
+#  pragma warning(pop)
+#endif
+
+// vim: et
+#endif
@@ -0,0 +1,267 @@
+#ifndef VEXCL_REORDER_HPP
+#define VEXCL_REORDER_HPP
+
+/*
+The MIT License
+
+Copyright (c) 2012-2013 Denis Demidov <ddemidov@ksu.ru>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/**
+ * \file   vexcl/reorder.hpp
+ * \author Denis Demidov <ddemidov@ksu.ru>
+ * \brief  Bandwidth-reducing reordering of sparse matrices.
+ */
+
+#ifdef WIN32
+#  pragma warning(push)
+#  pragma warning(disable : 4267 4290)
+#  define NOMINMAX
+#endif
+
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <CL/cl.hpp>
+#include <vexcl/vector.hpp>
+
+namespace vex {
+
+/// Reverse Cuthill-McKee reordering of a sparse matrix.
+/**
+ * SpMat splits matrix rows into contiguous strips, one per device, so the
+ * volume of ghost values exchanged between devices depends on the matrix
+ * bandwidth. For unstructured meshes the original numbering often has large
+ * bandwidth. Reordering the matrix with RCM before it is handed to SpMat
+ * keeps most of the nonzeros near the diagonal, and with them most of the
+ * columns inside the strip of their row:
+ * \code
+ * vex::reorder<> rcm(n, row.data(), col.data());
+ *
+ * std::vector<size_t> prow, pcol;
+ * std::vector<double> pval;
+ * rcm.matrix(row.data(), col.data(), val.data(), prow, pcol, pval);
+ *
+ * vex::SpMat<double> A(ctx, n, n, prow.data(), pcol.data(), pval.data());
+ *
+ * vex::vector<double> f(ctx, rcm.forward(rhs)), u(ctx, n);
+ * // ... solve A u = f ...
+ * std::vector<double> x = rcm.inverse(u);
+ * \endcode
+ * The adjacency graph is taken from the sparsity pattern of the matrix,
+ * which should be structurally symmetric for best results.
+ */
+template <typename idx_t = size_t, typename column_t = size_t>
+class reorder {
+    public:
+        /// Computes the permutation.
+        reorder(size_t n, const idx_t *row, const column_t *col)
+            : perm(n), iperm(n)
+        {
+            std::vector<size_t> degree(n);
+            for(size_t i = 0; i < n; i++)
+                degree[i] = row[i + 1] - row[i];
+
+            std::vector<char> visited(n, 0);
+            size_t pos = 0;
+
+            // Process each connected component.
+            for(size_t seed = 0; seed < n; seed++) {
+                if (visited[seed]) continue;
+
+                size_t start = peripheral(seed, row, col, degree);
+
+                visited[start] = 1;
+                perm[pos++] = start;
+
+                std::vector<size_t> nbr;
+
+                for(size_t head = pos - 1; head < pos; head++) {
+                    size_t i = perm[head];
+
+                    // Unvisited neighbours in order of increasing degree.
+                    nbr.clear();
+                    for(idx_t j = row[i]; j < row[i + 1]; j++) {
+                        size_t c = col[j];
+                        if (c < n && !visited[c]) {
+                            visited[c] = 1;
+                            nbr.push_back(c);
+                        }
+                    }
+
+                    std::stable_sort(nbr.begin(), nbr.end(),
+                            [&degree](size_t a, size_t b) {
+                                return degree[a] < degree[b];
+                            });
+
+                    for(auto c = nbr.begin(); c != nbr.end(); c++)
+                        perm[pos++] = *c;
+                }
+            }
+
+            std::reverse(perm.begin(), perm.end());
+
+            for(size_t i = 0; i < n; i++) iperm[perm[i]] = i;
+        }
+
+        /// New-to-old row numbering: row i of reordered matrix is row perm[i] of the original one.
+        const std::vector<size_t>& forward_map() const {
+            return perm;
+        }
+
+        /// Old-to-new row numbering.
+        const std::vector<size_t>& inverse_map() const {
+            return iperm;
+        }
+
+        /// Builds reordered matrix \f$P A P^T\f$ in CSR format.
+        /**
+         * Columns inside each row are kept sorted.
+         */
+        template <typename real>
+        void matrix(const idx_t *row, const column_t *col, const real *val,
+                std::vector<idx_t> &prow, std::vector<column_t> &pcol,
+                std::vector<real> &pval) const
+        {
+            size_t n = perm.size();
+
+            prow.resize(n + 1);
+            prow[0] = 0;
+            for(size_t i = 0; i < n; i++)
+                prow[i + 1] = prow[i] + (row[perm[i] + 1] - row[perm[i]]);
+
+            pcol.resize(prow[n]);
+            pval.resize(prow[n]);
+
+#pragma omp parallel
+            {
+                std::vector< std::pair<column_t, real> > buf;
+
+#pragma omp for
+                for(long i = 0; i < static_cast<long>(n); i++) {
+                    size_t o = perm[i];
+
+                    buf.clear();
+                    for(idx_t j = row[o]; j < row[o + 1]; j++)
+                        buf.push_back(std::make_pair(
+                                    static_cast<column_t>(iperm[col[j]]), val[j]));
+
+                    std::sort(buf.begin(), buf.end(),
+                            [](const std::pair<column_t, real> &a,
+                               const std::pair<column_t, real> &b) {
+                                return a.first < b.first;
+                            });
+
+                    idx_t k = prow[i];
+                    for(auto b = buf.begin(); b != buf.end(); b++, k++) {
+                        pcol[k] = b->first;
+                        pval[k] = b->second;
+                    }
+                }
+            }
+        }
+
+        /// Permutes vector from the original to the new numbering.
+        template <typename T>
+        std::vector<T> forward(const std::vector<T> &x) const {
+            std::vector<T> y(x.size());
+            for(size_t i = 0; i < perm.size(); i++) y[i] = x[perm[i]];
+            return y;
+        }
+
+        /// Permutes vector from the new numbering back to the original one.
+        template <typename T>
+        std::vector<T> inverse(const std::vector<T> &x) const {
+            std::vector<T> y(x.size());
+            for(size_t i = 0; i < perm.size(); i++) y[perm[i]] = x[i];
+            return y;
+        }
+
+        /// Copies device vector to host and permutes it to the original numbering.
+        template <typename T>
+        std::vector<T> inverse(const vex::vector<T> &x) const {
+            std::vector<T> h(x.size());
+            vex::copy(x, h);
+            return inverse(h);
+        }
+    private:
+        std::vector<size_t> perm, iperm;
+
+        // Finds pseudo-peripheral node of the component containing seed by
+        // repeated breadth-first searches (George-Liu algorithm).
+        static size_t peripheral(size_t seed, const idx_t *row,
+                const column_t *col, const std::vector<size_t> &degree)
+        {
+            size_t n = degree.size();
+
+            std::vector<size_t> level(n, n);
+            std::vector<size_t> touched;
+
+            size_t root = seed, height = 0;
+
+            for(int iter = 0; iter < 8; iter++) {
+                for(auto t = touched.begin(); t != touched.end(); t++)
+                    level[*t] = n;
+                touched.clear();
+
+                std::deque<size_t> q(1, root);
+                level[root] = 0;
+                touched.push_back(root);
+
+                size_t last = root;
+
+                while(!q.empty()) {
+                    size_t i = q.front(); q.pop_front();
+
+                    // Among the nodes of the last level prefer one of the
+                    // smallest degree.
+                    if (level[i] > level[last] ||
+                            (level[i] == level[last] && degree[i] < degree[last]))
+                        last = i;
+
+                    for(idx_t j = row[i]; j < row[i + 1]; j++) {
+                        size_t c = col[j];
+                        if (c < n && level[c] == n) {
+                            level[c] = level[i] + 1;
+                            touched.push_back(c);
+                            q.push_back(c);
+                        }
+                    }
+                }
+
+                if (iter > 0 && level[last] <= height) break;
+
+                height = level[last];
+                root   = last;
+            }
+
+            return root;
+        }
+};
+
+} // namespace vex
+
+#ifdef WIN32
+#  pragma warning(pop)
+#endif
+
+// vim: et
+#endif
@@ -0,0 +1,120 @@
+#ifndef VEXCL_SCALAR_HPP
+#define VEXCL_SCALAR_HPP
+
+/*
+The MIT License
+
+Copyright (c) 2012-2013 Denis Demidov <ddemidov@ksu.ru>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/**
+ * \file   vexcl/scalar.hpp
+ * \author Denis Demidov <ddemidov@ksu.ru>
+ * \brief  Device-resident scalar value.
+ */
+
+#ifdef WIN32
+#  pragma warning(push)
+#  pragma warning(disable : 4267 4290)
+#  define NOMINMAX
+#endif
+
+#include <vector>
+#include <boost/proto/proto.hpp>
+#include <CL/cl.hpp>
+#include <vexcl/util.hpp>
+#include <vexcl/memory_pool.hpp>
+#include <vexcl/operations.hpp>
+
+namespace vex {
+
+typedef vector_expression<
+    typename boost::proto::terminal< scalar_terminal >::type
+    > scalar_terminal_expression;
+
+/// Device-resident scalar.
+/**
+ * Keeps a copy of a single value in the memory of each device in the queue
+ * list. When used in a vector expression, the value is read by the kernel
+ * directly from device memory. Reductor may store its result into a scalar,
+ * so that iterative solvers can chain reductions and vector updates without
+ * transferring intermediate values to the host:
+ * \code
+ * vex::scalar<double> rho(ctx), pq(ctx);
+ *
+ * sum(pq, p * q);
+ * u += (rho / pq) * p;
+ * \endcode
+ * Copies of a scalar share device memory.
+ */
+template <typename T>
+class scalar : public scalar_terminal_expression {
+    public:
+        typedef T value_type;
+
+        /// Allocates the scalar on each device in the queue list.
+        scalar(const std::vector<cl::CommandQueue> &queue, const T &value = T())
+            : queue(queue)
+        {
+            buf.reserve(queue.size());
+
+            for(auto q = queue.begin(); q != queue.end(); q++)
+                buf.push_back(memory_pool<>::create("scalar", qctx(*q),
+                            CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                            sizeof(T), const_cast<T*>(&value)));
+        }
+
+        /// Queue list the scalar is allocated for.
+        const std::vector<cl::CommandQueue>& queue_list() const {
+            return queue;
+        }
+
+        /// Buffer holding the value on the given device.
+        const cl::Buffer& operator()(uint d = 0) const {
+            return buf[d];
+        }
+
+        /// Reads value from the first device.
+        T get() const {
+            T val;
+            queue[0].enqueueReadBuffer(buf[0], CL_TRUE, 0, sizeof(T), &val);
+            return val;
+        }
+
+        /// Writes value to all devices.
+        const scalar& operator=(const T &value) {
+            for(uint d = 0; d < queue.size(); d++)
+                queue[d].enqueueWriteBuffer(buf[d], CL_TRUE, 0, sizeof(T), &value);
+            return *this;
+        }
+    private:
+        std::vector<cl::CommandQueue> queue;
+        std::vector<cl::Buffer>       buf;
+};
+
+} // namespace vex
+
+#ifdef WIN32
+#  pragma warning(pop)
+#endif
+
+// vim: et
+#endif
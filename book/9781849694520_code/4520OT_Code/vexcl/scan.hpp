@@ -0,0 +1,648 @@
+#ifndef VEXCL_SCAN_HPP
+#define VEXCL_SCAN_HPP
+
+/*
+The MIT License
+
+Copyright (c) 2012-2013 Denis Demidov <ddemidov@ksu.ru>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/**
+ * \file   vexcl/scan.hpp
+ * \author Denis Demidov <ddemidov@ksu.ru>
+ * \brief  Prefix sums, segmented scans and stream compaction.
+ */
+
+#ifdef WIN32
+#  pragma warning(push)
+#  pragma warning(disable : 4267 4290)
+#  define NOMINMAX
+#endif
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <algorithm>
+#include <stdexcept>
+#include <CL/cl.hpp>
+#include <vexcl/util.hpp>
+#include <vexcl/kernel_cache.hpp>
+#include <vexcl/memory_pool.hpp>
+#include <vexcl/vector.hpp>
+#include <vexcl/reduce.hpp>
+
+namespace vex {
+
+/// \cond INTERNAL
+
+namespace scanning {
+
+// Tag for scans without segment heads.
+struct no_heads {};
+
+template <typename F> struct head_decl {
+    static std::string typedefs() {
+        return "typedef " + type_name<F>() + " head_t;\n#define SEGMENTED\n";
+    }
+    static std::string params() { return "    global const head_t *head,\n"; }
+};
+
+template <> struct head_decl<no_heads> {
+    static std::string typedefs() { return ""; }
+    static std::string params()   { return ""; }
+};
+
+// Elements processed by a work-item.
+const uint items = 4;
+
+// Single-pass scan with decoupled look-back. Work-groups take tiles in the
+// order of a global ticket, so a tile only waits for tiles whose groups are
+// already running. Each tile publishes its aggregate, looks back over the
+// preceding tiles until it finds one with a complete inclusive prefix, and
+// then publishes its own prefix. Segment heads are carried in the status
+// words, which stops the look-back at the nearest head.
+//
+// The scanned values are those of a vector expression, evaluated as the tile
+// is loaded.
+//
+// Every element is scanned as a (head, value) pair: a head restarts the scan
+// with init, and the start of the vector is a head as well. The pairs
+// compose as (fa, a) + (fb, b) = (fa | fb, fb ? b : a + b), which is
+// associative for any associative operation.
+template <typename T, class OP, typename F, class Expr>
+struct kernels {
+    cl::Kernel init;
+    cl::Kernel scan;
+    cl::Kernel fixup;
+    size_t     wgsize;
+
+    static std::string source(const Expr &expr) {
+        std::ostringstream src, val;
+
+        vector_expr_context ctx(val);
+        boost::proto::eval(expr, ctx);
+
+        src << standard_kernel_header <<
+            "typedef " << type_name<T>() << " real;\n"
+            "typedef " << type_name<size_t>() << " idx_t;\n"
+            << head_decl<F>::typedefs() <<
+            "#define ITEMS " << items << "\n"
+            "#define STATUS_AGGREGATE 1u\n"
+            "#define STATUS_PREFIX    2u\n"
+            "#define STATUS_HEAD      4u\n";
+
+        OP::template function<T>::define(src, "oper");
+        extract_user_functions()( expr, declare_user_function(src) );
+
+        src <<
+            "kernel void scan_init(uint ntiles, global uint *status) {\n"
+            "    size_t i = get_global_id(0);\n"
+            "    if (i <= ntiles) status[i] = 0;\n"
+            "}\n"
+            "kernel void scan(\n"
+            "    idx_t n, uint ntiles, uint exclusive, uint start_head,\n"
+            "    real identity, real init, real carry";
+        extract_terminals()( expr, declare_expression_parameter(src) );
+        src << ",\n"
+            << head_decl<F>::params() <<
+            "    global real *y,\n"
+            "    global volatile uint *status,\n"
+            "    global volatile real *aggregate,\n"
+            "    global volatile real *prefix,\n"
+            "    local real *buf,\n"
+            "    local uchar *hbuf,\n"
+            "    local real *val,\n"
+            "    local uint *flg\n"
+            "    )\n"
+            "{\n"
+            "    local uint tile;\n"
+            "    local real tile_prefix;\n"
+            "    size_t lid = get_local_id(0), wg = get_local_size(0);\n"
+            "    size_t ts = wg * ITEMS;\n"
+            "    if (lid == 0) tile = atomic_inc(status + ntiles);\n"
+            "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+            "    idx_t base = (idx_t)tile * ts;\n"
+            "    for(size_t k = lid; k < ts; k += wg) {\n"
+            "        idx_t idx = base + k;\n"
+            "        if (idx < n) {\n"
+            "            buf[k] = " << val.str() << ";\n"
+            "#ifdef SEGMENTED\n"
+            "            hbuf[k] = (head[idx] != 0) || (start_head && idx == 0);\n"
+            "#else\n"
+            "            hbuf[k] = start_head && idx == 0;\n"
+            "#endif\n"
+            "        }\n"
+            "    }\n"
+            "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+            "    real v = identity;\n"
+            "    uint f = 0;\n"
+            "    for(size_t j = 0, k = lid * ITEMS; j < ITEMS; j++, k++) {\n"
+            "        if (base + k < n) {\n"
+            "            uint h = hbuf[k];\n"
+            "            v = oper(h ? init : v, buf[k]);\n"
+            "            f |= h;\n"
+            "        }\n"
+            "    }\n"
+            "    val[lid] = v;\n"
+            "    flg[lid] = f;\n"
+            "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+            "    for(size_t s = 1; s < wg; s <<= 1) {\n"
+            "        real pv = identity;\n"
+            "        uint pf = 0;\n"
+            "        if (lid >= s) {\n"
+            "            pv = val[lid - s];\n"
+            "            pf = flg[lid - s];\n"
+            "        }\n"
+            "        barrier(CLK_LOCAL_MEM_FENCE);\n"
+            "        if (lid >= s) {\n"
+            "            if (!flg[lid]) val[lid] = oper(pv, val[lid]);\n"
+            "            flg[lid] |= pf;\n"
+            "        }\n"
+            "        barrier(CLK_LOCAL_MEM_FENCE);\n"
+            "    }\n"
+            "    if (lid == 0) {\n"
+            "        real agg = val[wg - 1];\n"
+            "        uint af  = flg[wg - 1] ? STATUS_HEAD : 0;\n"
+            "        real ev  = carry;\n"
+            "        if (tile) {\n"
+            "            aggregate[tile] = agg;\n"
+            "            write_mem_fence(CLK_GLOBAL_MEM_FENCE);\n"
+            "            atomic_xchg(status + tile, STATUS_AGGREGATE | af);\n"
+            "            ev = identity;\n"
+            "            for(uint j = tile - 1; ; j--) {\n"
+            "                uint s;\n"
+            "                while(!((s = atomic_add(status + j, 0)) & (STATUS_AGGREGATE | STATUS_PREFIX)));\n"
+            "                read_mem_fence(CLK_GLOBAL_MEM_FENCE);\n"
+            "                ev = oper((s & STATUS_PREFIX) ? prefix[j] : aggregate[j], ev);\n"
+            "                if ((s & (STATUS_PREFIX | STATUS_HEAD))) break;\n"
+            "            }\n"
+            "        }\n"
+            "        prefix[tile] = af ? agg : oper(ev, agg);\n"
+            "        write_mem_fence(CLK_GLOBAL_MEM_FENCE);\n"
+            "        atomic_xchg(status + tile, STATUS_PREFIX | af);\n"
+            "        tile_prefix = ev;\n"
+            "    }\n"
+            "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+            "    real acc = tile_prefix;\n"
+            "    if (lid > 0) acc = flg[lid - 1] ? val[lid - 1] : oper(acc, val[lid - 1]);\n"
+            "    for(size_t j = 0, k = lid * ITEMS; j < ITEMS; j++, k++) {\n"
+            "        if (base + k < n) {\n"
+            "            real b = hbuf[k] ? init : acc;\n"
+            "            acc = oper(b, buf[k]);\n"
+            "            buf[k] = exclusive ? b : acc;\n"
+            "        }\n"
+            "    }\n"
+            "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+            "    for(size_t k = lid; k < ts; k += wg)\n"
+            "        if (base + k < n) y[base + k] = buf[k];\n"
+            "}\n"
+            "kernel void scan_fixup(idx_t n, real offset, global real *y) {\n"
+            "    for(idx_t i = get_global_id(0); i < n; i += get_global_size(0))\n"
+            "        y[i] = oper(offset, y[i]);\n"
+            "}\n";
+
+        return src.str();
+    }
+
+    static std::shared_ptr<kernels> get(const cl::CommandQueue &queue, const Expr &expr) {
+        std::shared_ptr<kernels> k = kernel_cache<>::find<kernels>(queue);
+        if (k) return k;
+
+        cl::Context context = qctx(queue);
+        cl::Device  device  = qdev(queue);
+
+        auto program = build_sources(context, source(expr));
+
+        kernels e;
+        e.init  = cl::Kernel(program, "scan_init");
+        e.scan  = cl::Kernel(program, "scan");
+        e.fixup = cl::Kernel(program, "scan_fixup");
+
+        // The tile, its head flags and the per-item partials should fit
+        // into local memory.
+        size_t w = kernel_workgroup_size(e.scan, device);
+        size_t lmem = static_cast<size_t>(device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>());
+        size_t per_item = items * (sizeof(T) + 1) + sizeof(T) + sizeof(cl_uint);
+
+        e.wgsize = 1;
+        while(e.wgsize * 2 <= std::min<size_t>(w, 256) &&
+                e.wgsize * 2 * per_item <= lmem / 2)
+            e.wgsize *= 2;
+
+        return kernel_cache<>::insert(queue, e);
+    }
+};
+
+// Parts of a multi-device vector are scanned concurrently, each starting
+// from the identity, and every part but the first is then combined with the
+// total of the preceding parts. That total depends on the heads of the
+// preceding parts, so segmented scans instead run part after part, each
+// starting from the inclusive total of the previous one.
+template <class OP, typename T, typename F, class Expr>
+void scan(const Expr &x, const vector<F> *head, vector<T> &y,
+        bool exclusive, const T &init)
+{
+    get_expression_properties prop;
+    extract_terminals()(x, prop);
+
+    if ((prop.queue && prop.size != y.size()) || (head && head->size() != y.size()))
+        throw std::invalid_argument("scan: vector sizes differ");
+
+    const std::vector<cl::CommandQueue> &queue = y.queue_list();
+
+    const bool serial = head && queue.size() > 1;
+
+    T identity = OP::template initial<T>();
+    T carry    = identity;
+
+    std::vector<cl::Buffer> prefix(queue.size());
+    std::vector<size_t>     last(queue.size());
+    std::vector<T>          total(queue.size(), identity);
+
+    for(uint d = 0; d < queue.size(); d++) {
+        size_t n = y.part_size(d);
+        if (!n) continue;
+
+        if ((prop.part && prop.part_size(d) != n) || (head && head->part_size(d) != n))
+            throw std::invalid_argument("scan: vectors are partitioned differently");
+
+        auto krn = kernels<T, OP, F, Expr>::get(queue[d], x);
+
+        cl::Context context = qctx(queue[d]);
+
+        size_t  wg = krn->wgsize;
+        size_t  ts = wg * items;
+        cl_uint ntiles = static_cast<cl_uint>((n + ts - 1) / ts);
+
+        cl::Buffer status = memory_pool<>::allocate(context, CL_MEM_READ_WRITE,
+                (ntiles + 1) * sizeof(cl_uint));
+        cl::Buffer aggregate = memory_pool<>::allocate(context, CL_MEM_READ_WRITE,
+                ntiles * sizeof(T));
+
+        prefix[d] = memory_pool<>::allocate(context, CL_MEM_READ_WRITE,
+                ntiles * sizeof(T));
+        last[d] = ntiles - 1;
+
+        krn->init.setArg(0, ntiles);
+        krn->init.setArg(1, status);
+
+        queue[d].enqueueNDRangeKernel(krn->init, cl::NullRange,
+                alignup(ntiles + 1, wg), wg,
+                0, event_trace<>::kernel(queue[d], krn->init));
+
+        uint pos = 0;
+        krn->scan.setArg(pos++, n);
+        krn->scan.setArg(pos++, ntiles);
+        krn->scan.setArg(pos++, static_cast<cl_uint>(exclusive));
+        krn->scan.setArg(pos++, static_cast<cl_uint>(d == 0));
+        krn->scan.setArg(pos++, identity);
+        krn->scan.setArg(pos++, init);
+        krn->scan.setArg(pos++, carry);
+        extract_terminals()(x, set_expression_argument(krn->scan, d, pos, y.part_start(d)));
+        if (head) krn->scan.setArg(pos++, (*head)(d));
+        krn->scan.setArg(pos++, y(d));
+        krn->scan.setArg(pos++, status);
+        krn->scan.setArg(pos++, aggregate);
+        krn->scan.setArg(pos++, prefix[d]);
+        krn->scan.setArg(pos++, cl::Local(ts * sizeof(T)));
+        krn->scan.setArg(pos++, cl::Local(ts));
+        krn->scan.setArg(pos++, cl::Local(wg * sizeof(T)));
+        krn->scan.setArg(pos++, cl::Local(wg * sizeof(cl_uint)));
+
+        queue[d].enqueueNDRangeKernel(krn->scan, cl::NullRange,
+                ntiles * wg, wg,
+                0, event_trace<>::kernel(queue[d], krn->scan, 2 * n * sizeof(T)));
+
+        // Inclusive total of the part starts the scan of the next one.
+        if (serial && d + 1 < queue.size())
+            queue[d].enqueueReadBuffer(prefix[d], CL_TRUE,
+                    last[d] * sizeof(T), sizeof(T), &carry);
+
+        memory_pool<>::release(status);
+        memory_pool<>::release(aggregate);
+    }
+
+    if (!serial && queue.size() > 1) {
+        for(uint d = 0; d + 1 < queue.size(); d++)
+            if (y.part_size(d))
+                queue[d].enqueueReadBuffer(prefix[d], CL_FALSE,
+                        last[d] * sizeof(T), sizeof(T), &total[d]);
+
+        for(uint d = 0; d + 1 < queue.size(); d++)
+            if (y.part_size(d)) queue[d].finish();
+
+        for(uint d = 1; d < queue.size(); d++) {
+            size_t n = y.part_size(d);
+            if (!n) continue;
+
+            auto krn = kernels<T, OP, F, Expr>::get(queue[d], x);
+
+            T offset = OP::reduce(total.begin(), total.begin() + d);
+
+            krn->fixup.setArg(0, n);
+            krn->fixup.setArg(1, offset);
+            krn->fixup.setArg(2, y(d));
+
+            cl::Device device = qdev(queue[d]);
+
+            size_t wg = krn->wgsize;
+            size_t g_size = device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU ?
+                alignup(n, wg) :
+                device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * wg * 4;
+
+            queue[d].enqueueNDRangeKernel(krn->fixup, cl::NullRange, g_size, wg,
+                    0, event_trace<>::kernel(queue[d], krn->fixup, 2 * n * sizeof(T)));
+        }
+    }
+
+    for(uint d = 0; d < queue.size(); d++)
+        if (y.part_size(d)) memory_pool<>::release(prefix[d]);
+}
+
+// Stream compaction of x by a predicate expression, in tiles of wgsize *
+// items elements. count_if counts the survivors of each tile; once the
+// counts are scanned into tile offsets, compact_if ranks the survivors of its
+// tile in local memory and writes them out as one contiguous run. Each
+// work-item takes consecutive elements of the tile, so ranks keep the order
+// of the elements. The predicate is evaluated for element idx.
+template <typename T, class Expr>
+struct compact_kernels {
+    cl::Kernel count;
+    cl::Kernel compact;
+    size_t     wgsize;
+
+    static std::string source(const Expr &pred) {
+        std::ostringstream src, cond;
+
+        vector_expr_context ctx(cond);
+        boost::proto::eval(pred, ctx);
+
+        src << standard_kernel_header <<
+            "typedef " << type_name<T>() << " real;\n"
+            "typedef " << type_name<size_t>() << " idx_t;\n"
+            "#define ITEMS " << items << "\n";
+
+        extract_user_functions()( pred, declare_user_function(src) );
+
+        src << "kernel void count_if(\n\tidx_t n";
+        extract_terminals()( pred, declare_expression_parameter(src) );
+        src << ",\n\tglobal uint *count\n\t)\n"
+            "{\n"
+            "    local uint total;\n"
+            "    size_t lid = get_local_id(0), wg = get_local_size(0);\n"
+            "    idx_t base = (idx_t)get_group_id(0) * wg * ITEMS;\n"
+            "    if (lid == 0) total = 0;\n"
+            "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+            "    uint c = 0;\n"
+            "    for(size_t k = lid; k < wg * ITEMS; k += wg) {\n"
+            "        idx_t idx = base + k;\n"
+            "        if (idx < n && (" << cond.str() << ")) c++;\n"
+            "    }\n"
+            "    if (c) atomic_add(&total, c);\n"
+            "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+            "    if (lid == 0) {\n"
+            "        count[get_group_id(0)] = total;\n"
+            "        if (get_group_id(0) == 0) count[get_num_groups(0)] = 0;\n"
+            "    }\n"
+            "}\n"
+            "kernel void compact_if(\n\tidx_t n,\n\tidx_t m,\n\tglobal const real *x";
+        extract_terminals()( pred, declare_expression_parameter(src) );
+        src << ",\n\tglobal const uint *offset,\n"
+            "\tglobal real *y,\n"
+            "\tlocal real *buf,\n"
+            "\tlocal uint *rank\n"
+            "\t)\n"
+            "{\n"
+            "    size_t lid = get_local_id(0), wg = get_local_size(0);\n"
+            "    idx_t base = (idx_t)get_group_id(0) * wg * ITEMS;\n"
+            "    real v[ITEMS];\n"
+            "    uint own = 0;\n"
+            "    for(size_t j = 0; j < ITEMS; j++) {\n"
+            "        idx_t idx = base + lid * ITEMS + j;\n"
+            "        if (idx < n && (" << cond.str() << ")) v[own++] = x[idx];\n"
+            "    }\n"
+            "    rank[lid] = own;\n"
+            "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+            "    for(size_t s = 1; s < wg; s <<= 1) {\n"
+            "        uint p = lid >= s ? rank[lid - s] : 0;\n"
+            "        barrier(CLK_LOCAL_MEM_FENCE);\n"
+            "        rank[lid] += p;\n"
+            "        barrier(CLK_LOCAL_MEM_FENCE);\n"
+            "    }\n"
+            "    uint first = rank[lid] - own, total = rank[wg - 1];\n"
+            "    for(uint j = 0; j < own; j++) buf[first + j] = v[j];\n"
+            "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+            "    idx_t out = offset[get_group_id(0)];\n"
+            "    for(size_t k = lid; k < total; k += wg)\n"
+            "        if (out + k < m) y[out + k] = buf[k];\n"
+            "}\n";
+
+        return src.str();
+    }
+
+    static std::shared_ptr<compact_kernels> get(
+            const cl::CommandQueue &queue, const Expr &pred)
+    {
+        std::shared_ptr<compact_kernels> k = kernel_cache<>::find<compact_kernels>(queue);
+        if (k) return k;
+
+        cl::Context context = qctx(queue);
+        cl::Device  device  = qdev(queue);
+
+        auto program = build_sources(context, source(pred));
+
+        compact_kernels e;
+        e.count   = cl::Kernel(program, "count_if");
+        e.compact = cl::Kernel(program, "compact_if");
+
+        // Both kernels run over the same tiles; the survivors of a tile and
+        // the per-item ranks should fit into local memory.
+        size_t w = std::min(kernel_workgroup_size(e.count, device),
+                kernel_workgroup_size(e.compact, device));
+        size_t lmem = static_cast<size_t>(device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>());
+        size_t per_item = items * sizeof(T) + sizeof(cl_uint);
+
+        e.wgsize = 1;
+        while(e.wgsize * 2 <= std::min<size_t>(w, 256) &&
+                e.wgsize * 2 * per_item <= lmem / 2)
+            e.wgsize *= 2;
+
+        return kernel_cache<>::insert(queue, e);
+    }
+};
+
+} // namespace scanning
+
+/// \endcond
+
+/// Inclusive scan: y[i] = x[0] + ... + x[i].
+/**
+ * OP is any reduction kind usable with vex::Reductor (vex::SUM, vex::MIN,
+ * vex::MAX, or a user structure of the same form providing initial<T>(),
+ * reduce() and a function<T> user function), and should be associative. x
+ * may be any vector expression, which is evaluated as it is scanned:
+ * \code
+ * vex::inclusive_scan(x, y);
+ * vex::inclusive_scan<vex::MAX>(x, y); // running maximum
+ * vex::exclusive_scan(x > 0, pos);     // output positions of positives
+ * \endcode
+ * The scan takes a single pass over the data: work-groups exchange tile
+ * prefixes through global memory with decoupled look-back, so that each
+ * device only needs a tiny initialization kernel and one scan kernel. y may
+ * appear in x. The parts of multi-device vectors are scanned concurrently;
+ * their totals are then read back, and a fix-up pass adds the total of the
+ * preceding parts to each part.
+ */
+template <class OP = SUM, typename T, class Expr>
+typename std::enable_if<
+    boost::proto::matches<Expr, vector_expr_grammar>::value
+>::type
+inclusive_scan(const Expr &x, vector<T> &y) {
+    scanning::scan<OP, T, scanning::no_heads>(x, 0, y, false,
+            OP::template initial<T>());
+}
+
+/// Exclusive scan: y[0] = init, y[i] = init + x[0] + ... + x[i-1].
+template <class OP = SUM, typename T, class Expr>
+typename std::enable_if<
+    boost::proto::matches<Expr, vector_expr_grammar>::value
+>::type
+exclusive_scan(const Expr &x, vector<T> &y,
+        const T &init = OP::template initial<T>())
+{
+    scanning::scan<OP, T, scanning::no_heads>(x, 0, y, true, init);
+}
+
+/// Segmented inclusive scan.
+/**
+ * Nonzero elements of head mark the first elements of segments; each
+ * segment is scanned independently, as if it were a separate vector. Since
+ * the carry into a part depends on the heads before it, the parts of
+ * multi-device vectors are scanned one after another.
+ */
+template <class OP = SUM, typename T, typename F, class Expr>
+typename std::enable_if<
+    boost::proto::matches<Expr, vector_expr_grammar>::value
+>::type
+inclusive_scan_by_segment(const Expr &x, const vector<F> &head,
+        vector<T> &y)
+{
+    scanning::scan<OP, T, F>(x, &head, y, false, OP::template initial<T>());
+}
+
+/// Segmented exclusive scan. The first element of each segment receives init.
+template <class OP = SUM, typename T, typename F, class Expr>
+typename std::enable_if<
+    boost::proto::matches<Expr, vector_expr_grammar>::value
+>::type
+exclusive_scan_by_segment(const Expr &x, const vector<F> &head,
+        vector<T> &y, const T &init = OP::template initial<T>())
+{
+    scanning::scan<OP, T, F>(x, &head, y, true, init);
+}
+
+/// Stream compaction: copies elements of x satisfying a predicate to y.
+/**
+ * The predicate is a vector expression of the same size as x, evaluated
+ * element-wise; a vector is a predicate too, selecting its nonzero elements:
+ * \code
+ * size_t m = vex::copy_if(x, x > 0, y);
+ * size_t k = vex::copy_if(x, mask, y);
+ * \endcode
+ * The selected elements keep their order and are packed to the beginning of
+ * y, which should be large enough to hold them (otherwise the elements that
+ * do not fit are dropped and std::length_error is thrown). Returns the number
+ * of copied elements. Survivors are counted per tile, the tile counts are
+ * scanned, and each tile is compacted in local memory and written out as a
+ * contiguous run, so apart from x and y only one word per tile goes through
+ * global memory. The count is read back to the host. Only single-device
+ * vectors are supported, since the output of a device part may land in any
+ * part of y.
+ */
+template <typename T, class Expr>
+typename std::enable_if<
+    boost::proto::matches<Expr, vector_expr_grammar>::value,
+    size_t
+>::type
+copy_if(const vector<T> &x, const Expr &pred, vector<T> &y) {
+    const std::vector<cl::CommandQueue> &queue = x.queue_list();
+
+    if (queue.size() != 1 || y.queue_list().size() != 1)
+        throw std::logic_error("copy_if: only single-device vectors are supported");
+
+    get_expression_properties prop;
+    extract_terminals()(pred, prop);
+
+    if (prop.queue && prop.size != x.size())
+        throw std::invalid_argument("copy_if: vector sizes differ");
+
+    size_t n = x.size();
+    if (!n) return 0;
+
+    auto krn = scanning::compact_kernels<T, Expr>::get(queue[0], pred);
+
+    size_t  wg = krn->wgsize;
+    size_t  ts = wg * scanning::items;
+    size_t  ntiles = (n + ts - 1) / ts;
+
+    vector<cl_uint> offset(queue, ntiles + 1);
+
+    uint p = 0;
+    krn->count.setArg(p++, n);
+    extract_terminals()(pred, set_expression_argument(krn->count, 0, p, 0));
+    krn->count.setArg(p++, offset(0));
+
+    queue[0].enqueueNDRangeKernel(krn->count, cl::NullRange, ntiles * wg, wg,
+            0, event_trace<>::kernel(queue[0], krn->count));
+
+    exclusive_scan<SUM>(offset, offset);
+
+    p = 0;
+    krn->compact.setArg(p++, n);
+    krn->compact.setArg(p++, y.size());
+    krn->compact.setArg(p++, x(0));
+    extract_terminals()(pred, set_expression_argument(krn->compact, 0, p, 0));
+    krn->compact.setArg(p++, offset(0));
+    krn->compact.setArg(p++, y(0));
+    krn->compact.setArg(p++, cl::Local(ts * sizeof(T)));
+    krn->compact.setArg(p++, cl::Local(wg * sizeof(cl_uint)));
+
+    queue[0].enqueueNDRangeKernel(krn->compact, cl::NullRange, ntiles * wg, wg,
+            0, event_trace<>::kernel(queue[0], krn->compact, 2 * n * sizeof(T)));
+
+    cl_uint m = 0;
+    queue[0].enqueueReadBuffer(offset(0), CL_TRUE,
+            ntiles * sizeof(cl_uint), sizeof(cl_uint), &m);
+
+    if (m > y.size())
+        throw std::length_error("copy_if: output vector is too small");
+
+    return m;
+}
+
+} // namespace vex
+
+#ifdef WIN32
+#  pragma warning(pop)
+#endif
+
+// vim: et
+#endif
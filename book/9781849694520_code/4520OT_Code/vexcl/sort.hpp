@@ -0,0 +1,910 @@
+#ifndef VEXCL_SORT_HPP
+#define VEXCL_SORT_HPP
+
+/*
+The MIT License
+
+Copyright (c) 2012-2013 Denis Demidov <ddemidov@ksu.ru>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/**
+ * \file   vexcl/sort.hpp
+ * \author Denis Demidov <ddemidov@ksu.ru>
+ * \brief  Radix sort and radix select of device vectors.
+ */
+
+#ifdef WIN32
+#  pragma warning(push)
+#  pragma warning(disable : 4267 4290)
+#  define NOMINMAX
+#endif
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <algorithm>
+#include <stdexcept>
+#include <limits>
+#include <memory>
+#include <numeric>
+#include <CL/cl.hpp>
+#include <vexcl/util.hpp>
+#include <vexcl/kernel_cache.hpp>
+#include <vexcl/vector.hpp>
+
+namespace vex {
+
+/// \cond INTERNAL
+
+namespace sorting {
+
+// Maps keys to unsigned integers with the same ordering.
+template <typename K> struct key_traits {};
+
+template <> struct key_traits<cl_uint> {
+    typedef cl_uint ord_t;
+    static std::string ord_type() { return "uint"; }
+    static std::string ord() { return "return k;"; }
+};
+
+template <> struct key_traits<cl_int> {
+    typedef cl_uint ord_t;
+    static std::string ord_type() { return "uint"; }
+    static std::string ord() { return "return as_uint(k) ^ 0x80000000u;"; }
+};
+
+template <> struct key_traits<cl_ulong> {
+    typedef cl_ulong ord_t;
+    static std::string ord_type() { return "ulong"; }
+    static std::string ord() { return "return k;"; }
+};
+
+template <> struct key_traits<cl_long> {
+    typedef cl_ulong ord_t;
+    static std::string ord_type() { return "ulong"; }
+    static std::string ord() { return "return as_ulong(k) ^ 0x8000000000000000ul;"; }
+};
+
+// Negative floats have all bits flipped, positive ones only the sign bit.
+template <> struct key_traits<cl_float> {
+    typedef cl_uint ord_t;
+    static std::string ord_type() { return "uint"; }
+    static std::string ord() {
+        return "uint u = as_uint(k); "
+               "return u ^ ((uint)(-(int)(u >> 31)) | 0x80000000u);";
+    }
+};
+
+template <> struct key_traits<cl_double> {
+    typedef cl_ulong ord_t;
+    static std::string ord_type() { return "ulong"; }
+    static std::string ord() {
+        return "ulong u = as_ulong(k); "
+               "return u ^ ((ulong)(-(long)(u >> 63)) | 0x8000000000000000ul);";
+    }
+};
+
+// Tag for key-only sorts.
+struct no_values {};
+
+template <typename V> struct value_decl {
+    static std::string params() {
+        return ",\n    global const " + type_name<V>() + " *ival"
+               ",\n    global " + type_name<V>() + " *oval";
+    }
+    static std::string move() { return "            oval[pos] = ival[i];\n"; }
+};
+
+template <> struct value_decl<no_values> {
+    static std::string params() { return ""; }
+    static std::string move()   { return ""; }
+};
+
+template <typename V> inline size_t value_size() { return sizeof(V); }
+template <> inline size_t value_size<no_values>() { return 0; }
+
+// Supported digit widths. Wider digits mean fewer passes, but larger local
+// histograms and a longer scan of the global one.
+const uint min_radix_bits = 4;
+const uint max_radix_bits = 11;
+
+// Kernels of LSD radix sort with the given digit width. Each pass counts
+// digits in contiguous chunks of the input (one chunk per work-group), scans
+// the digit-major histogram, and scatters the chunks stably to their
+// positions. The range kernel computes bitwise AND and OR of the transformed
+// keys in each chunk: digits where the two agree are shared by all keys, and
+// their passes may be skipped.
+template <typename K, typename V>
+struct kernels {
+    cl::Kernel range;
+    cl::Kernel count;
+    cl::Kernel scan;
+    cl::Kernel scatter;
+    size_t     wgsize;
+
+    static std::string source(uint bits) {
+        std::ostringstream src;
+
+        src << standard_kernel_header <<
+            "typedef " << type_name<K>() << " key_t;\n"
+            "typedef " << key_traits<K>::ord_type() << " ord_t;\n"
+            "typedef " << type_name<size_t>() << " idx_t;\n"
+            "#define BINS " << (1 << bits) << "\n"
+            "ord_t ord(key_t k) { " << key_traits<K>::ord() << " }\n"
+            "kernel void range(\n"
+            "    idx_t n, idx_t chunk,\n"
+            "    global const key_t *key,\n"
+            "    global ord_t *bits,\n"
+            "    local ord_t *all,\n"
+            "    local ord_t *any\n"
+            "    )\n"
+            "{\n"
+            "    size_t lid = get_local_id(0), wg = get_local_size(0);\n"
+            "    size_t grp = get_group_id(0);\n"
+            "    ord_t a = ~(ord_t)0, o = 0;\n"
+            "    idx_t beg = grp * chunk, end = min(n, beg + chunk);\n"
+            "    for(idx_t i = beg + lid; i < end; i += wg) {\n"
+            "        ord_t u = ord(key[i]);\n"
+            "        a &= u;\n"
+            "        o |= u;\n"
+            "    }\n"
+            "    all[lid] = a;\n"
+            "    any[lid] = o;\n"
+            "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+            "    for(size_t s = wg / 2; s > 0; s >>= 1) {\n"
+            "        if (lid < s) {\n"
+            "            all[lid] &= all[lid + s];\n"
+            "            any[lid] |= any[lid + s];\n"
+            "        }\n"
+            "        barrier(CLK_LOCAL_MEM_FENCE);\n"
+            "    }\n"
+            "    if (lid == 0) {\n"
+            "        bits[2 * grp]     = all[0];\n"
+            "        bits[2 * grp + 1] = any[0];\n"
+            "    }\n"
+            "}\n"
+            "kernel void count(\n"
+            "    idx_t n, idx_t chunk, uint shift,\n"
+            "    global const key_t *key,\n"
+            "    global uint *hist,\n"
+            "    local uint *cnt\n"
+            "    )\n"
+            "{\n"
+            "    size_t lid = get_local_id(0), wg = get_local_size(0);\n"
+            "    size_t grp = get_group_id(0), ngrp = get_num_groups(0);\n"
+            "    for(size_t b = lid; b < BINS; b += wg) cnt[b] = 0;\n"
+            "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+            "    idx_t beg = grp * chunk, end = min(n, beg + chunk);\n"
+            "    for(idx_t i = beg + lid; i < end; i += wg)\n"
+            "        atomic_inc(cnt + ((ord(key[i]) >> shift) & (BINS - 1)));\n"
+            "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+            "    for(size_t b = lid; b < BINS; b += wg) hist[b * ngrp + grp] = cnt[b];\n"
+            "}\n"
+            "kernel void scan(\n"
+            "    uint m,\n"
+            "    global uint *hist,\n"
+            "    local uint *tmp\n"
+            "    )\n"
+            "{\n"
+            "    size_t lid = get_local_id(0), wg = get_local_size(0);\n"
+            "    uint carry = 0;\n"
+            "    for(uint base = 0; base < m; base += wg) {\n"
+            "        uint i = base + lid;\n"
+            "        uint v = i < m ? hist[i] : 0;\n"
+            "        tmp[lid] = v;\n"
+            "        barrier(CLK_LOCAL_MEM_FENCE);\n"
+            "        for(size_t s = 1; s < wg; s <<= 1) {\n"
+            "            uint t = lid >= s ? tmp[lid - s] : 0;\n"
+            "            barrier(CLK_LOCAL_MEM_FENCE);\n"
+            "            tmp[lid] += t;\n"
+            "            barrier(CLK_LOCAL_MEM_FENCE);\n"
+            "        }\n"
+            "        if (i < m) hist[i] = carry + tmp[lid] - v;\n"
+            "        carry += tmp[wg - 1];\n"
+            "        barrier(CLK_LOCAL_MEM_FENCE);\n"
+            "    }\n"
+            "}\n"
+            "kernel void scatter(\n"
+            "    idx_t n, idx_t chunk, uint shift,\n"
+            "    global const key_t *ikey,\n"
+            "    global key_t *okey" << value_decl<V>::params() << ",\n"
+            "    global const uint *hist,\n"
+            "    local uint *base,\n"
+            "    local uint *cnt,\n"
+            "    local ushort *dig\n"
+            "    )\n"
+            "{\n"
+            "    size_t lid = get_local_id(0), wg = get_local_size(0);\n"
+            "    size_t grp = get_group_id(0), ngrp = get_num_groups(0);\n"
+            "    for(size_t b = lid; b < BINS; b += wg) base[b] = hist[b * ngrp + grp];\n"
+            "    idx_t beg = grp * chunk, end = min(n, beg + chunk);\n"
+            "    for(idx_t tile = beg; tile < end; tile += wg) {\n"
+            "        idx_t i = tile + lid;\n"
+            "        key_t k;\n"
+            "        uint  d = BINS;\n"
+            "        if (i < end) {\n"
+            "            k = ikey[i];\n"
+            "            d = (ord(k) >> shift) & (BINS - 1);\n"
+            "        }\n"
+            "        dig[lid] = d;\n"
+            "        for(size_t b = lid; b < BINS; b += wg) cnt[b] = 0;\n"
+            "        barrier(CLK_LOCAL_MEM_FENCE);\n"
+            "        if (i < end) {\n"
+            "            // Rank among preceding elements of the tile with the\n"
+            "            // same digit keeps the sort stable.\n"
+            "            uint r = 0;\n"
+            "            for(size_t j = 0; j < lid; j++) r += (dig[j] == d);\n"
+            "            uint pos = base[d] + r;\n"
+            "            okey[pos] = k;\n"
+            << value_decl<V>::move() <<
+            "            atomic_inc(cnt + d);\n"
+            "        }\n"
+            "        barrier(CLK_LOCAL_MEM_FENCE);\n"
+            "        for(size_t b = lid; b < BINS; b += wg) base[b] += cnt[b];\n"
+            "        barrier(CLK_LOCAL_MEM_FENCE);\n"
+            "    }\n"
+            "}\n";
+
+        return src.str();
+    }
+
+    static std::shared_ptr<kernels> get(const cl::CommandQueue &queue, uint bits) {
+        std::ostringstream sig;
+        sig << bits;
+
+        std::shared_ptr<kernels> k = kernel_cache<>::find<kernels>(queue, sig.str());
+        if (k) return k;
+
+        cl::Context context = qctx(queue);
+        cl::Device  device  = qdev(queue);
+
+        auto program = build_sources(context, source(bits));
+
+        kernels e;
+        e.range   = cl::Kernel(program, "range");
+        e.count   = cl::Kernel(program, "count");
+        e.scan    = cl::Kernel(program, "scan");
+        e.scatter = cl::Kernel(program, "scatter");
+
+        size_t w = std::min(std::min(std::min(
+                    kernel_workgroup_size(e.range, device),
+                    kernel_workgroup_size(e.count, device)),
+                    kernel_workgroup_size(e.scan,  device)),
+                    kernel_workgroup_size(e.scatter, device));
+
+        // The scan and the range reduction need a power of two; larger
+        // groups make the ranking loop in the scatter kernel longer.
+        e.wgsize = 1;
+        while(e.wgsize * 2 <= std::min<size_t>(w, 256)) e.wgsize *= 2;
+
+        return kernel_cache<>::insert(queue, e, sig.str());
+    }
+};
+
+// Chooses digit width for the device and problem size: the widest one whose
+// two local histograms fit into a quarter of local memory, and whose global
+// histogram (bins times work-groups) stays well below the number of keys, so
+// that the single work-group scan does not dominate the pass.
+inline uint radix_width(const cl::Device &device, size_t n, size_t ngrp) {
+    cl_ulong lmem = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+
+    const uint width[] = {11, 8, 4};
+
+    for(uint i = 0; i < 2; i++) {
+        size_t bins = size_t(1) << width[i];
+        if (2 * bins * sizeof(cl_uint) <= lmem / 4 && bins * ngrp * 8 <= n)
+            return width[i];
+    }
+
+    return min_radix_bits;
+}
+
+// Stable digit positions of the significant bits. Digits where all keys agree
+// do not change the order, so their passes are skipped.
+template <typename K>
+std::vector<cl_uint> radix_shifts(const cl::CommandQueue &queue,
+        const kernels<K, no_values> &krn, const cl::Buffer &keys,
+        size_t n, size_t chunk, size_t ngrp, uint key_bits, uint bits,
+        bool detect_range)
+{
+    typedef typename key_traits<K>::ord_t ord_t;
+
+    ord_t diff = ~static_cast<ord_t>(0);
+
+    if (detect_range) {
+        cl::Context context = qctx(queue);
+        size_t wg = krn.wgsize;
+
+        cl::Buffer part(context, CL_MEM_READ_WRITE, 2 * ngrp * sizeof(ord_t));
+
+        uint pos = 0;
+        cl::Kernel range = krn.range;
+        range.setArg(pos++, n);
+        range.setArg(pos++, chunk);
+        range.setArg(pos++, keys);
+        range.setArg(pos++, part);
+        range.setArg(pos++, cl::Local(wg * sizeof(ord_t)));
+        range.setArg(pos++, cl::Local(wg * sizeof(ord_t)));
+
+        queue.enqueueNDRangeKernel(range, cl::NullRange, ngrp * wg, wg,
+                0, event_trace<>::kernel(queue, range));
+
+        std::vector<ord_t> h(2 * ngrp);
+        queue.enqueueReadBuffer(part, CL_TRUE, 0, h.size() * sizeof(ord_t), h.data());
+
+        ord_t all = ~static_cast<ord_t>(0), any = 0;
+        for(size_t g = 0; g < ngrp; g++) {
+            all &= h[2 * g];
+            any |= h[2 * g + 1];
+        }
+
+        diff = all ^ any;
+    }
+
+    if (key_bits < 8 * sizeof(ord_t))
+        diff &= (static_cast<ord_t>(1) << key_bits) - 1;
+
+    std::vector<cl_uint> shift;
+    for(uint s = 0; s < key_bits; s += bits)
+        if ((diff >> s) & ((static_cast<ord_t>(1) << bits) - 1))
+            shift.push_back(s);
+
+    return shift;
+}
+
+template <typename K, typename V>
+void radix_sort(const cl::CommandQueue &queue,
+        cl::Buffer &keys, cl::Buffer *values, size_t n, uint key_bits,
+        uint bits, bool detect_range)
+{
+    if (n < 2) return;
+
+    if (n > std::numeric_limits<cl_uint>::max())
+        throw std::invalid_argument("radix_sort: too many elements");
+
+    key_bits = std::min<uint>(key_bits, 8 * sizeof(K));
+
+    if (bits && (bits < min_radix_bits || bits > max_radix_bits))
+        throw std::invalid_argument("radix_sort: unsupported digit width");
+
+    cl::Context context = qctx(queue);
+    cl::Device  device  = qdev(queue);
+
+    // Work-group size does not depend on the digit width, so the range
+    // kernel of the 4-bit program sets up the partition for all of them.
+    auto base = kernels<K, no_values>::get(queue, min_radix_bits);
+
+    size_t wg   = base->wgsize;
+    size_t ngrp = std::min<size_t>((n + wg - 1) / wg,
+            device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * 16);
+    size_t chunk = alignup((n + ngrp - 1) / ngrp, wg);
+    ngrp = (n + chunk - 1) / chunk;
+
+    if (!bits) bits = radix_width(device, n, ngrp);
+
+    std::vector<cl_uint> shift = radix_shifts<K>(queue, *base, keys,
+            n, chunk, ngrp, key_bits, bits, detect_range);
+
+    if (shift.empty()) return;
+
+    auto krn = kernels<K, V>::get(queue, bits);
+
+    // Kernels with other digit widths may differ in the maximum work-group size.
+    if (krn->wgsize < wg) {
+        wg    = krn->wgsize;
+        chunk = alignup(chunk, wg);
+        ngrp  = (n + chunk - 1) / chunk;
+    }
+
+    size_t bins = size_t(1) << bits;
+    cl_uint m = static_cast<cl_uint>(bins * ngrp);
+
+    cl::Buffer hist(context, CL_MEM_READ_WRITE, m * sizeof(cl_uint));
+
+    cl::Buffer key[2] = {
+        keys, memory_pool<>::create("sort", context, CL_MEM_READ_WRITE, n * sizeof(K))
+    };
+    cl::Buffer val[2];
+
+    if (values) {
+        val[0] = *values;
+        val[1] = memory_pool<>::create("sort", context, CL_MEM_READ_WRITE, n * value_size<V>());
+    }
+
+    size_t passes = shift.size();
+
+    // Ping-pong between the input buffers and the temporary ones.
+    for(size_t p = 0; p < passes; p++) {
+        int src = p % 2, dst = 1 - src;
+
+        uint pos = 0;
+        krn->count.setArg(pos++, n);
+        krn->count.setArg(pos++, chunk);
+        krn->count.setArg(pos++, shift[p]);
+        krn->count.setArg(pos++, key[src]);
+        krn->count.setArg(pos++, hist);
+        krn->count.setArg(pos++, cl::Local(bins * sizeof(cl_uint)));
+
+        queue.enqueueNDRangeKernel(krn->count, cl::NullRange, ngrp * wg, wg,
+                0, event_trace<>::kernel(queue, krn->count));
+
+        pos = 0;
+        krn->scan.setArg(pos++, m);
+        krn->scan.setArg(pos++, hist);
+        krn->scan.setArg(pos++, cl::Local(wg * sizeof(cl_uint)));
+
+        queue.enqueueNDRangeKernel(krn->scan, cl::NullRange, wg, wg,
+                0, event_trace<>::kernel(queue, krn->scan));
+
+        pos = 0;
+        krn->scatter.setArg(pos++, n);
+        krn->scatter.setArg(pos++, chunk);
+        krn->scatter.setArg(pos++, shift[p]);
+        krn->scatter.setArg(pos++, key[src]);
+        krn->scatter.setArg(pos++, key[dst]);
+        if (values) {
+            krn->scatter.setArg(pos++, val[src]);
+            krn->scatter.setArg(pos++, val[dst]);
+        }
+        krn->scatter.setArg(pos++, hist);
+        krn->scatter.setArg(pos++, cl::Local(bins * sizeof(cl_uint)));
+        krn->scatter.setArg(pos++, cl::Local(bins * sizeof(cl_uint)));
+        krn->scatter.setArg(pos++, cl::Local(wg * sizeof(cl_ushort)));
+
+        queue.enqueueNDRangeKernel(krn->scatter, cl::NullRange, ngrp * wg, wg,
+                0, event_trace<>::kernel(queue, krn->scatter));
+    }
+
+    // Only an odd number of passes leaves the result in the temporaries.
+    if (passes % 2) {
+        queue.enqueueCopyBuffer(key[1], key[0], 0, 0, n * sizeof(K));
+        if (values)
+            queue.enqueueCopyBuffer(val[1], val[0], 0, 0,
+                    n * value_size<V>());
+    }
+}
+
+// Merges sorted device parts of a multi-device vector through host memory.
+template <typename K, typename V>
+void merge_parts(vector<K> &keys, vector<V> *values) {
+    std::vector<K> hk(keys.size());
+    std::vector<V> hv(values ? values->size() : 0);
+
+    vex::copy(keys, hk);
+    if (values) vex::copy(*values, hv);
+
+    std::vector<size_t> order(keys.size());
+    for(size_t i = 0; i < order.size(); i++) order[i] = i;
+
+    auto less = [&hk](size_t a, size_t b) { return hk[a] < hk[b]; };
+
+    for(uint d = 1; d < keys.nparts(); d++)
+        std::inplace_merge(order.begin(),
+                order.begin() + keys.part_start(d),
+                order.begin() + keys.part_start(d) + keys.part_size(d),
+                less);
+
+    std::vector<K> sk(hk.size());
+    for(size_t i = 0; i < order.size(); i++) sk[i] = hk[order[i]];
+    vex::copy(sk, keys);
+
+    if (values) {
+        std::vector<V> sv(hv.size());
+        for(size_t i = 0; i < order.size(); i++) sv[i] = hv[order[i]];
+        vex::copy(sv, *values);
+    }
+}
+
+// Digit width of radix select. Each pass narrows the candidates to a single
+// bucket, so there are as many passes as digits in the key.
+const uint select_bits = 8;
+
+// Kernels of MSD radix select. select_count histograms the next digit of the
+// keys whose higher digits match the prefix selected so far, in a local
+// histogram merged into the global one with atomics. select_gather copies out
+// the keys above the prefix and the first `need` keys matching it.
+template <typename K>
+struct select_kernels {
+    cl::Kernel count;
+    cl::Kernel gather;
+    size_t     wgsize;
+    size_t     g_size;
+
+    static std::string source() {
+        std::ostringstream src;
+
+        src << standard_kernel_header <<
+            "typedef " << type_name<K>() << " key_t;\n"
+            "typedef " << key_traits<K>::ord_type() << " ord_t;\n"
+            "typedef " << type_name<size_t>() << " idx_t;\n"
+            "#define BINS " << (1 << select_bits) << "\n"
+            "ord_t ord(key_t k) { " << key_traits<K>::ord() << " }\n"
+            "kernel void select_count(\n"
+            "    idx_t n, uint shift, ord_t prefix, ord_t mask,\n"
+            "    global const key_t *key,\n"
+            "    global uint *hist,\n"
+            "    local uint *cnt\n"
+            "    )\n"
+            "{\n"
+            "    size_t lid = get_local_id(0), wg = get_local_size(0);\n"
+            "    for(size_t b = lid; b < BINS; b += wg) cnt[b] = 0;\n"
+            "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+            "    for(idx_t i = get_global_id(0); i < n; i += get_global_size(0)) {\n"
+            "        ord_t u = ord(key[i]);\n"
+            "        if ((u & mask) == prefix)\n"
+            "            atomic_inc(cnt + ((u >> shift) & (BINS - 1)));\n"
+            "    }\n"
+            "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+            "    for(size_t b = lid; b < BINS; b += wg)\n"
+            "        if (cnt[b]) atomic_add(hist + b, cnt[b]);\n"
+            "}\n"
+            "kernel void select_gather(\n"
+            "    idx_t n, ord_t prefix, ord_t mask, uint above, uint need,\n"
+            "    global const key_t *key,\n"
+            "    global key_t *out,\n"
+            "    global uint *cnt\n"
+            "    )\n"
+            "{\n"
+            "    for(idx_t i = get_global_id(0); i < n; i += get_global_size(0)) {\n"
+            "        key_t k = key[i];\n"
+            "        ord_t u = ord(k) & mask;\n"
+            "        if ((above && u > prefix) || (u == prefix && atomic_inc(cnt + 1) < need))\n"
+            "            out[atomic_inc(cnt)] = k;\n"
+            "    }\n"
+            "}\n";
+
+        return src.str();
+    }
+
+    static std::shared_ptr<select_kernels> get(const cl::CommandQueue &queue) {
+        std::shared_ptr<select_kernels> k = kernel_cache<>::find<select_kernels>(queue);
+        if (k) return k;
+
+        cl::Context context = qctx(queue);
+        cl::Device  device  = qdev(queue);
+
+        auto program = build_sources(context, source());
+
+        select_kernels e;
+        e.count  = cl::Kernel(program, "select_count");
+        e.gather = cl::Kernel(program, "select_gather");
+
+        e.wgsize = std::min<size_t>(256, std::min(
+                    kernel_workgroup_size(e.count, device),
+                    kernel_workgroup_size(e.gather, device)));
+
+        e.g_size = device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU ?
+            device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * e.wgsize :
+            device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * e.wgsize * 4;
+
+        return kernel_cache<>::insert(queue, e);
+    }
+};
+
+// Bucket of the keys sharing the selected high digits (the masked ordinals
+// equal to prefix), together with the per-device counts of keys below the
+// bucket and in it, and the rank of the target key within the bucket.
+template <typename K>
+struct selection {
+    typedef typename key_traits<K>::ord_t ord_t;
+
+    ord_t  prefix, mask;
+    size_t rank;
+
+    std::vector<size_t> below, tie;
+
+    size_t ties() const {
+        return std::accumulate(tie.begin(), tie.end(), static_cast<size_t>(0));
+    }
+};
+
+// Narrows the bucket holding the key of the given ascending rank digit by
+// digit from the top. The devices histogram their own parts and the host
+// sums the histograms. Stops early once the target is the lowest key of a
+// bucket of at most `stop` keys, as then the bucket is known to be taken
+// whole.
+template <typename K>
+selection<K> radix_select(const vector<K> &x, size_t rank, size_t stop) {
+    typedef typename key_traits<K>::ord_t ord_t;
+
+    const std::vector<cl::CommandQueue> &queue = x.queue_list();
+    const size_t bins = size_t(1) << select_bits;
+
+    selection<K> s;
+    s.prefix = 0;
+    s.mask   = 0;
+    s.rank   = rank;
+    s.below.assign(queue.size(), 0);
+
+    for(uint d = 0; d < queue.size(); d++) s.tie.push_back(x.part_size(d));
+
+    std::vector< std::shared_ptr< select_kernels<K> > > krn(queue.size());
+    std::vector<cl::Buffer> hbuf(queue.size());
+    std::vector<cl::Event>  event(queue.size());
+
+    std::vector< std::vector<cl_uint> > hist(queue.size(), std::vector<cl_uint>(bins));
+    const std::vector<cl_uint> zero(bins, 0);
+
+    for(uint d = 0; d < queue.size(); d++) {
+        if (!x.part_size(d)) continue;
+
+        krn[d]  = select_kernels<K>::get(queue[d]);
+        hbuf[d] = memory_pool<>::create("sort",
+                qctx(queue[d]), CL_MEM_READ_WRITE, bins * sizeof(cl_uint));
+    }
+
+    const int top = static_cast<int>(8 * sizeof(ord_t) - select_bits);
+
+    for(int shift = top; shift >= 0; shift -= select_bits) {
+        if (s.rank == 0 && s.ties() <= stop) break;
+
+        for(uint d = 0; d < queue.size(); d++) {
+            if (!x.part_size(d)) continue;
+
+            const select_kernels<K> &k = *krn[d];
+
+            queue[d].enqueueWriteBuffer(hbuf[d], CL_FALSE, 0,
+                    bins * sizeof(cl_uint), zero.data());
+
+            uint pos = 0;
+            k.count.setArg(pos++, x.part_size(d));
+            k.count.setArg(pos++, static_cast<cl_uint>(shift));
+            k.count.setArg(pos++, s.prefix);
+            k.count.setArg(pos++, s.mask);
+            k.count.setArg(pos++, x(d));
+            k.count.setArg(pos++, hbuf[d]);
+            k.count.setArg(pos++, cl::Local(bins * sizeof(cl_uint)));
+
+            queue[d].enqueueNDRangeKernel(k.count, cl::NullRange,
+                    std::min(alignup(x.part_size(d), k.wgsize), k.g_size), k.wgsize,
+                    0, event_trace<>::kernel(queue[d], k.count, x.part_size(d) * sizeof(K)));
+
+            queue[d].enqueueReadBuffer(hbuf[d], CL_FALSE, 0,
+                    bins * sizeof(cl_uint), hist[d].data(), 0, &event[d]);
+        }
+
+        for(uint d = 0; d < queue.size(); d++)
+            if (x.part_size(d)) event[d].wait();
+
+        size_t b = 0;
+        for(;; b++) {
+            size_t c = 0;
+            for(uint d = 0; d < queue.size(); d++) c += hist[d][b];
+
+            if (s.rank < c) break;
+            s.rank -= c;
+        }
+
+        for(uint d = 0; d < queue.size(); d++) {
+            for(size_t j = 0; j < b; j++) s.below[d] += hist[d][j];
+            s.tie[d] = hist[d][b];
+        }
+
+        s.prefix |= static_cast<ord_t>(b) << shift;
+        s.mask   |= static_cast<ord_t>(bins - 1) << shift;
+    }
+
+    return s;
+}
+
+// Copies m keys of a device part into a new buffer: the keys above the
+// selected bucket when above is set, and the first need keys of the bucket.
+template <typename K>
+cl::Buffer select_gather(const cl::CommandQueue &queue, const cl::Buffer &keys,
+        size_t n, const selection<K> &s, bool above, size_t need, size_t m)
+{
+    auto krn = select_kernels<K>::get(queue);
+    cl::Context context = qctx(queue);
+
+    cl_uint zero[2] = {0, 0};
+
+    cl::Buffer out(context, CL_MEM_READ_WRITE, m * sizeof(K));
+    cl::Buffer cnt(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, sizeof(zero), zero);
+
+    uint pos = 0;
+    krn->gather.setArg(pos++, n);
+    krn->gather.setArg(pos++, s.prefix);
+    krn->gather.setArg(pos++, s.mask);
+    krn->gather.setArg(pos++, static_cast<cl_uint>(above));
+    krn->gather.setArg(pos++, static_cast<cl_uint>(need));
+    krn->gather.setArg(pos++, keys);
+    krn->gather.setArg(pos++, out);
+    krn->gather.setArg(pos++, cnt);
+
+    queue.enqueueNDRangeKernel(krn->gather, cl::NullRange,
+            std::min(alignup(n, krn->wgsize), krn->g_size), krn->wgsize,
+            0, event_trace<>::kernel(queue, krn->gather, n * sizeof(K)));
+
+    return out;
+}
+
+} // namespace sorting
+
+/// \endcond
+
+/// Sorts keys in a device buffer.
+/**
+ * LSD radix sort; the sort is stable. Keys may be 32- or 64-bit integers or
+ * floating point numbers (ordered by the usual bit transformation, with -0.0
+ * before +0.0 and NaNs at the ends). When key_bits is less than the key
+ * width, only the lowest key_bits of the (transformed) keys are sorted. The
+ * input buffers receive the result; temporaries of the same size are
+ * allocated for the ping-pong passes.
+ *
+ * The digit width (4 to 11 bits) is chosen per device from its local memory
+ * size and the problem size unless given explicitly in bits. With
+ * detect_range set, a reduction pass first finds the bits that differ
+ * between the keys, and passes over digits shared by all keys are skipped
+ * (e.g. 32-bit keys below 2^20 need three 8-bit passes instead of four).
+ * The pre-pass reads a few bytes back to the host and so synchronizes with
+ * the queue.
+ */
+template <typename K>
+void radix_sort(const cl::CommandQueue &queue, cl::Buffer &keys, size_t n,
+        uint key_bits = 8 * sizeof(K), uint bits = 0, bool detect_range = true)
+{
+    sorting::radix_sort<K, sorting::no_values>(queue, keys, 0, n,
+            key_bits, bits, detect_range);
+}
+
+/// Sorts key-value pairs in device buffers by keys.
+template <typename K, typename V>
+void radix_sort(const cl::CommandQueue &queue, cl::Buffer &keys,
+        cl::Buffer &values, size_t n, uint key_bits = 8 * sizeof(K),
+        uint bits = 0, bool detect_range = true)
+{
+    sorting::radix_sort<K, V>(queue, keys, &values, n,
+            key_bits, bits, detect_range);
+}
+
+/// Sorts device vector.
+/**
+ * \code
+ * vex::vector<float> x(ctx, n);
+ * vex::sort(x);
+ * \endcode
+ * Each device sorts its own part; parts of multi-device vectors are then
+ * merged through the host memory.
+ */
+template <typename K>
+void sort(vector<K> &keys) {
+    for(uint d = 0; d < keys.nparts(); d++)
+        if (size_t n = keys.part_size(d)) {
+            cl::Buffer k = keys(d);
+            radix_sort<K>(keys.queue_list()[d], k, n);
+        }
+
+    if (keys.nparts() > 1) sorting::merge_parts<K, K>(keys, 0);
+}
+
+/// Sorts device vectors of keys and values by keys.
+/**
+ * The vectors should have the same size and partitioning.
+ */
+template <typename K, typename V>
+void sort_by_key(vector<K> &keys, vector<V> &values) {
+    for(uint d = 0; d < keys.nparts(); d++)
+        if (size_t n = keys.part_size(d)) {
+            cl::Buffer k = keys(d), v = values(d);
+            radix_sort<K, V>(keys.queue_list()[d], k, v, n);
+        }
+
+    if (keys.nparts() > 1) sorting::merge_parts<K, V>(keys, &values);
+}
+
+/// The k largest elements of a device vector, largest first.
+/**
+ * \code
+ * std::vector<float> best = vex::top_k(score, 100);
+ * \endcode
+ * MSD radix select: one histogram pass per 8-bit digit of the key narrows
+ * the candidates to the bucket that holds the k-th largest key, stopping
+ * early when the whole bucket is taken. The keys above the bucket and enough
+ * keys of it are then gathered on each device, and only those are sorted.
+ * Each pass reads the vector once and synchronizes with the host to sum the
+ * device histograms, so the cost is a few passes over the vector instead of
+ * a full sort. Keys are ordered as in vex::sort(); k is clamped to the size
+ * of the vector.
+ */
+template <typename K>
+std::vector<K> top_k(const vector<K> &x, size_t k) {
+    const std::vector<cl::CommandQueue> &queue = x.queue_list();
+
+    k = std::min(k, x.size());
+    if (!k) return std::vector<K>();
+
+    if (x.size() > std::numeric_limits<cl_uint>::max())
+        throw std::invalid_argument("top_k: too many elements");
+
+    sorting::selection<K> s = sorting::radix_select(x, x.size() - k,
+            std::numeric_limits<size_t>::max());
+
+    size_t need = s.ties() - s.rank;
+
+    std::vector<K> result(k);
+    std::vector<size_t> start(queue.size() + 1, 0);
+    std::vector<cl::Event> event(queue.size());
+
+    for(uint d = 0; d < queue.size(); d++) {
+        size_t n    = x.part_size(d);
+        size_t take = std::min(need, s.tie[d]);
+        size_t m    = n - s.below[d] - s.tie[d] + take;
+
+        need -= take;
+        start[d + 1] = start[d] + m;
+
+        if (!m) continue;
+
+        cl::Buffer out = sorting::select_gather(queue[d], x(d), n, s, true, take, m);
+        radix_sort<K>(queue[d], out, m);
+
+        queue[d].enqueueReadBuffer(out, CL_FALSE, 0, m * sizeof(K),
+                &result[start[d]], 0, &event[d]);
+    }
+
+    for(uint d = 0; d < queue.size(); d++)
+        if (start[d + 1] > start[d]) event[d].wait();
+
+    for(uint d = 1; d < queue.size(); d++)
+        std::inplace_merge(result.begin(), result.begin() + start[d],
+                result.begin() + start[d + 1]);
+
+    std::reverse(result.begin(), result.end());
+
+    return result;
+}
+
+/// Element of a device vector that would be at the given position if the vector were sorted.
+/**
+ * Radix select as in vex::top_k(); the vector is not modified.
+ */
+template <typename K>
+K nth_element(const vector<K> &x, size_t nth) {
+    if (nth >= x.size())
+        throw std::out_of_range("nth_element: position out of range");
+
+    if (x.size() > std::numeric_limits<cl_uint>::max())
+        throw std::invalid_argument("nth_element: too many elements");
+
+    sorting::selection<K> s = sorting::radix_select(x, nth, 1);
+
+    // The bucket holds either equal keys or the target alone.
+    uint d = 0;
+    while(!s.tie[d]) d++;
+
+    const cl::CommandQueue &q = x.queue_list()[d];
+
+    cl::Buffer out = sorting::select_gather(q, x(d), x.part_size(d), s, false, 1, 1);
+
+    K result;
+    q.enqueueReadBuffer(out, CL_TRUE, 0, sizeof(K), &result);
+
+    return result;
+}
+
+} // namespace vex
+
+#ifdef WIN32
+#  pragma warning(pop)
+#endif
+
+// vim: et
+#endif
@@ -38,7 +38,6 @@ THE SOFTWARE.
 #endif
 
 #include <vector>
-#include <set>
 #include <map>
 #include <unordered_map>
 #include <string>
@@ -46,7 +45,12 @@ THE SOFTWARE.
 #include <algorithm>
 #include <iostream>
 #include <type_traits>
+#include <stdexcept>
+#include <numeric>
 #include <vexcl/vector.hpp>
+#include <vexcl/kernel_cache.hpp>
+#include <vexcl/sort.hpp>
+#include <vexcl/scan.hpp>
 
 namespace vex {
 
@@ -59,7 +63,8 @@ namespace vex {
  * \endcode
  * where x and y are vectors, and A is matrix for 3D Poisson problem in square
  * domain. Each device gets portion of the vector proportional to the
- * performance of this operation.
+ * performance of this operation. The measured weight is cached in
+ * VEXCL_CACHE_DIR when it is set.
  */
 inline double device_spmv_perf(const cl::CommandQueue&);
 
@@ -108,6 +113,17 @@ struct is_scalable< spmv<M, V> > : std::true_type {};
 
 #ifdef VEXCL_MULTIVECTOR_HPP
 
+/// Product of a matrix and each component of a multivector.
+/**
+ * Matrices that can multiply a block of vectors in a single pass over their
+ * nonzeros (see SpMat::mul_block()) provide more specialized overloads.
+ */
+template <class M, class V, class W>
+void spmm(const M &A, const V &x, W &y, typename M::value_type alpha, bool append) {
+    for(size_t i = 0; i < number_of_components<V>::value; i++)
+        A.mul(x(i), y(i), alpha, append);
+}
+
 template <class M, class V>
 struct multispmv
     : multivector_expression<
@@ -133,8 +149,7 @@ struct multispmv
         void
     >::type
     apply(W &y) const {
-        for(size_t i = 0; i < number_of_components<V>::value; i++)
-            A.mul(x(i), y(i), negate ? -scale : scale, append);
+        spmm(A, x, y, negate ? -scale : scale, append);
     }
 };
 
@@ -154,10 +169,125 @@ struct is_scalable< multispmv<M, V> > : std::true_type {};
 
 #endif
 
+// Transposed view of a matrix: products with it go to mul_transposed() of
+// the matrix. Holds a reference, so it should only be used inside the
+// expression it was created for.
+template <class M>
+struct transposed_matrix : matrix_terminal {
+    typedef typename M::value_type value_type;
+
+    const M &A;
+
+    transposed_matrix(const M &A) : A(A) {}
+
+    template <class V, class W>
+    void mul(const V &x, W &y, value_type alpha = 1, bool append = false) const {
+        A.mul_transposed(x, y, alpha, append);
+    }
+};
+
+/// \endcond
+
+/// Transposed matrix for matrix-vector products.
+/**
+ * No transposed copy of the matrix is stored:
+ * \code
+ * y = vex::transpose(A) * x;
+ * \endcode
+ * calls A.mul_transposed(x, y). See SpMat::mul_transposed().
+ */
+template <class M>
+typename std::enable_if<
+    std::is_base_of<matrix_terminal, M>::value,
+    transposed_matrix<M>
+>::type
+transpose(const M &A) {
+    return transposed_matrix<M>(A);
+}
+
+/// Kernels used by SpMat for matrices in CSR format.
+namespace csr_kernel {
+    enum type {
+        automatic, ///< Chosen per device from matrix structure.
+        scalar,    ///< One work-item per row.
+        vector,    ///< Several work-items per row (suits long rows).
+        adaptive,  ///< Row blocks sized to fit into local memory.
+        merge      ///< Rows and nonzeros split evenly across work-items (suits skewed rows).
+    };
+}
+
+/// \cond INTERNAL
+
+// Kernel expression that loads i-th value of type T as real.
+template <typename T>
+inline std::string spmat_load(const std::string &ptr, const std::string &i) {
+    return "(real)" + element_access<T>::load(ptr, i);
+}
+
+// Returns values converted to the storage type.
+template <typename T, typename S>
+const T* spmat_values(const S *v, size_t n, std::vector<T> &buf) {
+    if (std::is_same<T, S>::value) return reinterpret_cast<const T*>(v);
+
+    buf.assign(v, v + n);
+    return buf.data();
+}
+
 /// \endcond
 
-/// Sparse matrix in hybrid ELL-CSR format.
-template <typename real, typename column_t = size_t, typename idx_t = size_t>
+/// Nonzeros of a sparse matrix as (row, column, value) triplets.
+/**
+ * The triplets may come in any order; triplets with the same row and column
+ * are summed. See the SpMat constructor.
+ */
+template <typename column_t, typename real>
+struct coo_triplets {
+    size_t          nnz; ///< Number of triplets.
+    const column_t *row; ///< Row numbers.
+    const column_t *col; ///< Column numbers.
+    const real     *val; ///< Values.
+};
+
+/// Triplets of a sparse matrix in coordinate format.
+template <typename column_t, typename real>
+coo_triplets<column_t, real> coo(size_t nnz,
+        const column_t *row, const column_t *col, const real *val)
+{
+    coo_triplets<column_t, real> t = {nnz, row, col, val};
+    return t;
+}
+
+/// Host sparse matrix in CSR format, given by its arrays.
+/**
+ * Operand of the sparse matrix product constructor of SpMat.
+ */
+template <typename real, typename column_t, typename idx_t>
+struct csr_arrays {
+    size_t          n;   ///< Number of rows.
+    size_t          m;   ///< Number of columns.
+    const idx_t    *row; ///< Row index into col and val.
+    const column_t *col; ///< Column numbers.
+    const real     *val; ///< Values.
+};
+
+/// Sparse matrix in CSR format given by its arrays.
+template <typename real, typename column_t, typename idx_t>
+csr_arrays<real, column_t, idx_t> csr(size_t n, size_t m,
+        const idx_t *row, const column_t *col, const real *val)
+{
+    csr_arrays<real, column_t, idx_t> a = {n, m, row, col, val};
+    return a;
+}
+
+/// Sparse matrix in hybrid ELL-CSR or sliced ELL format.
+/**
+ * Matrix values are stored on the devices as val_t and are converted to real
+ * when loaded by the kernels; vector operations and accumulation are done in
+ * real. val_t may be real, float, or vex::half. Use float or half storage
+ * with double vectors to lower the memory traffic of the bandwidth-bound
+ * matrix-vector product, e.g. for the inner solver of vex::refine().
+ */
+template <typename real, typename column_t = size_t, typename idx_t = size_t, typename val_t = real>
 class SpMat : matrix_terminal {
     public:
         typedef real value_type;
@@ -168,8 +298,9 @@ class SpMat : matrix_terminal {
         /// Constructor.
         /**
          * Constructs GPU representation of the matrix. Input matrix is in CSR
-         * format. GPU matrix utilizes ELL format and is split equally across
-         * all compute devices. When there are more than one device, secondary
+         * format. GPU matrix utilizes either hybrid ELL-CSR or sliced ELL
+         * (SELL-C-sigma) format, depending on the distribution of row widths,
+         * and is split equally across all compute devices. When there are more than one device, secondary
          * queue can be used to perform transfer of ghost values across GPU
          * boundaries in parallel with computation kernel.
          * \param queue vector of queues. Each queue represents one
@@ -179,9 +310,61 @@ class SpMat : matrix_terminal {
          * \param row row index into col and val vectors.
          * \param col column numbers of nonzero elements of the matrix.
          * \param val values of nonzero elements of the matrix.
+         * \param method CSR kernel. By default, GPU strips with long rows
+         *            (32 or more nonzeros per row on average) are kept in
+         *            CSR format and multiplied with the vector kernel, and
+         *            strips with a few rows much wider than the average
+         *            (e.g. web graphs) are kept in CSR format and multiplied
+         *            with the merge kernel; other values force CSR format
+         *            with the given kernel on all devices.
+         */
+        SpMat(const std::vector<cl::CommandQueue> &queue,
+              size_t n, size_t m, const idx_t *row, const column_t *col, const real *val,
+              csr_kernel::type method = csr_kernel::automatic
+              );
+
+        /// Constructor from triplets in coordinate format.
+        /**
+         * The matrix is assembled on the compute devices: the host only
+         * sorts the triplets into the row strips of the devices. Each device
+         * uploads its triplets, radix sorts them by row and column, sums the
+         * duplicates, counts the rows and writes its strip in CSR format,
+         * split into the local and the ghost columns as the constructor from
+         * CSR arrays does. Only the row pointers and the ghost column numbers
+         * are read back. The strips are always in CSR format, with the CSR
+         * kernel chosen as by the constructor from CSR arrays.
+         * \code
+         * vex::SpMat<double, int> A(ctx, n, n, vex::coo(nnz, row, col, val));
+         * \endcode
+         * The number of bits needed for the rows of a strip plus the bits
+         * needed for the column numbers should not exceed 63.
          */
         SpMat(const std::vector<cl::CommandQueue> &queue,
-              size_t n, size_t m, const idx_t *row, const column_t *col, const real *val
+              size_t n, size_t m, const coo_triplets<column_t, real> &coo,
+              csr_kernel::type method = csr_kernel::automatic
+              );
+
+        /// Constructor from the product of two sparse matrices.
+        /**
+         * Computes \f$C = AB\f$ on the compute devices by expansion,
+         * sorting and compression. Each device gets the rows of A in its
+         * strip and the rows of B these reference. It counts the products
+         * of every nonzero of A with its row of B and scans the counts into
+         * output offsets, then writes all the products as triplets, which
+         * are sorted and summed as by the constructor from triplets. The
+         * result is in CSR format:
+         * \code
+         * vex::SpMat<double, int, int> C(ctx,
+         *     vex::csr(n, k, arow, acol, aval), vex::csr(k, m, brow, bcol, bval));
+         * \endcode
+         * The expanded products of a strip should fit into the memory of
+         * its device, and the bits needed for its rows plus the bits needed
+         * for the columns of B should not exceed 63.
+         */
+        SpMat(const std::vector<cl::CommandQueue> &queue,
+              const csr_arrays<real, column_t, idx_t> &A,
+              const csr_arrays<real, column_t, idx_t> &B,
+              csr_kernel::type method = csr_kernel::automatic
               );
 
         /// Matrix-vector multiplication.
@@ -198,13 +381,85 @@ class SpMat : matrix_terminal {
         void mul(const vex::vector<real> &x, vex::vector<real> &y,
                  real alpha = 1, bool append = false) const;
 
+        /// Transposed matrix-vector multiplication.
+        /**
+         * Computes \f$y = \alpha A^T x\f$ or \f$y += \alpha A^T x\f$ with
+         * the strips of A as they are stored, without a transposed copy.
+         * This is what <tt>y = vex::transpose(A) * x</tt> uses. x has the
+         * size and partitioning of the rows of A, y those of its columns.
+         * Each device scatters the products of its strip into its part of y
+         * with atomic additions. Sums for columns owned by other devices are
+         * collected in the ghost buffers of the device and sent back to
+         * their owners through the host, reversing the ghost values
+         * exchange of mul(). The order of summation is not deterministic.
+         * Double precision needs cl_khr_int64_base_atomics. Waits for the
+         * transfers through the host when there are several devices.
+         */
+        void mul_transposed(const vex::vector<real> &x, vex::vector<real> &y,
+                 real alpha = 1, bool append = false) const;
+
+        /// Multiplication by a block of vectors.
+        /**
+         * Computes \f$y_k = \alpha A x_k\f$ (or \f$y_k += \alpha A x_k\f$)
+         * for all k. On devices holding their strip in hybrid ELL or in CSR
+         * format with the scalar kernel, each row is multiplied by up to
+         * block_width vectors at once, so the matrix is read once per
+         * block_width vectors instead of once per vector. This is what
+         * <tt>Y = A * X</tt> uses for multivectors. Other formats and
+         * matrices that need ghost values exchange between devices fall back
+         * to a product per vector.
+         */
+        void mul_block(const std::vector<const vex::vector<real>*> &x,
+                       const std::vector<vex::vector<real>*> &y,
+                       real alpha = 1, bool append = false) const;
+
+        /// Number of vectors multiplied by a single kernel in mul_block().
+        static const uint block_width = 16;
+
         /// Number of rows.
         size_t rows() const { return nrows; }
         /// Number of columns.
         size_t cols() const { return ncols; }
         /// Number of non-zero entries.
         size_t nonzeros() const { return nnz;   }
+
+        /// Timing of the phases of a multiplication on a single device.
+        /**
+         * All times are in seconds and are counted from the start of the
+         * local part of the multiplication.
+         */
+        struct phase_timing {
+            double local_end;      ///< End of the local part.
+            double exchange_begin; ///< Start of ghost values transfer.
+            double exchange_end;   ///< Ghost values are available.
+            double remote_end;     ///< End of the remote part.
+        };
+
+        /// Timing of the phases of the last multiplication on each device.
+        /**
+         * Ghost values exchange overlaps with the local part when
+         * exchange_begin < local_end. Only available when the queues have
+         * CL_QUEUE_PROFILING_ENABLE property. Waits for the multiplication to
+         * finish.
+         */
+        std::vector<phase_timing> timing() const;
     private:
+        // Kernels scattering the products of a strip with atomic additions,
+        // one per storage format, and the kernels of the reversed exchange.
+        struct transposed_kernels {
+            cl::Kernel zero;
+            cl::Kernel csr;
+            cl::Kernel ell;
+            cl::Kernel tail;
+            cl::Kernel sell;
+            cl::Kernel scatter;
+            uint       wgsize;
+            size_t     g_size;
+        };
+
+        static std::shared_ptr<transposed_kernels> get_transposed_kernels(
+                const cl::CommandQueue &queue);
+
         struct sparse_matrix {
             virtual void mul_local(
                     const cl::Buffer &x, const cl::Buffer &y,
@@ -216,9 +471,101 @@ class SpMat : matrix_terminal {
                     real alpha, const std::vector<cl::Event> &event
                     ) const = 0;
 
+            // y += alpha * A_loc^T x and ghosts += alpha * A_rem^T x.
+            virtual void mul_transposed(
+                    const transposed_kernels &k,
+                    const cl::Buffer &x, const cl::Buffer &y,
+                    const cl::Buffer &ghosts, real alpha
+                    ) const = 0;
+
+            // Local part for a block of vectors. Formats without a fused
+            // kernel multiply the vectors one by one.
+            virtual void mul_local_block(
+                    const std::vector<cl::Buffer> &x,
+                    const std::vector<cl::Buffer> &y,
+                    real alpha, bool append
+                    ) const
+            {
+                for(size_t i = 0; i < x.size(); i++)
+                    mul_local(x[i], y[i], alpha, append);
+            }
+
             virtual ~sparse_matrix() {}
         };
 
+        // Kernels multiplying a strip of the matrix by 'width' vectors. The
+        // vectors are passed as separate arguments after the matrix data.
+        struct block_kernels {
+            cl::Kernel ell_set;
+            cl::Kernel ell_add;
+            cl::Kernel tail_add;
+            cl::Kernel csr_set;
+            cl::Kernel csr_add;
+            uint       wgsize;
+        };
+
+        static std::shared_ptr<block_kernels> get_block_kernels(
+                const cl::CommandQueue &queue, uint width);
+
+        // Strip of the matrix assembled from triplets on its device, in CSR
+        // format split into the local and the remote parts (remote columns
+        // are numbered in remote_cols).
+        struct device_strip {
+            size_t nnz;
+            bool   has_loc;
+            bool   has_rem;
+
+            cl::Buffer lrow, lcol, lval;
+            cl::Buffer rrow, rcol, rval;
+
+            std::vector<idx_t>    row; // host copy of lrow
+            std::vector<column_t> remote_cols;
+        };
+
+        // Kernels assembling strips from triplets, and expanding the
+        // products of two CSR matrices into triplets.
+        struct coo_kernels {
+            cl::Kernel products;
+            cl::Kernel expand;
+            cl::Kernel keys;
+            cl::Kernel key_heads;
+            cl::Kernel col_heads;
+            cl::Kernel compress;
+            cl::Kernel rows;
+            cl::Kernel remote_rows;
+            cl::Kernel split;
+            cl::Kernel renumber;
+            uint       wgsize;
+        };
+
+        static std::shared_ptr<coo_kernels> get_coo_kernels(const cl::CommandQueue &queue);
+
+        // Bits taken by the numbers below count in the keys of the triplets.
+        static cl_uint coo_bits(size_t count) {
+            cl_uint b = 0;
+            for(size_t v = count ? count - 1 : 0; v; v >>= 1) b++;
+            return b;
+        }
+
+        static device_strip assemble_strip(const cl::CommandQueue &queue,
+                size_t beg, size_t end, column_t xbeg, column_t xend, size_t m,
+                size_t nnz, const column_t *row, const column_t *col, const real *val);
+
+        // Same for triplets on the device. The buffers are released.
+        static device_strip compress_strip(const cl::CommandQueue &queue,
+                size_t beg, size_t end, column_t xbeg, column_t xend, size_t m,
+                size_t nnz, cl::Buffer &row, cl::Buffer &col, cl::Buffer &val);
+
+        // Strip of the product of A and B.
+        static device_strip multiply_strip(const cl::CommandQueue &queue,
+                size_t beg, size_t end, column_t xbeg, column_t xend,
+                const csr_arrays<real, column_t, idx_t> &A,
+                const csr_arrays<real, column_t, idx_t> &B);
+
+        static void set_block_args(cl::Kernel &k, uint pos,
+                const std::vector<cl::Buffer> &x, const std::vector<cl::Buffer> &y,
+                size_t first, uint width);
+
         struct SpMatELL : sparse_matrix {
             static const column_t ncol = -1;
 
@@ -226,10 +573,10 @@ class SpMat : matrix_terminal {
                     const cl::CommandQueue &queue,
                     size_t beg, size_t end, column_t xbeg, column_t xend,
                     const idx_t *row, const column_t *col, const real *val,
-                    const std::set<column_t> &remote_cols
+                    const std::vector<column_t> &remote_cols
                     );
 
-            void prepare_kernels(const cl::Context &context) const;
+            void prepare_kernels(const cl::Context &context);
 
             void mul_local(
                     const cl::Buffer &x, const cl::Buffer &y,
@@ -241,6 +588,18 @@ class SpMat : matrix_terminal {
                     real alpha, const std::vector<cl::Event> &event
                     ) const;
 
+            void mul_transposed(
+                    const transposed_kernels &k,
+                    const cl::Buffer &x, const cl::Buffer &y,
+                    const cl::Buffer &ghosts, real alpha
+                    ) const;
+
+            void mul_local_block(
+                    const std::vector<cl::Buffer> &x,
+                    const std::vector<cl::Buffer> &y,
+                    real alpha, bool append
+                    ) const;
+
             const cl::CommandQueue &queue;
 
             size_t n, pitch;
@@ -259,12 +618,15 @@ class SpMat : matrix_terminal {
                 cl::Buffer val;
             } loc_csr, rem_csr;
 
-            static std::map<cl_context, bool>       compiled;
-            static std::map<cl_context, cl::Kernel> zero;
-            static std::map<cl_context, cl::Kernel> spmv_set;
-            static std::map<cl_context, cl::Kernel> spmv_add;
-            static std::map<cl_context, cl::Kernel> csr_add;
-            static std::map<cl_context, uint>       wgsize;
+            struct kernels {
+                cl::Kernel zero;
+                cl::Kernel spmv_set;
+                cl::Kernel spmv_add;
+                cl::Kernel csr_add;
+                uint       wgsize;
+            };
+
+            std::shared_ptr<kernels> krn;
         };
 
         struct SpMatCSR : public sparse_matrix {
@@ -272,247 +634,1711 @@ class SpMat : matrix_terminal {
                     const cl::CommandQueue &queue,
                     size_t beg, size_t end, column_t xbeg, column_t xend,
                     const idx_t *row, const column_t *col, const real *val,
-                    const std::set<column_t> &remote_cols
+                    const std::vector<column_t> &remote_cols,
+                    csr_kernel::type method = csr_kernel::automatic
+                    );
+
+            // Strip assembled on the device.
+            SpMatCSR(
+                    const cl::CommandQueue &queue, size_t n,
+                    const device_strip &strip,
+                    csr_kernel::type method = csr_kernel::automatic
+                    );
+
+            void prepare_kernels(const cl::Context &context);
+
+            void setup_method(csr_kernel::type method, const idx_t *row);
+
+            void mul_local(
+                    const cl::Buffer &x, const cl::Buffer &y,
+                    real alpha, bool append
+                    ) const;
+
+            void mul_remote(
+                    const cl::Buffer &x, const cl::Buffer &y,
+                    real alpha, const std::vector<cl::Event> &event
+                    ) const;
+
+            void mul_transposed(
+                    const transposed_kernels &k,
+                    const cl::Buffer &x, const cl::Buffer &y,
+                    const cl::Buffer &ghosts, real alpha
+                    ) const;
+
+            void mul_local_block(
+                    const std::vector<cl::Buffer> &x,
+                    const std::vector<cl::Buffer> &y,
+                    real alpha, bool append
+                    ) const;
+
+            const cl::CommandQueue &queue;
+
+            size_t n;
+
+            bool has_loc;
+            bool has_rem;
+
+            struct {
+                cl::Buffer row;
+                cl::Buffer col;
+                cl::Buffer val;
+            } loc, rem;
+
+            // Kernel used for the local part. The remote part is
+            // usually very sparse and always uses the scalar kernel.
+            csr_kernel::type method;
+
+            // Work-items per row for the vector kernel.
+            uint vwidth;
+
+            // Row blocks for the adaptive kernel.
+            size_t     nblocks;
+            cl::Buffer blocks;
+
+            // Merge path tiles and their carry-out rows and sums for the
+            // merge kernel.
+            size_t     ntiles;
+            size_t     loc_nnz;
+            cl::Buffer carry_row;
+            cl::Buffer carry_val;
+
+            struct kernels {
+                cl::Kernel zero;
+                cl::Kernel spmv_set;
+                cl::Kernel spmv_add;
+                cl::Kernel vector_set;
+                cl::Kernel vector_add;
+                cl::Kernel adaptive_set;
+                cl::Kernel adaptive_add;
+                cl::Kernel merge_set;
+                cl::Kernel merge_add;
+                cl::Kernel merge_fixup;
+                uint       wgsize;
+                uint       local_size; // 0 if vector kernels are unusable.
+                uint       wavefront;
+                uint       tile;       // Merge path items per work-group.
+            };
+
+            std::shared_ptr<kernels> krn;
+        };
+
+        struct SpMatSELL : public sparse_matrix {
+            static const column_t ncol = -1;
+
+            // Rows are sorted by length inside windows of (C * sigma_chunks)
+            // rows.
+            static const uint sigma_chunks = 16;
+
+            SpMatSELL(
+                    const cl::CommandQueue &queue,
+                    size_t beg, size_t end, column_t xbeg, column_t xend,
+                    const idx_t *row, const column_t *col, const real *val,
+                    const std::vector<column_t> &remote_cols
                     );
 
-            void prepare_kernels(const cl::Context &context) const;
+            void prepare_kernels(const cl::Context &context);
+
+            void mul_local(
+                    const cl::Buffer &x, const cl::Buffer &y,
+                    real alpha, bool append
+                    ) const;
+
+            void mul_remote(
+                    const cl::Buffer &x, const cl::Buffer &y,
+                    real alpha, const std::vector<cl::Event> &event
+                    ) const;
+
+            void mul_transposed(
+                    const transposed_kernels &k,
+                    const cl::Buffer &x, const cl::Buffer &y,
+                    const cl::Buffer &ghosts, real alpha
+                    ) const;
+
+            struct slices {
+                size_t n;
+                cl::Buffer start;
+                cl::Buffer perm;
+                cl::Buffer col;
+                cl::Buffer val;
+            };
+
+            void setup(slices &s, size_t nrows, bool all_rows,
+                    const std::vector<idx_t>    &row,
+                    const std::vector<column_t> &col,
+                    const std::vector<val_t>    &val
+                    );
+
+            void spmv(const slices &s, const cl::Buffer &x, const cl::Buffer &y,
+                    real alpha, bool append,
+                    const std::vector<cl::Event> *event = 0
+                    ) const;
+
+            const cl::CommandQueue &queue;
+
+            size_t n;
+
+            slices loc, rem;
+
+            struct kernels {
+                cl::Kernel spmv_set;
+                cl::Kernel spmv_add;
+                uint       wgsize;
+                uint       chunk;
+            };
+
+            std::shared_ptr<kernels> krn;
+        };
+
+        struct exdata {
+            std::vector<column_t> cols_to_recv;
+
+            // Devices owning the ghost values needed by this device.
+            std::vector<uint> sources;
+
+            cl::Buffer cols_to_send;
+            cl::Buffer vals_to_send;
+            cl::Buffer recv_cols;
+            cl::Buffer ghosts;
+            mutable cl::Buffer rx;
+        };
+
+        const std::vector<cl::CommandQueue> queue;
+        std::vector<cl::CommandQueue>       squeue;
+        const std::vector<size_t>           part;
+
+        mutable std::vector<std::vector<cl::Event>> event1;
+        mutable std::vector<std::vector<cl::Event>> event2;
+        mutable std::vector<std::vector<cl::Event>> event3;
+        mutable std::vector<std::vector<cl::Event>> recv_event;
+        mutable std::vector<std::vector<cl::Event>> marker;
+        mutable bool exchange_pending;
+
+        std::vector<char> profiling;
+
+        std::vector<std::unique_ptr<sparse_matrix>> mtx;
+
+        std::vector<exdata> exc;
+        std::vector<size_t> cidx;
+        mutable std::vector<real> rx;
+
+        // Ghost sums of each device in the transposed product.
+        mutable std::vector<std::vector<real>> tx;
+
+        size_t nrows;
+        size_t ncols;
+        size_t nnz;
+
+
+        struct gather_kernel {
+            cl::Kernel kernel;
+            uint       wgsize;
+
+            gather_kernel(const cl::Kernel &kernel, const cl::Device &device)
+                : kernel(kernel), wgsize(kernel_workgroup_size(kernel, device))
+            {}
+        };
+
+        std::vector< std::shared_ptr<gather_kernel> > gather_vals_to_send;
+
+        // Compiles the ghost gather kernels and creates the secondary queues.
+        void setup_queues();
+
+        std::vector<std::vector<column_t>> setup_exchange(
+                size_t n, const std::vector<size_t> &xpart,
+                const idx_t *row, const column_t *col, const real *val
+                );
+
+        // Exchange structures from the sorted ghost columns of each device.
+        void build_exchange(const std::vector<size_t> &xpart,
+                const std::vector<std::vector<column_t>> &remote_cols);
+
+        static bool use_sell(size_t beg, size_t end, const idx_t *row);
+        static bool skewed(size_t beg, size_t end, const idx_t *row);
+
+        static void CL_CALLBACK ghosts_ready(cl_event, cl_int status, void *data) {
+            cl_event ready = static_cast<cl_event>(data);
+            clSetUserEventStatus(ready, status < 0 ? status : CL_COMPLETE);
+            clReleaseEvent(ready);
+        }
+};
+
+template <typename real, typename column_t, typename idx_t, typename val_t>
+SpMat<real,column_t,idx_t,val_t>::SpMat(
+        const std::vector<cl::CommandQueue> &queue,
+        size_t n, size_t m, const idx_t *row, const column_t *col, const real *val,
+        csr_kernel::type method
+        )
+    : queue(queue), part(partition(n, queue)),
+      event1(queue.size(), std::vector<cl::Event>(1)),
+      event2(queue.size(), std::vector<cl::Event>(1)),
+      event3(queue.size(), std::vector<cl::Event>(1)),
+      recv_event(queue.size()),
+      marker(queue.size(), std::vector<cl::Event>(3)),
+      exchange_pending(false), profiling(queue.size()),
+      mtx(queue.size()), exc(queue.size()),
+      nrows(n), ncols(m), nnz(row[n]),
+      gather_vals_to_send(queue.size())
+{
+    auto xpart = partition(m, queue);
+
+    setup_queues();
+
+    std::vector<std::vector<column_t>> remote_cols = setup_exchange(n, xpart, row, col, val);
+
+    // Each device get it's own strip of the matrix.
+#pragma omp parallel for schedule(static,1)
+    for(int d = 0; d < static_cast<int>(queue.size()); d++) {
+        if (part[d + 1] > part[d]) {
+            cl::Device device = qdev(queue[d]);
+
+            // Average row width of the strip.
+            double avg = static_cast<double>(row[part[d + 1]] - row[part[d]])
+                / (part[d + 1] - part[d]);
+
+            if (method != csr_kernel::automatic ||
+                    device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU ||
+                    avg >= 32)
+                mtx[d].reset(
+                        new SpMatCSR(queue[d],
+                            part[d], part[d + 1],
+                            xpart[d], xpart[d + 1],
+                            row, col, val, remote_cols[d], method)
+                        );
+            else if (skewed(part[d], part[d + 1], row))
+                mtx[d].reset(
+                        new SpMatCSR(queue[d],
+                            part[d], part[d + 1],
+                            xpart[d], xpart[d + 1],
+                            row, col, val, remote_cols[d], csr_kernel::merge)
+                        );
+            else if (use_sell(part[d], part[d + 1], row))
+                mtx[d].reset(
+                        new SpMatSELL(queue[d],
+                            part[d], part[d + 1],
+                            xpart[d], xpart[d + 1],
+                            row, col, val, remote_cols[d])
+                        );
+            else
+                mtx[d].reset(
+                        new SpMatELL(queue[d],
+                            part[d], part[d + 1],
+                            xpart[d], xpart[d + 1],
+                            row, col, val, remote_cols[d])
+                        );
+        }
+    }
+}
+
+template <typename real, typename column_t, typename idx_t, typename val_t>
+void SpMat<real,column_t,idx_t,val_t>::setup_queues() {
+    for(uint d = 0; d < queue.size(); d++) {
+        cl::Context context = qctx(queue[d]);
+        cl::Device  device  = qdev(queue[d]);
+
+        // Compile kernels.
+        gather_vals_to_send[d] = kernel_cache<>::find<gather_kernel>(queue[d]);
+
+        if (!gather_vals_to_send[d]) {
+            std::ostringstream source;
+
+            source << standard_kernel_header <<
+                "typedef " << type_name<real>() << " real;\n"
+                "kernel void gather_vals_to_send(\n"
+                "    " << type_name<size_t>() << " n,\n"
+                "    global const real *vals,\n"
+                "    global const " << type_name<column_t>() << " *cols_to_send,\n"
+                "    global real *vals_to_send\n"
+                "    )\n"
+                "{\n"
+                "    size_t i = get_global_id(0);\n"
+                "    if (i < n) vals_to_send[i] = vals[cols_to_send[i]];\n"
+                "}\n";
+
+            auto program = build_sources(context, source.str());
+
+            gather_vals_to_send[d] = kernel_cache<>::insert(queue[d], gather_kernel(
+                        cl::Kernel(program, "gather_vals_to_send"), device));
+        }
+
+        // Create secondary queues.
+        profiling[d] = (queue[d].getInfo<CL_QUEUE_PROPERTIES>()
+                & CL_QUEUE_PROFILING_ENABLE) != 0;
+
+        squeue.push_back(cl::CommandQueue(context, device,
+                    profiling[d] ? CL_QUEUE_PROFILING_ENABLE : 0));
+    }
+}
+
+template <typename real, typename column_t, typename idx_t, typename val_t>
+SpMat<real,column_t,idx_t,val_t>::SpMat(
+        const std::vector<cl::CommandQueue> &queue,
+        size_t n, size_t m, const coo_triplets<column_t, real> &coo,
+        csr_kernel::type method
+        )
+    : queue(queue), part(partition(n, queue)),
+      event1(queue.size(), std::vector<cl::Event>(1)),
+      event2(queue.size(), std::vector<cl::Event>(1)),
+      event3(queue.size(), std::vector<cl::Event>(1)),
+      recv_event(queue.size()),
+      marker(queue.size(), std::vector<cl::Event>(3)),
+      exchange_pending(false), profiling(queue.size()),
+      mtx(queue.size()), exc(queue.size()),
+      nrows(n), ncols(m), nnz(0),
+      gather_vals_to_send(queue.size())
+{
+    for(uint d = 0; d < queue.size(); d++)
+        if (coo_bits(part[d + 1] - part[d]) + coo_bits(m) > 63)
+            throw std::length_error("SpMat: the matrix is too large for assembly from triplets");
+
+    auto xpart = partition(m, queue);
+
+    setup_queues();
+
+    std::vector<device_strip> strip(queue.size());
+
+    if (queue.size() == 1) {
+        if (n) strip[0] = assemble_strip(queue[0], 0, n, 0, m, m,
+                coo.nnz, coo.row, coo.col, coo.val);
+    } else {
+        // Group the triplets by the strips of the devices. This is the only
+        // pass over the triplets on the host.
+        std::vector<size_t> start(queue.size() + 1, 0);
+        std::vector<uint>   owner(coo.nnz);
+
+        for(size_t i = 0; i < coo.nnz; i++) {
+            owner[i] = std::upper_bound(part.begin(), part.end(),
+                    static_cast<size_t>(coo.row[i])) - part.begin() - 1;
+            start[owner[i] + 1]++;
+        }
+
+        std::partial_sum(start.begin(), start.end(), start.begin());
+
+        std::vector<column_t> row(coo.nnz), col(coo.nnz);
+        std::vector<real>     val(coo.nnz);
+
+        {
+            std::vector<size_t> pos(start.begin(), start.end() - 1);
+
+            for(size_t i = 0; i < coo.nnz; i++) {
+                size_t j = pos[owner[i]]++;
+
+                row[j] = coo.row[i];
+                col[j] = coo.col[i];
+                val[j] = coo.val[i];
+            }
+        }
+
+#pragma omp parallel for schedule(static,1)
+        for(int d = 0; d < static_cast<int>(queue.size()); d++) {
+            if (part[d + 1] > part[d])
+                strip[d] = assemble_strip(queue[d],
+                        part[d], part[d + 1], xpart[d], xpart[d + 1], m,
+                        start[d + 1] - start[d], row.data() + start[d],
+                        col.data() + start[d], val.data() + start[d]);
+        }
+    }
+
+    std::vector<std::vector<column_t>> remote_cols(queue.size());
+    for(uint d = 0; d < queue.size(); d++)
+        remote_cols[d].swap(strip[d].remote_cols);
+
+    build_exchange(xpart, remote_cols);
+
+    for(uint d = 0; d < queue.size(); d++) {
+        if (part[d + 1] > part[d]) {
+            mtx[d].reset(new SpMatCSR(queue[d], part[d + 1] - part[d], strip[d], method));
+            nnz += strip[d].nnz;
+        }
+    }
+}
+
+template <typename real, typename column_t, typename idx_t, typename val_t>
+SpMat<real,column_t,idx_t,val_t>::SpMat(
+        const std::vector<cl::CommandQueue> &queue,
+        const csr_arrays<real, column_t, idx_t> &A,
+        const csr_arrays<real, column_t, idx_t> &B,
+        csr_kernel::type method
+        )
+    : queue(queue), part(partition(A.n, queue)),
+      event1(queue.size(), std::vector<cl::Event>(1)),
+      event2(queue.size(), std::vector<cl::Event>(1)),
+      event3(queue.size(), std::vector<cl::Event>(1)),
+      recv_event(queue.size()),
+      marker(queue.size(), std::vector<cl::Event>(3)),
+      exchange_pending(false), profiling(queue.size()),
+      mtx(queue.size()), exc(queue.size()),
+      nrows(A.n), ncols(B.m), nnz(0),
+      gather_vals_to_send(queue.size())
+{
+    if (A.m != B.n)
+        throw std::invalid_argument("SpMat: inner dimensions of the product differ");
+
+    for(uint d = 0; d < queue.size(); d++)
+        if (coo_bits(part[d + 1] - part[d]) + coo_bits(ncols) > 63)
+            throw std::length_error("SpMat: the matrix is too large for assembly from triplets");
+
+    auto xpart = partition(ncols, queue);
+
+    setup_queues();
+
+    std::vector<device_strip> strip(queue.size());
+
+#pragma omp parallel for schedule(static,1)
+    for(int d = 0; d < static_cast<int>(queue.size()); d++) {
+        if (part[d + 1] > part[d])
+            strip[d] = multiply_strip(queue[d],
+                    part[d], part[d + 1], xpart[d], xpart[d + 1], A, B);
+    }
+
+    std::vector<std::vector<column_t>> remote_cols(queue.size());
+    for(uint d = 0; d < queue.size(); d++)
+        remote_cols[d].swap(strip[d].remote_cols);
+
+    build_exchange(xpart, remote_cols);
+
+    for(uint d = 0; d < queue.size(); d++) {
+        if (part[d + 1] > part[d]) {
+            mtx[d].reset(new SpMatCSR(queue[d], part[d + 1] - part[d], strip[d], method));
+            nnz += strip[d].nnz;
+        }
+    }
+}
+
+template <typename real, typename column_t, typename idx_t, typename val_t>
+typename SpMat<real,column_t,idx_t,val_t>::device_strip
+SpMat<real,column_t,idx_t,val_t>::multiply_strip(
+        const cl::CommandQueue &queue,
+        size_t beg, size_t end, column_t xbeg, column_t xend,
+        const csr_arrays<real, column_t, idx_t> &A,
+        const csr_arrays<real, column_t, idx_t> &B
+        )
+{
+    const size_t n   = end - beg;
+    const size_t anz = A.row[end] - A.row[beg];
+
+    // Columns of the strip of A, as rows of B.
+    std::vector<column_t> acol(A.col + A.row[beg], A.col + A.row[end]);
+
+    const idx_t    *brow = B.row;
+    const column_t *bcol = B.col;
+    const real     *bval = B.val;
+    size_t          bn   = B.n;
+
+    // A strip of several takes only the rows of B it references.
+    std::vector<idx_t>    srow;
+    std::vector<column_t> scol;
+    std::vector<real>     sval;
+
+    if (n < A.n) {
+        std::vector<column_t> need(acol);
+        std::sort(need.begin(), need.end());
+        need.erase(std::unique(need.begin(), need.end()), need.end());
+
+        srow.reserve(need.size() + 1);
+        srow.push_back(0);
+
+        for(auto k = need.begin(); k != need.end(); k++) {
+            scol.insert(scol.end(), B.col + B.row[*k], B.col + B.row[*k + 1]);
+            sval.insert(sval.end(), B.val + B.row[*k], B.val + B.row[*k + 1]);
+            srow.push_back(scol.size());
+        }
+
+        for(auto c = acol.begin(); c != acol.end(); c++)
+            *c = std::lower_bound(need.begin(), need.end(), *c) - need.begin();
+
+        brow = srow.data();
+        bcol = scol.data();
+        bval = sval.data();
+        bn   = need.size();
+    }
+
+    const size_t bnz = brow[bn];
+
+    cl::Buffer trow, tcol, tval;
+    size_t total = 0;
+
+    if (anz && bnz) {
+        std::vector<cl::CommandQueue> q(1, queue);
+
+        auto krn = get_coo_kernels(queue);
+
+        auto launch = [&](const cl::Kernel &k, size_t count) {
+            queue.enqueueNDRangeKernel(k, cl::NullRange,
+                    alignup(count, krn->wgsize), krn->wgsize,
+                    0, event_trace<>::kernel(queue, k));
+        };
+
+        vector<idx_t>    dev_arow(q, n + 1, A.row + beg);
+        vector<column_t> dev_acol(q, anz, acol.data());
+        vector<real>     dev_aval(q, anz, A.val + A.row[beg]);
+        vector<idx_t>    dev_brow(q, bn + 1, brow);
+        vector<column_t> dev_bcol(q, bnz, bcol);
+        vector<real>     dev_bval(q, bnz, bval);
+
+        // Size estimation: the products of each nonzero of A, scanned into
+        // the end of its output range.
+        vector<cl_ulong> off(q, anz);
+
+        uint pos = 0;
+        krn->products.setArg(pos++, anz);
+        krn->products.setArg(pos++, dev_acol(0));
+        krn->products.setArg(pos++, dev_brow(0));
+        krn->products.setArg(pos++, off(0));
+
+        launch(krn->products, anz);
+
+        inclusive_scan(off, off);
+
+        cl_ulong last;
+        queue.enqueueReadBuffer(off(0), CL_TRUE,
+                (anz - 1) * sizeof(cl_ulong), sizeof(cl_ulong), &last);
+        total = static_cast<size_t>(last);
+
+        if (total) {
+            cl::Context context = qctx(queue);
+
+            trow = memory_pool<>::create("spmat",
+                    context, CL_MEM_READ_WRITE, total * sizeof(column_t));
+            tcol = memory_pool<>::create("spmat",
+                    context, CL_MEM_READ_WRITE, total * sizeof(column_t));
+            tval = memory_pool<>::create("spmat", context, CL_MEM_READ_WRITE, total * sizeof(real));
+
+            pos = 0;
+            krn->expand.setArg(pos++, n);
+            krn->expand.setArg(pos++, anz);
+            krn->expand.setArg(pos++, static_cast<cl_ulong>(beg));
+            krn->expand.setArg(pos++, dev_arow(0));
+            krn->expand.setArg(pos++, dev_acol(0));
+            krn->expand.setArg(pos++, dev_aval(0));
+            krn->expand.setArg(pos++, dev_brow(0));
+            krn->expand.setArg(pos++, dev_bcol(0));
+            krn->expand.setArg(pos++, dev_bval(0));
+            krn->expand.setArg(pos++, off(0));
+            krn->expand.setArg(pos++, trow);
+            krn->expand.setArg(pos++, tcol);
+            krn->expand.setArg(pos++, tval);
+
+            launch(krn->expand, anz);
+        }
+    }
+
+    return compress_strip(queue, beg, end, xbeg, xend, B.m, total, trow, tcol, tval);
+}
+
+template <typename real, typename column_t, typename idx_t, typename val_t>
+std::shared_ptr<typename SpMat<real,column_t,idx_t,val_t>::coo_kernels>
+SpMat<real,column_t,idx_t,val_t>::get_coo_kernels(const cl::CommandQueue &queue) {
+    std::shared_ptr<coo_kernels> krn = kernel_cache<>::find<coo_kernels>(queue);
+
+    if (krn) return krn;
+
+    typedef typename element_access<val_t>::compute_type stored_type;
+
+    std::ostringstream source;
+
+    source << standard_kernel_header <<
+        "typedef " << type_name<real>()     << " real;\n"
+        "typedef " << type_name<column_t>() << " col_t;\n"
+        "typedef " << type_name<idx_t>()    << " idx_t;\n"
+        "typedef " << type_name<val_t>()    << " val_t;\n"
+        "typedef " << type_name<size_t>()   << " size_type;\n"
+        // Keys are (remote, row, column); rows of the remote part follow
+        // the rows of the local part.
+        "size_t strip_row(ulong key, size_type n, uint cbits, uint rbits) {\n"
+        "    ulong r = key >> cbits;\n"
+        "    return (r >> rbits) * n + (r & ((1UL << rbits) - 1));\n"
+        "}\n"
+        "kernel void products(\n"
+        "    size_type nnz,\n"
+        "    global const col_t *acol,\n"
+        "    global const idx_t *brow,\n"
+        "    global ulong *cnt\n"
+        "    )\n"
+        "{\n"
+        "    size_t grid_size = get_global_size(0);\n"
+        "    for(size_t i = get_global_id(0); i < nnz; i += grid_size) {\n"
+        "        col_t k = acol[i];\n"
+        "        cnt[i] = brow[k + 1] - brow[k];\n"
+        "    }\n"
+        "}\n"
+        // Products of each nonzero of A with its row of B, ending at the
+        // scanned count of the nonzero.
+        "kernel void expand(\n"
+        "    size_type n, size_type nnz, ulong beg,\n"
+        "    global const idx_t *arow,\n"
+        "    global const col_t *acol,\n"
+        "    global const real  *aval,\n"
+        "    global const idx_t *brow,\n"
+        "    global const col_t *bcol,\n"
+        "    global const real  *bval,\n"
+        "    global const ulong *end,\n"
+        "    global col_t *row,\n"
+        "    global col_t *col,\n"
+        "    global real  *val\n"
+        "    )\n"
+        "{\n"
+        "    size_t grid_size = get_global_size(0);\n"
+        "    for(size_t i = get_global_id(0); i < nnz; i += grid_size) {\n"
+        "        size_t lo = 0, hi = n - 1, a0 = arow[0];\n"
+        "        while(lo < hi) {\n"
+        "            size_t mid = (lo + hi + 1) / 2;\n"
+        "            if (arow[mid] - a0 <= i) lo = mid; else hi = mid - 1;\n"
+        "        }\n"
+        "        col_t  k = acol[i];\n"
+        "        real   a = aval[i];\n"
+        "        size_t b = brow[k], e = brow[k + 1];\n"
+        "        size_t o = end[i] - (e - b);\n"
+        "        for(size_t j = b; j < e; j++, o++) {\n"
+        "            row[o] = beg + lo;\n"
+        "            col[o] = bcol[j];\n"
+        "            val[o] = a * bval[j];\n"
+        "        }\n"
+        "    }\n"
+        "}\n"
+        "kernel void keys(\n"
+        "    size_type nnz, ulong beg, col_t xbeg, col_t xend, uint cbits, uint rbits,\n"
+        "    global const col_t *row,\n"
+        "    global const col_t *col,\n"
+        "    global ulong *key\n"
+        "    )\n"
+        "{\n"
+        "    size_t grid_size = get_global_size(0);\n"
+        "    for(size_t i = get_global_id(0); i < nnz; i += grid_size) {\n"
+        "        col_t c = col[i];\n"
+        "        ulong remote = c < xbeg || c >= xend;\n"
+        "        key[i] = (remote << (rbits + cbits)) | ((ulong)(row[i] - beg) << cbits) | (ulong)c;\n"
+        "    }\n"
+        "}\n"
+        "kernel void key_heads(size_type n, global const ulong *key, global uint *head) {\n"
+        "    size_t grid_size = get_global_size(0);\n"
+        "    for(size_t i = get_global_id(0); i < n; i += grid_size)\n"
+        "        head[i] = i == 0 || key[i] != key[i - 1];\n"
+        "}\n"
+        "kernel void col_heads(size_type n, global const col_t *col, global uint *head) {\n"
+        "    size_t grid_size = get_global_size(0);\n"
+        "    for(size_t i = get_global_id(0); i < n; i += grid_size)\n"
+        "        head[i] = i == 0 || col[i] != col[i - 1];\n"
+        "}\n"
+        // Sums the duplicates that follow each first triplet of a key.
+        "kernel void compress(\n"
+        "    size_type nnz,\n"
+        "    global const ulong *key,\n"
+        "    global const real  *val,\n"
+        "    global const uint  *head,\n"
+        "    global const idx_t *pos,\n"
+        "    global ulong *ukey,\n"
+        "    global real  *uval\n"
+        "    )\n"
+        "{\n"
+        "    size_t grid_size = get_global_size(0);\n"
+        "    for(size_t i = get_global_id(0); i < nnz; i += grid_size) {\n"
+        "        if (!head[i]) continue;\n"
+        "        ulong k = key[i];\n"
+        "        real  s = val[i];\n"
+        "        for(size_t j = i + 1; j < nnz && key[j] == k; j++) s += val[j];\n"
+        "        size_t u = pos[i] - 1;\n"
+        "        ukey[u] = k;\n"
+        "        uval[u] = s;\n"
+        "    }\n"
+        "}\n"
+        // Row pointers of the local rows followed by those of the remote
+        // rows: triplet i starts the rows after the row of triplet i - 1 up
+        // to its own.
+        "kernel void rows(\n"
+        "    size_type nu, size_type n, uint cbits, uint rbits,\n"
+        "    global const ulong *ukey,\n"
+        "    global idx_t *ptr\n"
+        "    )\n"
+        "{\n"
+        "    size_t grid_size = get_global_size(0);\n"
+        "    for(size_t i = get_global_id(0); i <= nu; i += grid_size) {\n"
+        "        size_t first = i == 0  ? 0     : strip_row(ukey[i - 1], n, cbits, rbits) + 1;\n"
+        "        size_t last  = i == nu ? 2 * n : strip_row(ukey[i],     n, cbits, rbits);\n"
+        "        for(size_t r = first; r <= last; r++) ptr[r] = i;\n"
+        "    }\n"
+        "}\n"
+        "kernel void remote_rows(size_type n, global const idx_t *ptr, global idx_t *rptr) {\n"
+        "    size_t grid_size = get_global_size(0);\n"
+        "    for(size_t i = get_global_id(0); i <= n; i += grid_size)\n"
+        "        rptr[i] = ptr[n + i] - ptr[n];\n"
+        "}\n"
+        "kernel void split(\n"
+        "    size_type nu, size_type nloc, ulong cmask, col_t xbeg,\n"
+        "    global const ulong *ukey,\n"
+        "    global const real  *uval,\n"
+        "    global col_t *lcol,\n"
+        "    global val_t *lval,\n"
+        "    global col_t *rcol,\n"
+        "    global val_t *rval\n"
+        "    )\n"
+        "{\n"
+        "    size_t grid_size = get_global_size(0);\n"
+        "    for(size_t i = get_global_id(0); i < nu; i += grid_size) {\n"
+        "        col_t c = (col_t)(ukey[i] & cmask);\n"
+        "        if (i < nloc) {\n"
+        "            lcol[i] = c - xbeg;\n"
+        "            " << element_access<val_t>::store("lval", "i",
+                "(" + type_name<stored_type>() + ")(uval[i])") << "\n"
+        "        } else {\n"
+        "            rcol[i - nloc] = c;\n"
+        "            " << element_access<val_t>::store("rval", "i - nloc",
+                "(" + type_name<stored_type>() + ")(uval[i])") << "\n"
+        "        }\n"
+        "    }\n"
+        "}\n"
+        // Position of each remote column in the sorted ghost columns.
+        "kernel void renumber(\n"
+        "    size_type n, size_type ng,\n"
+        "    global const col_t *ghost,\n"
+        "    global col_t *col\n"
+        "    )\n"
+        "{\n"
+        "    size_t grid_size = get_global_size(0);\n"
+        "    for(size_t i = get_global_id(0); i < n; i += grid_size) {\n"
+        "        col_t  c  = col[i];\n"
+        "        size_t lo = 0, hi = ng;\n"
+        "        while(lo < hi) {\n"
+        "            size_t mid = (lo + hi) / 2;\n"
+        "            if (ghost[mid] < c) lo = mid + 1; else hi = mid;\n"
+        "        }\n"
+        "        col[i] = lo;\n"
+        "    }\n"
+        "}\n";
+
+    auto program = build_sources(qctx(queue), source.str());
+
+    coo_kernels k;
+
+    k.products    = cl::Kernel(program, "products");
+    k.expand      = cl::Kernel(program, "expand");
+    k.keys        = cl::Kernel(program, "keys");
+    k.key_heads   = cl::Kernel(program, "key_heads");
+    k.col_heads   = cl::Kernel(program, "col_heads");
+    k.compress    = cl::Kernel(program, "compress");
+    k.rows        = cl::Kernel(program, "rows");
+    k.remote_rows = cl::Kernel(program, "remote_rows");
+    k.split       = cl::Kernel(program, "split");
+    k.renumber    = cl::Kernel(program, "renumber");
+
+    cl::Device device = qdev(queue);
+
+    k.wgsize = kernel_workgroup_size(k.keys, device);
+
+    cl::Kernel *other[] = {&k.key_heads, &k.col_heads, &k.compress, &k.rows,
+        &k.remote_rows, &k.split, &k.renumber, &k.products, &k.expand};
+    for(int i = 0; i < 9; i++)
+        k.wgsize = std::min<uint>(k.wgsize, kernel_workgroup_size(*other[i], device));
+
+    return kernel_cache<>::insert(queue, k);
+}
+
+template <typename real, typename column_t, typename idx_t, typename val_t>
+typename SpMat<real,column_t,idx_t,val_t>::device_strip
+SpMat<real,column_t,idx_t,val_t>::assemble_strip(
+        const cl::CommandQueue &queue,
+        size_t beg, size_t end, column_t xbeg, column_t xend, size_t m,
+        size_t nnz, const column_t *row, const column_t *col, const real *val
+        )
+{
+    cl::Buffer trow, tcol, tval;
+
+    if (nnz) {
+        cl::Context context = qctx(queue);
+
+        trow = memory_pool<>::create("spmat", context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                nnz * sizeof(column_t), const_cast<column_t*>(row));
+        tcol = memory_pool<>::create("spmat", context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                nnz * sizeof(column_t), const_cast<column_t*>(col));
+        tval = memory_pool<>::create("spmat", context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                nnz * sizeof(real), const_cast<real*>(val));
+    }
+
+    return compress_strip(queue, beg, end, xbeg, xend, m, nnz, trow, tcol, tval);
+}
+
+template <typename real, typename column_t, typename idx_t, typename val_t>
+typename SpMat<real,column_t,idx_t,val_t>::device_strip
+SpMat<real,column_t,idx_t,val_t>::compress_strip(
+        const cl::CommandQueue &queue,
+        size_t beg, size_t end, column_t xbeg, column_t xend, size_t m,
+        size_t nnz, cl::Buffer &row, cl::Buffer &col, cl::Buffer &val
+        )
+{
+    const size_t n = end - beg;
+
+    device_strip s;
+    s.nnz     = 0;
+    s.has_loc = false;
+    s.has_rem = false;
+    s.row.assign(n + 1, 0);
+
+    cl::Context context = qctx(queue);
+
+    s.lrow = memory_pool<>::create("spmat", context, CL_MEM_READ_WRITE, (n + 1) * sizeof(idx_t));
+
+    if (!nnz) {
+        queue.enqueueWriteBuffer(s.lrow, CL_TRUE, 0, bytes(s.row), s.row.data());
+        return s;
+    }
+
+    const cl_uint rbits = coo_bits(n), cbits = coo_bits(m);
+
+    std::vector<cl::CommandQueue> q(1, queue);
+
+    auto krn = get_coo_kernels(queue);
+
+    auto launch = [&](const cl::Kernel &k, size_t count) {
+        queue.enqueueNDRangeKernel(k, cl::NullRange,
+                alignup(count, krn->wgsize), krn->wgsize,
+                0, event_trace<>::kernel(queue, k));
+    };
+
+    // Sorted keys and values of the unique triplets.
+    size_t nu;
+    vector<cl_ulong> ukey;
+    vector<real>     uval;
+
+    {
+        vector<cl_ulong> key(q, nnz);
+
+        {
+            uint pos = 0;
+            krn->keys.setArg(pos++, nnz);
+            krn->keys.setArg(pos++, static_cast<cl_ulong>(beg));
+            krn->keys.setArg(pos++, xbeg);
+            krn->keys.setArg(pos++, xend);
+            krn->keys.setArg(pos++, cbits);
+            krn->keys.setArg(pos++, rbits);
+            krn->keys.setArg(pos++, row);
+            krn->keys.setArg(pos++, col);
+            krn->keys.setArg(pos++, key(0));
+
+            launch(krn->keys, nnz);
+
+            // The keys hold the rows and the columns from now on.
+            row = cl::Buffer();
+            col = cl::Buffer();
+        }
+
+        {
+            cl::Buffer k = key(0);
+            radix_sort<cl_ulong, real>(queue, k, val, nnz, 1 + rbits + cbits);
+        }
+
+        vector<cl_uint> head(q, nnz);
+        vector<idx_t>   upos(q, nnz);
+
+        uint pos = 0;
+        krn->key_heads.setArg(pos++, nnz);
+        krn->key_heads.setArg(pos++, key(0));
+        krn->key_heads.setArg(pos++, head(0));
+
+        launch(krn->key_heads, nnz);
+
+        inclusive_scan(head, upos);
+
+        idx_t last;
+        queue.enqueueReadBuffer(upos(0), CL_TRUE,
+                (nnz - 1) * sizeof(idx_t), sizeof(idx_t), &last);
+        nu = last;
+
+        ukey.resize(q, nu);
+        uval.resize(q, nu);
+
+        pos = 0;
+        krn->compress.setArg(pos++, nnz);
+        krn->compress.setArg(pos++, key(0));
+        krn->compress.setArg(pos++, val);
+        krn->compress.setArg(pos++, head(0));
+        krn->compress.setArg(pos++, upos(0));
+        krn->compress.setArg(pos++, ukey(0));
+        krn->compress.setArg(pos++, uval(0));
+
+        launch(krn->compress, nnz);
+
+        val = cl::Buffer();
+    }
+
+    // Row pointers of the local part, then of the remote part.
+    vector<idx_t> ptr(q, 2 * n + 1);
+
+    uint pos = 0;
+    krn->rows.setArg(pos++, nu);
+    krn->rows.setArg(pos++, n);
+    krn->rows.setArg(pos++, cbits);
+    krn->rows.setArg(pos++, rbits);
+    krn->rows.setArg(pos++, ukey(0));
+    krn->rows.setArg(pos++, ptr(0));
+
+    launch(krn->rows, nu + 1);
+
+    idx_t nloc;
+    queue.enqueueReadBuffer(ptr(0), CL_TRUE, n * sizeof(idx_t), sizeof(idx_t), &nloc);
+
+    size_t nrem = nu - nloc;
+
+    queue.enqueueCopyBuffer(ptr(0), s.lrow, 0, 0, (n + 1) * sizeof(idx_t));
+
+    s.lcol = memory_pool<>::create("spmat",
+            context, CL_MEM_READ_WRITE, std::max<size_t>(nloc, 1) * sizeof(column_t));
+    s.lval = memory_pool<>::create("spmat",
+            context, CL_MEM_READ_WRITE, std::max<size_t>(nloc, 1) * sizeof(val_t));
+
+    if (nrem) {
+        s.rrow = memory_pool<>::create("spmat",
+                context, CL_MEM_READ_WRITE, (n + 1) * sizeof(idx_t));
+        s.rcol = memory_pool<>::create("spmat",
+                context, CL_MEM_READ_WRITE, nrem * sizeof(column_t));
+        s.rval = memory_pool<>::create("spmat", context, CL_MEM_READ_WRITE, nrem * sizeof(val_t));
+
+        pos = 0;
+        krn->remote_rows.setArg(pos++, n);
+        krn->remote_rows.setArg(pos++, ptr(0));
+        krn->remote_rows.setArg(pos++, s.rrow);
+
+        launch(krn->remote_rows, n + 1);
+    }
+
+    pos = 0;
+    krn->split.setArg(pos++, nu);
+    krn->split.setArg(pos++, static_cast<size_t>(nloc));
+    krn->split.setArg(pos++, (static_cast<cl_ulong>(1) << cbits) - 1);
+    krn->split.setArg(pos++, xbeg);
+    krn->split.setArg(pos++, ukey(0));
+    krn->split.setArg(pos++, uval(0));
+    krn->split.setArg(pos++, s.lcol);
+    krn->split.setArg(pos++, s.lval);
+    krn->split.setArg(pos++, nrem ? s.rcol : s.lcol);
+    krn->split.setArg(pos++, nrem ? s.rval : s.lval);
+
+    launch(krn->split, nu);
+
+    // Ghost columns: the sorted unique remote columns.
+    if (nrem) {
+        vector<column_t> gcol(q, nrem), ghost(q, nrem);
+        vector<cl_uint>  head(q, nrem);
+
+        queue.enqueueCopyBuffer(s.rcol, gcol(0), 0, 0, nrem * sizeof(column_t));
+
+        {
+            cl::Buffer g = gcol(0);
+            radix_sort<column_t>(queue, g, nrem);
+        }
+
+        pos = 0;
+        krn->col_heads.setArg(pos++, nrem);
+        krn->col_heads.setArg(pos++, gcol(0));
+        krn->col_heads.setArg(pos++, head(0));
+
+        launch(krn->col_heads, nrem);
+
+        size_t ng = copy_if(gcol, head, ghost);
+
+        s.remote_cols.resize(ng);
+        queue.enqueueReadBuffer(ghost(0), CL_TRUE, 0, bytes(s.remote_cols),
+                s.remote_cols.data());
+
+        pos = 0;
+        krn->renumber.setArg(pos++, nrem);
+        krn->renumber.setArg(pos++, ng);
+        krn->renumber.setArg(pos++, ghost(0));
+        krn->renumber.setArg(pos++, s.rcol);
+
+        launch(krn->renumber, nrem);
+    }
+
+    queue.enqueueReadBuffer(s.lrow, CL_TRUE, 0, bytes(s.row), s.row.data());
+
+    s.nnz     = nu;
+    s.has_loc = nloc > 0;
+    s.has_rem = nrem > 0;
+
+    return s;
+}
+
+template <typename real, typename column_t, typename idx_t, typename val_t>
+void SpMat<real,column_t,idx_t,val_t>::mul(const vex::vector<real> &x, vex::vector<real> &y,
+        real alpha, bool append) const
+{
+    hazard_guard guard(queue);
+    guard.reads(x).writes(y).begin();
+
+    if (rx.size()) {
+        // Host staging and device send buffers are reused, so ghost values
+        // of the previous multiplication should be delivered by now.
+        if (exchange_pending)
+            for(uint d = 0; d < queue.size(); d++)
+                if (!exc[d].sources.empty()) event3[d][0].wait();
+
+        // Transfer remote parts of the input vector.
+        for(uint d = 0; d < queue.size(); d++) {
+            if (size_t ncols = cidx[d + 1] - cidx[d]) {
+                const gather_kernel &krn = *gather_vals_to_send[d];
+
+                size_t g_size = alignup(ncols, krn.wgsize);
+
+                uint pos = 0;
+                krn.kernel.setArg(pos++, ncols);
+                krn.kernel.setArg(pos++, x(d));
+                krn.kernel.setArg(pos++, exc[d].cols_to_send);
+                krn.kernel.setArg(pos++, exc[d].vals_to_send);
+
+                queue[d].enqueueNDRangeKernel(krn.kernel,
+                        cl::NullRange, g_size, krn.wgsize, 0, &event1[d][0]);
+                event_trace<>::add(queue[d], krn.kernel, event1[d][0]);
+
+                squeue[d].enqueueReadBuffer(exc[d].vals_to_send, CL_FALSE,
+                        0, ncols * sizeof(real), &rx[cidx[d]], &event1[d], &event2[d][0]
+                        );
+                event_trace<>::add(squeue[d], "ghost_read", event2[d][0]);
+            }
+        }
+    }
+
+    // Compute contribution from local part of the matrix.
+    for(uint d = 0; d < queue.size(); d++) {
+        if (!mtx[d]) continue;
+
+        if (profiling[d]) queue[d].enqueueMarker(&marker[d][0]);
+        mtx[d]->mul_local(x(d), y(d), alpha, append);
+        if (profiling[d]) queue[d].enqueueMarker(&marker[d][1]);
+    }
+
+    // Compute contribution from remote part of the matrix. Nothing here
+    // blocks the host: ghost values are copied directly between devices
+    // sharing a context, and otherwise are written from the host staging
+    // buffer as soon as the owning device has read them back. Ghost values
+    // are then gathered on the device.
+    if (rx.size()) {
+        for(uint d = 0; d < queue.size(); d++) {
+            if (exc[d].sources.empty()) continue;
+
+            cl::Context context = qctx(queue[d]);
+
+            recv_event[d].clear();
+
+            for(auto s = exc[d].sources.begin(); s != exc[d].sources.end(); s++) {
+                size_t offset = cidx[*s] * sizeof(real);
+                size_t size   = (cidx[*s + 1] - cidx[*s]) * sizeof(real);
+
+                cl::Event e;
+
+                if (qctx(queue[*s])() == context()) {
+                    squeue[d].enqueueCopyBuffer(exc[*s].vals_to_send, exc[d].ghosts,
+                            0, offset, size, &event1[*s], &e);
+                } else {
+                    cl::UserEvent ready(context);
+
+                    clRetainEvent(ready());
+                    event2[*s][0].setCallback(CL_COMPLETE, &ghosts_ready, ready());
+
+                    std::vector<cl::Event> wait(1, ready);
+                    squeue[d].enqueueWriteBuffer(exc[d].ghosts, CL_FALSE,
+                            offset, size, &rx[cidx[*s]], &wait, &e);
+                }
+
+                event_trace<>::add(squeue[d], "ghost_write", e);
+                recv_event[d].push_back(e);
+            }
+
+            const gather_kernel &krn = *gather_vals_to_send[d];
+
+            size_t nrecv  = exc[d].cols_to_recv.size();
+            size_t g_size = alignup(nrecv, krn.wgsize);
+
+            uint pos = 0;
+            krn.kernel.setArg(pos++, nrecv);
+            krn.kernel.setArg(pos++, exc[d].ghosts);
+            krn.kernel.setArg(pos++, exc[d].recv_cols);
+            krn.kernel.setArg(pos++, exc[d].rx);
+
+            squeue[d].enqueueNDRangeKernel(krn.kernel,
+                    cl::NullRange, g_size, krn.wgsize, &recv_event[d], &event3[d][0]);
+            event_trace<>::add(squeue[d], krn.kernel, event3[d][0]);
+
+            mtx[d]->mul_remote(exc[d].rx, y(d), alpha, event3[d]);
 
-            void mul_local(
-                    const cl::Buffer &x, const cl::Buffer &y,
-                    real alpha, bool append
-                    ) const;
+            if (profiling[d]) queue[d].enqueueMarker(&marker[d][2]);
+        }
 
-            void mul_remote(
-                    const cl::Buffer &x, const cl::Buffer &y,
-                    real alpha, const std::vector<cl::Event> &event
-                    ) const;
+        exchange_pending = true;
+    }
 
-            const cl::CommandQueue &queue;
+    guard.end();
+}
 
-            size_t n;
+template <typename real, typename column_t, typename idx_t, typename val_t>
+const uint SpMat<real,column_t,idx_t,val_t>::block_width;
 
-            bool has_loc;
-            bool has_rem;
+template <typename real, typename column_t, typename idx_t, typename val_t>
+void SpMat<real,column_t,idx_t,val_t>::mul_block(
+        const std::vector<const vex::vector<real>*> &x,
+        const std::vector<vex::vector<real>*> &y,
+        real alpha, bool append) const
+{
+    if (x.size() != y.size())
+        throw std::invalid_argument("Block sizes of x and y differ in SpMat::mul_block");
 
-            struct {
-                cl::Buffer row;
-                cl::Buffer col;
-                cl::Buffer val;
-            } loc, rem;
+    // The ghost exchange buffers hold values of a single vector.
+    if (rx.size()) {
+        for(size_t i = 0; i < x.size(); i++)
+            mul(*x[i], *y[i], alpha, append);
+        return;
+    }
 
-            static std::map<cl_context, bool>       compiled;
-            static std::map<cl_context, cl::Kernel> zero;
-            static std::map<cl_context, cl::Kernel> spmv_set;
-            static std::map<cl_context, cl::Kernel> spmv_add;
-            static std::map<cl_context, uint>       wgsize;
-        };
+    std::vector<cl::Buffer> xb(x.size()), yb(y.size());
 
-        struct exdata {
-            std::vector<column_t> cols_to_recv;
-            mutable std::vector<real> vals_to_recv;
+    hazard_guard guard(queue);
+    for(size_t i = 0; i < x.size(); i++) guard.reads(*x[i]).writes(*y[i]);
+    guard.begin();
 
-            cl::Buffer cols_to_send;
-            cl::Buffer vals_to_send;
-            mutable cl::Buffer rx;
-        };
+    for(uint d = 0; d < queue.size(); d++) {
+        if (!mtx[d]) continue;
 
-        const std::vector<cl::CommandQueue> queue;
-        std::vector<cl::CommandQueue>       squeue;
-        const std::vector<size_t>           part;
+        for(size_t i = 0; i < x.size(); i++) {
+            xb[i] = (*x[i])(d);
+            yb[i] = (*y[i])(d);
+        }
 
-        mutable std::vector<std::vector<cl::Event>> event1;
-        mutable std::vector<std::vector<cl::Event>> event2;
+        if (profiling[d]) queue[d].enqueueMarker(&marker[d][0]);
+        mtx[d]->mul_local_block(xb, yb, alpha, append);
+        if (profiling[d]) queue[d].enqueueMarker(&marker[d][1]);
+    }
 
-        std::vector<std::unique_ptr<sparse_matrix>> mtx;
+    guard.end();
+}
 
-        std::vector<exdata> exc;
-        std::vector<size_t> cidx;
-        mutable std::vector<real> rx;
+template <typename real, typename column_t, typename idx_t, typename val_t>
+std::shared_ptr<typename SpMat<real,column_t,idx_t,val_t>::block_kernels>
+SpMat<real,column_t,idx_t,val_t>::get_block_kernels(
+        const cl::CommandQueue &queue, uint width)
+{
+    std::ostringstream sig;
+    sig << width;
 
-        size_t nrows;
-        size_t ncols;
-        size_t nnz;
+    std::shared_ptr<block_kernels> krn =
+        kernel_cache<>::find<block_kernels>(queue, sig.str());
 
+    if (krn) return krn;
 
-        static std::map<cl_context, bool>       compiled;
-        static std::map<cl_context, cl::Kernel> gather_vals_to_send;
-        static std::map<cl_context, uint>       wgsize;
+    std::ostringstream source, xargs, yargs, decl, acc;
 
-        std::vector<std::set<column_t>> setup_exchange(
-                size_t n, const std::vector<size_t> &xpart,
-                const idx_t *row, const column_t *col, const real *val
-                );
-};
+    for(uint k = 0; k < width; k++) {
+        xargs << ",\n    global const real * restrict x" << k;
+        yargs << ",\n    global real *y" << k;
+        decl  << "        real s" << k << " = 0;\n";
+        acc   << " s" << k << " += v * x" << k << "[c];";
+    }
 
-template <typename real, typename column_t, typename idx_t>
-std::map<cl_context, bool> SpMat<real,column_t,idx_t>::compiled;
+    source << standard_kernel_header <<
+        "typedef " << type_name<real>() << " real;\n"
+        "#define VAL(i) " << spmat_load<val_t>("val", "(i)") << "\n"
+        "#define NCOL ((" << type_name<column_t>() << ")(-1))\n";
 
-template <typename real, typename column_t, typename idx_t>
-std::map<cl_context, cl::Kernel> SpMat<real,column_t,idx_t>::gather_vals_to_send;
+    for(int append = 0; append < 2; append++) {
+        const char *op = append ? " += " : " = ";
 
-template <typename real, typename column_t, typename idx_t>
-std::map<cl_context, uint> SpMat<real,column_t,idx_t>::wgsize;
+        std::ostringstream store;
+        for(uint k = 0; k < width; k++)
+            store << "        y" << k << "[row]" << op << "alpha * s" << k << ";\n";
 
-template <typename real, typename column_t, typename idx_t>
-SpMat<real,column_t,idx_t>::SpMat(
-        const std::vector<cl::CommandQueue> &queue,
-        size_t n, size_t m, const idx_t *row, const column_t *col, const real *val
-        )
-    : queue(queue), part(partition(n, queue)),
-      event1(queue.size(), std::vector<cl::Event>(1)),
-      event2(queue.size(), std::vector<cl::Event>(1)),
-      mtx(queue.size()), exc(queue.size()),
-      nrows(n), ncols(m), nnz(row[n])
-{
-    auto xpart = partition(m, queue);
+        source <<
+            "kernel void ell_" << (append ? "add" : "set") << "(\n"
+            "    " << type_name<size_t>() << " n, uint w, " << type_name<size_t>() << " pitch,\n"
+            "    global const " << type_name<column_t>() << " *col,\n"
+            "    global const " << type_name<val_t>() << " *val,\n"
+            "    real alpha" << xargs.str() << yargs.str() << "\n"
+            "    )\n"
+            "{\n"
+            "    size_t grid_size = get_global_size(0);\n"
+            "    for(size_t row = get_global_id(0); row < n; row += grid_size) {\n"
+            << decl.str() <<
+            "        for(size_t j = 0; j < w; j++) {\n"
+            "            " << type_name<column_t>() << " c = col[row + j * pitch];\n"
+            "            if (c != NCOL) { real v = VAL(row + j * pitch);" << acc.str() << " }\n"
+            "        }\n"
+            << store.str() <<
+            "    }\n"
+            "}\n"
+            "kernel void csr_" << (append ? "add" : "set") << "(\n"
+            "    " << type_name<size_t>() << " n,\n"
+            "    global const " << type_name<idx_t>() << " *ptr,\n"
+            "    global const " << type_name<column_t>() << " *col,\n"
+            "    global const " << type_name<val_t>() << " *val,\n"
+            "    real alpha" << xargs.str() << yargs.str() << "\n"
+            "    )\n"
+            "{\n"
+            "    size_t grid_size = get_global_size(0);\n"
+            "    for(size_t row = get_global_id(0); row < n; row += grid_size) {\n"
+            << decl.str() <<
+            "        size_t end = ptr[row + 1];\n"
+            "        for(size_t j = ptr[row]; j < end; j++) {\n"
+            "            " << type_name<column_t>() << " c = col[j];\n"
+            "            real v = VAL(j);" << acc.str() << "\n"
+            "        }\n"
+            << store.str() <<
+            "    }\n"
+            "}\n";
+    }
 
-    for(auto q = queue.begin(); q != queue.end(); q++) {
-        cl::Context context = qctx(*q);
-        cl::Device  device  = qdev(*q);
+    // CSR tail of the hybrid format: rows are given explicitly.
+    source <<
+        "kernel void tail_add(\n"
+        "    " << type_name<size_t>() << " n,\n"
+        "    global const " << type_name<idx_t>() << " *idx,\n"
+        "    global const " << type_name<column_t>() << " *rows,\n"
+        "    global const " << type_name<column_t>() << " *col,\n"
+        "    global const " << type_name<val_t>() << " *val,\n"
+        "    real alpha" << xargs.str() << yargs.str() << "\n"
+        "    )\n"
+        "{\n"
+        "    size_t grid_size = get_global_size(0);\n"
+        "    for(size_t i = get_global_id(0); i < n; i += grid_size) {\n"
+        << decl.str() <<
+        "        size_t end = idx[i + 1];\n"
+        "        for(size_t j = idx[i]; j < end; j++) {\n"
+        "            " << type_name<column_t>() << " c = col[j];\n"
+        "            real v = VAL(j);" << acc.str() << "\n"
+        "        }\n"
+        "        size_t row = rows[i];\n";
+    for(uint k = 0; k < width; k++)
+        source << "        y" << k << "[row] += alpha * s" << k << ";\n";
+    source <<
+        "    }\n"
+        "}\n";
+
+    auto program = build_sources(qctx(queue), source.str());
+
+    block_kernels k;
+
+    k.ell_set  = cl::Kernel(program, "ell_set");
+    k.ell_add  = cl::Kernel(program, "ell_add");
+    k.tail_add = cl::Kernel(program, "tail_add");
+    k.csr_set  = cl::Kernel(program, "csr_set");
+    k.csr_add  = cl::Kernel(program, "csr_add");
+
+    cl::Device device = qdev(queue);
+
+    k.wgsize = kernel_workgroup_size(k.ell_set, device);
+
+    cl::Kernel *other[] = {&k.ell_add, &k.tail_add, &k.csr_set, &k.csr_add};
+    for(int i = 0; i < 4; i++)
+        k.wgsize = std::min<uint>(k.wgsize, kernel_workgroup_size(*other[i], device));
+
+    return kernel_cache<>::insert(queue, k, sig.str());
+}
 
-        // Compile kernels.
-        if (!compiled[context()]) {
-            std::ostringstream source;
+template <typename real, typename column_t, typename idx_t, typename val_t>
+void SpMat<real,column_t,idx_t,val_t>::set_block_args(cl::Kernel &k, uint pos,
+        const std::vector<cl::Buffer> &x, const std::vector<cl::Buffer> &y,
+        size_t first, uint width)
+{
+    for(uint i = 0; i < width; i++) k.setArg(pos++, x[first + i]);
+    for(uint i = 0; i < width; i++) k.setArg(pos++, y[first + i]);
+}
 
-            source << standard_kernel_header <<
-                "typedef " << type_name<real>() << " real;\n"
-                "kernel void gather_vals_to_send(\n"
-                "    " << type_name<size_t>() << " n,\n"
-                "    global const real *vals,\n"
-                "    global const " << type_name<column_t>() << " *cols_to_send,\n"
-                "    global real *vals_to_send\n"
-                "    )\n"
-                "{\n"
-                "    size_t i = get_global_id(0);\n"
-                "    if (i < n) vals_to_send[i] = vals[cols_to_send[i]];\n"
-                "}\n";
+template <typename real, typename column_t, typename idx_t, typename val_t>
+void SpMat<real,column_t,idx_t,val_t>::mul_transposed(
+        const vex::vector<real> &x, vex::vector<real> &y,
+        real alpha, bool append) const
+{
+    hazard_guard guard(queue);
+    guard.reads(x).writes(y).begin();
 
-            auto program = build_sources(context, source.str());
+    // Ghost buffers and the host staging buffer are reused.
+    if (exchange_pending) {
+        for(uint d = 0; d < queue.size(); d++)
+            if (!exc[d].sources.empty()) event3[d][0].wait();
+        exchange_pending = false;
+    }
 
-            gather_vals_to_send[context()] = cl::Kernel(program, "gather_vals_to_send");
+    for(uint d = 0; d < queue.size(); d++) {
+        std::shared_ptr<transposed_kernels> k = get_transposed_kernels(queue[d]);
 
-            wgsize[context()] = kernel_workgroup_size(
-                    gather_vals_to_send[context()], device
-                    );
+        size_t nloc  = y.part_size(d);
+        size_t nrecv = exc[d].cols_to_recv.size();
 
-            compiled[context()] = true;
+        if (nloc && !append) {
+            k->zero.setArg(0, nloc);
+            k->zero.setArg(1, y(d));
+            queue[d].enqueueNDRangeKernel(k->zero, cl::NullRange, k->g_size, k->wgsize,
+                    0, event_trace<>::kernel(queue[d], k->zero));
         }
 
-        // Create secondary queues.
-        squeue.push_back(cl::CommandQueue(context, device));
+        if (nrecv) {
+            k->zero.setArg(0, nrecv);
+            k->zero.setArg(1, exc[d].rx);
+            queue[d].enqueueNDRangeKernel(k->zero, cl::NullRange, k->g_size, k->wgsize,
+                    0, event_trace<>::kernel(queue[d], k->zero));
+        }
+
+        if (mtx[d]) mtx[d]->mul_transposed(*k, x(d), y(d), exc[d].rx, alpha);
     }
 
-    std::vector<std::set<column_t>> remote_cols = setup_exchange(n, xpart, row, col, val);
+    if (rx.size()) {
+        // Sums of the ghosts of all devices, in the order of the exchange.
+        std::vector<cl::Event> event(queue.size());
 
-    // Each device get it's own strip of the matrix.
-#pragma omp parallel for schedule(static,1)
-    for(int d = 0; d < static_cast<int>(queue.size()); d++) {
-        if (part[d + 1] > part[d]) {
-            cl::Device device = qdev(queue[d]);
+        tx.resize(queue.size());
 
-            if (device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU)
-                mtx[d].reset(
-                        new SpMatCSR(queue[d],
-                            part[d], part[d + 1],
-                            xpart[d], xpart[d + 1],
-                            row, col, val, remote_cols[d])
-                        );
-            else
-                mtx[d].reset(
-                        new SpMatELL(queue[d],
-                            part[d], part[d + 1],
-                            xpart[d], xpart[d + 1],
-                            row, col, val, remote_cols[d])
-                        );
+        for(uint d = 0; d < queue.size(); d++) {
+            if (size_t nrecv = exc[d].cols_to_recv.size()) {
+                tx[d].resize(nrecv);
+                queue[d].enqueueReadBuffer(exc[d].rx, CL_FALSE, 0,
+                        nrecv * sizeof(real), tx[d].data(), 0, &event[d]);
+                event_trace<>::add(queue[d], "ghost_read", event[d]);
+            }
         }
-    }
-}
 
-template <typename real, typename column_t, typename idx_t>
-void SpMat<real,column_t,idx_t>::mul(const vex::vector<real> &x, vex::vector<real> &y,
-        real alpha, bool append) const
-{
-    if (rx.size()) {
-        // Transfer remote parts of the input vector.
+        std::fill(rx.begin(), rx.end(), static_cast<real>(0));
+
         for(uint d = 0; d < queue.size(); d++) {
-            cl::Context context = qctx(queue[d]);
+            const std::vector<column_t> &c = exc[d].cols_to_recv;
+            if (c.empty()) continue;
+
+            event[d].wait();
+            for(size_t j = 0; j < c.size(); j++) rx[c[j]] += tx[d][j];
+        }
 
+        // Owners add the sums to their columns, which are unique.
+        for(uint d = 0; d < queue.size(); d++) {
             if (size_t ncols = cidx[d + 1] - cidx[d]) {
-                size_t g_size = alignup(ncols, wgsize[context()]);
+                std::shared_ptr<transposed_kernels> k = get_transposed_kernels(queue[d]);
 
-                uint pos = 0;
-                gather_vals_to_send[context()].setArg(pos++, ncols);
-                gather_vals_to_send[context()].setArg(pos++, x(d));
-                gather_vals_to_send[context()].setArg(pos++, exc[d].cols_to_send);
-                gather_vals_to_send[context()].setArg(pos++, exc[d].vals_to_send);
+                queue[d].enqueueWriteBuffer(exc[d].vals_to_send, CL_FALSE, 0,
+                        ncols * sizeof(real), &rx[cidx[d]], 0, &event[d]);
+                event_trace<>::add(queue[d], "ghost_write", event[d]);
 
-                queue[d].enqueueNDRangeKernel(gather_vals_to_send[context()],
-                        cl::NullRange, g_size, wgsize[context()], 0, &event1[d][0]);
+                uint pos = 0;
+                k->scatter.setArg(pos++, ncols);
+                k->scatter.setArg(pos++, exc[d].cols_to_send);
+                k->scatter.setArg(pos++, exc[d].vals_to_send);
+                k->scatter.setArg(pos++, y(d));
 
-                squeue[d].enqueueReadBuffer(exc[d].vals_to_send, CL_FALSE,
-                        0, ncols * sizeof(real), &rx[cidx[d]], &event1[d], &event2[d][0]
-                        );
+                queue[d].enqueueNDRangeKernel(k->scatter, cl::NullRange, k->g_size, k->wgsize,
+                        0, event_trace<>::kernel(queue[d], k->scatter));
             }
         }
+
+        // The staging buffer is free once written.
+        for(uint d = 0; d < queue.size(); d++)
+            if (cidx[d + 1] > cidx[d]) event[d].wait();
     }
 
-    // Compute contribution from local part of the matrix.
-    for(uint d = 0; d < queue.size(); d++)
-        if (mtx[d]) mtx[d]->mul_local(x(d), y(d), alpha, append);
+    guard.end();
+}
 
-    // Compute contribution from remote part of the matrix.
-    if (rx.size()) {
-        for(uint d = 0; d < queue.size(); d++)
-            if (cidx[d + 1] > cidx[d]) event2[d][0].wait();
+template <typename real, typename column_t, typename idx_t, typename val_t>
+std::shared_ptr<typename SpMat<real,column_t,idx_t,val_t>::transposed_kernels>
+SpMat<real,column_t,idx_t,val_t>::get_transposed_kernels(const cl::CommandQueue &queue)
+{
+    std::shared_ptr<transposed_kernels> krn =
+        kernel_cache<>::find<transposed_kernels>(queue);
+
+    if (krn) return krn;
+
+    static_assert(sizeof(real) == 4 || sizeof(real) == 8,
+            "Transposed product needs 32 or 64-bit values");
+
+    cl::Device device = qdev(queue);
+
+    const bool wide = sizeof(real) == 8;
+
+    if (wide && device.getInfo<CL_DEVICE_EXTENSIONS>().find(
+                "cl_khr_int64_base_atomics") == std::string::npos)
+        throw std::runtime_error(
+                "SpMat: transposed product in double precision needs cl_khr_int64_base_atomics");
+
+    std::ostringstream source;
+
+    source << standard_kernel_header;
+
+    if (wide) source <<
+        "#pragma OPENCL EXTENSION cl_khr_int64_base_atomics: enable\n";
+
+    source <<
+        "typedef " << type_name<real>() << " real;\n"
+        "typedef " << (wide ? "ulong" : "uint") << " bits;\n"
+        "#define VAL(i) " << spmat_load<val_t>("val", "(i)") << "\n"
+        "#define NCOL ((" << type_name<column_t>() << ")(-1))\n"
+        "void atomic_add_real(global real *p, real v) {\n"
+        "    union { real r; bits b; } old, sum;\n"
+        "    do {\n"
+        "        old.r = *p;\n"
+        "        sum.r = old.r + v;\n"
+        "    } while(" << (wide ? "atom_cmpxchg" : "atomic_cmpxchg") <<
+        "((volatile global bits*)p, old.b, sum.b) != old.b);\n"
+        "}\n"
+        "kernel void zero(\n"
+        "    " << type_name<size_t>() << " n,\n"
+        "    global real *y\n"
+        "    )\n"
+        "{\n"
+        "    size_t grid_size = get_global_size(0);\n"
+        "    for(size_t i = get_global_id(0); i < n; i += grid_size) y[i] = 0;\n"
+        "}\n"
+        "kernel void csr(\n"
+        "    " << type_name<size_t>() << " n,\n"
+        "    global const " << type_name<idx_t>() << " *row,\n"
+        "    global const " << type_name<column_t>() << " *col,\n"
+        "    global const " << type_name<val_t>() << " *val,\n"
+        "    global const real * restrict x,\n"
+        "    global real *y,\n"
+        "    real alpha\n"
+        "    )\n"
+        "{\n"
+        "    size_t grid_size = get_global_size(0);\n"
+        "    for(size_t i = get_global_id(0); i < n; i += grid_size) {\n"
+        "        real a = alpha * x[i];\n"
+        "        if (a == 0) continue;\n"
+        "        size_t end = row[i + 1];\n"
+        "        for(size_t j = row[i]; j < end; j++)\n"
+        "            atomic_add_real(y + col[j], VAL(j) * a);\n"
+        "    }\n"
+        "}\n"
+        "kernel void ell(\n"
+        "    " << type_name<size_t>() << " n, uint w, " << type_name<size_t>() << " pitch,\n"
+        "    global const " << type_name<column_t>() << " *col,\n"
+        "    global const " << type_name<val_t>() << " *val,\n"
+        "    global const real * restrict x,\n"
+        "    global real *y,\n"
+        "    real alpha\n"
+        "    )\n"
+        "{\n"
+        "    size_t grid_size = get_global_size(0);\n"
+        "    for(size_t i = get_global_id(0); i < n; i += grid_size) {\n"
+        "        real a = alpha * x[i];\n"
+        "        if (a == 0) continue;\n"
+        "        for(size_t j = 0; j < w; j++) {\n"
+        "            " << type_name<column_t>() << " c = col[i + j * pitch];\n"
+        "            if (c != NCOL) atomic_add_real(y + c, VAL(i + j * pitch) * a);\n"
+        "        }\n"
+        "    }\n"
+        "}\n"
+        "kernel void tail(\n"
+        "    " << type_name<size_t>() << " n,\n"
+        "    global const " << type_name<idx_t>() << " *idx,\n"
+        "    global const " << type_name<column_t>() << " *rows,\n"
+        "    global const " << type_name<column_t>() << " *col,\n"
+        "    global const " << type_name<val_t>() << " *val,\n"
+        "    global const real * restrict x,\n"
+        "    global real *y,\n"
+        "    real alpha\n"
+        "    )\n"
+        "{\n"
+        "    size_t grid_size = get_global_size(0);\n"
+        "    for(size_t i = get_global_id(0); i < n; i += grid_size) {\n"
+        "        real a = alpha * x[rows[i]];\n"
+        "        if (a == 0) continue;\n"
+        "        size_t end = idx[i + 1];\n"
+        "        for(size_t j = idx[i]; j < end; j++)\n"
+        "            atomic_add_real(y + col[j], VAL(j) * a);\n"
+        "    }\n"
+        "}\n"
+        "kernel void sell(\n"
+        "    " << type_name<size_t>() << " n, uint C,\n"
+        "    global const " << type_name<idx_t>() << " *start,\n"
+        "    global const " << type_name<column_t>() << " *perm,\n"
+        "    global const " << type_name<column_t>() << " *col,\n"
+        "    global const " << type_name<val_t>() << " *val,\n"
+        "    global const real * restrict x,\n"
+        "    global real *y,\n"
+        "    real alpha\n"
+        "    )\n"
+        "{\n"
+        "    size_t grid_size = get_global_size(0);\n"
+        "    for(size_t i = get_global_id(0); i < n; i += grid_size) {\n"
+        "        real a = alpha * x[perm[i]];\n"
+        "        if (a == 0) continue;\n"
+        "        size_t chunk = i / C;\n"
+        "        size_t beg   = start[chunk];\n"
+        "        size_t w     = (start[chunk + 1] - beg) / C;\n"
+        "        beg += i % C;\n"
+        "        for(size_t j = 0; j < w; j++, beg += C) {\n"
+        "            " << type_name<column_t>() << " c = col[beg];\n"
+        "            if (c != NCOL) atomic_add_real(y + c, VAL(beg) * a);\n"
+        "        }\n"
+        "    }\n"
+        "}\n"
+        "kernel void scatter(\n"
+        "    " << type_name<size_t>() << " n,\n"
+        "    global const " << type_name<column_t>() << " *cols,\n"
+        "    global const real *vals,\n"
+        "    global real *y\n"
+        "    )\n"
+        "{\n"
+        "    size_t grid_size = get_global_size(0);\n"
+        "    for(size_t i = get_global_id(0); i < n; i += grid_size)\n"
+        "        y[cols[i]] += vals[i];\n"
+        "}\n";
+
+    auto program = build_sources(qctx(queue), source.str());
+
+    transposed_kernels k;
+
+    k.zero    = cl::Kernel(program, "zero");
+    k.csr     = cl::Kernel(program, "csr");
+    k.ell     = cl::Kernel(program, "ell");
+    k.tail    = cl::Kernel(program, "tail");
+    k.sell    = cl::Kernel(program, "sell");
+    k.scatter = cl::Kernel(program, "scatter");
+
+    k.wgsize = kernel_workgroup_size(k.zero, device);
+
+    cl::Kernel *other[] = {&k.csr, &k.ell, &k.tail, &k.sell, &k.scatter};
+    for(int i = 0; i < 5; i++)
+        k.wgsize = std::min<uint>(k.wgsize, kernel_workgroup_size(*other[i], device));
+
+    k.g_size = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * k.wgsize * 4;
+
+    return kernel_cache<>::insert(queue, k);
+}
 
-        for(uint d = 0; d < queue.size(); d++) {
-            cl::Context context = qctx(queue[d]);
+template <typename real, typename column_t, typename idx_t, typename val_t>
+std::vector<typename SpMat<real,column_t,idx_t,val_t>::phase_timing>
+SpMat<real,column_t,idx_t,val_t>::timing() const {
+    std::vector<phase_timing> t(queue.size());
 
-            if (exc[d].cols_to_recv.size()) {
-                for(size_t i = 0; i < exc[d].cols_to_recv.size(); i++)
-                    exc[d].vals_to_recv[i] = rx[exc[d].cols_to_recv[i]];
+    for(uint d = 0; d < queue.size(); d++) {
+        phase_timing &p = t[d];
+        p.local_end = p.exchange_begin = p.exchange_end = p.remote_end = 0;
 
-                squeue[d].enqueueWriteBuffer(
-                        exc[d].rx, CL_FALSE, 0, bytes(exc[d].vals_to_recv),
-                        exc[d].vals_to_recv.data(), 0, &event2[d][0]
-                        );
+        if (!mtx[d] || !profiling[d]) continue;
 
-                mtx[d]->mul_remote(exc[d].rx, y(d), alpha, event2[d]);
-            }
+        bool remote = rx.size() && !exc[d].sources.empty();
+
+        (remote ? marker[d][2] : marker[d][1]).wait();
+
+        cl_ulong start = marker[d][0].getProfilingInfo<CL_PROFILING_COMMAND_END>();
+
+        p.local_end = 1e-9 * (
+                marker[d][1].getProfilingInfo<CL_PROFILING_COMMAND_END>() - start);
+
+        if (remote) {
+            cl_ulong xbeg = recv_event[d][0].getProfilingInfo<CL_PROFILING_COMMAND_START>();
+            for(auto e = recv_event[d].begin(); e != recv_event[d].end(); e++)
+                xbeg = std::min(xbeg, e->getProfilingInfo<CL_PROFILING_COMMAND_START>());
+
+            p.exchange_begin = 1e-9 * (static_cast<double>(xbeg) - start);
+            p.exchange_end   = 1e-9 * (static_cast<double>(
+                        event3[d][0].getProfilingInfo<CL_PROFILING_COMMAND_END>()) - start);
+            p.remote_end     = 1e-9 * (static_cast<double>(
+                        marker[d][2].getProfilingInfo<CL_PROFILING_COMMAND_END>()) - start);
+        } else {
+            p.remote_end = p.local_end;
         }
     }
+
+    return t;
 }
 
-template <typename real, typename column_t, typename idx_t>
-std::vector<std::set<column_t>> SpMat<real,column_t,idx_t>::setup_exchange(
+template <typename real, typename column_t, typename idx_t, typename val_t>
+bool SpMat<real,column_t,idx_t,val_t>::use_sell(size_t beg, size_t end, const idx_t *row) {
+    // Same criterion as used for the ELL width in SpMatELL.
+    static const double ell_vs_csr = 3.0;
+
+    size_t nrows = end - beg;
+    size_t nnz   = row[end] - row[beg];
+    size_t wmax  = 0;
+
+    for(size_t i = beg; i < end; i++)
+        wmax = std::max<size_t>(wmax, row[i + 1] - row[i]);
+
+    // Histogram of row widths.
+    std::vector<size_t> hist(wmax + 1, 0);
+    for(size_t i = beg; i < end; i++)
+        hist[row[i + 1] - row[i]]++;
+
+    // ELL width and the number of nonzeros that do not fit into ELL part.
+    size_t w = wmax;
+    for(size_t i = 0, rows = nrows; i < wmax; i++) {
+        rows -= hist[i];
+        if (ell_vs_csr * rows < nrows) {
+            w = i;
+            break;
+        }
+    }
+
+    size_t tail = 0;
+    for(size_t i = w + 1; i <= wmax; i++)
+        tail += hist[i] * (i - w);
+
+    // SELL wins when the CSR tail of the hybrid format is significant, or
+    // when ELL padding more than doubles the storage.
+    return tail * 10 > nnz || nrows * w > 2 * (nnz - tail);
+}
+
+template <typename real, typename column_t, typename idx_t, typename val_t>
+bool SpMat<real,column_t,idx_t,val_t>::skewed(size_t beg, size_t end, const idx_t *row) {
+    // A row this much wider than the average stalls the wavefront that
+    // gets it in the ELL tail or in the vector kernel.
+    static const double max_vs_avg = 32.0;
+    static const size_t min_width  = 1024;
+
+    size_t wmax = 0;
+    for(size_t i = beg; i < end; i++)
+        wmax = std::max<size_t>(wmax, row[i + 1] - row[i]);
+
+    double avg = static_cast<double>(row[end] - row[beg]) / (end - beg);
+
+    return wmax >= min_width && wmax > max_vs_avg * avg;
+}
+
+template <typename real, typename column_t, typename idx_t, typename val_t>
+std::vector<std::vector<column_t>> SpMat<real,column_t,idx_t,val_t>::setup_exchange(
         size_t, const std::vector<size_t> &xpart,
         const idx_t *row, const column_t *col, const real *
         )
 {
-    std::vector<std::set<column_t>> remote_cols(queue.size());
+    std::vector<std::vector<column_t>> remote_cols(queue.size());
 
     if (queue.size() <= 1) return remote_cols;
 
-    // Build sets of ghost points.
+    // Build sorted lists of ghost points.
 #pragma omp parallel for schedule(static,1)
     for(int d = 0; d < static_cast<int>(queue.size()); d++) {
+        std::vector<column_t> &rc = remote_cols[d];
+
         for(size_t i = part[d]; i < part[d + 1]; i++) {
             for(idx_t j = row[i]; j < row[i + 1]; j++) {
                 if (col[j] < static_cast<column_t>(xpart[d]) || col[j] >= static_cast<column_t>(xpart[d + 1])) {
-                    remote_cols[d].insert(col[j]);
+                    rc.push_back(col[j]);
                 }
             }
         }
+
+        std::sort(rc.begin(), rc.end());
+        rc.erase(std::unique(rc.begin(), rc.end()), rc.end());
     }
 
+    build_exchange(xpart, remote_cols);
+
+    return remote_cols;
+}
+
+template <typename real, typename column_t, typename idx_t, typename val_t>
+void SpMat<real,column_t,idx_t,val_t>::build_exchange(
+        const std::vector<size_t> &xpart,
+        const std::vector<std::vector<column_t>> &remote_cols
+        )
+{
     // Complete set of points to be exchanged between devices.
     std::vector<column_t> cols_to_send;
     {
-        std::set<column_t> cols_to_send_s;
+        size_t total = 0;
+        for(uint d = 0; d < queue.size(); d++)
+            total += remote_cols[d].size();
+
+        cols_to_send.reserve(total);
+
         for(uint d = 0; d < queue.size(); d++)
-            cols_to_send_s.insert(remote_cols[d].begin(), remote_cols[d].end());
+            cols_to_send.insert(cols_to_send.end(),
+                    remote_cols[d].begin(), remote_cols[d].end());
 
-        cols_to_send.insert(cols_to_send.begin(), cols_to_send_s.begin(), cols_to_send_s.end());
+        std::sort(cols_to_send.begin(), cols_to_send.end());
+        cols_to_send.erase(
+                std::unique(cols_to_send.begin(), cols_to_send.end()),
+                cols_to_send.end());
     }
 
     // Build local structures to facilitate exchange.
@@ -520,13 +2346,25 @@ std::vector<std::set<column_t>> SpMat<real,column_t,idx_t>::setup_exchange(
 #pragma omp parallel for schedule(static,1)
         for(int d = 0; d < static_cast<int>(queue.size()); d++) {
             if (size_t rcols = remote_cols[d].size()) {
+                cl::Context context = qctx(queue[d]);
+
                 exc[d].cols_to_recv.resize(rcols);
-                exc[d].vals_to_recv.resize(rcols);
 
-                exc[d].rx = cl::Buffer(qctx(queue[d]), CL_MEM_READ_ONLY, rcols * sizeof(real));
+                exc[d].rx = memory_pool<>::create("spmat",
+                        context, CL_MEM_READ_WRITE, rcols * sizeof(real));
+
+                exc[d].ghosts = memory_pool<>::create("spmat", context, CL_MEM_READ_WRITE,
+                        cols_to_send.size() * sizeof(real));
 
-                for(size_t i = 0, j = 0; i < cols_to_send.size(); i++)
-                    if (remote_cols[d].count(cols_to_send[i])) exc[d].cols_to_recv[j++] = i;
+                // Both lists are sorted.
+                for(size_t i = 0, j = 0; j < rcols; i++)
+                    if (cols_to_send[i] == remote_cols[d][j]) exc[d].cols_to_recv[j++] = i;
+
+                exc[d].recv_cols = memory_pool<>::create("spmat",
+                        context, CL_MEM_READ_ONLY, rcols * sizeof(column_t));
+
+                queue[d].enqueueWriteBuffer(exc[d].recv_cols, CL_TRUE, 0,
+                        rcols * sizeof(column_t), exc[d].cols_to_recv.data());
             }
         }
 
@@ -542,14 +2380,24 @@ std::vector<std::set<column_t>> SpMat<real,column_t,idx_t>::setup_exchange(
             }
         }
 
+        // Find out which devices own the ghost values of each device.
+        for(uint d = 0; d < queue.size(); d++) {
+            const std::vector<column_t> &c = exc[d].cols_to_recv;
+
+            for(uint s = 0; s < queue.size(); s++)
+                if (std::lower_bound(c.begin(), c.end(), cidx[s]) !=
+                    std::lower_bound(c.begin(), c.end(), cidx[s + 1]))
+                    exc[d].sources.push_back(s);
+        }
+
         for(uint d = 0; d < queue.size(); d++) {
             if (size_t ncols = cidx[d + 1] - cidx[d]) {
                 cl::Context context = qctx(queue[d]);
 
-                exc[d].cols_to_send = cl::Buffer(
+                exc[d].cols_to_send = memory_pool<>::create("spmat",
                         context, CL_MEM_READ_ONLY, ncols * sizeof(column_t));
 
-                exc[d].vals_to_send = cl::Buffer(
+                exc[d].vals_to_send = memory_pool<>::create("spmat",
                         context, CL_MEM_READ_WRITE, ncols * sizeof(real));
 
                 for(size_t i = cidx[d]; i < cidx[d + 1]; i++)
@@ -561,40 +2409,20 @@ std::vector<std::set<column_t>> SpMat<real,column_t,idx_t>::setup_exchange(
             }
         }
     }
-
-    return remote_cols;
 }
 
 //---------------------------------------------------------------------------
 // SpMat::SpMatELL
 //---------------------------------------------------------------------------
-template <typename real, typename column_t, typename idx_t>
-const column_t SpMat<real,column_t,idx_t>::SpMatELL::ncol;
-
-template <typename real, typename column_t, typename idx_t>
-std::map<cl_context, bool> SpMat<real,column_t,idx_t>::SpMatELL::compiled;
-
-template <typename real, typename column_t, typename idx_t>
-std::map<cl_context, cl::Kernel> SpMat<real,column_t,idx_t>::SpMatELL::zero;
-
-template <typename real, typename column_t, typename idx_t>
-std::map<cl_context, cl::Kernel> SpMat<real,column_t,idx_t>::SpMatELL::spmv_set;
-
-template <typename real, typename column_t, typename idx_t>
-std::map<cl_context, cl::Kernel> SpMat<real,column_t,idx_t>::SpMatELL::spmv_add;
-
-template <typename real, typename column_t, typename idx_t>
-std::map<cl_context, cl::Kernel> SpMat<real,column_t,idx_t>::SpMatELL::csr_add;
-
-template <typename real, typename column_t, typename idx_t>
-std::map<cl_context, uint> SpMat<real,column_t,idx_t>::SpMatELL::wgsize;
+template <typename real, typename column_t, typename idx_t, typename val_t>
+const column_t SpMat<real,column_t,idx_t,val_t>::SpMatELL::ncol;
 
-template <typename real, typename column_t, typename idx_t>
-SpMat<real,column_t,idx_t>::SpMatELL::SpMatELL(
+template <typename real, typename column_t, typename idx_t, typename val_t>
+SpMat<real,column_t,idx_t,val_t>::SpMatELL::SpMatELL(
         const cl::CommandQueue &queue,
         size_t beg, size_t end, column_t xbeg, column_t xend,
         const idx_t *row, const column_t *col, const real *val,
-        const std::set<column_t> &remote_cols
+        const std::vector<column_t> &remote_cols
         )
     : queue(queue), n(end - beg), pitch(alignup(n, 16U))
 {
@@ -682,14 +2510,14 @@ SpMat<real,column_t,idx_t>::SpMatELL::SpMatELL(
 
     // Prepare ELL and COO formats for transfer to devices.
     std::vector<column_t> lell_col(pitch * loc_ell.w, ncol);
-    std::vector<real>     lell_val(pitch * loc_ell.w, 0);
+    std::vector<val_t>    lell_val(pitch * loc_ell.w, 0);
     std::vector<column_t> rell_col(pitch * rem_ell.w, ncol);
-    std::vector<real>     rell_val(pitch * rem_ell.w, 0);
+    std::vector<val_t>    rell_val(pitch * rem_ell.w, 0);
 
     std::vector<idx_t>    lcsr_idx;
     std::vector<column_t> lcsr_row;
     std::vector<column_t> lcsr_col;
-    std::vector<real>     lcsr_val;
+    std::vector<val_t>    lcsr_val;
 
     lcsr_idx.reserve(loc_csr.n + 1);
     lcsr_row.reserve(loc_csr.n);
@@ -699,7 +2527,7 @@ SpMat<real,column_t,idx_t>::SpMatELL::SpMatELL(
     std::vector<idx_t>    rcsr_idx;
     std::vector<column_t> rcsr_row;
     std::vector<column_t> rcsr_col;
-    std::vector<real>     rcsr_val;
+    std::vector<val_t>    rcsr_val;
 
     rcsr_idx.reserve(rem_csr.n + 1);
     rcsr_row.reserve(rem_csr.n);
@@ -747,8 +2575,8 @@ SpMat<real,column_t,idx_t>::SpMatELL::SpMatELL(
 
     // Copy local part to the device.
     if (loc_ell.w) {
-        loc_ell.col = cl::Buffer(context, CL_MEM_READ_ONLY, bytes(lell_col));
-        loc_ell.val = cl::Buffer(context, CL_MEM_READ_ONLY, bytes(lell_val));
+        loc_ell.col = memory_pool<>::create("spmat", context, CL_MEM_READ_ONLY, bytes(lell_col));
+        loc_ell.val = memory_pool<>::create("spmat", context, CL_MEM_READ_ONLY, bytes(lell_val));
 
         queue.enqueueWriteBuffer(loc_ell.col, CL_FALSE, 0,
                 bytes(lell_col), lell_col.data());
@@ -758,10 +2586,10 @@ SpMat<real,column_t,idx_t>::SpMatELL::SpMatELL(
     }
 
     if (loc_csr.n) {
-        loc_csr.idx = cl::Buffer(context, CL_MEM_READ_ONLY, bytes(lcsr_idx));
-        loc_csr.row = cl::Buffer(context, CL_MEM_READ_ONLY, bytes(lcsr_row));
-        loc_csr.col = cl::Buffer(context, CL_MEM_READ_ONLY, bytes(lcsr_col));
-        loc_csr.val = cl::Buffer(context, CL_MEM_READ_ONLY, bytes(lcsr_val));
+        loc_csr.idx = memory_pool<>::create("spmat", context, CL_MEM_READ_ONLY, bytes(lcsr_idx));
+        loc_csr.row = memory_pool<>::create("spmat", context, CL_MEM_READ_ONLY, bytes(lcsr_row));
+        loc_csr.col = memory_pool<>::create("spmat", context, CL_MEM_READ_ONLY, bytes(lcsr_col));
+        loc_csr.val = memory_pool<>::create("spmat", context, CL_MEM_READ_ONLY, bytes(lcsr_val));
 
         queue.enqueueWriteBuffer(loc_csr.idx, CL_FALSE, 0,
                 bytes(lcsr_idx), lcsr_idx.data());
@@ -778,8 +2606,8 @@ SpMat<real,column_t,idx_t>::SpMatELL::SpMatELL(
 
     // Copy remote part to the device.
     if (rem_ell.w) {
-        rem_ell.col = cl::Buffer(context, CL_MEM_READ_ONLY, bytes(rell_col));
-        rem_ell.val = cl::Buffer(context, CL_MEM_READ_ONLY, bytes(rell_val));
+        rem_ell.col = memory_pool<>::create("spmat", context, CL_MEM_READ_ONLY, bytes(rell_col));
+        rem_ell.val = memory_pool<>::create("spmat", context, CL_MEM_READ_ONLY, bytes(rell_val));
 
         queue.enqueueWriteBuffer(rem_ell.col, CL_FALSE, 0,
                 bytes(rell_col), rell_col.data());
@@ -789,10 +2617,10 @@ SpMat<real,column_t,idx_t>::SpMatELL::SpMatELL(
     }
 
     if (rem_csr.n) {
-        rem_csr.idx = cl::Buffer(context, CL_MEM_READ_ONLY, bytes(rcsr_idx));
-        rem_csr.row = cl::Buffer(context, CL_MEM_READ_ONLY, bytes(rcsr_row));
-        rem_csr.col = cl::Buffer(context, CL_MEM_READ_ONLY, bytes(rcsr_col));
-        rem_csr.val = cl::Buffer(context, CL_MEM_READ_ONLY, bytes(rcsr_val));
+        rem_csr.idx = memory_pool<>::create("spmat", context, CL_MEM_READ_ONLY, bytes(rcsr_idx));
+        rem_csr.row = memory_pool<>::create("spmat", context, CL_MEM_READ_ONLY, bytes(rcsr_row));
+        rem_csr.col = memory_pool<>::create("spmat", context, CL_MEM_READ_ONLY, bytes(rcsr_col));
+        rem_csr.val = memory_pool<>::create("spmat", context, CL_MEM_READ_ONLY, bytes(rcsr_val));
 
         queue.enqueueWriteBuffer(rem_csr.idx, CL_FALSE, 0,
                 bytes(rcsr_idx), rcsr_idx.data());
@@ -811,13 +2639,16 @@ SpMat<real,column_t,idx_t>::SpMatELL::SpMatELL(
     if (loc_ell.w || loc_csr.n || rem_ell.w || rem_csr.n) event.wait();
 }
 
-template <typename real, typename column_t, typename idx_t>
-void SpMat<real,column_t,idx_t>::SpMatELL::prepare_kernels(const cl::Context &context) const {
-    if (!compiled[context()]) {
+template <typename real, typename column_t, typename idx_t, typename val_t>
+void SpMat<real,column_t,idx_t,val_t>::SpMatELL::prepare_kernels(const cl::Context &context) {
+    krn = kernel_cache<>::find<kernels>(queue);
+
+    if (!krn) {
         std::ostringstream source;
 
         source << standard_kernel_header <<
             "typedef " << type_name<real>() << " real;\n"
+            "#define VAL(i) " << spmat_load<val_t>("val", "(i)") << "\n"
             "#define NCOL ((" << type_name<column_t>() << ")(-1))\n"
             "kernel void zero(\n"
             "    " << type_name<size_t>() << " n,\n"
@@ -831,8 +2662,8 @@ void SpMat<real,column_t,idx_t>::SpMatELL::prepare_kernels(const cl::Context &co
             "kernel void spmv_set(\n"
             "    " << type_name<size_t>() << " n, uint w, " << type_name<size_t>() << " pitch,\n"
             "    global const " << type_name<column_t>() << " *col,\n"
-            "    global const real *val,\n"
-            "    global const real *x,\n"
+            "    global const " << type_name<val_t>() << " *val,\n"
+            "    global const real * restrict x,\n"
             "    global real *y,\n"
             "    real alpha\n"
             "    )\n"
@@ -842,7 +2673,7 @@ void SpMat<real,column_t,idx_t>::SpMatELL::prepare_kernels(const cl::Context &co
             "        real sum = 0;\n"
             "        for(size_t j = 0; j < w; j++) {\n"
             "            " << type_name<column_t>() << " c = col[row + j * pitch];\n"
-            "            if (c != NCOL) sum += val[row + j * pitch] * x[c];\n"
+            "            if (c != NCOL) sum += VAL(row + j * pitch) * x[c];\n"
             "        }\n"
             "        y[row] = alpha * sum;\n"
             "    }\n"
@@ -850,8 +2681,8 @@ void SpMat<real,column_t,idx_t>::SpMatELL::prepare_kernels(const cl::Context &co
             "kernel void spmv_add(\n"
             "    " << type_name<size_t>() << " n, uint w, " << type_name<size_t>() << " pitch,\n"
             "    global const " << type_name<column_t>() << " *col,\n"
-            "    global const real *val,\n"
-            "    global const real *x,\n"
+            "    global const " << type_name<val_t>() << " *val,\n"
+            "    global const real * restrict x,\n"
             "    global real *y,\n"
             "    real alpha\n"
             "    )\n"
@@ -861,7 +2692,7 @@ void SpMat<real,column_t,idx_t>::SpMatELL::prepare_kernels(const cl::Context &co
             "        real sum = 0;\n"
             "        for(size_t j = 0; j < w; j++) {\n"
             "            " << type_name<column_t>() << " c = col[row + j * pitch];\n"
-            "            if (c != NCOL) sum += val[row + j * pitch] * x[c];\n"
+            "            if (c != NCOL) sum += VAL(row + j * pitch) * x[c];\n"
             "        }\n"
             "        y[row] += alpha * sum;\n"
             "    }\n"
@@ -871,8 +2702,8 @@ void SpMat<real,column_t,idx_t>::SpMatELL::prepare_kernels(const cl::Context &co
             "    global const " << type_name<idx_t>() << " *idx,\n"
             "    global const " << type_name<column_t>() << " *row,\n"
             "    global const " << type_name<column_t>() << " *col,\n"
-            "    global const real *val,\n"
-            "    global const real *x,\n"
+            "    global const " << type_name<val_t>() << " *val,\n"
+            "    global const real * restrict x,\n"
             "    global real *y,\n"
             "    real alpha\n"
             "    )\n"
@@ -883,167 +2714,275 @@ void SpMat<real,column_t,idx_t>::SpMatELL::prepare_kernels(const cl::Context &co
             "        size_t beg = idx[i];\n"
             "        size_t end = idx[i + 1];\n"
             "        for(size_t j = beg; j < end; j++)\n"
-            "            sum += val[j] * x[col[j]];\n"
+            "            sum += VAL(j) * x[col[j]];\n"
             "        y[row[i]] += alpha * sum;\n"
             "    }\n"
             "}\n";
 
         auto program = build_sources(context, source.str());
 
-        zero[context()]     = cl::Kernel(program, "zero");
-        spmv_set[context()] = cl::Kernel(program, "spmv_set");
-        spmv_add[context()] = cl::Kernel(program, "spmv_add");
-        csr_add[context()]  = cl::Kernel(program, "csr_add");
+        kernels k;
+
+        k.zero     = cl::Kernel(program, "zero");
+        k.spmv_set = cl::Kernel(program, "spmv_set");
+        k.spmv_add = cl::Kernel(program, "spmv_add");
+        k.csr_add  = cl::Kernel(program, "csr_add");
 
-        std::vector<cl::Device> device = context.getInfo<CL_CONTEXT_DEVICES>();
+        cl::Device device = qdev(queue);
 
-        wgsize[context()] = std::min(
-                kernel_workgroup_size(spmv_set[context()], device[0]),
-                kernel_workgroup_size(spmv_add[context()], device[0])
+        k.wgsize = std::min(
+                kernel_workgroup_size(k.spmv_set, device),
+                kernel_workgroup_size(k.spmv_add, device)
                 );
 
-        wgsize[context()] = std::min<uint>(wgsize[context()],
-                kernel_workgroup_size(csr_add[context()], device[0])
+        k.wgsize = std::min<uint>(k.wgsize,
+                kernel_workgroup_size(k.csr_add, device)
                 );
 
-        compiled[context()] = true;
+        krn = kernel_cache<>::insert(queue, k);
     }
 }
 
-template <typename real, typename column_t, typename idx_t>
-void SpMat<real,column_t,idx_t>::SpMatELL::mul_local(
+template <typename real, typename column_t, typename idx_t, typename val_t>
+void SpMat<real,column_t,idx_t,val_t>::SpMatELL::mul_local(
         const cl::Buffer &x, const cl::Buffer &y,
         real alpha, bool append
         ) const
 {
-    cl::Context context = qctx(queue);
-    cl::Device  device  = qdev(queue);
+    cl::Device device = qdev(queue);
 
     size_t g_size = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>()
-        * wgsize[context()] * 4;
+        * krn->wgsize * 4;
 
     if (loc_ell.w) {
         if (append) {
             uint pos = 0;
-            spmv_add[context()].setArg(pos++, n);
-            spmv_add[context()].setArg(pos++, loc_ell.w);
-            spmv_add[context()].setArg(pos++, pitch);
-            spmv_add[context()].setArg(pos++, loc_ell.col);
-            spmv_add[context()].setArg(pos++, loc_ell.val);
-            spmv_add[context()].setArg(pos++, x);
-            spmv_add[context()].setArg(pos++, y);
-            spmv_add[context()].setArg(pos++, alpha);
-
-            queue.enqueueNDRangeKernel(spmv_add[context()],
-                    cl::NullRange, g_size, wgsize[context()]);
+            krn->spmv_add.setArg(pos++, n);
+            krn->spmv_add.setArg(pos++, loc_ell.w);
+            krn->spmv_add.setArg(pos++, pitch);
+            krn->spmv_add.setArg(pos++, loc_ell.col);
+            krn->spmv_add.setArg(pos++, loc_ell.val);
+            krn->spmv_add.setArg(pos++, x);
+            krn->spmv_add.setArg(pos++, y);
+            krn->spmv_add.setArg(pos++, alpha);
+
+            queue.enqueueNDRangeKernel(krn->spmv_add,
+                    cl::NullRange, g_size, krn->wgsize, 0, event_trace<>::kernel(queue, krn->spmv_add));
         } else {
             uint pos = 0;
-            spmv_set[context()].setArg(pos++, n);
-            spmv_set[context()].setArg(pos++, loc_ell.w);
-            spmv_set[context()].setArg(pos++, pitch);
-            spmv_set[context()].setArg(pos++, loc_ell.col);
-            spmv_set[context()].setArg(pos++, loc_ell.val);
-            spmv_set[context()].setArg(pos++, x);
-            spmv_set[context()].setArg(pos++, y);
-            spmv_set[context()].setArg(pos++, alpha);
-
-            queue.enqueueNDRangeKernel(spmv_set[context()],
-                    cl::NullRange, g_size, wgsize[context()]);
+            krn->spmv_set.setArg(pos++, n);
+            krn->spmv_set.setArg(pos++, loc_ell.w);
+            krn->spmv_set.setArg(pos++, pitch);
+            krn->spmv_set.setArg(pos++, loc_ell.col);
+            krn->spmv_set.setArg(pos++, loc_ell.val);
+            krn->spmv_set.setArg(pos++, x);
+            krn->spmv_set.setArg(pos++, y);
+            krn->spmv_set.setArg(pos++, alpha);
+
+            queue.enqueueNDRangeKernel(krn->spmv_set,
+                    cl::NullRange, g_size, krn->wgsize, 0, event_trace<>::kernel(queue, krn->spmv_set));
         }
     } else if (!append) {
         uint pos = 0;
-        zero[context()].setArg(pos++, n);
-        zero[context()].setArg(pos++, y);
+        krn->zero.setArg(pos++, n);
+        krn->zero.setArg(pos++, y);
 
-        queue.enqueueNDRangeKernel(zero[context()],
-                cl::NullRange, g_size, wgsize[context()]);
+        queue.enqueueNDRangeKernel(krn->zero,
+                cl::NullRange, g_size, krn->wgsize, 0, event_trace<>::kernel(queue, krn->zero));
     }
 
     if (loc_csr.n) {
         uint pos = 0;
-        csr_add[context()].setArg(pos++, loc_csr.n);
-        csr_add[context()].setArg(pos++, loc_csr.idx);
-        csr_add[context()].setArg(pos++, loc_csr.row);
-        csr_add[context()].setArg(pos++, loc_csr.col);
-        csr_add[context()].setArg(pos++, loc_csr.val);
-        csr_add[context()].setArg(pos++, x);
-        csr_add[context()].setArg(pos++, y);
-        csr_add[context()].setArg(pos++, alpha);
-
-        queue.enqueueNDRangeKernel(csr_add[context()],
-                cl::NullRange, g_size, wgsize[context()]);
+        krn->csr_add.setArg(pos++, loc_csr.n);
+        krn->csr_add.setArg(pos++, loc_csr.idx);
+        krn->csr_add.setArg(pos++, loc_csr.row);
+        krn->csr_add.setArg(pos++, loc_csr.col);
+        krn->csr_add.setArg(pos++, loc_csr.val);
+        krn->csr_add.setArg(pos++, x);
+        krn->csr_add.setArg(pos++, y);
+        krn->csr_add.setArg(pos++, alpha);
+
+        queue.enqueueNDRangeKernel(krn->csr_add,
+                cl::NullRange, g_size, krn->wgsize, 0, event_trace<>::kernel(queue, krn->csr_add));
+    }
+}
+template <typename real, typename column_t, typename idx_t, typename val_t>
+void SpMat<real,column_t,idx_t,val_t>::SpMatELL::mul_remote(
+        const cl::Buffer &x, const cl::Buffer &y,
+        real alpha, const std::vector<cl::Event> &event
+        ) const
+{
+    cl::Device device = qdev(queue);
+
+    size_t g_size = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>()
+        * krn->wgsize * 4;
+
+    if (rem_ell.w) {
+        uint pos = 0;
+        krn->spmv_add.setArg(pos++, n);
+        krn->spmv_add.setArg(pos++, rem_ell.w);
+        krn->spmv_add.setArg(pos++, pitch);
+        krn->spmv_add.setArg(pos++, rem_ell.col);
+        krn->spmv_add.setArg(pos++, rem_ell.val);
+        krn->spmv_add.setArg(pos++, x);
+        krn->spmv_add.setArg(pos++, y);
+        krn->spmv_add.setArg(pos++, alpha);
+
+        queue.enqueueNDRangeKernel(krn->spmv_add,
+                cl::NullRange, g_size, krn->wgsize, &event, event_trace<>::kernel(queue, krn->spmv_add)
+                );
+    }
+
+    if (rem_csr.n) {
+        uint pos = 0;
+        krn->csr_add.setArg(pos++, rem_csr.n);
+        krn->csr_add.setArg(pos++, rem_csr.idx);
+        krn->csr_add.setArg(pos++, rem_csr.row);
+        krn->csr_add.setArg(pos++, rem_csr.col);
+        krn->csr_add.setArg(pos++, rem_csr.val);
+        krn->csr_add.setArg(pos++, x);
+        krn->csr_add.setArg(pos++, y);
+        krn->csr_add.setArg(pos++, alpha);
+
+        queue.enqueueNDRangeKernel(krn->csr_add,
+                cl::NullRange, g_size, krn->wgsize, &event, event_trace<>::kernel(queue, krn->csr_add));
+    }
+}
+
+template <typename real, typename column_t, typename idx_t, typename val_t>
+void SpMat<real,column_t,idx_t,val_t>::SpMatELL::mul_transposed(
+        const transposed_kernels &k,
+        const cl::Buffer &x, const cl::Buffer &y,
+        const cl::Buffer &ghosts, real alpha
+        ) const
+{
+    const struct {
+        uint w;
+        const cl::Buffer *col, *val;
+    } ell[] = {
+        {loc_ell.w, &loc_ell.col, &loc_ell.val},
+        {rem_ell.w, &rem_ell.col, &rem_ell.val}
+    };
+
+    const struct {
+        size_t n;
+        const cl::Buffer *idx, *row, *col, *val;
+    } csr[] = {
+        {loc_csr.n, &loc_csr.idx, &loc_csr.row, &loc_csr.col, &loc_csr.val},
+        {rem_csr.n, &rem_csr.idx, &rem_csr.row, &rem_csr.col, &rem_csr.val}
+    };
+
+    for(int r = 0; r < 2; r++) {
+        const cl::Buffer &dst = r ? ghosts : y;
+
+        if (ell[r].w) {
+            uint pos = 0;
+            k.ell.setArg(pos++, n);
+            k.ell.setArg(pos++, ell[r].w);
+            k.ell.setArg(pos++, pitch);
+            k.ell.setArg(pos++, *ell[r].col);
+            k.ell.setArg(pos++, *ell[r].val);
+            k.ell.setArg(pos++, x);
+            k.ell.setArg(pos++, dst);
+            k.ell.setArg(pos++, alpha);
+
+            queue.enqueueNDRangeKernel(k.ell, cl::NullRange, k.g_size, k.wgsize,
+                    0, event_trace<>::kernel(queue, k.ell));
+        }
+
+        if (csr[r].n) {
+            uint pos = 0;
+            k.tail.setArg(pos++, csr[r].n);
+            k.tail.setArg(pos++, *csr[r].idx);
+            k.tail.setArg(pos++, *csr[r].row);
+            k.tail.setArg(pos++, *csr[r].col);
+            k.tail.setArg(pos++, *csr[r].val);
+            k.tail.setArg(pos++, x);
+            k.tail.setArg(pos++, dst);
+            k.tail.setArg(pos++, alpha);
+
+            queue.enqueueNDRangeKernel(k.tail, cl::NullRange, k.g_size, k.wgsize,
+                    0, event_trace<>::kernel(queue, k.tail));
+        }
     }
 }
-template <typename real, typename column_t, typename idx_t>
-void SpMat<real,column_t,idx_t>::SpMatELL::mul_remote(
-        const cl::Buffer &x, const cl::Buffer &y,
-        real alpha, const std::vector<cl::Event> &event
+
+template <typename real, typename column_t, typename idx_t, typename val_t>
+void SpMat<real,column_t,idx_t,val_t>::SpMatELL::mul_local_block(
+        const std::vector<cl::Buffer> &x, const std::vector<cl::Buffer> &y,
+        real alpha, bool append
         ) const
 {
-    cl::Context context = qctx(queue);
-    cl::Device  device  = qdev(queue);
+    if (!loc_ell.w && !append) {
+        for(size_t i = 0; i < y.size(); i++) {
+            uint pos = 0;
+            krn->zero.setArg(pos++, n);
+            krn->zero.setArg(pos++, y[i]);
 
-    size_t g_size = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>()
-        * wgsize[context()] * 4;
+            size_t g_size = qdev(queue).getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>()
+                * krn->wgsize * 4;
 
-    if (rem_ell.w) {
-        uint pos = 0;
-        spmv_add[context()].setArg(pos++, n);
-        spmv_add[context()].setArg(pos++, rem_ell.w);
-        spmv_add[context()].setArg(pos++, pitch);
-        spmv_add[context()].setArg(pos++, rem_ell.col);
-        spmv_add[context()].setArg(pos++, rem_ell.val);
-        spmv_add[context()].setArg(pos++, x);
-        spmv_add[context()].setArg(pos++, y);
-        spmv_add[context()].setArg(pos++, alpha);
-
-        queue.enqueueNDRangeKernel(spmv_add[context()],
-                cl::NullRange, g_size, wgsize[context()], &event
-                );
+            queue.enqueueNDRangeKernel(krn->zero,
+                    cl::NullRange, g_size, krn->wgsize, 0, event_trace<>::kernel(queue, krn->zero));
+        }
+        append = true;
     }
 
-    if (rem_csr.n) {
-        uint pos = 0;
-        csr_add[context()].setArg(pos++, rem_csr.n);
-        csr_add[context()].setArg(pos++, rem_csr.idx);
-        csr_add[context()].setArg(pos++, rem_csr.row);
-        csr_add[context()].setArg(pos++, rem_csr.col);
-        csr_add[context()].setArg(pos++, rem_csr.val);
-        csr_add[context()].setArg(pos++, x);
-        csr_add[context()].setArg(pos++, y);
-        csr_add[context()].setArg(pos++, alpha);
-
-        queue.enqueueNDRangeKernel(csr_add[context()],
-                cl::NullRange, g_size, wgsize[context()], &event);
-    }
-}
+    for(size_t first = 0; first < x.size(); first += block_width) {
+        uint width = static_cast<uint>(std::min<size_t>(block_width, x.size() - first));
 
-//---------------------------------------------------------------------------
-// SpMat::SpMatCSR
-//---------------------------------------------------------------------------
-template <typename real, typename column_t, typename idx_t>
-std::map<cl_context, bool> SpMat<real,column_t,idx_t>::SpMatCSR::compiled;
+        std::shared_ptr<block_kernels> bk = get_block_kernels(queue, width);
 
-template <typename real, typename column_t, typename idx_t>
-std::map<cl_context, cl::Kernel> SpMat<real,column_t,idx_t>::SpMatCSR::zero;
+        size_t g_size = qdev(queue).getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>()
+            * bk->wgsize * 4;
 
-template <typename real, typename column_t, typename idx_t>
-std::map<cl_context, cl::Kernel> SpMat<real,column_t,idx_t>::SpMatCSR::spmv_set;
+        if (loc_ell.w) {
+            cl::Kernel &k = append ? bk->ell_add : bk->ell_set;
 
-template <typename real, typename column_t, typename idx_t>
-std::map<cl_context, cl::Kernel> SpMat<real,column_t,idx_t>::SpMatCSR::spmv_add;
+            uint pos = 0;
+            k.setArg(pos++, n);
+            k.setArg(pos++, loc_ell.w);
+            k.setArg(pos++, pitch);
+            k.setArg(pos++, loc_ell.col);
+            k.setArg(pos++, loc_ell.val);
+            k.setArg(pos++, alpha);
+            set_block_args(k, pos, x, y, first, width);
+
+            queue.enqueueNDRangeKernel(k, cl::NullRange, g_size, bk->wgsize, 0,
+                    event_trace<>::kernel(queue, k));
+        }
 
-template <typename real, typename column_t, typename idx_t>
-std::map<cl_context, uint> SpMat<real,column_t,idx_t>::SpMatCSR::wgsize;
+        if (loc_csr.n) {
+            cl::Kernel &k = bk->tail_add;
 
-template <typename real, typename column_t, typename idx_t>
-SpMat<real,column_t,idx_t>::SpMatCSR::SpMatCSR(
+            uint pos = 0;
+            k.setArg(pos++, loc_csr.n);
+            k.setArg(pos++, loc_csr.idx);
+            k.setArg(pos++, loc_csr.row);
+            k.setArg(pos++, loc_csr.col);
+            k.setArg(pos++, loc_csr.val);
+            k.setArg(pos++, alpha);
+            set_block_args(k, pos, x, y, first, width);
+
+            queue.enqueueNDRangeKernel(k, cl::NullRange, g_size, bk->wgsize, 0,
+                    event_trace<>::kernel(queue, k));
+        }
+    }
+}
+
+//---------------------------------------------------------------------------
+// SpMat::SpMatCSR
+//---------------------------------------------------------------------------
+template <typename real, typename column_t, typename idx_t, typename val_t>
+SpMat<real,column_t,idx_t,val_t>::SpMatCSR::SpMatCSR(
         const cl::CommandQueue &queue,
         size_t beg, size_t end, column_t xbeg, column_t xend,
         const idx_t *row, const column_t *col, const real *val,
-        const std::set<column_t> &remote_cols
+        const std::vector<column_t> &remote_cols,
+        csr_kernel::type ktype
         )
-    : queue(queue), n(end - beg), has_loc(false), has_rem(false)
+    : queue(queue), n(end - beg), has_loc(false), has_rem(false),
+      method(csr_kernel::scalar), vwidth(1), nblocks(0), ntiles(0), loc_nnz(0)
 {
     cl::Context context = qctx(queue);
 
@@ -1051,14 +2990,14 @@ SpMat<real,column_t,idx_t>::SpMatCSR::SpMatCSR(
 
     if (beg == 0 && remote_cols.empty()) {
         if (row[n]) {
-            loc.row = cl::Buffer(
+            loc.row = memory_pool<>::create("spmat",
                     context, CL_MEM_READ_ONLY, (n + 1) * sizeof(idx_t));
 
-            loc.col = cl::Buffer(
+            loc.col = memory_pool<>::create("spmat",
                     context, CL_MEM_READ_ONLY, row[n] * sizeof(column_t));
 
-            loc.val = cl::Buffer(
-                    context, CL_MEM_READ_ONLY, row[n] * sizeof(real));
+            loc.val = memory_pool<>::create("spmat",
+                    context, CL_MEM_READ_ONLY, row[n] * sizeof(val_t));
 
             queue.enqueueWriteBuffer(
                     loc.row, CL_FALSE, 0, (n + 1) * sizeof(idx_t), row);
@@ -1066,20 +3005,25 @@ SpMat<real,column_t,idx_t>::SpMatCSR::SpMatCSR(
             queue.enqueueWriteBuffer(
                     loc.col, CL_FALSE, 0, row[n] * sizeof(column_t), col);
 
+            std::vector<val_t> buf;
+
             queue.enqueueWriteBuffer(
-                    loc.val, CL_TRUE, 0, row[n] * sizeof(real), val);
+                    loc.val, CL_TRUE, 0, row[n] * sizeof(val_t),
+                    spmat_values(val, row[n], buf));
         }
 
         has_loc = row[n];
         has_rem = false;
+
+        setup_method(ktype, row);
     } else {
         std::vector<idx_t>    lrow;
         std::vector<column_t> lcol;
-        std::vector<real>     lval;
+        std::vector<val_t>    lval;
 
         std::vector<idx_t>    rrow;
         std::vector<column_t> rcol;
-        std::vector<real>     rval;
+        std::vector<val_t>    rval;
 
         lrow.reserve(end - beg + 1);
         lrow.push_back(0);
@@ -1122,36 +3066,36 @@ SpMat<real,column_t,idx_t>::SpMatCSR::SpMatCSR(
 
         // Copy local part to the device.
         if (lrow.back()) {
-            loc.row = cl::Buffer(
+            loc.row = memory_pool<>::create("spmat",
                     context, CL_MEM_READ_ONLY, lrow.size() * sizeof(idx_t));
 
             queue.enqueueWriteBuffer(
                     loc.row, CL_FALSE, 0, lrow.size() * sizeof(idx_t), lrow.data());
 
-            loc.col = cl::Buffer(
+            loc.col = memory_pool<>::create("spmat",
                     context, CL_MEM_READ_ONLY, lcol.size() * sizeof(column_t));
 
-            loc.val = cl::Buffer(
-                    context, CL_MEM_READ_ONLY, lval.size() * sizeof(real));
+            loc.val = memory_pool<>::create("spmat",
+                    context, CL_MEM_READ_ONLY, lval.size() * sizeof(val_t));
 
             queue.enqueueWriteBuffer(
                     loc.col, CL_FALSE, 0, lcol.size() * sizeof(column_t), lcol.data());
 
             queue.enqueueWriteBuffer(
-                    loc.val, CL_FALSE, 0, lval.size() * sizeof(real), lval.data(),
+                    loc.val, CL_FALSE, 0, lval.size() * sizeof(val_t), lval.data(),
                     0, &event);
         }
 
         // Copy remote part to the device.
         if (!remote_cols.empty()) {
-            rem.row = cl::Buffer(
+            rem.row = memory_pool<>::create("spmat",
                     context, CL_MEM_READ_ONLY, rrow.size() * sizeof(idx_t));
 
-            rem.col = cl::Buffer(
+            rem.col = memory_pool<>::create("spmat",
                     context, CL_MEM_READ_ONLY, rcol.size() * sizeof(column_t));
 
-            rem.val = cl::Buffer(
-                    context, CL_MEM_READ_ONLY, rval.size() * sizeof(real));
+            rem.val = memory_pool<>::create("spmat",
+                    context, CL_MEM_READ_ONLY, rval.size() * sizeof(val_t));
 
             queue.enqueueWriteBuffer(
                     rem.row, CL_FALSE, 0, rrow.size() * sizeof(idx_t), rrow.data());
@@ -1160,7 +3104,7 @@ SpMat<real,column_t,idx_t>::SpMatCSR::SpMatCSR(
                     rem.col, CL_FALSE, 0, rcol.size() * sizeof(column_t), rcol.data());
 
             queue.enqueueWriteBuffer(
-                    rem.val, CL_FALSE, 0, rval.size() * sizeof(real), rval.data(),
+                    rem.val, CL_FALSE, 0, rval.size() * sizeof(val_t), rval.data(),
                     0, &event);
         }
 
@@ -1168,16 +3112,103 @@ SpMat<real,column_t,idx_t>::SpMatCSR::SpMatCSR(
 
         has_loc = lrow.back();
         has_rem = !remote_cols.empty();
+
+        setup_method(ktype, lrow.data());
     }
 }
 
-template <typename real, typename column_t, typename idx_t>
-void SpMat<real,column_t,idx_t>::SpMatCSR::prepare_kernels(const cl::Context &context) const {
-    if (!compiled[context()]) {
+template <typename real, typename column_t, typename idx_t, typename val_t>
+SpMat<real,column_t,idx_t,val_t>::SpMatCSR::SpMatCSR(
+        const cl::CommandQueue &queue, size_t n,
+        const device_strip &strip,
+        csr_kernel::type ktype
+        )
+    : queue(queue), n(n), has_loc(strip.has_loc), has_rem(strip.has_rem),
+      method(csr_kernel::scalar), vwidth(1), nblocks(0), ntiles(0), loc_nnz(0)
+{
+    prepare_kernels(qctx(queue));
+
+    loc.row = strip.lrow;
+    loc.col = strip.lcol;
+    loc.val = strip.lval;
+
+    rem.row = strip.rrow;
+    rem.col = strip.rcol;
+    rem.val = strip.rval;
+
+    setup_method(ktype, strip.row.data());
+}
+
+template <typename real, typename column_t, typename idx_t, typename val_t>
+void SpMat<real,column_t,idx_t,val_t>::SpMatCSR::setup_method(
+        csr_kernel::type m, const idx_t *row)
+{
+    if (!has_loc || !krn->local_size) return;
+
+    double avg = static_cast<double>(row[n]) / n;
+
+    if (m == csr_kernel::automatic) {
+        if (qdev(queue).getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU)
+            m = csr_kernel::scalar;
+        else if (skewed(0, n, row))
+            m = csr_kernel::merge;
+        else
+            m = avg >= 8 ? csr_kernel::vector : csr_kernel::adaptive;
+    }
+
+    method = m;
+
+    if (method == csr_kernel::vector) {
+        // Smallest power of two not less than average row width.
+        for(vwidth = 2; vwidth < avg && vwidth < krn->wavefront; vwidth *= 2);
+        vwidth = std::min(vwidth, krn->local_size);
+    } else if (method == csr_kernel::adaptive) {
+        // Each block either has several rows with at most local_size
+        // nonzeros in total, or consists of a single long row.
+        const size_t ls = krn->local_size;
+
+        std::vector<idx_t> blk(1, 0);
+
+        for(size_t i = 0; i < n; ) {
+            size_t start = i, nnz = row[i + 1] - row[i];
+
+            if (nnz > ls) {
+                i++;
+            } else {
+                for(nnz = 0; i < n && i - start < ls &&
+                        nnz + row[i + 1] - row[i] <= ls; i++)
+                    nnz += row[i + 1] - row[i];
+            }
+
+            blk.push_back(i);
+        }
+
+        nblocks = blk.size() - 1;
+
+        blocks = memory_pool<>::create("spmat", qctx(queue), CL_MEM_READ_ONLY, bytes(blk));
+        queue.enqueueWriteBuffer(blocks, CL_TRUE, 0, bytes(blk), blk.data());
+    } else if (method == csr_kernel::merge) {
+        // The merge path has a step per row end and per nonzero.
+        loc_nnz = row[n];
+        ntiles  = (n + loc_nnz + krn->tile - 1) / krn->tile;
+
+        carry_row = memory_pool<>::create("spmat",
+                qctx(queue), CL_MEM_READ_WRITE, ntiles * sizeof(size_t));
+        carry_val = memory_pool<>::create("spmat",
+                qctx(queue), CL_MEM_READ_WRITE, ntiles * sizeof(real));
+    }
+}
+
+template <typename real, typename column_t, typename idx_t, typename val_t>
+void SpMat<real,column_t,idx_t,val_t>::SpMatCSR::prepare_kernels(const cl::Context &context) {
+    krn = kernel_cache<>::find<kernels>(queue);
+
+    if (!krn) {
         std::ostringstream source;
 
         source << standard_kernel_header <<
             "typedef " << type_name<real>() << " real;\n"
+            "#define VAL(i) " << spmat_load<val_t>("val", "(i)") << "\n"
             "kernel void zero(\n"
             "    " << type_name<size_t>() << " n,\n"
             "    global real *y\n"
@@ -1190,8 +3221,8 @@ void SpMat<real,column_t,idx_t>::SpMatCSR::prepare_kernels(const cl::Context &co
             "    " << type_name<size_t>() << " n,\n"
             "    global const " << type_name<idx_t>() << " *row,\n"
             "    global const " << type_name<column_t>() << " *col,\n"
-            "    global const real *val,\n"
-            "    global const real *x,\n"
+            "    global const " << type_name<val_t>() << " *val,\n"
+            "    global const real * restrict x,\n"
             "    global real *y,\n"
             "    real alpha\n"
             "    )\n"
@@ -1202,7 +3233,7 @@ void SpMat<real,column_t,idx_t>::SpMatCSR::prepare_kernels(const cl::Context &co
             "        size_t beg = row[i];\n"
             "        size_t end = row[i + 1];\n"
             "        for(size_t j = beg; j < end; j++)\n"
-            "            sum += val[j] * x[col[j]];\n"
+            "            sum += VAL(j) * x[col[j]];\n"
             "        y[i] = alpha * sum;\n"
             "    }\n"
             "}\n"
@@ -1210,8 +3241,8 @@ void SpMat<real,column_t,idx_t>::SpMatCSR::prepare_kernels(const cl::Context &co
             "    " << type_name<size_t>() << " n,\n"
             "    global const " << type_name<idx_t>() << " *row,\n"
             "    global const " << type_name<column_t>() << " *col,\n"
-            "    global const real *val,\n"
-            "    global const real *x,\n"
+            "    global const " << type_name<val_t>() << " *val,\n"
+            "    global const real * restrict x,\n"
             "    global real *y,\n"
             "    real alpha\n"
             "    )\n"
@@ -1222,94 +3253,705 @@ void SpMat<real,column_t,idx_t>::SpMatCSR::prepare_kernels(const cl::Context &co
             "        size_t beg = row[i];\n"
             "        size_t end = row[i + 1];\n"
             "        for(size_t j = beg; j < end; j++)\n"
-            "            sum += val[j] * x[col[j]];\n"
+            "            sum += VAL(j) * x[col[j]];\n"
             "        y[i] += alpha * sum;\n"
             "    }\n"
             "}\n";
 
-        auto program = build_sources(context, source.str());
+        cl::Device device = qdev(queue);
+
+        // Work-group size of the vector kernels is a power of two.
+        uint local_size = 1;
+        while(local_size * 2 <= std::min<size_t>(256,
+                    device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>()))
+            local_size *= 2;
+
+        // Merge path items per work-item of the merge kernels.
+        const uint ipt = 7;
+
+        source <<
+            "#define LS " << local_size << "\n"
+            "#define IPT " << ipt << "\n"
+            // Inclusive scan of cval within runs of equal crow; rows only
+            // grow along the merge path, so equal neighbours form a run.
+            "#define SEGMENTED_SCAN(i) \\\n"
+            "    for(uint s = 1; s < LS; s <<= 1) { \\\n"
+            "        real v = (lid >= s && crow[lid - s] == (i)) ? cval[lid - s] : 0; \\\n"
+            "        barrier(CLK_LOCAL_MEM_FENCE); \\\n"
+            "        cval[lid] += v; \\\n"
+            "        barrier(CLK_LOCAL_MEM_FENCE); \\\n"
+            "    }\n";
+
+        for(int append = 0; append < 2; append++) {
+            const char *op = append ? " += " : " = ";
+
+            source <<
+                "kernel void vector_" << (append ? "add" : "set") << "(\n"
+                "    " << type_name<size_t>() << " n, uint V,\n"
+                "    global const " << type_name<idx_t>() << " *row,\n"
+                "    global const " << type_name<column_t>() << " *col,\n"
+                "    global const " << type_name<val_t>() << " *val,\n"
+                "    global const real * restrict x,\n"
+                "    global real *y,\n"
+                "    real alpha\n"
+                "    )\n"
+                "{\n"
+                "    local real part[LS];\n"
+                "    size_t lid  = get_local_id(0);\n"
+                "    size_t lane = lid % V;\n"
+                "    size_t rpg  = LS / V;\n"
+                "    for(size_t base = get_group_id(0) * rpg; base < n; base += get_num_groups(0) * rpg) {\n"
+                "        size_t i = base + lid / V;\n"
+                "        real sum = 0;\n"
+                "        if (i < n) {\n"
+                "            size_t end = row[i + 1];\n"
+                "            for(size_t j = row[i] + lane; j < end; j += V)\n"
+                "                sum += VAL(j) * x[col[j]];\n"
+                "        }\n"
+                "        part[lid] = sum;\n"
+                "        barrier(CLK_LOCAL_MEM_FENCE);\n"
+                "        for(uint s = V / 2; s > 0; s >>= 1) {\n"
+                "            if (lane < s) part[lid] += part[lid + s];\n"
+                "            barrier(CLK_LOCAL_MEM_FENCE);\n"
+                "        }\n"
+                "        if (lane == 0 && i < n) y[i]" << op << "alpha * part[lid];\n"
+                "        barrier(CLK_LOCAL_MEM_FENCE);\n"
+                "    }\n"
+                "}\n"
+                "kernel void adaptive_" << (append ? "add" : "set") << "(\n"
+                "    " << type_name<size_t>() << " nblocks,\n"
+                "    global const " << type_name<idx_t>() << " *blocks,\n"
+                "    global const " << type_name<idx_t>() << " *row,\n"
+                "    global const " << type_name<column_t>() << " *col,\n"
+                "    global const " << type_name<val_t>() << " *val,\n"
+                "    global const real * restrict x,\n"
+                "    global real *y,\n"
+                "    real alpha\n"
+                "    )\n"
+                "{\n"
+                "    local real part[LS];\n"
+                "    size_t lid = get_local_id(0);\n"
+                "    for(size_t b = get_group_id(0); b < nblocks; b += get_num_groups(0)) {\n"
+                "        size_t rbeg = blocks[b];\n"
+                "        size_t rend = blocks[b + 1];\n"
+                "        size_t jbeg = row[rbeg];\n"
+                "        size_t jend = row[rend];\n"
+                "        if (rend - rbeg > 1) {\n"
+                "            if (jbeg + lid < jend)\n"
+                "                part[lid] = VAL(jbeg + lid) * x[col[jbeg + lid]];\n"
+                "            barrier(CLK_LOCAL_MEM_FENCE);\n"
+                "            if (rbeg + lid < rend) {\n"
+                "                real sum = 0;\n"
+                "                size_t end = row[rbeg + lid + 1] - jbeg;\n"
+                "                for(size_t j = row[rbeg + lid] - jbeg; j < end; j++)\n"
+                "                    sum += part[j];\n"
+                "                y[rbeg + lid]" << op << "alpha * sum;\n"
+                "            }\n"
+                "        } else {\n"
+                "            real sum = 0;\n"
+                "            for(size_t j = jbeg + lid; j < jend; j += LS)\n"
+                "                sum += VAL(j) * x[col[j]];\n"
+                "            part[lid] = sum;\n"
+                "            barrier(CLK_LOCAL_MEM_FENCE);\n"
+                "            for(uint s = LS / 2; s > 0; s >>= 1) {\n"
+                "                if (lid < s) part[lid] += part[lid + s];\n"
+                "                barrier(CLK_LOCAL_MEM_FENCE);\n"
+                "            }\n"
+                "            if (lid == 0) y[rbeg]" << op << "alpha * part[0];\n"
+                "        }\n"
+                "        barrier(CLK_LOCAL_MEM_FENCE);\n"
+                "    }\n"
+                "}\n"
+                "kernel void merge_" << (append ? "add" : "set") << "(\n"
+                "    " << type_name<size_t>() << " n,\n"
+                "    " << type_name<size_t>() << " nnz,\n"
+                "    global const " << type_name<idx_t>() << " *row,\n"
+                "    global const " << type_name<column_t>() << " *col,\n"
+                "    global const " << type_name<val_t>() << " *val,\n"
+                "    global const real * restrict x,\n"
+                "    global real *y,\n"
+                "    real alpha,\n"
+                "    global " << type_name<size_t>() << " *carry_row,\n"
+                "    global real *carry_val\n"
+                "    )\n"
+                "{\n"
+                "    local " << type_name<size_t>() << " crow[LS];\n"
+                "    local real cval[LS];\n"
+                "    size_t lid  = get_local_id(0);\n"
+                "    size_t last = n + nnz;\n"
+                "    size_t d    = min((get_group_id(0) * LS + lid) * IPT, last);\n"
+                "    size_t dend = min(d + IPT, last);\n"
+                "    size_t lo = d > nnz ? d - nnz : 0;\n"
+                "    size_t hi = min(d, n);\n"
+                "    while(lo < hi) {\n"
+                "        size_t mid = (lo + hi) / 2;\n"
+                "        if (row[mid + 1] <= d - mid - 1) lo = mid + 1; else hi = mid;\n"
+                "    }\n"
+                "    size_t i = lo, j = d - lo, first = n;\n"
+                "    real sum = 0, first_sum = 0;\n"
+                "    for(; d < dend; d++) {\n"
+                "        if (j < row[i + 1]) {\n"
+                "            sum += VAL(j) * x[col[j]];\n"
+                "            j++;\n"
+                "        } else {\n"
+                "            if (first == n) {\n"
+                "                first = i;\n"
+                "                first_sum = sum;\n"
+                "            } else {\n"
+                "                y[i]" << op << "alpha * sum;\n"
+                "            }\n"
+                "            sum = 0;\n"
+                "            i++;\n"
+                "        }\n"
+                "    }\n"
+                "    crow[lid] = i;\n"
+                "    cval[lid] = sum;\n"
+                "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+                "    SEGMENTED_SCAN(i);\n"
+                "    if (first < n) {\n"
+                "        if (lid > 0 && crow[lid - 1] == first) first_sum += cval[lid - 1];\n"
+                "        y[first]" << op << "alpha * first_sum;\n"
+                "    }\n"
+                "    if (lid == LS - 1) {\n"
+                "        carry_row[get_group_id(0)] = i;\n"
+                "        carry_val[get_group_id(0)] = cval[lid];\n"
+                "    }\n"
+                "}\n";
+        }
 
-        zero[context()]     = cl::Kernel(program, "zero");
-        spmv_set[context()] = cl::Kernel(program, "spmv_set");
-        spmv_add[context()] = cl::Kernel(program, "spmv_add");
+        source <<
+            "kernel void merge_fixup(\n"
+            "    " << type_name<size_t>() << " n,\n"
+            "    " << type_name<size_t>() << " ntiles,\n"
+            "    global const " << type_name<size_t>() << " *carry_row,\n"
+            "    global const real *carry_val,\n"
+            "    global real *y,\n"
+            "    real alpha\n"
+            "    )\n"
+            "{\n"
+            "    local " << type_name<size_t>() << " crow[LS];\n"
+            "    local real cval[LS];\n"
+            "    size_t lid = get_local_id(0);\n"
+            "    for(size_t base = 0; base < ntiles; base += LS) {\n"
+            "        size_t t = base + lid;\n"
+            "        size_t i = t < ntiles ? carry_row[t] : n;\n"
+            "        crow[lid] = i;\n"
+            "        cval[lid] = t < ntiles ? carry_val[t] : 0;\n"
+            "        barrier(CLK_LOCAL_MEM_FENCE);\n"
+            "        SEGMENTED_SCAN(i);\n"
+            "        if (i < n && (lid == LS - 1 || crow[lid + 1] != i))\n"
+            "            y[i] += alpha * cval[lid];\n"
+            "        barrier(CLK_LOCAL_MEM_FENCE | CLK_GLOBAL_MEM_FENCE);\n"
+            "    }\n"
+            "}\n";
 
-        std::vector<cl::Device> device = context.getInfo<CL_CONTEXT_DEVICES>();
+        auto program = build_sources(context, source.str());
 
-        wgsize[context()] = std::min(
-                kernel_workgroup_size(spmv_set[context()], device[0]),
-                kernel_workgroup_size(spmv_add[context()], device[0])
+        kernels k;
+
+        k.zero         = cl::Kernel(program, "zero");
+        k.spmv_set     = cl::Kernel(program, "spmv_set");
+        k.spmv_add     = cl::Kernel(program, "spmv_add");
+        k.vector_set   = cl::Kernel(program, "vector_set");
+        k.vector_add   = cl::Kernel(program, "vector_add");
+        k.adaptive_set = cl::Kernel(program, "adaptive_set");
+        k.adaptive_add = cl::Kernel(program, "adaptive_add");
+        k.merge_set    = cl::Kernel(program, "merge_set");
+        k.merge_add    = cl::Kernel(program, "merge_add");
+        k.merge_fixup  = cl::Kernel(program, "merge_fixup");
+
+        k.wgsize = std::min(
+                kernel_workgroup_size(k.spmv_set, device),
+                kernel_workgroup_size(k.spmv_add, device)
                 );
 
-        compiled[context()] = true;
+        k.wavefront = static_cast<uint>(
+                k.vector_set.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device));
+
+        k.local_size = local_size;
+        k.tile       = local_size * ipt;
+
+        cl::Kernel *vk[] = {&k.vector_set, &k.vector_add, &k.adaptive_set, &k.adaptive_add,
+            &k.merge_set, &k.merge_add, &k.merge_fixup};
+        for(int i = 0; i < 7; i++)
+            if (kernel_workgroup_size(*vk[i], device) < local_size) k.local_size = 0;
+
+        krn = kernel_cache<>::insert(queue, k);
     }
 }
 
-template <typename real, typename column_t, typename idx_t>
-void SpMat<real,column_t,idx_t>::SpMatCSR::mul_local(
+template <typename real, typename column_t, typename idx_t, typename val_t>
+void SpMat<real,column_t,idx_t,val_t>::SpMatCSR::mul_local(
         const cl::Buffer &x, const cl::Buffer &y,
         real alpha, bool append
         ) const
 {
-    cl::Context context = qctx(queue);
+    if (has_loc && method != csr_kernel::scalar) {
+        cl::Device device = qdev(queue);
+
+        size_t ngroups = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * 8;
+        size_t ls      = krn->local_size;
+
+        if (method == csr_kernel::vector) {
+            cl::Kernel &k = append ? krn->vector_add : krn->vector_set;
+
+            ngroups = std::min(ngroups, (n + ls / vwidth - 1) / (ls / vwidth));
+
+            uint pos = 0;
+            k.setArg(pos++, n);
+            k.setArg(pos++, vwidth);
+            k.setArg(pos++, loc.row);
+            k.setArg(pos++, loc.col);
+            k.setArg(pos++, loc.val);
+            k.setArg(pos++, x);
+            k.setArg(pos++, y);
+            k.setArg(pos++, alpha);
+
+            queue.enqueueNDRangeKernel(k, cl::NullRange, ngroups * ls, ls, 0, event_trace<>::kernel(queue, k));
+        } else if (method == csr_kernel::merge) {
+            cl::Kernel &k = append ? krn->merge_add : krn->merge_set;
 
-    if (has_loc) {
+            uint pos = 0;
+            k.setArg(pos++, n);
+            k.setArg(pos++, loc_nnz);
+            k.setArg(pos++, loc.row);
+            k.setArg(pos++, loc.col);
+            k.setArg(pos++, loc.val);
+            k.setArg(pos++, x);
+            k.setArg(pos++, y);
+            k.setArg(pos++, alpha);
+            k.setArg(pos++, carry_row);
+            k.setArg(pos++, carry_val);
+
+            queue.enqueueNDRangeKernel(k, cl::NullRange, ntiles * ls, ls, 0, event_trace<>::kernel(queue, k));
+
+            // Rows crossing tile boundaries get the carries of the tiles
+            // before the one they end in. The last tile ends the path.
+            if (ntiles > 1) {
+                pos = 0;
+                krn->merge_fixup.setArg(pos++, n);
+                krn->merge_fixup.setArg(pos++, ntiles);
+                krn->merge_fixup.setArg(pos++, carry_row);
+                krn->merge_fixup.setArg(pos++, carry_val);
+                krn->merge_fixup.setArg(pos++, y);
+                krn->merge_fixup.setArg(pos++, alpha);
+
+                queue.enqueueNDRangeKernel(krn->merge_fixup, cl::NullRange, ls, ls, 0,
+                        event_trace<>::kernel(queue, krn->merge_fixup));
+            }
+        } else {
+            cl::Kernel &k = append ? krn->adaptive_add : krn->adaptive_set;
+
+            ngroups = std::min(ngroups, nblocks);
+
+            uint pos = 0;
+            k.setArg(pos++, nblocks);
+            k.setArg(pos++, blocks);
+            k.setArg(pos++, loc.row);
+            k.setArg(pos++, loc.col);
+            k.setArg(pos++, loc.val);
+            k.setArg(pos++, x);
+            k.setArg(pos++, y);
+            k.setArg(pos++, alpha);
+
+            queue.enqueueNDRangeKernel(k, cl::NullRange, ngroups * ls, ls, 0, event_trace<>::kernel(queue, k));
+        }
+    } else if (has_loc) {
         if (append) {
             uint pos = 0;
-            spmv_add[context()].setArg(pos++, n);
-            spmv_add[context()].setArg(pos++, loc.row);
-            spmv_add[context()].setArg(pos++, loc.col);
-            spmv_add[context()].setArg(pos++, loc.val);
-            spmv_add[context()].setArg(pos++, x);
-            spmv_add[context()].setArg(pos++, y);
-            spmv_add[context()].setArg(pos++, alpha);
-
-            queue.enqueueNDRangeKernel(spmv_add[context()],
-                    cl::NullRange, n, cl::NullRange);
+            krn->spmv_add.setArg(pos++, n);
+            krn->spmv_add.setArg(pos++, loc.row);
+            krn->spmv_add.setArg(pos++, loc.col);
+            krn->spmv_add.setArg(pos++, loc.val);
+            krn->spmv_add.setArg(pos++, x);
+            krn->spmv_add.setArg(pos++, y);
+            krn->spmv_add.setArg(pos++, alpha);
+
+            queue.enqueueNDRangeKernel(krn->spmv_add,
+                    cl::NullRange, n, cl::NullRange, 0, event_trace<>::kernel(queue, krn->spmv_add));
         } else {
             uint pos = 0;
-            spmv_set[context()].setArg(pos++, n);
-            spmv_set[context()].setArg(pos++, loc.row);
-            spmv_set[context()].setArg(pos++, loc.col);
-            spmv_set[context()].setArg(pos++, loc.val);
-            spmv_set[context()].setArg(pos++, x);
-            spmv_set[context()].setArg(pos++, y);
-            spmv_set[context()].setArg(pos++, alpha);
-
-            queue.enqueueNDRangeKernel(spmv_set[context()],
-                    cl::NullRange, n, cl::NullRange);
+            krn->spmv_set.setArg(pos++, n);
+            krn->spmv_set.setArg(pos++, loc.row);
+            krn->spmv_set.setArg(pos++, loc.col);
+            krn->spmv_set.setArg(pos++, loc.val);
+            krn->spmv_set.setArg(pos++, x);
+            krn->spmv_set.setArg(pos++, y);
+            krn->spmv_set.setArg(pos++, alpha);
+
+            queue.enqueueNDRangeKernel(krn->spmv_set,
+                    cl::NullRange, n, cl::NullRange, 0, event_trace<>::kernel(queue, krn->spmv_set));
         }
     } else if (!append) {
         uint pos = 0;
-        zero[context()].setArg(pos++, n);
-        zero[context()].setArg(pos++, y);
+        krn->zero.setArg(pos++, n);
+        krn->zero.setArg(pos++, y);
 
-        queue.enqueueNDRangeKernel(zero[context()],
-                cl::NullRange, n, cl::NullRange);
+        queue.enqueueNDRangeKernel(krn->zero,
+                cl::NullRange, n, cl::NullRange, 0, event_trace<>::kernel(queue, krn->zero));
     }
 }
 
-template <typename real, typename column_t, typename idx_t>
-void SpMat<real,column_t,idx_t>::SpMatCSR::mul_remote(
+template <typename real, typename column_t, typename idx_t, typename val_t>
+void SpMat<real,column_t,idx_t,val_t>::SpMatCSR::mul_remote(
         const cl::Buffer &x, const cl::Buffer &y,
         real alpha, const std::vector<cl::Event> &event
         ) const
 {
     if (!has_rem) return;
 
+    uint pos = 0;
+    krn->spmv_add.setArg(pos++, n);
+    krn->spmv_add.setArg(pos++, rem.row);
+    krn->spmv_add.setArg(pos++, rem.col);
+    krn->spmv_add.setArg(pos++, rem.val);
+    krn->spmv_add.setArg(pos++, x);
+    krn->spmv_add.setArg(pos++, y);
+    krn->spmv_add.setArg(pos++, alpha);
+
+    queue.enqueueNDRangeKernel(krn->spmv_add,
+            cl::NullRange, n, cl::NullRange, &event, event_trace<>::kernel(queue, krn->spmv_add)
+            );
+}
+
+template <typename real, typename column_t, typename idx_t, typename val_t>
+void SpMat<real,column_t,idx_t,val_t>::SpMatCSR::mul_transposed(
+        const transposed_kernels &k,
+        const cl::Buffer &x, const cl::Buffer &y,
+        const cl::Buffer &ghosts, real alpha
+        ) const
+{
+    for(int r = 0; r < 2; r++) {
+        if (!(r ? has_rem : has_loc)) continue;
+
+        uint pos = 0;
+        k.csr.setArg(pos++, n);
+        k.csr.setArg(pos++, r ? rem.row : loc.row);
+        k.csr.setArg(pos++, r ? rem.col : loc.col);
+        k.csr.setArg(pos++, r ? rem.val : loc.val);
+        k.csr.setArg(pos++, x);
+        k.csr.setArg(pos++, r ? ghosts : y);
+        k.csr.setArg(pos++, alpha);
+
+        queue.enqueueNDRangeKernel(k.csr, cl::NullRange, k.g_size, k.wgsize,
+                0, event_trace<>::kernel(queue, k.csr));
+    }
+}
+
+template <typename real, typename column_t, typename idx_t, typename val_t>
+void SpMat<real,column_t,idx_t,val_t>::SpMatCSR::mul_local_block(
+        const std::vector<cl::Buffer> &x, const std::vector<cl::Buffer> &y,
+        real alpha, bool append
+        ) const
+{
+    // Long rows are better served by the vector kernels, one vector at a
+    // time.
+    if (!has_loc || method != csr_kernel::scalar) {
+        for(size_t i = 0; i < x.size(); i++)
+            mul_local(x[i], y[i], alpha, append);
+        return;
+    }
+
+    for(size_t first = 0; first < x.size(); first += block_width) {
+        uint width = static_cast<uint>(std::min<size_t>(block_width, x.size() - first));
+
+        std::shared_ptr<block_kernels> bk = get_block_kernels(queue, width);
+        cl::Kernel &k = append ? bk->csr_add : bk->csr_set;
+
+        size_t g_size = qdev(queue).getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>()
+            * bk->wgsize * 4;
+
+        uint pos = 0;
+        k.setArg(pos++, n);
+        k.setArg(pos++, loc.row);
+        k.setArg(pos++, loc.col);
+        k.setArg(pos++, loc.val);
+        k.setArg(pos++, alpha);
+        set_block_args(k, pos, x, y, first, width);
+
+        queue.enqueueNDRangeKernel(k, cl::NullRange, g_size, bk->wgsize, 0,
+                event_trace<>::kernel(queue, k));
+    }
+}
+
+//---------------------------------------------------------------------------
+// SpMat::SpMatSELL
+//---------------------------------------------------------------------------
+template <typename real, typename column_t, typename idx_t, typename val_t>
+const column_t SpMat<real,column_t,idx_t,val_t>::SpMatSELL::ncol;
+
+template <typename real, typename column_t, typename idx_t, typename val_t>
+const uint SpMat<real,column_t,idx_t,val_t>::SpMatSELL::sigma_chunks;
+
+template <typename real, typename column_t, typename idx_t, typename val_t>
+SpMat<real,column_t,idx_t,val_t>::SpMatSELL::SpMatSELL(
+        const cl::CommandQueue &queue,
+        size_t beg, size_t end, column_t xbeg, column_t xend,
+        const idx_t *row, const column_t *col, const real *val,
+        const std::vector<column_t> &remote_cols
+        )
+    : queue(queue), n(end - beg)
+{
+    prepare_kernels(qctx(queue));
+
+    // Split the strip into local and remote CSR parts.
+    std::vector<idx_t>    lrow, rrow;
+    std::vector<column_t> lcol, rcol;
+    std::vector<val_t>    lval, rval;
+
+    lrow.reserve(n + 1);
+    lrow.push_back(0);
+
+    lcol.reserve(row[end] - row[beg]);
+    lval.reserve(row[end] - row[beg]);
+
+    if (!remote_cols.empty()) {
+        rrow.reserve(n + 1);
+        rrow.push_back(0);
+    }
+
+    // Renumber columns.
+    std::unordered_map<column_t,column_t> r2l(2 * remote_cols.size());
+    for(auto c = remote_cols.begin(); c != remote_cols.end(); c++) {
+        size_t idx = r2l.size();
+        r2l[*c] = idx;
+    }
+
+    for(size_t i = beg; i < end; i++) {
+        for(idx_t j = row[i]; j < row[i + 1]; j++) {
+            if (col[j] >= xbeg && col[j] < xend) {
+                lcol.push_back(col[j] - xbeg);
+                lval.push_back(val[j]);
+            } else {
+                assert(r2l.count(col[j]));
+                rcol.push_back(r2l[col[j]]);
+                rval.push_back(val[j]);
+            }
+        }
+
+        lrow.push_back(lcol.size());
+        if (!remote_cols.empty()) rrow.push_back(rcol.size());
+    }
+
+    // Every row of the local part is stored, so that spmv_set writes every
+    // element of y. Only nonempty rows of the remote part are stored.
+    setup(loc, n, true, lrow, lcol, lval);
+
+    if (remote_cols.empty())
+        rem.n = 0;
+    else
+        setup(rem, n, false, rrow, rcol, rval);
+}
+
+template <typename real, typename column_t, typename idx_t, typename val_t>
+void SpMat<real,column_t,idx_t,val_t>::SpMatSELL::setup(
+        slices &s, size_t nrows, bool all_rows,
+        const std::vector<idx_t>    &row,
+        const std::vector<column_t> &col,
+        const std::vector<val_t>    &val
+        )
+{
+    const size_t C     = krn->chunk;
+    const size_t sigma = C * sigma_chunks;
+
+    std::vector<column_t> perm;
+    perm.reserve(nrows);
+
+    for(size_t i = 0; i < nrows; i++)
+        if (all_rows || row[i + 1] > row[i]) perm.push_back(i);
+
+    s.n = perm.size();
+    if (!s.n) return;
+
+    // Sort rows by length inside sigma-windows, so that rows of similar
+    // length end up in the same chunk.
+    for(size_t w = 0; w < s.n; w += sigma)
+        std::stable_sort(
+                perm.begin() + w, perm.begin() + std::min(w + sigma, s.n),
+                [&row](column_t a, column_t b) {
+                    return row[a + 1] - row[a] > row[b + 1] - row[b];
+                });
+
+    // Each chunk of C rows is stored in column-major order padded to the
+    // length of its longest (first) row.
+    size_t nchunks = (s.n + C - 1) / C;
+
+    std::vector<idx_t> start(nchunks + 1);
+    start[0] = 0;
+    for(size_t c = 0; c < nchunks; c++) {
+        column_t i = perm[c * C];
+        start[c + 1] = start[c] + (row[i + 1] - row[i]) * C;
+    }
+
+    std::vector<column_t> scol(start.back(), ncol);
+    std::vector<val_t>    sval(start.back(), 0);
+
+    for(size_t k = 0; k < s.n; k++) {
+        column_t i = perm[k];
+        size_t   p = start[k / C] + k % C;
+
+        for(idx_t j = row[i]; j < row[i + 1]; j++, p += C) {
+            scol[p] = col[j];
+            sval[p] = val[j];
+        }
+    }
+
+    // Keep the buffers valid for all-empty parts.
+    if (scol.empty()) {
+        scol.push_back(ncol);
+        sval.push_back(val_t(0));
+    }
+
     cl::Context context = qctx(queue);
 
+    s.start = memory_pool<>::create("spmat", context, CL_MEM_READ_ONLY, bytes(start));
+    s.perm  = memory_pool<>::create("spmat", context, CL_MEM_READ_ONLY, bytes(perm));
+    s.col   = memory_pool<>::create("spmat", context, CL_MEM_READ_ONLY, bytes(scol));
+    s.val   = memory_pool<>::create("spmat", context, CL_MEM_READ_ONLY, bytes(sval));
+
+    queue.enqueueWriteBuffer(s.start, CL_FALSE, 0, bytes(start), start.data());
+    queue.enqueueWriteBuffer(s.perm,  CL_FALSE, 0, bytes(perm),  perm.data());
+    queue.enqueueWriteBuffer(s.col,   CL_FALSE, 0, bytes(scol),  scol.data());
+    queue.enqueueWriteBuffer(s.val,   CL_TRUE,  0, bytes(sval),  sval.data());
+}
+
+template <typename real, typename column_t, typename idx_t, typename val_t>
+void SpMat<real,column_t,idx_t,val_t>::SpMatSELL::prepare_kernels(const cl::Context &context) {
+    krn = kernel_cache<>::find<kernels>(queue);
+
+    if (!krn) {
+        std::ostringstream source;
+
+        source << standard_kernel_header <<
+            "typedef " << type_name<real>() << " real;\n"
+            "#define VAL(i) " << spmat_load<val_t>("val", "(i)") << "\n"
+            "#define NCOL ((" << type_name<column_t>() << ")(-1))\n";
+
+        for(int append = 0; append < 2; append++) {
+            source <<
+                "kernel void " << (append ? "spmv_add" : "spmv_set") << "(\n"
+                "    " << type_name<size_t>() << " n, uint C,\n"
+                "    global const " << type_name<idx_t>() << " *start,\n"
+                "    global const " << type_name<column_t>() << " *perm,\n"
+                "    global const " << type_name<column_t>() << " *col,\n"
+                "    global const " << type_name<val_t>() << " *val,\n"
+                "    global const real * restrict x,\n"
+                "    global real *y,\n"
+                "    real alpha\n"
+                "    )\n"
+                "{\n"
+                "    size_t grid_size = get_global_size(0);\n"
+                "    for (size_t i = get_global_id(0); i < n; i += grid_size) {\n"
+                "        size_t chunk = i / C;\n"
+                "        size_t beg   = start[chunk];\n"
+                "        size_t w     = (start[chunk + 1] - beg) / C;\n"
+                "        beg += i % C;\n"
+                "        real sum = 0;\n"
+                "        for(size_t j = 0; j < w; j++, beg += C) {\n"
+                "            " << type_name<column_t>() << " c = col[beg];\n"
+                "            if (c != NCOL) sum += VAL(beg) * x[c];\n"
+                "        }\n"
+                "        y[perm[i]] " << (append ? "+=" : "=") << " alpha * sum;\n"
+                "    }\n"
+                "}\n";
+        }
+
+        auto program = build_sources(context, source.str());
+
+        kernels k;
+
+        k.spmv_set = cl::Kernel(program, "spmv_set");
+        k.spmv_add = cl::Kernel(program, "spmv_add");
+
+        cl::Device device = qdev(queue);
+
+        k.wgsize = std::min(
+                kernel_workgroup_size(k.spmv_set, device),
+                kernel_workgroup_size(k.spmv_add, device)
+                );
+
+        // Chunk height is the wavefront width, so that a wavefront works on
+        // a single chunk.
+        k.chunk = std::min<uint>(k.wgsize, static_cast<uint>(
+                k.spmv_set.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device)));
+
+        k.wgsize = k.wgsize / k.chunk * k.chunk;
+
+        krn = kernel_cache<>::insert(queue, k);
+    }
+}
+
+template <typename real, typename column_t, typename idx_t, typename val_t>
+void SpMat<real,column_t,idx_t,val_t>::SpMatSELL::spmv(
+        const slices &s, const cl::Buffer &x, const cl::Buffer &y,
+        real alpha, bool append, const std::vector<cl::Event> *event
+        ) const
+{
+    cl::Device device = qdev(queue);
+
+    size_t g_size = device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>()
+        * krn->wgsize * 4;
+
+    cl::Kernel &kernel = append ? krn->spmv_add : krn->spmv_set;
+
     uint pos = 0;
-    spmv_add[context()].setArg(pos++, n);
-    spmv_add[context()].setArg(pos++, rem.row);
-    spmv_add[context()].setArg(pos++, rem.col);
-    spmv_add[context()].setArg(pos++, rem.val);
-    spmv_add[context()].setArg(pos++, x);
-    spmv_add[context()].setArg(pos++, y);
-    spmv_add[context()].setArg(pos++, alpha);
-
-    queue.enqueueNDRangeKernel(spmv_add[context()],
-            cl::NullRange, n, cl::NullRange, &event
-            );
+    kernel.setArg(pos++, s.n);
+    kernel.setArg(pos++, krn->chunk);
+    kernel.setArg(pos++, s.start);
+    kernel.setArg(pos++, s.perm);
+    kernel.setArg(pos++, s.col);
+    kernel.setArg(pos++, s.val);
+    kernel.setArg(pos++, x);
+    kernel.setArg(pos++, y);
+    kernel.setArg(pos++, alpha);
+
+    queue.enqueueNDRangeKernel(kernel,
+            cl::NullRange, g_size, krn->wgsize, event, event_trace<>::kernel(queue, kernel));
+}
+
+template <typename real, typename column_t, typename idx_t, typename val_t>
+void SpMat<real,column_t,idx_t,val_t>::SpMatSELL::mul_local(
+        const cl::Buffer &x, const cl::Buffer &y,
+        real alpha, bool append
+        ) const
+{
+    spmv(loc, x, y, alpha, append);
+}
+
+template <typename real, typename column_t, typename idx_t, typename val_t>
+void SpMat<real,column_t,idx_t,val_t>::SpMatSELL::mul_remote(
+        const cl::Buffer &x, const cl::Buffer &y,
+        real alpha, const std::vector<cl::Event> &event
+        ) const
+{
+    if (rem.n) spmv(rem, x, y, alpha, true, &event);
+}
+
+template <typename real, typename column_t, typename idx_t, typename val_t>
+void SpMat<real,column_t,idx_t,val_t>::SpMatSELL::mul_transposed(
+        const transposed_kernels &k,
+        const cl::Buffer &x, const cl::Buffer &y,
+        const cl::Buffer &ghosts, real alpha
+        ) const
+{
+    for(int r = 0; r < 2; r++) {
+        const slices &s = r ? rem : loc;
+        if (!s.n) continue;
+
+        uint pos = 0;
+        k.sell.setArg(pos++, s.n);
+        k.sell.setArg(pos++, krn->chunk);
+        k.sell.setArg(pos++, s.start);
+        k.sell.setArg(pos++, s.perm);
+        k.sell.setArg(pos++, s.col);
+        k.sell.setArg(pos++, s.val);
+        k.sell.setArg(pos++, x);
+        k.sell.setArg(pos++, r ? ghosts : y);
+        k.sell.setArg(pos++, alpha);
+
+        queue.enqueueNDRangeKernel(k.sell, cl::NullRange, k.g_size, k.wgsize,
+                0, event_trace<>::kernel(queue, k.sell));
+    }
 }
 
 /// Sparse matrix in CCSR format.
@@ -1365,7 +4007,7 @@ class SpMatCCSR : matrix_terminal {
         void mul(const vex::vector<real> &x, vex::vector<real> &y,
                 real alpha = 1, bool append = false) const;
     private:
-        void prepare_kernels(const cl::Context &context) const;
+        void prepare_kernels(const cl::Context &context);
 
         void mul_local(
                 const cl::Buffer &x, const cl::Buffer &y,
@@ -1383,23 +4025,14 @@ class SpMatCCSR : matrix_terminal {
             cl::Buffer val;
         } mtx;
 
-        static std::map<cl_context, bool>       compiled;
-        static std::map<cl_context, cl::Kernel> spmv_set;
-        static std::map<cl_context, cl::Kernel> spmv_add;
-        static std::map<cl_context, uint>       wgsize;
-};
-
-template <typename real, typename column_t, typename idx_t>
-std::map<cl_context, bool> SpMatCCSR<real,column_t,idx_t>::compiled;
-
-template <typename real, typename column_t, typename idx_t>
-std::map<cl_context, cl::Kernel> SpMatCCSR<real,column_t,idx_t>::spmv_set;
-
-template <typename real, typename column_t, typename idx_t>
-std::map<cl_context, cl::Kernel> SpMatCCSR<real,column_t,idx_t>::spmv_add;
+        struct kernels {
+            cl::Kernel spmv_set;
+            cl::Kernel spmv_add;
+            uint       wgsize;
+        };
 
-template <typename real, typename column_t, typename idx_t>
-std::map<cl_context, uint> SpMatCCSR<real,column_t,idx_t>::wgsize;
+        std::shared_ptr<kernels> krn;
+};
 
 template <typename real, typename column_t, typename idx_t>
 SpMatCCSR<real,column_t,idx_t>::SpMatCCSR(
@@ -1416,10 +4049,10 @@ SpMatCCSR<real,column_t,idx_t>::SpMatCCSR(
 
     prepare_kernels(context);
 
-    mtx.idx = cl::Buffer(context, CL_MEM_READ_ONLY, n * sizeof(idx_t));
-    mtx.row = cl::Buffer(context, CL_MEM_READ_ONLY, (m + 1) * sizeof(idx_t));
-    mtx.col = cl::Buffer(context, CL_MEM_READ_ONLY, row[m] * sizeof(column_t));
-    mtx.val = cl::Buffer(context, CL_MEM_READ_ONLY, row[m] * sizeof(real));
+    mtx.idx = memory_pool<>::create("spmat", context, CL_MEM_READ_ONLY, n * sizeof(idx_t));
+    mtx.row = memory_pool<>::create("spmat", context, CL_MEM_READ_ONLY, (m + 1) * sizeof(idx_t));
+    mtx.col = memory_pool<>::create("spmat", context, CL_MEM_READ_ONLY, row[m] * sizeof(column_t));
+    mtx.val = memory_pool<>::create("spmat", context, CL_MEM_READ_ONLY, row[m] * sizeof(real));
 
     queue.enqueueWriteBuffer(mtx.idx, CL_FALSE, 0, n * sizeof(idx_t), idx);
     queue.enqueueWriteBuffer(mtx.row, CL_FALSE, 0, (m + 1) * sizeof(idx_t), row);
@@ -1428,8 +4061,10 @@ SpMatCCSR<real,column_t,idx_t>::SpMatCCSR(
 }
 
 template <typename real, typename column_t, typename idx_t>
-void SpMatCCSR<real,column_t,idx_t>::prepare_kernels(const cl::Context &context) const {
-    if (!compiled[context()]) {
+void SpMatCCSR<real,column_t,idx_t>::prepare_kernels(const cl::Context &context) {
+    krn = kernel_cache<>::find<kernels>(queue);
+
+    if (!krn) {
         std::ostringstream source;
 
         source << standard_kernel_header <<
@@ -1440,7 +4075,7 @@ void SpMatCCSR<real,column_t,idx_t>::prepare_kernels(const cl::Context &context)
             "    global const " << type_name<idx_t>() << " *row,\n"
             "    global const " << type_name<column_t>() << " *col,\n"
             "    global const real *val,\n"
-            "    global const real *x,\n"
+            "    global const real * restrict x,\n"
             "    global real *y,\n"
             "    real alpha\n"
             "    )\n"
@@ -1462,7 +4097,7 @@ void SpMatCCSR<real,column_t,idx_t>::prepare_kernels(const cl::Context &context)
             "    global const " << type_name<idx_t>() << " *row,\n"
             "    global const " << type_name<column_t>() << " *col,\n"
             "    global const real *val,\n"
-            "    global const real *x,\n"
+            "    global const real * restrict x,\n"
             "    global real *y,\n"
             "    real alpha\n"
             "    )\n"
@@ -1481,17 +4116,19 @@ void SpMatCCSR<real,column_t,idx_t>::prepare_kernels(const cl::Context &context)
 
         auto program = build_sources(context, source.str());
 
-        spmv_set[context()] = cl::Kernel(program, "spmv_set");
-        spmv_add[context()] = cl::Kernel(program, "spmv_add");
+        kernels k;
+
+        k.spmv_set = cl::Kernel(program, "spmv_set");
+        k.spmv_add = cl::Kernel(program, "spmv_add");
 
-        std::vector<cl::Device> device = context.getInfo<CL_CONTEXT_DEVICES>();
+        cl::Device device = qdev(queue);
 
-        wgsize[context()] = std::min(
-                kernel_workgroup_size(spmv_set[context()], device[0]),
-                kernel_workgroup_size(spmv_add[context()], device[0])
+        k.wgsize = std::min(
+                kernel_workgroup_size(k.spmv_set, device),
+                kernel_workgroup_size(k.spmv_add, device)
                 );
 
-        compiled[context()] = true;
+        krn = kernel_cache<>::insert(queue, k);
     }
 }
 
@@ -1501,43 +4138,68 @@ void SpMatCCSR<real,column_t,idx_t>::mul(
         real alpha, bool append
         ) const
 {
-    cl::Context context = qctx(queue);
-
     if (append) {
         uint pos = 0;
-        spmv_add[context()].setArg(pos++, n);
-        spmv_add[context()].setArg(pos++, mtx.idx);
-        spmv_add[context()].setArg(pos++, mtx.row);
-        spmv_add[context()].setArg(pos++, mtx.col);
-        spmv_add[context()].setArg(pos++, mtx.val);
-        spmv_add[context()].setArg(pos++, x());
-        spmv_add[context()].setArg(pos++, y());
-        spmv_add[context()].setArg(pos++, alpha);
-
-        queue.enqueueNDRangeKernel(spmv_add[context()],
-                cl::NullRange, n, cl::NullRange);
+        krn->spmv_add.setArg(pos++, n);
+        krn->spmv_add.setArg(pos++, mtx.idx);
+        krn->spmv_add.setArg(pos++, mtx.row);
+        krn->spmv_add.setArg(pos++, mtx.col);
+        krn->spmv_add.setArg(pos++, mtx.val);
+        krn->spmv_add.setArg(pos++, x());
+        krn->spmv_add.setArg(pos++, y());
+        krn->spmv_add.setArg(pos++, alpha);
+
+        queue.enqueueNDRangeKernel(krn->spmv_add,
+                cl::NullRange, n, cl::NullRange, 0, event_trace<>::kernel(queue, krn->spmv_add));
     } else {
         uint pos = 0;
-        spmv_set[context()].setArg(pos++, n);
-        spmv_set[context()].setArg(pos++, mtx.idx);
-        spmv_set[context()].setArg(pos++, mtx.row);
-        spmv_set[context()].setArg(pos++, mtx.col);
-        spmv_set[context()].setArg(pos++, mtx.val);
-        spmv_set[context()].setArg(pos++, x());
-        spmv_set[context()].setArg(pos++, y());
-        spmv_set[context()].setArg(pos++, alpha);
-
-        queue.enqueueNDRangeKernel(spmv_set[context()],
-                cl::NullRange, n, cl::NullRange);
+        krn->spmv_set.setArg(pos++, n);
+        krn->spmv_set.setArg(pos++, mtx.idx);
+        krn->spmv_set.setArg(pos++, mtx.row);
+        krn->spmv_set.setArg(pos++, mtx.col);
+        krn->spmv_set.setArg(pos++, mtx.val);
+        krn->spmv_set.setArg(pos++, x());
+        krn->spmv_set.setArg(pos++, y());
+        krn->spmv_set.setArg(pos++, alpha);
+
+        queue.enqueueNDRangeKernel(krn->spmv_set,
+                cl::NullRange, n, cl::NullRange, 0, event_trace<>::kernel(queue, krn->spmv_set));
     }
 }
 
+#ifdef VEXCL_MULTIVECTOR_HPP
+
+/// \cond INTERNAL
+
+/// SpMat times multivector with the fused block kernels.
+template <typename real, typename column_t, typename idx_t, typename val_t, class V, class W>
+void spmm(const SpMat<real,column_t,idx_t,val_t> &A, const V &x, W &y,
+        typename SpMat<real,column_t,idx_t,val_t>::value_type alpha, bool append)
+{
+    std::vector<const vector<real>*> xp(number_of_components<V>::value);
+    std::vector<vector<real>*>       yp(number_of_components<V>::value);
+
+    for(size_t i = 0; i < xp.size(); i++) {
+        xp[i] = &x(i);
+        yp[i] = &y(i);
+    }
+
+    A.mul_block(xp, yp, alpha, append);
+}
+
+/// \endcond
+
+#endif
+
 /// Returns device weight after spmv test
 inline double device_spmv_perf(const cl::CommandQueue &q) {
     static const size_t test_size = 64U;
 
     std::vector<cl::CommandQueue> queue(1, q);
 
+    double w;
+    if (device_properties<>::load(qdev(q), "spmv perf", w)) return w;
+
     // Construct matrix for 3D Poisson problem in cubic domain.
     const size_t n   = test_size;
     const float  h2i = (n - 1.0f) * (n - 1.0f);
@@ -1606,7 +4268,10 @@ inline double device_spmv_perf(const cl::CommandQueue &q) {
     prof.tic_cl("");
     A.mul(x, y);
     double time = prof.toc("");
-    return 1.0 / time;
+
+    w = 1.0 / time;
+    device_properties<>::store(qdev(q), "spmv perf", w);
+    return w;
 }
 
 } // namespace vex
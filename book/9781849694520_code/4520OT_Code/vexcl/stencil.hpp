@@ -38,10 +38,13 @@ THE SOFTWARE.
 #endif
 
 #include <vector>
+#include <array>
 #include <map>
+#include <algorithm>
 #include <sstream>
 #include <cassert>
 #include <vexcl/vector.hpp>
+#include <vexcl/kernel_cache.hpp>
 
 namespace vex {
 
@@ -100,6 +103,261 @@ struct is_scalable< multiconv<S, V> > : std::true_type {};
 
 #endif
 
+// Halos of vector parts, shared by all stencils of a value type.
+//
+// For the part of a vector on one device, an entry holds the widest left and
+// right halos fetched so far, padded at the ends of the vector the way the
+// stencil kernels expect. It stays valid while the vector keeps the write
+// version it was fetched at (see vector::version()), so a gradient in three
+// directions, or any other set of stencils applied to an unchanged vector,
+// transfers the halos once. Define VEXCL_NO_HALO_CACHE to fetch them on
+// every convolution.
+//
+// Halos are copied directly from the neighbours when they share a context
+// with the device. Otherwise they are staged in host memory, and the write to
+// the device waits on a user event for the read from the neighbour. Either
+// way the host does not wait, and the stencil kernels are ordered after the
+// transfers by their queues.
+template <typename T>
+class halo_cache {
+    public:
+        // Copies halos of part d of x into halo, in the queue of a stencil:
+        // lhalo elements left of the part to the start, rhalo elements right
+        // of it at roffset.
+        static void fetch(const vector<T> &x, uint d, int lhalo, int rhalo,
+                const cl::CommandQueue &q, const cl::Buffer &halo, int roffset)
+        {
+            entry &h = lookup(x, d, lhalo, rhalo);
+
+            if (h.readers.size() >= 8)
+                h.readers.erase(std::remove_if(h.readers.begin(), h.readers.end(),
+                            [](const cl::Event &r) {
+                                return r.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() == CL_COMPLETE;
+                            }), h.readers.end());
+
+            std::vector<cl::Event> wait(h.ready);
+
+            if (lhalo) {
+                cl::Event e;
+                q.enqueueCopyBuffer(h.left, halo, (h.lhalo - lhalo) * sizeof(T), 0,
+                        lhalo * sizeof(T), wait.empty() ? 0 : &wait, &e);
+                event_trace<>::add(q, "halo", e);
+                h.readers.push_back(e);
+            }
+
+            if (rhalo) {
+                cl::Event e;
+                q.enqueueCopyBuffer(h.right, halo, 0, roffset * sizeof(T),
+                        rhalo * sizeof(T), wait.empty() ? 0 : &wait, &e);
+                event_trace<>::add(q, "halo", e);
+                h.readers.push_back(e);
+            }
+        }
+    private:
+        struct entry {
+            size_t         version;
+            size_t         used;         // last use, for eviction
+            int            lhalo, rhalo; // widths held
+            cl::Buffer     left, right;  // on the device of the part
+            std::vector<T> host;         // staging, without a shared context
+            bool           staged;
+
+            std::vector<cl::Event> ready;   // writes of left and right
+            std::vector<cl::Event> readers; // copies out of left and right
+
+            entry() : version(0), used(0), lhalo(0), rhalo(0), staged(false) {}
+
+            // The staging memory may only be reused or freed once written.
+            void drain() {
+                if (staged)
+                    for(auto e = ready.begin(); e != ready.end(); e++) e->wait();
+                staged = false;
+            }
+        };
+
+        static const size_t max_entries = 64;
+
+        static std::map<cl_mem, entry>& entries() {
+            static std::map<cl_mem, entry> e;
+            return e;
+        }
+
+        static size_t tick() {
+            static size_t t = 0;
+            return ++t;
+        }
+
+        static entry& lookup(const vector<T> &x, uint d, int lhalo, int rhalo) {
+            std::map<cl_mem, entry> &cache = entries();
+
+            cl_mem key = x(d)();
+            auto i = cache.find(key);
+
+            if (i == cache.end()) {
+                if (cache.size() >= max_entries) {
+                    auto lru = cache.begin();
+                    for(auto c = cache.begin(); c != cache.end(); c++)
+                        if (c->second.used < lru->second.used) lru = c;
+                    lru->second.drain();
+                    cache.erase(lru);
+                }
+                i = cache.insert(std::make_pair(key, entry())).first;
+            }
+
+            entry &h = i->second;
+            h.used = tick();
+
+#ifndef VEXCL_NO_HALO_CACHE
+            if (x.version() && h.version == x.version() &&
+                    h.lhalo >= lhalo && h.rhalo >= rhalo)
+                return h;
+#endif
+
+            refill(x, d, std::max(lhalo, h.lhalo), std::max(rhalo, h.rhalo), h);
+            return h;
+        }
+
+        static void refill(const vector<T> &x, uint d, int lhalo, int rhalo, entry &h) {
+            const std::vector<cl::CommandQueue> &queue = x.queue_list();
+            cl::Context context = qctx(queue[d]);
+
+            h.drain();
+
+            if (lhalo && (h.lhalo < lhalo || !h.left()))
+                h.left  = memory_pool<>::create("stencil",
+                        context, CL_MEM_READ_WRITE, lhalo * sizeof(T));
+            if (rhalo && (h.rhalo < rhalo || !h.right()))
+                h.right = memory_pool<>::create("stencil",
+                        context, CL_MEM_READ_WRITE, rhalo * sizeof(T));
+            h.host.resize(lhalo + rhalo);
+
+            std::vector<cl::Event> ready;
+
+            if (lhalo) {
+                size_t end   = x.part_start(d);
+                size_t begin = end >= static_cast<size_t>(lhalo) ? end - lhalo : 0;
+                size_t size  = end - begin;
+
+                transfer(x, d, begin, end, h.left, lhalo - size, 0, h, ready);
+
+                // Past the start of the vector the first element is repeated.
+                if (size < static_cast<size_t>(lhalo))
+                    replicate(x, d, begin, h.left, 0, lhalo - size, 0, h, ready);
+            }
+
+            if (rhalo) {
+                size_t begin = x.part_start(d + 1);
+                size_t end   = std::min(begin + rhalo, x.size());
+                size_t size  = end - begin;
+
+                transfer(x, d, begin, end, h.right, 0, lhalo, h, ready);
+
+                // Past the end of the vector the last element is repeated.
+                if (size < static_cast<size_t>(rhalo))
+                    replicate(x, d, end - 1, h.right, size, rhalo - size, lhalo, h, ready);
+            }
+
+            h.ready.swap(ready);
+            h.readers.clear();
+            h.lhalo   = lhalo;
+            h.rhalo   = rhalo;
+            h.version = x.version();
+        }
+
+        // Copies elements [begin, end) of x to dst from position pos on, i.e.
+        // to host[base + pos] first when staged. Writes have to wait for the
+        // copies out of the previous halos.
+        static void transfer(const vector<T> &x, uint d, size_t begin, size_t end,
+                const cl::Buffer &dst, size_t pos, size_t base, entry &h,
+                std::vector<cl::Event> &ready)
+        {
+            const std::vector<cl::CommandQueue> &queue = x.queue_list();
+            cl::Context context = qctx(queue[d]);
+
+            for(uint s = 0; s < queue.size(); s++) {
+                size_t lo = std::max(begin, x.part_start(s));
+                size_t hi = std::min(end,   x.part_start(s) + x.part_size(s));
+
+                if (lo >= hi) continue;
+
+                size_t src   = (lo - x.part_start(s)) * sizeof(T);
+                size_t to    = pos + lo - begin;
+                size_t bytes = (hi - lo) * sizeof(T);
+
+                std::vector<cl::Event> wait;
+                if (stream_tracking<>::enabled) x.depends(s, false, wait);
+
+                cl::Event e;
+
+                if (qctx(queue[s])() == context()) {
+                    wait.insert(wait.end(), h.readers.begin(), h.readers.end());
+
+                    queue[s].enqueueCopyBuffer(x(s), dst, src, to * sizeof(T), bytes,
+                            wait.empty() ? 0 : &wait, &e);
+                    event_trace<>::add(queue[s], "halo", e);
+
+                    if (stream_tracking<>::enabled) x.track(s, false, e);
+                } else {
+                    T *host = &h.host[base + to];
+                    cl::Event r;
+
+                    queue[s].enqueueReadBuffer(x(s), CL_FALSE, src, bytes, host,
+                            wait.empty() ? 0 : &wait, &r);
+                    event_trace<>::add(queue[s], "halo_read", r);
+
+                    if (stream_tracking<>::enabled) x.track(s, false, r);
+
+                    cl::UserEvent arrived(context);
+
+                    clRetainEvent(arrived());
+                    r.setCallback(CL_COMPLETE, &halo_arrived, arrived());
+                    queue[s].flush();
+
+                    std::vector<cl::Event> wwait(h.readers);
+                    wwait.push_back(arrived);
+
+                    queue[d].enqueueWriteBuffer(dst, CL_FALSE, to * sizeof(T), bytes, host,
+                            &wwait, &e);
+                    event_trace<>::add(queue[d], "halo_write", e);
+
+                    h.staged = true;
+                }
+
+                ready.push_back(e);
+            }
+        }
+
+        // Fills dst[pos, pos + count) with element i of x, doubling the
+        // filled range on the device of the part with each copy.
+        static void replicate(const vector<T> &x, uint d, size_t i,
+                const cl::Buffer &dst, size_t pos, size_t count, size_t base,
+                entry &h, std::vector<cl::Event> &ready)
+        {
+            const cl::CommandQueue &q = x.queue_list()[d];
+
+            transfer(x, d, i, i + 1, dst, pos, base, h, ready);
+
+            for(size_t k = 1; k < count; ) {
+                size_t n = std::min(k, count - k);
+
+                std::vector<cl::Event> wait(ready);
+                cl::Event e;
+
+                q.enqueueCopyBuffer(dst, dst, pos * sizeof(T), (pos + k) * sizeof(T),
+                        n * sizeof(T), &wait, &e);
+
+                ready.push_back(e);
+                k += n;
+            }
+        }
+
+        static void CL_CALLBACK halo_arrived(cl_event, cl_int status, void *data) {
+            cl_event arrived = static_cast<cl_event>(data);
+            clSetUserEventStatus(arrived, status < 0 ? status : CL_COMPLETE);
+            clReleaseEvent(arrived);
+        }
+};
+
 template <typename T>
 class stencil_base {
     protected:
@@ -109,11 +367,11 @@ class stencil_base {
                 uint width, uint center, Iterator begin, Iterator end
                 );
 
+        // Brings the halos of x on every device into dbuf.
         void exchange_halos(const vex::vector<T> &x) const;
 
         const std::vector<cl::CommandQueue> &queue;
 
-        mutable std::vector<T>  hbuf;
         std::vector<cl::Buffer> dbuf;
         std::vector<cl::Buffer> s;
         mutable std::vector<cl::Event> event;
@@ -127,7 +385,7 @@ stencil_base<T>::stencil_base(
         const std::vector<cl::CommandQueue> &queue,
         uint width, uint center, Iterator begin, Iterator end
         )
-    : queue(queue), hbuf(queue.size() * (width - 1)),
+    : queue(queue),
       dbuf(queue.size()), s(queue.size()), event(queue.size()),
       lhalo(center), rhalo(width - center - 1)
 {
@@ -142,7 +400,8 @@ stencil_base<T>::stencil_base(
         cl::Device  device  = qdev(queue[d]);
 
         if (begin != end) {
-            s[d] = cl::Buffer(context, CL_MEM_READ_ONLY, (end - begin) * sizeof(T));
+            s[d] = memory_pool<>::create("stencil",
+                    context, CL_MEM_READ_ONLY, (end - begin) * sizeof(T));
 
             queue[d].enqueueWriteBuffer(s[d], CL_FALSE, 0,
                     (end - begin) * sizeof(T), &begin[0], 0, &event[d]);
@@ -152,12 +411,12 @@ stencil_base<T>::stencil_base(
             // for all events.
             char dummy = 0;
 
-            s[d] = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(char));
+            s[d] = memory_pool<>::create("stencil", context, CL_MEM_READ_ONLY, sizeof(char));
             queue[d].enqueueWriteBuffer(s[d], CL_FALSE, 0, sizeof(char), &dummy, 0, &event[d]);
         }
 
         // Allocate one element more than needed, to be sure size is nonzero.
-        dbuf[d] = cl::Buffer(context, CL_MEM_READ_WRITE, width * sizeof(T));
+        dbuf[d] = memory_pool<>::create("stencil", context, CL_MEM_READ_WRITE, width * sizeof(T));
     }
 
     for(uint d = 0; d < queue.size(); d++) event[d].wait();
@@ -165,68 +424,34 @@ stencil_base<T>::stencil_base(
 
 template <typename T>
 void stencil_base<T>::exchange_halos(const vex::vector<T> &x) const {
-    int width = lhalo + rhalo;
-
-    if ((queue.size() <= 1) || (width <= 0)) return;
+    if ((queue.size() <= 1) || (lhalo + rhalo <= 0)) return;
 
-    // Get halos from neighbours.
     for(uint d = 0; d < queue.size(); d++) {
         if (!x.part_size(d)) continue;
 
-        // Get halo from left neighbour.
-        if (d > 0 && lhalo > 0) {
-            size_t end   = x.part_start(d);
-            size_t begin = end >= static_cast<uint>(lhalo) ?  end - lhalo : 0;
-            size_t size  = end - begin;
-            x.read_data(begin, size, &hbuf[d * width + lhalo - size], CL_FALSE, &event);
-        }
+        int l = d > 0                ? lhalo : 0;
+        int r = d + 1 < queue.size() ? rhalo : 0;
 
-        // Get halo from right neighbour.
-        if (d + 1 < queue.size() && rhalo > 0) {
-            size_t begin = x.part_start(d + 1);
-            size_t end   = std::min(begin + rhalo, x.size());
-            size_t size  = end - begin;
-            x.read_data(begin, size, &hbuf[d * width + lhalo], CL_FALSE, &event);
-        }
+        if (l || r) halo_cache<T>::fetch(x, d, l, r, queue[d], dbuf[d], lhalo);
     }
-
-    // Wait for the end of transfer.
-    for(uint d = 0; d < queue.size(); d++) event[d].wait();
-
-    // Write halos to a local buffer.
-    for(uint d = 0; d < queue.size(); d++) {
-        if (!x.part_size(d)) continue;
-
-        if (d > 0 && lhalo > 0) {
-            size_t end   = x.part_start(d);
-            size_t begin = end >= static_cast<uint>(lhalo) ?  end - lhalo : 0;
-            size_t size  = end - begin;
-            if (size)
-                std::fill(&hbuf[d * width], &hbuf[d * width + lhalo - size], hbuf[d * width + lhalo - size]);
-            else
-                std::fill(&hbuf[d * width], &hbuf[d * width + lhalo - size], static_cast<T>(x[0]));
-        }
-
-        if (d + 1 < queue.size() && rhalo > 0) {
-            size_t begin = x.part_start(d + 1);
-            size_t end   = std::min(begin + rhalo, x.size());
-            size_t size  = end - begin;
-            if (size)
-                std::fill(&hbuf[d * width + lhalo + size], &hbuf[(d + 1) * width], hbuf[d * width + lhalo + size - 1]);
-            else
-                std::fill(&hbuf[d * width + lhalo + size], &hbuf[(d + 1) * width], static_cast<T>(x[x.size()-1]));
-
-        }
-
-        if ((d > 0 && lhalo > 0) || (d + 1 < queue.size() && rhalo > 0))
-            queue[d].enqueueWriteBuffer(dbuf[d], CL_FALSE, 0, width * sizeof(T),
-                    &hbuf[d * width], 0, &event[d]);
-    }
-
-    // Wait for the end of transfer.
-    for(uint d = 0; d < queue.size(); d++) event[d].wait();
 }
 
+// Halo buffers without stencil data (used for temporal blocking).
+template <typename T>
+struct stencil_halo : public stencil_base<T> {
+    typedef stencil_base<T> Base;
+
+    using Base::exchange_halos;
+    using Base::dbuf;
+    using Base::lhalo;
+    using Base::rhalo;
+
+    stencil_halo(const std::vector<cl::CommandQueue> &queue,
+            uint width, uint center)
+        : Base(queue, width, center, static_cast<T*>(0), static_cast<T*>(0))
+    {}
+};
+
 /// \endcond
 
 /// Stencil.
@@ -318,7 +543,6 @@ class stencil : private stencil_base<T> {
         typedef stencil_base<T> Base;
 
         using Base::queue;
-        using Base::hbuf;
         using Base::dbuf;
         using Base::s;
         using Base::event;
@@ -332,24 +556,13 @@ class stencil : private stencil_base<T> {
 
         void init(uint width);
 
-        static std::map<cl_context, bool>              compiled;
-        static std::map<cl_context, cl::Kernel>        slow_conv;
-        static std::map<cl_context, cl::Kernel>        fast_conv;
-        static std::map<cl_context, uint>              wgsize;
+        struct kernels {
+            cl::Kernel slow_conv;
+            cl::Kernel fast_conv;
+            uint       wgsize;
+        };
 };
 
-template <typename T>
-std::map<cl_context, bool> stencil<T>::compiled;
-
-template <typename T>
-std::map<cl_context, uint> stencil<T>::wgsize;
-
-template <typename T>
-std::map<cl_context, cl::Kernel> stencil<T>::slow_conv;
-
-template <typename T>
-std::map<cl_context, cl::Kernel> stencil<T>::fast_conv;
-
 template <typename T>
 void stencil<T>::init(uint width) {
     for (uint d = 0; d < queue.size(); d++) {
@@ -358,7 +571,9 @@ void stencil<T>::init(uint width) {
 
         bool device_is_cpu = device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU;
 
-        if (!compiled[context()]) {
+        auto krn = kernel_cache<>::find<kernels>(queue[d]);
+
+        if (!krn) {
             std::ostringstream source;
 
             source << standard_kernel_header <<
@@ -455,29 +670,31 @@ void stencil<T>::init(uint width) {
 
             auto program = build_sources(context, source.str());
 
-            slow_conv[context()] = cl::Kernel(program, "slow_conv");
-            fast_conv[context()] = cl::Kernel(program, "fast_conv");
+            kernels k;
+
+            k.slow_conv = cl::Kernel(program, "slow_conv");
+            k.fast_conv = cl::Kernel(program, "fast_conv");
 
-            wgsize[context()] = std::min(
-                    kernel_workgroup_size(slow_conv[context()], device),
-                    kernel_workgroup_size(fast_conv[context()], device)
+            k.wgsize = std::min(
+                    kernel_workgroup_size(k.slow_conv, device),
+                    kernel_workgroup_size(k.fast_conv, device)
                     );
 
-            compiled[context()] = true;
+            krn = kernel_cache<>::insert(queue[d], k);
         }
 
         size_t available_lmem = (device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() -
-                fast_conv[context()].getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(device)
+                krn->fast_conv.getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(device)
                 ) / sizeof(T);
 
         if (device_is_cpu || available_lmem < width + 64 + lhalo + rhalo) {
-            conv[d]  = slow_conv[context()];
-            wgs[d]   = wgsize[context()];
+            conv[d]  = krn->slow_conv;
+            wgs[d]   = krn->wgsize;
             loc_s[d] = cl::Local(1);
             loc_x[d] = cl::Local(1);
         } else {
-            conv[d] = fast_conv[context()];
-            wgs[d]  = wgsize[context()];
+            conv[d] = krn->fast_conv;
+            wgs[d]  = krn->wgsize;
             while(available_lmem < width + wgs[d] + lhalo + rhalo)
                 wgs[d] /= 2;
             loc_s[d] = cl::Local(sizeof(T) * width);
@@ -492,6 +709,9 @@ void stencil<T>::convolve(const vex::vector<T> &x, vex::vector<T> &y,
         T alpha, T beta
         ) const
 {
+    hazard_guard guard(queue);
+    guard.reads(x).writes(y).begin();
+
     Base::exchange_halos(x);
 
     for(uint d = 0; d < queue.size(); d++) {
@@ -523,9 +743,11 @@ void stencil<T>::convolve(const vex::vector<T> &x, vex::vector<T> &y,
             conv[d].setArg(pos++, loc_s[d]);
             conv[d].setArg(pos++, loc_x[d]);
 
-            queue[d].enqueueNDRangeKernel(conv[d], cl::NullRange, g_size, wgs[d]);
+            queue[d].enqueueNDRangeKernel(conv[d], cl::NullRange, g_size, wgs[d], 0, event_trace<>::kernel(queue[d], conv[d]));
         }
     }
+
+    guard.end();
 }
 
 template <typename T>
@@ -593,44 +815,65 @@ class StencilOperator : private stencil_base<T> {
 
         void convolve(const vex::vector<T> &x, vex::vector<T> &y,
                 T alpha = 0, T beta = 1) const;
+
+        /// Applies the operator several times in a row.
+        /**
+         * y = op(op(...op(x)...)), with the operator applied steps times.
+         * Several time steps are fused into a single kernel launch: each
+         * work-group loads its block together with a halo which is as many
+         * times wider as the number of fused steps, and does the
+         * intermediate steps in local memory. With several devices the
+         * halos are exchanged once per launch instead of once per step.
+         * x and y may be the same vector.
+         */
+        void apply_n(const vex::vector<T> &x, vex::vector<T> &y, size_t steps) const;
     private:
         typedef stencil_base<T> Base;
 
         using Base::queue;
-        using Base::hbuf;
         using Base::dbuf;
         using Base::event;
         using Base::lhalo;
         using Base::rhalo;
 
-        static std::map<cl_context, bool>              compiled;
-        static std::map<cl_context, cl::Kernel>        kernel;
-        static std::map<cl_context, uint>              wgsize;
-        static std::map<cl_context, cl::LocalSpaceArg> lmem;
-};
+        struct kernels {
+            cl::Kernel        kernel;
+            uint              wgsize;
+            cl::LocalSpaceArg lmem;
+        };
 
-template <typename T, uint width, uint center, class Impl>
-std::map<cl_context, bool> StencilOperator<T, width, center, Impl>::compiled;
+        std::vector< std::shared_ptr<kernels> > krn;
 
-template <typename T, uint width, uint center, class Impl>
-std::map<cl_context, cl::Kernel> StencilOperator<T, width, center, Impl>::kernel;
+        struct temporal_kernels {
+            cl::Kernel kernel;
+            uint       wgsize;
+        };
 
-template <typename T, uint width, uint center, class Impl>
-std::map<cl_context, uint> StencilOperator<T, width, center, Impl>::wgsize;
+        mutable std::vector< std::shared_ptr<temporal_kernels> > tkrn;
 
-template <typename T, uint width, uint center, class Impl>
-std::map<cl_context, cl::LocalSpaceArg> StencilOperator<T, width, center, Impl>::lmem;
+        // Number of time steps fused in a single launch, and halos of the
+        // corresponding width.
+        mutable uint fuse;
+        mutable std::shared_ptr< stencil_halo<T> > wide;
+
+        mutable vex::vector<T> tmp;
+
+        void init_temporal() const;
+};
 
 template <typename T, uint width, uint center, class Impl>
 StencilOperator<T, width, center, Impl>::StencilOperator(
         const std::vector<cl::CommandQueue> &queue)
-    : Base(queue, width, center, static_cast<T*>(0), static_cast<T*>(0))
+    : Base(queue, width, center, static_cast<T*>(0), static_cast<T*>(0)),
+      krn(queue.size()), tkrn(queue.size()), fuse(0)
 {
     for (uint d = 0; d < queue.size(); d++) {
         cl::Context context = qctx(queue[d]);
         cl::Device  device  = qdev(queue[d]);
 
-        if (!compiled[context()]) {
+        krn[d] = kernel_cache<>::find<kernels>(queue[d]);
+
+        if (!krn[d]) {
             bool device_is_cpu = device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU;
 
             std::ostringstream source;
@@ -712,20 +955,23 @@ StencilOperator<T, width, center, Impl>::StencilOperator(
 
             auto program = build_sources(context, source.str());
 
-            kernel[context()]   = cl::Kernel(program, "convolve");
-            wgsize[context()]   = kernel_workgroup_size(kernel[context()], device);
-            compiled[context()] = true;
+            kernels k;
+
+            k.kernel = cl::Kernel(program, "convolve");
+            k.wgsize = kernel_workgroup_size(k.kernel, device);
 
             size_t available_lmem = (device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() -
-                    kernel[context()].getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(device)
+                    k.kernel.getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(device)
                     ) / sizeof(T);
 
             assert(available_lmem >= width + 64);
 
-            while(available_lmem < width + wgsize[context()])
-                wgsize[context()] /= 2;
+            while(available_lmem < width + k.wgsize)
+                k.wgsize /= 2;
+
+            k.lmem = cl::Local(sizeof(T) * (k.wgsize + width - 1));
 
-            lmem[context()] = cl::Local(sizeof(T) * (wgsize[context()] + width - 1));
+            krn[d] = kernel_cache<>::insert(queue[d], k);
         }
 
     }
@@ -735,38 +981,246 @@ template <typename T, uint width, uint center, class Impl>
 void StencilOperator<T, width, center, Impl>::convolve(
         const vex::vector<T> &x, vex::vector<T> &y, T alpha, T beta) const
 {
+    hazard_guard guard(queue);
+    guard.reads(x).writes(y).begin();
+
     Base::exchange_halos(x);
 
     for(uint d = 0; d < queue.size(); d++) {
         if (size_t psize = x.part_size(d)) {
-            cl::Context context = qctx(queue[d]);
-            cl::Device  device  = qdev(queue[d]);
+            cl::Device device = qdev(queue[d]);
 
             bool device_is_cpu = device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU;
 
-            size_t g_size = device_is_cpu ? alignup(psize, wgsize[context()]) :
-                device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * wgsize[context()] * 4;
+            size_t g_size = device_is_cpu ? alignup(psize, krn[d]->wgsize) :
+                device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * krn[d]->wgsize * 4;
 
             char has_left  = d > 0;
             char has_right = d + 1 < queue.size();
 
             uint pos = 0;
 
-            kernel[context()].setArg(pos++, psize);
-            kernel[context()].setArg(pos++, has_left);
-            kernel[context()].setArg(pos++, has_right);
-            kernel[context()].setArg(pos++, lhalo);
-            kernel[context()].setArg(pos++, rhalo);
-            kernel[context()].setArg(pos++, x(d));
-            kernel[context()].setArg(pos++, dbuf[d]);
-            kernel[context()].setArg(pos++, y(d));
-            kernel[context()].setArg(pos++, alpha);
-            kernel[context()].setArg(pos++, beta);
-            kernel[context()].setArg(pos++, lmem[context()]);
-
-            queue[d].enqueueNDRangeKernel(kernel[context()], cl::NullRange, g_size, wgsize[context()]);
+            krn[d]->kernel.setArg(pos++, psize);
+            krn[d]->kernel.setArg(pos++, has_left);
+            krn[d]->kernel.setArg(pos++, has_right);
+            krn[d]->kernel.setArg(pos++, lhalo);
+            krn[d]->kernel.setArg(pos++, rhalo);
+            krn[d]->kernel.setArg(pos++, x(d));
+            krn[d]->kernel.setArg(pos++, dbuf[d]);
+            krn[d]->kernel.setArg(pos++, y(d));
+            krn[d]->kernel.setArg(pos++, alpha);
+            krn[d]->kernel.setArg(pos++, beta);
+            krn[d]->kernel.setArg(pos++, krn[d]->lmem);
+
+            queue[d].enqueueNDRangeKernel(krn[d]->kernel, cl::NullRange, g_size, krn[d]->wgsize, 0, event_trace<>::kernel(queue[d], krn[d]->kernel));
         }
     }
+
+    guard.end();
+}
+
+template <typename T, uint width, uint center, class Impl>
+void StencilOperator<T, width, center, Impl>::init_temporal() const {
+    // Upper limit for the number of fused steps. Redundant work on the
+    // halos grows with the number of steps.
+    fuse = 8;
+
+    for(uint d = 0; d < queue.size(); d++) {
+        cl::Context context = qctx(queue[d]);
+        cl::Device  device  = qdev(queue[d]);
+
+        tkrn[d] = kernel_cache<>::find<temporal_kernels>(queue[d]);
+
+        if (!tkrn[d]) {
+            std::ostringstream source;
+
+            source << standard_kernel_header <<
+                "typedef " << type_name<T>() << " real;\n"
+                "real read_x(\n"
+                "    long g_id,\n"
+                "    " << type_name<size_t>() << " n,\n"
+                "    char has_left, char has_right,\n"
+                "    int lhalo, int rhalo,\n"
+                "    global const real *xloc,\n"
+                "    global const real *xrem\n"
+                "    )\n"
+                "{\n"
+                "    if (g_id >= 0 && g_id < n) {\n"
+                "        return xloc[g_id];\n"
+                "    } else if (g_id < 0) {\n"
+                "        if (has_left)\n"
+                "            return (lhalo + g_id >= 0) ? xrem[lhalo + g_id] : 0;\n"
+                "        else\n"
+                "            return xloc[0];\n"
+                "    } else {\n"
+                "        if (has_right)\n"
+                "            return (g_id < n + rhalo) ? xrem[lhalo + g_id - n] : 0;\n"
+                "        else\n"
+                "            return xloc[n - 1];\n"
+                "    }\n"
+                "}\n"
+                "real stencil_oper(local real *X) {\n"
+                << Impl::body() <<
+                "\n}\n"
+                "kernel void convolve_n(\n"
+                "    " << type_name<size_t>() << " n,\n"
+                "    char has_left,\n"
+                "    char has_right,\n"
+                "    int hl, int hr,\n"
+                "    int steps,\n"
+                "    global const real *xloc,\n"
+                "    global const real *xrem,\n"
+                "    global real *y,\n"
+                "    local real *X,\n"
+                "    local real *Y\n"
+                "    )\n"
+                "{\n"
+                "    const int lhalo = " << center << ";\n"
+                "    const int rhalo = " << width - center - 1 << ";\n"
+                "    int l_id       = get_local_id(0);\n"
+                "    int block_size = get_local_size(0);\n"
+                "    int H = steps * lhalo;\n"
+                "    int L = block_size + steps * (lhalo + rhalo);\n"
+                "    for(long base = get_group_id(0) * block_size; base < n; base += get_num_groups(0) * block_size) {\n"
+                "        for(int i = l_id; i < L; i += block_size)\n"
+                "            X[i] = read_x(base - H + i, n, has_left, has_right, hl, hr, xloc, xrem);\n"
+                "        barrier(CLK_LOCAL_MEM_FENCE);\n"
+                "        long i0 = H - base;\n"
+                "        long i1 = H + (long)n - 1 - base;\n"
+                "        for(int s = 1; s <= steps; s++) {\n"
+                "            int lo = s * lhalo;\n"
+                "            int hi = L - s * rhalo;\n"
+                "            for(int i = lo + l_id; i < hi; i += block_size)\n"
+                "                Y[i] = stencil_oper(X + i);\n"
+                "            barrier(CLK_LOCAL_MEM_FENCE);\n"
+                "            if (!has_left || !has_right) {\n"
+                "                for(int i = lo + l_id; i < hi; i += block_size) {\n"
+                "                    if (!has_left  && i < i0) Y[i] = Y[i0];\n"
+                "                    if (!has_right && i > i1) Y[i] = Y[i1];\n"
+                "                }\n"
+                "                barrier(CLK_LOCAL_MEM_FENCE);\n"
+                "            }\n"
+                "            local real *t = X; X = Y; Y = t;\n"
+                "        }\n"
+                "        if (base + l_id < n) y[base + l_id] = X[H + l_id];\n"
+                "        barrier(CLK_LOCAL_MEM_FENCE);\n"
+                "    }\n"
+                "}\n";
+
+            auto program = build_sources(context, source.str());
+
+            temporal_kernels k;
+
+            k.kernel = cl::Kernel(program, "convolve_n");
+            k.wgsize = kernel_workgroup_size(k.kernel, device);
+
+            // Fused halos take at most a quarter of the block.
+            size_t available_lmem = (device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() -
+                    k.kernel.getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(device)
+                    ) / sizeof(T);
+
+            while(k.wgsize > 64 && 2 * (k.wgsize + k.wgsize / 4 + width) > available_lmem)
+                k.wgsize /= 2;
+
+            tkrn[d] = kernel_cache<>::insert(queue[d], k);
+        }
+
+        // The block should be wider than the fused halo, and the halo should
+        // not take more than a quarter of the block.
+        if (width > 1)
+            fuse = std::max<uint>(1, std::min<uint>(fuse,
+                        tkrn[d]->wgsize / (4 * (width - 1))));
+    }
+
+    wide = std::make_shared< stencil_halo<T> >(queue,
+            fuse * (width - 1) + 1, fuse * center);
+}
+
+template <typename T, uint width, uint center, class Impl>
+void StencilOperator<T, width, center, Impl>::apply_n(
+        const vex::vector<T> &x, vex::vector<T> &y, size_t steps) const
+{
+    if (!steps) {
+        if (&x != &y) y = x;
+        return;
+    }
+
+    if (!fuse) init_temporal();
+
+    if (tmp.partition() != x.partition())
+        tmp = std::move(vex::vector<T>(x));
+
+    hazard_guard guard(queue);
+    guard.reads(x).writes(y).begin();
+
+    // Launches alternate between tmp and y, so that x is only read by the
+    // first one. If the last result ends up in tmp, buffers are swapped.
+    const vex::vector<T> *src = &x;
+
+    for(size_t done = 0, launch = 0; done < steps; launch++) {
+        int k = std::min<size_t>(fuse, steps - done);
+
+        vex::vector<T> &dst = (launch % 2 == 0) ? tmp : y;
+
+        wide->exchange_halos(*src);
+
+        for(uint d = 0; d < queue.size(); d++) {
+            if (size_t psize = src->part_size(d)) {
+                cl::Device device = qdev(queue[d]);
+
+                bool device_is_cpu = device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU;
+
+                uint wgs = tkrn[d]->wgsize;
+
+                size_t g_size = device_is_cpu ? alignup(psize, wgs) :
+                    std::min<size_t>(alignup(psize, wgs),
+                            device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * wgs * 4);
+
+                char has_left  = d > 0;
+                char has_right = d + 1 < queue.size();
+
+                cl::Kernel &krn = tkrn[d]->kernel;
+
+                uint pos = 0;
+
+                krn.setArg(pos++, psize);
+                krn.setArg(pos++, has_left);
+                krn.setArg(pos++, has_right);
+                krn.setArg(pos++, wide->lhalo);
+                krn.setArg(pos++, wide->rhalo);
+                krn.setArg(pos++, k);
+                krn.setArg(pos++, (*src)(d));
+                krn.setArg(pos++, wide->dbuf[d]);
+                krn.setArg(pos++, dst(d));
+                krn.setArg(pos++, cl::Local(sizeof(T) * (wgs + k * (width - 1))));
+                krn.setArg(pos++, cl::Local(sizeof(T) * (wgs + k * (width - 1))));
+
+                queue[d].enqueueNDRangeKernel(krn, cl::NullRange, g_size, wgs, 0, event_trace<>::kernel(queue[d], krn));
+            }
+        }
+
+        src   = &dst;
+        done += k;
+    }
+
+    if (src == &tmp) y.swap(tmp);
+
+    guard.end();
+}
+
+/// Applies stencil operator to a vector several times in a row.
+/**
+ * \code
+ * // Explicit time stepping: u = op(op(...op(u)...)).
+ * vex::apply_n(op, u, 100);
+ * \endcode
+ * \see StencilOperator::apply_n
+ */
+template <typename T, uint width, uint center, class Impl>
+void apply_n(const StencilOperator<T, width, center, Impl> &op,
+        vex::vector<T> &x, size_t steps)
+{
+    op.apply_n(x, x, steps);
 }
 
 /// Macro to declare a user-defined stencil operator type.
@@ -797,6 +1251,604 @@ void StencilOperator<T, width, center, Impl>::convolve(
 #define VEX_STENCIL_OPERATOR(name, type, width, center, body, queue) \
     VEX_STENCIL_OPERATOR_TYPE(stencil_operator_##name##_t, type, width, center, body) name(queue)
 
+/// \cond INTERNAL
+
+// One pass of a multidimensional stencil. Grid dimensions, stencil widths and
+// centers are given for x, y, and z (x is the fastest changing index). On the
+// flat vector the pass is a 1D stencil with halo of (cz * ny + cy) * nx + cx
+// elements on the left, so stencil_base takes care of the halo exchange.
+template <typename T>
+struct mdstencil_pass : public stencil_base<T> {
+    typedef stencil_base<T> Base;
+
+    using Base::exchange_halos;
+    using Base::s;
+    using Base::dbuf;
+    using Base::lhalo;
+    using Base::rhalo;
+
+    uint width[3];
+    uint center[3];
+
+    // Tile sizes (three per device). Zero tile means no local memory tiling.
+    std::vector<uint> tile;
+
+    mdstencil_pass(const std::vector<cl::CommandQueue> &queue,
+            const size_t *grid, const uint *w, const uint *c, const T *st)
+        : Base(queue,
+                halo(grid, w, c, false) + halo(grid, w, c, true) + 1,
+                halo(grid, w, c, false), st, st + w[0] * w[1] * w[2]),
+          tile(3 * queue.size(), 0)
+    {
+        for(int k = 0; k < 3; k++) {
+            assert(c[k] < w[k]);
+
+            width[k]  = w[k];
+            center[k] = c[k];
+        }
+    }
+
+    static uint halo(const size_t *grid, const uint *w, const uint *c, bool right) {
+        size_t h = 0;
+        for(int k = 2; k >= 0; k--)
+            h = h * grid[k] + (right ? w[k] - c[k] - 1 : c[k]);
+        return h;
+    }
+
+    size_t local_elements(uint d) const {
+        size_t n = 1;
+        for(int k = 0; k < 3; k++) n *= tile[3 * d + k] + width[k] - 1;
+        return n + width[0] * width[1] * width[2];
+    }
+};
+
+/// \endcond
+
+/// Multidimensional stencil.
+/**
+ * Convolves a 2D or 3D grid, stored in a vex::vector in row-major order (x
+ * is the fastest changing index), with a dense stencil:
+ * \code
+ * // 3x3 smoothing filter on nx by ny image.
+ * std::vector<float> st = {
+ *     1.0f/16, 2.0f/16, 1.0f/16,
+ *     2.0f/16, 4.0f/16, 2.0f/16,
+ *     1.0f/16, 2.0f/16, 1.0f/16
+ * };
+ * vex::mdstencil<float> blur(ctx, {{nx, ny}}, {{3, 3}}, {{1, 1}}, st);
+ *
+ * y = x * blur;
+ * \endcode
+ * Stencil values are given in the same row-major order. Points outside of
+ * the grid take the value of the nearest boundary point.
+ *
+ * On GPUs, each work-group stages a tile of the grid together with its halo
+ * in local memory, so every input element is read from global memory about
+ * once instead of once per stencil point. Separable stencils (e.g. Gaussian
+ * filters) are better given by their one-dimensional factors, which are then
+ * applied one dimension at a time, reducing the work per output from
+ * \f$w^d\f$ to \f$d \cdot w\f$ operations.
+ *
+ * The grid may span several devices. As with vex::stencil, halos between
+ * the device partitions are exchanged before each convolution.
+ */
+template <typename T>
+class mdstencil {
+    public:
+        typedef T value_type;
+
+        /// 2D stencil.
+        /**
+         * \param queue  vector of queues. Each queue represents one
+         *               compute device.
+         * \param grid   grid dimensions {nx, ny}.
+         * \param width  stencil dimensions {wx, wy}.
+         * \param center center of the stencil {cx, cy}.
+         * \param st     wx * wy stencil values in row-major order.
+         */
+        mdstencil(const std::vector<cl::CommandQueue> &queue,
+                const std::array<size_t, 2> &grid,
+                const std::array<uint, 2> &width,
+                const std::array<uint, 2> &center,
+                const std::vector<T> &st
+                ) : queue(queue)
+        {
+            size_t g[3] = {grid[0],  grid[1],  1};
+            uint   w[3] = {width[0], width[1], 1};
+            uint   c[3] = {center[0], center[1], 0};
+
+            assert(st.size() == w[0] * w[1]);
+
+            init(g);
+            add_pass(w, c, st.data());
+        }
+
+        /// 3D stencil.
+        /**
+         * \param queue  vector of queues. Each queue represents one
+         *               compute device.
+         * \param grid   grid dimensions {nx, ny, nz}.
+         * \param width  stencil dimensions {wx, wy, wz}.
+         * \param center center of the stencil {cx, cy, cz}.
+         * \param st     wx * wy * wz stencil values in row-major order.
+         */
+        mdstencil(const std::vector<cl::CommandQueue> &queue,
+                const std::array<size_t, 3> &grid,
+                const std::array<uint, 3> &width,
+                const std::array<uint, 3> &center,
+                const std::vector<T> &st
+                ) : queue(queue)
+        {
+            assert(st.size() == width[0] * width[1] * width[2]);
+
+            init(grid.data());
+            add_pass(width.data(), center.data(), st.data());
+        }
+
+        /// Separable 2D stencil.
+        /**
+         * The stencil is the outer product of st[1] (along y) and st[0]
+         * (along x).
+         */
+        mdstencil(const std::vector<cl::CommandQueue> &queue,
+                const std::array<size_t, 2> &grid,
+                const std::array<std::vector<T>, 2> &st,
+                const std::array<uint, 2> &center
+                ) : queue(queue)
+        {
+            size_t g[3] = {grid[0], grid[1], 1};
+
+            init(g);
+            for(int k = 0; k < 2; k++) add_factor(k, st[k], center[k]);
+        }
+
+        /// Separable 3D stencil.
+        /**
+         * The stencil is the outer product of st[2] (along z), st[1] (along
+         * y) and st[0] (along x).
+         */
+        mdstencil(const std::vector<cl::CommandQueue> &queue,
+                const std::array<size_t, 3> &grid,
+                const std::array<std::vector<T>, 3> &st,
+                const std::array<uint, 3> &center
+                ) : queue(queue)
+        {
+            init(grid.data());
+            for(int k = 0; k < 3; k++) add_factor(k, st[k], center[k]);
+        }
+
+        /// Convolve stencil with a vector.
+        /**
+         * y = alpha * y + beta * conv(x);
+         * \param x input vector.
+         * \param y output vector.
+         * \param alpha Scaling coefficient in front of y.
+         * \param beta  Scaling coefficient in front of convolution.
+         */
+        void convolve(const vex::vector<T> &x, vex::vector<T> &y,
+                T alpha = 0, T beta = 1) const;
+    private:
+        const std::vector<cl::CommandQueue> &queue;
+
+        size_t grid[3];
+
+        std::vector< mdstencil_pass<T> > passes;
+
+        // Intermediate results of separable passes.
+        mutable vex::vector<T> tmp[2];
+
+        struct kernels {
+            cl::Kernel slow_conv;
+            cl::Kernel fast_conv;
+            uint       wgsize;
+        };
+
+        std::vector< std::shared_ptr<kernels> > krn;
+
+        void init(const size_t *g);
+        void add_pass(const uint *w, const uint *c, const T *st);
+        void add_factor(int dim, const std::vector<T> &st, uint center);
+
+        void apply(const mdstencil_pass<T> &p,
+                const vex::vector<T> &x, vex::vector<T> &y,
+                T alpha, T beta) const;
+};
+
+template <typename T>
+void mdstencil<T>::init(const size_t *g) {
+    assert(queue.size());
+
+    std::copy(g, g + 3, grid);
+
+    passes.reserve(3);
+    krn.resize(queue.size());
+
+    for(uint d = 0; d < queue.size(); d++) {
+        krn[d] = kernel_cache<>::find<kernels>(queue[d]);
+
+        if (krn[d]) continue;
+
+        cl::Context context = qctx(queue[d]);
+        cl::Device  device  = qdev(queue[d]);
+
+        bool device_is_cpu = device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU;
+
+        std::ostringstream source;
+
+        source << standard_kernel_header <<
+            "typedef " << type_name<T>() << " real;\n"
+            "real read_x(\n"
+            "    long g_id,\n"
+            "    " << type_name<size_t>() << " n,\n"
+            "    char has_left, char has_right,\n"
+            "    int lhalo, int rhalo,\n"
+            "    global const real *xloc,\n"
+            "    global const real *xrem\n"
+            "    )\n"
+            "{\n"
+            "    if (g_id >= 0 && g_id < n) {\n"
+            "        return xloc[g_id];\n"
+            "    } else if (g_id < 0) {\n"
+            "        if (has_left)\n"
+            "            return (lhalo + g_id >= 0) ? xrem[lhalo + g_id] : 0;\n"
+            "        else\n"
+            "            return xloc[0];\n"
+            "    } else {\n"
+            "        if (has_right)\n"
+            "            return (g_id < n + rhalo) ? xrem[lhalo + g_id - n] : 0;\n"
+            "        else\n"
+            "            return xloc[n - 1];\n"
+            "    }\n"
+            "}\n"
+            "kernel void slow_conv(\n"
+            "    " << type_name<size_t>() << " n,\n"
+            "    " << type_name<size_t>() << " start,\n"
+            "    int nx, int ny, int nz,\n"
+            "    int wx, int wy, int wz,\n"
+            "    int cx, int cy, int cz,\n"
+            "    char has_left,\n"
+            "    char has_right,\n"
+            "    int lhalo, int rhalo,\n"
+            "    global const real *s,\n"
+            "    global const real *xloc,\n"
+            "    global const real *xrem,\n"
+            "    global real *y,\n"
+            "    real alpha, real beta\n"
+            "    )\n"
+            "{\n";
+        if (device_is_cpu)
+            source <<
+            "    long g_id = get_global_id(0);\n"
+            "    if (g_id < n) {\n";
+        else
+            source <<
+            "    size_t grid_size = get_global_size(0);\n"
+            "    for(long g_id = get_global_id(0); g_id < n; g_id += grid_size) {\n";
+        source <<
+            "        long g = start + g_id;\n"
+            "        int i = g % nx;\n"
+            "        int j = (g / nx) % ny;\n"
+            "        int k = g / ((long)nx * ny);\n"
+            "        real sum = 0;\n"
+            "        for(int kk = 0; kk < wz; kk++) {\n"
+            "            long pz = clamp(k + kk - cz, 0, nz - 1);\n"
+            "            for(int jj = 0; jj < wy; jj++) {\n"
+            "                long py = clamp(j + jj - cy, 0, ny - 1);\n"
+            "                for(int ii = 0; ii < wx; ii++) {\n"
+            "                    long px = clamp(i + ii - cx, 0, nx - 1);\n"
+            "                    sum += s[(kk * wy + jj) * wx + ii] * read_x(\n"
+            "                        (pz * ny + py) * nx + px - (long)start,\n"
+            "                        n, has_left, has_right, lhalo, rhalo, xloc, xrem);\n"
+            "                }\n"
+            "            }\n"
+            "        }\n"
+            "        if (alpha)\n"
+            "            y[g_id] = alpha * y[g_id] + beta * sum;\n"
+            "        else\n"
+            "            y[g_id] = beta * sum;\n"
+            "    }\n"
+            "}\n"
+            "kernel void fast_conv(\n"
+            "    " << type_name<size_t>() << " n,\n"
+            "    " << type_name<size_t>() << " start,\n"
+            "    int nx, int ny, int nz,\n"
+            "    int wx, int wy, int wz,\n"
+            "    int cx, int cy, int cz,\n"
+            "    int tx, int ty, int tz,\n"
+            "    int y0, int y1, int z0, int z1,\n"
+            "    char has_left,\n"
+            "    char has_right,\n"
+            "    int lhalo, int rhalo,\n"
+            "    global const real *s,\n"
+            "    global const real *xloc,\n"
+            "    global const real *xrem,\n"
+            "    global real *y,\n"
+            "    real alpha, real beta,\n"
+            "    local real *S,\n"
+            "    local real *X\n"
+            "    )\n"
+            "{\n"
+            "    int l_id       = get_local_id(0);\n"
+            "    int block_size = get_local_size(0);\n"
+            "    int lx = tx + wx - 1;\n"
+            "    int ly = ty + wy - 1;\n"
+            "    int lz = tz + wz - 1;\n"
+            "    int ntx = (nx + tx - 1) / tx;\n"
+            "    int nty = (y1 - y0 + ty - 1) / ty;\n"
+            "    int ntz = (z1 - z0 + tz - 1) / tz;\n"
+            "    event_t e = async_work_group_copy(S, s, wx * wy * wz, 0);\n"
+            "    wait_group_events(1, &e);\n"
+            "    int oi = l_id % tx;\n"
+            "    int oj = (l_id / tx) % ty;\n"
+            "    int ok = l_id / (tx * ty);\n"
+            "    for(int t = get_group_id(0); t < ntx * nty * ntz; t += get_num_groups(0)) {\n"
+            "        int bx = (t % ntx) * tx;\n"
+            "        int by = y0 + ((t / ntx) % nty) * ty;\n"
+            "        int bz = z0 + (t / (ntx * nty)) * tz;\n"
+            "        for(int p = l_id; p < lx * ly * lz; p += block_size) {\n"
+            "            long px = clamp(bx + p % lx - cx, 0, nx - 1);\n"
+            "            long py = clamp(by + (p / lx) % ly - cy, 0, ny - 1);\n"
+            "            long pz = clamp(bz + p / (lx * ly) - cz, 0, nz - 1);\n"
+            "            X[p] = read_x((pz * ny + py) * nx + px - (long)start,\n"
+            "                n, has_left, has_right, lhalo, rhalo, xloc, xrem);\n"
+            "        }\n"
+            "        barrier(CLK_LOCAL_MEM_FENCE);\n"
+            "        int i = bx + oi;\n"
+            "        int j = by + oj;\n"
+            "        int k = bz + ok;\n"
+            "        long g = ((long)k * ny + j) * nx + i - (long)start;\n"
+            "        if (i < nx && j < y1 && k < z1 && g >= 0 && g < n) {\n"
+            "            real sum = 0;\n"
+            "            for(int kk = 0; kk < wz; kk++)\n"
+            "                for(int jj = 0; jj < wy; jj++)\n"
+            "                    for(int ii = 0; ii < wx; ii++)\n"
+            "                        sum += S[(kk * wy + jj) * wx + ii] *\n"
+            "                               X[((ok + kk) * ly + oj + jj) * lx + oi + ii];\n"
+            "            if (alpha)\n"
+            "                y[g] = alpha * y[g] + beta * sum;\n"
+            "            else\n"
+            "                y[g] = beta * sum;\n"
+            "        }\n"
+            "        barrier(CLK_LOCAL_MEM_FENCE);\n"
+            "    }\n"
+            "}\n";
+
+        auto program = build_sources(context, source.str());
+
+        kernels k;
+
+        k.slow_conv = cl::Kernel(program, "slow_conv");
+        k.fast_conv = cl::Kernel(program, "fast_conv");
+
+        k.wgsize = std::min(
+                kernel_workgroup_size(k.slow_conv, device),
+                kernel_workgroup_size(k.fast_conv, device)
+                );
+
+        krn[d] = kernel_cache<>::insert(queue[d], k);
+    }
+}
+
+template <typename T>
+void mdstencil<T>::add_pass(const uint *w, const uint *c, const T *st) {
+    passes.push_back(mdstencil_pass<T>(queue, grid, w, c, st));
+
+    mdstencil_pass<T> &p = passes.back();
+
+    for(uint d = 0; d < queue.size(); d++) {
+        cl::Device device = qdev(queue[d]);
+
+        if (device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU) continue;
+
+        // Work-group is a tx * ty * tz tile. Use power of two work-group
+        // size, wide along x for coalesced reads.
+        uint wgs = 1;
+        while(2 * wgs <= std::min<uint>(krn[d]->wgsize, 256)) wgs *= 2;
+
+        uint *t = &p.tile[3 * d];
+
+        t[0] = std::min<uint>(wgs, grid[2] > 1 ? 16 : 32);
+        t[1] = 1;
+        t[2] = 1;
+
+        if (grid[2] > 1) {
+            while(t[1] * t[1] * t[0] < wgs) t[1] *= 2;
+            t[2] = wgs / (t[0] * t[1]);
+        } else {
+            t[1] = wgs / t[0];
+        }
+
+        size_t available_lmem = (device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>() -
+                krn[d]->fast_conv.getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(device)
+                ) / sizeof(T);
+
+        // Shrink the tile until it fits into local memory.
+        while(p.local_elements(d) > available_lmem && t[0] * t[1] * t[2] > 32) {
+            int k = t[2] >= t[1] && t[2] > 1 ? 2 : (t[1] > 1 ? 1 : 0);
+            t[k] /= 2;
+        }
+
+        // A tile that is mostly halo is not worth it.
+        if (p.local_elements(d) > available_lmem ||
+                (t[0] + w[0] - 1) * (t[1] + w[1] - 1) * (t[2] + w[2] - 1) >
+                4 * t[0] * t[1] * t[2])
+            std::fill(t, t + 3, 0);
+    }
+}
+
+template <typename T>
+void mdstencil<T>::add_factor(int dim, const std::vector<T> &st, uint center) {
+    uint w[3] = {1, 1, 1};
+    uint c[3] = {0, 0, 0};
+
+    w[dim] = st.size();
+    c[dim] = center;
+
+    add_pass(w, c, st.data());
+}
+
+template <typename T>
+void mdstencil<T>::convolve(const vex::vector<T> &x, vex::vector<T> &y,
+        T alpha, T beta) const
+{
+    assert(x.size() == grid[0] * grid[1] * grid[2]);
+
+    hazard_guard guard(queue);
+    guard.reads(x).writes(y).begin();
+
+    if (passes.size() == 1) {
+        apply(passes[0], x, y, alpha, beta);
+        guard.end();
+        return;
+    }
+
+    for(uint i = 0; i + 1 < passes.size() && i < 2; i++)
+        if (tmp[i].partition() != x.partition())
+            tmp[i] = std::move(vex::vector<T>(x));
+
+    const vex::vector<T> *src = &x;
+
+    for(uint i = 0; i + 1 < passes.size(); i++) {
+        apply(passes[i], *src, tmp[i % 2], 0, 1);
+        src = &tmp[i % 2];
+    }
+
+    apply(passes.back(), *src, y, alpha, beta);
+
+    guard.end();
+}
+
+template <typename T>
+void mdstencil<T>::apply(const mdstencil_pass<T> &p,
+        const vex::vector<T> &x, vex::vector<T> &y, T alpha, T beta) const
+{
+    p.exchange_halos(x);
+
+    for(uint d = 0; d < queue.size(); d++) {
+        size_t psize = x.part_size(d);
+        if (!psize) continue;
+
+        cl::Device device = qdev(queue[d]);
+
+        bool device_is_cpu = device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU;
+
+        size_t start = x.part_start(d);
+
+        char has_left  = d > 0;
+        char has_right = d + 1 < queue.size();
+
+        const uint *t = &p.tile[3 * d];
+
+        int nx = grid[0], ny = grid[1], nz = grid[2];
+
+        uint pos = 0;
+
+        if (t[0]) {
+            cl::Kernel &k = krn[d]->fast_conv;
+
+            // Planes and rows touched by the partition.
+            size_t plane = grid[0] * grid[1];
+            int z0 = start / plane;
+            int z1 = (start + psize - 1) / plane + 1;
+            int y0 = 0, y1 = ny;
+
+            if (z1 - z0 == 1) {
+                y0 = (start % plane) / grid[0];
+                y1 = ((start + psize - 1) % plane) / grid[0] + 1;
+            }
+
+            size_t ntiles = ((nx + t[0] - 1) / t[0]) *
+                ((y1 - y0 + t[1] - 1) / t[1]) * ((z1 - z0 + t[2] - 1) / t[2]);
+
+            size_t wgs = t[0] * t[1] * t[2];
+
+            size_t g_size = wgs * std::min<size_t>(ntiles,
+                    device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * 8);
+
+            k.setArg(pos++, psize);
+            k.setArg(pos++, start);
+            k.setArg(pos++, nx);
+            k.setArg(pos++, ny);
+            k.setArg(pos++, nz);
+            for(int i = 0; i < 3; i++) k.setArg(pos++, static_cast<int>(p.width[i]));
+            for(int i = 0; i < 3; i++) k.setArg(pos++, static_cast<int>(p.center[i]));
+            for(int i = 0; i < 3; i++) k.setArg(pos++, static_cast<int>(t[i]));
+            k.setArg(pos++, y0);
+            k.setArg(pos++, y1);
+            k.setArg(pos++, z0);
+            k.setArg(pos++, z1);
+            k.setArg(pos++, has_left);
+            k.setArg(pos++, has_right);
+            k.setArg(pos++, p.lhalo);
+            k.setArg(pos++, p.rhalo);
+            k.setArg(pos++, p.s[d]);
+            k.setArg(pos++, x(d));
+            k.setArg(pos++, p.dbuf[d]);
+            k.setArg(pos++, y(d));
+            k.setArg(pos++, alpha);
+            k.setArg(pos++, beta);
+            k.setArg(pos++, cl::Local(sizeof(T) * p.width[0] * p.width[1] * p.width[2]));
+            k.setArg(pos++, cl::Local(sizeof(T) *
+                        (p.local_elements(d) - p.width[0] * p.width[1] * p.width[2])));
+
+            queue[d].enqueueNDRangeKernel(k, cl::NullRange, g_size, wgs, 0, event_trace<>::kernel(queue[d], k));
+        } else {
+            cl::Kernel &k = krn[d]->slow_conv;
+
+            size_t g_size = device_is_cpu ? alignup(psize, krn[d]->wgsize)
+                : device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * krn[d]->wgsize * 4;
+
+            k.setArg(pos++, psize);
+            k.setArg(pos++, start);
+            k.setArg(pos++, nx);
+            k.setArg(pos++, ny);
+            k.setArg(pos++, nz);
+            for(int i = 0; i < 3; i++) k.setArg(pos++, static_cast<int>(p.width[i]));
+            for(int i = 0; i < 3; i++) k.setArg(pos++, static_cast<int>(p.center[i]));
+            k.setArg(pos++, has_left);
+            k.setArg(pos++, has_right);
+            k.setArg(pos++, p.lhalo);
+            k.setArg(pos++, p.rhalo);
+            k.setArg(pos++, p.s[d]);
+            k.setArg(pos++, x(d));
+            k.setArg(pos++, p.dbuf[d]);
+            k.setArg(pos++, y(d));
+            k.setArg(pos++, alpha);
+            k.setArg(pos++, beta);
+
+            queue[d].enqueueNDRangeKernel(k, cl::NullRange, g_size, krn[d]->wgsize, 0, event_trace<>::kernel(queue[d], k));
+        }
+    }
+}
+
+template <typename T>
+conv< mdstencil<T>, vector<T> >
+operator*( const mdstencil<T> &s, const vector<T> &x ) {
+    return conv< mdstencil<T>, vector<T> >(s, x);
+}
+
+template <typename T>
+conv< mdstencil<T>, vector<T> >
+operator*( const vector<T> &x, const mdstencil<T> &s ) {
+    return conv< mdstencil<T>, vector<T> >(s, x);
+}
+
+#ifdef VEXCL_MULTIVECTOR_HPP
+
+template <typename T, size_t N, bool own>
+multiconv< mdstencil<T>, multivector<T, N, own> >
+operator*( const mdstencil<T> &s, const multivector<T, N, own> &x ) {
+    return multiconv< mdstencil<T>, multivector<T, N, own> >(s, x);
+}
+
+template <typename T, size_t N, bool own>
+multiconv< mdstencil<T>, multivector<T, N, own> >
+operator*( const multivector<T, N, own> &x, const mdstencil<T> &s ) {
+    return multiconv< mdstencil<T>, multivector<T, N, own> >(s, x);
+}
+
+#endif
+
 } // namespace vex
 
 #ifdef WIN32
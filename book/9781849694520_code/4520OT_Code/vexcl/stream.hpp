@@ -0,0 +1,329 @@
+#ifndef VEXCL_STREAM_HPP
+#define VEXCL_STREAM_HPP
+
+/*
+The MIT License
+
+Copyright (c) 2012-2013 Denis Demidov <ddemidov@ksu.ru>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/**
+ * \file   vexcl/stream.hpp
+ * \author Denis Demidov <ddemidov@ksu.ru>
+ * \brief  Out-of-core processing of host-resident vectors.
+ */
+
+#ifdef WIN32
+#  pragma warning(push)
+#  pragma warning(disable : 4267 4290)
+#  define NOMINMAX
+#endif
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <algorithm>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <CL/cl.hpp>
+#include <vexcl/util.hpp>
+#include <vexcl/vector.hpp>
+
+namespace vex {
+
+/// \cond INTERNAL
+
+struct stream_vector_base {
+    virtual ~stream_vector_base() {}
+
+    virtual size_t size() const = 0;
+
+    // Allocates slot for the tile and (if transfer is set) enqueues transfer
+    // of the tile to the devices. Adds transfer events to ev[d].
+    virtual void load(int slot, size_t start, size_t len, bool transfer,
+            std::vector<cl::CommandQueue> &xfer,
+            const std::vector< std::vector<cl::Event> > &wait,
+            std::vector< std::vector<cl::Event> > &ev) = 0;
+
+    // Enqueues transfer of the tile back to the host.
+    virtual void store(int slot, size_t start,
+            std::vector<cl::CommandQueue> &xfer,
+            const std::vector< std::vector<cl::Event> > &wait) = 0;
+
+    virtual void select(int slot) = 0;
+};
+
+/// \endcond
+
+/// Host-resident vector processed by the devices tile by tile.
+/**
+ * The vector data stays in host memory (either user-provided or a
+ * memory-mapped file), which may be much larger than the device memory.
+ * Inside a stream_loop, tile() gives a vex::vector holding the current tile,
+ * which may be used in any vector expression or reduction.
+ * \see stream_loop
+ */
+template <typename T>
+class stream_vector : public stream_vector_base {
+    public:
+        typedef T value_type;
+
+        /// Wraps host memory.
+        stream_vector(const std::vector<cl::CommandQueue> &queue, T *host, size_t size)
+            : queue(queue), host(host), n(size), current(0)
+        {}
+
+        /// Maps file as vector data.
+        /**
+         * The file should exist and contain at least size elements.
+         */
+        stream_vector(const std::vector<cl::CommandQueue> &queue,
+                const std::string &fname, size_t size)
+            : queue(queue), n(size), current(0),
+              file(new boost::interprocess::file_mapping(
+                          fname.c_str(), boost::interprocess::read_write)),
+              region(new boost::interprocess::mapped_region(
+                          *file, boost::interprocess::read_write, 0, size * sizeof(T)))
+        {
+            host = static_cast<T*>(region->get_address());
+        }
+
+        /// Vector size.
+        size_t size() const {
+            return n;
+        }
+
+        /// Host data.
+        T* data() const {
+            return host;
+        }
+
+        /// Device copy of the current tile.
+        vector<T>& tile() {
+            return slot[current];
+        }
+
+        /// Device copy of the current tile.
+        const vector<T>& tile() const {
+            return slot[current];
+        }
+    private:
+        std::vector<cl::CommandQueue> queue;
+        T     *host;
+        size_t n;
+        int    current;
+
+        vector<T> slot[2];
+
+        std::shared_ptr<boost::interprocess::file_mapping>  file;
+        std::shared_ptr<boost::interprocess::mapped_region> region;
+
+        void load(int s, size_t start, size_t len, bool transfer,
+                std::vector<cl::CommandQueue> &xfer,
+                const std::vector< std::vector<cl::Event> > &wait,
+                std::vector< std::vector<cl::Event> > &ev)
+        {
+            if (slot[s].size() != len) {
+                // Only happens for the last tile. Make sure the old buffers
+                // are not in use before they go back to the memory pool.
+                if (slot[s].size())
+                    for(uint d = 0; d < queue.size(); d++) {
+                        queue[d].finish();
+                        xfer[d].finish();
+                    }
+
+                slot[s] = std::move(vector<T>(queue, len));
+            }
+
+            if (!transfer) return;
+
+            for(uint d = 0; d < queue.size(); d++) {
+                if (!slot[s].part_size(d)) continue;
+
+                cl::Event e;
+                xfer[d].enqueueWriteBuffer(slot[s](d), CL_FALSE, 0,
+                        slot[s].part_size(d) * sizeof(T),
+                        host + start + slot[s].part_start(d),
+                        wait[d].empty() ? 0 : &wait[d], &e);
+
+                ev[d].push_back(e);
+            }
+        }
+
+        void store(int s, size_t start,
+                std::vector<cl::CommandQueue> &xfer,
+                const std::vector< std::vector<cl::Event> > &wait)
+        {
+            for(uint d = 0; d < queue.size(); d++) {
+                if (!slot[s].part_size(d)) continue;
+
+                xfer[d].enqueueReadBuffer(slot[s](d), CL_FALSE, 0,
+                        slot[s].part_size(d) * sizeof(T),
+                        host + start + slot[s].part_start(d),
+                        wait[d].empty() ? 0 : &wait[d]);
+            }
+        }
+
+        void select(int s) {
+            current = s;
+        }
+};
+
+/// Loop over tiles of stream vectors.
+/**
+ * Input vectors are transferred to the devices tile by tile, and output
+ * vectors are transferred back after each iteration. Transfers run on
+ * separate command queues, so that the next tile is prefetched while the
+ * current one is processed:
+ * \code
+ * vex::stream_vector<double> x(ctx, "x.bin", n), y(ctx, "y.bin", n);
+ * vex::Reductor<double, vex::SUM> sum(ctx);
+ *
+ * double s = 0;
+ * for(vex::stream_loop loop(ctx, n, 1 << 24, {&x}, {&y}); loop; ++loop) {
+ *     y.tile() = sin(x.tile());
+ *     s += sum(y.tile());
+ * }
+ * \endcode
+ * Results of reductions over tiles are combined by the user code. A vector
+ * may be both an input and an output. Output-only vectors are not read from
+ * the host, so each iteration should assign all elements of their tiles. All
+ * vectors should have the same size.
+ */
+class stream_loop {
+    public:
+        /// Starts the loop and loads the first tiles.
+        stream_loop(const std::vector<cl::CommandQueue> &queue,
+                size_t size, size_t tile,
+                const std::vector<stream_vector_base*> &input,
+                const std::vector<stream_vector_base*> &output)
+            : queue(queue), n(size), tile(std::max<size_t>(1, tile)), k(0),
+              input(input), output(output)
+        {
+            for(auto q = queue.begin(); q != queue.end(); q++)
+                xfer.push_back(cl::CommandQueue(qctx(*q), qdev(*q)));
+
+            for(int s = 0; s < 2; s++) {
+                loaded[s].resize(queue.size());
+                done[s].resize(queue.size());
+            }
+
+            // Output-only vectors still need device storage.
+            for(auto v = output.begin(); v != output.end(); v++)
+                if (std::find(input.begin(), input.end(), *v) == input.end())
+                    allocate.push_back(*v);
+
+            if (n) {
+                load(0);
+                if (n > this->tile) load(1);
+                start(0);
+            }
+        }
+
+        ~stream_loop() {
+            for(auto q = xfer.begin(); q != xfer.end(); q++) q->finish();
+        }
+
+        /// Whether there are tiles left to process.
+        operator bool() const {
+            return k * tile < n;
+        }
+
+        /// Index of the first element of the current tile.
+        size_t offset() const {
+            return k * tile;
+        }
+
+        /// Finishes work with the current tile and moves to the next one.
+        stream_loop& operator++() {
+            int s = k % 2;
+
+            for(uint d = 0; d < queue.size(); d++) {
+                done[s][d].resize(1);
+                queue[d].enqueueMarker(&done[s][d][0]);
+            }
+
+            for(auto v = output.begin(); v != output.end(); v++)
+                (*v)->store(s, k * tile, xfer, done[s]);
+
+            k++;
+
+            // The slot is free once the computation and transfers of the
+            // finished tile are done, which is ensured by xfer queues order.
+            if ((k + 1) * tile < n) load(k + 1);
+
+            if (k * tile < n) {
+                start(k % 2);
+            } else {
+                for(auto q = xfer.begin(); q != xfer.end(); q++) q->finish();
+            }
+
+            return *this;
+        }
+    private:
+        std::vector<cl::CommandQueue> queue;
+        std::vector<cl::CommandQueue> xfer;
+
+        size_t n, tile, k;
+
+        std::vector<stream_vector_base*> input, output, allocate;
+
+        std::vector< std::vector<cl::Event> > loaded[2];
+        std::vector< std::vector<cl::Event> > done[2];
+
+        void load(size_t t) {
+            int s = t % 2;
+
+            size_t start = t * tile;
+            size_t len   = std::min(tile, n - start);
+
+            for(uint d = 0; d < queue.size(); d++)
+                loaded[s][d].clear();
+
+            for(auto v = input.begin(); v != input.end(); v++)
+                (*v)->load(s, start, len, true, xfer, done[s], loaded[s]);
+
+            // Output-only vectors just need a slot of the right size.
+            for(auto v = allocate.begin(); v != allocate.end(); v++)
+                (*v)->load(s, start, len, false, xfer, done[s], loaded[s]);
+        }
+
+        void start(int s) {
+            for(uint d = 0; d < queue.size(); d++)
+                if (!loaded[s][d].empty())
+                    queue[d].enqueueWaitForEvents(loaded[s][d]);
+
+            for(auto v = input.begin(); v != input.end(); v++)
+                (*v)->select(s);
+
+            for(auto v = allocate.begin(); v != allocate.end(); v++)
+                (*v)->select(s);
+        }
+};
+
+} // namespace vex
+
+#ifdef WIN32
+#  pragma warning(pop)
+#endif
+
+// vim: et
+#endif
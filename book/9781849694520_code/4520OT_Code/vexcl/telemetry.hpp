@@ -0,0 +1,310 @@
+#ifndef VEXCL_TELEMETRY_HPP
+#define VEXCL_TELEMETRY_HPP
+
+/*
+The MIT License
+
+Copyright (c) 2012-2013 Denis Demidov <ddemidov@ksu.ru>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/**
+ * \file   vexcl/telemetry.hpp
+ * \author Denis Demidov <ddemidov@ksu.ru>
+ * \brief  Sampled latency histograms of kernel launches.
+ */
+
+#ifdef WIN32
+#  pragma warning(push)
+#  pragma warning(disable : 4267 4290)
+#  define NOMINMAX
+#endif
+
+#include <deque>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <string>
+#include <memory>
+#include <atomic>
+#include <functional>
+#include <iostream>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <CL/cl.hpp>
+
+namespace vex {
+
+/// Latency histogram of a kernel.
+/**
+ * Buckets are spaced by a factor of \f$2^{1/4}\f$, so that quantiles are
+ * accurate to about 10%. Counters are atomic, and the histogram may be read
+ * while it is being updated.
+ */
+class latency_histogram {
+    public:
+        static const int buckets = 256;
+
+        latency_histogram() {
+            for(int i = 0; i < buckets; i++) bucket[i] = 0;
+            total = 0;
+        }
+
+        /// Records single sample.
+        void add(cl_ulong ns) {
+            bucket[index(ns)].fetch_add(1, std::memory_order_relaxed);
+            total.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        /// Number of recorded samples.
+        size_t count() const {
+            return total.load(std::memory_order_relaxed);
+        }
+
+        /// Estimated quantile in seconds (q = 0.5 is the median).
+        double quantile(double q) const {
+            size_t n = count();
+            if (!n) return 0;
+
+            size_t rank = static_cast<size_t>(q * (n - 1)), seen = 0;
+
+            for(int i = 0; i < buckets; i++) {
+                seen += bucket[i].load(std::memory_order_relaxed);
+                if (seen > rank) return 1e-9 * std::pow(2.0, (i + 0.5) / 4);
+            }
+
+            return 1e-9 * std::pow(2.0, buckets / 4.0);
+        }
+    private:
+        std::atomic<size_t> bucket[buckets];
+        std::atomic<size_t> total;
+
+        // floor(4 * log2(ns)), from the leading bit and the two bits after it.
+        static int index(cl_ulong ns) {
+            if (ns < 2) return 0;
+
+            int b = 63;
+            while(!(ns >> b)) b--;
+
+            int frac = b >= 2 ?
+                static_cast<int>((ns >> (b - 2)) & 3) :
+                static_cast<int>((ns << (2 - b)) & 3);
+
+            return std::min(buckets - 1, 4 * b + frac);
+        }
+};
+
+/// Always-on sampled timing of kernel launches.
+/**
+ * Every launch made by VexCL (vector expressions, reductions, sparse
+ * matrices, stencils, FFT, etc.) passes through this class. When sampling
+ * is enabled, every n-th launch gets an event attached; completed events are
+ * collected on subsequent samples and queries, and their execution times go
+ * to a histogram per kernel name. The unsampled launches cost an atomic
+ * increment, and nothing is ever waited for:
+ * \code
+ * vex::telemetry<>::enable(100);
+ * // ... computations ...
+ * double p99 = vex::telemetry<>::quantile("minus_term_term", 0.99);
+ * vex::telemetry<>::write(std::cout);
+ * \endcode
+ * Hooks registered with on_sample() receive each collected sample, e.g. to
+ * forward it to a monitoring system. Only queues created with
+ * CL_QUEUE_PROFILING_ENABLE provide timings; samples from other queues are
+ * dropped.
+ */
+template <bool dummy = true>
+class telemetry {
+    static_assert(dummy, "dummy parameter should be true");
+
+    public:
+        /// Callback for collected samples: kernel name, device, and execution time in ns.
+        typedef std::function<void(const std::string&, cl_device_id, cl_ulong)> hook;
+
+        /// Starts sampling every n-th launch. Zero disables sampling.
+        static void enable(size_t n = 64) {
+            period = n;
+        }
+
+        /// Sampling period.
+        static size_t sampling() {
+            return period;
+        }
+
+        /// Registers a callback for collected samples.
+        static void on_sample(const hook &h) {
+            boost::lock_guard<boost::mutex> lock(mx);
+            hooks.push_back(h);
+        }
+
+        /// Event for a kernel launch, or NULL when the launch is not sampled.
+        static cl::Event* kernel(const cl::CommandQueue &q, const cl::Kernel &k) {
+            if (!sampled()) return 0;
+
+            boost::lock_guard<boost::mutex> lock(mx);
+            sample *s = push(q, k);
+            return s ? &s->event : 0;
+        }
+
+        /// Samples already existing event of a kernel launch.
+        static void add(const cl::CommandQueue &q, const cl::Kernel &k,
+                const cl::Event &e)
+        {
+            if (!sampled()) return;
+
+            boost::lock_guard<boost::mutex> lock(mx);
+            if (sample *s = push(q, k)) s->event = e;
+        }
+
+        /// Histogram for the given kernel name, or NULL.
+        static std::shared_ptr<const latency_histogram> histogram(const std::string &name) {
+            boost::lock_guard<boost::mutex> lock(mx);
+            collect();
+
+            auto h = hist.find(name);
+            return h == hist.end() ? std::shared_ptr<const latency_histogram>() : h->second;
+        }
+
+        /// Estimated quantile of execution time of the kernel in seconds.
+        static double quantile(const std::string &name, double q) {
+            auto h = histogram(name);
+            return h ? h->quantile(q) : 0;
+        }
+
+        /// Writes sample counts, median and 99th percentile of each kernel.
+        static void write(std::ostream &os) {
+            boost::lock_guard<boost::mutex> lock(mx);
+            collect();
+
+            for(auto h = hist.begin(); h != hist.end(); h++)
+                os << h->first
+                   << " samples=" << h->second->count()
+                   << " p50=" << h->second->quantile(0.50)
+                   << " p99=" << h->second->quantile(0.99)
+                   << std::endl;
+        }
+
+        /// Drops collected histograms.
+        static void reset() {
+            boost::lock_guard<boost::mutex> lock(mx);
+            hist.clear();
+        }
+    private:
+        struct sample {
+            cl::CommandQueue queue;
+            std::string      name;
+            cl::Event        event;
+        };
+
+        static const size_t max_pending = 1024;
+
+        static std::atomic<size_t> period;
+        static std::atomic<size_t> counter;
+
+        static boost::mutex mx;
+        static std::deque<sample> pending;
+        static std::map<std::string, std::shared_ptr<latency_histogram>> hist;
+        static std::vector<hook> hooks;
+
+        static bool sampled() {
+            size_t n = period;
+            return n && ++counter % n == 0;
+        }
+
+        // Deque never moves its elements on push_back/pop_front, so the
+        // returned pointer stays valid until the sample is collected. Should
+        // be called with the mutex locked.
+        static sample* push(const cl::CommandQueue &q, const cl::Kernel &k) {
+            collect();
+
+            // Do not let the pending list grow when nobody drains the queues.
+            if (pending.size() >= max_pending) return 0;
+
+            sample s;
+            s.queue = q;
+            s.name  = k.getInfo<CL_KERNEL_FUNCTION_NAME>();
+
+            pending.push_back(s);
+            return &pending.back();
+        }
+
+        // Moves completed samples to the histograms. Launches complete in
+        // order within a queue, so the scan stops at the first unfinished
+        // one. Should be called with the mutex locked.
+        static void collect() {
+            while(!pending.empty()) {
+                sample &s = pending.front();
+
+                // The launch has not been enqueued yet.
+                if (!s.event()) break;
+
+                try {
+                    if (s.event.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() > CL_COMPLETE)
+                        break;
+
+                    cl_ulong ns =
+                        s.event.getProfilingInfo<CL_PROFILING_COMMAND_END>() -
+                        s.event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+
+                    auto &h = hist[s.name];
+                    if (!h) h = std::make_shared<latency_histogram>();
+                    h->add(ns);
+
+                    if (!hooks.empty()) {
+                        cl_device_id d = s.queue.getInfo<CL_QUEUE_DEVICE>()();
+                        for(auto f = hooks.begin(); f != hooks.end(); f++)
+                            (*f)(s.name, d, ns);
+                    }
+                } catch(const cl::Error&) {
+                    // Queue without profiling enabled, or failed command.
+                }
+
+                pending.pop_front();
+            }
+        }
+};
+
+template <bool dummy>
+std::atomic<size_t> telemetry<dummy>::period(0);
+
+template <bool dummy>
+std::atomic<size_t> telemetry<dummy>::counter(0);
+
+template <bool dummy>
+boost::mutex telemetry<dummy>::mx;
+
+template <bool dummy>
+std::deque<typename telemetry<dummy>::sample> telemetry<dummy>::pending;
+
+template <bool dummy>
+std::map<std::string, std::shared_ptr<latency_histogram>> telemetry<dummy>::hist;
+
+template <bool dummy>
+std::vector<typename telemetry<dummy>::hook> telemetry<dummy>::hooks;
+
+} // namespace vex
+
+#ifdef WIN32
+#  pragma warning(pop)
+#endif
+
+// vim: et
+#endif
@@ -0,0 +1,389 @@
+#ifndef VEXCL_TRACE_HPP
+#define VEXCL_TRACE_HPP
+
+/*
+The MIT License
+
+Copyright (c) 2012-2013 Denis Demidov <ddemidov@ksu.ru>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/**
+ * \file   vexcl/trace.hpp
+ * \author Denis Demidov <ddemidov@ksu.ru>
+ * \brief  Event trace of kernel launches and transfers.
+ */
+
+#ifdef WIN32
+#  pragma warning(push)
+#  pragma warning(disable : 4267 4290)
+#  define NOMINMAX
+#endif
+
+#include <deque>
+#include <vector>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <iostream>
+#include <iomanip>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/io/ios_state.hpp>
+#include <CL/cl.hpp>
+#include <vexcl/telemetry.hpp>
+
+namespace vex {
+
+/// Asynchronous trace of device commands.
+/**
+ * When enabled, VexCL attaches an event to every kernel launch and host
+ * transfer it enqueues, and keeps the events along with the kernel names.
+ * Nothing is waited for while the trace is recorded; the profiling
+ * timestamps are only read when the trace is written. The queues should be
+ * created with CL_QUEUE_PROFILING_ENABLE; commands from other queues are
+ * skipped on output.
+ * \code
+ * vex::Context ctx(vex::Filter::Env, CL_QUEUE_PROFILING_ENABLE);
+ * vex::event_trace<>::enable();
+ * // ... computations ...
+ * std::ofstream f("trace.json");
+ * vex::event_trace<>::write(f);
+ * \endcode
+ * The output is in Chrome trace event format (load it in chrome://tracing),
+ * with a process for each device and a thread for each queue. Timestamps
+ * come from the device clocks, so intervals on different devices only line
+ * up when the devices share a time base.
+ */
+template <bool dummy = true>
+class event_trace {
+    static_assert(dummy, "dummy parameter should be true");
+
+    public:
+        /// Starts or stops recording.
+        static void enable(bool on = true) {
+            active = on;
+        }
+
+        /// Whether the trace is being recorded.
+        static bool enabled() {
+            return active;
+        }
+
+        /// Event for a kernel launch, or NULL when the trace is disabled.
+        /**
+         * When the trace is disabled, the launch may still be sampled by
+         * vex::telemetry.
+         * The result is passed as the event argument to enqueueNDRangeKernel().
+         * \param bytes Estimated global memory traffic of the launch.
+         * \param flops Estimated number of arithmetic operations.
+         */
+        static cl::Event* kernel(const cl::CommandQueue &q, const cl::Kernel &k,
+                size_t bytes = 0, size_t flops = 0)
+        {
+            if (!active) return telemetry<>::kernel(q, k);
+
+            record &r = push(q, k.getInfo<CL_KERNEL_FUNCTION_NAME>(), "kernel");
+            r.bytes = bytes;
+            r.flops = flops;
+
+            return &r.event;
+        }
+
+        /// Event for a transfer, or NULL when the trace is disabled.
+        static cl::Event* transfer(const cl::CommandQueue &q, const std::string &name) {
+            if (!active) return 0;
+            return &push(q, name, "transfer").event;
+        }
+
+        /// Records already existing event.
+        static void add(const cl::CommandQueue &q, const std::string &name,
+                const cl::Event &e, const std::string &category = "transfer")
+        {
+            if (!active) return;
+            push(q, name, category).event = e;
+        }
+
+        /// Records existing event of a kernel launch.
+        static void add(const cl::CommandQueue &q, const cl::Kernel &k,
+                const cl::Event &e, size_t bytes = 0, size_t flops = 0)
+        {
+            if (!active) {
+                telemetry<>::add(q, k, e);
+                return;
+            }
+
+            record &r = push(q, k.getInfo<CL_KERNEL_FUNCTION_NAME>(), "kernel");
+            r.event = e;
+            r.bytes = bytes;
+            r.flops = flops;
+        }
+
+        /// Sets peak memory bandwidth of a device in GB/s.
+        /**
+         * OpenCL does not report the peak bandwidth, so it has to be taken
+         * from the device specifications. When set, summary() shows achieved
+         * bandwidth as a fraction of the peak.
+         */
+        static void peak_bandwidth(const cl::Device &d, double gbps) {
+            boost::lock_guard<boost::mutex> lock(mx);
+            peak[d()] = gbps;
+        }
+
+        /// Drops recorded events.
+        static void clear() {
+            boost::lock_guard<boost::mutex> lock(mx);
+            records.clear();
+        }
+
+        /// Writes recorded events in Chrome trace format.
+        /**
+         * Waits for completion of the recorded commands.
+         */
+        static void write(std::ostream &os) {
+            boost::lock_guard<boost::mutex> lock(mx);
+
+            cl_ulong t0;
+            std::vector<timing> t = timings(t0);
+
+            std::map<cl_device_id, int>        pid;
+            std::map<cl_command_queue, int>    tid;
+            std::map<cl_device_id, cl::Device> dev;
+
+            os << "{\"traceEvents\":[\n";
+
+            bool first = true;
+            for(auto e = t.begin(); e != t.end(); e++) {
+                cl::Device d;
+                e->r->queue.getInfo(CL_QUEUE_DEVICE, &d);
+
+                if (!pid.count(d())) {
+                    int p = pid.size();
+                    pid[d()] = p;
+                    dev[d()] = d;
+                }
+
+                if (!tid.count(e->r->queue())) {
+                    int q = tid.size();
+                    tid[e->r->queue()] = q;
+                }
+
+                if (!first) os << ",\n";
+                first = false;
+
+                os << "{\"name\":\"" << escape(e->r->name) << "\","
+                   << "\"cat\":\"" << e->r->category << "\","
+                   << "\"ph\":\"X\","
+                   << "\"pid\":" << pid[d()] << ","
+                   << "\"tid\":" << tid[e->r->queue()] << ","
+                   << "\"ts\":" << (e->start - t0) / 1000.0 << ","
+                   << "\"dur\":" << (e->end - e->start) / 1000.0 << ","
+                   << "\"args\":{\"wait_us\":" << (e->start - e->queued) / 1000.0;
+
+                if (e->r->bytes || e->r->flops) {
+                    // Bytes per nanosecond are gigabytes per second.
+                    double ns = std::max<cl_ulong>(1, e->end - e->start);
+                    os << ",\"bytes\":" << e->r->bytes
+                       << ",\"flops\":" << e->r->flops
+                       << ",\"GB/s\":" << e->r->bytes / ns
+                       << ",\"GFLOP/s\":" << e->r->flops / ns;
+                }
+
+                os << "}}";
+            }
+
+            for(auto p = pid.begin(); p != pid.end(); p++) {
+                if (!first) os << ",\n";
+                first = false;
+
+                os << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << p->second
+                   << ",\"args\":{\"name\":\""
+                   << escape(dev[p->first].getInfo<CL_DEVICE_NAME>()) << "\"}}";
+            }
+
+            os << "\n]}\n";
+        }
+
+        /// Writes per-kernel totals of recorded events.
+        /**
+         * For each device and command name shows number of calls, total
+         * time, and, for kernels with known traffic and operation counts,
+         * achieved bandwidth and arithmetic throughput. Waits for completion
+         * of the recorded commands.
+         */
+        static void summary(std::ostream &os) {
+            boost::lock_guard<boost::mutex> lock(mx);
+
+            struct total {
+                size_t calls, bytes, flops;
+                cl_ulong ns;
+                total() : calls(0), bytes(0), flops(0), ns(0) {}
+            };
+
+            typedef std::pair<cl_device_id, std::string> key;
+
+            std::map<key, total>               tot;
+            std::map<cl_device_id, cl::Device> dev;
+
+            cl_ulong t0;
+            std::vector<timing> t = timings(t0);
+
+            for(auto e = t.begin(); e != t.end(); e++) {
+                cl::Device d;
+                e->r->queue.getInfo(CL_QUEUE_DEVICE, &d);
+                dev[d()] = d;
+
+                total &s = tot[key(d(), e->r->name)];
+                s.calls++;
+                s.bytes += e->r->bytes;
+                s.flops += e->r->flops;
+                s.ns    += e->end - e->start;
+            }
+
+            boost::io::ios_all_saver stream_state(os);
+            os << std::fixed;
+
+            cl_device_id current = 0;
+            for(auto s = tot.begin(); s != tot.end(); s++) {
+                if (s->first.first != current) {
+                    current = s->first.first;
+                    os << dev[current].getInfo<CL_DEVICE_NAME>() << std::endl;
+                }
+
+                os << "  " << std::left  << std::setw(40) << s->first.second
+                   << std::right
+                   << std::setw(8)  << s->second.calls
+                   << std::setw(12) << std::setprecision(3) << s->second.ns * 1e-6 << " ms";
+
+                if (s->second.bytes || s->second.flops) {
+                    double ns = std::max<cl_ulong>(1, s->second.ns);
+                    double bw = s->second.bytes / ns;
+
+                    os << std::setw(10) << std::setprecision(2) << bw << " GB/s"
+                       << std::setw(10) << s->second.flops / ns << " GFLOP/s";
+
+                    auto p = peak.find(current);
+                    if (p != peak.end() && p->second > 0)
+                        os << std::setw(7) << std::setprecision(1)
+                           << 100 * bw / p->second << "% of peak";
+                }
+
+                os << std::endl;
+            }
+        }
+    private:
+        struct record {
+            cl::CommandQueue queue;
+            std::string      name;
+            std::string      category;
+            cl::Event        event;
+            size_t           bytes;
+            size_t           flops;
+
+            record() : bytes(0), flops(0) {}
+        };
+
+        struct timing {
+            const record *r;
+            cl_ulong queued, start, end;
+        };
+
+        static bool active;
+        static boost::mutex mx;
+        static std::deque<record> records;
+        static std::map<cl_device_id, double> peak;
+
+        // Waits for the recorded commands and reads their timestamps. Should
+        // be called with the mutex locked.
+        static std::vector<timing> timings(cl_ulong &t0) {
+            std::vector<timing> t;
+            t.reserve(records.size());
+
+            t0 = ~static_cast<cl_ulong>(0);
+
+            for(auto r = records.begin(); r != records.end(); r++) {
+                if (!r->event()) continue;
+
+                try {
+                    r->event.wait();
+
+                    timing tm = {
+                        &*r,
+                        r->event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>(),
+                        r->event.getProfilingInfo<CL_PROFILING_COMMAND_START>(),
+                        r->event.getProfilingInfo<CL_PROFILING_COMMAND_END>()
+                    };
+
+                    t0 = std::min(t0, tm.queued);
+                    t.push_back(tm);
+                } catch(const cl::Error&) {
+                    // Queue without profiling enabled.
+                }
+            }
+
+            return t;
+        }
+
+        // Deque never moves its elements, so the returned reference stays
+        // valid until clear().
+        static record& push(const cl::CommandQueue &q, const std::string &name,
+                const std::string &category)
+        {
+            boost::lock_guard<boost::mutex> lock(mx);
+
+            record r;
+            r.queue    = q;
+            r.name     = name;
+            r.category = category;
+
+            records.push_back(r);
+            return records.back();
+        }
+
+        static std::string escape(const std::string &s) {
+            std::string r;
+            for(auto c = s.begin(); c != s.end(); c++) {
+                if (*c == '"' || *c == '\\') r += '\\';
+                if (static_cast<unsigned char>(*c) >= 0x20) r += *c;
+            }
+            return r;
+        }
+};
+
+template <bool dummy>
+bool event_trace<dummy>::active = false;
+
+template <bool dummy>
+boost::mutex event_trace<dummy>::mx;
+
+template <bool dummy>
+std::deque<typename event_trace<dummy>::record> event_trace<dummy>::records;
+
+template <bool dummy>
+std::map<cl_device_id, double> event_trace<dummy>::peak;
+
+} // namespace vex
+
+#ifdef WIN32
+#  pragma warning(pop)
+#endif
+
+// vim: et
+#endif
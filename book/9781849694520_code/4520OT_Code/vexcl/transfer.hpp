@@ -0,0 +1,193 @@
+#ifndef VEXCL_TRANSFER_HPP
+#define VEXCL_TRANSFER_HPP
+
+/*
+The MIT License
+
+Copyright (c) 2012-2013 Denis Demidov <ddemidov@ksu.ru>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/**
+ * \file   vexcl/transfer.hpp
+ * \author Denis Demidov <ddemidov@ksu.ru>
+ * \brief  Pinned host staging and device-to-device copies.
+ */
+
+#ifdef WIN32
+#  pragma warning(push)
+#  pragma warning(disable : 4267 4290)
+#  define NOMINMAX
+#endif
+
+#include <vector>
+#include <algorithm>
+#include <CL/cl.hpp>
+#include <vexcl/util.hpp>
+#include <vexcl/memory_pool.hpp>
+#include <vexcl/trace.hpp>
+
+namespace vex {
+
+/// \cond INTERNAL
+
+/// Pair of pinned host buffers used for double-buffered transfers.
+template <typename T>
+struct pinned_staging {
+    cl::CommandQueue queue;
+    cl::Buffer       buf[2];
+    T               *ptr[2];
+    cl::Event        event[2];
+    bool             busy[2];
+
+    pinned_staging(const cl::CommandQueue &q, size_t chunk) : queue(q) {
+        for(int i = 0; i < 2; i++) {
+            buf[i] = memory_pool<>::create("staging",
+                    qctx(q), CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
+                    chunk * sizeof(T));
+
+            ptr[i] = static_cast<T*>(queue.enqueueMapBuffer(buf[i], CL_TRUE,
+                        CL_MAP_READ | CL_MAP_WRITE, 0, chunk * sizeof(T)));
+
+            busy[i] = false;
+        }
+    }
+
+    void wait(int i) {
+        if (busy[i]) event[i].wait();
+        busy[i] = false;
+    }
+
+    ~pinned_staging() {
+        for(int i = 0; i < 2; i++) {
+            wait(i);
+            queue.enqueueUnmapMemObject(buf[i], ptr[i]);
+        }
+        queue.finish();
+    }
+};
+
+inline size_t default_stream_chunk(size_t elem_size) {
+    return std::max<size_t>(1, (16U << 20) / elem_size);
+}
+
+// Completes the user event a staged write waits on, once the read into the
+// staging buffer is done.
+inline void CL_CALLBACK staged_chunk_arrived(cl_event, cl_int status, void *data) {
+    cl_event arrived = static_cast<cl_event>(data);
+    clSetUserEventStatus(arrived, status < 0 ? status : CL_COMPLETE);
+    clReleaseEvent(arrived);
+}
+
+/// \endcond
+
+/// Whether buffers of the two queues may be copied between directly.
+/**
+ * OpenCL copies buffers without the host only within a context, so this is
+ * true for the queues of devices sharing a context (for example, GPUs of one
+ * platform put into a single context by the application).
+ */
+inline bool peer_copy(const cl::CommandQueue &a, const cl::CommandQueue &b) {
+    return qctx(a)() == qctx(b)();
+}
+
+/// Copies a range of bytes between buffers of two devices.
+/**
+ * When the queues share a context, the range is copied directly with
+ * clEnqueueCopyBuffer, ordered after the commands already enqueued to both
+ * queues. The host does not wait; the returned event marks the end of the
+ * copy, and the source should not be overwritten before it.
+ *
+ * Otherwise the range is pipelined through two pinned host buffers of the
+ * source context, in chunks of the given size (in bytes): the write of a
+ * chunk to the destination overlaps with the read of the next one from the
+ * source, and does not wait for the host. The call returns when the whole
+ * range has been written.
+ *
+ * All multi-device exchanges of VexCL (repartitioning of vectors, scattered
+ * gathers, dense products) go through this function or, for the exchanges of
+ * SpMat and stencils that keep their own host buffers, follow the same rule.
+ */
+inline cl::Event device_copy(
+        const cl::CommandQueue &src_queue, const cl::Buffer &src, size_t src_offset,
+        const cl::CommandQueue &dst_queue, const cl::Buffer &dst, size_t dst_offset,
+        size_t bytes, size_t chunk = 0)
+{
+    cl::Event done;
+
+    if (peer_copy(src_queue, dst_queue)) {
+        std::vector<cl::Event> wait;
+
+        if (src_queue() != dst_queue()) {
+            wait.resize(1);
+            src_queue.enqueueMarker(&wait[0]);
+        }
+
+        dst_queue.enqueueCopyBuffer(src, dst, src_offset, dst_offset, bytes,
+                wait.empty() ? 0 : &wait, &done);
+        event_trace<>::add(dst_queue, "peer_copy", done);
+
+        return done;
+    }
+
+    if (!chunk) chunk = default_stream_chunk(1);
+    chunk = std::min(chunk, bytes);
+
+    cl::Context context = qctx(dst_queue);
+    pinned_staging<char> stage(src_queue, chunk);
+
+    for(size_t start = 0, k = 0; start < bytes; start += chunk, k++) {
+        size_t n = std::min(chunk, bytes - start);
+        int    i = k % 2;
+
+        // The write of chunk k - 2 has to be done with the buffer.
+        stage.wait(i);
+
+        cl::Event r;
+        src_queue.enqueueReadBuffer(src, CL_FALSE, src_offset + start, n,
+                stage.ptr[i], 0, &r);
+        event_trace<>::add(src_queue, "staged_read", r);
+
+        cl::UserEvent arrived(context);
+
+        clRetainEvent(arrived());
+        r.setCallback(CL_COMPLETE, &staged_chunk_arrived, arrived());
+        src_queue.flush();
+
+        std::vector<cl::Event> wait(1, arrived);
+        dst_queue.enqueueWriteBuffer(dst, CL_FALSE, dst_offset + start, n,
+                stage.ptr[i], &wait, &stage.event[i]);
+        event_trace<>::add(dst_queue, "staged_write", stage.event[i]);
+
+        stage.busy[i] = true;
+        done = stage.event[i];
+    }
+
+    return done;
+}
+
+} // namespace vex
+
+#ifdef WIN32
+#  pragma warning(pop)
+#endif
+
+// vim: et
+#endif
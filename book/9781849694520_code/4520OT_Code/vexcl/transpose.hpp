@@ -0,0 +1,217 @@
+#ifndef VEXCL_TRANSPOSE_HPP
+#define VEXCL_TRANSPOSE_HPP
+
+/*
+The MIT License
+
+Copyright (c) 2012-2013 Denis Demidov <ddemidov@ksu.ru>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/**
+ * \file   vexcl/transpose.hpp
+ * \author Denis Demidov <ddemidov@ksu.ru>
+ * \brief  Matrix transposition of device vectors.
+ */
+
+#ifdef WIN32
+#  pragma warning(push)
+#  pragma warning(disable : 4267 4290)
+#  define NOMINMAX
+#endif
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <stdexcept>
+#include <memory>
+#include <CL/cl.hpp>
+#include <vexcl/util.hpp>
+#include <vexcl/kernel_cache.hpp>
+#include <vexcl/vector.hpp>
+
+namespace vex {
+
+/// \cond INTERNAL
+
+namespace transposition {
+
+// Tiled transposition. A work-group of tile x tile work-items reads a tile
+// of the matrix row by row into local memory and writes it out transposed,
+// again row by row, so both sides of the global memory traffic are
+// coalesced. Tile rows are padded by one element against bank conflicts of
+// the column-wise local reads.
+//
+// The in-place kernel runs on a square matrix: the group of tile (i, j),
+// i < j, swaps it with tile (j, i), diagonal tiles are transposed in place,
+// and groups below the diagonal have nothing to do.
+template <typename T>
+struct kernels {
+    cl::Kernel copy;
+    cl::Kernel inplace;
+    size_t     tile;
+
+    static std::string source(size_t tile) {
+        std::ostringstream src;
+
+        src << standard_kernel_header <<
+            "typedef " << type_name<T>() << " real;\n"
+            "typedef " << type_name<size_t>() << " idx_t;\n"
+            "#define TILE " << tile << "\n"
+            "kernel void transpose_copy(\n"
+            "    idx_t rows, idx_t cols,\n"
+            "    global const real *x,\n"
+            "    global real *y\n"
+            "    )\n"
+            "{\n"
+            "    local real tile[TILE][TILE + 1];\n"
+            "    size_t lx = get_local_id(0), ly = get_local_id(1);\n"
+            "    idx_t c = get_group_id(0) * TILE + lx;\n"
+            "    idx_t r = get_group_id(1) * TILE + ly;\n"
+            "    if (r < rows && c < cols) tile[ly][lx] = x[r * cols + c];\n"
+            "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+            "    c = get_group_id(1) * TILE + lx;\n"
+            "    r = get_group_id(0) * TILE + ly;\n"
+            "    if (r < cols && c < rows) y[r * rows + c] = tile[lx][ly];\n"
+            "}\n"
+            "kernel void transpose_inplace(\n"
+            "    idx_t n,\n"
+            "    global real *x\n"
+            "    )\n"
+            "{\n"
+            "    local real a[TILE][TILE + 1];\n"
+            "    local real b[TILE][TILE + 1];\n"
+            "    size_t gi = get_group_id(1), gj = get_group_id(0);\n"
+            "    if (gi > gj) return;\n"
+            "    size_t lx = get_local_id(0), ly = get_local_id(1);\n"
+            "    idx_t ar = gi * TILE + ly, ac = gj * TILE + lx;\n"
+            "    idx_t br = gj * TILE + ly, bc = gi * TILE + lx;\n"
+            "    if (ar < n && ac < n) a[ly][lx] = x[ar * n + ac];\n"
+            "    if (gi != gj && br < n && bc < n) b[ly][lx] = x[br * n + bc];\n"
+            "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+            "    if (br < n && bc < n) x[br * n + bc] = a[lx][ly];\n"
+            "    if (gi != gj && ar < n && ac < n) x[ar * n + ac] = b[lx][ly];\n"
+            "}\n";
+
+        return src.str();
+    }
+
+    static std::shared_ptr<kernels> get(const cl::CommandQueue &queue) {
+        std::shared_ptr<kernels> k = kernel_cache<>::find<kernels>(queue);
+        if (k) return k;
+
+        cl::Context context = qctx(queue);
+        cl::Device  device  = qdev(queue);
+
+        // Two padded tiles should fit into local memory, and a tile into a
+        // work-group.
+        size_t lmem = static_cast<size_t>(device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>());
+        size_t wmax = device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+
+        size_t tile = 16;
+        while(tile > 1 && (tile * tile > wmax ||
+                    2 * tile * (tile + 1) * sizeof(T) > lmem / 2))
+            tile /= 2;
+
+        auto program = build_sources(context, source(tile));
+
+        kernels e;
+        e.copy    = cl::Kernel(program, "transpose_copy");
+        e.inplace = cl::Kernel(program, "transpose_inplace");
+        e.tile    = tile;
+
+        return kernel_cache<>::insert(queue, e);
+    }
+};
+
+template <typename T>
+const cl::CommandQueue& single_queue(const vector<T> &x, const char *what) {
+    if (x.queue_list().size() != 1)
+        throw std::logic_error(std::string(what) + ": only single-device vectors are supported");
+
+    return x.queue_list()[0];
+}
+
+} // namespace transposition
+
+/// \endcond
+
+/// Transposes the row-major rows x cols matrix stored in x into y.
+/**
+ * y receives the cols x rows transpose of x, also row-major:
+ * \code
+ * vex::vector<double> A(ctx.queue(0), n * m), At(ctx.queue(0), m * n);
+ * vex::transpose(A, At, n, m);
+ * \endcode
+ * Only single-device vectors are supported, since a tile of the result may
+ * come from any part of the source.
+ */
+template <typename T>
+void transpose(const vector<T> &x, vector<T> &y, size_t rows, size_t cols) {
+    const cl::CommandQueue &queue = transposition::single_queue(x, "transpose");
+    transposition::single_queue(y, "transpose");
+
+    if (x.size() != rows * cols || y.size() != rows * cols)
+        throw std::invalid_argument("transpose: vector sizes do not match the matrix");
+
+    if (!x.size()) return;
+
+    auto krn = transposition::kernels<T>::get(queue);
+    size_t t = krn->tile;
+
+    krn->copy.setArg(0, rows);
+    krn->copy.setArg(1, cols);
+    krn->copy.setArg(2, x(0));
+    krn->copy.setArg(3, y(0));
+
+    queue.enqueueNDRangeKernel(krn->copy, cl::NullRange,
+            cl::NDRange(alignup(cols, t), alignup(rows, t)), cl::NDRange(t, t),
+            0, event_trace<>::kernel(queue, krn->copy, 2 * x.size() * sizeof(T)));
+}
+
+/// Transposes the row-major n x n matrix stored in x in place.
+template <typename T>
+void transpose(vector<T> &x, size_t n) {
+    const cl::CommandQueue &queue = transposition::single_queue(x, "transpose");
+
+    if (x.size() != n * n)
+        throw std::invalid_argument("transpose: vector size does not match the matrix");
+
+    if (!n) return;
+
+    auto krn = transposition::kernels<T>::get(queue);
+    size_t t = krn->tile;
+
+    krn->inplace.setArg(0, n);
+    krn->inplace.setArg(1, x(0));
+
+    queue.enqueueNDRangeKernel(krn->inplace, cl::NullRange,
+            cl::NDRange(alignup(n, t), alignup(n, t)), cl::NDRange(t, t),
+            0, event_trace<>::kernel(queue, krn->inplace, 2 * x.size() * sizeof(T)));
+}
+
+} // namespace vex
+
+#ifdef WIN32
+#  pragma warning(pop)
+#endif
+
+// vim: et
+#endif
@@ -0,0 +1,404 @@
+#ifndef VEXCL_TRISOLVE_HPP
+#define VEXCL_TRISOLVE_HPP
+
+/*
+The MIT License
+
+Copyright (c) 2012-2013 Denis Demidov <ddemidov@ksu.ru>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/**
+ * \file   vexcl/trisolve.hpp
+ * \author Denis Demidov <ddemidov@ksu.ru>
+ * \brief  Level-scheduled sparse triangular solves.
+ */
+
+#ifdef WIN32
+#  pragma warning(push)
+#  pragma warning(disable : 4267 4290)
+#  define NOMINMAX
+#endif
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <CL/cl.hpp>
+#include <vexcl/util.hpp>
+#include <vexcl/kernel_cache.hpp>
+#include <vexcl/vector.hpp>
+#include <vexcl/sort.hpp>
+
+namespace vex {
+
+/// \cond INTERNAL
+
+namespace trisolve {
+
+// Kernels of the level-scheduled solve. The level of a row is one more than
+// the largest level of the rows it depends on. trsv_levels is a sweep of
+// this recurrence updated in place, so that new levels propagate within a
+// sweep as well; the levels only grow and are bounded by the true ones, and
+// the sweeps are repeated until none of them changes. The rows are then
+// sorted by level, and trsv_bounds finds where each level starts in the
+// sorted order. trsv_solve substitutes the rows of one level.
+template <typename real>
+struct kernels {
+    cl::Kernel levels;
+    cl::Kernel bounds;
+    cl::Kernel solve;
+    size_t     wgsize;
+    size_t     g_size;
+
+    static std::string source() {
+        std::ostringstream src;
+
+        src << standard_kernel_header <<
+            "typedef " << type_name<real>() << " real;\n"
+            "typedef " << type_name<size_t>() << " idx_t;\n"
+            "kernel void trsv_levels(\n"
+            "    uint n,\n"
+            "    global const idx_t *row,\n"
+            "    global const uint *col,\n"
+            "    global uint *level,\n"
+            "    global uint *state\n"
+            "    )\n"
+            "{\n"
+            "    for(uint i = get_global_id(0); i < n; i += get_global_size(0)) {\n"
+            "        uint lev = 0;\n"
+            "        for(idx_t j = row[i], e = row[i + 1]; j < e; j++)\n"
+            "            lev = max(lev, level[col[j]] + 1);\n"
+            "        if (lev != level[i]) {\n"
+            "            level[i] = lev;\n"
+            "            state[0] = 1;\n"
+            "            atomic_max(state + 1, lev);\n"
+            "        }\n"
+            "    }\n"
+            "}\n"
+            "kernel void trsv_bounds(\n"
+            "    uint n,\n"
+            "    global const uint *level,\n"
+            "    global uint *start\n"
+            "    )\n"
+            "{\n"
+            "    for(uint i = get_global_id(0); i < n; i += get_global_size(0)) {\n"
+            "        if (i == 0 || level[i] != level[i - 1]) start[level[i]] = i;\n"
+            "        if (i == n - 1) start[level[i] + 1] = n;\n"
+            "    }\n"
+            "}\n"
+            "kernel void trsv_solve(\n"
+            "    uint beg, uint end,\n"
+            "    global const uint *perm,\n"
+            "    global const idx_t *row,\n"
+            "    global const uint *col,\n"
+            "    global const real *val,\n"
+            "    global const real *dinv,\n"
+            "    global const real *b,\n"
+            "    global real *x\n"
+            "    )\n"
+            "{\n"
+            "    for(uint k = beg + get_global_id(0); k < end; k += get_global_size(0)) {\n"
+            "        uint i = perm[k];\n"
+            "        real s = b[i];\n"
+            "        for(idx_t j = row[i], e = row[i + 1]; j < e; j++)\n"
+            "            s -= val[j] * x[col[j]];\n"
+            "        x[i] = dinv[i] * s;\n"
+            "    }\n"
+            "}\n";
+
+        return src.str();
+    }
+
+    static std::shared_ptr<kernels> get(const cl::CommandQueue &queue) {
+        std::shared_ptr<kernels> k = kernel_cache<>::find<kernels>(queue);
+        if (k) return k;
+
+        cl::Context context = qctx(queue);
+        cl::Device  device  = qdev(queue);
+
+        auto program = build_sources(context, source());
+
+        kernels e;
+        e.levels = cl::Kernel(program, "trsv_levels");
+        e.bounds = cl::Kernel(program, "trsv_bounds");
+        e.solve  = cl::Kernel(program, "trsv_solve");
+
+        e.wgsize = std::min<size_t>(256, std::min(
+                    kernel_workgroup_size(e.levels, device),
+                    kernel_workgroup_size(e.solve, device)));
+
+        e.g_size = device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU ?
+            device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * e.wgsize :
+            device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * e.wgsize * 4;
+
+        return kernel_cache<>::insert(queue, e);
+    }
+};
+
+} // namespace trisolve
+
+/// \endcond
+
+/// Sparse triangular solve with level scheduling.
+/**
+ * Solves \f$Tx = b\f$ for a lower or upper triangular matrix T given in CSR
+ * format; the diagonal may be implied to be unit, in which case diagonal
+ * entries of the arrays are ignored:
+ * \code
+ * vex::triangular_solver<double> L(ctx, n, row.data(), col.data(), val.data());
+ * L(b, x);
+ * \endcode
+ * The rows are grouped into levels once, on the compute devices, when the
+ * solver is constructed: rows of a level depend only on rows of the earlier
+ * levels and are substituted in parallel, one kernel launch per level. The
+ * row order and the level boundaries are kept with the solver, so a solve
+ * costs a pass over the matrix and as many launches as there are levels.
+ * Wavefront-like matrices such as factors of grid operators have a few
+ * hundred levels and solve well; long dependency chains do not.
+ *
+ * On several devices each device solves the diagonal block of its own
+ * partition of the vectors and couplings between the partitions are dropped,
+ * as in a block-Jacobi preconditioner; the solve is exact on a single device.
+ * b and x may be the same vector.
+ */
+template <typename real>
+class triangular_solver {
+    public:
+        /// Which triangle of the matrix is stored.
+        enum triangle {
+            lower, ///< Entries on and below the diagonal.
+            upper  ///< Entries on and above the diagonal.
+        };
+
+        /// Constructor.
+        /**
+         * \param queue vector of queues.
+         * \param n     number of rows in the matrix.
+         * \param row   row index into col and val vectors.
+         * \param col   column numbers of nonzero elements of the matrix.
+         * \param val   values of nonzero elements of the matrix.
+         * \param uplo  triangle of the matrix.
+         * \param unit  whether the diagonal is unit.
+         */
+        template <typename idx_t, typename column_t>
+        triangular_solver(const std::vector<cl::CommandQueue> &queue,
+                size_t n, const idx_t *row, const column_t *col, const real *val,
+                triangle uplo = lower, bool unit = false
+                )
+            : queue(queue), krn(queue.size()), dev(queue.size())
+        {
+            std::vector<size_t> part = partition(n, queue);
+
+            for(uint d = 0; d < queue.size(); d++) {
+                size_t beg = part[d], end = part[d + 1];
+                if (beg == end) continue;
+
+                if (end - beg > std::numeric_limits<cl_uint>::max())
+                    throw std::length_error("triangular_solver: too many rows");
+
+                // Diagonal block without the diagonal, local column numbers.
+                std::vector<size_t>  lrow(1, 0);
+                std::vector<cl_uint> lcol;
+                std::vector<real>    lval, dinv(end - beg, unit ? 1 : 0);
+
+                for(size_t i = beg; i < end; i++) {
+                    for(size_t j = row[i]; j < static_cast<size_t>(row[i + 1]); j++) {
+                        size_t c = col[j];
+
+                        if (uplo == lower ? c > i : c < i)
+                            throw std::invalid_argument(
+                                    "triangular_solver: entry outside of the triangle");
+
+                        if (c == i) {
+                            if (!unit) dinv[i - beg] += val[j];
+                        } else if (c >= beg && c < end) {
+                            lcol.push_back(static_cast<cl_uint>(c - beg));
+                            lval.push_back(val[j]);
+                        }
+                    }
+
+                    if (dinv[i - beg] == 0)
+                        throw std::runtime_error("Zero diagonal entry");
+
+                    if (!unit) dinv[i - beg] = 1 / dinv[i - beg];
+
+                    lrow.push_back(lcol.size());
+                }
+
+                setup(d, lrow, lcol, lval, dinv);
+            }
+        }
+
+        /// Solves \f$Tx = b\f$.
+        void operator()(const vector<real> &b, vector<real> &x) const {
+            for(uint d = 0; d < queue.size(); d++) {
+                const device_data &s = dev[d];
+                if (!s.n) continue;
+
+                const kernels_t &k = *krn[d];
+
+                for(size_t l = 0; l + 1 < s.start.size(); l++) {
+                    size_t cnt = s.start[l + 1] - s.start[l];
+
+                    uint pos = 0;
+                    k.solve.setArg(pos++, s.start[l]);
+                    k.solve.setArg(pos++, s.start[l + 1]);
+                    k.solve.setArg(pos++, s.perm);
+                    k.solve.setArg(pos++, s.row);
+                    k.solve.setArg(pos++, s.col);
+                    k.solve.setArg(pos++, s.val);
+                    k.solve.setArg(pos++, s.dinv);
+                    k.solve.setArg(pos++, b(d));
+                    k.solve.setArg(pos++, x(d));
+
+                    queue[d].enqueueNDRangeKernel(k.solve, cl::NullRange,
+                            std::min(alignup(cnt, k.wgsize), k.g_size), k.wgsize,
+                            0, event_trace<>::kernel(queue[d], k.solve));
+                }
+            }
+        }
+
+        /// Number of levels on the given device.
+        size_t levels(uint d) const {
+            return dev[d].start.empty() ? 0 : dev[d].start.size() - 1;
+        }
+    private:
+        typedef trisolve::kernels<real> kernels_t;
+
+        struct device_data {
+            size_t n;
+            cl::Buffer row, col, val, dinv, perm;
+            std::vector<cl_uint> start;
+
+            device_data() : n(0) {}
+        };
+
+        const std::vector<cl::CommandQueue> &queue;
+
+        std::vector< std::shared_ptr<kernels_t> > krn;
+        std::vector<device_data> dev;
+
+        void setup(uint d, const std::vector<size_t> &lrow,
+                const std::vector<cl_uint> &lcol, const std::vector<real> &lval,
+                const std::vector<real> &dinv)
+        {
+            const cl::CommandQueue &q = queue[d];
+            cl::Context context = qctx(q);
+
+            krn[d] = kernels_t::get(q);
+
+            const kernels_t &k = *krn[d];
+
+            device_data &s = dev[d];
+            s.n = dinv.size();
+
+            const cl_uint n = static_cast<cl_uint>(s.n);
+
+            s.row = memory_pool<>::create("trisolve",
+                    context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                    lrow.size() * sizeof(size_t), const_cast<size_t*>(lrow.data()));
+            s.dinv = memory_pool<>::create("trisolve",
+                    context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                    dinv.size() * sizeof(real), const_cast<real*>(dinv.data()));
+
+            // Keep the buffers valid for the rows without dependencies.
+            if (!lcol.empty()) {
+                s.col = memory_pool<>::create("trisolve",
+                        context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                        lcol.size() * sizeof(cl_uint), const_cast<cl_uint*>(lcol.data()));
+                s.val = memory_pool<>::create("trisolve",
+                        context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                        lval.size() * sizeof(real), const_cast<real*>(lval.data()));
+            } else {
+                s.col = memory_pool<>::create("trisolve",
+                        context, CL_MEM_READ_ONLY, sizeof(cl_uint));
+                s.val = memory_pool<>::create("trisolve",
+                        context, CL_MEM_READ_ONLY, sizeof(real));
+            }
+
+            std::vector<cl_uint> init(s.n, 0);
+            cl::Buffer level(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                    init.size() * sizeof(cl_uint), init.data());
+
+            for(cl_uint i = 0; i < n; i++) init[i] = i;
+            s.perm = memory_pool<>::create("trisolve",
+                    context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                    init.size() * sizeof(cl_uint), init.data());
+
+            // Level analysis. A few sweeps between the checks of the flag, so
+            // that the host does not wait on the device after every sweep.
+            const int sweeps = 4;
+
+            cl_uint state[2] = {1, 0};
+            cl::Buffer sbuf(context, CL_MEM_READ_WRITE, sizeof(state));
+
+            while(!lcol.empty() && state[0]) {
+                state[0] = 0;
+                q.enqueueWriteBuffer(sbuf, CL_FALSE, 0, sizeof(state), state);
+
+                uint pos = 0;
+                k.levels.setArg(pos++, n);
+                k.levels.setArg(pos++, s.row);
+                k.levels.setArg(pos++, s.col);
+                k.levels.setArg(pos++, level);
+                k.levels.setArg(pos++, sbuf);
+
+                for(int i = 0; i < sweeps; i++)
+                    q.enqueueNDRangeKernel(k.levels, cl::NullRange,
+                            std::min(alignup(s.n, k.wgsize), k.g_size), k.wgsize,
+                            0, event_trace<>::kernel(q, k.levels));
+
+                q.enqueueReadBuffer(sbuf, CL_TRUE, 0, sizeof(state), state);
+            }
+
+            // Rows in the order of their levels.
+            uint key_bits = 1;
+            while(key_bits < 32 && (state[1] >> key_bits)) key_bits++;
+
+            if (state[1]) radix_sort<cl_uint, cl_uint>(q, level, s.perm, s.n, key_bits);
+
+            cl::Buffer start(context, CL_MEM_READ_WRITE, (state[1] + 2) * sizeof(cl_uint));
+
+            uint pos = 0;
+            k.bounds.setArg(pos++, n);
+            k.bounds.setArg(pos++, level);
+            k.bounds.setArg(pos++, start);
+
+            q.enqueueNDRangeKernel(k.bounds, cl::NullRange,
+                    std::min(alignup(s.n, k.wgsize), k.g_size), k.wgsize,
+                    0, event_trace<>::kernel(q, k.bounds));
+
+            s.start.resize(state[1] + 2);
+            q.enqueueReadBuffer(start, CL_TRUE, 0,
+                    s.start.size() * sizeof(cl_uint), s.start.data());
+        }
+};
+
+} // namespace vex
+
+#ifdef WIN32
+#  pragma warning(pop)
+#endif
+
+// vim: et
+#endif
@@ -134,6 +134,148 @@ CL_TYPES(long);  CL_TYPES(ulong);
 
 namespace vex {
 
+/// Half precision storage type for vectors and SpMat values.
+/**
+ * Values are converted to IEEE 754 binary16 on the host, loaded with
+ * vload_half() and stored with vstore_half() in kernels, and computed in
+ * float in between, so cl_khr_fp16 support is not required.
+ */
+struct half {
+    cl_half bits;
+
+    half() : bits(0) {}
+
+    half(double v) : bits(to_half(static_cast<float>(v))) {}
+
+    operator float() const {
+        return to_float(bits);
+    }
+
+    private:
+        // Round-to-nearest-even conversion.
+        static cl_half to_half(float f) {
+            union { float f; cl_uint u; } v;
+            v.f = f;
+
+            cl_uint sign = (v.u >> 16) & 0x8000;
+            cl_int  exp  = static_cast<cl_int>((v.u >> 23) & 0xff) - 127 + 15;
+            cl_uint mant = v.u & 0x7fffff;
+
+            if (((v.u >> 23) & 0xff) == 0xff) // Inf or NaN
+                return static_cast<cl_half>(sign | 0x7c00 | (mant ? 0x200 : 0));
+
+            if (exp >= 31) // Overflow
+                return static_cast<cl_half>(sign | 0x7c00);
+
+            if (exp <= 0) { // Subnormal or zero
+                if (exp < -10) return static_cast<cl_half>(sign);
+
+                mant |= 0x800000;
+                cl_uint shift = 14 - exp;
+                cl_uint h     = mant >> shift;
+                cl_uint rest  = mant & ((1U << shift) - 1);
+                cl_uint half_ = 1U << (shift - 1);
+
+                if (rest > half_ || (rest == half_ && (h & 1))) h++;
+
+                return static_cast<cl_half>(sign | h);
+            }
+
+            cl_uint h = sign | (exp << 10) | (mant >> 13);
+            cl_uint rest = mant & 0x1fff;
+
+            // Carry into exponent gives correct result, including overflow
+            // to infinity.
+            if (rest > 0x1000 || (rest == 0x1000 && (h & 1))) h++;
+
+            return static_cast<cl_half>(h);
+        }
+
+        static float to_float(cl_half h) {
+            union { float f; cl_uint u; } v;
+
+            cl_uint sign = static_cast<cl_uint>(h & 0x8000) << 16;
+            cl_uint exp  = (h >> 10) & 0x1f;
+            cl_uint mant = h & 0x3ff;
+
+            if (exp == 0x1f) { // Inf or NaN
+                v.u = sign | 0x7f800000 | (mant << 13);
+            } else if (exp) {
+                v.u = sign | ((exp - 15 + 127) << 23) | (mant << 13);
+            } else if (mant) { // Subnormal: normalize
+                exp = 127 - 15 + 1;
+                while (!(mant & 0x400)) {
+                    mant <<= 1;
+                    --exp;
+                }
+                v.u = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+            } else {
+                v.u = sign;
+            }
+
+            return v.f;
+        }
+};
+
+/// Double-float storage and arithmetic type.
+/**
+ * Represents a value as the unevaluated sum of two floats, hi + lo with
+ * |lo| <= ulp(hi) / 2, which carries about 48 significant bits. Kernels
+ * store it as float2 and compute with it in float arithmetic only (see
+ * dfloat_kernel_header), so it stands in for double on devices without
+ * cl_khr_fp64 support or with slow double precision units. The range is
+ * that of float. On the host, arithmetic goes through double.
+ */
+struct dfloat {
+    cl_float hi, lo;
+
+    dfloat() : hi(0), lo(0) {}
+
+    dfloat(double v) : hi(static_cast<float>(v)), lo(static_cast<float>(v - hi)) {}
+
+    explicit operator double() const {
+        return static_cast<double>(hi) + lo;
+    }
+};
+
+#define DFLOAT_BIN_OP(op) \
+inline dfloat operator op(const dfloat &a, const dfloat &b) { \
+    return dfloat(static_cast<double>(a) op static_cast<double>(b)); \
+} \
+inline dfloat &operator op##=(dfloat &a, const dfloat &b) { \
+    return a = a op b; \
+}
+
+DFLOAT_BIN_OP(+)
+DFLOAT_BIN_OP(-)
+DFLOAT_BIN_OP(*)
+DFLOAT_BIN_OP(/)
+
+#undef DFLOAT_BIN_OP
+
+inline dfloat operator-(const dfloat &a) {
+    dfloat r;
+    r.hi = -a.hi;
+    r.lo = -a.lo;
+    return r;
+}
+
+inline bool operator<(const dfloat &a, const dfloat &b) {
+    return a.hi < b.hi || (a.hi == b.hi && a.lo < b.lo);
+}
+
+inline bool operator==(const dfloat &a, const dfloat &b) {
+    return a.hi == b.hi && a.lo == b.lo;
+}
+
+/// Writes the value as an OpenCL float2 literal.
+inline std::ostream &operator<<(std::ostream &os, const dfloat &v) {
+    std::ostringstream s;
+    s.precision(std::numeric_limits<float>::max_digits10);
+    s << std::scientific << "(float2)(" << v.hi << "f, " << v.lo << "f)";
+    return os << s.str();
+}
+
 /// Convert each element of the vector to another type.
 template<class To, class From>
 inline To cl_convert(const From &val) {
@@ -147,5 +289,17 @@ inline To cl_convert(const From &val) {
 
 }
 
+namespace std {
+
+template <>
+class numeric_limits<vex::dfloat> : public numeric_limits<float> {
+    public:
+        static vex::dfloat min() { return vex::dfloat(numeric_limits<float>::min()); }
+        static vex::dfloat max() { return vex::dfloat(numeric_limits<float>::max()); }
+        static vex::dfloat lowest() { return -max(); }
+};
+
+}
+
 
 #endif
@@ -39,6 +39,8 @@ THE SOFTWARE.
 
 #include <iostream>
 #include <sstream>
+#include <fstream>
+#include <iterator>
 #include <string>
 #include <vector>
 #include <map>
@@ -48,9 +50,22 @@ THE SOFTWARE.
 #include <climits>
 #include <stdexcept>
 #include <limits>
+#include <cstdlib>
+#include <cstdio>
+#include <atomic>
 #include <boost/config.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
 #include <boost/type_traits/is_same.hpp>
 
+#ifdef WIN32
+#  include <process.h>
+#  define VEXCL_GETPID _getpid
+#else
+#  include <unistd.h>
+#  define VEXCL_GETPID getpid
+#endif
+
 #ifndef __CL_ENABLE_EXCEPTIONS
 #  define __CL_ENABLE_EXCEPTIONS
 #endif
@@ -110,6 +125,156 @@ template <> inline std::string type_name<ptrdiff_t>() {
 template <> struct is_cl_native<ptrdiff_t> : std::true_type {};
 #endif
 
+template <> inline std::string type_name<half>() { return "half"; }
+
+/// How kernels read and write elements of type T in global memory.
+/**
+ * Elements are accessed directly, and computed in their own type. Half
+ * precision elements are converted to and from float with
+ * vload_half()/vstore_half(), and computed in float.
+ */
+template <class T>
+struct element_access {
+    /// Type elements are computed in.
+    typedef T compute_type;
+
+    /// Element idx of ptr.
+    static std::string load(const std::string &ptr, const std::string &idx) {
+        return ptr + "[" + idx + "]";
+    }
+
+    /// Elements [idx, idx + width) of ptr as a vector of compute_type.
+    static std::string load(uint width, const std::string &ptr, const std::string &idx) {
+        return "vload" + std::to_string(width) + "(0, " + ptr + " + " + idx + ")";
+    }
+
+    /// Statement writing value to element idx of ptr.
+    static std::string store(const std::string &ptr, const std::string &idx,
+            const std::string &value)
+    {
+        return ptr + "[" + idx + "] = " + value + ";";
+    }
+
+    /// Statement writing a vector value to elements [idx, idx + width) of ptr.
+    static std::string store(uint width, const std::string &ptr, const std::string &idx,
+            const std::string &value)
+    {
+        return "vstore" + std::to_string(width) + "(" + value + ", 0, " + ptr + " + " + idx + ");";
+    }
+};
+
+template <>
+struct element_access<half> {
+    typedef cl_float compute_type;
+
+    static std::string load(const std::string &ptr, const std::string &idx) {
+        return "vload_half(" + idx + ", " + ptr + ")";
+    }
+
+    static std::string load(uint width, const std::string &ptr, const std::string &idx) {
+        return "vload_half" + std::to_string(width) + "(0, " + ptr + " + " + idx + ")";
+    }
+
+    static std::string store(const std::string &ptr, const std::string &idx,
+            const std::string &value)
+    {
+        return "vstore_half(" + value + ", " + idx + ", " + ptr + ");";
+    }
+
+    static std::string store(uint width, const std::string &ptr, const std::string &idx,
+            const std::string &value)
+    {
+        return "vstore_half" + std::to_string(width) + "(" + value + ", 0, " + ptr + " + " + idx + ");";
+    }
+};
+
+template <> inline std::string type_name<dfloat>() { return "float2"; }
+template <> struct is_cl_native<dfloat> : std::true_type {};
+
+/// Double-float elements are read as their float value outside of dfloat kernels.
+template <>
+struct element_access<dfloat> {
+    typedef dfloat compute_type;
+
+    static std::string load(const std::string &ptr, const std::string &idx) {
+        return "(" + ptr + "[" + idx + "].s0 + " + ptr + "[" + idx + "].s1)";
+    }
+
+    static std::string load(uint, const std::string &ptr, const std::string &idx) {
+        return load(ptr, idx);
+    }
+
+    static std::string store(const std::string &ptr, const std::string &idx,
+            const std::string &value)
+    {
+        return ptr + "[" + idx + "] = " + value + ";";
+    }
+
+    static std::string store(uint, const std::string &ptr, const std::string &idx,
+            const std::string &value)
+    {
+        return store(ptr, idx, value);
+    }
+};
+
+/// Double-float arithmetic for kernels that use vex::dfloat.
+/**
+ * Error-free transformations after Dekker and Knuth; products split the
+ * operands instead of relying on fma(), which may be emulated. Contraction
+ * would break the transformations, so it is switched off, and the kernels
+ * must not be compiled with -cl-fast-relaxed-math.
+ */
+const std::string dfloat_kernel_header = std::string(
+        "#ifndef VEXCL_DFLOAT\n"
+        "#define VEXCL_DFLOAT\n"
+        "#pragma OPENCL FP_CONTRACT OFF\n"
+        "float2 df_from(float a) { return (float2)(a, 0.0f); }\n"
+        "float2 df_two_sum(float a, float b) {\n"
+        "    float s = a + b, v = s - a;\n"
+        "    return (float2)(s, (a - (s - v)) + (b - v));\n"
+        "}\n"
+        "float2 df_fast_two_sum(float a, float b) {\n"
+        "    float s = a + b;\n"
+        "    return (float2)(s, b - (s - a));\n"
+        "}\n"
+        "float2 df_split(float a) {\n"
+        "    float c = 4097.0f * a, h = c - (c - a);\n"
+        "    return (float2)(h, a - h);\n"
+        "}\n"
+        "float2 df_two_prod(float a, float b) {\n"
+        "    float p = a * b;\n"
+        "    float2 x = df_split(a), y = df_split(b);\n"
+        "    return (float2)(p, ((x.s0 * y.s0 - p) + x.s0 * y.s1 + x.s1 * y.s0) + x.s1 * y.s1);\n"
+        "}\n"
+        "float2 df_neg(float2 a) { return -a; }\n"
+        "float2 df_add(float2 a, float2 b) {\n"
+        "    float2 s = df_two_sum(a.s0, b.s0), t = df_two_sum(a.s1, b.s1);\n"
+        "    s = df_fast_two_sum(s.s0, s.s1 + t.s0);\n"
+        "    return df_fast_two_sum(s.s0, s.s1 + t.s1);\n"
+        "}\n"
+        "float2 df_sub(float2 a, float2 b) { return df_add(a, -b); }\n"
+        "float2 df_mul(float2 a, float2 b) {\n"
+        "    float2 p = df_two_prod(a.s0, b.s0);\n"
+        "    return df_fast_two_sum(p.s0, p.s1 + (a.s0 * b.s1 + a.s1 * b.s0));\n"
+        "}\n"
+        "float2 df_div(float2 a, float2 b) {\n"
+        "    float q = a.s0 / b.s0;\n"
+        "    float2 r = df_sub(a, df_mul(df_from(q), b));\n"
+        "    return df_fast_two_sum(q, r.s0 / b.s0);\n"
+        "}\n"
+        "float2 df_sqrt(float2 a) {\n"
+        "    if (a.s0 <= 0.0f) return df_from(sqrt(a.s0));\n"
+        "    float s = sqrt(a.s0);\n"
+        "    float2 r = df_sub(a, df_two_prod(s, s));\n"
+        "    return df_fast_two_sum(s, r.s0 / (2.0f * s));\n"
+        "}\n"
+        "float2 df_abs(float2 a) { return a.s0 < 0.0f ? -a : a; }\n"
+        "int df_less(float2 a, float2 b) { return a.s0 < b.s0 || (a.s0 == b.s0 && a.s1 < b.s1); }\n"
+        "float2 df_max(float2 a, float2 b) { return df_less(a, b) ? b : a; }\n"
+        "float2 df_min(float2 a, float2 b) { return df_less(b, a) ? b : a; }\n"
+        "#endif\n"
+        );
+
 const std::string standard_kernel_header = std::string(
         "#if defined(cl_khr_fp64)\n"
         "#  pragma OPENCL EXTENSION cl_khr_fp64: enable\n"
@@ -208,7 +373,277 @@ for_each(const Tuple &v, Function &f)
 }
 
 
+/// \cond INTERNAL
+
+/// On-disk cache of compiled program binaries.
+/**
+ * The cache is disabled unless VEXCL_CACHE_DIR environment variable points
+ * to an existing writable directory. Each binary is stored in a separate
+ * file named after a hash of the program source, build options, device name
+ * and driver version, so that a driver update or a change in the generated
+ * source invalidates the corresponding entry.
+ */
+template <bool dummy = true>
+struct program_binaries {
+    static_assert(dummy, "dummy parameter should be true");
+
+    /// Cache directory, or NULL if the cache is disabled.
+    static const char* dir() {
+        static const char *d = getenv("VEXCL_CACHE_DIR");
+        return d;
+    }
+
+    /// Hash of the string, continuing the hash h of the preceding strings.
+    /**
+     * 64-bit FNV-1a. std::hash is not guaranteed to be stable between runs
+     * or library versions, which would defeat the purpose.
+     */
+    static cl_ulong hash(const std::string &s, cl_ulong h = 14695981039346656037ULL) {
+        for(auto c = s.begin(); c != s.end(); c++) {
+            h ^= static_cast<unsigned char>(*c);
+            h *= 1099511628211ULL;
+        }
+        h ^= 0xff;
+        h *= 1099511628211ULL;
+
+        return h;
+    }
+
+    /// Name of the cache file for the given program and device.
+    static std::string path(
+            const cl::Device &device,
+            const std::string &source, const std::string &options,
+            const char *ext = ".bin"
+            )
+    {
+        cl_ulong h = hash(source);
+
+        h = hash(options, h);
+        h = hash(device.getInfo<CL_DEVICE_NAME>(), h);
+        h = hash(device.getInfo<CL_DEVICE_VENDOR>(), h);
+        h = hash(device.getInfo<CL_DRIVER_VERSION>(), h);
+
+        std::ostringstream fname;
+#ifdef WIN32
+        fname << dir() << "\\";
+#else
+        fname << dir() << "/";
+#endif
+        fname << "vexcl_" << std::hex << h << ext;
+
+        return fname.str();
+    }
+
+    /// Try to load binaries for all devices. Returns false on cache miss.
+    static bool load(
+            const std::vector<cl::Device> &device,
+            const std::string &source, const std::string &options,
+            std::vector< std::vector<char> > &bin
+            )
+    {
+        bin.resize(device.size());
+
+        for(size_t d = 0; d < device.size(); d++) {
+            std::ifstream f(path(device[d], source, options).c_str(),
+                    std::ios::binary);
+            if (!f) return false;
+
+            bin[d].assign(std::istreambuf_iterator<char>(f),
+                    std::istreambuf_iterator<char>());
+
+            if (bin[d].empty()) return false;
+        }
+
+        return true;
+    }
+
+    /// Store binaries of a successfully built program.
+    static void store(
+            const cl::Program &program,
+            const std::vector<cl::Device> &device,
+            const std::string &source, const std::string &options
+            )
+    {
+        // Binaries are returned in the order of CL_PROGRAM_DEVICES.
+        std::vector<cl::Device> pdev = program.getInfo<CL_PROGRAM_DEVICES>();
+        std::vector<size_t>     size = program.getInfo<CL_PROGRAM_BINARY_SIZES>();
+
+        std::vector< std::vector<char> > bin(size.size());
+        std::vector<unsigned char*> ptr(size.size());
+
+        for(size_t d = 0; d < size.size(); d++) {
+            bin[d].resize(size[d]);
+            ptr[d] = reinterpret_cast<unsigned char*>(bin[d].data());
+        }
+
+        if (CL_SUCCESS != clGetProgramInfo(program(), CL_PROGRAM_BINARIES,
+                    ptr.size() * sizeof(unsigned char*), ptr.data(), NULL))
+            return;
+
+        for(size_t d = 0; d < pdev.size(); d++) {
+            if (bin[d].empty()) continue;
+
+            std::string fname = path(pdev[d], source, options);
+
+            // Write to a temporary file first so that concurrent processes
+            // never see a partially written binary.
+            std::ostringstream tmp;
+            tmp << fname << "." << VEXCL_GETPID() << ".tmp";
+
+            {
+                std::ofstream f(tmp.str().c_str(), std::ios::binary);
+                if (!f) continue;
+                f.write(bin[d].data(), bin[d].size());
+                if (!f) {
+                    f.close();
+                    std::remove(tmp.str().c_str());
+                    continue;
+                }
+            }
+
+            if (std::rename(tmp.str().c_str(), fname.c_str()))
+                std::remove(tmp.str().c_str());
+        }
+    }
+};
+
+/// Whether vectors track read/write hazards between command queues.
+/**
+ * Switched on by vex::Context created with several streams per device, and
+ * may be set by the user when vectors share devices through different
+ * queues. Every vector part then keeps its last write and outstanding reads,
+ * and vector expressions, copies, transfers, reductions, sparse matrix
+ * products and stencil convolutions enqueue their commands with the
+ * corresponding wait lists instead of relying on the host to block. Other
+ * algorithms (scan, sort, FFT, multivector expressions) are ordered by their
+ * queue only.
+ */
+template <bool dummy = true>
+struct stream_tracking {
+    static_assert(dummy, "dummy parameter should be true");
+
+    static bool enabled;
+};
+
+template <bool dummy>
+bool stream_tracking<dummy>::enabled = false;
+
+/// On-disk cache of measured device properties.
+/**
+ * Keeps results of device micro-benchmarks (such as partitioning weights)
+ * next to the program binaries in VEXCL_CACHE_DIR, keyed by the device name
+ * and driver version, so that short-lived processes do not repeat the
+ * measurements on each startup.
+ */
+template <bool dummy = true>
+struct device_properties {
+    static_assert(dummy, "dummy parameter should be true");
+
+    /// Loads the value. Returns false on cache miss or when cache is disabled.
+    /**
+     * Values are numbers or strings without whitespace.
+     */
+    template <class V>
+    static bool load(const cl::Device &device, const std::string &key, V &value) {
+        if (!program_binaries<>::dir()) return false;
+
+        std::ifstream f(program_binaries<>::path(device, key, "", ".prop").c_str());
+        return static_cast<bool>(f >> value);
+    }
+
+    /// Stores the value.
+    template <class V>
+    static void store(const cl::Device &device, const std::string &key, const V &value) {
+        if (!program_binaries<>::dir()) return;
+
+        std::string fname = program_binaries<>::path(device, key, "", ".prop");
+
+        std::ostringstream tmp;
+        tmp << fname << "." << VEXCL_GETPID() << ".tmp";
+
+        {
+            std::ofstream f(tmp.str().c_str());
+            f.precision(17);
+            if (!(f << value << std::endl)) {
+                f.close();
+                std::remove(tmp.str().c_str());
+                return;
+            }
+        }
+
+        if (std::rename(tmp.str().c_str(), fname.c_str()))
+            std::remove(tmp.str().c_str());
+    }
+};
+
+/// Hashes of the sources of the programs built by build_sources().
+/**
+ * Programs loaded from VEXCL_CACHE_DIR report no source, so whatever is
+ * keyed on the source of a kernel after the build (such as the tuned
+ * work-group sizes) looks the program up here.
+ */
+template <bool dummy = true>
+struct program_sources {
+    static_assert(dummy, "dummy parameter should be true");
+
+    /// Records the source and the build options of the program.
+    static void add(const cl::Program &program,
+            const std::string &source, const std::string &options)
+    {
+        cl_ulong h = program_binaries<>::hash(options, program_binaries<>::hash(source));
+
+        boost::lock_guard<boost::mutex> lock(mx);
+        known[program()] = h;
+    }
+
+    /// Hash of the source and options of the program. Returns false for
+    /// programs not built by build_sources().
+    static bool find(const cl::Program &program, cl_ulong &h) {
+        boost::lock_guard<boost::mutex> lock(mx);
+
+        auto p = known.find(program());
+        if (p == known.end()) return false;
+
+        h = p->second;
+        return true;
+    }
+
+    private:
+        static boost::mutex mx;
+        static std::map<cl_program, cl_ulong> known;
+};
+
+template <bool dummy>
+boost::mutex program_sources<dummy>::mx;
+
+template <bool dummy>
+std::map<cl_program, cl_ulong> program_sources<dummy>::known;
+
+/// Work-group size pinned by the user, or zero.
+/**
+ * Initialized from VEXCL_WORKGROUP_SIZE environment variable.
+ */
+template <bool dummy = true>
+struct workgroup_pin {
+    static_assert(dummy, "dummy parameter should be true");
+
+    static std::atomic<size_t> size;
+};
+
+template <bool dummy>
+std::atomic<size_t> workgroup_pin<dummy>::size(
+        getenv("VEXCL_WORKGROUP_SIZE") ?
+        static_cast<size_t>(atoi(getenv("VEXCL_WORKGROUP_SIZE"))) : 0
+        );
+
+/// \endcond
+
 /// Create and build a program from source string.
+/**
+ * If VEXCL_CACHE_DIR environment variable is set, compiled binaries are
+ * stored in (and later reloaded from) the specified directory. A stale or
+ * corrupted cache entry silently falls back to compilation from source.
+ */
 inline cl::Program build_sources(
         const cl::Context &context, const std::string &source,
         const std::string &options = ""
@@ -218,12 +653,33 @@ inline cl::Program build_sources(
     std::cout << source << std::endl;
 #endif
 
+    auto device = context.getInfo<CL_CONTEXT_DEVICES>();
+
+    if (program_binaries<>::dir()) {
+        std::vector< std::vector<char> > bin;
+
+        if (program_binaries<>::load(device, source, options, bin)) {
+            cl::Program::Binaries binaries;
+            for(auto b = bin.begin(); b != bin.end(); b++)
+                binaries.push_back(std::make_pair(
+                            static_cast<const void*>(b->data()), b->size()));
+
+            try {
+                cl::Program program(context, device, binaries);
+                program.build(device, options.c_str());
+                program_sources<>::add(program, source, options);
+                return program;
+            } catch(const cl::Error&) {
+                // Binary is unusable (e.g. rejected by the driver).
+                // Rebuild the program from source and overwrite the entry.
+            }
+        }
+    }
+
     cl::Program program(context, cl::Program::Sources(
                 1, std::make_pair(source.c_str(), source.size())
                 ));
 
-    auto device = context.getInfo<CL_CONTEXT_DEVICES>();
-
     try {
         program.build(device, options.c_str());
     } catch(const cl::Error&) {
@@ -234,10 +690,21 @@ inline cl::Program build_sources(
         throw;
     }
 
+    if (program_binaries<>::dir())
+        program_binaries<>::store(program, device, source, options);
+
+    program_sources<>::add(program, source, options);
+
     return program;
 }
 
 /// Get maximum possible workgroup size for given kernel.
+/**
+ * The largest power of two up to 1024 the kernel accepts on the device, or
+ * up to the size pinned with vex::workgroup_tuning<>::pin() (or
+ * VEXCL_WORKGROUP_SIZE environment variable), rounded down to a power of
+ * two.
+ */
 inline uint kernel_workgroup_size(
         const cl::Kernel &kernel,
         const cl::Device &device
@@ -245,12 +712,50 @@ inline uint kernel_workgroup_size(
 {
     size_t wgsz = 1024U;
 
+    if (size_t pin = workgroup_pin<>::size)
+        while(wgsz > pin && wgsz > 1) wgsz /= 2;
+
     uint dev_wgsz = kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
     while(wgsz > dev_wgsz) wgsz /= 2;
 
     return wgsz;
 }
 
+/// Number of elements of type T generated kernels process per vload/vstore.
+/**
+ * Taken from CL_DEVICE_PREFERRED_VECTOR_WIDTH_* of the device and rounded
+ * down to a valid OpenCL vector length (1, 2, 4, 8 or 16). The
+ * VEXCL_VECTOR_WIDTH environment variable overrides the device preference
+ * on all devices; setting it to 1 disables vectorization.
+ */
+template <typename T>
+inline uint simd_width(const cl::Device &device) {
+    uint width = 1;
+
+    if (const char *env = getenv("VEXCL_VECTOR_WIDTH")) {
+        width = static_cast<uint>(atoi(env));
+    } else if (std::is_same<T, half>::value) {
+        // Computed in float.
+        width = device.getInfo<CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT>();
+    } else if (std::is_floating_point<T>::value) {
+        width = sizeof(T) == sizeof(cl_double) ?
+            device.getInfo<CL_DEVICE_PREFERRED_VECTOR_WIDTH_DOUBLE>() :
+            device.getInfo<CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT>();
+    } else if (std::is_integral<T>::value) {
+        switch (sizeof(T)) {
+            case 1: width = device.getInfo<CL_DEVICE_PREFERRED_VECTOR_WIDTH_CHAR>();  break;
+            case 2: width = device.getInfo<CL_DEVICE_PREFERRED_VECTOR_WIDTH_SHORT>(); break;
+            case 4: width = device.getInfo<CL_DEVICE_PREFERRED_VECTOR_WIDTH_INT>();   break;
+            case 8: width = device.getInfo<CL_DEVICE_PREFERRED_VECTOR_WIDTH_LONG>();  break;
+        }
+    }
+
+    uint valid = 1;
+    while(valid < 16 && valid * 2 <= width) valid *= 2;
+
+    return valid;
+}
+
 /// Shortcut for q.getInfo<CL_QUEUE_CONTEXT>()
 inline cl::Context qctx(const cl::CommandQueue& q) {
     cl::Context ctx;
@@ -265,6 +770,28 @@ inline cl::Device qdev(const cl::CommandQueue& q) {
     return dev;
 }
 
+/// Wraps a buffer created by another library, keeping a reference to it.
+/**
+ * cl::Buffer adopts the handle it is constructed from without retaining it;
+ * this retains it first, so that both owners may release it.
+ */
+inline cl::Buffer shared_buffer(cl_mem mem) {
+    clRetainMemObject(mem);
+    return cl::Buffer(mem);
+}
+
+/// Wraps a command queue created by another library, keeping a reference to it.
+inline cl::CommandQueue shared_queue(cl_command_queue queue) {
+    clRetainCommandQueue(queue);
+    return cl::CommandQueue(queue);
+}
+
+/// Wraps a context created by another library, keeping a reference to it.
+inline cl::Context shared_context(cl_context context) {
+    clRetainContext(context);
+    return cl::Context(context);
+}
+
 struct column_owner {
     const std::vector<size_t> &part;
 
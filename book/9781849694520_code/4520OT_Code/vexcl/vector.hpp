@@ -38,15 +38,30 @@ THE SOFTWARE.
 #endif
 
 #include <vector>
+#include <array>
+#include <algorithm>
 #include <map>
+#include <list>
 #include <iostream>
 #include <sstream>
 #include <string>
 #include <type_traits>
 #include <functional>
+#include <memory>
+#include <stdexcept>
+#include <atomic>
 #include <boost/proto/proto.hpp>
+#include <boost/chrono.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
 #include <vexcl/util.hpp>
+#include <vexcl/kernel_cache.hpp>
+#include <vexcl/autotune.hpp>
+#include <vexcl/memory_pool.hpp>
 #include <vexcl/profiler.hpp>
+#include <vexcl/trace.hpp>
+#include <vexcl/transfer.hpp>
+#include <vexcl/precision.hpp>
 #include <vexcl/operations.hpp>
 
 /// Vector expression template library for OpenCL.
@@ -61,7 +76,8 @@ namespace vex {
  * a = b + c;
  * \endcode
  * where a, b and c are device vectors. Each device gets portion of the vector
- * proportional to the performance of this operation.
+ * proportional to the performance of this operation. When VEXCL_CACHE_DIR is
+ * set, the measured weight is stored there and reused by later processes.
  */
 inline double device_vector_perf(const cl::CommandQueue&);
 
@@ -95,6 +111,14 @@ struct partitioning_scheme {
 
     static std::vector<size_t> get(size_t n, const std::vector<cl::CommandQueue> &queue);
 
+    /// Weight of the device associated with the queue, measured on first use.
+    static double device(const cl::CommandQueue &queue);
+
+    /// Replaces weight of the device associated with the queue.
+    static void update(const cl::CommandQueue &queue, double w) {
+        device_weight[qdev(queue)()] = w;
+    }
+
     private:
         static bool is_set;
         static weight_function weight;
@@ -108,14 +132,23 @@ template <bool dummy>
 std::map<cl_device_id, double> partitioning_scheme<dummy>::device_weight;
 
 template <bool dummy>
-std::vector<size_t> partitioning_scheme<dummy>::get(size_t n,
-        const std::vector<cl::CommandQueue> &queue)
-{
+double partitioning_scheme<dummy>::device(const cl::CommandQueue &queue) {
     if (!is_set) {
         weight = device_vector_perf;
         is_set = true;
     }
 
+    cl_device_id id = qdev(queue)();
+
+    auto dw = device_weight.find(id);
+
+    return (dw == device_weight.end()) ? (device_weight[id] = weight(queue)) : dw->second;
+}
+
+template <bool dummy>
+std::vector<size_t> partitioning_scheme<dummy>::get(size_t n,
+        const std::vector<cl::CommandQueue> &queue)
+{
     std::vector<size_t> part;
     part.reserve(queue.size() + 1);
     part.push_back(0);
@@ -125,17 +158,8 @@ std::vector<size_t> partitioning_scheme<dummy>::get(size_t n,
         cumsum.reserve(queue.size() + 1);
         cumsum.push_back(0);
 
-        for(auto q = queue.begin(); q != queue.end(); q++) {
-            cl::Device  device  = qdev(*q);
-
-            auto dw = device_weight.find(device());
-
-            double w = (dw == device_weight.end()) ?
-                (device_weight[device()] = weight(*q)) :
-                dw->second;
-
-            cumsum.push_back(cumsum.back() + w);
-        }
+        for(auto q = queue.begin(); q != queue.end(); q++)
+            cumsum.push_back(cumsum.back() + device(*q));
 
         for(uint d = 1; d < queue.size(); d++)
             part.push_back(
@@ -167,12 +191,380 @@ inline void set_partitioning(
     partitioning_scheme<>::set(f);
 }
 
+/// Adjusts device weights according to measured run times.
+/**
+ * Measures the time each device spends on the work enqueued between start()
+ * and stop(), and updates device weights used by the partitioning scheme.
+ * Vectors created afterwards, or vectors explicitly rebalanced, get parts
+ * proportional to the observed device throughput:
+ * \code
+ * vex::load_balancer lb(ctx);
+ *
+ * for(int iter = 0; iter < niter; iter++) {
+ *     lb.start();
+ *     x = y + z;
+ *     if (lb.stop(x.partition())) {
+ *         x.rebalance(); y.rebalance(); z.rebalance();
+ *     }
+ * }
+ * \endcode
+ * All vectors taking part in the same expressions should be rebalanced
+ * together, since corresponding vector parts have to reside on the same
+ * devices.
+ */
+class load_balancer {
+    public:
+        /// Constructor.
+        /**
+         * \param threshold relative difference between the slowest and the
+         *        fastest device after which stop() requests rebalancing.
+         * \param smoothing weight of the previous estimate in the moving
+         *        average of device throughput.
+         */
+        load_balancer(const std::vector<cl::CommandQueue> &queue,
+                double threshold = 0.1, double smoothing = 0.5)
+            : queue(queue), threshold(threshold), smoothing(smoothing),
+              weight(queue.size(), 0), event(queue.size())
+        {}
+
+        /// Marks start of the measured section.
+        /**
+         * Waits for the work already submitted to the devices.
+         */
+        void start() {
+            for(auto q = queue.begin(); q != queue.end(); q++) q->finish();
+            tic = boost::chrono::high_resolution_clock::now();
+        }
+
+        /// Marks end of the measured section and updates device weights.
+        /**
+         * Returns true if the run times of the devices differ by more than
+         * the threshold, so that vectors should be rebalanced.
+         */
+        bool stop(const std::vector<size_t> &part) {
+            std::vector<double> time(queue.size(), 0);
+
+            for(uint d = 0; d < queue.size(); d++)
+                queue[d].enqueueMarker(&event[d]);
+
+            for(size_t done = 0; done < queue.size(); ) {
+                for(uint d = 0; d < queue.size(); d++) {
+                    if (time[d] > 0) continue;
+
+                    if (event[d].getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() == CL_COMPLETE) {
+                        time[d] = std::max(1e-9, boost::chrono::duration<double>(
+                                    boost::chrono::high_resolution_clock::now() - tic
+                                    ).count());
+                        done++;
+                    }
+                }
+            }
+
+            if (queue.size() < 2) return false;
+
+            double tmin = *std::min_element(time.begin(), time.end());
+            double tmax = *std::max_element(time.begin(), time.end());
+
+            for(uint d = 0; d < queue.size(); d++) {
+                double w = (part[d + 1] - part[d]) / time[d];
+
+                weight[d] = weight[d] > 0 ?
+                    smoothing * weight[d] + (1 - smoothing) * w : w;
+
+                if (weight[d] > 0)
+                    partitioning_scheme<>::update(queue[d], weight[d]);
+            }
+
+            return tmax > (1 + threshold) * tmin;
+        }
+    private:
+        std::vector<cl::CommandQueue> queue;
+        double threshold, smoothing;
+        std::vector<double> weight;
+        std::vector<cl::Event> event;
+        boost::chrono::high_resolution_clock::time_point tic;
+};
+
 inline std::vector<size_t> partition(size_t n,
             const std::vector<cl::CommandQueue> &queue)
 {
     return partitioning_scheme<>::get(n, queue);
 }
 
+//--- Stream dependencies ---------------------------------------------------
+
+/// \cond INTERNAL
+
+// Last write and outstanding reads of a vector part.
+struct part_hazards {
+    cl::Event              write;
+    std::vector<cl::Event> read;
+
+    // Events the next command has to wait for. A write has to wait for the
+    // reads as well.
+    void depends(bool writing, std::vector<cl::Event> &ev) const {
+        if (write()) ev.push_back(write);
+        if (writing) ev.insert(ev.end(), read.begin(), read.end());
+    }
+
+    void track(bool writing, const cl::Event &e) {
+        if (writing) {
+            write = e;
+            read.clear();
+        } else {
+            // Forget completed reads of a vector that is only read.
+            if (read.size() >= 8)
+                read.erase(std::remove_if(read.begin(), read.end(),
+                            [](const cl::Event &r) {
+                                return r.getInfo<CL_EVENT_COMMAND_EXECUTION_STATUS>() == CL_COMPLETE;
+                            }), read.end());
+            read.push_back(e);
+        }
+    }
+};
+
+// Source of the write versions of vectors. Versions are never reused, so
+// that a version identifies the contents of a vector at one point in time.
+template <bool dummy = true>
+struct write_version {
+    static_assert(dummy, "dummy parameter should be true");
+
+    static std::atomic<size_t> last;
+
+    static size_t next() {
+        return ++last;
+    }
+};
+
+template <bool dummy>
+std::atomic<size_t> write_version<dummy>::last(0);
+
+// Writes a byte of every page of the new buffers of NUMA sub-devices (see
+// Filter::NUMA) from the sub-device, so that the pages are placed on its
+// node and not on the node of the host thread that writes them first.
+template <bool dummy = true>
+struct numa_first_touch {
+    static_assert(dummy, "dummy parameter should be true");
+
+    cl::Kernel kernel;
+
+    numa_first_touch(const cl::Kernel &kernel, const cl::Device&) : kernel(kernel) {}
+
+    // True for sub-devices of a CPU split by affinity domain.
+    static bool needed(const cl::CommandQueue &queue) {
+#ifdef CL_VERSION_1_2
+        cl::Device device = qdev(queue);
+
+        if (!(device.getInfo<CL_DEVICE_TYPE>() & CL_DEVICE_TYPE_CPU)) return false;
+        if (!device.getInfo<CL_DEVICE_PARENT_DEVICE>()) return false;
+
+        auto type = device.getInfo<CL_DEVICE_PARTITION_TYPE>();
+        return !type.empty() && type[0] == CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN;
+#else
+        (void)queue;
+        return false;
+#endif
+    }
+
+    static void apply(const cl::CommandQueue &queue, const cl::Buffer &buf, size_t bytes) {
+        // The smallest page size of the systems concerned.
+        const size_t page = 4096;
+
+        auto krn = kernel_cache<>::find<numa_first_touch>(queue);
+        if (!krn) krn = kernel_cache<>::build<numa_first_touch>(queue, source(page), "first_touch");
+
+        cl_ulong pages = (bytes + page - 1) / page;
+        size_t   g_size = std::min<size_t>(pages,
+                qdev(queue).getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * 64);
+
+        cl::Kernel kernel = krn->kernel;
+        kernel.setArg(0, pages);
+        kernel.setArg(1, buf);
+
+        queue.enqueueNDRangeKernel(kernel, cl::NullRange, g_size, cl::NullRange,
+                0, event_trace<>::kernel(queue, kernel, pages));
+    }
+
+    static std::string source(size_t page) {
+        std::ostringstream src;
+        src <<
+            "kernel void first_touch(ulong n, global uchar *p) {\n"
+            "    for(ulong i = get_global_id(0); i < n; i += get_global_size(0))\n"
+            "        p[i * " << page << "] = 0;\n"
+            "}\n";
+        return src.str();
+    }
+};
+
+// Collects dependencies of the vector terminals of an expression.
+struct expression_dependencies {
+    uint d;
+    std::vector<cl::Event> &ev;
+
+    expression_dependencies(uint d, std::vector<cl::Event> &ev) : d(d), ev(ev) {}
+
+    template <typename T>
+    void operator()(const vector<T> &term) const {
+        term.depends(d, false, ev);
+    }
+
+    template <typename Term>
+    void operator()(const Term&) const {}
+};
+
+// Registers a command as a reader of the vector terminals of an expression.
+struct expression_reader {
+    uint d;
+    const cl::Event &e;
+
+    expression_reader(uint d, const cl::Event &e) : d(d), e(e) {}
+
+    template <typename T>
+    void operator()(const vector<T> &term) const {
+        term.track(d, false, e);
+    }
+
+    template <typename Term>
+    void operator()(const Term&) const {}
+};
+
+/// \endcond
+
+/// Launch configuration of vector assignment kernels.
+struct assignment_params {
+    /// Upper limit for the number of work-groups per compute unit.
+    /**
+     * Each work-item strides over the elements left to it once the grid is
+     * capped. Zero means no limit: one work-item per element (per chunk of
+     * vectorized kernels).
+     */
+    size_t groups;
+
+    assignment_params(size_t groups = 0) : groups(groups) {}
+};
+
+/// \cond INTERNAL
+
+/// Per-device launch configuration of vector assignment kernels.
+/**
+ * Unless set explicitly, GPUs get at most 4 work-groups per compute unit and
+ * CPUs one work-item per element. When VEXCL_TUNE_ASSIGNMENT environment
+ * variable is set, a range of limits is benchmarked once per device on
+ * a = b + c instead, and the fastest one is kept for the lifetime of the
+ * process. When VEXCL_CACHE_DIR is set, the result is also stored there and
+ * reused by later runs.
+ */
+template <bool dummy = true>
+struct assignment_tuning {
+    static_assert(dummy, "dummy parameter should be true");
+
+    /// Launch configuration for the given queue.
+    static assignment_params get(const cl::CommandQueue &queue);
+
+    /// Replaces launch configuration of the device.
+    static void set(const cl::Device &device, const assignment_params &prm) {
+        boost::lock_guard<boost::mutex> lock(mx);
+        known[device()] = prm;
+        ++rev;
+    }
+
+    /// Changes with every set(), so that cached launch sizes may be checked
+    /// without the lock.
+    static size_t revision() {
+        return rev;
+    }
+
+    private:
+        static boost::mutex mx;
+        static std::map<cl_device_id, assignment_params> known;
+        static std::atomic<size_t> rev;
+
+        static assignment_params benchmark(const cl::CommandQueue &queue);
+};
+
+/// \endcond
+
+/// Sets launch configuration of vector assignments on the device.
+/**
+ * \code
+ * // Grid-stride over 100M elements with two work-groups per compute unit.
+ * vex::set_assignment_params(ctx.device(0), vex::assignment_params(2));
+ * \endcode
+ */
+inline void set_assignment_params(const cl::Device &device, const assignment_params &prm) {
+    assignment_tuning<>::set(device, prm);
+}
+
+#ifndef VEXCL_ASSIGN_LAUNCH_CACHE
+/// Number of assignment kernels a vector keeps ready to launch per device.
+#  define VEXCL_ASSIGN_LAUNCH_CACHE 8
+#endif
+
+#ifndef VEXCL_MAX_SPECIALIZATIONS
+/// Number of specialized kernels built per expression type and device.
+#  define VEXCL_MAX_SPECIALIZATIONS 16
+#endif
+
+/// \cond INTERNAL
+
+/// Counts specialized kernels built for a kernel cache entry type.
+/**
+ * Every distinct set of values compiles a kernel of its own, so an
+ * expression specialized on a value that changes with each iteration would
+ * never stop compiling. Once VEXCL_MAX_SPECIALIZATIONS kernels exist for the
+ * device, the generic kernel is used for any new values.
+ */
+template <class Entry>
+struct specialization_budget {
+    /// Takes one specialization for the device of the queue. Returns false when none are left.
+    static bool take(const cl::CommandQueue &queue) {
+        boost::lock_guard<boost::mutex> lock(mx);
+        size_t &n = built[qdev(queue)()];
+        if (n >= VEXCL_MAX_SPECIALIZATIONS) return false;
+        ++n;
+        return true;
+    }
+
+    private:
+        static boost::mutex mx;
+        static std::map<cl_device_id, size_t> built;
+};
+
+template <class Entry>
+boost::mutex specialization_budget<Entry>::mx;
+
+template <class Entry>
+std::map<cl_device_id, size_t> specialization_budget<Entry>::built;
+
+/// Expression to be assigned with a specialized kernel.
+template <class Expr>
+struct specialized_expression {
+    const Expr &expr;
+
+    specialized_expression(const Expr &expr) : expr(expr) {}
+};
+
+/// \endcond
+
+/// Assigns the expression with a kernel specialized for its current values.
+/**
+ * The vector size and the values of the host scalars in the expression are
+ * compiled into the kernel as constants, so that the compiler may fold them
+ * (multiplications by one, loop bounds known in advance). A kernel is built
+ * for each distinct set of values, up to VEXCL_MAX_SPECIALIZATIONS per
+ * expression and device; this pays off for values that stay the same over
+ * many assignments.
+ * \code
+ * p = vex::specialize(r + beta * p);
+ * \endcode
+ * The result refers to the expression and is only valid within the
+ * assignment statement.
+ */
+template <class Expr>
+specialized_expression<Expr> specialize(const Expr &expr) {
+    return specialized_expression<Expr>(expr);
+}
+
 //--- Vector Type -----------------------------------------------------------
 typedef vector_expression<
     typename boost::proto::terminal< vector_terminal >::type
@@ -212,15 +604,18 @@ class vector : public vector_terminal_expression {
                             index * sizeof(T), sizeof(T),
                             &val
                             );
+                    next_version(version);
                     return val;
                 }
             private:
-                element(const cl::CommandQueue &q, cl::Buffer b, size_t i)
-                    : queue(q), buf(b), index(i) {}
+                element(const cl::CommandQueue &q, cl::Buffer b, size_t i,
+                        size_t &version)
+                    : queue(q), buf(b), index(i), version(version) {}
 
                 const cl::CommandQueue  &queue;
                 cl::Buffer              buf;
                 const size_t            index;
+                size_t                  &version;
 
                 friend class vector;
         };
@@ -241,7 +636,7 @@ class vector : public vector_terminal_expression {
                 element_type operator*() const {
                     return element_type(
                             vec->queue[part], vec->buf[part],
-                            pos - vec->part[part]
+                            pos - vec->part[part], vec->ver
                             );
                 }
 
@@ -290,13 +685,14 @@ class vector : public vector_terminal_expression {
         typedef iterator_type<const vector, const element> const_iterator;
 
         /// Empty constructor.
-        vector() {}
+        vector() : ver(write_version<>::next()) {}
 
         /// Construct by size and use static context.
         vector(size_t size) :
             queue(current_context().queue()),
             part(vex::partition(size, queue)),
-            buf(queue.size()), event(queue.size())
+            buf(queue.size()), event(queue.size()),
+            ver(write_version<>::next())
         {
             if (size) allocate_buffers(CL_MEM_READ_WRITE, 0);
         }
@@ -304,26 +700,58 @@ class vector : public vector_terminal_expression {
         /// Copy constructor.
         vector(const vector &v)
             : queue(v.queue), part(v.part),
-              buf(queue.size()), event(queue.size())
+              buf(queue.size()), event(queue.size()),
+              ver(write_version<>::next())
         {
             if (size()) allocate_buffers(CL_MEM_READ_WRITE, 0);
             *this = v;
         }
 
         /// Wrap a native buffer
-        vector(const cl::CommandQueue &q, const cl::Buffer &buffer)
-            : queue(1, q), part(2), buf(1, buffer), event(1)
+        /**
+         * The buffer may be written behind the back of the vector, so the
+         * vector is not versioned (see version()). With nonzero size, only
+         * the first size elements of the buffer are wrapped.
+         */
+        vector(const cl::CommandQueue &q, const cl::Buffer &buffer, size_t size = 0)
+            : queue(1, q), part(2), buf(1, buffer), event(1), ver(0)
         {
             part[0] = 0;
-            part[1] = buffer.getInfo<CL_MEM_SIZE>() / sizeof(T);
+            part[1] = size ? size : buffer.getInfo<CL_MEM_SIZE>() / sizeof(T);
         }
 
+        /// Wrap native buffers, one per device, with the given partition.
+        /**
+         * Buffers of empty parts may be null. The buffers are not returned to
+         * the memory pool, so they may be sub-buffers of other vectors (see
+         * vex::slice()). As with a single native buffer, the vector is not
+         * versioned.
+         */
+        vector(const std::vector<cl::CommandQueue> &queue,
+                const std::vector<size_t> &part,
+                const std::vector<cl::Buffer> &buffer
+              ) : queue(queue), part(part), buf(buffer), event(queue.size()), ver(0)
+        {}
+
         /// Copy host data to the new buffer.
+        /**
+         * If flags contain CL_MEM_USE_HOST_PTR, host memory is not copied but
+         * wrapped by the device buffers instead. On CPUs and integrated GPUs
+         * this avoids any transfers, provided the memory is suitably aligned
+         * (see CL_DEVICE_MEM_BASE_ADDR_ALIGN; page alignment is a safe
+         * choice). The memory should outlive the vector and may be modified by
+         * the device. With several devices, each part wraps the corresponding
+         * slice of host memory, and parts start at multiples of 16 elements.
+         *
+         * With CL_MEM_ALLOC_HOST_PTR the buffers are allocated in
+         * host-accessible memory; use map() to access them without copies.
+         */
         vector(const std::vector<cl::CommandQueue> &queue,
                 size_t size, const T *host = 0,
                 cl_mem_flags flags = CL_MEM_READ_WRITE
               ) : queue(queue), part(vex::partition(size, queue)),
-                  buf(queue.size()), event(queue.size())
+                  buf(queue.size()), event(queue.size()),
+                  ver(write_version<>::next())
         {
             if (size) allocate_buffers(flags, host);
         }
@@ -333,16 +761,22 @@ class vector : public vector_terminal_expression {
                 const std::vector<T> &host,
                 cl_mem_flags flags = CL_MEM_READ_WRITE
               ) : queue(queue), part(vex::partition(host.size(), queue)),
-                  buf(queue.size()), event(queue.size())
+                  buf(queue.size()), event(queue.size()),
+                  ver(write_version<>::next())
         {
             if (!host.empty()) allocate_buffers(flags, host.data());
         }
 
         /// Move constructor
-        vector(vector &&v) {
+        vector(vector &&v) : ver(write_version<>::next()) {
             swap(v);
         }
 
+        /// Returns device memory to the pool.
+        ~vector() {
+            release_buffers();
+        }
+
         /// Move assignment
         const vector& operator=(vector &&v) {
             swap(v);
@@ -355,6 +789,9 @@ class vector : public vector_terminal_expression {
             std::swap(part,    v.part);
             std::swap(buf,     v.buf);
             std::swap(event,   v.event);
+            std::swap(hazard,  v.hazard);
+            std::swap(launches, v.launches);
+            std::swap(ver,     v.ver);
         }
 
         /// Resize vector.
@@ -400,6 +837,51 @@ class vector : public vector_terminal_expression {
             return buf[d];
         }
 
+        /// Return cl::Buffer object located on a given device, for writing.
+        /**
+         * Handing out the buffer of a non-const vector counts as a write (see
+         * version()).
+         */
+        cl::Buffer operator()(uint d = 0) {
+            touch();
+            return buf[d];
+        }
+
+        /// Write version of the vector contents.
+        /**
+         * Changes whenever the vector may have been written: by assignments,
+         * write_data(), map(), element writes, graph replays, and whenever a
+         * device buffer of the non-const vector is handed out. Versions are
+         * never shared by two vectors or reused, so results derived from the
+         * contents (the halos of vex::stencil) stay valid while the version
+         * stays the same.
+         *
+         * Zero for vectors that wrap native buffers and for vectors that
+         * vex::slice() was taken of: their memory may be written through
+         * other objects, and nothing is cached for them.
+         */
+        size_t version() const {
+            return ver;
+        }
+
+        /// Marks the contents as changed.
+        /**
+         * Needed after the vector was written by means VexCL does not see,
+         * e.g. by a user kernel given the buffer of a const vector.
+         */
+        void touch() const {
+            next_version(ver);
+        }
+
+        /// \cond INTERNAL
+
+        /// Stops versioning: the memory is shared with other objects.
+        void unversion() const {
+            ver = 0;
+        }
+
+        /// \endcond
+
         /// Const iterator to beginning.
         const_iterator begin() const {
             return const_iterator(*this, 0);
@@ -424,7 +906,7 @@ class vector : public vector_terminal_expression {
         const element operator[](size_t index) const {
             size_t d = std::upper_bound(
                     part.begin(), part.end(), index) - part.begin() - 1;
-            return element(queue[d], buf[d], index - part[d]);
+            return element(queue[d], buf[d], index - part[d], ver);
         }
 
         /// Access element.
@@ -432,7 +914,7 @@ class vector : public vector_terminal_expression {
             uint d = static_cast<uint>(
                 std::upper_bound(part.begin(), part.end(), index) - part.begin() - 1
                 );
-            return element(queue[d], buf[d], index - part[d]);
+            return element(queue[d], buf[d], index - part[d], ver);
         }
 
         /// Return size .
@@ -465,14 +947,83 @@ class vector : public vector_terminal_expression {
             return part;
         }
 
+        /// Moves data to match the new partition.
+        /**
+         * Only the elements that change their device are transferred (see
+         * device_copy()); the rest is copied within the device memory.
+         */
+        void repartition(const std::vector<size_t> &new_part) {
+            if (new_part == part) return;
+
+            std::vector<cl::Buffer> new_buf(queue.size());
+            std::vector<cl::Event>  copies;
+
+            for(uint d = 0; d < queue.size(); d++) {
+                size_t psize = new_part[d + 1] - new_part[d];
+                if (!psize) continue;
+
+                new_buf[d] = create_buffer(qctx(queue[d]), CL_MEM_READ_WRITE,
+                        psize * sizeof(T));
+
+                for(uint s = 0; s < queue.size(); s++) {
+                    size_t lo = std::max(new_part[d],     part[s]);
+                    size_t hi = std::min(new_part[d + 1], part[s + 1]);
+
+                    if (lo >= hi) continue;
+
+                    copies.push_back(device_copy(
+                                queue[s], buf[s],     (lo - part[s])     * sizeof(T),
+                                queue[d], new_buf[d], (lo - new_part[d]) * sizeof(T),
+                                (hi - lo) * sizeof(T)));
+                }
+            }
+
+            // The old buffers go back to the pool, so the copies out of them
+            // should be done.
+            if (!copies.empty()) cl::Event::waitForEvents(copies);
+
+            part = new_part;
+            buf.swap(new_buf);
+            touch();
+
+            for(auto b = new_buf.begin(); b != new_buf.end(); b++)
+                release_buffer(*b);
+        }
+
+        /// Repartitions vector according to current device weights.
+        /**
+         * \see load_balancer
+         */
+        void rebalance() {
+            repartition(vex::partition(size(), queue));
+        }
+
         /// Copies data from device vector.
         const vector& operator=(const vector &x) {
             if (&x != this) {
                 for(uint d = 0; d < queue.size(); d++)
                     if (size_t psize = part[d + 1] - part[d]) {
-                        queue[d].enqueueCopyBuffer(x.buf[d], buf[d], 0, 0,
-                                psize * sizeof(T));
+                        if (stream_tracking<>::enabled) {
+                            std::vector<cl::Event> wait;
+                            cl::Event e;
+
+                            depends(d, true, wait);
+                            x.depends(d, false, wait);
+
+                            queue[d].enqueueCopyBuffer(x.buf[d], buf[d], 0, 0,
+                                    psize * sizeof(T), wait.empty() ? 0 : &wait, &e);
+
+                            event_trace<>::add(queue[d], "copy", e);
+
+                            x.track(d, false, e);
+                            track(d, true, e);
+                        } else {
+                            queue[d].enqueueCopyBuffer(x.buf[d], buf[d], 0, 0,
+                                    psize * sizeof(T), 0, event_trace<>::transfer(queue[d], "copy"));
+                        }
                     }
+
+                touch();
             }
 
             return *this;
@@ -481,13 +1032,16 @@ class vector : public vector_terminal_expression {
         struct buffer_unmapper {
             const cl::CommandQueue &queue;
             const cl::Buffer       &buffer;
+            size_t                 &version;
 
-            buffer_unmapper(const cl::CommandQueue &q, const cl::Buffer &b)
-                : queue(q), buffer(b)
+            buffer_unmapper(const cl::CommandQueue &q, const cl::Buffer &b,
+                    size_t &version)
+                : queue(q), buffer(b), version(version)
             {}
 
             void operator()(T* ptr) const {
                 queue.enqueueUnmapMemObject(buffer, ptr);
+                next_version(version);
             }
         };
 
@@ -504,7 +1058,7 @@ class vector : public vector_terminal_expression {
                     static_cast<T*>( queue[d].enqueueMapBuffer(
                             buf[d], CL_TRUE, flags, 0, part_size(d) * sizeof(T))
                         ),
-                    buffer_unmapper(queue[d], buf[d])
+                    buffer_unmapper(queue[d], buf[d], ver)
                     );
         }
 
@@ -514,6 +1068,11 @@ class vector : public vector_terminal_expression {
          * made. Vectors participating in expression should have same number of
          * parts; corresponding parts of the vectors should reside on the same
          * compute devices.
+         *
+         * The vector keeps private copies of the kernels of its most recent
+         * expression types (VEXCL_ASSIGN_LAUNCH_CACHE per device), so that
+         * repeating an assignment only sets the arguments that changed and
+         * enqueues the kernel.
          */
         template <class Expr>
         typename std::enable_if<
@@ -524,79 +1083,44 @@ class vector : public vector_terminal_expression {
             const vector&
         >::type
         operator=(const Expr &expr) {
-            for(auto q = queue.begin(); q != queue.end(); q++) {
-                cl::Context context = qctx(*q);
-                cl::Device  device  = qdev(*q);
-
-                if (!exdata<Expr>::compiled[context()]) {
-                    std::ostringstream kernel;
-
-                    vector_expr_context expr_ctx(kernel);
-
-                    std::ostringstream kernel_name;
-                    vector_name_context name_ctx(kernel_name);
-                    boost::proto::eval(boost::proto::as_child(expr), name_ctx);
-
-                    kernel << standard_kernel_header;
-
-                    extract_user_functions()(
-                            boost::proto::as_child(expr),
-                            declare_user_function(kernel)
-                            );
-
-                    kernel << "kernel void " << kernel_name.str()
-                           << "(\n\t" << type_name<size_t>()
-                           << " n,\n\tglobal " << type_name<T>() << " *res";
-
-                    extract_terminals()(
-                            boost::proto::as_child(expr),
-                            declare_expression_parameter(kernel)
-                            );
-
-                    kernel <<
-                        "\n)\n{\n\t"
-                        "for(size_t idx = get_global_id(0); idx < n; idx += get_global_size(0)) {\n"
-                        "\t\tres[idx] = ";
-
-                    boost::proto::eval(boost::proto::as_child(expr), expr_ctx);
-
-                    kernel << ";\n\t}\n}\n";
-
-                    auto program = build_sources(context, kernel.str());
-
-                    exdata<Expr>::kernel[context()]   = cl::Kernel(program, kernel_name.str().c_str());
-                    exdata<Expr>::compiled[context()] = true;
-                    exdata<Expr>::wgsize[context()]   = kernel_workgroup_size(
-                            exdata<Expr>::kernel[context()], device);
-                }
+            vector_cost_context cost;
+            if (event_trace<>::enabled()) {
+                boost::proto::eval(boost::proto::as_child(expr), cost);
+                cost.bytes += sizeof(T);
             }
 
             for(uint d = 0; d < queue.size(); d++) {
-                if (size_t psize = part[d + 1] - part[d]) {
-                    cl::Context context = qctx(queue[d]);
-                    cl::Device  device  = qdev(queue[d]);
-
-                    size_t g_size = device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU ?
-                        alignup(psize, exdata<Expr>::wgsize[context()]) :
-                        device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * exdata<Expr>::wgsize[context()] * 4;
+                if (part[d + 1] == part[d]) continue;
 
-                    uint pos = 0;
-                    exdata<Expr>::kernel[context()].setArg(pos++, psize);
-                    exdata<Expr>::kernel[context()].setArg(pos++, buf[d]);
+                assign_launch &l = assign_launcher(d, expr);
+                launch_assignment(d, expr, l.args, l.g_size, l.wgsize, cost,
+                        l.measure ? l.tuner.get() : 0);
+            }
 
-                    extract_terminals()(
-                            boost::proto::as_child(expr),
-                            set_expression_argument(exdata<Expr>::kernel[context()], d, pos, part[d])
-                            );
+            touch();
+            return *this;
+        }
 
-                    queue[d].enqueueNDRangeKernel(
-                            exdata<Expr>::kernel[context()],
-                            cl::NullRange,
-                            g_size, exdata<Expr>::wgsize[context()]
-                            );
-                }
+        /// Assignment with a kernel specialized for the scalar values (see vex::specialize()).
+        template <class Expr>
+        typename std::enable_if<
+            boost::proto::matches<
+                typename boost::proto::result_of::as_expr<Expr>::type,
+                vector_expr_grammar
+            >::value,
+            const vector&
+        >::type
+        operator=(const specialized_expression<Expr> &spec) {
+            vector_cost_context cost;
+            if (event_trace<>::enabled()) {
+                boost::proto::eval(boost::proto::as_child(spec.expr), cost);
+                cost.bytes += sizeof(T);
             }
 
+            for(uint d = 0; d < queue.size(); d++)
+                launch_assignment(d, spec.expr, *specialized_kernel(d, spec.expr), cost);
+
+            touch();
             return *this;
         }
 
@@ -613,6 +1137,7 @@ class vector : public vector_terminal_expression {
                     *this, simplify_additive_transform()( expr )
                     );
 
+            touch();
             return *this;
         }
 
@@ -637,6 +1162,7 @@ class vector : public vector_terminal_expression {
                         )
                     );
 
+            touch();
             return *this;
         }
 
@@ -675,14 +1201,23 @@ class vector : public vector_terminal_expression {
 
                 if (stop <= start) continue;
 
+                std::vector<cl::Event> wait;
+                if (stream_tracking<>::enabled) depends(d, true, wait);
+
                 queue[d].enqueueWriteBuffer(buf[d], CL_FALSE,
                         sizeof(T) * (start - part[d]),
                         sizeof(T) * (stop - start),
                         hostptr + start - offset,
-                        0, &ev[d]
+                        wait.empty() ? 0 : &wait, &ev[d]
                         );
+
+                if (stream_tracking<>::enabled) track(d, true, ev[d]);
+
+                event_trace<>::add(queue[d], "write", ev[d]);
             }
 
+            touch();
+
             if (blocking)
                 for(size_t d = 0; d < queue.size(); d++) {
                     size_t start = std::max(offset,        part[d]);
@@ -706,12 +1241,19 @@ class vector : public vector_terminal_expression {
 
                 if (stop <= start) continue;
 
+                std::vector<cl::Event> wait;
+                if (stream_tracking<>::enabled) depends(d, false, wait);
+
                 queue[d].enqueueReadBuffer(buf[d], CL_FALSE,
                         sizeof(T) * (start - part[d]),
                         sizeof(T) * (stop - start),
                         hostptr + start - offset,
-                        0, &ev[d]
+                        wait.empty() ? 0 : &wait, &ev[d]
                         );
+
+                if (stream_tracking<>::enabled) track(d, false, ev[d]);
+
+                event_trace<>::add(queue[d], "read", ev[d]);
             }
 
             if (blocking)
@@ -723,39 +1265,617 @@ class vector : public vector_terminal_expression {
                 }
         }
 
-    private:
-        template <class Expr>
+        /// \cond INTERNAL
+
+        /// Private copy of the assignment kernel with all arguments set.
+        /**
+         * The kernel may be enqueued repeatedly with the global and local
+         * sizes returned in g_size and wgsize; the values of the expression
+         * terminals are taken at the time of the call. Returns false when the
+         * part d is empty.
+         */
+        template <class Expr>
+        bool bind_assignment(uint d, const Expr &expr,
+                cl::Kernel &kernel, size_t &g_size, size_t &wgsize) const
+        {
+            auto krn = assign_kernel(d, expr);
+
+            size_t psize = part[d + 1] - part[d];
+            if (!psize) return false;
+
+            kernel = kernel_copy(krn->kernel);
+
+            wgsize = krn->tuner->size();
+            g_size = assign_global_size(d, wgsize, assign_width(d, expr));
+
+            uint pos = 0;
+            kernel.setArg(pos++, psize);
+            kernel.setArg(pos++, buf[d]);
+
+            extract_terminals()(
+                    boost::proto::as_child(expr),
+                    set_expression_argument(kernel, d, pos, part[d], is_dfloat::value)
+                    );
+
+            return true;
+        }
+
+        /// Adds events the next command on part d has to wait for.
+        /**
+         * Only used when stream tracking is enabled. Reads depend on the last
+         * write; writes depend on the last write and on all reads since.
+         */
+        void depends(uint d, bool writing, std::vector<cl::Event> &ev) const {
+            if (d < hazard.size()) hazard[d].depends(writing, ev);
+        }
+
+        /// Registers command on part d as a reader or a writer of the vector.
+        void track(uint d, bool writing, const cl::Event &e) const {
+            if (hazard.size() < queue.size()) hazard.resize(queue.size());
+            hazard[d].track(writing, e);
+        }
+
+        /// \endcond
+
+        /// Compile kernel for assignment of the expression in background.
+        /**
+         * Starts compilation of the kernel that would be used for
+         * \code x = expr; \endcode
+         * where x is any vector<T>, and returns immediately. The first such
+         * assignment blocks only until the background build is complete.
+         * Useful to move compilation of known expressions out of the latency
+         * sensitive paths.
+         */
+        template <class Expr>
+        static typename std::enable_if<
+            boost::proto::matches<
+                typename boost::proto::result_of::as_expr<Expr>::type,
+                vector_expr_grammar
+            >::value,
+            void
+        >::type
+        prewarm(const std::vector<cl::CommandQueue> &queue, const Expr &expr) {
+            for(auto q = queue.begin(); q != queue.end(); q++) {
+                precision::policy prec = kernel_precision(*q);
+
+                std::string name, source = assign_source(
+                        expr, name, assign_width(qdev(*q), expr), prec);
+
+                kernel_cache<>::build_async< exdata<Expr> >(*q, source, name,
+                        precision_options(prec), assign_signature(prec, expr));
+            }
+        }
+
+    private:
+        /// Elements per work-item step in the assignment kernel for the device.
+        template <class Expr>
+        static uint assign_width(const cl::Device &device, const Expr &expr) {
+            return vector_simd_ok<T>(boost::proto::as_child(expr)) ?
+                simd_width<T>(device) : 1;
+        }
+
+        template <class Expr>
+        uint assign_width(uint d, const Expr &expr) const {
+            return assign_width(qdev(queue[d]), expr);
+        }
+
+        // With width > 1 the kernel processes chunks of 'width' elements
+        // with vloadN/vstoreN, and the n % width elements left over one by
+        // one. Multiply-adds are contracted as the precision policy says.
+        // Non-empty defines (VEXCL_SPEC_N and the literal values) make a
+        // kernel specialized on them.
+        template <class Expr>
+        static std::string assign_source(const Expr &expr, std::string &name, uint width,
+                precision::policy prec, const std::string &defines = "")
+        {
+            std::ostringstream kernel;
+
+            bool spec = !defines.empty();
+            const char *n = spec ? "VEXCL_SPEC_N" : "n";
+
+            typedef element_access<T> access;
+
+            std::ostringstream value;
+
+            std::ostringstream kernel_name;
+            vector_name_context name_ctx(kernel_name);
+            boost::proto::eval(boost::proto::as_child(expr), name_ctx);
+
+            kernel << standard_kernel_header << precision_header(prec) << defines;
+            if (is_dfloat::value) kernel << dfloat_kernel_header;
+
+            extract_user_functions()(
+                    boost::proto::as_child(expr),
+                    declare_user_function(kernel)
+                    );
+
+            kernel << "kernel void " << kernel_name.str()
+                   << "(\n\t" << type_name<size_t>()
+                   << " n,\n\tglobal " << type_name<T>() << " *res";
+
+            extract_terminals()(
+                    boost::proto::as_child(expr),
+                    declare_expression_parameter(kernel, 1, is_dfloat::value)
+                    );
+
+            kernel << "\n)\n{\n";
+
+            if (width > 1) {
+                std::ostringstream simd_value;
+                vector_simd_context simd_ctx(simd_value,
+                        type_name<typename access::compute_type>(), width, 1, spec);
+                simd_ctx.contract<T>(precision_contraction(prec));
+
+                expression_cse simd_cse(boost::proto::as_child(expr));
+                write_with_cse(simd_ctx, boost::proto::as_child(expr), simd_cse);
+
+                kernel <<
+                    "\tsize_t chunks = " << n << " / " << width << ";\n"
+                    "\tfor(size_t i = get_global_id(0); i < chunks; i += get_global_size(0)) {\n"
+                    "\t\tsize_t idx = i * " << width << ";\n"
+                    << simd_cse.declarations("\t\t") <<
+                    "\t\t" << access::store(width, "res", "idx", simd_value.str()) << "\n"
+                    "\t}\n"
+                    "\tfor(size_t idx = chunks * " << width << " + get_global_id(0); "
+                    "idx < " << n << "; idx += get_global_size(0)) {\n";
+            } else {
+                kernel <<
+                    "\tfor(size_t idx = get_global_id(0); idx < " << n << "; idx += get_global_size(0)) {\n";
+            }
+
+            expression_cse cse(boost::proto::as_child(expr));
+            write_element(value, boost::proto::as_child(expr), spec, prec, cse, is_dfloat());
+
+            kernel << cse.declarations("\t\t")
+                   << "\t\t" << access::store("res", "idx", value.str()) << "\n\t}\n}\n";
+
+            name = kernel_name.str();
+            return kernel.str();
+        }
+
+        typedef std::is_same<T, dfloat> is_dfloat;
+
+        // Kernel cache signature: the precision policy, and the aliased
+        // parameters the common subexpressions depend on.
+        template <class Expr>
+        static std::string assign_signature(precision::policy prec, const Expr &expr) {
+            return is_dfloat::value ? precision_signature(prec) :
+                precision_signature(prec) + expression_cse::signature(boost::proto::as_child(expr));
+        }
+
+        // Double-float arithmetic relies on exact rounding of each operation,
+        // so its kernels ignore the precision policy.
+        static precision::policy kernel_precision(const cl::CommandQueue &q) {
+            return is_dfloat::value ? precision::standard : get_precision(q);
+        }
+
+        // Writes the value of element idx of the expression, with the
+        // temporaries of its common subexpressions declared in cse.
+        template <class Expr>
+        static void write_element(std::ostream &os, const Expr &expr,
+                bool spec, precision::policy prec, expression_cse &cse, std::false_type)
+        {
+            vector_expr_context ctx(os, 1, spec);
+            ctx.contract<T>(precision_contraction(prec));
+            write_with_cse(ctx, expr, cse);
+        }
+
+        // Double-float kernels do not fold literals, contract, or eliminate
+        // common subexpressions.
+        template <class Expr>
+        static void write_element(std::ostream &os, const Expr &expr,
+                bool, precision::policy, expression_cse&, std::true_type)
+        {
+            dfloat_expr_context ctx(os);
+            boost::proto::eval(expr, ctx);
+        }
+
+        template <class Expr>
         struct exdata {
-            static std::map<cl_context,bool>       compiled;
-            static std::map<cl_context,cl::Kernel> kernel;
-            static std::map<cl_context,size_t>     wgsize;
+            cl::Kernel kernel;
+            std::shared_ptr<workgroup_tuner> tuner;
+
+            exdata(const cl::Kernel &kernel, const cl::Device &device)
+                : kernel(kernel), tuner(std::make_shared<workgroup_tuner>(kernel, device))
+            {}
+        };
+
+        template <class Expr>
+        std::shared_ptr< exdata<Expr> > assign_kernel(uint d, const Expr &expr) const {
+            return assign_kernel(d, expr, kernel_precision(queue[d]));
+        }
+
+        template <class Expr>
+        std::shared_ptr< exdata<Expr> > assign_kernel(uint d, const Expr &expr,
+                precision::policy prec) const
+        {
+            std::string sig = assign_signature(prec, expr);
+
+            auto krn = kernel_cache<>::find< exdata<Expr> >(queue[d], sig);
+
+            if (!krn) {
+                std::string name, source = assign_source(
+                        expr, name, assign_width(d, expr), prec);
+
+                krn = kernel_cache<>::build< exdata<Expr> >(queue[d], source, name,
+                        precision_options(prec), sig);
+            }
+
+            return krn;
+        }
+
+        // Kernel specialized on the part size and the literal values of the
+        // expression, or the generic one once the specialization budget of
+        // the expression type is spent on this device.
+        template <class Expr>
+        std::shared_ptr< exdata<Expr> > specialized_kernel(uint d, const Expr &expr) const {
+            precision::policy prec = kernel_precision(queue[d]);
+
+            std::ostringstream defines;
+            defines << "#define VEXCL_SPEC_N ((" << type_name<size_t>() << ")("
+                    << part[d + 1] - part[d] << "u))\n";
+            extract_terminals()(
+                    boost::proto::as_child(expr),
+                    define_expression_literal(defines)
+                    );
+
+            std::string sig = assign_signature(prec, expr) + defines.str();
+
+            auto krn = kernel_cache<>::find< exdata<Expr> >(queue[d], sig);
+            if (krn) return krn;
+
+            if (!specialization_budget< exdata<Expr> >::take(queue[d]))
+                return assign_kernel(d, expr);
+
+            std::string name, source = assign_source(
+                    expr, name, assign_width(d, expr), prec, defines.str());
+
+            return kernel_cache<>::build< exdata<Expr> >(queue[d], source, name,
+                    precision_options(prec), sig);
+        }
+
+        template <class Expr>
+        void launch_assignment(uint d, const Expr &expr, const exdata<Expr> &krn,
+                const vector_cost_context &cost) const
+        {
+            if (part[d + 1] == part[d]) return;
+
+            // Shared kernel: all arguments are set.
+            kernel_arguments args(krn.kernel);
+
+            bool measure;
+            size_t wgsize = krn.tuner->next(part[d + 1] - part[d], measure);
+
+            launch_assignment(d, expr, args,
+                    assign_global_size(d, wgsize, assign_width(d, expr)),
+                    wgsize, cost, measure ? krn.tuner.get() : 0);
+        }
+
+        // The launch is timed for the tuner when one is given.
+        template <class Expr>
+        void launch_assignment(uint d, const Expr &expr, kernel_arguments &args,
+                size_t g_size, size_t wgsize, const vector_cost_context &cost,
+                workgroup_tuner *tuner = 0) const
+        {
+            size_t psize = part[d + 1] - part[d];
+
+            uint pos = 0;
+            args.setArg(pos++, psize);
+            args.setArg(pos++, buf[d]);
+
+            extract_terminals()(
+                    boost::proto::as_child(expr),
+                    basic_set_expression_argument<kernel_arguments>(
+                        args, d, pos, part[d], is_dfloat::value)
+                    );
+
+            const cl::Kernel &kernel = args.kernel();
+
+            if (stream_tracking<>::enabled || tuner) {
+                std::vector<cl::Event> wait;
+                cl::Event e;
+
+                if (stream_tracking<>::enabled) {
+                    depends(d, true, wait);
+                    extract_terminals()(
+                            boost::proto::as_child(expr),
+                            expression_dependencies(d, wait)
+                            );
+                }
+
+                queue[d].enqueueNDRangeKernel(
+                        kernel, cl::NullRange, g_size, wgsize,
+                        wait.empty() ? 0 : &wait, &e
+                        );
+
+                event_trace<>::add(queue[d], kernel, e,
+                        psize * cost.bytes, psize * cost.flops);
+
+                if (stream_tracking<>::enabled) {
+                    extract_terminals()(
+                            boost::proto::as_child(expr),
+                            expression_reader(d, e)
+                            );
+                    track(d, true, e);
+                }
+
+                if (tuner) tuner->record(wgsize, psize, e);
+            } else {
+                queue[d].enqueueNDRangeKernel(
+                        kernel, cl::NullRange, g_size, wgsize, 0,
+                        event_trace<>::kernel(queue[d], kernel,
+                            psize * cost.bytes, psize * cost.flops)
+                        );
+            }
+        }
+
+        // Private copy of a cached kernel, for arguments of its own.
+        static cl::Kernel kernel_copy(const cl::Kernel &krn) {
+            return cl::Kernel(
+                    krn.getInfo<CL_KERNEL_PROGRAM>(),
+                    krn.getInfo<CL_KERNEL_FUNCTION_NAME>().c_str()
+                    );
+        }
+
+        // Assignment kernel of an expression type ready to launch on a part:
+        // the private kernel with the arguments last set and the launch
+        // sizes.
+        struct assign_launch {
+            const void        *type;   // kernel cache tag of the expression
+            precision::policy prec;
+            std::string       cse;     // parameter aliases (expression_cse)
+            size_t            psize;
+            size_t            tuning;  // assignment_tuning<> revision of g_size
+            size_t            g_size;
+            size_t            wgsize;
+            bool              measure; // whether the launch is timed for the tuner
+            kernel_arguments  args;
+
+            std::shared_ptr<workgroup_tuner> tuner;
+        };
+
+        // Launch state of the assignments on a part: the queue with its
+        // context and precision policy, and the kernels, most recently used
+        // first.
+        struct assign_launches {
+            cl::CommandQueue  queue;
+            cl_context        context;
+            size_t            revision; // precision_policy<> revision of prec
+            precision::policy prec;
+
+            std::list<assign_launch> recent;
+
+            assign_launches() : context(0), revision(0), prec(precision::standard) {}
+
+            explicit assign_launches(const cl::CommandQueue &q)
+                : queue(q), context(qctx(q)()),
+                  revision(precision_policy<>::revision()),
+                  prec(precision_policy<>::get(context))
+            {}
         };
 
+        // The kernel of the expression on part d, from the launch state of
+        // the vector. The kernel cache is only consulted for new expression
+        // types, and when the precision policy, the parameter aliases or the
+        // part size change. Calls on the same vector are not thread-safe, as
+        // the arguments of the private kernels are not locked.
+        template <class Expr>
+        assign_launch& assign_launcher(uint d, const Expr &expr) const {
+            if (launches.size() != queue.size()) {
+                launches.clear();
+                launches.resize(queue.size());
+            }
+
+            assign_launches &l = launches[d];
+
+            if (l.queue() != queue[d]()) l = assign_launches(queue[d]);
+
+            size_t rev = precision_policy<>::revision();
+            if (l.revision != rev) {
+                l.revision = rev;
+                l.prec     = precision_policy<>::get(l.context);
+            }
+
+            const void *type = &kernel_cache_tag< exdata<Expr> >::id;
+
+            precision::policy prec  = is_dfloat::value ? precision::standard : l.prec;
+            size_t            psize = part[d + 1] - part[d];
+            std::string       cse   = is_dfloat::value ? std::string() :
+                expression_cse::signature(boost::proto::as_child(expr));
+
+            auto e = l.recent.begin();
+            for(; e != l.recent.end(); ++e)
+                if (e->type == type && e->prec == prec && e->psize == psize && e->cse == cse)
+                    break;
+
+            if (e != l.recent.end()) {
+                l.recent.splice(l.recent.begin(), l.recent, e);
+            } else {
+                auto krn = assign_kernel(d, expr, prec);
+
+                assign_launch n;
+                n.type    = type;
+                n.prec    = prec;
+                n.cse     = cse;
+                n.psize   = psize;
+                n.tuning  = 0;
+                n.g_size  = 0;
+                n.wgsize  = krn->tuner->size();
+                n.measure = false;
+                n.args    = kernel_arguments(kernel_copy(krn->kernel));
+                n.tuner   = krn->tuner;
+
+                l.recent.push_front(n);
+                if (l.recent.size() > VEXCL_ASSIGN_LAUNCH_CACHE) l.recent.pop_back();
+            }
+
+            assign_launch &f = l.recent.front();
+
+            size_t tuning = assignment_tuning<>::revision();
+            size_t wgsize = f.tuner->next(psize, f.measure);
+            if (!f.g_size || f.tuning != tuning || f.wgsize != wgsize) {
+                f.tuning = tuning;
+                f.wgsize = wgsize;
+                f.g_size = assign_global_size(d, f.wgsize, assign_width(d, expr));
+            }
+
+            return f;
+        }
+
+        size_t assign_global_size(uint d, size_t wgsize, uint width = 1) const {
+            size_t psize  = part[d + 1] - part[d];
+            size_t groups = assignment_tuning<>::get(queue[d]).groups;
+
+            // One work-item per chunk, or per element of the scalar tail.
+            size_t g_size = alignup(std::max<size_t>(psize / width, psize % width), wgsize);
+
+            // The kernel loops are grid-strided, so the grid may be capped.
+            if (groups) g_size = std::min(g_size,
+                    qdev(queue[d]).getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * wgsize * groups);
+
+            return g_size;
+        }
+
         std::vector<cl::CommandQueue>   queue;
         std::vector<size_t>             part;
         std::vector<cl::Buffer>         buf;
         mutable std::vector<cl::Event>  event;
 
+        mutable std::vector<part_hazards> hazard;
+
+        mutable std::vector<assign_launches> launches;
+
+        // Write version; zero when not versioned.
+        mutable size_t ver;
+
+        static void next_version(size_t &v) {
+            if (v) v = write_version<>::next();
+        }
+
         void allocate_buffers(cl_mem_flags flags, const T *hostptr) {
+            // Buffers are initialized by OpenCL when host pointer is used or
+            // copied at creation.
+            bool init = hostptr && (flags & (CL_MEM_USE_HOST_PTR | CL_MEM_COPY_HOST_PTR));
+
+            if (!hostptr) flags &= ~(CL_MEM_USE_HOST_PTR | CL_MEM_COPY_HOST_PTR);
+
             for(uint d = 0; d < queue.size(); d++) {
                 if (size_t psize = part[d + 1] - part[d]) {
                     cl::Context context = qctx(queue[d]);
 
-                    buf[d] = cl::Buffer(context, flags, psize * sizeof(T));
+                    buf[d] = init ?
+                        memory_pool<>::create("vector", context, flags, psize * sizeof(T),
+                                const_cast<T*>(hostptr + part[d])) :
+                        create_buffer(context, flags, psize * sizeof(T));
+
+                    if (!init && numa_first_touch<>::needed(queue[d]))
+                        numa_first_touch<>::apply(queue[d], buf[d], psize * sizeof(T));
                 }
             }
-            if (hostptr) write_data(0, size(), hostptr, CL_TRUE);
+
+            if (hostptr && !init) write_data(0, size(), hostptr, CL_TRUE);
+        }
+
+        static cl::Buffer create_buffer(
+                const cl::Context &context, cl_mem_flags flags, size_t bytes)
+        {
+#ifndef VEXCL_NO_MEMORY_POOL
+            return memory_pool<>::allocate(context, flags, bytes);
+#else
+            return memory_pool<>::create("vector", context, flags, bytes);
+#endif
+        }
+
+        static void release_buffer(const cl::Buffer &b) {
+#ifndef VEXCL_NO_MEMORY_POOL
+            memory_pool<>::release(b);
+#endif
+        }
+
+        void release_buffers() {
+            for(auto b = buf.begin(); b != buf.end(); b++)
+                release_buffer(*b);
         }
 };
 
-template <class T> template <class Expr>
-std::map<cl_context, bool> vector<T>::exdata<Expr>::compiled;
+/// \cond INTERNAL
+
+/// Orders an operation that does not pass wait lists itself.
+/**
+ * Operations built from several commands (sparse matrix products, stencil
+ * convolutions) declare the vectors they read and write, and call begin()
+ * before and end() after enqueuing their commands. begin() makes every queue
+ * wait for the last write of the inputs and for the last write and the
+ * outstanding reads of the outputs; end() registers a marker enqueued after
+ * the commands as a reader of the inputs and a writer of the outputs. Does
+ * nothing unless stream tracking is enabled.
+ */
+class hazard_guard {
+    public:
+        explicit hazard_guard(const std::vector<cl::CommandQueue> &queue)
+            : queue(queue), wait(stream_tracking<>::enabled ? queue.size() : 0)
+        {}
+
+        template <typename T>
+        hazard_guard& reads(const vector<T> &v) {
+            return add(v, false);
+        }
+
+        template <typename T>
+        hazard_guard& writes(const vector<T> &v) {
+            return add(v, true);
+        }
+
+        void begin() const {
+            for(uint d = 0; d < wait.size(); d++)
+                if (!wait[d].empty()) queue[d].enqueueWaitForEvents(wait[d]);
+        }
+
+        void end() const {
+            if (tracker.empty()) return;
+
+            std::vector<cl::Event> marker(queue.size());
+            for(uint d = 0; d < queue.size(); d++)
+                queue[d].enqueueMarker(&marker[d]);
+
+            for(auto t = tracker.begin(); t != tracker.end(); t++)
+                (*t)(marker);
+        }
+    private:
+        const std::vector<cl::CommandQueue> &queue;
+        std::vector< std::vector<cl::Event> > wait;
+        std::vector< std::function<void(const std::vector<cl::Event>&)> > tracker;
+
+        template <typename T>
+        hazard_guard& add(const vector<T> &v, bool writing) {
+            if (!stream_tracking<>::enabled) return *this;
 
-template <class T> template <class Expr>
-std::map<cl_context, cl::Kernel> vector<T>::exdata<Expr>::kernel;
+            for(uint d = 0; d < queue.size(); d++)
+                v.depends(d, writing, wait[d]);
 
-template <class T> template <class Expr>
-std::map<cl_context, size_t> vector<T>::exdata<Expr>::wgsize;
+            tracker.push_back([&v, writing](const std::vector<cl::Event> &marker) {
+                for(uint d = 0; d < marker.size(); d++)
+                    v.track(d, writing, marker[d]);
+            });
+
+            return *this;
+        }
+};
+
+/// \endcond
+
+/// Compile kernel for assignment of the expression to a vector<T> in background.
+/**
+ * \code
+ * vex::prewarm<double>(ctx, x + 2 * y);  // at startup
+ * ...
+ * z = x + 2 * y;                         // does not wait for compilation
+ * \endcode
+ */
+template <typename T, class Expr>
+void prewarm(const std::vector<cl::CommandQueue> &queue, const Expr &expr) {
+    vector<T>::prewarm(queue, expr);
+}
 
 /// Copy device vector to host vector.
 template <class T>
@@ -783,6 +1903,341 @@ void copy(const T *hv, vex::vector<T> &dv, cl_bool blocking = CL_TRUE) {
 
 /// \cond INTERNAL
 
+/// Rectangular transfer between a device vector and a packed host block.
+template <class T>
+void copy_rect(const vex::vector<T> &dv, T *hv,
+        const std::array<size_t, 3> &origin, const std::array<size_t, 3> &region,
+        size_t row_pitch, size_t slice_pitch, cl_bool blocking, bool read)
+{
+    const size_t w = region[0], h = region[1], depth = region[2];
+
+    if (!w || !h || !depth) return;
+
+    if ((origin[2] || depth > 1) && !slice_pitch)
+        throw std::invalid_argument("vex::copy: slice pitch is required for 3D regions");
+
+    if (origin[0] + w > row_pitch || (slice_pitch && (origin[1] + h) * row_pitch > slice_pitch))
+        throw std::out_of_range("vex::copy: region exceeds the pitch");
+
+    // Position of the first element of row y in slice z of the block.
+    auto linear = [&](size_t y, size_t z) {
+        return (origin[2] + z) * slice_pitch + (origin[1] + y) * row_pitch + origin[0];
+    };
+
+    if (linear(h - 1, depth - 1) + w > dv.size())
+        throw std::out_of_range("vex::copy: region exceeds the vector");
+
+    const std::vector<cl::CommandQueue> &queue = dv.queue_list();
+    const std::vector<size_t> &part = dv.partition();
+    std::vector<cl::Event> events;
+
+    // Transfers rows [y, y + rows) of slices [z, z + slices), which have to
+    // reside in the part d.
+    auto transfer = [&](uint d, size_t y, size_t z, size_t rows, size_t slices) {
+        cl::size_t<3> buffer_origin, host_origin, rect;
+
+        buffer_origin[0] = (linear(y, z) - part[d]) * sizeof(T);
+        buffer_origin[1] = 0;
+        buffer_origin[2] = 0;
+
+        host_origin[0] = 0;
+        host_origin[1] = y;
+        host_origin[2] = z;
+
+        rect[0] = w * sizeof(T);
+        rect[1] = rows;
+        rect[2] = slices;
+
+        size_t bpitch = slices > 1 ? slice_pitch * sizeof(T) : 0;
+
+        std::vector<cl::Event> wait;
+        if (stream_tracking<>::enabled) dv.depends(d, !read, wait);
+
+        cl::Event e;
+        if (read)
+            queue[d].enqueueReadBufferRect(dv(d), CL_FALSE,
+                    buffer_origin, host_origin, rect,
+                    row_pitch * sizeof(T), bpitch, w * sizeof(T), w * h * sizeof(T),
+                    hv, wait.empty() ? 0 : &wait, &e);
+        else
+            queue[d].enqueueWriteBufferRect(dv(d), CL_FALSE,
+                    buffer_origin, host_origin, rect,
+                    row_pitch * sizeof(T), bpitch, w * sizeof(T), w * h * sizeof(T),
+                    hv, wait.empty() ? 0 : &wait, &e);
+
+        if (stream_tracking<>::enabled) dv.track(d, !read, e);
+        event_trace<>::add(queue[d], read ? "read rect" : "write rect", e);
+
+        events.push_back(e);
+    };
+
+    for(uint d = 0; d < queue.size(); d++) {
+        size_t lo = part[d], hi = part[d + 1];
+        if (lo == hi) continue;
+
+        // The whole block is on the device.
+        if (linear(0, 0) >= lo && linear(h - 1, depth - 1) + w <= hi) {
+            transfer(d, 0, 0, h, depth);
+            continue;
+        }
+
+        // Rows of each slice that are completely on the device.
+        for(size_t z = 0; z < depth; z++) {
+            size_t first = linear(0, z);
+            if (first + (h - 1) * row_pitch + w <= lo || first >= hi) continue;
+
+            size_t ya = first >= lo ? 0 : (lo - first + row_pitch - 1) / row_pitch;
+            size_t yb = first + w > hi ? 0 : std::min(h, (hi - w - first) / row_pitch + 1);
+
+            if (ya < yb) transfer(d, ya, z, yb - ya, 1);
+        }
+    }
+
+    // Rows that cross a part boundary go through the linear transfers.
+    for(size_t z = 0; z < depth; z++) {
+        for(size_t y = 0; y < h; y++) {
+            size_t start = linear(y, z);
+            size_t d = std::upper_bound(part.begin(), part.end(), start) - part.begin() - 1;
+
+            if (start + w <= part[d + 1]) continue;
+
+            std::vector<cl::Event> ev(queue.size());
+            if (read)
+                dv.read_data(start, w, hv + (z * h + y) * w, CL_FALSE, &ev);
+            else
+                const_cast<vex::vector<T>&>(dv).write_data(start, w, hv + (z * h + y) * w, CL_FALSE, &ev);
+
+            for(; d < queue.size() && part[d] < start + w; d++)
+                events.push_back(ev[d]);
+        }
+    }
+
+    if (blocking)
+        for(auto e = events.begin(); e != events.end(); e++) e->wait();
+}
+
+/// \endcond
+
+/// Copy rectangular block of device vector to host pointer.
+/**
+ * The vector holds a row-major grid with row_pitch elements per row and
+ * slice_pitch elements per slice. The block of region[0] x region[1] x
+ * region[2] elements starting at (origin[0], origin[1], origin[2]) is
+ * written to hv densely packed. The slice pitch may be omitted for 2D
+ * blocks (origin[2] == 0, region[2] == 1):
+ * \code
+ * // rows 10..19, columns 0..31 of an n x m matrix
+ * std::vector<double> block(32 * 10);
+ * vex::copy(A, block.data(), {{0, 10, 0}}, {{32, 10, 1}}, m);
+ * \endcode
+ * Each device transfers the rows it holds with clEnqueueReadBufferRect,
+ * so halos and subdomains are extracted without copying the whole grid.
+ */
+template <class T>
+void copy(const vex::vector<T> &dv, T *hv,
+        const std::array<size_t, 3> &origin, const std::array<size_t, 3> &region,
+        size_t row_pitch, size_t slice_pitch = 0, cl_bool blocking = CL_TRUE)
+{
+    copy_rect(dv, hv, origin, region, row_pitch, slice_pitch, blocking, true);
+}
+
+/// Copy densely packed host block to rectangular block of device vector.
+/**
+ * \see copy(const vex::vector<T>&, T*, const std::array<size_t, 3>&, const std::array<size_t, 3>&, size_t, size_t, cl_bool)
+ */
+template <class T>
+void copy(const T *hv, vex::vector<T> &dv,
+        const std::array<size_t, 3> &origin, const std::array<size_t, 3> &region,
+        size_t row_pitch, size_t slice_pitch = 0, cl_bool blocking = CL_TRUE)
+{
+    copy_rect(dv, const_cast<T*>(hv), origin, region, row_pitch, slice_pitch, blocking, false);
+}
+
+/// Granularity of slice starts on the device, in elements.
+/**
+ * Sub-buffer origins have to be aligned to CL_DEVICE_MEM_BASE_ADDR_ALIGN.
+ */
+template <typename T>
+size_t slice_alignment(const cl::CommandQueue &queue) {
+    size_t bytes = qdev(queue).getInfo<CL_DEVICE_MEM_BASE_ADDR_ALIGN>() / 8;
+    return std::max<size_t>(1, bytes / sizeof(T));
+}
+
+/// Zero-copy view of the elements [start, start + size) of a vector.
+/**
+ * The returned vector shares memory with v through sub-buffers, so it may
+ * be used in expressions, reductions and copies like any other vector, and
+ * writes to it change v:
+ * \code
+ * vex::vector<double> head = vex::slice(x, 0, n / 2);
+ * head = 2 * head;                     // scales the first half of x
+ * \endcode
+ * The slice keeps the devices of v and covers the part of [start, start +
+ * size) that each device holds, so slices of vectors with the same
+ * partition have the same partition too.
+ *
+ * The start of every non-empty part, relative to the part of v it lies in,
+ * has to be a multiple of slice_alignment<T>() for its device; otherwise
+ * std::invalid_argument is thrown. Unaligned ranges may still be copied
+ * without staging through vector::read_data() and vector::write_data().
+ *
+ * \note The slice must not outlive v. Commands on the slice and on v are
+ * ordered by their device queues only, and not by stream tracking.
+ */
+template <typename T>
+vector<T> slice(const vector<T> &v, size_t start, size_t size) {
+    if (start + size > v.size())
+        throw std::out_of_range("vex::slice: range exceeds the vector");
+
+    const std::vector<cl::CommandQueue> &queue = v.queue_list();
+
+    std::vector<size_t>     part(queue.size() + 1);
+    std::vector<cl::Buffer> buf(queue.size());
+
+    part[0] = 0;
+
+    for(uint d = 0; d < queue.size(); d++) {
+        size_t lo = std::max(start,        v.part_start(d));
+        size_t hi = std::min(start + size, v.part_start(d) + v.part_size(d));
+
+        part[d + 1] = part[d];
+        if (lo >= hi) continue;
+
+        size_t origin = lo - v.part_start(d);
+
+        if (origin % slice_alignment<T>(queue[d]))
+            throw std::invalid_argument(
+                    "vex::slice: start is not aligned to CL_DEVICE_MEM_BASE_ADDR_ALIGN");
+
+        part[d + 1] += hi - lo;
+
+        cl_buffer_region region = {origin * sizeof(T), (hi - lo) * sizeof(T)};
+        buf[d] = v(d).createSubBuffer(CL_MEM_READ_WRITE,
+                CL_BUFFER_CREATE_TYPE_REGION, &region);
+    }
+
+    // v may be written through the slice from now on.
+    v.unversion();
+
+    return vector<T>(queue, part, buf);
+}
+
+/// Copy host array to device vector through pinned staging buffers.
+/**
+ * The transfer is split into chunks of the given size (in elements). Each
+ * chunk is first copied into one of two pinned host buffers and then sent to
+ * the device asynchronously, so that copying of the next chunk on the host
+ * overlaps with the DMA transfer of the previous one. Chunks for different
+ * devices are interleaved. This is faster than copy() for large vectors
+ * residing in pageable host memory.
+ */
+template <class T>
+void stream_copy(const T *hv, vex::vector<T> &dv, size_t chunk = 0) {
+    if (!chunk) chunk = default_stream_chunk(sizeof(T));
+
+    const std::vector<cl::CommandQueue> &queue = dv.queue_list();
+
+    std::vector< std::unique_ptr< pinned_staging<T> > > stage(queue.size());
+    for(uint d = 0; d < queue.size(); d++)
+        if (dv.part_size(d))
+            stage[d].reset(new pinned_staging<T>(queue[d],
+                        std::min(chunk, dv.part_size(d))));
+
+    for(size_t k = 0; ; k++) {
+        bool active = false;
+
+        for(uint d = 0; d < queue.size(); d++) {
+            size_t start = k * chunk;
+            if (start >= dv.part_size(d)) continue;
+
+            size_t n = std::min(chunk, dv.part_size(d) - start);
+            int    i = k % 2;
+
+            stage[d]->wait(i);
+
+            std::copy(hv + dv.part_start(d) + start,
+                    hv + dv.part_start(d) + start + n, stage[d]->ptr[i]);
+
+            queue[d].enqueueWriteBuffer(dv(d), CL_FALSE,
+                    start * sizeof(T), n * sizeof(T), stage[d]->ptr[i],
+                    0, &stage[d]->event[i]);
+
+            stage[d]->busy[i] = true;
+            active = true;
+        }
+
+        if (!active) break;
+    }
+}
+
+/// Copy device vector to host array through pinned staging buffers.
+/**
+ * \see stream_copy(const T*, vex::vector<T>&, size_t)
+ */
+template <class T>
+void stream_copy(const vex::vector<T> &dv, T *hv, size_t chunk = 0) {
+    if (!chunk) chunk = default_stream_chunk(sizeof(T));
+
+    const std::vector<cl::CommandQueue> &queue = dv.queue_list();
+
+    std::vector< std::unique_ptr< pinned_staging<T> > > stage(queue.size());
+    for(uint d = 0; d < queue.size(); d++)
+        if (dv.part_size(d))
+            stage[d].reset(new pinned_staging<T>(queue[d],
+                        std::min(chunk, dv.part_size(d))));
+
+    // Chunk k is read while chunk k - 1 is copied out of the staging area.
+    for(size_t k = 0; ; k++) {
+        bool active = false;
+
+        for(uint d = 0; d < queue.size(); d++) {
+            size_t psize = dv.part_size(d);
+
+            if (k * chunk < psize) {
+                size_t start = k * chunk;
+                size_t n = std::min(chunk, psize - start);
+                int    i = k % 2;
+
+                queue[d].enqueueReadBuffer(dv(d), CL_FALSE,
+                        start * sizeof(T), n * sizeof(T), stage[d]->ptr[i],
+                        0, &stage[d]->event[i]);
+
+                stage[d]->busy[i] = true;
+                active = true;
+            }
+
+            if (k > 0 && (k - 1) * chunk < psize) {
+                size_t start = (k - 1) * chunk;
+                size_t n = std::min(chunk, psize - start);
+                int    i = (k - 1) % 2;
+
+                stage[d]->wait(i);
+
+                std::copy(stage[d]->ptr[i], stage[d]->ptr[i] + n,
+                        hv + dv.part_start(d) + start);
+
+                active = true;
+            }
+        }
+
+        if (!active) break;
+    }
+}
+
+/// Copy host vector to device vector through pinned staging buffers.
+template <class T>
+void stream_copy(const std::vector<T> &hv, vex::vector<T> &dv, size_t chunk = 0) {
+    stream_copy(hv.data(), dv, chunk);
+}
+
+/// Copy device vector to host vector through pinned staging buffers.
+template <class T>
+void stream_copy(const vex::vector<T> &dv, std::vector<T> &hv, size_t chunk = 0) {
+    stream_copy(dv, hv.data(), chunk);
+}
+
+/// \cond INTERNAL
+
 template<class Iterator, class Enable = void>
 struct stored_on_device : std::false_type {};
 
@@ -836,10 +2291,22 @@ void swap(vector<T> &x, vector<T> &y) {
 }
 
 /// Returns device weight after simple bandwidth test
+/**
+ * If the device has been characterised with the roofline suite of
+ * src/Ch1/device_details (DeviceDetails --bench with VEXCL_CACHE_DIR set),
+ * its measured copy bandwidth is used instead of the test, scaled to the
+ * units of the test (the inverse time of a = b + c).
+ */
 inline double device_vector_perf(const cl::CommandQueue &q) {
     static const size_t test_size = 1024U * 1024U;
     std::vector<cl::CommandQueue> queue(1, q);
 
+    double w;
+    if (device_properties<>::load(qdev(q), "roofline global copy bandwidth", w))
+        return w * 1e9 / (3 * sizeof(float) * test_size);
+
+    if (device_properties<>::load(qdev(q), "vector perf", w)) return w;
+
     // Allocate test vectors on current device and measure execution
     // time of a simple kernel.
     vex::vector<float> a(queue, test_size);
@@ -853,9 +2320,93 @@ inline double device_vector_perf(const cl::CommandQueue &q) {
     profiler prof(queue);
     prof.tic_cl("");
     a = b + c;
-    return 1.0 / prof.toc("");
+
+    w = 1.0 / prof.toc("");
+    device_properties<>::store(qdev(q), "vector perf", w);
+    return w;
+}
+
+/// \cond INTERNAL
+
+template <bool dummy>
+boost::mutex assignment_tuning<dummy>::mx;
+
+template <bool dummy>
+std::map<cl_device_id, assignment_params> assignment_tuning<dummy>::known;
+
+template <bool dummy>
+std::atomic<size_t> assignment_tuning<dummy>::rev(0);
+
+template <bool dummy>
+assignment_params assignment_tuning<dummy>::get(const cl::CommandQueue &queue) {
+    cl::Device device = qdev(queue);
+
+    {
+        boost::lock_guard<boost::mutex> lock(mx);
+
+        auto p = known.find(device());
+        if (p != known.end()) return p->second;
+    }
+
+    assignment_params prm(device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU ? 0 : 4);
+
+    // The benchmark assigns vectors itself, so it runs without the lock.
+    double groups;
+    if (device_properties<>::load(device, "assignment groups", groups)) {
+        prm.groups = static_cast<size_t>(groups);
+    } else if (getenv("VEXCL_TUNE_ASSIGNMENT")) {
+        prm = benchmark(queue);
+        device_properties<>::store(device, "assignment groups", static_cast<double>(prm.groups));
+    }
+
+    set(device, prm);
+    return prm;
 }
 
+template <bool dummy>
+assignment_params assignment_tuning<dummy>::benchmark(const cl::CommandQueue &queue) {
+    typedef boost::chrono::high_resolution_clock clock;
+
+    const size_t n = 1 << 22;
+    const int    repeat = 8;
+
+    cl::Device device = qdev(queue);
+    std::vector<cl::CommandQueue> q(1, queue);
+
+    // Assignments below look up the configuration being benchmarked.
+    set(device, assignment_params());
+
+    vex::vector<float> a(q, n), b(q, n), c(q, n);
+    b = 1;
+    c = 2;
+
+    assignment_params best;
+    double best_time = std::numeric_limits<double>::max();
+
+    for(size_t groups = 0; groups <= 64; groups = groups ? groups * 2 : 1) {
+        assignment_params prm(groups);
+        set(device, prm);
+
+        // Warm up: compiles the kernel on the first pass.
+        a = b + c;
+        q[0].finish();
+
+        clock::time_point start = clock::now();
+        for(int i = 0; i < repeat; i++) a = b + c;
+        q[0].finish();
+        double time = boost::chrono::duration<double>(clock::now() - start).count();
+
+        if (time < best_time) {
+            best_time = time;
+            best = prm;
+        }
+    }
+
+    return best;
+}
+
+/// \endcond
+
 
 /// Download and print the vector elements.
 template<class T>
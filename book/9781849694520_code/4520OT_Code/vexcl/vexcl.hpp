@@ -113,6 +113,16 @@ Y = 42;
 Z = sqrt(2 * X) + cos(Y);
 \endcode
 
+Repeated subexpressions of an expression, and repeated reads of the same
+vector, are computed once per element into temporaries of the generated
+kernel. Here sin(X) and exp(a * X) are evaluated once each:
+\code
+Z = sin(X) * sin(X) + cos(X) * exp(a * X) / exp(a * X);
+\endcode
+Kernels with such repetitions are compiled for the pattern of repeated
+terminals, so Z = sin(X) * sin(Y) gets a kernel of its own. Defining
+VEXCL_NO_CSE turns the elimination off.
+
 If values of vector elements should depend on their positions in the vector,
 then you can use element_index() function in vector expresion. For example,
 to assign one period of sine function to a vector, you could
@@ -137,6 +147,137 @@ std::cout << sum(Z) << std::endl;
 std::cout << sum(sqrt(2 * X) + cos(Y)) << std::endl;
 \endcode
 
+Assignment and reduction kernels process several elements per step with
+vloadN/vstoreN whenever the expression consists of vectors of the result
+type, scalars, arithmetic and component-wise builtins (comparisons, user
+functions and element_index() keep the kernel scalar). N is the device's
+CL_DEVICE_PREFERRED_VECTOR_WIDTH_* for the type; VEXCL_VECTOR_WIDTH
+environment variable overrides it, and VEXCL_VECTOR_WIDTH=1 turns
+vectorization off.
+
+The kernels stride over the vector, so on large vectors the grid may be
+capped by vex::set_assignment_params() at a number of work-groups per compute
+unit. GPUs are capped at 4 by default; with VEXCL_TUNE_ASSIGNMENT set, the
+cap of each device is chosen by a benchmark (and stored in VEXCL_CACHE_DIR).
+
+Vector and multivector expressions and generated kernels are launched with the
+largest work-group size the kernel accepts. With VEXCL_TUNE_WORKGROUP set (or
+after vex::workgroup_tuning<>::enable()), every such kernel times its first
+launches with several smaller power of two sizes and keeps the fastest one;
+the queues have to be created with CL_QUEUE_PROFILING_ENABLE. Choices are
+stored in VEXCL_CACHE_DIR next to the program binaries. VEXCL_WORKGROUP_SIZE
+(or vex::workgroup_tuning<>::pin()) pins the size for reproducible runs:
+\code
+vex::workgroup_tuning<>::pin(128);
+\endcode
+
+Vectors of vex::half store IEEE 754 half precision values and halve the
+memory traffic of bandwidth-bound expressions. Kernels load and store them
+with vload_half()/vstore_half() and compute in float, so cl_khr_fp16 is not
+required. Half vectors mix freely with float ones, and are reduced with float
+reductors:
+\code
+vex::vector<vex::half> H(ctx.queue(), n);
+vex::Reductor<float, vex::SUM> sum(ctx.queue());
+H = 0.5f * H + X;
+std::cout << sum(H * H) << std::endl;
+\endcode
+
+Multiply-adds of assignments and reductions follow the precision policy of
+the context, set with vex::set_precision(). vex::precision::fma writes
+a * b + c as fma(), vex::precision::fast_relaxed as mad() and compiles with
+-cl-mad-enable -cl-fast-relaxed-math, and vex::precision::strict switches off
+FP_CONTRACT. Kernels are cached per policy:
+\code
+vex::set_precision(ctx.context(0), vex::precision::fma);
+Y = A * X + Y;
+\endcode
+
+Devices without cl_khr_fp64 may still get about 44 bits of mantissa from
+vectors of vex::dfloat, which keep each value as an unevaluated sum of two
+floats. Arithmetic, sqrt(), fabs(), fmax() and fmin() of dfloat expressions
+are generated with error-free transformations, and sums, maxima and minima
+are reduced by dfloat reductors. Any other builtin throws on kernel
+generation:
+\code
+vex::vector<vex::dfloat> D(ctx.queue(), n);
+vex::Reductor<vex::dfloat, vex::SUM> sum(ctx.queue());
+D = D * D + 1e-10;
+std::cout << static_cast<double>(sum(D)) << std::endl;
+\endcode
+
+Long float sums keep their accuracy with vex::SUM_KAHAN, which carries the
+rounding error of every work-item along, or with the cheaper
+vex::SUM_PAIRWISE, which adds elements in blocks of VEXCL_PAIRWISE_BLOCK.
+Both read the vector once, at the bandwidth of float:
+\code
+vex::Reductor<float, vex::SUM_KAHAN> ksum(ctx.queue());
+std::cout << ksum(X) << std::endl;
+\endcode
+
+Reductions per key use the same reduction kinds. vex::reduce_by_key() reduces
+runs of equal keys, as in sorted keys, with a segmented scan;
+vex::group_by() takes unsorted integer keys from a bounded range and reduces
+them with atomics:
+\code
+size_t groups = vex::reduce_by_key(keys, X, ukeys, sums);
+vex::group_by<vex::MAX>(bin, X, nbins, maxima);
+\endcode
+
+Each float builtin with a native_ or half_ version (sin, cos, exp, log,
+sqrt, ...) is available as vex::native_sin(), vex::half_exp() and so on.
+vex::minimax::sin(), cos(), exp() and log() take the largest error the caller
+accepts in ulp, and evaluate the cheapest polynomial within it.
+vex::math_benchmark() measures the error and the time of every variant on a
+device:
+\code
+Y = vex::minimax::sin<32>(X) * vex::native_exp(-X);
+std::cout << vex::math_benchmark(ctx.queue(0)) << std::endl;
+\endcode
+
+Values that stay the same over many assignments may be compiled into the
+kernel with vex::specialize(). The vector size and the host scalars of the
+expression become constants the compiler can fold; a kernel is built for each
+distinct set of values, up to VEXCL_MAX_SPECIALIZATIONS per expression and
+device, after which the generic kernel is used:
+\code
+Y = vex::specialize(2 * X + 1);
+\endcode
+
+A contiguous range of a vector may be used without copying through
+vex::slice(), which returns a vector sharing memory with the original one
+through OpenCL sub-buffers. Within the device part it falls into, the start
+of the range has to respect CL_DEVICE_MEM_BASE_ADDR_ALIGN (see
+vex::slice_alignment()). With a single device:
+\code
+size_t a = vex::slice_alignment<double>(ctx.queue(0));
+vex::vector<double> tail = vex::slice(X, n / 2 / a * a, n - n / 2 / a * a);
+tail = 0;
+\endcode
+
+Rectangular blocks of row-major 2D and 3D grids are copied with the pitched
+overloads of vex::copy(), which use clEnqueueReadBufferRect and
+clEnqueueWriteBufferRect on every device holding a part of the block:
+\code
+// columns [8, 24) of rows [100, 200) of an n x m grid
+std::vector<double> block(16 * 100);
+vex::copy(X, block.data(), {{8, 100, 0}}, {{16, 100, 1}}, m);
+\endcode
+
+Device memory taken by VexCL is accounted per context and per owner (vectors,
+the memory pool, sparse matrices, FFT plans and so on) by vex::memory_account.
+A memory budget for a context makes allocations beyond it release the cached
+buffers of the pool and, failing that, throw, instead of running the device
+out of memory later on:
+\code
+vex::memory_account<>::set_budget(ctx.context(0), 1536 << 20);
+...
+auto tags = vex::memory_account<>::by_tag();
+for(auto t = tags.begin(); t != tags.end(); ++t)
+    std::cout << t->first << ": " << t->second.live << " bytes (peak "
+              << t->second.peak << ")" << std::endl;
+\endcode
+
 \section stencil Stencil convolution
 
 Stencil convolution operation comes in handy in many situations. For example,
@@ -154,6 +295,17 @@ x = 1;
 y = x * s; // convolve x with s
 \endcode
 
+Images and other 2D or 3D grids stored in row-major order are convolved with
+vex::mdstencil. Separable filters may be given by their one-dimensional
+factors:
+\code
+// 5x5 Gaussian blur of nx by ny image.
+std::vector<double> g = {1.0/16, 4.0/16, 6.0/16, 4.0/16, 1.0/16};
+vex::mdstencil<double> blur(ctx, {{nx, ny}}, {{g, g}}, {{2, 2}});
+
+y = x * blur;
+\endcode
+
 \section spmv Sparse matrix-vector multiplication
 
 One of the most common operations in linear algebra is matrix-vector
@@ -216,6 +368,59 @@ void cg_gpu(
 }
 \endcode
 
+Large matrices may be assembled on the devices from unsorted triplets instead:
+the devices sort them, sum the duplicates and build their CSR strips, so the
+host only groups the triplets by device:
+\code
+vex::SpMat<double, int> A(ctx, n, n, vex::coo(nnz, row, col, val));
+\endcode
+The same device pipeline assembles products of sparse matrices, e.g. for the
+Galerkin operators of multigrid hierarchies:
+\code
+vex::SpMat<double, int, int> C(ctx,
+    vex::csr(n, k, arow, acol, aval), vex::csr(k, m, brow, bcol, bval));
+\endcode
+
+Products with the transposed matrix, as needed by BiCG or by gradients, use
+the stored matrix and no transposed copy:
+\code
+y = vex::transpose(A) * x;
+\endcode
+
+The same solvers, together with BiCGStab and restarted GMRES, are available in
+vexcl/krylov.hpp. Their fused updates write u and r in one pass while
+computing the next residual norm, and the operator does not have to be an
+assembled matrix: any functor with signature <tt>void(const vector<real>&,
+vector<real>&)</tt>, a stencil, or a matrix will do:
+\code
+vex::krylov_report rep = vex::cg(A, f, u, vex::krylov_params(1e-8, 100));
+std::cout << rep.iters << " iterations, residual " << rep.resid << std::endl;
+
+rep = vex::gmres([&](const vex::vector<double> &x, vex::vector<double> &y) {
+        S.convolve(x, y); y += x;
+    }, f, u);
+\endcode
+
+Each solver also takes a preconditioner as the second argument. The
+preconditioners in vexcl/precond.hpp are set up from the same CSR arrays as
+vex::SpMat: vex::precond::jacobi, vex::precond::chebyshev,
+vex::precond::block_ilu0 (ILU(0) of the diagonal block owned by each device)
+and vex::precond::amg (smoothed aggregation multigrid):
+\code
+vex::precond::amg<double> M(ctx, n, row.data(), col.data(), val.data());
+rep = vex::cg(A, M, f, u);
+\endcode
+
+Sparse triangular systems, e.g. the factors of an incomplete factorization,
+are solved on the devices by vex::triangular_solver. The rows are grouped
+into levels of independent rows once, at construction, and each solve is
+one kernel launch per level:
+\code
+vex::triangular_solver<double> L(ctx, n, lrow.data(), lcol.data(), lval.data(),
+        vex::triangular_solver<double>::lower);
+L(b, x);
+\endcode
+
 VexCL also provides support for <a
 href="http://viennacl.sourceforge.net">ViennaCL</a> iterative solvers. See
 examples/viennacl/solvers.cpp.
@@ -285,6 +490,31 @@ y = rnd(element_index(n), seed);
 double pi = 4.0 * sum(x * x + y * y < 1) / n;
 \endcode
 
+When a vector just has to be filled with random numbers, vex::RandomStream is
+faster: it uses all four output words of the generator for each counter, and
+remembers its position in the stream between calls:
+\code
+vex::RandomStream<double> rnd(ctx, seed);
+
+rnd.uniform(x);
+rnd.normal(y, 0, 2);
+rnd.exponential(z);
+\endcode
+
+Monte Carlo estimates do not need the random numbers stored at all.
+vex::MonteCarlo generates the samples, evaluates the integrand and
+accumulates the statistics in a single kernel, and returns the standard error
+of the mean along with the mean:
+\code
+VEX_FUNCTION_TYPE(inside_t, double(double, double),
+        "return prm1 * prm1 + prm2 * prm2 < 1 ? 4.0 : 0.0;");
+
+vex::MonteCarlo<double> mc(ctx, seed);
+vex::monte_carlo_estimate<double> pi = mc.uniform<2>(inside_t(), n);
+
+std::cout << pi.mean << " +- " << pi.error << std::endl;
+\endcode
+
 
 \section multivector Multi-component vectors
 
@@ -315,6 +545,25 @@ Components of a multivector may be accessed with operator():
 vex::vector<double> z = y(1);
 \endcode
 
+Reduction of a multivector expression computes all components in a single
+kernel. When all components are always processed together, the interleaved
+layout of a vex::vector of OpenCL vector type allows single vector loads.
+vex::pack() and vex::unpack() convert between the two layouts:
+\code
+vex::vector<cl_double4> p(ctx, n);
+vex::pack(x, p);
+\endcode
+
+Records of N scalars interleaved in a plain vex::vector, as ingested from
+array-of-structures data, convert the same way without padding. The row-major
+matrices of single-device vectors are transposed with vex::transpose(), in
+place when square:
+\code
+vex::vector<double> xyz(ctx, 3 * n);
+vex::unpack(xyz, x);
+vex::transpose(A, At, rows, cols);
+\endcode
+
 Sometimes operations with multicomponent vector cannot be expressed with simple
 arithmetic expressions. Imagine that you need to solve the following system of
 ordinary differential equations:
@@ -431,6 +680,37 @@ sys_func are now represented not as full-blown vex::vectors, but as fast
 register variables inside the kernel body. We have seen upto tenfold
 performance improvement with this technique.
 
+Loops and branches of the host algorithm are unrolled during recording. For
+long loops this results in huge kernels. vex::generator::loop() and
+vex::generator::if_() record real OpenCL control flow instead:
+\code
+typedef vex::generator::symbolic<int> sym_int;
+sym_int steps(sym_int::ScalarParameter);
+
+vex::generator::loop(steps, [&](sym_int) {
+    runge_kutta_4(sys_func<sym_state>, sym_x, dt);
+});
+
+auto kernel = vex::generator::build_kernel(ctx,
+    "rk4_stepper", body.str(), sym_x, steps);
+
+kernel(x, 100);
+\endcode
+
+Recording does not need an OpenCL context, so the kernel source may be
+generated once, saved, and loaded in later runs without repeating the
+recording. Compiled binaries of loaded kernels go to the program binary cache
+when VEXCL_CACHE_DIR is set:
+\code
+// At build time:
+vex::generator::build_source("rk4_stepper", body.str(), sym_x)
+    .save("rk4_stepper.vexkrn");
+
+// At runtime:
+vex::generator::Kernel<1> kernel(ctx,
+    vex::generator::kernel_source::load("rk4_stepper.vexkrn"));
+\endcode
+
 \section custkern Using custom kernels
 
 Custom kernels are of course possible as well. vector::operator(uint)
@@ -501,6 +781,28 @@ CPU is added to VexCL context. The only primitive gaining speed from this
 addition is vector arithmetic. This is probably because performance of vector
 arithmetic was used as a basis for problem partitioning.
 
+Data moves between devices when vectors are repartitioned and in the
+multi-device exchanges of sparse matrices, stencils, gathers and dense
+products. OpenCL copies buffers without the host only within one context, so
+these copies are direct when the devices share a context, and otherwise are
+pipelined through pinned host buffers. vex::device_copy() does the same for
+any pair of buffers:
+vex::Context creates a context per device; devices of one platform may be
+put into a single context explicitly:
+\code
+std::vector<cl::Device> dev = vex::device_list(
+        vex::Filter::Platform("NVIDIA") && vex::Filter::Count(2));
+cl::Context context(dev);
+
+std::vector< std::pair<cl::Context, cl::CommandQueue> > q;
+for(auto d = dev.begin(); d != dev.end(); d++)
+    q.push_back(std::make_pair(context, cl::CommandQueue(context, *d)));
+
+vex::Context ctx(q);
+...
+vex::device_copy(ctx.queue(0), x(0), 0, ctx.queue(1), y(1), 0, bytes).wait();
+\endcode
+
 \section mpi MPI wrappers
 
 VexCL provides thin layer of MPI wrappers for its types. Please see examples in
@@ -536,16 +838,41 @@ there, you can download it from <a href="http://www.khronos.org/registry/cl">Kro
 #include <CL/cl.hpp>
 #include <iostream>
 
+#include <vexcl/kernel_cache.hpp>
+#include <vexcl/autotune.hpp>
+#include <vexcl/accounting.hpp>
+#include <vexcl/memory_pool.hpp>
+#include <vexcl/telemetry.hpp>
+#include <vexcl/trace.hpp>
+#include <vexcl/transfer.hpp>
+#include <vexcl/precision.hpp>
 #include <vexcl/devlist.hpp>
 #include <vexcl/vector.hpp>
+#include <vexcl/scalar.hpp>
 #include <vexcl/multivector.hpp>
 #include <vexcl/reduce.hpp>
 #include <vexcl/spmat.hpp>
+#include <vexcl/reorder.hpp>
+#include <vexcl/refine.hpp>
 #include <vexcl/stencil.hpp>
+#include <vexcl/krylov.hpp>
+#include <vexcl/trisolve.hpp>
+#include <vexcl/precond.hpp>
 #include <vexcl/gather.hpp>
+#include <vexcl/sort.hpp>
+#include <vexcl/scan.hpp>
+#include <vexcl/reduce_by_key.hpp>
+#include <vexcl/transpose.hpp>
+#include <vexcl/mathlib.hpp>
+#include <vexcl/histogram.hpp>
+#include <vexcl/gemm.hpp>
+#include <vexcl/dense.hpp>
 #include <vexcl/random.hpp>
 #include <vexcl/fft.hpp>
 #include <vexcl/generator.hpp>
+#include <vexcl/stream.hpp>
+#include <vexcl/graph.hpp>
+#include <vexcl/binary_io.hpp>
 #include <vexcl/profiler.hpp>
 
 #ifdef WIN32
@@ -1,6 +1,14 @@
 ﻿#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <malloc.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+// OpenCL 1.x 的设备仍然用 clCreateCommandQueue
+#define CL_USE_DEPRECATED_OPENCL_1_2_APIS
 #include <CL/cl.h>
 
 
@@ -151,69 +159,128 @@ void displayDeviceInfo(cl_platform_id id,
 	}
 }
 
-const int ARRAY_SIZE = 1000;
 /*
-1. 创建平台
-2. 创建设备
-3. 根据设备创建上下文
+@ 向量加法的扩展测试：把一个大向量按比例切分到所有平台的所有设备上同时计算，
+@ 输出每个设备单独运行时的吞吐量，以及所有设备一起运行时的总吞吐量和扩展效率
+@ （总吞吐量 / 各设备单独吞吐量之和）。
+@ 数据通过共享虚拟内存（OpenCL 2.0 的 coarse-grain SVM）或者 pinned 内存
+@ （CL_MEM_ALLOC_HOST_PTR 映射得到的主机内存）传输。
 */
-cl_context CreateContext(cl_device_id* device) {
-	cl_int errNum;
-	cl_uint numPlateforms;
-	cl_platform_id  *platformIds;
-	cl_platform_id firstPlatformId;
-	cl_context context = NULL;
+const size_t DEFAULT_ARRAY_SIZE = 1 << 24;
+const size_t VECTOR_ALIGN = 8;          // 每段的元素个数是 float8 的整数倍
+const size_t ITEMS_PER_WORK_ITEM = 4;   // float4/float8 版本每个 work-item 处理的向量个数
+const int REPEAT = 5;                   // 重复次数，取最快的一次
+const int MAX_DEVICES = 32;
 
-	errNum = clGetPlatformIDs(0, NULL, &numPlateforms);
-	printf("number of platform: %d\n", numPlateforms);
-	platformIds = (cl_platform_id*)alloca(sizeof(cl_platform_id) * numPlateforms);
+const int KERNEL_COUNT = 3;
+const char* kernelNames[KERNEL_COUNT] = { "vector_add", "vector_add4", "vector_add8" };
+const size_t kernelWidth[KERNEL_COUNT] = { 1, 4, 8 };
 
+enum TransferMode { TRANSFER_AUTO, TRANSFER_PINNED, TRANSFER_SVM };
 
-	//errNum = clGetPlatformIDs(1, platformIds, &numPlateforms);
-	errNum = clGetPlatformIDs(numPlateforms, platformIds, NULL);
-	firstPlatformId = platformIds[1];
+struct DeviceState {
+	cl_device_id device;
+	cl_context context;
+	cl_command_queue commandQueue;
+	cl_program program;
+	cl_kernel kernels[KERNEL_COUNT];
+	char name[128];
+	bool useSVM;
+	cl_mem memObjects[3];   // 设备上的 a, b, result（pinned 模式）
+	cl_mem pinned[3];       // CL_MEM_ALLOC_HOST_PTR 的中转缓冲区（pinned 模式）
+	float* host[3];         // 映射得到的 pinned 指针，或者 SVM 指针
+	size_t offset;          // 该设备负责的一段 [offset, offset + count)
+	size_t count;
+	double alone[KERNEL_COUNT];   // 单独运行时的吞吐量, GB/s
+};
 
-	{
-		displayDeviceInfo(platformIds[0], CL_DEVICE_TYPE_ALL);
-		displayDeviceInfo(platformIds[1], CL_DEVICE_TYPE_ALL);
-	}
+double WallTime() {
+#ifdef _WIN32
+	LARGE_INTEGER frequency, counter;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (double)counter.QuadPart / frequency.QuadPart;
+#else
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + 1e-9 * t.tv_nsec;
+#endif
+}
 
+/* 设备支持的 OpenCL 主版本号（"OpenCL <major>.<minor> ..."） */
+int DeviceMajorVersion(cl_device_id device) {
+	char version[128] = "";
+	int major = 1, minor = 0;
+	clGetDeviceInfo(device, CL_DEVICE_VERSION, sizeof(version), version, NULL);
+	sscanf(version, "OpenCL %d.%d", &major, &minor);
+	return major;
+}
+
+bool DeviceSupportsSVM(cl_device_id device) {
+#ifdef CL_VERSION_2_0
+	cl_device_svm_capabilities caps = 0;
+	if (DeviceMajorVersion(device) < 2) return false;
+	if (clGetDeviceInfo(device, CL_DEVICE_SVM_CAPABILITIES, sizeof(caps), &caps, NULL) != CL_SUCCESS) return false;
+	return (caps & CL_DEVICE_SVM_COARSE_GRAIN_BUFFER) != 0;
+#else
+	return false;
+#endif
+}
+
+/*
+@ 收集所有平台上的所有设备
+*/
+int GetAllDevices(cl_device_id* devices, int maxDevices) {
+	cl_int errNum;
+	cl_uint numPlateforms = 0;
+	cl_platform_id  *platformIds;
+	int count = 0;
+
+	errNum = clGetPlatformIDs(0, NULL, &numPlateforms);
 	if (errNum != CL_SUCCESS || numPlateforms <= 0) {
 		printf("Failed to find any OpenCL platforms.\n");
-		return NULL;
+		return 0;
 	}
-	errNum = clGetDeviceIDs(firstPlatformId, CL_DEVICE_TYPE_GPU, 1, device, NULL);
-	if (errNum != CL_SUCCESS) {
-		printf("There is no GPU , trying CPU...\n");
-		errNum = clGetDeviceIDs(firstPlatformId, CL_DEVICE_TYPE_CPU, 1, device, NULL);
+	printf("number of platform: %d\n", numPlateforms);
+	platformIds = (cl_platform_id*)alloca(sizeof(cl_platform_id) * numPlateforms);
+	clGetPlatformIDs(numPlateforms, platformIds, NULL);
 
-	}
-	 
-	if (errNum != CL_SUCCESS) {
-		printf("There is NO CPU or GPU\n");
-		return NULL;
-	}
+	for (cl_uint p = 0; p < numPlateforms; p++) {
+		char platformName[128] = "";
+		cl_uint numOfDevices = 0;
+		clGetPlatformInfo(platformIds[p], CL_PLATFORM_NAME, sizeof(platformName), platformName, NULL);
+		printf("\nPlatform %d: %s\n", p, platformName);
 
+		if (clGetDeviceIDs(platformIds[p], CL_DEVICE_TYPE_ALL, 0, NULL, &numOfDevices) != CL_SUCCESS || numOfDevices == 0) {
+			printf("\tno devices\n");
+			continue;
+		}
+		displayDeviceInfo(platformIds[p], CL_DEVICE_TYPE_ALL);
 
-	context = clCreateContext(NULL, 1, device, NULL, NULL, &errNum);
-	if (errNum != CL_SUCCESS) {
-		printf("Create context error\n");
-		return NULL;
+		if (numOfDevices > (cl_uint)(maxDevices - count)) numOfDevices = maxDevices - count;
+		clGetDeviceIDs(platformIds[p], CL_DEVICE_TYPE_ALL, numOfDevices, devices + count, NULL);
+		count += numOfDevices;
 	}
-	return context;
+	return count;
 }
+
 /*
-@ 在上下文可用的第一个设备中创建命令队列
+@ 创建带 profiling 的命令队列；OpenCL 1.x 的设备没有 clCreateCommandQueueWithProperties
 */
-
 cl_command_queue CreateCommandQueue(cl_context context, cl_device_id device) {
 	cl_int errNum;
 	cl_command_queue commandQueue = NULL;
-	//commandQueue = clCreateCommandQueue(context, device, 0, NULL);
-	// OpenCL 2.0 的用法
-	commandQueue = clCreateCommandQueueWithProperties(context, device, 0, NULL);
+#ifdef CL_VERSION_2_0
+	if (DeviceMajorVersion(device) >= 2) {
+		// OpenCL 2.0 的用法
+		cl_queue_properties properties[] = { CL_QUEUE_PROPERTIES, CL_QUEUE_PROFILING_ENABLE, 0 };
+		commandQueue = clCreateCommandQueueWithProperties(context, device, properties, &errNum);
+	}
+	else
+#endif
+		commandQueue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &errNum);
 	if (commandQueue == NULL) {
-		printf("Failed to create commandQueue for device 0\n");
+		printf("Failed to create commandQueue\n");
 		return NULL;
 	}
 	return commandQueue;
@@ -250,19 +317,23 @@ char* ReadKernelSourceFile(const char* filename, size_t* length) {
 
 
 }
-cl_program CreateProgram(cl_context context, cl_device_id device, const char* filename) {
+cl_program CreateProgram(cl_context context, cl_device_id device, const char* filename, const char* options) {
 	cl_int errNum;
 	cl_program program;
 	//记录大小的数据类型
 	size_t program_length;
 	char* const source = ReadKernelSourceFile(filename, &program_length);
+	if (source == NULL) {
+		return NULL;
+	}
 	program = clCreateProgramWithSource(context, 1, (const char**)& source, NULL, NULL);
+	free(source);
 
 	if (program == NULL) {
 		printf("Failed to creae CL program from source.\n");
 		return NULL;
 	}
-	errNum = clBuildProgram(program, 0, NULL, NULL, NULL, NULL);
+	errNum = clBuildProgram(program, 1, &device, options, NULL, NULL);
 	if (errNum != CL_SUCCESS) {
 		char buildLog[16384];
 		clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, sizeof(buildLog), buildLog, NULL);
@@ -273,119 +344,386 @@ cl_program CreateProgram(cl_context context, cl_device_id device, const char* fi
 	return program;
 }
 /*
-@ 创建内存对象
+@ 创建内存对象：SVM 模式下直接分配共享虚拟内存；
+@ pinned 模式下分配设备缓冲区和 ALLOC_HOST_PTR 中转缓冲区，并把中转缓冲区一直映射着
+*/
+bool  CreateMemObjects(DeviceState* d, size_t arraySize) {
+	cl_int errNum;
+	size_t bytes = sizeof(float) * arraySize;
+#ifdef CL_VERSION_2_0
+	if (d->useSVM) {
+		for (int i = 0; i < 3; i++) {
+			d->host[i] = (float*)clSVMAlloc(d->context, CL_MEM_READ_WRITE, bytes, 0);
+			if (d->host[i] == NULL) {
+				printf("Error allocating shared virtual memory.\n");
+				return false;
+			}
+		}
+		return true;
+	}
+#endif
+	d->memObjects[0] = clCreateBuffer(d->context, CL_MEM_READ_ONLY, bytes, NULL, NULL);
+	d->memObjects[1] = clCreateBuffer(d->context, CL_MEM_READ_ONLY, bytes, NULL, NULL);
+	d->memObjects[2] = clCreateBuffer(d->context, CL_MEM_WRITE_ONLY, bytes, NULL, NULL);
+	for (int i = 0; i < 3; i++) {
+		d->pinned[i] = clCreateBuffer(d->context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, bytes, NULL, NULL);
+		if (d->memObjects[i] == NULL || d->pinned[i] == NULL) {
+			printf("Error creating memeory objects.\n");
+			return false;
+		}
+		d->host[i] = (float*)clEnqueueMapBuffer(d->commandQueue, d->pinned[i], CL_TRUE, CL_MAP_READ | CL_MAP_WRITE,
+			0, bytes, 0, NULL, NULL, &errNum);
+		if (errNum != CL_SUCCESS) {
+			printf("Error mapping pinned memory.\n");
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+@ 为设备创建上下文、命令队列、程序、内核和内存对象
 */
-bool  CreateMemObjects(cl_context context, cl_mem memObjects[3], float* a, float* b) {
-	memObjects[0] = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(float) * ARRAY_SIZE, a, NULL);
-	memObjects[1] = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(float) * ARRAY_SIZE, b, NULL);
-	memObjects[2] = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(float) * ARRAY_SIZE, NULL, NULL);
-	if (memObjects[0] == NULL || memObjects[1] == NULL || memObjects[2] == NULL) {
-		printf("Error creating memeory objects.\n");
+bool SetupDevice(DeviceState* d, cl_device_id device, TransferMode mode, size_t arraySize) {
+	cl_int errNum;
+	memset(d, 0, sizeof(*d));
+	d->device = device;
+	clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(d->name), d->name, NULL);
+	d->useSVM = mode != TRANSFER_PINNED && DeviceSupportsSVM(device);
+	if (mode == TRANSFER_SVM && !d->useSVM) {
+		printf("%s: no shared virtual memory, using pinned transfers\n", d->name);
+	}
+
+	d->context = clCreateContext(NULL, 1, &device, NULL, NULL, &errNum);
+	if (errNum != CL_SUCCESS) {
+		printf("Create context error\n");
+		return false;
+	}
+	d->commandQueue = CreateCommandQueue(d->context, device);
+	if (d->commandQueue == NULL) {
+		return false;
+	}
+	//SVM 指针作为内核参数需要 OpenCL 2.0 的内核
+	d->program = CreateProgram(d->context, device, "vecAdd.cl", d->useSVM ? "-cl-std=CL2.0" : NULL);
+	if (d->program == NULL) {
 		return false;
+	}
+	for (int k = 0; k < KERNEL_COUNT; k++) {
+		d->kernels[k] = clCreateKernel(d->program, kernelNames[k], NULL);
+		if (d->kernels[k] == NULL) {
+			printf("Failed to create kernel %s\n", kernelNames[k]);
+			return false;
+		}
+	}
+	return CreateMemObjects(d, arraySize);
+}
 
+/*
+@ 写入输入数据：a[i] = i, b[i] = 2i（i 为整个向量中的下标），不计时
+*/
+bool FillInputs(DeviceState* d) {
+	size_t bytes = sizeof(float) * d->count;
+	if (d->count == 0) return true;
+#ifdef CL_VERSION_2_0
+	if (d->useSVM) {
+		if (clEnqueueSVMMap(d->commandQueue, CL_TRUE, CL_MAP_WRITE, d->host[0], bytes, 0, NULL, NULL) != CL_SUCCESS ||
+			clEnqueueSVMMap(d->commandQueue, CL_TRUE, CL_MAP_WRITE, d->host[1], bytes, 0, NULL, NULL) != CL_SUCCESS) {
+			printf("Error mapping shared virtual memory.\n");
+			return false;
+		}
 	}
-	return true;
+#endif
+	for (size_t i = 0; i < d->count; i++) {
+		d->host[0][i] = (float)(d->offset + i);
+		d->host[1][i] = (float)(2 * (d->offset + i));
+	}
+#ifdef CL_VERSION_2_0
+	if (d->useSVM) {
+		clEnqueueSVMUnmap(d->commandQueue, d->host[0], 0, NULL, NULL);
+		clEnqueueSVMUnmap(d->commandQueue, d->host[1], 0, NULL, NULL);
+	}
+#endif
+	return clFinish(d->commandQueue) == CL_SUCCESS;
+}
+
+/*
+@ 把该设备负责的一段放入队列：pinned 模式下 写入 -> 内核 -> 读回，都不阻塞
+*/
+bool EnqueueVectorAdd(DeviceState* d, int k) {
+	cl_int errNum = CL_SUCCESS;
+	cl_kernel kernel = d->kernels[k];
+	size_t bytes = sizeof(float) * d->count;
+	cl_uint n = (cl_uint)(d->count / kernelWidth[k]);
+	size_t globalWorkSize[1] = { d->count };
+
+	if (d->count == 0) return true;
+	if (k > 0) {
+		globalWorkSize[0] = (n + ITEMS_PER_WORK_ITEM - 1) / ITEMS_PER_WORK_ITEM;
+		errNum |= clSetKernelArg(kernel, 3, sizeof(cl_uint), &n);
+	}
+#ifdef CL_VERSION_2_0
+	if (d->useSVM) {
+		for (cl_uint i = 0; i < 3; i++) {
+			errNum |= clSetKernelArgSVMPointer(kernel, i, d->host[i]);
+		}
+	}
+	else
+#endif
+	{
+		errNum |= clEnqueueWriteBuffer(d->commandQueue, d->memObjects[0], CL_FALSE, 0, bytes, d->host[0], 0, NULL, NULL);
+		errNum |= clEnqueueWriteBuffer(d->commandQueue, d->memObjects[1], CL_FALSE, 0, bytes, d->host[1], 0, NULL, NULL);
+		for (cl_uint i = 0; i < 3; i++) {
+			errNum |= clSetKernelArg(kernel, i, sizeof(cl_mem), &d->memObjects[i]);
+		}
+	}
+	if (errNum != CL_SUCCESS) {
+		printf("Error setting kernel arguments.\n");
+		return false;
+	}
+	//执行内核，work-group 大小交给运行时决定
+	errNum = clEnqueueNDRangeKernel(d->commandQueue, kernel, 1, NULL, globalWorkSize, NULL, 0, NULL, NULL);
+	if (errNum != CL_SUCCESS) {
+		printf("Error queueing kernel for execution\n");
+		return false;
+	}
+	if (!d->useSVM) {
+		//将计算的结果拷贝到主机上
+		errNum = clEnqueueReadBuffer(d->commandQueue, d->memObjects[2], CL_FALSE, 0, bytes, d->host[2], 0, NULL, NULL);
+		if (errNum != CL_SUCCESS) {
+			printf("Error reading result buffer.\n");
+			return false;
+		}
+	}
+	return clFlush(d->commandQueue) == CL_SUCCESS;
+}
+
+/*
+@ 检查结果，返回出错的元素个数
+*/
+size_t VerifyResult(DeviceState* d) {
+	size_t errors = 0;
+	if (d->count == 0) return 0;
+#ifdef CL_VERSION_2_0
+	if (d->useSVM) {
+		clEnqueueSVMMap(d->commandQueue, CL_TRUE, CL_MAP_READ, d->host[2], sizeof(float) * d->count, 0, NULL, NULL);
+	}
+#endif
+	for (size_t i = 0; i < d->count; i++) {
+		float expected = (float)(d->offset + i) + (float)(2 * (d->offset + i));
+		if (d->host[2][i] != expected) errors++;
+	}
+#ifdef CL_VERSION_2_0
+	if (d->useSVM) {
+		clEnqueueSVMUnmap(d->commandQueue, d->host[2], 0, NULL, NULL);
+		clFinish(d->commandQueue);
+	}
+#endif
+	return errors;
 }
+
+/*
+@ 所有设备同时运行 REPEAT 次，返回最快一次的时间（秒），出错时返回 0
+*/
+double RunDevices(DeviceState* devices, int numDevices, int k) {
+	double best = 0;
+	for (int r = 0; r < REPEAT; r++) {
+		double start = WallTime();
+		for (int i = 0; i < numDevices; i++) {
+			if (!EnqueueVectorAdd(&devices[i], k)) return 0;
+		}
+		for (int i = 0; i < numDevices; i++) {
+			if (clFinish(devices[i].commandQueue) != CL_SUCCESS) return 0;
+		}
+		double time = WallTime() - start;
+		if (r == 0 || time < best) best = time;
+	}
+	return best;
+}
+
+/*
+@ 按各设备单独运行时的吞吐量切分向量，每段是 VECTOR_ALIGN 的整数倍
+*/
+void SplitVector(DeviceState* devices, int numDevices, size_t arraySize, int k) {
+	double total = 0;
+	size_t offset = 0;
+	for (int i = 0; i < numDevices; i++) {
+		total += devices[i].alone[k];
+	}
+	for (int i = 0; i < numDevices; i++) {
+		size_t count = 0;
+		if (i == numDevices - 1) {
+			count = arraySize - offset;
+		}
+		else if (total > 0) {
+			count = (size_t)(arraySize * (devices[i].alone[k] / total)) / VECTOR_ALIGN * VECTOR_ALIGN;
+		}
+		devices[i].offset = offset;
+		devices[i].count = count;
+		offset += count;
+	}
+}
+
 /*
 @ 清楚OpenCL资源
 */
-void CleanUp(cl_context context, cl_command_queue commandQueue, cl_program program, cl_kernel kernel, cl_mem memObjects[3]) {
+void CleanUp(DeviceState* d) {
 	for (int i = 0; i < 3; i++) {
-		if (memObjects[i] != 0) {
-			clReleaseMemObject(memObjects[i]);
+#ifdef CL_VERSION_2_0
+		if (d->useSVM && d->host[i] != NULL) {
+			clSVMFree(d->context, d->host[i]);
+		}
+#endif
+		if (d->pinned[i] != 0) {
+			if (d->host[i] != NULL) {
+				clEnqueueUnmapMemObject(d->commandQueue, d->pinned[i], d->host[i], 0, NULL, NULL);
+			}
+			clReleaseMemObject(d->pinned[i]);
+		}
+		if (d->memObjects[i] != 0) {
+			clReleaseMemObject(d->memObjects[i]);
 		}
 	}
-
-	if (commandQueue != 0) {
-		clReleaseCommandQueue(commandQueue);
+	if (d->commandQueue != 0) {
+		clFinish(d->commandQueue);
+		clReleaseCommandQueue(d->commandQueue);
 	}
-	if (kernel != 0) {
-		clReleaseKernel(kernel);
+	for (int k = 0; k < KERNEL_COUNT; k++) {
+		if (d->kernels[k] != 0) {
+			clReleaseKernel(d->kernels[k]);
+		}
 	}
-	if (program != 0) {
-		clReleaseProgram(program);
+	if (d->program != 0) {
+		clReleaseProgram(d->program);
 	}
-	if (context != 0) {
-		clReleaseContext(context);
+	if (d->context != 0) {
+		clReleaseContext(d->context);
 	}
 }
 
-/*main函数*/
+/*main函数
+@ 用法: opencl_test2 [-n 元素个数] [--pinned | --svm]
+*/
 int main(int argc, char** agrv) {
-	cl_context context = 0;
-	cl_command_queue commandQueue = 0;
-	cl_program program = 0;
-	cl_device_id device = 0;
-	cl_kernel kernel = 0;
-	cl_mem memObjects[3] = { 0,0,0 };
-	cl_int errNum;
-	//创建OpenCL上下文
-	context = CreateContext(&device);
-	if (context == NULL) {
-		printf("Failed to create OpenCL context\n");
-		return 1;
+	cl_device_id deviceIds[MAX_DEVICES];
+	DeviceState devices[MAX_DEVICES];
+	int numDevices = 0;
+	size_t arraySize = DEFAULT_ARRAY_SIZE;
+	TransferMode mode = TRANSFER_AUTO;
+	int status = 0;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(agrv[i], "-n") == 0 && i + 1 < argc) {
+			arraySize = (size_t)strtoull(agrv[++i], NULL, 10);
+		}
+		else if (strcmp(agrv[i], "--pinned") == 0) {
+			mode = TRANSFER_PINNED;
+		}
+		else if (strcmp(agrv[i], "--svm") == 0) {
+			mode = TRANSFER_SVM;
+		}
+		else {
+			printf("Usage: %s [-n elements] [--pinned | --svm]\n", agrv[0]);
+			return 1;
+		}
 	}
-	//获得OpenCL设备，并创建命令队列
-	commandQueue = CreateCommandQueue(context, device);
-	if (commandQueue == NULL) {
-		CleanUp(context, commandQueue, program, kernel, memObjects);
+
+	int numIds = GetAllDevices(deviceIds, MAX_DEVICES);
+	if (numIds == 0) {
+		printf("Failed to find any OpenCL device\n");
 		return 1;
 	}
-	//创建OpenCL程序
-	program = CreateProgram(context, device, "vecAdd.cl");
-	if (program == NULL) {
-		CleanUp(context, commandQueue, program, kernel, memObjects);
-		return 1;
+
+	//每个设备都要能放下整个向量
+	for (int i = 0; i < numIds; i++) {
+		cl_ulong maxAlloc = 0;
+		clGetDeviceInfo(deviceIds[i], CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(maxAlloc), &maxAlloc, NULL);
+		if (arraySize > maxAlloc / sizeof(float)) arraySize = (size_t)(maxAlloc / sizeof(float));
 	}
-	kernel = clCreateKernel(program, "vector_add", NULL);
-	if (kernel == NULL) {
-		printf("Failed to create kernel\n");
-		CleanUp(context, commandQueue, program, kernel, memObjects);
+	arraySize = arraySize / VECTOR_ALIGN * VECTOR_ALIGN;
+	if (arraySize == 0) {
+		printf("Vector is too small\n");
 		return 1;
-
 	}
-	//创建OpenCL内存对象
-	float result[ARRAY_SIZE];
-	float a[ARRAY_SIZE];
-	float b[ARRAY_SIZE];
-	for (int i = 0; i < ARRAY_SIZE; i++) {
-		a[i] = (float)i;
-		b[i] = (float)(i * 2);
+	printf("\nVector size: %lu floats (%lu mega-bytes per array)\n",
+		(unsigned long)arraySize, (unsigned long)((arraySize * sizeof(float)) >> 20));
+
+	//创建每个设备的 OpenCL 资源，失败的设备不参加测试
+	for (int i = 0; i < numIds; i++) {
+		if (SetupDevice(&devices[numDevices], deviceIds[i], mode, arraySize)) {
+			printf("Device %d: %s (%s transfers)\n", numDevices, devices[numDevices].name,
+				devices[numDevices].useSVM ? "SVM" : "pinned");
+			numDevices++;
+		}
+		else {
+			printf("Skipping device %d\n", i);
+			CleanUp(&devices[numDevices]);
+		}
 	}
-	if (!CreateMemObjects(context, memObjects, a, b)) {
-		CleanUp(context, commandQueue, program, kernel, memObjects);
+	if (numDevices == 0) {
+		printf("Failed to create OpenCL context\n");
 		return 1;
 	}
-	//设置内核参数
-	errNum = clSetKernelArg(kernel, 0, sizeof(cl_mem), &memObjects[0]);
-	errNum |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &memObjects[1]);
-	errNum |= clSetKernelArg(kernel, 2, sizeof(cl_mem), &memObjects[2]);
 
-	if (errNum != CL_SUCCESS) {
-		printf("Error setting kernel arguments.\n");
-		CleanUp(context, commandQueue, program, kernel, memObjects);
-		return 1;
+	//每次 a + b = result 读写 3 个数组
+	double bytes = 3.0 * sizeof(float) * arraySize;
+
+	for (int k = 0; k < KERNEL_COUNT; k++) {
+		double sum = 0, fastest = 0;
+		printf("\n%s\n", kernelNames[k]);
+		printf("\t%-40s %12s %12s %10s\n", "device", "alone GB/s", "elements", "share");
+
+		//每个设备单独处理整个向量
+		for (int i = 0; i < numDevices; i++) {
+			DeviceState* d = &devices[i];
+			d->offset = 0;
+			d->count = arraySize;
+			d->alone[k] = 0;
+			if (!FillInputs(d)) continue;
+			double time = RunDevices(d, 1, k);
+			size_t errors = VerifyResult(d);
+			if (time > 0 && errors == 0) {
+				d->alone[k] = bytes / time * 1e-9;
+			}
+			else if (errors) {
+				printf("\t%s: %lu wrong results\n", d->name, (unsigned long)errors);
+				status = 1;
+			}
+			sum += d->alone[k];
+			if (d->alone[k] > fastest) fastest = d->alone[k];
+		}
+		if (sum == 0) {
+			printf("\tno device completed %s\n", kernelNames[k]);
+			status = 1;
+			continue;
+		}
+
+		//所有设备一起处理，按吞吐量切分
+		SplitVector(devices, numDevices, arraySize, k);
+		for (int i = 0; i < numDevices; i++) {
+			FillInputs(&devices[i]);
+		}
+		double time = RunDevices(devices, numDevices, k);
+		size_t errors = 0;
+		for (int i = 0; i < numDevices; i++) {
+			errors += VerifyResult(&devices[i]);
+			printf("\t%-40s %12.2f %12lu %9.1f%%\n", devices[i].name, devices[i].alone[k],
+				(unsigned long)devices[i].count, 100.0 * devices[i].count / arraySize);
+		}
+		if (time == 0 || errors) {
+			printf("\tall devices: %lu wrong results\n", (unsigned long)errors);
+			status = 1;
+			continue;
+		}
+		double aggregate = bytes / time * 1e-9;
+		printf("\taggregate: %.2f GB/s, sum of devices: %.2f GB/s, scaling efficiency: %.1f%%, speedup over fastest device: %.2fx\n",
+			aggregate, sum, 100.0 * aggregate / sum, aggregate / fastest);
 	}
-	size_t globalWorkSize[1] = { ARRAY_SIZE };
-	size_t localWorkSize[1] = { 1 };
-	//执行内核
-	errNum = clEnqueueNDRangeKernel(commandQueue, kernel, 1, NULL, globalWorkSize, localWorkSize, 0, NULL, NULL);
-	if (errNum != CL_SUCCESS) {
-		printf("Error queueing kernel for execution\n");
-		CleanUp(context, commandQueue, program, kernel, memObjects);
-		return 1;
+
+	if (status == 0) {
+		printf("\nExecuted program succesfully\n");
 	}
-	//将计算的结果拷贝到主机上
-	errNum = clEnqueueReadBuffer(commandQueue, memObjects[2], CL_TRUE, 0, ARRAY_SIZE * sizeof(float), result, 0, NULL, NULL);
-	if (errNum != CL_SUCCESS) {
-		printf("Error reading result buffer.\n");
-		CleanUp(context, commandQueue, program, kernel, memObjects);
-		return 1;
+	for (int i = 0; i < numDevices; i++) {
+		CleanUp(&devices[i]);
 	}
-	//for (int i = 0; i < ARRAY_SIZE; i++) {
-	//	printf("i=%d:%f\n", i, result[i]);
-	//}
-	printf("Executed program succesfully\n");
-	CleanUp(context, commandQueue, program, kernel, memObjects);
-	return 0;
+	return status;
 }
\ No newline at end of file
@@ -1,4 +1,20 @@
 __kernel void vector_add(global const float *a, global const float *b, global float * result) {
 	int gid = get_global_id(0);
 	result[gid] = a[gid] + b[gid];
+}
+
+/*
+@ float4/float8 版本：n 为向量元素个数。每个 work-item 以 global size 为步长
+@ 处理多个元素，相邻的 work-item 访问相邻的地址，保证访存合并
+*/
+__kernel void vector_add4(global const float4 *a, global const float4 *b, global float4 * result, uint n) {
+	for (uint i = get_global_id(0); i < n; i += get_global_size(0)) {
+		result[i] = a[i] + b[i];
+	}
+}
+
+__kernel void vector_add8(global const float8 *a, global const float8 *b, global float8 * result, uint n) {
+	for (uint i = get_global_id(0); i < n; i += get_global_size(0)) {
+		result[i] = a[i] + b[i];
+	}
 }
\ No newline at end of file